@@ -98,6 +98,37 @@
 
 FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
 
+extern CConfigSection *g_pBuildingBlocksConfig;
+
+// This is the most blocks we will keep for one file stream. It also
+// bounds how many blocks one read may fetch when the stream is read
+// sequentially.
+static const char g_FileStreamBuffersValueName[] = "File Stream Buffers";
+#define DEFAULT_FILE_STREAM_BUFFERS   8
+
+extern CJobQueue *g_MainJobQueue;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This syncs a durable stream to disk after its flush writes finish, and
+// then reports the flush. It runs as its own job so the sync does not hold
+// up the thread that reported the last write, or the stream lock.
+class CDurableFlushJob : public CRefCountImpl,
+                            public CJob {
+public:
+    CDurableFlushJob();
+    virtual ~CDurableFlushJob();
+    NEWEX_IMPL()
+
+    virtual void ProcessJob(CSimpleThread *pThreadState);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    CAsyncIOStream      *m_pStream;
+    CAsyncBlockIO       *m_pBlockIO;
+}; // CDurableFlushJob
+
 
 
 
@@ -112,6 +143,12 @@ FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
 CAsyncIOStream::CAsyncIOStream() {
     m_AsyncIOStreamFlags = 0;
     m_pLock = NULL;
+    m_CursorDepth = 0;
+    m_CursorOwner = 0;
+    m_pCursorBuffer = NULL;
+    m_pCursorFirstByte = NULL;
+    m_pCursorNextByte = NULL;
+    m_pCursorEndBytes = NULL;
 
     m_pBlockIO = NULL;
     m_pIOSystem = NULL;
@@ -132,6 +169,8 @@ CAsyncIOStream::CAsyncIOStream() {
 
     m_IOBufferList.ResetQueue();
     m_MaxNumIOBuffersForSeekableDevices = 1;
+    m_SequentialReadBlocks = 0;
+    m_NextSequentialReadPosition = -1;
 
     m_AsynchLoadType = NOT_LOADING;
     m_NextAsynchBufferPosition = 0;
@@ -282,6 +321,8 @@ CAsyncIOStream::StartOpenCommand(
     m_OutputBufferList.ResetQueue();
 
     m_MaxNumIOBuffersForSeekableDevices = 1;
+    m_SequentialReadBlocks = 0;
+    m_NextSequentialReadPosition = -1;
     m_TotalAvailableBytes = 0;
 
 abort:
@@ -326,6 +367,27 @@ CAsyncIOStream::FinishOpenCommand() {
         gotoErr(EFail);
     }
 
+    // Files may keep several blocks, so a sequential reader can pull in
+    // more than one block with each read.
+    if ((CAsyncBlockIO::FILE_MEDIA == m_pBlockIO->m_MediaType)
+        && (m_pBlockIO->m_fSeekable)) {
+        m_MaxNumIOBuffersForSeekableDevices = DEFAULT_FILE_STREAM_BUFFERS;
+        if (NULL != g_pBuildingBlocksConfig) {
+            m_MaxNumIOBuffersForSeekableDevices = g_pBuildingBlocksConfig->GetInt(
+                                                        g_FileStreamBuffersValueName,
+                                                        DEFAULT_FILE_STREAM_BUFFERS);
+        }
+        if (m_MaxNumIOBuffersForSeekableDevices < 1) {
+            m_MaxNumIOBuffersForSeekableDevices = 1;
+        }
+
+        // A file opened without WRITE_ACCESS cannot be changed, so this
+        // stream may share blocks from the file block cache.
+        if (!(m_pBlockIO->m_BlockIOFlags & CAsyncBlockIO::WRITE_ACCESS)) {
+            m_AsyncIOStreamFlags |= READ_ONLY_STREAM;
+        }
+    }
+
     // If this is a memory blockIO, then make one buffer entry that
     // references the contents of the blockIO.
     if ((NULL != m_pBlockIO->m_pUrl)
@@ -351,42 +413,84 @@ CAsyncIOStream::FinishOpenCommand() {
 
         DEBUG_LOG_VERBOSE("CAsyncIOStream::FinishOpenCommand. Memory stream. numValidBytes = %d", numValidBytes);
         if (numValidBytes > 0) {
-            m_pActiveIOBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, false);
-            if (NULL == m_pActiveIOBuffer) {
-                gotoErr(EFail);
+            err = UseDataInPlace(pBuffer, bufferLength, numValidBytes);
+            if (err) {
+                gotoErr(err);
             }
+        } // (numValidBytes > 0)
+    } // (CParsedUrl::URL_SCHEME_MEMORY == m_pUrl->m_Scheme)
 
-            m_pActiveIOBuffer->m_BufferOp = CIOBuffer::NO_OP;
-            m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
-            m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::INPUT_BUFFER;
-            m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::OUTPUT_BUFFER;
-            m_pActiveIOBuffer->m_Err = ENoErr;
+    // A mapped file is one buffer that covers the whole file. We never
+    // read anything into buffers of our own.
+    if ((CAsyncBlockIO::MAPPED_FILE_MEDIA == m_pBlockIO->m_MediaType)
+        && (NULL != m_pBlockIO->GetMappedData())) {
+        DEBUG_LOG_VERBOSE("CAsyncIOStream::FinishOpenCommand. Mapped file. size = " INT64FMT,
+                    m_TotalAvailableBytes);
+        err = UseDataInPlace(
+                    m_pBlockIO->GetMappedData(),
+                    (int32) m_TotalAvailableBytes,
+                    (int32) m_TotalAvailableBytes);
+        if (err) {
+            gotoErr(err);
+        }
+        m_AsyncIOStreamFlags |= ALL_DATA_IS_IN_BUFFERS;
+        m_AsyncIOStreamFlags |= READ_ONLY_STREAM;
+    }
 
-            // buffer and bufferSize are initialized by AllocIOBuffer.
-            m_pActiveIOBuffer->m_pPhysicalBuffer = pBuffer;
-            m_pActiveIOBuffer->m_pLogicalBuffer = m_pActiveIOBuffer->m_pPhysicalBuffer;
-            m_pActiveIOBuffer->m_BufferSize = numValidBytes;
-            m_pActiveIOBuffer->m_NumValidBytes = numValidBytes;
+abort:
+    returnErr(err);
+} // FinishOpenCommand.
 
-            m_pActiveIOBuffer->m_PosInMedia = 0;
 
-            // The buffer was AddRef'ed by AllocIOBuffer.
-            // Keep m_IOBufferList in LRU order. New buffers are the most recently
-            // used, so they are added to the head of the list.
-            m_IOBufferList.InsertHead(&(m_pActiveIOBuffer->m_StreamBufferList));
 
-            m_pFirstValidByte = m_pActiveIOBuffer->m_pLogicalBuffer;
-            m_pNextValidByte = m_pFirstValidByte;
-            m_pEndValidBytes = m_pActiveIOBuffer->m_pLogicalBuffer + numValidBytes;
-            m_pLastPossibleValidByte = m_pActiveIOBuffer->m_pPhysicalBuffer + bufferLength;
 
-            m_TotalAvailableBytes = numValidBytes;
-        } // (numValidBytes > 0)
-    } // (CParsedUrl::URL_SCHEME_MEMORY == m_pUrl->m_Scheme)
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UseDataInPlace]
+//
+// This makes one buffer that points at data the blockIO already has in
+// memory, so the stream reads it without copying.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::UseDataInPlace(char *pData, int32 bufferLength, int32 numValidBytes) {
+    ErrVal err = ENoErr;
+
+    m_pActiveIOBuffer = m_pIOSystem->AllocIOBuffer(-1, false);
+    if (NULL == m_pActiveIOBuffer) {
+        gotoErr(EFail);
+    }
+
+    m_pActiveIOBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::INPUT_BUFFER;
+    m_pActiveIOBuffer->m_BufferFlags |= CIOBuffer::OUTPUT_BUFFER;
+    m_pActiveIOBuffer->m_Err = ENoErr;
+
+    // buffer and bufferSize are initialized by AllocIOBuffer.
+    m_pActiveIOBuffer->m_pPhysicalBuffer = pData;
+    m_pActiveIOBuffer->m_pLogicalBuffer = m_pActiveIOBuffer->m_pPhysicalBuffer;
+    m_pActiveIOBuffer->m_BufferSize = numValidBytes;
+    m_pActiveIOBuffer->m_NumValidBytes = numValidBytes;
+
+    m_pActiveIOBuffer->m_PosInMedia = 0;
+
+    // The buffer was AddRef'ed by AllocIOBuffer.
+    // Keep m_IOBufferList in LRU order. New buffers are the most recently
+    // used, so they are added to the head of the list.
+    m_IOBufferList.InsertHead(&(m_pActiveIOBuffer->m_StreamBufferList));
+
+    m_pFirstValidByte = m_pActiveIOBuffer->m_pLogicalBuffer;
+    m_pNextValidByte = m_pFirstValidByte;
+    m_pEndValidBytes = m_pActiveIOBuffer->m_pLogicalBuffer + numValidBytes;
+    m_pLastPossibleValidByte = m_pActiveIOBuffer->m_pPhysicalBuffer + bufferLength;
+
+    m_TotalAvailableBytes = numValidBytes;
 
 abort:
     returnErr(err);
-} // FinishOpenCommand.
+} // UseDataInPlace.
 
 
 
@@ -409,6 +513,14 @@ CAsyncIOStream::Close() {
     { /////////////////////////////////////////////////
         AutoLock(m_pLock);
 
+        // A cursor that is still checked out loses its window.
+        RELEASE_OBJECT(m_pCursorBuffer);
+        m_pCursorFirstByte = NULL;
+        m_pCursorNextByte = NULL;
+        m_pCursorEndBytes = NULL;
+        m_CursorDepth = 0;
+        m_CursorOwner = 0;
+
         // Remove all buffers.
         m_pActiveIOBuffer = NULL;
         m_pFirstValidByte = NULL;
@@ -418,6 +530,8 @@ CAsyncIOStream::Close() {
 
         m_AsyncIOStreamFlags = 0;
         m_MaxNumIOBuffersForSeekableDevices = 1;
+        m_SequentialReadBlocks = 0;
+        m_NextSequentialReadPosition = -1;
         m_AsynchLoadType = NOT_LOADING;
 
         m_pActiveOutputIOBuffer = NULL;
@@ -479,6 +593,171 @@ CAsyncIOStream::GetLock() {
 
 
 
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckOutCursor]
+//
+// This records the calling thread as the owner of the read position and
+// opens a window on the active buffer. It does not keep the lock; the byte
+// methods only take it again when the owner reaches the edge of the window.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::CheckOutCursor() {
+    if (NULL == m_pLock) {
+        return(EFail);
+    }
+
+    AutoLock(m_pLock);
+
+    if ((0 != m_CursorOwner) && (!IsCursorOwner())) {
+        return(EFileIsBusy);
+    }
+
+    m_CursorDepth += 1;
+    m_CursorOwner = OSIndependantLayer::GetCurrentThreadId();
+    OpenCursorWindow();
+
+    return(ENoErr);
+} // CheckOutCursor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckInCursor]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::CheckInCursor() {
+    if ((NULL == m_pLock) || (!IsCursorOwner())) {
+        return;
+    }
+
+    AutoLock(m_pLock);
+
+    m_CursorDepth = m_CursorDepth - 1;
+    if (m_CursorDepth <= 0) {
+        SyncCursor();
+        m_CursorDepth = 0;
+        m_CursorOwner = 0;
+    }
+} // CheckInCursor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenCursorWindow]
+//
+// This is called while holding the lock. If the calling thread owns a
+// cursor, then it may read the rest of the active buffer without the lock.
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::OpenCursorWindow() {
+    if ((!IsCursorOwner())
+        || (NULL != m_pCursorBuffer)
+        || (NULL == m_pActiveIOBuffer)
+        || (NULL == m_pFirstValidByte)
+        || (NULL == m_pNextValidByte)
+        || (m_pNextValidByte >= m_pEndValidBytes)) {
+        return;
+    }
+
+    m_pCursorBuffer = m_pActiveIOBuffer;
+    ADDREF_OBJECT(m_pCursorBuffer);
+    m_pCursorFirstByte = m_pFirstValidByte;
+    m_pCursorNextByte = m_pNextValidByte;
+    m_pCursorEndBytes = m_pEndValidBytes;
+} // OpenCursorWindow.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SyncCursor]
+//
+// This is called while holding the lock, before anything reads or moves
+// the read position. It closes the window of the calling thread's cursor
+// and moves the stream to where the owner stopped reading. A completion may
+// have replaced or discarded the active buffer while the window was open,
+// so if the window no longer matches it, then this looks up the position
+// in the buffer list again.
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::SyncCursor() {
+    CIOBuffer *pBuffer;
+    int64 cursorPos;
+
+    if ((NULL == m_pCursorBuffer) || (!IsCursorOwner())) {
+        return;
+    }
+
+    // Close the window first, since SetPosition syncs the cursor too.
+    pBuffer = m_pCursorBuffer;
+    cursorPos = pBuffer->m_PosInMedia + (m_pCursorNextByte - m_pCursorFirstByte);
+    m_pCursorBuffer = NULL;
+
+    if ((pBuffer == m_pActiveIOBuffer)
+        && (m_pFirstValidByte == m_pCursorFirstByte)
+        && (m_pEndValidBytes)
+        && (m_pCursorNextByte <= m_pEndValidBytes)) {
+        m_pNextValidByte = m_pCursorNextByte;
+    } else {
+        (void) SetPosition(cursorPos);
+    }
+
+    m_pCursorFirstByte = NULL;
+    m_pCursorNextByte = NULL;
+    m_pCursorEndBytes = NULL;
+    RELEASE_OBJECT(pBuffer);
+} // SyncCursor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SetEventHandler]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::SetEventHandler(
+                        CAsyncIOEventHandler *pEventHandler,
+                        void *pEventHandlerContext) {
+    CAsyncIOEventHandler *pOldEventHandler = NULL;
+
+    { /////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        if (m_pEventHandler != pEventHandler) {
+            pOldEventHandler = m_pEventHandler;
+            m_pEventHandler = pEventHandler;
+            ADDREF_OBJECT(m_pEventHandler);
+        }
+        m_pEventHandlerContext = pEventHandlerContext;
+    } /////////////////////////////////////////////////
+
+    // The old handler may be the last reference to its owner, so
+    // release it outside the lock.
+    RELEASE_OBJECT(pOldEventHandler);
+} // SetEventHandler.
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [SetPosition]
@@ -496,6 +775,7 @@ CAsyncIOStream::SetPosition(int64 newPos) {
     CIOBuffer *pBuffer;
     bool fFoundBuffer;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE( "CAsyncIOStream::SetPosition. newPos = " INT64FMT, newPos );
@@ -550,6 +830,10 @@ CAsyncIOStream::SetPosition(int64 newPos) {
                 gotoErr(pBuffer->m_Err);
             }
 
+            // The buffer we leave stays in the list, so the stream length
+            // must include anything written to it.
+            UpdateDataLength(m_pActiveIOBuffer);
+
             m_pActiveIOBuffer = pBuffer;
             offset = newPos - m_pActiveIOBuffer->m_PosInMedia;
 
@@ -598,8 +882,33 @@ CAsyncIOStream::SetPosition(int64 newPos) {
         gotoErr(err);
     }
 
+    // A read-only stream shares a block that its device already has in the
+    // block cache, rather than reading a copy of it into its own buffer.
+    if (m_AsyncIOStreamFlags & READ_ONLY_STREAM) {
+        pBuffer = m_pBlockIO->GetSharedBlock(newPos);
+        if (NULL != pBuffer) {
+            DEBUG_LOG_VERBOSE("CAsyncIOStream::SetPosition. Share a cached block");
+            DiscardIdleInputBuffer();
+
+            // The slice was AddRef'ed by GetSharedBlock.
+            pBuffer->m_BufferFlags |= CIOBuffer::INPUT_BUFFER;
+            m_IOBufferList.InsertHead(&(pBuffer->m_StreamBufferList));
+
+            m_pActiveIOBuffer = pBuffer;
+            offset = newPos - m_pActiveIOBuffer->m_PosInMedia;
+
+            m_pFirstValidByte = m_pActiveIOBuffer->m_pLogicalBuffer;
+            m_pNextValidByte = m_pFirstValidByte + offset;
+            m_pEndValidBytes = m_pFirstValidByte + m_pActiveIOBuffer->m_NumValidBytes;
+            m_pLastPossibleValidByte = m_pActiveIOBuffer->m_pPhysicalBuffer + m_pActiveIOBuffer->m_BufferSize;
+            gotoErr(ENoErr);
+        }
+    } // (m_AsyncIOStreamFlags & READ_ONLY_STREAM)
+
     // We will either allocate a new block, or else recycle an existing one.
-    m_pActiveIOBuffer = AllocAsyncIOStreamBuffer(newPos, true);
+    // If the reader is moving sequentially through the media, then this
+    // may be several blocks long.
+    m_pActiveIOBuffer = AllocAsyncIOStreamBuffer(newPos, true, GetSequentialReadSize(newPos));
     if (NULL == m_pActiveIOBuffer) {
         gotoErr(EFail);
     }
@@ -615,6 +924,13 @@ CAsyncIOStream::SetPosition(int64 newPos) {
         m_pBlockIO->ReadBlockAsync(m_pActiveIOBuffer);
     }
 
+    // A synchronous device has already filled the buffer, so put the cursor
+    // on the byte we asked for, not the start of the block.
+    offset = newPos - m_pActiveIOBuffer->m_PosInMedia;
+    if ((offset > 0) && (offset <= (m_pEndValidBytes - m_pFirstValidByte))) {
+        m_pNextValidByte = m_pFirstValidByte + offset;
+    }
+
     // This is seeking to the end of a stream. We do this when we want to start
     // writing at the end. This is not an EOF error.
     if ((EEOF == err) && (newPos == m_TotalAvailableBytes)) {
@@ -643,6 +959,7 @@ abort:
 inline int64
 CAsyncIOStream::GetPosition() {
     AutoLock(m_pLock);
+    SyncCursor();
 
     if ((NULL == m_pActiveIOBuffer)
         || (NULL == m_pNextValidByte)
@@ -836,6 +1153,154 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CIOStreamSpanIterator]
+//
+/////////////////////////////////////////////////////////////////////////////
+CIOStreamSpanIterator::CIOStreamSpanIterator() {
+    m_pStream = NULL;
+    m_pPinnedBuffer = NULL;
+
+    m_SpanPosition = 0;
+    m_NextPosition = 0;
+    m_StopPosition = 0;
+} // CIOStreamSpanIterator.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CIOStreamSpanIterator]
+//
+/////////////////////////////////////////////////////////////////////////////
+CIOStreamSpanIterator::~CIOStreamSpanIterator() {
+    Stop();
+} // ~CIOStreamSpanIterator.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Start]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOStreamSpanIterator::Start(CAsyncIOStream *pStream, int64 startPos, int64 numBytes) {
+    Stop();
+
+    if ((NULL == pStream) || (startPos < 0)) {
+        returnErr(EFail);
+    }
+
+    m_pStream = pStream;
+    ADDREF_OBJECT(m_pStream);
+
+    m_SpanPosition = startPos;
+    m_NextPosition = startPos;
+    if (numBytes < 0) {
+        m_StopPosition = -1;
+    } else {
+        m_StopPosition = startPos + numBytes;
+    }
+
+    returnErr(ENoErr);
+} // Start.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetNextSpan]
+//
+// This returns false when there are no more bytes. A buffer that is
+// already in memory is used as it is. Otherwise, SetPosition reads it.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CIOStreamSpanIterator::GetNextSpan(const char **ppSpan, int32 *pLength) {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = m_pStream;
+    CIOBuffer *pBuffer;
+    int64 offset;
+    int64 length;
+
+    if ((NULL == ppSpan) || (NULL == pLength) || (NULL == pStream)) {
+        return(false);
+    }
+    *ppSpan = NULL;
+    *pLength = 0;
+
+    AutoLock(pStream->m_pLock);
+
+    // The caller is done with the previous span.
+    RELEASE_OBJECT(m_pPinnedBuffer);
+
+    if ((m_StopPosition >= 0) && (m_NextPosition >= m_StopPosition)) {
+        return(false);
+    }
+
+    err = pStream->SetPosition(m_NextPosition);
+    pBuffer = pStream->m_pActiveIOBuffer;
+    if ((err)
+        || (NULL == pBuffer)
+        || (NULL == pStream->m_pFirstValidByte)
+        || (NULL == pStream->m_pEndValidBytes)) {
+        return(false);
+    }
+
+    offset = m_NextPosition - pBuffer->m_PosInMedia;
+    length = (pStream->m_pEndValidBytes - pStream->m_pFirstValidByte) - offset;
+    if ((m_StopPosition >= 0) && (length > (m_StopPosition - m_NextPosition))) {
+        length = m_StopPosition - m_NextPosition;
+    }
+    if ((offset < 0) || (length <= 0)) {
+        return(false);
+    }
+
+    m_pPinnedBuffer = pBuffer;
+    ADDREF_OBJECT(m_pPinnedBuffer);
+
+    *ppSpan = pStream->m_pFirstValidByte + offset;
+    *pLength = (int32) length;
+    m_SpanPosition = m_NextPosition;
+    m_NextPosition += length;
+
+    return(true);
+} // GetNextSpan.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Stop]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOStreamSpanIterator::Stop() {
+    RELEASE_OBJECT(m_pPinnedBuffer);
+    RELEASE_OBJECT(m_pStream);
+} // Stop.
+
+
+
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [Read]
@@ -847,6 +1312,7 @@ CAsyncIOStream::Read(char *clientBuffer, int32 bytesToRead) {
     int32 bytesInBuffer;
     int32 numBytes;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::Read. bytesToRead = %d", bytesToRead);
@@ -930,6 +1396,7 @@ ErrVal
 CAsyncIOStream::Write(const char *clientBuffer, int32 bytesToWrite) {
     ErrVal err = ENoErr;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::Write. bytesToWrite = %d",
@@ -947,6 +1414,11 @@ CAsyncIOStream::Write(const char *clientBuffer, int32 bytesToWrite) {
         gotoErr(EEOF);
     }
 
+    // A mapped file, or a file opened without WRITE_ACCESS, cannot be changed.
+    if (m_AsyncIOStreamFlags & READ_ONLY_STREAM) {
+        gotoErr(EFail);
+    }
+
     if (m_pBlockIO->m_fSeekable) {
         err = WriteToSeekableDevice(clientBuffer, bytesToWrite);
     } else
@@ -1187,6 +1659,7 @@ CAsyncIOStream::RemoveNBytes(int64 startPos, int32 bytesToRemove) {
     int32 offset;
     int32 bytesInNewBuffer;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::RemoveNBytes. startPos = " INT64FMT ", bytesToRemove = %d",
@@ -1195,7 +1668,8 @@ CAsyncIOStream::RemoveNBytes(int64 startPos, int32 bytesToRemove) {
     // The stream must have been initialized.
     if ((NULL == m_pBlockIO)
         || (startPos < 0)
-        || (bytesToRemove < 0)) {
+        || (bytesToRemove < 0)
+        || (m_AsyncIOStreamFlags & READ_ONLY_STREAM)) {
         gotoErr(EFail);
     }
 
@@ -1366,6 +1840,7 @@ CAsyncIOStream::CopyStream(
     int32 numBytes;
     CIOBuffer *pBuffer;
     int32 startOffsetInBuffer;
+    int64 numBytesCopied;
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyStream. numBytesToCopy = " INT64FMT ", fTransferOwnerShip = %d",
@@ -1380,6 +1855,8 @@ CAsyncIOStream::CopyStream(
 
     m_pLock->Lock();
     destStream->m_pLock->Lock();
+    SyncCursor();
+    destStream->SyncCursor();
 
     // Save where we left off so we can restore our position.
     srcStartPos = GetPosition();
@@ -1393,13 +1870,50 @@ CAsyncIOStream::CopyStream(
     }
     DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyStream. numBytesToCopy = %d", numBytesToCopy);
 
-    if (fTransferOwnerShip) {
-        // Write any unsaved output buffer.
-        err = MoveBufferToBackground(m_pActiveIOBuffer);
+    // A file that is sent to a socket is never read into our buffers.
+    // The socket copies the bytes straight from the file.
+    if (CanSendFileToStream(destStream)) {
+        if ((srcStartPos + numBytesToCopy) > GetDataLength()) {
+            numBytesToCopy = GetDataLength() - srcStartPos;
+        }
+
+        err = SendFileToStream(destStream, srcStartPos, numBytesToCopy);
+        if (!err) {
+            srcStartPos += numBytesToCopy;
+        }
+        gotoErr(err);
+    } // if (CanSendFileToStream(destStream))
+
+    // A file that is copied to another file is copied by the kernel. If
+    // the kernel stops early, the buffers below copy the rest.
+    if (CanCopyFileToStream(destStream)) {
+        if ((srcStartPos + numBytesToCopy) > GetDataLength()) {
+            numBytesToCopy = GetDataLength() - srcStartPos;
+        }
+
+        err = CopyFileToStream(destStream, srcStartPos, numBytesToCopy, &numBytesCopied);
         if (err) {
             gotoErr(err);
         }
-        err = destStream->MoveBufferToBackground(destStream->m_pActiveIOBuffer);
+        srcStartPos += numBytesCopied;
+        numBytesToCopy = numBytesToCopy - numBytesCopied;
+    } // if (CanCopyFileToStream(destStream))
+
+    // The buffer of a mapped file points into the mapping, which goes
+    // away when this stream closes, and a read-only stream may hold slices
+    // of cached blocks, which the destination must not change. Copy the
+    // bytes instead.
+    if (m_AsyncIOStreamFlags & READ_ONLY_STREAM) {
+        fTransferOwnerShip = false;
+    }
+
+    if (fTransferOwnerShip) {
+        // Write any unsaved output buffer.
+        err = MoveBufferToBackground(m_pActiveIOBuffer);
+        if (err) {
+            gotoErr(err);
+        }
+        err = destStream->MoveBufferToBackground(destStream->m_pActiveIOBuffer);
         if (err) {
             gotoErr(err);
         }
@@ -1472,8 +1986,15 @@ CAsyncIOStream::CopyStream(
                 numBytes = (int32) numBytesToCopy;
             }
 
-            DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyStream. Writing bytes, numBytes = %d", numBytes);
-            err = destStream->Write(m_pNextValidByte, numBytes);
+            // A large run of bytes is sent as a slice of our buffer, so
+            // it is not copied. Small runs are cheaper to copy.
+            if (CanForwardBufferToStream(destStream, m_pActiveIOBuffer, numBytes)) {
+                DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyStream. Forwarding bytes, numBytes = %d", numBytes);
+                err = ForwardBufferToStream(destStream, m_pActiveIOBuffer, m_pNextValidByte, numBytes);
+            } else {
+                DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyStream. Writing bytes, numBytes = %d", numBytes);
+                err = destStream->Write(m_pNextValidByte, numBytes);
+            }
             if (err) {
                 gotoErr(err);
             }
@@ -1509,6 +2030,409 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CanSendFileToStream]
+//
+// This decides whether CopyStream can let the destination blockIO copy
+// bytes straight out of our file. The caller holds both locks.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CAsyncIOStream::CanSendFileToStream(CAsyncIOStream *destStream) {
+    CIOBuffer *pBuffer;
+
+    if ((NULL == m_pBlockIO)
+        || ((CAsyncBlockIO::FILE_MEDIA != m_pBlockIO->m_MediaType)
+            && (CAsyncBlockIO::MAPPED_FILE_MEDIA != m_pBlockIO->m_MediaType))
+        || (CAsyncBlockIO::NETWORK_MEDIA != destStream->m_pBlockIO->m_MediaType)
+        || !(destStream->m_pBlockIO->CanSendFromFile())
+        || (m_pBlockIO->GetFileDescriptor() < 0)) {
+        return(false);
+    }
+
+    // The destination reads the file itself, so it would miss any bytes
+    // that we have not yet written to the file.
+    pBuffer = m_IOBufferList.GetHead();
+    while (pBuffer) {
+        if ((CIOBuffer::WRITE == pBuffer->m_BufferOp)
+            || (pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)) {
+            return(false);
+        }
+        pBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
+    }
+    pBuffer = m_OutputBufferList.GetHead();
+    while (pBuffer) {
+        if ((CIOBuffer::WRITE == pBuffer->m_BufferOp)
+            || (pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)) {
+            return(false);
+        }
+        pBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
+    }
+
+    return(true);
+} // CanSendFileToStream.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SendFileToStream]
+//
+// This writes a range of our file to the destination with SEND_FROM_FILE
+// buffers, which hold no data. They go on the output list of the
+// destination like any other write, so they are sent in order and a
+// Flush of the destination waits for them.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::SendFileToStream(
+                    CAsyncIOStream *destStream,
+                    int64 srcStartPos,
+                    int64 numBytesToCopy) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer;
+    int32 numBytes;
+
+    DEBUG_LOG_VERBOSE("CAsyncIOStream::SendFileToStream. srcStartPos = " INT64FMT ", numBytesToCopy = " INT64FMT,
+                srcStartPos, numBytesToCopy);
+
+    // Anything that was already written to the destination goes first.
+    err = destStream->MoveBufferToBackground(destStream->m_pActiveIOBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+    err = destStream->MoveBufferToBackground(destStream->m_pActiveOutputIOBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+
+    destStream->m_pBlockIO->StartWriteChain();
+
+    while (numBytesToCopy > 0) {
+        numBytes = MAX_SEND_FILE_CHUNK;
+        if (numBytesToCopy < numBytes) {
+            numBytes = (int32) numBytesToCopy;
+        }
+
+        pBuffer = destStream->m_pIOSystem->AllocIOBuffer(-1, false);
+        if (NULL == pBuffer) {
+            gotoErr(EFail);
+        }
+
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pBuffer->m_BufferFlags |= CIOBuffer::OUTPUT_BUFFER;
+        pBuffer->m_BufferFlags |= CIOBuffer::SEND_FROM_FILE;
+        pBuffer->m_BufferSize = numBytes;
+        pBuffer->m_NumValidBytes = numBytes;
+        pBuffer->m_SendFilePos = srcStartPos;
+        pBuffer->m_pSendFileSource = m_pBlockIO;
+        ADDREF_OBJECT(m_pBlockIO);
+
+        // The buffer was AddRef'ed by AllocIOBuffer. The destination
+        // releases it when the write completes.
+        destStream->m_OutputBufferList.InsertTail(&(pBuffer->m_StreamBufferList));
+        destStream->m_pBlockIO->WriteBlockAsync(pBuffer, 0);
+
+        srcStartPos += numBytes;
+        numBytesToCopy = numBytesToCopy - numBytes;
+    } // while (numBytesToCopy > 0)
+
+abort:
+    destStream->m_pBlockIO->EndWriteChain();
+    returnErr(err);
+} // SendFileToStream.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CanForwardBufferToStream]
+//
+// This decides whether CopyStream can send part of one of our buffers to
+// the destination without copying it. Only devices that write a buffer and
+// then drop it, like sockets, can take a slice. The bytes in the slice must
+// not change until it is written, so a seekable stream must be able to
+// read them again from its device after it gives up the buffer.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CAsyncIOStream::CanForwardBufferToStream(
+                        CAsyncIOStream *destStream,
+                        CIOBuffer *pBuffer,
+                        int32 numBytes) {
+    if ((NULL == m_pBlockIO)
+        || (NULL == pBuffer)
+        || (numBytes < MIN_FORWARD_SLICE_BYTES)
+        || (destStream->m_pBlockIO->m_fSeekable)
+        || (CIOBuffer::NO_OP != pBuffer->m_BufferOp)
+        || (pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)
+        || !(pBuffer->m_BufferFlags
+                & (CIOBuffer::ALLOCATED_BUFFER | CIOBuffer::SLICE_OF_BUFFER))) {
+        return(false);
+    }
+
+    if ((m_pBlockIO->m_fSeekable)
+        && (m_AsyncIOStreamFlags & (ALL_DATA_IS_IN_BUFFERS | EXPANDING_MEMORY_STREAM))) {
+        return(false);
+    }
+
+    return(true);
+} // CanForwardBufferToStream.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ForwardBufferToStream]
+//
+// This writes numBytes starting at pStart in one of our buffers to the
+// destination, with a slice that shares the memory of our buffer. Like
+// SendFileToStream, the slice goes on the output list of the destination,
+// so it is sent in order and a Flush of the destination waits for it.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::ForwardBufferToStream(
+                        CAsyncIOStream *destStream,
+                        CIOBuffer *pBuffer,
+                        char *pStart,
+                        int32 numBytes) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pSlice = NULL;
+
+    pSlice = destStream->m_pIOSystem->AllocBufferSlice(
+                                        pBuffer,
+                                        pStart - pBuffer->m_pLogicalBuffer,
+                                        numBytes);
+    if (NULL == pSlice) {
+        err = destStream->Write(pStart, numBytes);
+        returnErr(err);
+    }
+
+    // Anything that was already written to the destination goes first.
+    err = destStream->MoveBufferToBackground(destStream->m_pActiveIOBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+    err = destStream->MoveBufferToBackground(destStream->m_pActiveOutputIOBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // The slice was AddRef'ed by AllocBufferSlice. The destination
+    // releases it when the write completes.
+    pSlice->m_BufferFlags |= CIOBuffer::OUTPUT_BUFFER;
+    destStream->m_OutputBufferList.InsertTail(&(pSlice->m_StreamBufferList));
+    destStream->m_pBlockIO->WriteBlockAsync(pSlice, 0);
+    pSlice = NULL;
+
+    // A seekable stream may write over these bytes later. Stop using the
+    // buffer, so the next time we need these bytes we read them again
+    // into a new buffer. Only the slices still use the old one.
+    if (m_pBlockIO->m_fSeekable) {
+        if (m_pActiveIOBuffer == pBuffer) {
+            m_pActiveIOBuffer = NULL;
+            m_pFirstValidByte = NULL;
+            m_pNextValidByte = NULL;
+            m_pEndValidBytes = NULL;
+            m_pLastPossibleValidByte = NULL;
+        }
+        if (m_pActiveOutputIOBuffer == pBuffer) {
+            m_pActiveOutputIOBuffer = NULL;
+            m_pFirstValidOutputByte = NULL;
+            m_pNextValidOutputByte = NULL;
+            m_pLastPossibleValidOutputByte = NULL;
+        }
+        pBuffer->m_StreamBufferList.RemoveFromQueue();
+        RELEASE_OBJECT(pBuffer);
+    }
+
+abort:
+    RELEASE_OBJECT(pSlice);
+    returnErr(err);
+} // ForwardBufferToStream.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CanCopyFileToStream]
+//
+// Both files must be synchronous, so the unsaved buffers we write before
+// the copy are in the files when the kernel reads them.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CAsyncIOStream::CanCopyFileToStream(CAsyncIOStream *destStream) {
+    if ((NULL == m_pBlockIO)
+        || (destStream == this)
+        || ((CAsyncBlockIO::FILE_MEDIA != m_pBlockIO->m_MediaType)
+            && (CAsyncBlockIO::MAPPED_FILE_MEDIA != m_pBlockIO->m_MediaType))
+        || (CAsyncBlockIO::FILE_MEDIA != destStream->m_pBlockIO->m_MediaType)
+        || !(m_pBlockIO->m_fSynchronousDevice)
+        || !(destStream->m_pBlockIO->m_fSynchronousDevice)
+        || (destStream->m_AsyncIOStreamFlags & READ_ONLY_STREAM)
+        || (m_pBlockIO->GetFileDescriptor() < 0)
+        || (destStream->m_pBlockIO->GetFileDescriptor() < 0)) {
+        return(false);
+    }
+
+    return(true);
+} // CanCopyFileToStream.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CopyFileToStream]
+//
+// This copies a range of our file into the destination file without
+// reading it into buffers. The bytes go where destStream->Write would have
+// put them, and the destination is left positioned just after them.
+// *pNumBytesCopied may be less than numBytesToCopy, or 0 if the two files
+// cannot be copied by the kernel.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::CopyFileToStream(
+                    CAsyncIOStream *destStream,
+                    int64 srcStartPos,
+                    int64 numBytesToCopy,
+                    int64 *pNumBytesCopied) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer;
+    CIOBuffer *pNextBuffer;
+    int64 destStartPos;
+    int64 destStopPos;
+    int64 numBytesCopied = 0;
+
+    DEBUG_LOG_VERBOSE("CAsyncIOStream::CopyFileToStream. srcStartPos = " INT64FMT ", numBytesToCopy = " INT64FMT,
+                srcStartPos, numBytesToCopy);
+
+    if (numBytesToCopy <= 0) {
+        gotoErr(ENoErr);
+    }
+
+    // WriteToSeekableDevice writes at the start of the stream when there
+    // is no active buffer, so do the same.
+    destStartPos = 0;
+    if ((destStream->m_pActiveIOBuffer)
+        && (destStream->m_pNextValidByte)
+        && (destStream->m_pFirstValidByte)) {
+        destStartPos = destStream->GetPosition();
+    }
+
+    // The kernel copies what is in the files, so both files must have
+    // every change that is still in a buffer.
+    err = WriteUnsavedBuffers();
+    if (err) {
+        gotoErr(err);
+    }
+    err = destStream->WriteUnsavedBuffers();
+    if (err) {
+        gotoErr(err);
+    }
+
+    numBytesCopied = destStream->m_pBlockIO->CopyFromFile(
+                                                m_pBlockIO,
+                                                srcStartPos,
+                                                destStartPos,
+                                                numBytesToCopy);
+    if (numBytesCopied <= 0) {
+        numBytesCopied = 0;
+        gotoErr(ENoErr);
+    }
+    destStopPos = destStartPos + numBytesCopied;
+
+    // Any buffer of the destination that overlaps the copied bytes is stale.
+    destStream->UpdateDataLength(destStream->m_pActiveIOBuffer);
+    destStream->m_pActiveIOBuffer = NULL;
+    destStream->m_pFirstValidByte = NULL;
+    destStream->m_pNextValidByte = NULL;
+    destStream->m_pEndValidBytes = NULL;
+    destStream->m_pLastPossibleValidByte = NULL;
+
+    pBuffer = destStream->m_IOBufferList.GetHead();
+    while (pBuffer) {
+        pNextBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
+        if ((pBuffer->m_PosInMedia < destStopPos)
+            && ((pBuffer->m_PosInMedia + pBuffer->m_BufferSize) > destStartPos)) {
+            pBuffer->m_StreamBufferList.RemoveFromQueue();
+            if ((CIOBuffer::READ == pBuffer->m_BufferOp)
+                || (CIOBuffer::WRITE == pBuffer->m_BufferOp)) {
+                pBuffer->m_BufferFlags |= CIOBuffer::DISCARD_WHEN_IDLE;
+            } else {
+                RELEASE_OBJECT(pBuffer);
+            }
+        }
+        pBuffer = pNextBuffer;
+    } // while (pBuffer)
+
+    if (destStopPos > destStream->m_TotalAvailableBytes) {
+        destStream->m_TotalAvailableBytes = destStopPos;
+    }
+
+    err = destStream->SetPosition(destStopPos);
+    if (EEOF == err) {
+        err = ENoErr;
+    }
+
+abort:
+    *pNumBytesCopied = numBytesCopied;
+    returnErr(err);
+} // CopyFileToStream.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WriteUnsavedBuffers]
+//
+// This writes every changed buffer but leaves the position alone, unlike
+// Flush, which also gives up the active buffer.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CAsyncIOStream::WriteUnsavedBuffers() {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer;
+    AutoLock(m_pLock);
+
+    pBuffer = m_IOBufferList.GetHead();
+    while (pBuffer) {
+        if ((CIOBuffer::NO_OP == pBuffer->m_BufferOp)
+            && (pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)) {
+            err = WriteBackgroundBuffer(pBuffer);
+            if (err) {
+                gotoErr(err);
+            }
+        }
+        pBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
+    } // while (pBuffer)
+
+abort:
+    returnErr(err);
+} // WriteUnsavedBuffers.
+
+
+
+
+
+
 
 /////////////////////////////////////////////////////////////////////////////
 //
@@ -1520,6 +2444,7 @@ CAsyncIOStream::ListenForNBytes(int64 startPos, int64 nBytes) {
     ErrVal err = ENoErr;
     int64 bytesAvalilableNow;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::ListenForNBytes. startPos = " INT64FMT ", nBytes = " INT64FMT,
@@ -1587,6 +2512,7 @@ CAsyncIOStream::ListenForMoreBytes() {
     ErrVal err = ENoErr;
     int64 bytesAvalilableNow;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::ListenForMoreBytes");
@@ -1649,6 +2575,7 @@ void
 CAsyncIOStream::ListenForAllBytesToEOF() {
     ErrVal err = ENoErr;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::ListenForAllBytesToEOF");
@@ -2098,8 +3025,9 @@ CAsyncIOStream::OnBlockIOEvent(CIOBuffer *pBuffer) {
                 } // Look for the previous buffer.
 
                 // Check if we found a previous buffer that is small enough
-                // to fit into the new buffer.
-                if (NULL != pPrevBuffer) {
+                // to fit into the new buffer. A buffer that was forwarded
+                // to another stream is shared with its slices, so leave it.
+                if ((NULL != pPrevBuffer) && (pPrevBuffer->GetRefCount() <= 1)) {
                     int32 offset = pPrevBuffer->m_pLogicalBuffer - pPrevBuffer->m_pPhysicalBuffer;
 
                     if ((offset + pPrevBuffer->m_NumValidBytes + pBuffer->m_NumValidBytes)
@@ -2327,6 +3255,8 @@ CAsyncIOStream::MoveBufferToBackground(CIOBuffer *pBuffer) {
         m_pNextValidOutputByte = NULL;
         m_pLastPossibleValidOutputByte = NULL;
     } else if (m_pActiveIOBuffer == pBuffer) {
+        UpdateDataLength(pBuffer);
+
         m_pActiveIOBuffer = NULL;
         m_pFirstValidByte = NULL;
         m_pNextValidByte = NULL;
@@ -2348,6 +3278,38 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UpdateDataLength]
+//
+// PutByte extends the active buffer of a seekable stream without changing
+// m_TotalAvailableBytes. GetDataLength allows for that in the active
+// buffer, so this is called whenever the stream stops using a buffer that
+// may stay in m_IOBufferList.
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::UpdateDataLength(CIOBuffer *pBuffer) {
+    int64 endPos;
+    AutoLock(m_pLock);
+
+    if ((NULL == pBuffer)
+        || (NULL == m_pBlockIO)
+        || !(m_pBlockIO->m_fSeekable)) {
+        return;
+    }
+
+    endPos = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
+    if (endPos > m_TotalAvailableBytes) {
+        m_TotalAvailableBytes = endPos;
+    }
+} // UpdateDataLength.
+
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [WriteBackgroundBuffer]
@@ -2387,10 +3349,10 @@ abort:
 //
 // [AllocAsyncIOStreamBuffer]
 //
-// This allocates a new buffer.
+// This allocates a new buffer. A bufferSize of -1 means one block.
 /////////////////////////////////////////////////////////////////////////////
 CIOBuffer *
-CAsyncIOStream::AllocAsyncIOStreamBuffer(int64 bufferStartPos, bool fInputBuffer) {
+CAsyncIOStream::AllocAsyncIOStreamBuffer(int64 bufferStartPos, bool fInputBuffer, int32 bufferSize) {
     ErrVal err = ENoErr;
     CIOBuffer *pBuffer = NULL;
     bool fAllocBuffer = true;
@@ -2412,12 +3374,44 @@ CAsyncIOStream::AllocAsyncIOStreamBuffer(int64 bufferStartPos, bool fInputBuffer
             && (m_IOBufferList.GetLength() >= m_MaxNumIOBuffersForSeekableDevices)) {
         pBuffer = m_IOBufferList.GetTail();
         while (NULL != pBuffer) {
-            if (CIOBuffer::NO_OP == pBuffer->m_BufferOp) {
-                DEBUG_LOG_VERBOSE("CAsyncIOStream::AllocAsyncIOStreamBuffer. Recycle a buffer");
+            // SetPosition may have switched to another buffer in the list
+            // without saving this one, so save any changes before reusing it.
+            // A synchronous device finishes the write before this returns.
+            if ((CIOBuffer::NO_OP == pBuffer->m_BufferOp)
+                && (pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)) {
+                (void) WriteBackgroundBuffer(pBuffer);
+            }
+            // A buffer that someone else holds, like a span iterator or
+            // a slice, still has bytes in use, so it cannot be reused.
+            if ((CIOBuffer::NO_OP == pBuffer->m_BufferOp)
+                && (pBuffer->GetRefCount() <= 1)) {
                 break;
             }
             pBuffer = pBuffer->m_StreamBufferList.GetPreviousInQueue();
         } // while (NULL != pBuffer)
+
+        // Sequential reads may be several blocks long. A buffer of the
+        // wrong size is discarded rather than recycled, so the list does
+        // not grow past its limit. A slice of a cached block is always
+        // discarded, since its memory belongs to the block cache.
+        if ((NULL != pBuffer)
+            && (pBuffer->m_BufferFlags & CIOBuffer::SLICE_OF_BUFFER)
+            && (pBuffer == m_pActiveIOBuffer)) {
+            pBuffer = NULL;
+        } else if ((NULL != pBuffer)
+            && (pBuffer != m_pActiveIOBuffer)
+            && ((pBuffer->m_BufferFlags & CIOBuffer::SLICE_OF_BUFFER)
+                || ((bufferSize > 0) && (pBuffer->m_BufferSize != bufferSize)))) {
+            DEBUG_LOG_VERBOSE("CAsyncIOStream::AllocAsyncIOStreamBuffer. Discard a buffer");
+            m_IOBufferList.RemoveFromQueue(&(pBuffer->m_StreamBufferList));
+            RELEASE_OBJECT(pBuffer);
+        } else if (NULL != pBuffer) {
+            DEBUG_LOG_VERBOSE("CAsyncIOStream::AllocAsyncIOStreamBuffer. Recycle a buffer");
+
+            // The recycled buffer is now the most recently used.
+            pBuffer->m_StreamBufferList.RemoveFromQueue();
+            m_IOBufferList.InsertHead(&(pBuffer->m_StreamBufferList));
+        }
     } // Recycle a buffer.
 
 
@@ -2425,7 +3419,7 @@ CAsyncIOStream::AllocAsyncIOStreamBuffer(int64 bufferStartPos, bool fInputBuffer
     if (NULL == pBuffer) {
         DEBUG_LOG_VERBOSE("CAsyncIOStream::AllocAsyncIOStreamBuffer. Allocate a new buffer");
 
-        pBuffer = m_pIOSystem->AllocIOBuffer(-1, fAllocBuffer);
+        pBuffer = m_pIOSystem->AllocIOBuffer(bufferSize, fAllocBuffer);
         if ((NULL == pBuffer)
             || (NULL == pBuffer->m_pPhysicalBuffer)
             || (pBuffer->m_BufferSize < 0)) {
@@ -2471,14 +3465,141 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [Flush]
+// [DiscardIdleInputBuffer]
 //
+// SetPosition calls this before it adds a buffer to the list without
+// AllocAsyncIOStreamBuffer, like a shared block, so the list of a file
+// stream does not grow past its limit.
 /////////////////////////////////////////////////////////////////////////////
 void
-CAsyncIOStream::Flush() {
-    ErrVal err = ENoErr;
+CAsyncIOStream::DiscardIdleInputBuffer() {
     CIOBuffer *pBuffer;
-    AutoLock(m_pLock);
+
+    if ((NULL == m_pBlockIO)
+        || !(m_pBlockIO->m_fSeekable)
+        || (m_IOBufferList.GetLength() < m_MaxNumIOBuffersForSeekableDevices)) {
+        return;
+    }
+
+    // Start with the least recently used buffer, at the tail.
+    pBuffer = m_IOBufferList.GetTail();
+    while (NULL != pBuffer) {
+        if ((pBuffer != m_pActiveIOBuffer)
+            && (CIOBuffer::NO_OP == pBuffer->m_BufferOp)
+            && !(pBuffer->m_BufferFlags & CIOBuffer::UNSAVED_CHANGES)
+            && (pBuffer->GetRefCount() <= 1)) {
+            DEBUG_LOG_VERBOSE("CAsyncIOStream::DiscardIdleInputBuffer. Discard a buffer");
+            m_IOBufferList.RemoveFromQueue(&(pBuffer->m_StreamBufferList));
+            RELEASE_OBJECT(pBuffer);
+            return;
+        }
+        pBuffer = pBuffer->m_StreamBufferList.GetPreviousInQueue();
+    } // while (NULL != pBuffer)
+} // DiscardIdleInputBuffer.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetSequentialReadSize]
+//
+// This decides how large a buffer to read when SetPosition misses every
+// buffer we have. A reader that keeps asking for the block just past the
+// last one we read is reading sequentially, so each miss reads twice as
+// many blocks as the last one, up to m_MaxNumIOBuffersForSeekableDevices.
+// Any other seek starts over with a single block.
+//
+// This only makes sequential reads larger and fewer. It does not prefetch.
+// File streams open their blockIO synchronously, so each read finishes
+// before SetPosition returns, and there is no IO to overlap with the
+// reader's work on the blocks it already has.
+//
+// This returns -1 when the stream does not use larger reads, so the buffer
+// should be the default single block.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CAsyncIOStream::GetSequentialReadSize(int64 bufferStartPos) {
+    CIOBuffer *pBuffer;
+    int32 blockSize;
+    int32 numBlocks;
+    int64 maxBlocks;
+    int64 blocksBeforeBuffer;
+    AutoLock(m_pLock);
+
+    if ((NULL == m_pBlockIO)
+        || (NULL == m_pIOSystem)
+        || !(m_pBlockIO->m_fSeekable)
+        || (m_AsyncIOStreamFlags & EXPANDING_MEMORY_STREAM)
+        || (m_AsyncIOStreamFlags & ALL_DATA_IS_IN_BUFFERS)
+        || (m_MaxNumIOBuffersForSeekableDevices <= 1)) {
+        return(-1);
+    }
+
+    bufferStartPos = m_pIOSystem->GetIOStartPosition(bufferStartPos);
+    blockSize = m_pIOSystem->GetDefaultBytesPerBlock();
+    if (blockSize <= 0) {
+        return(-1);
+    }
+
+    if ((bufferStartPos == m_NextSequentialReadPosition) && (m_SequentialReadBlocks > 0)) {
+        m_SequentialReadBlocks = m_SequentialReadBlocks * 2;
+        if (m_SequentialReadBlocks > m_MaxNumIOBuffersForSeekableDevices) {
+            m_SequentialReadBlocks = m_MaxNumIOBuffersForSeekableDevices;
+        }
+    } else {
+        m_SequentialReadBlocks = 1;
+    }
+    numBlocks = m_SequentialReadBlocks;
+
+    // Do not read past the end of the media.
+    maxBlocks = (m_TotalAvailableBytes - bufferStartPos + blockSize - 1) / blockSize;
+    if (numBlocks > maxBlocks) {
+        numBlocks = (int32) maxBlocks;
+    }
+
+    // Do not overlap a buffer we already have. Its data may be newer
+    // than what is on the media.
+    pBuffer = m_IOBufferList.GetHead();
+    while ((NULL != pBuffer) && (numBlocks > 1)) {
+        if (pBuffer->m_PosInMedia > bufferStartPos) {
+            blocksBeforeBuffer = (pBuffer->m_PosInMedia - bufferStartPos) / blockSize;
+            if (numBlocks > blocksBeforeBuffer) {
+                numBlocks = (int32) blocksBeforeBuffer;
+            }
+        }
+        pBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
+    }
+
+    if (numBlocks < 1) {
+        numBlocks = 1;
+    }
+    m_NextSequentialReadPosition = bufferStartPos + (numBlocks * blockSize);
+
+    DEBUG_LOG_VERBOSE("CAsyncIOStream::GetSequentialReadSize. Read %d blocks", numBlocks);
+    return(numBlocks * blockSize);
+} // GetSequentialReadSize.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Flush]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::Flush() {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer;
+    AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     DEBUG_LOG_VERBOSE("CAsyncIOStream::Flush");
@@ -2501,6 +3622,11 @@ CAsyncIOStream::Flush() {
         gotoErr(ENoErr);
     }
 
+    // Let the blockIO send all of the dirty buffers together. For a
+    // network stream, this sends a header and the body buffers behind it
+    // with one system call instead of one per buffer.
+    m_pBlockIO->StartWriteChain();
+
     pBuffer = m_IOBufferList.GetHead();
     while (pBuffer) {
         if ((CIOBuffer::NO_OP == pBuffer->m_BufferOp)
@@ -2533,6 +3659,8 @@ CAsyncIOStream::Flush() {
         pBuffer = pBuffer->m_StreamBufferList.GetNextInQueue();
     } // while (pBuffer)
 
+    m_pBlockIO->EndWriteChain();
+
     DEBUG_LOG_VERBOSE("CAsyncIOStream::Flush m_NumFlushWrites = %d", m_NumFlushWrites);
 
     m_pActiveIOBuffer = NULL;
@@ -2572,6 +3700,8 @@ abort:
 /////////////////////////////////////////////////////////////////////////////
 void
 CAsyncIOStream::FinishFlush() {
+    ErrVal err = ENoErr;
+    CDurableFlushJob *pJob = NULL;
     AutoLock(m_pLock);
     RunChecks();
 
@@ -2584,13 +3714,109 @@ CAsyncIOStream::FinishFlush() {
     m_AsyncIOStreamFlags &= ~FLUSHING;
     m_AsyncIOStreamFlags &= ~WAITING_ON_FLUSH;
 
+    // A durable stream does not report the flush until the data is on disk.
+    // The job does the sync and then reports the flush.
+    if ((NULL != m_pBlockIO)
+        && (m_pBlockIO->m_BlockIOFlags & CAsyncBlockIO::DURABLE_FLUSH)
+        && (ENoErr == m_FlushErr)) {
+        pJob = newex CDurableFlushJob;
+        if (NULL == pJob) {
+            gotoErr(EFail);
+        }
+        pJob->m_pStream = this;
+        ADDREF_THIS();
+        pJob->m_pBlockIO = m_pBlockIO;
+        ADDREF_OBJECT(m_pBlockIO);
+
+        err = g_MainJobQueue->SubmitJob(pJob);
+        RELEASE_OBJECT(pJob);
+        if (err) {
+            gotoErr(err);
+        }
+        return;
+    }
+
+abort:
+    if (err) {
+        m_FlushErr = err;
+    }
+    ReportFlush(m_FlushErr);
+} // FinishFlush.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReportFlush]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncIOStream::ReportFlush(ErrVal err) {
+    AutoLock(m_pLock);
+
     if (NULL != m_pEventHandler) {
         CAsyncIOEventHandler *pEventHandler = m_pEventHandler;
         ADDREF_OBJECT(pEventHandler);
-        pEventHandler->OnFlush(m_FlushErr, this, m_pEventHandlerContext);
+        pEventHandler->OnFlush(err, this, m_pEventHandlerContext);
         RELEASE_OBJECT(pEventHandler);
      } // (NULL != m_pEventHandler)
-} // FinishFlush.
+} // ReportFlush.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CDurableFlushJob]
+//
+/////////////////////////////////////////////////////////////////////////////
+CDurableFlushJob::CDurableFlushJob() {
+    m_pStream = NULL;
+    m_pBlockIO = NULL;
+} // CDurableFlushJob.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CDurableFlushJob]
+//
+/////////////////////////////////////////////////////////////////////////////
+CDurableFlushJob::~CDurableFlushJob() {
+    RELEASE_OBJECT(m_pBlockIO);
+    RELEASE_OBJECT(m_pStream);
+} // ~CDurableFlushJob.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ProcessJob]
+//
+// This waits for the disk, so it holds no lock. Flushes of other streams on
+// the same file may share the sync.
+/////////////////////////////////////////////////////////////////////////////
+void
+CDurableFlushJob::ProcessJob(CSimpleThread *pThreadState) {
+    ErrVal err;
+    UNUSED_PARAM(pThreadState);
+
+    if ((NULL == m_pStream) || (NULL == m_pBlockIO)) {
+        return;
+    }
+
+    err = m_pBlockIO->Flush();
+    m_pStream->ReportFlush(err);
+} // ProcessJob.
 
 
 
@@ -2858,6 +4084,7 @@ CAsyncIOStream::GetChar(
                   int *pCharLen) {
     ErrVal err = ENoErr;
     AutoLock(m_pLock);
+    SyncCursor();
 
     if ((NULL == pBuffer) || (NULL == pCharLen) || (maxCharLen < 0)) {
         gotoErr(EFail);
@@ -2926,8 +4153,9 @@ ErrVal
 CAsyncIOStream::PutByte(char c) {
     ErrVal err = ENoErr;
     AutoLock(m_pLock);
+    SyncCursor();
 
-    if (NULL == m_pBlockIO) {
+    if ((NULL == m_pBlockIO) || (m_AsyncIOStreamFlags & READ_ONLY_STREAM)) {
         returnErr(EFail);
     }
 
@@ -3024,6 +4252,7 @@ CAsyncIOStream::printf(const char *format, ...) {
     int32 charsWritten;
     int numActualDigits;
     AutoLock(m_pLock);
+    SyncCursor();
 
 
     va_start(argList, format);
@@ -3326,6 +4555,7 @@ CAsyncIOStream::SkipWhileCharType(int32 charType) {
     int32 streamCharProperties;
     int64 lastCharPosition;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     // Make sure we start at a valid buffer. Otherwise, all pointers are bogus.
@@ -3387,6 +4617,7 @@ CAsyncIOStream::SkipUntilCharType(int32 charType) {
     int32 streamCharProperties;
     int64 lastCharPosition;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     // Make sure we start at a valid buffer. Otherwise, all pointers are bogus.
@@ -3455,6 +4686,7 @@ CAsyncIOStream::FindString(
     const char *pMatchStr;
     bool fHitStopPosition = false;
     AutoLock(m_pLock);
+    SyncCursor();
     RunChecks();
 
     searchOptions = searchOptions; // Unused.
@@ -3785,6 +5017,16 @@ static CAsyncIOEventHandlerSynch *g_TestCallback = NULL;
 
 ErrVal TestCompareStreams(CAsyncIOStream *reader, CAsyncIOStream *writer, bool clipToDestSize);
 ErrVal TestCopyStreams(CAsyncIOStream *reader, CAsyncIOStream *writer, bool fBucketIO);
+static ErrVal TestReadAhead();
+static ErrVal TestSeekBackAfterWrite();
+static ErrVal TestMappedFile();
+static ErrVal TestSharedCacheBlocks();
+static ErrVal TestDurableFlush();
+static ErrVal TestCopyFile();
+static ErrVal TestByteCursor();
+static ErrVal TestCursorOtherThread();
+static ErrVal TestStreamSpans();
+static ErrVal TestFindString();
 
 // Watch out, google now has a chunked main page. The higher levels of the
 // http code can handle chunking, but not this simple test code.
@@ -4190,6 +5432,104 @@ CAsyncIOStream::TestAsyncIOStream() {
 
 
 
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Read a file sequentially and at random positions");
+
+    err = TestReadAhead();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Seek back over buffers that were just written");
+
+    err = TestSeekBackAfterWrite();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Read a memory-mapped file");
+
+    err = TestMappedFile();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Share cached blocks between read-only streams");
+
+    err = TestSharedCacheBlocks();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Flush scattered changes to disk");
+
+    err = TestDurableFlush();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Copy part of a file into another file");
+
+    err = TestCopyFile();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Read bytes through a cursor");
+
+    err = TestByteCursor();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Read from another thread while a cursor is out");
+
+    err = TestCursorOtherThread();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Walk a stream as spans");
+
+    err = TestStreamSpans();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+    //////////////////////////////////////////////////////////
+    g_DebugManager.StartTest("Find strings that straddle buffers");
+
+    err = TestFindString();
+    if (err) {
+        gotoErr(err);
+    }
+
+
+
     //////////////////////////////////////////////////////////
     g_DebugManager.StartTest("Search for a string in a file");
 
@@ -4345,6 +5685,1432 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestReadAhead]
+//
+// This writes a file that is many blocks long, and then reads it back
+// in pieces that do not line up with blocks. A sequential pass makes each
+// read larger, and the random seeks that follow shrink them again.
+/////////////////////////////////////////////////////////////////////////////
+#define READ_AHEAD_TEST_FILE_SIZE   (200 * 1024 + 123)
+#define READ_AHEAD_TEST_CHUNK_SIZE  3001
+#define READ_AHEAD_TEST_BYTE(pos)   ((char) ('a' + (((pos) * 7) + ((pos) / 4096)) % 26))
+#define READ_AHEAD_TEST_CHANGE_POS  50000
+#define READ_AHEAD_TEST_CHANGE_END  70000
+#define READ_AHEAD_TEST_CHANGED_BYTE 'Z'
+
+static ErrVal
+TestReadAhead() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    char path[512];
+    char buffer[READ_AHEAD_TEST_CHUNK_SIZE];
+    int64 pos;
+    int64 startPos;
+    int32 chunkSize;
+    int32 index;
+    int32 pass;
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamReadAhead.txt", path, 512);
+    (void) CSimpleFile::DeleteFile(path);
+    pUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < READ_AHEAD_TEST_FILE_SIZE; pos++) {
+        err = pStream->PutByte(READ_AHEAD_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    pStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pStream->Close();
+    RELEASE_OBJECT(pStream);
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    if (READ_AHEAD_TEST_FILE_SIZE != pStream->GetDataLength()) {
+        DEBUG_WARNING("Wrong file size");
+    }
+
+    // Read the whole file twice, so the second pass starts with a
+    // window that has already grown.
+    for (pass = 0; pass < 2; pass++) {
+        err = pStream->SetPosition(0);
+        if (err) {
+            gotoErr(err);
+        }
+
+        pos = 0;
+        while (pos < READ_AHEAD_TEST_FILE_SIZE) {
+            chunkSize = READ_AHEAD_TEST_CHUNK_SIZE;
+            if ((pos + chunkSize) > READ_AHEAD_TEST_FILE_SIZE) {
+                chunkSize = (int32) (READ_AHEAD_TEST_FILE_SIZE - pos);
+            }
+            err = pStream->Read(buffer, chunkSize);
+            if (err) {
+                gotoErr(err);
+            }
+            for (index = 0; index < chunkSize; index++) {
+                if (buffer[index] != READ_AHEAD_TEST_BYTE(pos + index)) {
+                    DEBUG_WARNING("Wrong byte in a sequential read");
+                    gotoErr(EFail);
+                }
+            }
+            pos += chunkSize;
+        } // while (pos < READ_AHEAD_TEST_FILE_SIZE)
+    } // for (pass = 0; pass < 2; pass++)
+
+    // Seek around the file. Most of these land in the middle of a block
+    // that is not in any buffer.
+    for (pass = 0; pass < 200; pass++) {
+        startPos = (pass * 7919) % (READ_AHEAD_TEST_FILE_SIZE - 100);
+        err = pStream->SetPosition(startPos);
+        if (!err) {
+            err = pStream->Read(buffer, 100);
+        }
+        if (err) {
+            gotoErr(err);
+        }
+        for (index = 0; index < 100; index++) {
+            if (buffer[index] != READ_AHEAD_TEST_BYTE(startPos + index)) {
+                DEBUG_WARNING("Wrong byte after a seek");
+                gotoErr(EFail);
+            }
+        }
+    } // for (pass = 0; pass < 200; pass++)
+
+    // Read a block in the middle of the range we are about to change, so
+    // the writes below move from a new buffer into one that is already in
+    // the list. Then read the whole file twice. Those reads recycle the
+    // buffers that hold the changes, so the changes must be saved first.
+    err = pStream->SetPosition(READ_AHEAD_TEST_CHANGE_POS + 8192);
+    if (!err) {
+        err = pStream->Read(buffer, 100);
+    }
+    if (!err) {
+        err = pStream->SetPosition(READ_AHEAD_TEST_CHANGE_POS);
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    for (pos = READ_AHEAD_TEST_CHANGE_POS; pos < READ_AHEAD_TEST_CHANGE_END; pos++) {
+        err = pStream->PutByte(READ_AHEAD_TEST_CHANGED_BYTE);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        err = pStream->SetPosition(0);
+        if (err) {
+            gotoErr(err);
+        }
+
+        pos = 0;
+        while (pos < READ_AHEAD_TEST_FILE_SIZE) {
+            chunkSize = READ_AHEAD_TEST_CHUNK_SIZE;
+            if ((pos + chunkSize) > READ_AHEAD_TEST_FILE_SIZE) {
+                chunkSize = (int32) (READ_AHEAD_TEST_FILE_SIZE - pos);
+            }
+            err = pStream->Read(buffer, chunkSize);
+            if (err) {
+                gotoErr(err);
+            }
+            for (index = 0; index < chunkSize; index++) {
+                if (((pos + index) >= READ_AHEAD_TEST_CHANGE_POS)
+                        && ((pos + index) < READ_AHEAD_TEST_CHANGE_END)) {
+                    if (buffer[index] != READ_AHEAD_TEST_CHANGED_BYTE) {
+                        DEBUG_WARNING("Lost a change when a buffer was recycled");
+                        gotoErr(EFail);
+                    }
+                } else if (buffer[index] != READ_AHEAD_TEST_BYTE(pos + index)) {
+                    DEBUG_WARNING("Wrong byte in a sequential read");
+                    gotoErr(EFail);
+                }
+            }
+            pos += chunkSize;
+        } // while (pos < READ_AHEAD_TEST_FILE_SIZE)
+    } // for (pass = 0; pass < 2; pass++)
+
+    // Put back the original bytes. TestMappedFile reads this file.
+    err = pStream->SetPosition(READ_AHEAD_TEST_CHANGE_POS);
+    if (err) {
+        gotoErr(err);
+    }
+    for (pos = READ_AHEAD_TEST_CHANGE_POS; pos < READ_AHEAD_TEST_CHANGE_END; pos++) {
+        err = pStream->PutByte(READ_AHEAD_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    pStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    if (pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // TestReadAhead.
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestSeekBackAfterWrite]
+//
+// This writes a file a byte at a time, so the buffers it leaves behind
+// have more bytes than the stream has counted, and then seeks back into
+// them and changes a few bytes. The file is then reopened and read from
+// the middle of blocks that are not in memory yet.
+/////////////////////////////////////////////////////////////////////////////
+#define SEEK_BACK_TEST_FILE_SIZE    (3 * 4096 + 500)
+#define SEEK_BACK_TEST_BYTE(pos)    ((char) ('a' + ((pos) % 17)))
+#define SEEK_BACK_TEST_CHANGE_POS   100
+#define SEEK_BACK_TEST_CHANGED_BYTE '*'
+#define SEEK_BACK_TEST_NUM_CHANGES  10
+#define SEEK_BACK_TEST_TAIL_BYTE    '!'
+
+static int64 g_SeekBackTestPositions[] = { SEEK_BACK_TEST_FILE_SIZE - 7, 4096 + 13, 2 * 4096 + 2000, 13, -1 };
+
+static char
+SeekBackTestExpectedByte(int64 pos) {
+    if ((pos >= SEEK_BACK_TEST_CHANGE_POS)
+            && (pos < (SEEK_BACK_TEST_CHANGE_POS + SEEK_BACK_TEST_NUM_CHANGES))) {
+        return(SEEK_BACK_TEST_CHANGED_BYTE);
+    }
+    if (pos == SEEK_BACK_TEST_FILE_SIZE) {
+        return(SEEK_BACK_TEST_TAIL_BYTE);
+    }
+    return(SEEK_BACK_TEST_BYTE(pos));
+} // SeekBackTestExpectedByte.
+
+
+static ErrVal
+TestSeekBackAfterWrite() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    char path[512];
+    char c;
+    int32 index;
+    int64 pos;
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamSeekBack.txt", path, 512);
+    (void) CSimpleFile::DeleteFile(path);
+    pUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE
+                                | CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < SEEK_BACK_TEST_FILE_SIZE; pos++) {
+        err = pStream->PutByte(SEEK_BACK_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    // Seek back into the first block, which is still in the buffer list.
+    err = pStream->SetPosition(SEEK_BACK_TEST_CHANGE_POS);
+    if (err) {
+        gotoErr(err);
+    }
+    if (SEEK_BACK_TEST_FILE_SIZE != pStream->GetDataLength()) {
+        DEBUG_WARNING("Wrong stream length after seeking back");
+    }
+    for (index = 0; index < SEEK_BACK_TEST_NUM_CHANGES; index++) {
+        err = pStream->PutByte(SEEK_BACK_TEST_CHANGED_BYTE);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    // Every byte written before the seek can still be reached.
+    err = pStream->SetPosition(SEEK_BACK_TEST_FILE_SIZE - 1);
+    if (!err) {
+        err = pStream->GetByte(&c);
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    if (c != SEEK_BACK_TEST_BYTE(SEEK_BACK_TEST_FILE_SIZE - 1)) {
+        DEBUG_WARNING("Wrong byte at the end of the stream");
+    }
+    err = pStream->PutByte(SEEK_BACK_TEST_TAIL_BYTE);
+    if (err) {
+        gotoErr(err);
+    }
+
+    pStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pStream->Close();
+    RELEASE_OBJECT(pStream);
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    if ((SEEK_BACK_TEST_FILE_SIZE + 1) != pStream->GetDataLength()) {
+        DEBUG_WARNING("Wrong file size after seeking back");
+    }
+
+    // Each of these is in the middle of a block that has not been read,
+    // so SetPosition must put the cursor on the byte, not the block start.
+    for (index = 0; g_SeekBackTestPositions[index] >= 0; index++) {
+        pos = g_SeekBackTestPositions[index];
+        err = pStream->SetPosition(pos);
+        if (!err) {
+            err = pStream->GetByte(&c);
+        }
+        if (err) {
+            gotoErr(err);
+        }
+        if ((c != SeekBackTestExpectedByte(pos))
+                || (pStream->GetPosition() != (pos + 1))) {
+            DEBUG_WARNING("Wrong byte after seeking into an unread block");
+        }
+    }
+
+    err = pStream->SetPosition(0);
+    if (err) {
+        gotoErr(err);
+    }
+    for (pos = 0; pos <= SEEK_BACK_TEST_FILE_SIZE; pos++) {
+        err = pStream->GetByte(&c);
+        if (err) {
+            gotoErr(err);
+        }
+        if (c != SeekBackTestExpectedByte(pos)) {
+            DEBUG_WARNING("Wrong byte after seeking back");
+            gotoErr(EFail);
+        }
+    }
+
+abort:
+    if (pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // TestSeekBackAfterWrite.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestMappedFile]
+//
+// This reopens the file from TestReadAhead as a mapped file. The whole
+// file should come back from one GetPtrRef, and a copy should match.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestMappedFile() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    char path[512];
+    char buffer[100];
+    char *pData;
+    char *pTempPtr;
+    int32 length;
+    int32 index;
+    int64 pos;
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamReadAhead.txt", path, 512);
+    pUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::USE_MEMORY_MAP
+                                | CAsyncBlockIO::RANDOM_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    err = pStream->GetPtrRef(0, -1, &pData, &length);
+    if (err) {
+        gotoErr(err);
+    }
+#if LINUX
+    if (READ_AHEAD_TEST_FILE_SIZE != length) {
+        DEBUG_WARNING("A mapped file is not one buffer");
+    }
+#endif
+    for (pos = 0; pos < length; pos++) {
+        if (pData[pos] != READ_AHEAD_TEST_BYTE(pos)) {
+            DEBUG_WARNING("Wrong byte in a mapped file");
+            gotoErr(EFail);
+        }
+    }
+
+    // GetPtr never needs the temp buffer.
+    err = pStream->GetPtr(5000, 20000, NULL, 0, &pTempPtr);
+#if LINUX
+    if ((err) || (pTempPtr != (pData + 5000))) {
+        DEBUG_WARNING("GetPtr copied from a mapped file");
+    }
+#endif
+
+    err = pStream->SetPosition(READ_AHEAD_TEST_FILE_SIZE - 100);
+    if (!err) {
+        err = pStream->Read(buffer, 100);
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    for (index = 0; index < 100; index++) {
+        if (buffer[index] != READ_AHEAD_TEST_BYTE(READ_AHEAD_TEST_FILE_SIZE - 100 + index)) {
+            DEBUG_WARNING("Wrong byte at the end of a mapped file");
+            gotoErr(EFail);
+        }
+    }
+
+abort:
+    if (pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // TestMappedFile.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestSharedCacheBlocks]
+//
+// This reads the file from TestReadAhead through the file block cache.
+// Two more streams, opened without WRITE_ACCESS, should then point at the
+// same cached bytes rather than each reading a copy of their own.
+/////////////////////////////////////////////////////////////////////////////
+#define SHARED_BLOCK_TEST_CACHE_BLOCKS  64
+#define SHARED_BLOCK_TEST_POS           (9 * 4096 + 17)
+
+static ErrVal
+TestSharedCacheBlocks() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream[3] = { NULL, NULL, NULL };
+    CParsedUrl *pUrl = NULL;
+    char path[512];
+    char buffer[READ_AHEAD_TEST_CHUNK_SIZE];
+    char *pData[3];
+    int32 length;
+    int32 streamNum;
+    int32 index;
+    int64 pos;
+
+    err = SetFileBlockCacheSize(SHARED_BLOCK_TEST_CACHE_BLOCKS);
+    if (err) {
+        gotoErr(err);
+    }
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamReadAhead.txt", path, 512);
+    pUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    for (streamNum = 0; streamNum < 3; streamNum++) {
+        err = CAsyncIOStream::OpenAsyncIOStream(
+                                  pUrl,
+                                  CAsyncBlockIO::READ_ACCESS,
+                                  g_TestCallback,
+                                  NULL);
+        if (!err) {
+            err = g_TestCallback->Wait();
+        }
+        if (err) {
+            gotoErr(err);
+        }
+        pStream[streamNum] = g_TestCallback->m_pAsyncIOStream;
+        g_TestCallback->m_pAsyncIOStream = NULL;
+    }
+
+    // The first stream reads the whole file, which fills the cache. The
+    // last stream reads it after that, through shared blocks.
+    for (streamNum = 0; streamNum < 3; streamNum += 2) {
+        for (pos = 0; pos < READ_AHEAD_TEST_FILE_SIZE; pos += length) {
+            length = READ_AHEAD_TEST_CHUNK_SIZE;
+            if (length > (READ_AHEAD_TEST_FILE_SIZE - pos)) {
+                length = (int32) (READ_AHEAD_TEST_FILE_SIZE - pos);
+            }
+            err = pStream[streamNum]->Read(buffer, length);
+            if (err) {
+                gotoErr(err);
+            }
+            for (index = 0; index < length; index++) {
+                if (buffer[index] != READ_AHEAD_TEST_BYTE(pos + index)) {
+                    DEBUG_WARNING("Wrong byte read through the block cache");
+                    gotoErr(EFail);
+                }
+            }
+        }
+    }
+
+    for (streamNum = 1; streamNum < 3; streamNum++) {
+        err = pStream[streamNum]->GetPtrRef(SHARED_BLOCK_TEST_POS, -1, &(pData[streamNum]), &length);
+        if (err) {
+            gotoErr(err);
+        }
+        if ((length <= 0) || (*(pData[streamNum]) != READ_AHEAD_TEST_BYTE(SHARED_BLOCK_TEST_POS))) {
+            DEBUG_WARNING("Wrong byte in a shared block");
+            gotoErr(EFail);
+        }
+    }
+#if LINUX
+    if (pData[1] != pData[2]) {
+        DEBUG_WARNING("Two read-only streams did not share a cached block");
+    }
+#endif
+
+abort:
+    for (streamNum = 0; streamNum < 3; streamNum++) {
+        if (pStream[streamNum]) {
+            pStream[streamNum]->Close();
+        }
+        RELEASE_OBJECT(pStream[streamNum]);
+    }
+    RELEASE_OBJECT(pUrl);
+    (void) SetFileBlockCacheSize(0);
+
+    returnErr(err);
+} // TestSharedCacheBlocks.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestDurableFlush]
+//
+// This changes one byte in each block of a file, working backward, so
+// the dirty buffers are not in file order when the stream is flushed.
+// A second stream on the same file flushes too, so the two streams share
+// a sync group.
+/////////////////////////////////////////////////////////////////////////////
+#define DURABLE_TEST_FILE_SIZE      (6 * 4096 + 500)
+#define DURABLE_TEST_BYTE(pos)      ((char) ('A' + ((pos) % 23)))
+#define DURABLE_TEST_CHANGED_BYTE   '#'
+
+static ErrVal
+TestDurableFlush() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CAsyncIOStream *pOtherStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    char path[512];
+    char c;
+    char expectedByte;
+    int64 pos;
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamDurable.txt", path, 512);
+    (void) CSimpleFile::DeleteFile(path);
+    pUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE
+                                | CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::WRITE_ACCESS
+                                | CAsyncBlockIO::DURABLE_FLUSH,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < DURABLE_TEST_FILE_SIZE; pos++) {
+        err = pStream->PutByte(DURABLE_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    pStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::WRITE_ACCESS
+                                | CAsyncBlockIO::DURABLE_FLUSH,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pOtherStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = DURABLE_TEST_FILE_SIZE - 1; pos >= 0; pos -= 4096) {
+        err = pStream->SetPosition(pos);
+        if (!err) {
+            err = pStream->PutByte(DURABLE_TEST_CHANGED_BYTE);
+        }
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    pStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pOtherStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pStream->Close();
+    RELEASE_OBJECT(pStream);
+    pOtherStream->Close();
+    RELEASE_OBJECT(pOtherStream);
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    if (DURABLE_TEST_FILE_SIZE != pStream->GetDataLength()) {
+        DEBUG_WARNING("Wrong file size");
+    }
+    for (pos = 0; pos < DURABLE_TEST_FILE_SIZE; pos++) {
+        err = pStream->GetByte(&c);
+        if (err) {
+            gotoErr(err);
+        }
+        expectedByte = DURABLE_TEST_BYTE(pos);
+        if (0 == ((DURABLE_TEST_FILE_SIZE - 1 - pos) % 4096)) {
+            expectedByte = DURABLE_TEST_CHANGED_BYTE;
+        }
+        if (c != expectedByte) {
+            DEBUG_WARNING("Wrong byte after a durable flush");
+            gotoErr(EFail);
+        }
+    }
+
+abort:
+    if (pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    if (pOtherStream) {
+        pOtherStream->Close();
+    }
+    RELEASE_OBJECT(pOtherStream);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // TestDurableFlush.
+
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestCopyFile]
+//
+// This copies the end of one file into the middle of another, so the copy
+// overwrites part of the destination and then grows it. Neither file is
+// flushed first, so the copy has to save the buffers of both.
+/////////////////////////////////////////////////////////////////////////////
+#define COPY_TEST_SRC_SIZE          (5 * 4096 + 700)
+#define COPY_TEST_SRC_START         1500
+#define COPY_TEST_SRC_BYTE(pos)     ((char) ('a' + ((pos) % 19)))
+#define COPY_TEST_DEST_SIZE         (3 * 4096 + 100)
+#define COPY_TEST_DEST_START        2000
+#define COPY_TEST_DEST_BYTE         '-'
+#define COPY_TEST_TAIL_BYTE         '!'
+#define COPY_TEST_NUM_COPIED_BYTES  (COPY_TEST_SRC_SIZE - COPY_TEST_SRC_START)
+#define COPY_TEST_DEST_STOP         (COPY_TEST_DEST_START + COPY_TEST_NUM_COPIED_BYTES)
+
+static ErrVal
+TestCopyFile() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pSrcStream = NULL;
+    CAsyncIOStream *pDestStream = NULL;
+    CParsedUrl *pSrcUrl = NULL;
+    CParsedUrl *pDestUrl = NULL;
+    char path[512];
+    char c;
+    char expectedByte;
+    int64 pos;
+
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamCopySrc.txt", path, 512);
+    (void) CSimpleFile::DeleteFile(path);
+    pSrcUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pSrcUrl) {
+        gotoErr(EFail);
+    }
+    g_DebugManager.AddTestResultsDirectoryPath("asyncIOStreamCopyDest.txt", path, 512);
+    (void) CSimpleFile::DeleteFile(path);
+    pDestUrl = CParsedUrl::AllocateFileUrl(path);
+    if (NULL == pDestUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pSrcUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE
+                                | CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pSrcStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pDestUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE
+                                | CAsyncBlockIO::READ_ACCESS
+                                | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pDestStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < COPY_TEST_SRC_SIZE; pos++) {
+        err = pSrcStream->PutByte(COPY_TEST_SRC_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    for (pos = 0; pos < COPY_TEST_DEST_SIZE; pos++) {
+        err = pDestStream->PutByte(COPY_TEST_DEST_BYTE);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    err = pSrcStream->SetPosition(COPY_TEST_SRC_START);
+    if (err) {
+        gotoErr(err);
+    }
+    err = pDestStream->SetPosition(COPY_TEST_DEST_START);
+    if (err) {
+        gotoErr(err);
+    }
+    err = pSrcStream->CopyStream(pDestStream, CAsyncIOStream::COPY_TO_EOF, false);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // The destination carries on writing after the copied bytes.
+    if ((COPY_TEST_DEST_STOP != pDestStream->GetPosition())
+        || (COPY_TEST_DEST_STOP != pDestStream->GetDataLength())) {
+        DEBUG_WARNING("Wrong position after a copy");
+    }
+
+    // The open destination stream must not read the old bytes from a
+    // buffer it held before the copy.
+    err = pDestStream->SetPosition(0);
+    if (err) {
+        gotoErr(err);
+    }
+    for (pos = 0; pos < COPY_TEST_DEST_STOP; pos++) {
+        err = pDestStream->GetByte(&c);
+        if (err) {
+            gotoErr(err);
+        }
+        if (pos < COPY_TEST_DEST_START) {
+            expectedByte = COPY_TEST_DEST_BYTE;
+        } else {
+            expectedByte = COPY_TEST_SRC_BYTE(pos - COPY_TEST_DEST_START + COPY_TEST_SRC_START);
+        }
+        if (c != expectedByte) {
+            DEBUG_WARNING("Wrong byte in an open stream after a copy");
+            gotoErr(EFail);
+        }
+    }
+
+    err = pDestStream->PutByte(COPY_TEST_TAIL_BYTE);
+    if (err) {
+        gotoErr(err);
+    }
+
+    pDestStream->Flush();
+    err = g_TestCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pSrcStream->Close();
+    RELEASE_OBJECT(pSrcStream);
+    pDestStream->Close();
+    RELEASE_OBJECT(pDestStream);
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pDestUrl,
+                              CAsyncBlockIO::READ_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pDestStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    if ((COPY_TEST_DEST_STOP + 1) != pDestStream->GetDataLength()) {
+        DEBUG_WARNING("Wrong file size after a copy");
+    }
+    for (pos = 0; pos <= COPY_TEST_DEST_STOP; pos++) {
+        err = pDestStream->GetByte(&c);
+        if (err) {
+            gotoErr(err);
+        }
+        if (pos < COPY_TEST_DEST_START) {
+            expectedByte = COPY_TEST_DEST_BYTE;
+        } else if (pos < COPY_TEST_DEST_STOP) {
+            expectedByte = COPY_TEST_SRC_BYTE(pos - COPY_TEST_DEST_START + COPY_TEST_SRC_START);
+        } else {
+            expectedByte = COPY_TEST_TAIL_BYTE;
+        }
+        if (c != expectedByte) {
+            DEBUG_WARNING("Wrong byte after a copy");
+            gotoErr(EFail);
+        }
+    }
+
+abort:
+    if (pSrcStream) {
+        pSrcStream->Close();
+    }
+    RELEASE_OBJECT(pSrcStream);
+    if (pDestStream) {
+        pDestStream->Close();
+    }
+    RELEASE_OBJECT(pDestStream);
+    RELEASE_OBJECT(pSrcUrl);
+    RELEASE_OBJECT(pDestUrl);
+
+    returnErr(err);
+} // TestCopyFile.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestByteCursor]
+//
+// This walks a memory stream of several buffers with a cursor checked out,
+// and backs up now and then, sometimes across the start of a buffer. It
+// also asks for the position in the middle of a window, and seeks to other
+// buffers, which both close the window.
+/////////////////////////////////////////////////////////////////////////////
+#define CURSOR_TEST_SIZE            (10 * 1024 + 77)
+#define CURSOR_TEST_BYTE(pos)       ((char) ('A' + ((pos) % 23)))
+#define CURSOR_TEST_UNGET_INTERVAL  37
+
+static ErrVal
+TestByteCursor() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    CRefLock *pLock = NULL;
+    char c;
+    char peekedByte;
+    int64 pos;
+
+    pUrl = CParsedUrl::AllocateMemoryUrl(NULL, 0, 0);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < CURSOR_TEST_SIZE; pos++) {
+        err = pStream->PutByte(CURSOR_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    err = pStream->SetPosition(0);
+    if (err) {
+        gotoErr(err);
+    }
+    pLock = pStream->GetLock();
+    if (NULL == pLock) {
+        gotoErr(EFail);
+    }
+
+    // Nest the check-outs, as a parser that calls a helper would.
+    err = pStream->CheckOutCursor();
+    if (!err) {
+        err = pStream->CheckOutCursor();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    if (pLock->IsLocked()) {
+        DEBUG_WARNING("A stream is locked while its cursor is checked out");
+    }
+
+    for (pos = 0; pos < CURSOR_TEST_SIZE; pos++) {
+        err = pStream->PeekByte(&peekedByte);
+        if (!err) {
+            err = pStream->GetByte(&c);
+        }
+        if (err) {
+            DEBUG_WARNING("Cannot read through a cursor");
+            break;
+        }
+        if ((c != CURSOR_TEST_BYTE(pos)) || (peekedByte != c)) {
+            DEBUG_WARNING("Wrong byte read through a cursor");
+            break;
+        }
+
+        if (0 == (pos % CURSOR_TEST_UNGET_INTERVAL)) {
+            err = pStream->UnGetByte();
+            if (!err) {
+                err = pStream->GetByte(&c);
+            }
+            if ((err) || (c != CURSOR_TEST_BYTE(pos))) {
+                DEBUG_WARNING("Wrong byte after backing up a cursor");
+                break;
+            }
+            if (pStream->GetPosition() != pos + 1) {
+                DEBUG_WARNING("A cursor is at the wrong position");
+                break;
+            }
+        }
+    } // for (pos = 0; pos < CURSOR_TEST_SIZE; pos++)
+
+    if (pStream->GetPosition() != CURSOR_TEST_SIZE) {
+        DEBUG_WARNING("A cursor is at the wrong position");
+    }
+
+    // Seek back to the first buffer and read it through a new window.
+    err = pStream->SetPosition(1);
+    if (!err) {
+        err = pStream->GetByte(&c);
+    }
+    if ((err) || (c != CURSOR_TEST_BYTE(1))) {
+        DEBUG_WARNING("Wrong byte read through a cursor after a seek");
+    }
+
+    pStream->CheckInCursor();
+    pStream->CheckInCursor();
+    err = ENoErr;
+
+    if (pStream->GetPosition() != 2) {
+        DEBUG_WARNING("A cursor is at the wrong position after it is checked in");
+    }
+    if (pLock->IsLocked()) {
+        DEBUG_WARNING("A stream is still locked after its cursor is checked in");
+    }
+
+abort:
+    RELEASE_OBJECT(pLock);
+    if (NULL != pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+    returnErr(err);
+} // TestByteCursor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestCursorOtherThread]
+//
+// While this thread holds a cursor, a second thread tries to check out a
+// cursor, checks one in, and reads a byte. The stream is not locked, so it
+// does not wait, but it cannot move the read position and its stray
+// check-in must not close this thread's cursor.
+/////////////////////////////////////////////////////////////////////////////
+#define CURSOR_THREAD_TEST_NUM_READS    100
+
+static CAsyncIOStream *g_pCursorTestStream = NULL;
+static ErrVal g_CursorTestCheckOutErr = ENoErr;
+static ErrVal g_CursorTestOtherErr = ENoErr;
+static CRefEvent *g_pCursorTestThreadDone = NULL;
+
+static void
+CursorTestThreadProc(void *arg, CSimpleThread *pThread) {
+    char c;
+    UNUSED_PARAM(arg);
+    UNUSED_PARAM(pThread);
+
+    g_CursorTestCheckOutErr = g_pCursorTestStream->CheckOutCursor();
+    g_pCursorTestStream->CheckInCursor();
+    g_CursorTestOtherErr = g_pCursorTestStream->GetByte(&c);
+    g_pCursorTestThreadDone->Signal();
+} // CursorTestThreadProc.
+
+
+static ErrVal
+TestCursorOtherThread() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    char c;
+    int64 pos;
+
+    g_pCursorTestThreadDone = newex CRefEvent;
+    if (NULL == g_pCursorTestThreadDone) {
+        gotoErr(EFail);
+    }
+    err = g_pCursorTestThreadDone->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    pUrl = CParsedUrl::AllocateMemoryUrl(NULL, 0, 0);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < CURSOR_TEST_SIZE; pos++) {
+        err = pStream->PutByte(CURSOR_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    err = pStream->SetPosition(0);
+    if (err) {
+        gotoErr(err);
+    }
+
+    err = pStream->CheckOutCursor();
+    if (err) {
+        gotoErr(err);
+    }
+    for (pos = 0; pos < CURSOR_THREAD_TEST_NUM_READS; pos++) {
+        err = pStream->GetByte(&c);
+        if ((err) || (c != CURSOR_TEST_BYTE(pos))) {
+            DEBUG_WARNING("Wrong byte read through a cursor");
+            break;
+        }
+    }
+
+    g_pCursorTestStream = pStream;
+    g_CursorTestCheckOutErr = ENoErr;
+    g_CursorTestOtherErr = ENoErr;
+    err = CSimpleThread::CreateThread(
+                             "CursorTestThread",
+                             CursorTestThreadProc,
+                             NULL,
+                             NULL);
+    if (err) {
+        pStream->CheckInCursor();
+        gotoErr(err);
+    }
+    g_pCursorTestThreadDone->Wait();
+
+    if ((EFileIsBusy != g_CursorTestCheckOutErr)
+        || (EFileIsBusy != g_CursorTestOtherErr)) {
+        DEBUG_WARNING("Another thread used a stream while a cursor was out");
+    }
+
+    // The cursor is still ours, and still where we left it.
+    err = pStream->GetByte(&c);
+    if ((err) || (c != CURSOR_TEST_BYTE(CURSOR_THREAD_TEST_NUM_READS))) {
+        DEBUG_WARNING("Another thread moved a cursor it does not own");
+    }
+    err = ENoErr;
+    pStream->CheckInCursor();
+
+    if (pStream->GetPosition() != CURSOR_THREAD_TEST_NUM_READS + 1) {
+        DEBUG_WARNING("A cursor is at the wrong position");
+    }
+
+abort:
+    g_pCursorTestStream = NULL;
+    RELEASE_OBJECT(g_pCursorTestThreadDone);
+    if (NULL != pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+    returnErr(err);
+} // TestCursorOtherThread.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestStreamSpans]
+//
+// This walks a memory stream of several buffers as spans, from a position
+// that is not at the start of a buffer, both to the end and for a bounded
+// number of bytes.
+/////////////////////////////////////////////////////////////////////////////
+#define SPAN_TEST_SIZE              (10 * 1024 + 77)
+#define SPAN_TEST_BYTE(pos)         ((char) ('a' + ((pos) % 19)))
+#define SPAN_TEST_START             333
+#define SPAN_TEST_BOUNDED_LENGTH    (3 * 1024 + 5)
+
+static ErrVal
+TestStreamSpans() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    CIOStreamSpanIterator spans;
+    const char *pSpan;
+    int32 spanLength;
+    int32 index;
+    int32 numSpans;
+    int64 pos;
+    int64 testNum;
+    int64 numBytes;
+
+    pUrl = CParsedUrl::AllocateMemoryUrl(NULL, 0, 0);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    for (pos = 0; pos < SPAN_TEST_SIZE; pos++) {
+        err = pStream->PutByte(SPAN_TEST_BYTE(pos));
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    // The first pass runs to the end of the stream, the second stops early.
+    for (testNum = 0; testNum < 2; testNum++) {
+        if (0 == testNum) {
+            numBytes = SPAN_TEST_SIZE - SPAN_TEST_START;
+            err = spans.Start(pStream, SPAN_TEST_START, -1);
+        } else {
+            numBytes = SPAN_TEST_BOUNDED_LENGTH;
+            err = spans.Start(pStream, SPAN_TEST_START, SPAN_TEST_BOUNDED_LENGTH);
+        }
+        if (err) {
+            gotoErr(err);
+        }
+
+        pos = SPAN_TEST_START;
+        numSpans = 0;
+        while (spans.GetNextSpan(&pSpan, &spanLength)) {
+            numSpans += 1;
+            if (spans.GetSpanPosition() != pos) {
+                DEBUG_WARNING("A span is not at the end of the previous span");
+                break;
+            }
+            for (index = 0; index < spanLength; index++) {
+                if (pSpan[index] != SPAN_TEST_BYTE(pos + index)) {
+                    DEBUG_WARNING("Wrong byte in a span");
+                    break;
+                }
+            }
+            pos += spanLength;
+        } // while (spans.GetNextSpan(&pSpan, &spanLength))
+        spans.Stop();
+
+        if ((pos - SPAN_TEST_START) != numBytes) {
+            DEBUG_WARNING("The spans do not cover the requested bytes");
+        }
+        if (numSpans < 2) {
+            DEBUG_WARNING("The spans did not cross a buffer");
+        }
+    } // for (testNum = 0; testNum < 2; testNum++)
+
+abort:
+    spans.Stop();
+    if (NULL != pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+    returnErr(err);
+} // TestStreamSpans.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestFindString]
+//
+// This plants a pattern in a memory stream so that each copy straddles two
+// 1K buffers at a different split, and finds each copy in turn. It also
+// checks that stopPosition ends the search. The string library test
+// covers matches at every offset within one buffer.
+/////////////////////////////////////////////////////////////////////////////
+#define FIND_TEST_SIZE              (4 * 1024)
+#define FIND_TEST_BYTE(pos)         ((char) ('a' + ((pos) % 7)))
+#define FIND_TEST_PATTERN           "--BoundaryX"
+#define FIND_TEST_NUM_MATCHES       3
+
+static int64 g_FindTestMatchPositions[FIND_TEST_NUM_MATCHES] = { 1024 - 1, 2048 - 5, 3072 - 10 };
+
+static ErrVal
+TestFindString() {
+    ErrVal err = ENoErr;
+    CAsyncIOStream *pStream = NULL;
+    CParsedUrl *pUrl = NULL;
+    int32 patternLength = strlen(FIND_TEST_PATTERN);
+    int32 matchNum;
+    int64 matchPos;
+    int64 pos;
+    char c;
+
+    pUrl = CParsedUrl::AllocateMemoryUrl(NULL, 0, 0);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                              g_TestCallback,
+                              NULL);
+    if (!err) {
+        err = g_TestCallback->Wait();
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pStream = g_TestCallback->m_pAsyncIOStream;
+    g_TestCallback->m_pAsyncIOStream = NULL;
+
+    matchNum = 0;
+    for (pos = 0; pos < FIND_TEST_SIZE; pos++) {
+        c = FIND_TEST_BYTE(pos);
+        if ((matchNum < FIND_TEST_NUM_MATCHES)
+            && (pos >= g_FindTestMatchPositions[matchNum])) {
+            c = FIND_TEST_PATTERN[pos - g_FindTestMatchPositions[matchNum]];
+            if ((pos + 1 - g_FindTestMatchPositions[matchNum]) >= patternLength) {
+                matchNum += 1;
+            }
+        }
+        err = pStream->PutByte(c);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    // The search stops before the end of the first copy.
+    err = pStream->SetPosition(0);
+    if (err) {
+        gotoErr(err);
+    }
+    matchPos = pStream->FindString(
+                            FIND_TEST_PATTERN,
+                            patternLength,
+                            0,
+                            g_FindTestMatchPositions[0] + patternLength - 1);
+    if ((matchPos >= 0) || (pStream->GetPosition() != 0)) {
+        DEBUG_WARNING("Found a string past the stop position");
+    }
+
+    for (matchNum = 0; matchNum < FIND_TEST_NUM_MATCHES; matchNum++) {
+        matchPos = pStream->FindString(FIND_TEST_PATTERN, patternLength, 0, -1);
+        if ((matchPos != g_FindTestMatchPositions[matchNum])
+            || (pStream->GetPosition() != matchPos)) {
+            DEBUG_WARNING("Did not find a string at the right position");
+            break;
+        }
+
+        err = pStream->SetPosition(matchPos + 1);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+abort:
+    if (NULL != pStream) {
+        pStream->Close();
+    }
+    RELEASE_OBJECT(pStream);
+    RELEASE_OBJECT(pUrl);
+    returnErr(err);
+} // TestFindString.
+
+
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [TestCompareStreams]
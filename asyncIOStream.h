@@ -140,6 +140,12 @@ public:
     bool IsOpen() {return(NULL != m_pBlockIO);}
     CRefLock *GetLock();
 
+    // This changes who receives events for an open stream. A connection
+    // pool uses it to pass an idle connection from one owner to the next.
+    void SetEventHandler(
+                CAsyncIOEventHandler *pEventHandler,
+                void *pEventHandlerContext);
+
     // Some devices, like network connections, are asynchronous. In those cases,
     // we may have to wait until enough data becomes available to read.
     int64 GetDataLength();
@@ -151,6 +157,15 @@ public:
     void ListenForAllBytesToEOF();
     void Flush();
 
+    // A thread that reads many bytes in a row can check out a cursor. Until
+    // it checks the cursor back in, that thread owns the read position and
+    // the byte methods of any other thread fail with EFileIsBusy. The owner
+    // reads through a window of the active buffer, so GetByte, PeekByte and
+    // UnGetByte only lock the stream when they reach the edge of the window.
+    // The stream is not locked while the cursor is out. Check-outs may nest.
+    ErrVal CheckOutCursor();
+    void CheckInCursor();
+
     // These read and write bytes.
     inline ErrVal GetByte(char *c);
     inline ErrVal PeekByte(char *c);
@@ -212,6 +227,9 @@ public:
     PASS_REFCOUNT_TO_REFCOUNTIMPL()
 
 private:
+    friend class CIOStreamSpanIterator;
+    friend class CDurableFlushJob;
+
     enum AsyncIOStreamPrivateConstants
     {
         // Flags for m_AsyncIOStreamFlags.
@@ -222,9 +240,17 @@ private:
         UDP_READ_STREAM                 = 0x0010,
         ALL_DATA_IS_IN_BUFFERS          = 0x0020,
         EXPANDING_MEMORY_STREAM         = 0x0040,
+        READ_ONLY_STREAM                = 0x0080,
 
         MIN_REASONABLE_NETWORK_PACKET   = 400,
 
+        // This is the most bytes that one SEND_FROM_FILE buffer describes.
+        MAX_SEND_FILE_CHUNK             = 0x40000000,
+
+        // CopyStream copies fewer bytes than this rather than forwarding
+        // them in a slice of the source buffer.
+        MIN_FORWARD_SLICE_BYTES         = 1024,
+
         // These are the states we pass through while parsing format strings.
         PRINTF_FORMAT_NORMAL_CHAR       = 0,
         PRINTF_FORMAT_ESCAPED_CHAR      = 1,
@@ -249,18 +275,63 @@ private:
     void ContinueAsyncLoad(ErrVal resultErr, bool fReceivedNewData);
     void FinishAsyncLoad(ErrVal resultErr);
 
-    CIOBuffer *AllocAsyncIOStreamBuffer(int64 newPos, bool fInputBuffer);
+    ErrVal UseDataInPlace(char *pData, int32 bufferLength, int32 numValidBytes);
+    CIOBuffer *AllocAsyncIOStreamBuffer(int64 newPos, bool fInputBuffer, int32 bufferSize = -1);
+    void DiscardIdleInputBuffer();
+    int32 GetSequentialReadSize(int64 bufferStartPos);
 
     ErrVal MoveBufferToBackground(CIOBuffer *pBuffer);
     ErrVal WriteBackgroundBuffer(CIOBuffer *pBuffer);
+    void UpdateDataLength(CIOBuffer *pBuffer);
     ErrVal WriteToStreamDevice(const char *clientBuffer, int32 bytesToWrite);
     ErrVal WriteToSeekableDevice(const char *clientBuffer, int32 bytesToWrite);
 
+    bool CanSendFileToStream(CAsyncIOStream *destStream);
+    ErrVal SendFileToStream(
+                    CAsyncIOStream *destStream,
+                    int64 srcStartPos,
+                    int64 numBytesToCopy);
+    bool CanCopyFileToStream(CAsyncIOStream *destStream);
+    ErrVal CopyFileToStream(
+                    CAsyncIOStream *destStream,
+                    int64 srcStartPos,
+                    int64 numBytesToCopy,
+                    int64 *pNumBytesCopied);
+    ErrVal WriteUnsavedBuffers();
+    bool CanForwardBufferToStream(
+                    CAsyncIOStream *destStream,
+                    CIOBuffer *pBuffer,
+                    int32 numBytes);
+    ErrVal ForwardBufferToStream(
+                    CAsyncIOStream *destStream,
+                    CIOBuffer *pBuffer,
+                    char *pStart,
+                    int32 numBytes);
+
     void FinishFlush();
+    void ReportFlush(ErrVal err);
+    bool IsCursorOwner();
+    void OpenCursorWindow();
+    void SyncCursor();
 
     int32                   m_AsyncIOStreamFlags;
     CRefLock                *m_pLock;
 
+    // This is how many cursors are checked out. The owner is the thread
+    // that checked them out, and is only changed while holding m_pLock.
+    // It is 0 when no cursor is checked out.
+    int32                   m_CursorDepth;
+    int32                   m_CursorOwner;
+
+    // This is the window of the active buffer that the owner of a cursor
+    // reads without the lock. The window holds a reference on its buffer,
+    // so a completion that replaces the active buffer cannot free the bytes
+    // under the owner. Only the owner touches these without holding m_pLock.
+    CIOBuffer               *m_pCursorBuffer;
+    char                    *m_pCursorFirstByte;
+    char                    *m_pCursorNextByte;
+    char                    *m_pCursorEndBytes;
+
     // This is the connection to the media that we are reading/writing.
     CAsyncBlockIO           *m_pBlockIO;
     CIOSystem               *m_pIOSystem;
@@ -291,6 +362,11 @@ private:
     CQueueList<CIOBuffer>   m_IOBufferList;
     int32                   m_MaxNumIOBuffersForSeekableDevices;
 
+    // A sequential reader of seekable media gets larger and larger reads.
+    // These are the size of the last one and where the next one starts.
+    int32                   m_SequentialReadBlocks;
+    int64                   m_NextSequentialReadPosition;
+
     // This is the state of the current asynch read.
     int32                   m_AsynchLoadType;
     int64                   m_LoadStartPosition;
@@ -311,6 +387,60 @@ private:
 
 
 
+
+/////////////////////////////////////////////////////////////////////////////
+// This walks the bytes of a stream as a series of contiguous spans, one per
+// buffer, so a parser can scan a whole buffer with memchr or a similar loop
+// instead of reading one byte at a time. The buffer of the current span is
+// pinned, so the stream does not reuse it until the next span is requested.
+//
+// Like GetPtrRef, this moves the stream. After GetNextSpan, the stream is
+// positioned at the start of the span it returned. The stream must not be
+// written while its spans are being read.
+/////////////////////////////////////////////////////////////////////////////
+class CIOStreamSpanIterator {
+public:
+    CIOStreamSpanIterator();
+    ~CIOStreamSpanIterator();
+
+    // A numBytes of -1 means walk to the end of the available data.
+    ErrVal Start(CAsyncIOStream *pStream, int64 startPos, int64 numBytes);
+    bool GetNextSpan(const char **ppSpan, int32 *pLength);
+    int64 GetSpanPosition() { return(m_SpanPosition); }
+    void Stop();
+
+private:
+    CAsyncIOStream          *m_pStream;
+    CIOBuffer               *m_pPinnedBuffer;
+
+    int64                   m_SpanPosition;
+    int64                   m_NextPosition;
+    int64                   m_StopPosition;
+}; // CIOStreamSpanIterator
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [IsCursorOwner]
+//
+// Only the thread that checked out a cursor may read through its window.
+// Any other thread reads m_CursorOwner without the lock, but it can never
+// see its own id there unless it stored it itself.
+/////////////////////////////////////////////////////////////////////////////
+inline bool
+CAsyncIOStream::IsCursorOwner() {
+    return((0 != m_CursorOwner)
+            && (m_CursorOwner == OSIndependantLayer::GetCurrentThreadId()));
+} // IsCursorOwner.
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [GetByte]
@@ -319,19 +449,35 @@ private:
 inline ErrVal
 CAsyncIOStream::GetByte(char *pResultChar) {
     ErrVal err;
+
+    // The owner of a cursor reads its window without the lock.
+    if ((IsCursorOwner())
+        && (pResultChar)
+        && (m_pCursorNextByte < m_pCursorEndBytes)) {
+        *pResultChar = *(m_pCursorNextByte++);
+        return(ENoErr);
+    }
+
     AutoLock(m_pLock);
 
+    if ((0 != m_CursorOwner) && (!IsCursorOwner())) {
+        return(EFileIsBusy);
+    }
+    SyncCursor();
+
     if ((pResultChar)
         && (m_pNextValidByte)
         && (m_pEndValidBytes)
         && (m_pNextValidByte < m_pEndValidBytes)) {
         *pResultChar = *(m_pNextValidByte++);
-        return(ENoErr);
+        err = ENoErr;
     } else
     {
         err = Read(pResultChar, 1);
-        return(err);
     }
+
+    OpenCursorWindow();
+    return(err);
 } // GetByte.
 
 
@@ -348,20 +494,37 @@ CAsyncIOStream::GetByte(char *pResultChar) {
 /////////////////////////////////////////////////////////////////////////////
 inline ErrVal
 CAsyncIOStream::PeekByte(char *pResultChar) {
+    ErrVal err;
+
+    // The owner of a cursor reads its window without the lock.
+    if ((IsCursorOwner())
+        && (pResultChar)
+        && (m_pCursorNextByte < m_pCursorEndBytes)) {
+        *pResultChar = *m_pCursorNextByte;
+        return(ENoErr);
+    }
+
     AutoLock(m_pLock);
 
+    if ((0 != m_CursorOwner) && (!IsCursorOwner())) {
+        return(EFileIsBusy);
+    }
+    SyncCursor();
+
     if ((pResultChar)
         && (m_pNextValidByte)
         && (m_pEndValidBytes)
         && (m_pNextValidByte < m_pEndValidBytes)) {
         *pResultChar = *m_pNextValidByte;
-        return(ENoErr);
+        err = ENoErr;
     } else
     {
-        ErrVal err = Read(pResultChar, 1);
+        err = Read(pResultChar, 1);
         (void) UnGetByte();
-        return(err);
     }
+
+    OpenCursorWindow();
+    return(err);
 } // PeekByte
 
 
@@ -375,23 +538,41 @@ CAsyncIOStream::PeekByte(char *pResultChar) {
 /////////////////////////////////////////////////////////////////////////////
 inline ErrVal
 CAsyncIOStream::UnGetByte() {
+    ErrVal err;
+
+    // The owner of a cursor reads its window without the lock.
+    if ((IsCursorOwner())
+        && (m_pCursorNextByte)
+        && (m_pCursorNextByte > m_pCursorFirstByte)) {
+        m_pCursorNextByte = m_pCursorNextByte - 1;
+        return(ENoErr);
+    }
+
     AutoLock(m_pLock);
 
+    if ((0 != m_CursorOwner) && (!IsCursorOwner())) {
+        return(EFileIsBusy);
+    }
+    SyncCursor();
+
     if ((m_pNextValidByte)
         && (m_pFirstValidByte)
         && (m_pNextValidByte > m_pFirstValidByte)) {
         m_pNextValidByte = m_pNextValidByte - 1;
-        return(ENoErr);
+        err = ENoErr;
     }
     // Otherwise, the buffer is empty. Move our position back
     // in the file.
     else if ((m_pActiveIOBuffer)
         && (m_pActiveIOBuffer->m_PosInMedia > 0)) {
-        return(SetPosition(m_pActiveIOBuffer->m_PosInMedia - 1));
+        err = SetPosition(m_pActiveIOBuffer->m_PosInMedia - 1);
     } else
     {
-        return(EFail);
+        err = EFail;
     }
+
+    OpenCursorWindow();
+    return(err);
 } // UnGetByte
 
 
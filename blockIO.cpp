@@ -62,6 +62,13 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <math.h> // for ceil
+#if LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "osIndependantLayer.h"
 #include "config.h"
@@ -83,8 +90,49 @@
 FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
 
 extern CJobQueue *g_MainJobQueue;
+extern CConfigSection *g_pBuildingBlocksConfig;
 int32 g_NumFileCallbacksActive = 0;
 
+// Each IO system keeps up to this many idle buffers of each size, so busy
+// streams reuse buffers instead of going to the heap for every block.
+static const char g_IOBufferPoolSizeConfigValueName[] = "IO Buffer Pool Buffers Per Size";
+#define DEFAULT_IDLE_BUFFERS_PER_SIZE   64
+
+// The shared idle lists are trimmed at most this often.
+#define IDLE_BUFFER_TRIM_INTERVAL_MS    1000
+
+extern bool g_ShutdownBuildingBlocks;
+
+#if LINUX
+/////////////////////////////////////////////////////////////////////////////
+// Each thread keeps a small magazine of idle buffers for each IO system, so
+// most buffers are allocated and released without taking the pool lock.
+// Only the thread that owns a magazine ever touches it. When the thread
+// exits, its magazines are flushed back to the shared lists.
+/////////////////////////////////////////////////////////////////////////////
+struct CIOBufferMagazine {
+    static void FlushOnThreadExit(void *pValue);
+
+    CIOSystem   *m_pIOSystem;
+    int32       m_PoolGeneration;
+    int32       m_NumBuffers[CIOSystem::MAX_POOLED_BUFFER_BLOCKS + 1];
+    CIOBuffer   *m_pBuffers[CIOSystem::MAX_POOLED_BUFFER_BLOCKS + 1][CIOSystem::BUFFERS_PER_MAGAZINE];
+};
+
+// One each for net, file and memory, and a spare.
+#define MAX_IO_BUFFER_MAGAZINES         4
+
+static __thread CIOBufferMagazine g_IOBufferMagazines[MAX_IO_BUFFER_MAGAZINES];
+static __thread bool g_fThreadHasIOBufferMagazines = false;
+static pthread_key_t g_IOBufferMagazineKey;
+static pthread_once_t g_IOBufferMagazineKeyOnce = PTHREAD_ONCE_INIT;
+
+static void
+CreateIOBufferMagazineKey() {
+    (void) pthread_key_create(&g_IOBufferMagazineKey, CIOBufferMagazine::FlushOnThreadExit);
+}
+#endif // LINUX
+
 // The main implementations, one each for net, file and memory.
 CIOSystem *g_pMemoryIOSystem = NULL;
 CIOSystem *g_pFileIOSystem = NULL;
@@ -116,6 +164,11 @@ CIOBuffer::CIOBuffer() : m_BlockIOBufferList(this),
     m_pIOSystem = NULL;
     m_pBlockIO = NULL;
 
+    m_pSendFileSource = NULL;
+    m_SendFilePos = 0;
+
+    m_pSliceParent = NULL;
+
 #if WIN32
     m_NTOverlappedIOInfo.Internal = 0;
     m_NTOverlappedIOInfo.InternalHigh = 0;
@@ -139,6 +192,8 @@ CIOBuffer::~CIOBuffer() {
     ASSERT(!(m_StreamBufferList.OnAnyQueue()));
 
     RELEASE_OBJECT(m_pBlockIO);
+    RELEASE_OBJECT(m_pSendFileSource);
+    RELEASE_OBJECT(m_pSliceParent);
 
     if ((m_BufferFlags & CIOBuffer::ALLOCATED_BUFFER)
         && (NULL != m_pPhysicalBuffer)) {
@@ -150,6 +205,47 @@ CIOBuffer::~CIOBuffer() {
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReleaseImpl]
+//
+// If this is the last reference, then the IO system may keep the buffer
+// on its idle list. Nobody else can see the buffer then, so there is no
+// race between checking the refcount and recycling.
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOBuffer::ReleaseImpl(const char *pFileName, int32 lineNum) {
+    if ((1 == m_cRef)
+        && (NULL != m_pIOSystem)
+        && (m_pIOSystem->RecycleIOBuffer(this))) {
+        return;
+    }
+
+    DefaultReleaseImpl(pFileName, lineNum);
+} // ReleaseImpl.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [DeleteIdleIOBuffer]
+//
+// A buffer with no IO system is not recycled, so its last release deletes
+// it. Idle buffers only have their single reference.
+/////////////////////////////////////////////////////////////////////////////
+static void
+DeleteIdleIOBuffer(CIOBuffer *pBuffer) {
+    pBuffer->m_pIOSystem = NULL;
+    RELEASE_OBJECT(pBuffer);
+} // DeleteIdleIOBuffer.
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [ProcessJob]
@@ -186,6 +282,28 @@ CIOBuffer::CheckState() {
     // Do not check the chain of asynch buffers, since this is
     // done without getting the lock.
 
+    // A buffer that sends bytes from a file has no memory of its own.
+    if (m_BufferFlags & CIOBuffer::SEND_FROM_FILE) {
+        if ((NULL == m_pSendFileSource)
+            || (m_SendFilePos < 0)
+            || (m_NumValidBytes < 0)
+            || (NULL == m_pIOSystem)) {
+            returnErr(EFail);
+        }
+        returnErr(ENoErr);
+    }
+
+    // A slice must stay inside the memory of its parent.
+    if (m_BufferFlags & CIOBuffer::SLICE_OF_BUFFER) {
+        if ((NULL == m_pSliceParent)
+            || (m_BufferFlags & CIOBuffer::ALLOCATED_BUFFER)
+            || (m_pPhysicalBuffer < m_pSliceParent->m_pPhysicalBuffer)
+            || ((m_pPhysicalBuffer + m_BufferSize)
+                    > (m_pSliceParent->m_pPhysicalBuffer + m_pSliceParent->m_BufferSize))) {
+            returnErr(EFail);
+        }
+    }
+
     if (NULL == m_pLogicalBuffer) {
         returnErr(EFail);
     }
@@ -505,7 +623,10 @@ CAsyncBlockIO::WriteBlockAsync(CIOBuffer *pBuffer, int32 startOffsetInBuffer) {
     if ((NULL == m_pIOSystem)
         || (CIOBuffer::NO_OP != pBuffer->m_BufferOp)
         || !(pBuffer->m_BufferFlags & CIOBuffer::VALID_DATA)
-        || (NULL == pBuffer->m_pLogicalBuffer)
+        || ((NULL == pBuffer->m_pLogicalBuffer)
+            && !(pBuffer->m_BufferFlags & CIOBuffer::SEND_FROM_FILE))
+        || ((pBuffer->m_BufferFlags & CIOBuffer::SEND_FROM_FILE)
+            && ((NULL == pBuffer->m_pSendFileSource) || !(CanSendFromFile())))
         || (pBuffer->m_NumValidBytes < 0)
         || (pBuffer->m_BufferSize < 0)
         || (pBuffer->m_BufferSize < pBuffer->m_NumValidBytes)
@@ -732,7 +853,11 @@ CAsyncBlockIO::FinishIO(
            // set SENT_BLOCKIO_TO_JOBQUEUE before calling
            // SubmitJob.
            m_BlockIOFlags |= SENT_BLOCKIO_TO_JOBQUEUE;
-           err = g_MainJobQueue->SubmitJob(pBuffer);
+           if (NULL != m_pIOSystem) {
+               err = m_pIOSystem->GetCompletionJobQueue()->SubmitJob(pBuffer);
+           } else {
+               err = g_MainJobQueue->SubmitJob(pBuffer);
+           }
            if (err)
            {
                m_BlockIOFlags &= ~SENT_BLOCKIO_TO_JOBQUEUE;
@@ -824,7 +949,7 @@ CAsyncBlockIO::SendIOEvent(int32 IOEvent, ErrVal eventErr) {
         // SubmitJob.
         m_BlockIOFlags |= SENT_BLOCKIO_TO_JOBQUEUE;
 
-        err = g_MainJobQueue->SubmitJob(pBuffer);
+        err = m_pIOSystem->GetCompletionJobQueue()->SubmitJob(pBuffer);
         if (err) {
             DEBUG_WARNING("SendIOEvent. SubmitJob failed.");
             m_BlockIOFlags &= ~SENT_BLOCKIO_TO_JOBQUEUE;
@@ -938,6 +1063,61 @@ CAsyncBlockIO::StartTimeout(int32 opType) {
 
 
 
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [StartWriteChain]
+//
+// This is the stub. Each subclass of CAsyncBlockIO may implement this differently.
+// Currently, this is only impleted in NetBlockIO and FileBlockIO, since those
+// are the only blockIOs where one system call can send several buffers.
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncBlockIO::StartWriteChain() {
+} // StartWriteChain.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [EndWriteChain]
+//
+// This is the stub. Each subclass of CAsyncBlockIO may implement this differently.
+/////////////////////////////////////////////////////////////////////////////
+void
+CAsyncBlockIO::EndWriteChain() {
+} // EndWriteChain.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CopyFromFile]
+//
+// This is the stub. Currently, only FileBlockIO can copy between two
+// files without reading the bytes into buffers.
+/////////////////////////////////////////////////////////////////////////////
+int64
+CAsyncBlockIO::CopyFromFile(
+                    CAsyncBlockIO *pSrcBlockIO,
+                    int64 srcPos,
+                    int64 destPos,
+                    int64 numBytes) {
+    UNUSED_PARAM(pSrcBlockIO);
+    UNUSED_PARAM(srcPos);
+    UNUSED_PARAM(destPos);
+    UNUSED_PARAM(numBytes);
+
+    return(0);
+} // CopyFromFile.
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [GetLock]
@@ -1060,6 +1240,14 @@ CAsyncBlockIO::RemoveNBytes(int64 numBytes) {
 CIOSystem::CIOSystem() {
     m_fInitialized = false;
     m_pLock = NULL;
+
+    m_pPoolLock = NULL;
+    m_MaxIdleBuffersPerSize = 0;
+    m_PoolGeneration = 0;
+    for (int32 sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++) {
+        m_MinIdleBuffers[sizeClass] = 0;
+    }
+    m_LastTrimTimeInMs = 0;
 } // CIOSystem.
 
 
@@ -1076,6 +1264,7 @@ CIOSystem::~CIOSystem() {
     // they are released after the memory system is shut down.
     // RELEASE_OBJECT(m_pLock);
     m_pLock = NULL;
+    m_pPoolLock = NULL;
 } // ~CIOSystem.
 
 
@@ -1090,14 +1279,32 @@ CIOSystem::~CIOSystem() {
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
 CIOSystem::InitIOSystem() {
-    m_pLock = CRefLock::Alloc();
+    // A system that was shut down keeps its locks, so it can be started again.
     if (NULL == m_pLock) {
-        returnErr(EFail);
+        m_pLock = CRefLock::Alloc();
+        if (NULL == m_pLock) {
+            returnErr(EFail);
+        }
     }
 
     // Initially, there are no active blockIOs.
     m_ActiveBlockIOs.ResetQueue();
 
+    if (NULL == m_pPoolLock) {
+        m_pPoolLock = CRefLock::Alloc();
+        if (NULL == m_pPoolLock) {
+            returnErr(EFail);
+        }
+    }
+    m_MaxIdleBuffersPerSize = DEFAULT_IDLE_BUFFERS_PER_SIZE;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_MaxIdleBuffersPerSize = g_pBuildingBlocksConfig->GetInt(
+                                        g_IOBufferPoolSizeConfigValueName,
+                                        DEFAULT_IDLE_BUFFERS_PER_SIZE);
+    }
+    m_PoolGeneration += 1;
+    m_LastTrimTimeInMs = GetTimeSinceBootInMs();
+
     m_fInitialized = true;
 
     returnErr(ENoErr);
@@ -1119,6 +1326,10 @@ CIOSystem::InitIOSystem() {
 ErrVal
 CIOSystem::Shutdown() {
     ErrVal err = ENoErr;
+
+    // Any buffer released after this goes straight back to the heap.
+    EmptyIOBufferPool();
+
     returnErr(err);
 } // Shutdown.
 
@@ -1130,22 +1341,27 @@ CIOSystem::Shutdown() {
 //
 // [AllocIOBuffer]
 //
-// This used to be really complex, and would keep a free queue of idle
-// buffers. Instead, now it just relies on the main memory pool to recycle
-// buffers efficiently.
+// This used to keep a free queue of idle buffers, then relied only on the
+// main memory pool. Now it does both. A buffer whose size is a small whole
+// number of default blocks is taken from this thread's magazine or the
+// shared idle list of that size, so a busy stream reuses the same few
+// buffers and never touches the heap. Any other size is allocated from
+// the heap.
 //
-// Besides simplicity (only one global allocator cache), and performance
-// (all allocations are served by a unified cache), this also allows a
-// client to dynamically change the size of buffers. That allows both
-// AsyncIOStreams and record files to use the same blockIO and to allocate
-// different sized buffers for the same type of blockIO. For example, one
-// client reading a file may want to use 2K or 4K buffers, while another may
-// want to use 64K buffers.
+// This still lets a client dynamically change the size of buffers. That
+// allows both AsyncIOStreams and record files to use the same blockIO and
+// to allocate different sized buffers for the same type of blockIO. For
+// example, one client reading a file may want to use 2K or 4K buffers,
+// while another may want to use 64K buffers.
 /////////////////////////////////////////////////////////////////////////////
 CIOBuffer *
 CIOSystem::AllocIOBuffer(int32 blockBufferSize, bool fAllocBuffer) {
     ErrVal err = ENoErr;
-    CIOBuffer *pBuffer;
+    CIOBuffer *pBuffer = NULL;
+    int32 pageSize;
+    int32 numPages = 0;
+    int32 bytesPerBlock;
+    int32 sizeClass = -1;
 
     // Do NOT take the lock. We don't need to, and that can cause a deadlock.
     // This method is called by blockIO objects.
@@ -1157,9 +1373,48 @@ CIOSystem::AllocIOBuffer(int32 blockBufferSize, bool fAllocBuffer) {
        blockBufferSize = GetDefaultBytesPerBlock();
     }
 
-    pBuffer = newex CIOBuffer;
+    if (fAllocBuffer) {
+        // If the data must be aligned, then we allocate it on a
+        // page boundary. Otherwise, allocate the data on any alignment.
+        // File systems, for example, work faster when doing IO on page
+        // boundaries, while network interfaces don't seem to care.
+        //
+        // This is a bit heavy-handed. If the alignment is anything != 0,
+        // then we allocate whole pages. Doing better, however, will
+        // require more flexibility from the memory allocator, like
+        // malloc(size, arbitraryAlignment)
+        if (GetBlockBufferAlignment() > 0) {
+            // Make sure the buffer size is a multiple of pages.
+            pageSize = g_MainMem.GetBytesPerPage();
+            numPages = (int32) ceil((double)blockBufferSize / (double)pageSize);
+            blockBufferSize = pageSize * numPages;
+        }
+        ASSERT(blockBufferSize > 0);
+
+        bytesPerBlock = GetDefaultBytesPerBlock();
+        if ((bytesPerBlock > 0)
+            && (0 == (blockBufferSize % bytesPerBlock))
+            && ((blockBufferSize / bytesPerBlock) <= MAX_POOLED_BUFFER_BLOCKS)) {
+            sizeClass = blockBufferSize / bytesPerBlock;
+            pBuffer = GetPooledIOBuffer(sizeClass);
+        }
+    } // if (fAllocBuffer)
+
+    // An idle buffer of the right size already has its memory. Otherwise,
+    // an idle buffer with no memory still saves allocating the CIOBuffer.
+    if (NULL != pBuffer) {
+        ASSERT(pBuffer->m_BufferFlags & CIOBuffer::ALLOCATED_BUFFER);
+        ASSERT(pBuffer->m_BufferSize == blockBufferSize);
+        pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+        pBuffer->m_NumValidBytes = 0;
+        return(pBuffer);
+    }
+    pBuffer = GetPooledIOBuffer(0);
     if (NULL == pBuffer) {
-        gotoErr(EFail);
+        pBuffer = newex CIOBuffer;
+        if (NULL == pBuffer) {
+            gotoErr(EFail);
+        }
     }
 
     pBuffer->m_BufferOp = CIOBuffer::NO_OP;
@@ -1180,27 +1435,14 @@ CIOSystem::AllocIOBuffer(int32 blockBufferSize, bool fAllocBuffer) {
 
     // Allocate the physical buffer.
     if (fAllocBuffer) {
-        // If the data must be aligned, then we allocate it on a
-        // page boundary. Otherwise, allocate the data on any alignment.
-        // File systems, for example, work faster when doing IO on page
-        // boundaries, while network interfaces don't seem to care.
-        //
-        // This is a bit heavy-handed. If the alignment is anything != 0,
-        // then we allocate whole pages. Doing better, however, will
-        // require more flexibility from the memory allocator, like
-        // malloc(size, arbitraryAlignment)
+        pBuffer->m_BufferSize = blockBufferSize;
         if (GetBlockBufferAlignment() > 0) {
-            // Make sure the buffer size is a multiple of pages.
-            int32 pageSize = g_MainMem.GetBytesPerPage();
-            int32 numPages = (int32) ceil((double)blockBufferSize / (double)pageSize);
-            blockBufferSize = pageSize * numPages;
-
-            ASSERT(blockBufferSize > 0);
-            pBuffer->m_BufferSize = blockBufferSize;
             pBuffer->m_pPhysicalBuffer = (char *) memAllocPages(numPages);
+
+            // Unbuffered file IO fails if this is not aligned.
+            ASSERT((NULL == pBuffer->m_pPhysicalBuffer)
+                || (0 == (((uint64) (pBuffer->m_pPhysicalBuffer)) % GetBlockBufferAlignment())));
         } else {
-            ASSERT(blockBufferSize > 0);
-            pBuffer->m_BufferSize = blockBufferSize;
             pBuffer->m_pPhysicalBuffer = (char *) memAlloc(pBuffer->m_BufferSize);
         }
 
@@ -1230,97 +1472,156 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [ReleaseBlockList]
+// [AllocBufferSlice]
 //
-// Return buffers to the idle list.
+// This makes a buffer that shares numBytes of the valid data of pParent,
+// starting offset bytes into it. Nothing is copied. The slice keeps the
+// parent alive, so it can be queued and written after whoever owns the
+// parent has released it. A slice of a slice shares the original memory.
 //
-// NOTE: This routine takes a reference to the pointer, so
-// it can be safely NULL'ed when the buffer is deallocated.
+// The parent must own its memory, since memory that belongs to a caller
+// may go away no matter how long we hold the buffer. The caller must not
+// change the shared bytes until every slice of them is released.
 /////////////////////////////////////////////////////////////////////////////
-void
-CIOSystem::ReleaseBlockList(CIOBuffer *blockList) {
-    CIOBuffer *pNextBlock;
+CIOBuffer *
+CIOSystem::AllocBufferSlice(CIOBuffer *pParent, int32 offset, int32 numBytes) {
+    CIOBuffer *pBuffer = NULL;
+    CIOBuffer *pMemoryOwner;
+
+    if ((NULL == pParent)
+        || (NULL == pParent->m_pLogicalBuffer)
+        || (offset < 0)
+        || (numBytes <= 0)
+        || ((offset + numBytes) > pParent->m_NumValidBytes)) {
+        return(NULL);
+    }
 
-    while (blockList) {
-        pNextBlock = blockList->m_StreamBufferList.GetNextInQueue();
-        RELEASE_OBJECT(blockList);
-        blockList = pNextBlock;
+    pMemoryOwner = pParent;
+    if (pParent->m_BufferFlags & CIOBuffer::SLICE_OF_BUFFER) {
+        pMemoryOwner = pParent->m_pSliceParent;
+    }
+    if ((NULL == pMemoryOwner)
+        || !(pMemoryOwner->m_BufferFlags & CIOBuffer::ALLOCATED_BUFFER)) {
+        return(NULL);
     }
-} // ReleaseBlockList.
 
+    pBuffer = AllocIOBuffer(-1, false);
+    if (NULL == pBuffer) {
+        return(NULL);
+    }
 
+    pBuffer->m_BufferFlags = CIOBuffer::VALID_DATA | CIOBuffer::SLICE_OF_BUFFER;
+    pBuffer->m_pPhysicalBuffer = pParent->m_pLogicalBuffer + offset;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_BufferSize = numBytes;
+    pBuffer->m_NumValidBytes = numBytes;
+    pBuffer->m_PosInMedia = pParent->m_PosInMedia + offset;
 
+    pBuffer->m_pSliceParent = pMemoryOwner;
+    ADDREF_OBJECT(pMemoryOwner);
+
+    return(pBuffer);
+} // AllocBufferSlice.
 
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [GetTotalActiveIOJobs]
-//
-/////////////////////////////////////////////////////////////////////////////
-int32
-CIOSystem::GetTotalActiveIOJobs() {
-    return(g_MainJobQueue->GetNumJobs() + g_NumFileCallbacksActive);
-}
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CSynCAsyncBlockIOCallback]
+// [GetPooledIOBuffer]
 //
+// This returns an idle buffer of one size, or NULL if there are none.
+// The buffer already has its single reference. It comes from this thread's
+// magazine if it can. Otherwise, we take the pool lock once to get the
+// buffer and to refill the magazine.
 /////////////////////////////////////////////////////////////////////////////
-CSynCAsyncBlockIOCallback::CSynCAsyncBlockIOCallback() {
-    m_Semaphore = NULL;
-    m_pLock = NULL;
-    m_TestErr = ENoErr;
-    m_pBlockIO = NULL;
-}
+CIOBuffer *
+CIOSystem::GetPooledIOBuffer(int32 sizeClass) {
+    CIOBuffer *pBuffer = NULL;
+    CIOBuffer *pRefill;
+    CIOBufferMagazine *pMagazine;
+    CQueueList<CIOBuffer> deadBuffers;
+    int32 numIdle;
 
+    if ((NULL == m_pPoolLock) || (m_MaxIdleBuffersPerSize <= 0)) {
+        return(NULL);
+    }
 
+    pMagazine = GetIOBufferMagazine();
+#if LINUX
+    if ((NULL != pMagazine) && (pMagazine->m_NumBuffers[sizeClass] > 0)) {
+        pMagazine->m_NumBuffers[sizeClass] -= 1;
+        return(pMagazine->m_pBuffers[sizeClass][pMagazine->m_NumBuffers[sizeClass]]);
+    }
+#endif
+
+    m_pPoolLock->Lock();
+    pBuffer = m_IdleBuffers[sizeClass].RemoveHead();
+#if LINUX
+    while ((NULL != pBuffer)
+            && (NULL != pMagazine)
+            && (pMagazine->m_NumBuffers[sizeClass] < MAGAZINE_TRANSFER_SIZE)) {
+        pRefill = m_IdleBuffers[sizeClass].RemoveHead();
+        if (NULL == pRefill) {
+            break;
+        }
+        pMagazine->m_pBuffers[sizeClass][pMagazine->m_NumBuffers[sizeClass]] = pRefill;
+        pMagazine->m_NumBuffers[sizeClass] += 1;
+    }
+#else
+    pRefill = NULL;
+#endif
+    numIdle = m_IdleBuffers[sizeClass].GetLength();
+    if (numIdle < m_MinIdleBuffers[sizeClass]) {
+        m_MinIdleBuffers[sizeClass] = numIdle;
+    }
+    TrimIdleIOBuffers(false, &deadBuffers);
+    m_pPoolLock->Unlock();
+
+    while (NULL != (pRefill = deadBuffers.RemoveHead())) {
+        DeleteIdleIOBuffer(pRefill);
+    }
+
+    return(pBuffer);
+} // GetPooledIOBuffer.
 
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [~CSynCAsyncBlockIOCallback]
-//
-/////////////////////////////////////////////////////////////////////////////
-CSynCAsyncBlockIOCallback::~CSynCAsyncBlockIOCallback() {
-    RELEASE_OBJECT(m_Semaphore);
-    RELEASE_OBJECT(m_pBlockIO);
-    RELEASE_OBJECT(m_pLock);
-}
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [Initialize]
+// [PutPooledIOBuffer]
 //
+// This adds an idle buffer to the shared list of its size. It returns false
+// if the caller should delete the buffer, because the pool is off or the
+// list is full.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CSynCAsyncBlockIOCallback::Initialize() {
-    ErrVal err = ENoErr;
-
-    m_pLock = CRefLock::Alloc();
-    if (NULL == m_pLock) {
-        gotoErr(EFail);
+bool
+CIOSystem::PutPooledIOBuffer(int32 sizeClass, CIOBuffer *pBuffer) {
+    CQueueList<CIOBuffer> deadBuffers;
+    CIOBuffer *pDeadBuffer;
+    bool fPooled = false;
+
+    m_pPoolLock->Lock();
+    if ((m_MaxIdleBuffersPerSize > 0)
+        && (m_IdleBuffers[sizeClass].GetLength() < m_MaxIdleBuffersPerSize)) {
+        m_IdleBuffers[sizeClass].InsertHead(&(pBuffer->m_StreamBufferList));
+        fPooled = true;
     }
+    TrimIdleIOBuffers(false, &deadBuffers);
+    m_pPoolLock->Unlock();
 
-    m_Semaphore = newex CRefEvent;
-    if (NULL == m_Semaphore) {
-        gotoErr(EFail);
+    while (NULL != (pDeadBuffer = deadBuffers.RemoveHead())) {
+        DeleteIdleIOBuffer(pDeadBuffer);
     }
 
-    err = m_Semaphore->Initialize();
-    if (err) {
-        gotoErr(err);
-    }
+    return(fPooled);
+} // PutPooledIOBuffer.
 
-abort:
-    returnErr(err);
-} // Initialize
 
 
 
@@ -1328,62 +1629,185 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [OnBlockIOEvent]
+// [RecycleIOBuffer]
 //
+// This is called when the last reference to a buffer is released. It strips
+// the buffer of everything but its memory, and keeps it in this thread's
+// magazine for the next AllocIOBuffer. It returns false if the caller should
+// delete the buffer, because the pool is off or already holds enough buffers
+// of this size.
 /////////////////////////////////////////////////////////////////////////////
-void
-CSynCAsyncBlockIOCallback::OnBlockIOEvent(CIOBuffer *pBuffer) {
-    AutoLock(m_pLock);
+bool
+CIOSystem::RecycleIOBuffer(CIOBuffer *pBuffer) {
+    int32 bytesPerBlock;
+    int32 sizeClass = 0;
+#if LINUX
+    CIOBufferMagazine *pMagazine;
+    CIOBuffer **pSlot;
+    CQueueList<CIOBuffer> deadBuffers;
+    CIOBuffer *pDeadBuffer;
+    int32 index;
+#endif
 
-    if (NULL == pBuffer) {
-        return;
+    if ((NULL == pBuffer)
+        || (NULL == m_pPoolLock)
+        || (m_MaxIdleBuffersPerSize <= 0)
+        || (pBuffer->m_StreamBufferList.OnAnyQueue())
+        || (pBuffer->m_BlockIOBufferList.OnAnyQueue())) {
+        return(false);
     }
 
-    if ((CIOBuffer::READ == pBuffer->m_BufferOp)
-       || (CIOBuffer::WRITE == pBuffer->m_BufferOp)) {
-        if (m_Semaphore) {
-            m_Semaphore->Signal();
+    // Do this outside the pool lock, since it may delete a blockIO or
+    // the parent of a slice.
+    RELEASE_OBJECT(pBuffer->m_pBlockIO);
+    RELEASE_OBJECT(pBuffer->m_pSendFileSource);
+    RELEASE_OBJECT(pBuffer->m_pSliceParent);
+
+    // Only memory we allocated ourselves, of exactly a whole number of
+    // blocks, is kept with the buffer.
+    if ((pBuffer->m_BufferFlags & CIOBuffer::ALLOCATED_BUFFER)
+        && (NULL != pBuffer->m_pPhysicalBuffer)) {
+        bytesPerBlock = GetDefaultBytesPerBlock();
+        if ((bytesPerBlock > 0)
+            && (pBuffer->m_BufferSize > 0)
+            && (0 == (pBuffer->m_BufferSize % bytesPerBlock))
+            && ((pBuffer->m_BufferSize / bytesPerBlock) <= MAX_POOLED_BUFFER_BLOCKS)) {
+            sizeClass = pBuffer->m_BufferSize / bytesPerBlock;
+        } else {
+            memFree(pBuffer->m_pPhysicalBuffer);
         }
     }
-} // OnBlockIOEvent
+    if (0 == sizeClass) {
+        pBuffer->m_pPhysicalBuffer = NULL;
+        pBuffer->m_BufferSize = 0;
+        pBuffer->m_BufferFlags = 0;
+    } else {
+        pBuffer->m_BufferFlags = CIOBuffer::ALLOCATED_BUFFER;
+    }
+
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_Err = ENoErr;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_NumValidBytes = 0;
+    pBuffer->m_PosInMedia = 0;
+    pBuffer->m_StartWriteOffset = 0;
+    pBuffer->m_SendFilePos = 0;
+
+#if LINUX
+    // Keep the buffer on this thread. If the magazine is full, then first
+    // move its oldest buffers to the shared list, under one lock.
+    pMagazine = GetIOBufferMagazine();
+    if (NULL != pMagazine) {
+        pSlot = pMagazine->m_pBuffers[sizeClass];
+        if (pMagazine->m_NumBuffers[sizeClass] >= BUFFERS_PER_MAGAZINE) {
+            m_pPoolLock->Lock();
+            for (index = 0; index < MAGAZINE_TRANSFER_SIZE; index++) {
+                if ((m_MaxIdleBuffersPerSize > 0)
+                    && (m_IdleBuffers[sizeClass].GetLength() < m_MaxIdleBuffersPerSize)) {
+                    m_IdleBuffers[sizeClass].InsertHead(&(pSlot[index]->m_StreamBufferList));
+                } else {
+                    deadBuffers.InsertHead(&(pSlot[index]->m_StreamBufferList));
+                }
+            }
+            TrimIdleIOBuffers(false, &deadBuffers);
+            m_pPoolLock->Unlock();
+
+            for (index = MAGAZINE_TRANSFER_SIZE; index < BUFFERS_PER_MAGAZINE; index++) {
+                pSlot[index - MAGAZINE_TRANSFER_SIZE] = pSlot[index];
+            }
+            pMagazine->m_NumBuffers[sizeClass] -= MAGAZINE_TRANSFER_SIZE;
+
+            while (NULL != (pDeadBuffer = deadBuffers.RemoveHead())) {
+                DeleteIdleIOBuffer(pDeadBuffer);
+            }
+        } // if (pMagazine->m_NumBuffers[sizeClass] >= BUFFERS_PER_MAGAZINE)
+
+        pSlot[pMagazine->m_NumBuffers[sizeClass]] = pBuffer;
+        pMagazine->m_NumBuffers[sizeClass] += 1;
+        return(true);
+    } // if (NULL != pMagazine)
+#endif
+
+    // If the pool is full, then the caller deletes the buffer. It is
+    // consistent, so the destructor frees whatever memory is left.
+    return(PutPooledIOBuffer(sizeClass, pBuffer));
+} // RecycleIOBuffer.
+
+
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [OnBlockIOOpen]
+// [EmptyIOBufferPool]
 //
+// This deletes every idle buffer and turns the pool off.
 /////////////////////////////////////////////////////////////////////////////
 void
-CSynCAsyncBlockIOCallback::OnBlockIOOpen(ErrVal resultErr, CAsyncBlockIO *pBlockIO) {
-    RELEASE_OBJECT(m_pBlockIO);
-    m_pBlockIO = pBlockIO;
-    ADDREF_OBJECT(m_pBlockIO);
+CIOSystem::EmptyIOBufferPool() {
+    CQueueList<CIOBuffer> idleBuffers;
+    CIOBufferMagazine *pMagazine;
+    CIOBuffer *pBuffer;
+    int32 sizeClass;
 
-    m_TestErr = resultErr;
+    if (NULL == m_pPoolLock) {
+        return;
+    }
 
-    if (m_Semaphore) {
-        m_Semaphore->Signal();
+    // This thread's magazine goes back to the shared lists first. Other
+    // threads see the new generation, and flush theirs the next time they
+    // use the pool or when they exit.
+    pMagazine = GetIOBufferMagazine();
+    if (NULL != pMagazine) {
+        FlushIOBufferMagazine(pMagazine);
     }
-} // OnBlockIOOpen
+
+    m_pPoolLock->Lock();
+    m_MaxIdleBuffersPerSize = 0;
+    m_PoolGeneration += 1;
+    for (sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++) {
+        while (NULL != (pBuffer = m_IdleBuffers[sizeClass].RemoveHead())) {
+            idleBuffers.InsertHead(&(pBuffer->m_StreamBufferList));
+        }
+    }
+    m_pPoolLock->Unlock();
+
+    // Now the pool is off, so releasing the last reference deletes each buffer.
+    while (NULL != (pBuffer = idleBuffers.RemoveHead())) {
+        RELEASE_OBJECT(pBuffer);
+    }
+} // EmptyIOBufferPool.
+
+
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [Wait]
+// [TrimIOBufferPool]
 //
+// This trims the shared idle lists now, rather than waiting for the next
+// interval to end.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CSynCAsyncBlockIOCallback::Wait() {
-    if (m_Semaphore) {
-        m_Semaphore->Wait();
+void
+CIOSystem::TrimIOBufferPool() {
+    CQueueList<CIOBuffer> deadBuffers;
+    CIOBuffer *pBuffer;
+
+    if (NULL == m_pPoolLock) {
+        return;
     }
 
-    return(m_TestErr);
-} // Wait
+    m_pPoolLock->Lock();
+    TrimIdleIOBuffers(true, &deadBuffers);
+    m_pPoolLock->Unlock();
+
+    while (NULL != (pBuffer = deadBuffers.RemoveHead())) {
+        DeleteIdleIOBuffer(pBuffer);
+    }
+} // TrimIOBufferPool.
 
 
 
@@ -1392,106 +1816,74 @@ CSynCAsyncBlockIOCallback::Wait() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-//                          TESTING PROCEDURES
+// [TrimIdleIOBuffers]
 //
+// This is called while holding the pool lock, and at most once an interval
+// unless fForce is set. Every list gives up half of its low-water mark, so
+// a burst of buffers drains away over a few intervals, while buffers that
+// are in steady use are kept. The caller deletes the buffers after it
+// releases the lock.
 /////////////////////////////////////////////////////////////////////////////
-#if INCLUDE_REGRESSION_TESTS
-
-static ErrVal TestOpenBlockIO(
-                     int32 numBlockIOs,
-                     int32 openOptions,
-                     int32 storeSize,
-                     bool memDevice);
-
-static ErrVal TestWriteBlocks(
-                    CAsyncBlockIO *pBlockIO,
-                    int32 startByte,
-                    int32 numBytes,
-                    int16 baseVal);
-
-static ErrVal TestReadBlocks(
-                    CAsyncBlockIO *pBlockIO,
-                    int32 startByte,
-                    int32 numBytes,
-                    int16 baseVal);
-
-static void RunBlockIOTests(
-                    int32 numBlockIOs,
-                    int32 storeSize,
-                    int32 growAmount,
-                    bool memDevice);
+void
+CIOSystem::TrimIdleIOBuffers(bool fForce, CQueueList<CIOBuffer> *pDeadBuffers) {
+    CIOBuffer *pBuffer;
+    uint64 now;
+    int32 sizeClass;
+    int32 numToTrim;
 
-static void TestNet();
+    now = GetTimeSinceBootInMs();
+    if ((!fForce) && ((now - m_LastTrimTimeInMs) < IDLE_BUFFER_TRIM_INTERVAL_MS)) {
+        return;
+    }
+    m_LastTrimTimeInMs = now;
+
+    for (sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++) {
+        // The oldest buffers are at the tail.
+        numToTrim = (m_MinIdleBuffers[sizeClass] + 1) / 2;
+        while (numToTrim > 0) {
+            pBuffer = m_IdleBuffers[sizeClass].GetTail();
+            if (NULL == pBuffer) {
+                break;
+            }
+            m_IdleBuffers[sizeClass].RemoveFromQueue(&(pBuffer->m_StreamBufferList));
+            pDeadBuffers->InsertHead(&(pBuffer->m_StreamBufferList));
+            numToTrim--;
+        }
 
-static ErrVal TestReadPastEof(CAsyncBlockIO *pBlockIO, int32 startByte);
+        m_MinIdleBuffers[sizeClass] = m_IdleBuffers[sizeClass].GetLength();
+    } // for (sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++)
+} // TrimIdleIOBuffers.
 
-#define NUM_TEST_BLOCKIOS       1
-#define BYTES_IN_STORE          10300
-#define TEST_BLOCK_SIZE         100000
 
-static char g_TestPathPrefix[512];
-static CAsyncBlockIO *g_BlockIOList[NUM_TEST_BLOCKIOS];
-static char g_TestMemoryDevice[TEST_BLOCK_SIZE];
-static CSynCAsyncBlockIOCallback *g_TestCallback;
 
-static char *g_TestServerName = (char *) "www.google.com";
-static int g_TestServerPort = 80;
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestBlockIO]
+// [GetNumIdleIOBuffers]
 //
+// This counts the buffers on the shared idle lists. It does not count the
+// buffers in the magazines of each thread.
 /////////////////////////////////////////////////////////////////////////////
-void
-CIOSystem::TestBlockIO() {
-    ErrVal err = ENoErr;
-    bool fFoundProxy;
-
-
-    g_DebugManager.StartModuleTest("Block IO");
+int32
+CIOSystem::GetNumIdleIOBuffers() {
+    int32 numBuffers = 0;
+    int32 sizeClass;
 
-    fFoundProxy = NetIO_GetLocalProxySettings(&g_TestServerName, &g_TestServerPort);
-    if (!fFoundProxy) {
-        g_TestServerName = (char *) "www.google.com";
-        g_TestServerPort = 80;
+    if (NULL == m_pPoolLock) {
+        return(0);
     }
 
-    g_TestCallback = newex CSynCAsyncBlockIOCallback;
-    if (NULL == g_TestCallback) {
-        DEBUG_WARNING("Error");
-        return;
-    }
-    err = g_TestCallback->Initialize();
-    if (err) {
-        DEBUG_WARNING("Error");
-        return;
+    m_pPoolLock->Lock();
+    for (sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++) {
+        numBuffers += m_IdleBuffers[sizeClass].GetLength();
     }
+    m_pPoolLock->Unlock();
 
-    g_DebugManager.AddTestResultsDirectoryPath(
-                        "",
-                        g_TestPathPrefix,
-                        sizeof g_TestPathPrefix);
-    printf("\nDood: g_TestPathPrefix=%s\n", g_TestPathPrefix);
-
-
-    g_pMemoryIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
-    g_pFileIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
-    g_pNetIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
-
-    g_DebugManager.StartSubTest("Memory Block IO");
-    RunBlockIOTests(1, BYTES_IN_STORE, BYTES_IN_STORE, true);
-    g_DebugManager.EndSubTest();
-
-    g_DebugManager.StartSubTest("File Block IO");
-    RunBlockIOTests(NUM_TEST_BLOCKIOS, BYTES_IN_STORE, BYTES_IN_STORE, false);
-    g_DebugManager.EndSubTest();
+    return(numBuffers);
+} // GetNumIdleIOBuffers.
 
-    g_DebugManager.StartSubTest("Network Block IO");
-    TestNet();
-    g_DebugManager.EndSubTest();
-} // TestBlockIO.
 
 
 
@@ -1499,296 +1891,3420 @@ CIOSystem::TestBlockIO() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [RunBlockIOTests]
+// [GetIOBufferMagazine]
 //
+// This returns this thread's magazine for this IO system, or NULL if the
+// pool is off or the thread has no magazine to spare. A magazine left over
+// from before the pool was last emptied is flushed and then reused.
 /////////////////////////////////////////////////////////////////////////////
-static void
-RunBlockIOTests(
-         int32 numBlockIOs,
-         int32 storeSize,
-         int32 growAmount,
-         bool memDevice) {
-    ErrVal err = ENoErr;
-    int16 blockIONum;
-    int32 grownStoreSize;
-    int32 shrunkStoreSize;
-
-
-    g_DebugManager.StartTest("Creating BlockIOs for new stores");
-    err = TestOpenBlockIO(
-                     numBlockIOs,
-                     CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
-                     storeSize,
-                     memDevice);
-    if (err) {
-       DEBUG_WARNING("Cannot create an store.");
-       gotoErr(err);
+CIOBufferMagazine *
+CIOSystem::GetIOBufferMagazine() {
+#if LINUX
+    CIOBufferMagazine *pMagazine;
+    CIOBufferMagazine *pFreeMagazine = NULL;
+    int32 index;
+
+    if ((m_MaxIdleBuffersPerSize <= 0) || (g_ShutdownBuildingBlocks)) {
+        return(NULL);
     }
 
+    // The key is only used so the thread flushes its magazines when it exits.
+    if (!g_fThreadHasIOBufferMagazines) {
+        (void) pthread_once(&g_IOBufferMagazineKeyOnce, CreateIOBufferMagazineKey);
+        (void) pthread_setspecific(g_IOBufferMagazineKey, g_IOBufferMagazines);
+        g_fThreadHasIOBufferMagazines = true;
+    }
 
-    g_DebugManager.StartTest("Writing and Reading stores");
-
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
-        if (err) {
-            gotoErr(err);
+    for (index = 0; index < MAX_IO_BUFFER_MAGAZINES; index++) {
+        pMagazine = &(g_IOBufferMagazines[index]);
+        if (this == pMagazine->m_pIOSystem) {
+            if (m_PoolGeneration == pMagazine->m_PoolGeneration) {
+                return(pMagazine);
+            }
+            FlushIOBufferMagazine(pMagazine);
         }
-
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
-        if (err) {
-            gotoErr(err);
+        if ((NULL == pMagazine->m_pIOSystem) && (NULL == pFreeMagazine)) {
+            pFreeMagazine = pMagazine;
         }
     }
 
+    if (NULL != pFreeMagazine) {
+        pFreeMagazine->m_pIOSystem = this;
+        pFreeMagazine->m_PoolGeneration = m_PoolGeneration;
+    }
+    return(pFreeMagazine);
+#else
+    return(NULL);
+#endif
+} // GetIOBufferMagazine.
 
 
-    g_DebugManager.StartTest("Closing and re-opening pBlockIOs");
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
 
-        (g_BlockIOList[blockIONum])->Close();
-        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
-    }
 
-    err = TestOpenBlockIO(
-                     numBlockIOs,
-                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
-                     storeSize,
-                     memDevice);
-    if (err) {
-       DEBUG_WARNING("Cannot create an store.");
-       gotoErr(err);
-    }
 
-    // Memory devices do not keep their state.
-    if (!memDevice) {
-         // Read the contents.
-         for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++)
-         {
-            err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
-            if (err) {
-                  gotoErr(err);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FlushIOBufferMagazine]
+//
+// This moves every buffer in a magazine to the shared lists, or deletes it
+// if they are full, and frees the magazine for any IO system.
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOSystem::FlushIOBufferMagazine(CIOBufferMagazine *pMagazine) {
+#if LINUX
+    CIOBuffer *pBuffer;
+    int32 sizeClass;
+
+    for (sizeClass = 0; sizeClass <= MAX_POOLED_BUFFER_BLOCKS; sizeClass++) {
+        while (pMagazine->m_NumBuffers[sizeClass] > 0) {
+            pMagazine->m_NumBuffers[sizeClass] -= 1;
+            pBuffer = pMagazine->m_pBuffers[sizeClass][pMagazine->m_NumBuffers[sizeClass]];
+            if (!PutPooledIOBuffer(sizeClass, pBuffer)) {
+                DeleteIdleIOBuffer(pBuffer);
             }
-         }
+        }
     }
 
+    pMagazine->m_pIOSystem = NULL;
+#else
+    UNUSED_PARAM(pMagazine);
+#endif
+} // FlushIOBufferMagazine.
 
 
-    // Now, read and write the entire stores after they have been
-    // overwritten.
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
-        if (err) {
-            gotoErr(err);
-        }
-
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
-        if (err) {
-            gotoErr(err);
-        }
-
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
-        if (err) {
-            gotoErr(err);
-        }
-    }
 
 
 
-    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
+#if LINUX
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FlushOnThreadExit]
+//
+// pthreads calls this when a thread that used the pool exits. After the
+// memory system is shut down, the buffers are leaked instead.
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOBufferMagazine::FlushOnThreadExit(void *pValue) {
+    CIOBufferMagazine *pMagazine;
+    int32 index;
+    UNUSED_PARAM(pValue);
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
-        err = TestReadPastEof(g_BlockIOList[blockIONum], storeSize);
-        if (err) {
-            DEBUG_WARNING("Error while reading a store.");
-            gotoErr(EFail);
-        }
+    if (g_ShutdownBuildingBlocks) {
+        return;
     }
 
-    // Memory devices do not keep their state.
-    if (memDevice) {
-       gotoErr(ENoErr);
+    for (index = 0; index < MAX_IO_BUFFER_MAGAZINES; index++) {
+        pMagazine = &(g_IOBufferMagazines[index]);
+        if (NULL != pMagazine->m_pIOSystem) {
+            pMagazine->m_pIOSystem->FlushIOBufferMagazine(pMagazine);
+        }
     }
+} // FlushOnThreadExit.
+#endif // LINUX
 
 
-    g_DebugManager.StartTest("Growing stores");
-    grownStoreSize = storeSize + growAmount;
-
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
 
-        err = (g_BlockIOList[blockIONum])->Resize(grownStoreSize);
-        if (err) {
-            DEBUG_WARNING("Cannot grow a store");
-            gotoErr(err);
-        }
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
-        if (err) {
-            gotoErr(err);
-        }
-    }
 
 
 
-    g_DebugManager.StartTest("Reading and Writing Grown Stores");
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetCompletionJobQueue]
+//
+// By default, every IO system shares the main job queue.
+/////////////////////////////////////////////////////////////////////////////
+CJobQueue *
+CIOSystem::GetCompletionJobQueue() {
+    return(g_MainJobQueue);
+} // GetCompletionJobQueue.
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
-        if (err) {
-            gotoErr(err);
-        }
 
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
-        if (err) {
-            gotoErr(err);
-        }
-    }
 
 
 
-    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
-        err = TestReadPastEof(g_BlockIOList[blockIONum], grownStoreSize);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReleaseBlockList]
+//
+// Return buffers to the idle list.
+//
+// NOTE: This routine takes a reference to the pointer, so
+// it can be safely NULL'ed when the buffer is deallocated.
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOSystem::ReleaseBlockList(CIOBuffer *blockList) {
+    CIOBuffer *pNextBlock;
+
+    while (blockList) {
+        pNextBlock = blockList->m_StreamBufferList.GetNextInQueue();
+        RELEASE_OBJECT(blockList);
+        blockList = pNextBlock;
+    }
+} // ReleaseBlockList.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetTotalActiveIOJobs]
+//
+/////////////////////////////////////////////////////////////////////////////
+int32
+CIOSystem::GetTotalActiveIOJobs() {
+    return(g_MainJobQueue->GetNumJobs() + g_NumFileCallbacksActive);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CSynCAsyncBlockIOCallback]
+//
+/////////////////////////////////////////////////////////////////////////////
+CSynCAsyncBlockIOCallback::CSynCAsyncBlockIOCallback() {
+    m_Semaphore = NULL;
+    m_pLock = NULL;
+    m_TestErr = ENoErr;
+    m_pBlockIO = NULL;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CSynCAsyncBlockIOCallback]
+//
+/////////////////////////////////////////////////////////////////////////////
+CSynCAsyncBlockIOCallback::~CSynCAsyncBlockIOCallback() {
+    RELEASE_OBJECT(m_Semaphore);
+    RELEASE_OBJECT(m_pBlockIO);
+    RELEASE_OBJECT(m_pLock);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CSynCAsyncBlockIOCallback::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+
+    m_Semaphore = newex CRefEvent;
+    if (NULL == m_Semaphore) {
+        gotoErr(EFail);
+    }
+
+    err = m_Semaphore->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    returnErr(err);
+} // Initialize
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CSynCAsyncBlockIOCallback::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    AutoLock(m_pLock);
+
+    if (NULL == pBuffer) {
+        return;
+    }
+
+    if ((CIOBuffer::READ == pBuffer->m_BufferOp)
+       || (CIOBuffer::WRITE == pBuffer->m_BufferOp)) {
+        if (m_Semaphore) {
+            m_Semaphore->Signal();
+        }
+    }
+} // OnBlockIOEvent
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOOpen]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CSynCAsyncBlockIOCallback::OnBlockIOOpen(ErrVal resultErr, CAsyncBlockIO *pBlockIO) {
+    RELEASE_OBJECT(m_pBlockIO);
+    m_pBlockIO = pBlockIO;
+    ADDREF_OBJECT(m_pBlockIO);
+
+    m_TestErr = resultErr;
+
+    if (m_Semaphore) {
+        m_Semaphore->Signal();
+    }
+} // OnBlockIOOpen
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Wait]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CSynCAsyncBlockIOCallback::Wait() {
+    if (m_Semaphore) {
+        m_Semaphore->Wait();
+    }
+
+    return(m_TestErr);
+} // Wait
+
+
+
+
+
+
+#if LINUX
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CIOUring]
+//
+/////////////////////////////////////////////////////////////////////////////
+CIOUring::CIOUring() {
+    m_RingFd = -1;
+    m_pSubmitLock = NULL;
+    m_NumQueuedSQEs = 0;
+
+    m_pSQRing = NULL;
+    m_SQRingSize = 0;
+    m_pCQRing = NULL;
+    m_CQRingSize = 0;
+    m_pSQEs = NULL;
+    m_SQEsSize = 0;
+
+    m_pSQHead = NULL;
+    m_pSQTail = NULL;
+    m_SQMask = 0;
+    m_SQNumEntries = 0;
+    m_pSQArray = NULL;
+
+    m_pCQHead = NULL;
+    m_pCQTail = NULL;
+    m_CQMask = 0;
+    m_pCQEs = NULL;
+} // CIOUring.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CIOUring]
+//
+/////////////////////////////////////////////////////////////////////////////
+CIOUring::~CIOUring() {
+    if (NULL != m_pSQEs) {
+        munmap(m_pSQEs, m_SQEsSize);
+    }
+    if ((NULL != m_pCQRing) && (m_pCQRing != m_pSQRing)) {
+        munmap(m_pCQRing, m_CQRingSize);
+    }
+    if (NULL != m_pSQRing) {
+        munmap(m_pSQRing, m_SQRingSize);
+    }
+    if (m_RingFd >= 0) {
+        close(m_RingFd);
+    }
+    RELEASE_OBJECT(m_pSubmitLock);
+} // ~CIOUring.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::Initialize(uint32 numEntries) {
+    ErrVal err = ENoErr;
+    struct io_uring_params params;
+    char *pSQRing;
+    char *pCQRing;
+
+    m_pSubmitLock = CRefLock::Alloc();
+    if (NULL == m_pSubmitLock) {
+        gotoErr(EFail);
+    }
+
+    memset(&params, 0, sizeof(params));
+    m_RingFd = (int) syscall(__NR_io_uring_setup, numEntries, &params);
+    if (m_RingFd < 0) {
+        DEBUG_LOG("CIOUring::Initialize. io_uring_setup failed. errno = %d", errno);
+        gotoErr(EFail);
+    }
+
+    m_SQRingSize = params.sq_off.array + (params.sq_entries * sizeof(uint32));
+    m_CQRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_CQRingSize > m_SQRingSize) {
+            m_SQRingSize = m_CQRingSize;
+        }
+        m_CQRingSize = m_SQRingSize;
+    }
+
+    m_pSQRing = mmap(
+                    NULL,
+                    m_SQRingSize,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    m_RingFd,
+                    IORING_OFF_SQ_RING);
+    if (MAP_FAILED == m_pSQRing) {
+        m_pSQRing = NULL;
+        gotoErr(EFail);
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_pCQRing = m_pSQRing;
+    } else {
+        m_pCQRing = mmap(
+                        NULL,
+                        m_CQRingSize,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        m_RingFd,
+                        IORING_OFF_CQ_RING);
+        if (MAP_FAILED == m_pCQRing) {
+            m_pCQRing = NULL;
+            gotoErr(EFail);
+        }
+    }
+
+    m_SQEsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_pSQEs = (struct io_uring_sqe *) mmap(
+                                        NULL,
+                                        m_SQEsSize,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE,
+                                        m_RingFd,
+                                        IORING_OFF_SQES);
+    if (MAP_FAILED == (void *) m_pSQEs) {
+        m_pSQEs = NULL;
+        gotoErr(EFail);
+    }
+
+    pSQRing = (char *) m_pSQRing;
+    m_pSQHead = (uint32 *) (pSQRing + params.sq_off.head);
+    m_pSQTail = (uint32 *) (pSQRing + params.sq_off.tail);
+    m_SQMask = *((uint32 *) (pSQRing + params.sq_off.ring_mask));
+    m_SQNumEntries = *((uint32 *) (pSQRing + params.sq_off.ring_entries));
+    m_pSQArray = (uint32 *) (pSQRing + params.sq_off.array);
+
+    pCQRing = (char *) m_pCQRing;
+    m_pCQHead = (uint32 *) (pCQRing + params.cq_off.head);
+    m_pCQTail = (uint32 *) (pCQRing + params.cq_off.tail);
+    m_CQMask = *((uint32 *) (pCQRing + params.cq_off.ring_mask));
+    m_pCQEs = (struct io_uring_cqe *) (pCQRing + params.cq_off.cqes);
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SubmitSQE]
+//
+// Copy one request into the submission ring and tell the kernel about it.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::SubmitSQE(const struct io_uring_sqe *pSQE) {
+    ErrVal err = ENoErr;
+    AutoLock(m_pSubmitLock);
+
+    err = QueueSQEInLock(pSQE);
+    if (err) {
+        gotoErr(err);
+    }
+    err = EnterRing(m_NumQueuedSQEs);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    returnErr(err);
+} // SubmitSQE.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [QueueSQE]
+//
+// Copy one request into the submission ring, but do not tell the kernel
+// until the next SubmitQueuedSQEs or SubmitSQE.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::QueueSQE(const struct io_uring_sqe *pSQE) {
+    ErrVal err = ENoErr;
+    AutoLock(m_pSubmitLock);
+
+    err = QueueSQEInLock(pSQE);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    returnErr(err);
+} // QueueSQE.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SubmitQueuedSQEs]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::SubmitQueuedSQEs() {
+    ErrVal err = ENoErr;
+    AutoLock(m_pSubmitLock);
+
+    if (m_NumQueuedSQEs > 0) {
+        err = EnterRing(m_NumQueuedSQEs);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+abort:
+    returnErr(err);
+} // SubmitQueuedSQEs.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [QueueSQEInLock]
+//
+// The caller holds m_pSubmitLock. If the ring is full of requests that
+// were queued but not yet submitted, then pass those to the kernel first
+// to make room.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::QueueSQEInLock(const struct io_uring_sqe *pSQE) {
+    ErrVal err = ENoErr;
+    uint32 tail;
+    uint32 index;
+
+    if ((NULL == pSQE) || (m_RingFd < 0)) {
+        gotoErr(EFail);
+    }
+
+    tail = *m_pSQTail;
+    if (((tail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE)) >= m_SQNumEntries)
+            && (m_NumQueuedSQEs > 0)) {
+        err = EnterRing(m_NumQueuedSQEs);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    if ((tail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE)) >= m_SQNumEntries) {
+        DEBUG_LOG("CIOUring::QueueSQEInLock. The submission ring is full");
+        gotoErr(ETooManySockets);
+    }
+
+    index = tail & m_SQMask;
+    m_pSQEs[index] = *pSQE;
+    m_pSQArray[index] = index;
+    __atomic_store_n(m_pSQTail, tail + 1, __ATOMIC_RELEASE);
+    m_NumQueuedSQEs += 1;
+
+abort:
+    returnErr(err);
+} // QueueSQEInLock.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [EnterRing]
+//
+// The caller holds m_pSubmitLock.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::EnterRing(uint32 numToSubmit) {
+    ErrVal err = ENoErr;
+    int result;
+
+    while (1) {
+        result = (int) syscall(__NR_io_uring_enter, m_RingFd, numToSubmit, 0, 0, NULL, 0);
+        if ((result < 0) && (EINTR == errno)) {
+            continue;
+        }
+        break;
+    }
+    if (result < 0) {
+        DEBUG_LOG("CIOUring::EnterRing. io_uring_enter failed. errno = %d", errno);
+        gotoErr(EFail);
+    }
+
+    // The kernel consumes submissions in order, so whatever it took
+    // came off the front of the queued requests.
+    if ((uint32) result >= m_NumQueuedSQEs) {
+        m_NumQueuedSQEs = 0;
+    } else {
+        m_NumQueuedSQEs -= (uint32) result;
+    }
+
+abort:
+    returnErr(err);
+} // EnterRing.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WaitForCompletions]
+//
+// Block until there is at least one completion in the ring.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CIOUring::WaitForCompletions() {
+    ErrVal err = ENoErr;
+    int result;
+
+    result = (int) syscall(
+                        __NR_io_uring_enter,
+                        m_RingFd,
+                        0,
+                        1,
+                        IORING_ENTER_GETEVENTS,
+                        NULL,
+                        0);
+    if ((result < 0) && (EINTR != errno)) {
+        DEBUG_LOG("CIOUring::WaitForCompletions. io_uring_enter failed. errno = %d", errno);
+        gotoErr(EFail);
+    }
+
+abort:
+    returnErr(err);
+} // WaitForCompletions.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetNextCompletion]
+//
+// Only the thread that reaps completions calls this, so the completion ring needs no lock.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CIOUring::GetNextCompletion(uint64 *pUserData, int32 *pResult) {
+    uint32 head;
+    struct io_uring_cqe *pCQE;
+
+    head = *m_pCQHead;
+    if (head == __atomic_load_n(m_pCQTail, __ATOMIC_ACQUIRE)) {
+        return(false);
+    }
+
+    pCQE = &(m_pCQEs[head & m_CQMask]);
+    *pUserData = pCQE->user_data;
+    *pResult = pCQE->res;
+    __atomic_store_n(m_pCQHead, head + 1, __ATOMIC_RELEASE);
+
+    return(true);
+} // GetNextCompletion.
+#endif // LINUX
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//                          TESTING PROCEDURES
+//
+/////////////////////////////////////////////////////////////////////////////
+#if INCLUDE_REGRESSION_TESTS
+
+static ErrVal TestOpenBlockIO(
+                     int32 numBlockIOs,
+                     int32 openOptions,
+                     int32 storeSize,
+                     bool memDevice);
+
+static ErrVal TestWriteBlocks(
+                    CAsyncBlockIO *pBlockIO,
+                    int32 startByte,
+                    int32 numBytes,
+                    int16 baseVal);
+
+static ErrVal TestReadBlocks(
+                    CAsyncBlockIO *pBlockIO,
+                    int32 startByte,
+                    int32 numBytes,
+                    int16 baseVal);
+
+static void RunBlockIOTests(
+                    int32 numBlockIOs,
+                    int32 storeSize,
+                    int32 growAmount,
+                    bool memDevice);
+
+static void TestNet();
+static ErrVal TestNetWriteChain();
+static ErrVal TestNetLoopbackEcho(const char *pTestName, const CNetIOTestSettings *pSettings);
+static ErrVal TestNetCrossReactorClose();
+static ErrVal TestNetDatagramBatch();
+static ErrVal TestNetReusePortListeners();
+
+#define WRITE_CHAIN_TEST_NUM_BUFFERS    40
+#define WRITE_CHAIN_TEST_BUFFER_SIZE    10000
+#define WRITE_CHAIN_TEST_TOTAL_BYTES    (WRITE_CHAIN_TEST_NUM_BUFFERS * WRITE_CHAIN_TEST_BUFFER_SIZE)
+#define WRITE_CHAIN_TEST_BYTE(_pos) ((char) (((_pos) % 251) ^ ((_pos) / 251)))
+#define WRITE_CHAIN_TEST_SOCKET_BUFFER_SIZE 16000
+
+#define LOOPBACK_TEST_MAX_CONNECTIONS   16
+#define LOOPBACK_TEST_NUM_SENDS         3
+#define LOOPBACK_TEST_SEND_SIZE         10000
+#define LOOPBACK_TEST_BYTE(_pos)        ((char) (((_pos) % 241) ^ ((_pos) / 241)))
+
+// This is more than one recvmmsg or sendmmsg batch. The first byte of each
+// datagram is its number, and each one is a different size.
+#define DATAGRAM_TEST_NUM_DATAGRAMS     40
+#define DATAGRAM_TEST_SIZE(_num)        (100 + ((_num) * 23))
+
+#define REUSEPORT_TEST_NUM_LISTENERS    2
+#define REUSEPORT_TEST_NUM_CLIENTS      8
+
+static ErrVal TestReadPastEof(CAsyncBlockIO *pBlockIO, int32 startByte);
+
+static ErrVal TestDirectFileIO();
+
+static ErrVal TestFileBlockCache();
+static ErrVal TestCachedRead(
+                    CAsyncBlockIO *pBlockIO,
+                    CIOBuffer *pBuffer,
+                    int64 pos,
+                    int32 numBytes,
+                    bool fBlockTwoChanged);
+
+#define CACHE_TEST_NUM_BLOCKS   12
+#define CACHE_TEST_CACHE_SIZE   8
+#define CACHE_TEST_CHANGED_BYTE 77
+
+static ErrVal TestFilePreallocation();
+
+static ErrVal TestGrowingMemoryStore();
+
+static ErrVal TestIOBufferPool();
+static ErrVal TestBufferSlices();
+
+#define BUFFER_POOL_TEST_ODD_SIZE       1000
+#define BUFFER_POOL_TEST_NUM_BUFFERS    40
+#define SLICE_TEST_OFFSET               100
+#define SLICE_TEST_LENGTH               300
+
+#define MEMORY_GROW_TEST_SIZE           (5 * 16 * 1024 + 300)
+#define MEMORY_GROW_TEST_OFFSET         700
+#define MEMORY_GROW_TEST_SHRUNK_SIZE    (2 * 16 * 1024 + 100)
+
+#define PREALLOCATION_TEST_NUM_BLOCKS   40
+#define PREALLOCATION_TEST_MIN_CHUNK    (16 * 1024)
+#define PREALLOCATION_TEST_MAX_CHUNK    (64 * 1024)
+
+#define NUM_TEST_BLOCKIOS       1
+#define BYTES_IN_STORE          10300
+#define TEST_BLOCK_SIZE         100000
+
+static char g_TestPathPrefix[512];
+static CAsyncBlockIO *g_BlockIOList[NUM_TEST_BLOCKIOS];
+static char g_TestMemoryDevice[TEST_BLOCK_SIZE];
+static CSynCAsyncBlockIOCallback *g_TestCallback;
+
+static char *g_TestServerName = (char *) "www.google.com";
+static int g_TestServerPort = 80;
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CIOSystem::TestBlockIO() {
+    ErrVal err = ENoErr;
+    bool fFoundProxy;
+
+
+    g_DebugManager.StartModuleTest("Block IO");
+
+    fFoundProxy = NetIO_GetLocalProxySettings(&g_TestServerName, &g_TestServerPort);
+    if (!fFoundProxy) {
+        g_TestServerName = (char *) "www.google.com";
+        g_TestServerPort = 80;
+    }
+
+    g_TestCallback = newex CSynCAsyncBlockIOCallback;
+    if (NULL == g_TestCallback) {
+        DEBUG_WARNING("Error");
+        return;
+    }
+    err = g_TestCallback->Initialize();
+    if (err) {
+        DEBUG_WARNING("Error");
+        return;
+    }
+
+    g_DebugManager.AddTestResultsDirectoryPath(
+                        "",
+                        g_TestPathPrefix,
+                        sizeof g_TestPathPrefix);
+    printf("\nDood: g_TestPathPrefix=%s\n", g_TestPathPrefix);
+
+
+    g_pMemoryIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
+    g_pFileIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
+    g_pNetIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
+
+    g_DebugManager.StartSubTest("Memory Block IO");
+    RunBlockIOTests(1, BYTES_IN_STORE, BYTES_IN_STORE, true);
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("Growing Memory Block IO");
+    (void) TestGrowingMemoryStore();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("IO Buffer Pool");
+    (void) TestIOBufferPool();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("IO Buffer Slices");
+    (void) TestBufferSlices();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("File Block IO");
+    RunBlockIOTests(NUM_TEST_BLOCKIOS, BYTES_IN_STORE, BYTES_IN_STORE, false);
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("File Block IO with io_uring");
+    {
+        CFileIOTestSettings uringSettings;
+
+        // If the kernel has no io_uring, this quietly runs synchronously.
+        uringSettings.m_UseIOUring = 1;
+        if (RestartFileIOSystem(&uringSettings)) {
+            DEBUG_WARNING("Cannot restart the file system.");
+        } else {
+            RunBlockIOTests(NUM_TEST_BLOCKIOS, BYTES_IN_STORE, BYTES_IN_STORE, false);
+        }
+
+        // Put back whatever the config file asks for. This also fails if
+        // the tests left a file open.
+        if (RestartFileIOSystem(NULL)) {
+            DEBUG_WARNING("A file test left a blockIO open.");
+        }
+    }
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("Direct File Block IO");
+    (void) TestDirectFileIO();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("File Block Cache");
+    (void) TestFileBlockCache();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("File Preallocation");
+    (void) TestFilePreallocation();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("Network Write Chain");
+    (void) TestNetWriteChain();
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("Network Loopback");
+    {
+        CNetIOTestSettings selectSettings;
+        CNetIOTestSettings epollSettings;
+        CNetIOTestSettings uringSettings;
+
+        selectSettings.m_UseEpoll = 0;
+        selectSettings.m_UseIOUring = 0;
+        (void) TestNetLoopbackEcho("Connect, echo and close with select", &selectSettings);
+
+        epollSettings.m_UseEpoll = 1;
+        epollSettings.m_UseIOUring = 0;
+        (void) TestNetLoopbackEcho("Connect, echo and close with epoll", &epollSettings);
+
+        // If the kernel has no io_uring, this quietly runs over epoll.
+        uringSettings.m_UseEpoll = 1;
+        uringSettings.m_UseIOUring = 1;
+        (void) TestNetLoopbackEcho("Connect, echo and close with io_uring", &uringSettings);
+
+        (void) TestNetCrossReactorClose();
+        (void) TestNetDatagramBatch();
+        (void) TestNetReusePortListeners();
+
+        // Put back whatever the config file asks for. This also fails if
+        // any of the tests left a blockIO on a reactor.
+        if (NetIO_RestartNetIOSystem(NULL)) {
+            DEBUG_WARNING("A loopback test left a network blockIO open.");
+        }
+    }
+    g_DebugManager.EndSubTest();
+
+    g_DebugManager.StartSubTest("Network Block IO");
+    TestNet();
+    g_DebugManager.EndSubTest();
+} // TestBlockIO.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [RunBlockIOTests]
+//
+/////////////////////////////////////////////////////////////////////////////
+static void
+RunBlockIOTests(
+         int32 numBlockIOs,
+         int32 storeSize,
+         int32 growAmount,
+         bool memDevice) {
+    ErrVal err = ENoErr;
+    int16 blockIONum;
+    int32 grownStoreSize;
+    int32 shrunkStoreSize;
+
+
+    g_DebugManager.StartTest("Creating BlockIOs for new stores");
+    err = TestOpenBlockIO(
+                     numBlockIOs,
+                     CAsyncBlockIO::CREATE_NEW_STORE | CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
+                     storeSize,
+                     memDevice);
+    if (err) {
+       DEBUG_WARNING("Cannot create an store.");
+       gotoErr(err);
+    }
+
+
+    g_DebugManager.StartTest("Writing and Reading stores");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Closing and re-opening pBlockIOs");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        (g_BlockIOList[blockIONum])->Close();
+        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+    }
+
+    err = TestOpenBlockIO(
+                     numBlockIOs,
+                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
+                     storeSize,
+                     memDevice);
+    if (err) {
+       DEBUG_WARNING("Cannot create an store.");
+       gotoErr(err);
+    }
+
+    // Memory devices do not keep their state.
+    if (!memDevice) {
+         // Read the contents.
+         for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++)
+         {
+            err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 12);
+            if (err) {
+                  gotoErr(err);
+            }
+         }
+    }
+
+
+
+    // Now, read and write the entire stores after they have been
+    // overwritten.
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+        err = TestReadPastEof(g_BlockIOList[blockIONum], storeSize);
+        if (err) {
+            DEBUG_WARNING("Error while reading a store.");
+            gotoErr(EFail);
+        }
+    }
+
+    // Memory devices do not keep their state.
+    if (memDevice) {
+       gotoErr(ENoErr);
+    }
+
+
+    g_DebugManager.StartTest("Growing stores");
+    grownStoreSize = storeSize + growAmount;
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        err = (g_BlockIOList[blockIONum])->Resize(grownStoreSize);
+        if (err) {
+            DEBUG_WARNING("Cannot grow a store");
+            gotoErr(err);
+        }
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, storeSize, 31);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Reading and Writing Grown Stores");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+        err = TestReadPastEof(g_BlockIOList[blockIONum], grownStoreSize);
+        if (err) {
+            DEBUG_WARNING("Error while reading a store.");
+            gotoErr(EFail);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Closing and re-opening grown pBlockIOs");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        (g_BlockIOList[blockIONum])->Close();
+        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+    }
+
+
+
+    err = TestOpenBlockIO(
+                     numBlockIOs,
+                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
+                     storeSize,
+                     memDevice);
+    if (err) {
+       DEBUG_WARNING("Cannot create an store.");
+       gotoErr(err);
+    }
+
+    // Read the contents.
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
+        if (err)
+            gotoErr(err);
+    }
+
+
+
+
+
+    g_DebugManager.StartTest("Shrinking stores");
+    shrunkStoreSize = storeSize - (growAmount >> 1);
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        err = (g_BlockIOList[blockIONum])->Resize(shrunkStoreSize);
+        if (err) {
+            DEBUG_WARNING("Cannot grow a store");
+            gotoErr(err);
+        }
+    }
+
+
+    g_DebugManager.StartTest("Reading and Writing shrunk Stores");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+
+
+    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+        err = TestReadPastEof(g_BlockIOList[blockIONum], shrunkStoreSize);
+        if (err) {
+            DEBUG_WARNING("Error while reading a store.");
+            gotoErr(EFail);
+        }
+    }
+
+
+    g_DebugManager.StartTest("Closing and re-opening shrunk pBlockIOs");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        (g_BlockIOList[blockIONum])->Close();
+        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+    }
+
+
+    err = TestOpenBlockIO(
+                     numBlockIOs,
+                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
+                     storeSize,
+                     memDevice);
+    if (err) {
+       DEBUG_WARNING("Cannot create an store.");
+       gotoErr(err);
+    }
+
+
+    // Read the contents.
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+
+
+    g_DebugManager.StartTest("Closing stores");
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        g_DebugManager.ShowProgress();
+
+        if (g_BlockIOList[blockIONum]) {
+            g_BlockIOList[blockIONum]->Close();
+            RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+        }
+    }
+
+abort:
+    if (err) {
+        ::printf("\n\n\nERROR\n\n\n");
+    }
+    return;
+} // RunBlockIOTests.
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestOpenBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestOpenBlockIO(
+         int32 numBlockIOs,
+         int32 openOptions,
+         int32 storeSize,
+         bool memDevice
+        ) {
+    ErrVal err = ENoErr;
+    int16 blockIONum;
+    CParsedUrl *pUrl = NULL;
+    char buffer[CParsedUrl::MAX_URL_LENGTH];
+
+
+    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
+        RELEASE_OBJECT(pUrl);
+        pUrl = NULL;
+        g_DebugManager.ShowProgress();
+
+        if (memDevice) {
+            pUrl = CParsedUrl::AllocateMemoryUrl(0, storeSize, 0);
+            if (NULL == pUrl) {
+                gotoErr(EFail);
+            }
+
+            err = g_pMemoryIOSystem->OpenBlockIO(pUrl, openOptions, g_TestCallback);
+        } else {
+            snprintf(
+                buffer,
+                sizeof(buffer),
+                "%stestFile%d",
+                g_TestPathPrefix,
+                blockIONum);
+            pUrl = CParsedUrl::AllocateFileUrl(buffer);
+            if (NULL == pUrl) {
+                gotoErr(EFail);
+            }
+
+            err = g_pFileIOSystem->OpenBlockIO(pUrl, openOptions, g_TestCallback);
+        }
+        if (err) {
+            DEBUG_WARNING("Cannot create an store.");
+            gotoErr(err);
+        }
+
+        err = g_TestCallback->Wait();
+        if (err) {
+            DEBUG_WARNING("Cannot create an store.");
+            gotoErr(err);
+        }
+
+        g_BlockIOList[blockIONum] = g_TestCallback->m_pBlockIO;
+        g_TestCallback->m_pBlockIO = NULL;
+
+        if (NULL == g_BlockIOList[blockIONum]) {
+            DEBUG_WARNING("Cannot open an store.");
+            gotoErr(err);
+        }
+
+        (g_BlockIOList[blockIONum])->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
+    }
+
+abort:
+    RELEASE_OBJECT(pUrl);
+    returnErr(err);
+} // TestOpenBlockIO
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestWriteBlocks]
+//
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestWriteBlocks(
+         CAsyncBlockIO *pBlockIO,
+         int32 startByte,
+         int32 numBytes,
+         int16 baseVal
+        ) {
+    ErrVal err = ENoErr;
+    int32 byteNum;
+    int32 bytesPerBlock;
+    int32 bytesWritten;
+    int32 bytesToWrite;
+    CIOBuffer *pBuffer = NULL;
+    CIOSystem *pIOSystem = NULL;
+
+    if (!pBlockIO) {
+        gotoErr(EFail);
+    }
+
+    pIOSystem = pBlockIO->GetIOSystem();
+    bytesPerBlock = pIOSystem->GetDefaultBytesPerBlock();
+    if (bytesPerBlock <= 0) {
+        DEBUG_WARNING("Invalid bytes per block.");
+        gotoErr(EFail);
+    }
+
+    if (bytesPerBlock >= TEST_BLOCK_SIZE) {
+        DEBUG_WARNING("Block size too big");
+        gotoErr(EFail);
+    }
+
+    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
+    if (!pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+
+    bytesWritten = 0;
+    while (bytesWritten < numBytes) {
+        g_DebugManager.ShowProgress();
+
+        bytesToWrite = bytesPerBlock;
+        if ((bytesWritten + bytesToWrite) > numBytes) {
+            bytesToWrite = numBytes - bytesWritten;
+        }
+
+        // First, initialize the blocks.
+        for (byteNum = 0; byteNum < bytesToWrite; byteNum++) {
+            g_TestMemoryDevice[byteNum] = (char) (byteNum + baseVal);
+        }
+
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pBuffer->m_Err = ENoErr;
+        pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
+        pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+        pBuffer->m_BufferSize = bytesToWrite;
+        ASSERT(bytesToWrite > 0);
+        pBuffer->m_NumValidBytes = bytesToWrite;
+        ASSERT(pBuffer->m_NumValidBytes >= 0);
+        pBuffer->m_PosInMedia = startByte;
+        pBuffer->m_StartWriteOffset = 0;
+
+        pBlockIO->WriteBlockAsync(pBuffer, 0);
+        g_TestCallback->Wait();
+        if ((ENoErr != pBuffer->m_Err)
+            || (pBuffer->m_NumValidBytes != bytesToWrite)) {
+            DEBUG_WARNING("Error while writing a block.");
+            gotoErr(EFail);
+        }
+
+        startByte += bytesToWrite;
+        bytesWritten += bytesToWrite;
+    }
+
+abort:
+    CIOSystem::ReleaseBlockList(pBuffer);
+    returnErr(ENoErr);
+} // TestWriteBlocks.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestReadBlocks]
+//
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestReadBlocks(
+         CAsyncBlockIO *pBlockIO,
+         int32 startByte,
+         int32 numBytes,
+         int16 baseVal
+        ) {
+    ErrVal err = ENoErr;
+    int32 byteNum;
+    int32 bytesRead;
+    int32 bytesPerBlock;
+    int32 bytesToRead;
+    CIOBuffer *pBuffer = NULL;
+    char c;
+    int16 same;
+    CIOSystem *pIOSystem;
+
+    if (!pBlockIO) {
+        gotoErr(EFail);
+    }
+
+    pIOSystem = pBlockIO->GetIOSystem();
+    bytesPerBlock = pIOSystem->GetDefaultBytesPerBlock();
+    if (bytesPerBlock <= 0) {
+        DEBUG_WARNING("Invalid bytes per block.");
+        gotoErr(EFail);
+    }
+
+    if (bytesPerBlock >= TEST_BLOCK_SIZE) {
+        DEBUG_WARNING("Block size too big");
+        gotoErr(EFail);
+    }
+
+
+    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
+    if (!pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    bytesRead = 0;
+    while (bytesRead < numBytes) {
+        g_DebugManager.ShowProgress();
+
+        bytesToRead = bytesPerBlock;
+        if ((bytesRead + bytesToRead) > numBytes) {
+            bytesToRead = numBytes - bytesRead;
+        }
+
+        // Zero out the memory.
+        memset(g_TestMemoryDevice, 0, bytesRead);
+
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_Err = ENoErr;
+        pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
+        pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+        pBuffer->m_BufferSize = bytesToRead;
+        ASSERT(bytesToRead > 0);
+        pBuffer->m_NumValidBytes = bytesToRead;
+        ASSERT(pBuffer->m_NumValidBytes >= 0);
+        pBuffer->m_PosInMedia = startByte;
+
+        pBlockIO->ReadBlockAsync(pBuffer);
+
+        // Be careful; once we grow a file we may get more data than
+        // we originally wrote.
+        g_TestCallback->Wait();
+        if ((ENoErr != pBuffer->m_Err)
+            || (pBuffer->m_NumValidBytes < bytesToRead)) {
+            DEBUG_WARNING("Error while reading a block.");
+            gotoErr(EFail);
+        }
+
+        same = true;
+        for (byteNum = 0; byteNum < bytesToRead; byteNum++) {
+            c = (char) (byteNum + baseVal);
+            if (c != g_TestMemoryDevice[byteNum]) {
+                same = false;
+                break;
+            }
+        }
+
+        if (!same) {
+            DEBUG_WARNING("Data read does not match what was written. byteNum = %d\n",
+                    byteNum);
+            gotoErr(EFail);
+        }
+
+        startByte += bytesToRead;
+        bytesRead += bytesToRead;
+    }
+
+abort:
+    CIOSystem::ReleaseBlockList(pBuffer);
+    returnErr(ENoErr);
+} // TestReadBlocks.
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestReadPastEof]
+//
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestReadPastEof(CAsyncBlockIO *pBlockIO, int32 startByte) {
+    ErrVal err = ENoErr;
+    int32 bytesToRead;
+    CIOBuffer *pBuffer = NULL;
+    CIOSystem *pIOSystem;
+    int64 pos;
+
+    if (!pBlockIO) {
+        gotoErr(EFail);
+    }
+
+    pIOSystem = pBlockIO->GetIOSystem();
+
+    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
+    if (!pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    bytesToRead = 10;
+
+    pos = pIOSystem->GetIOStartPosition(startByte)
+                + pIOSystem->GetDefaultBytesPerBlock();
+
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_Err = ENoErr;
+    pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_BufferSize = bytesToRead;
+    ASSERT(bytesToRead > 0);
+    pBuffer->m_NumValidBytes = bytesToRead;
+    ASSERT(pBuffer->m_NumValidBytes >= 0);
+    pBuffer->m_PosInMedia = pos;
+
+    pBlockIO->ReadBlockAsync(pBuffer);
+    g_TestCallback->Wait();
+    if (EEOF == pBuffer->m_Err) {
+        err = ENoErr;
+    } else {
+        err = EFail;
+    }
+
+    if (err) {
+        DEBUG_WARNING("Error while reading a block.");
+        gotoErr(EFail);
+    }
+
+    if (pBuffer->m_NumValidBytes != 0) {
+        DEBUG_WARNING("Error. No error from reading past eof.");
+        gotoErr(EFail);
+    }
+
+abort:
+    RELEASE_OBJECT(pBuffer);
+    returnErr(ENoErr);
+} // TestReadPastEof.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestDirectFileIO]
+//
+// Write one whole block and then a partial block at the end of a file
+// opened for unbuffered IO. The partial block is the hard case, since the
+// device can only write whole blocks.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestDirectFileIO() {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pBlockIO = NULL;
+    CIOBuffer *pBuffer = NULL;
+    int32 bytesPerBlock;
+    int32 tailSize = 1000;
+    int32 byteNum;
+
+    g_DebugManager.StartTest("Writing a partial last block");
+    err = TestOpenBlockIO(
+                     1,
+                     CAsyncBlockIO::CREATE_NEW_STORE
+                        | CAsyncBlockIO::WRITE_ACCESS
+                        | CAsyncBlockIO::READ_ACCESS
+                        | CAsyncBlockIO::USE_DIRECT_IO,
+                     0,
+                     false);
+    if (err) {
+        DEBUG_WARNING("Cannot create a store.");
+        gotoErr(err);
+    }
+    pBlockIO = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    bytesPerBlock = pBlockIO->GetIOSystem()->GetDefaultBytesPerBlock();
+    pBuffer = pBlockIO->GetIOSystem()->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    for (byteNum = 0; byteNum < bytesPerBlock; byteNum++) {
+        pBuffer->m_pLogicalBuffer[byteNum] = (char) (byteNum + 17);
+    }
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_NumValidBytes = bytesPerBlock;
+    pBuffer->m_PosInMedia = 0;
+    pBlockIO->WriteBlockAsync(pBuffer, 0);
+    g_TestCallback->Wait();
+    if (ENoErr != pBuffer->m_Err) {
+        DEBUG_WARNING("Error while writing a block.");
+        gotoErr(EFail);
+    }
+
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_NumValidBytes = tailSize;
+    pBuffer->m_PosInMedia = bytesPerBlock;
+    pBlockIO->WriteBlockAsync(pBuffer, 0);
+    g_TestCallback->Wait();
+    if (ENoErr != pBuffer->m_Err) {
+        DEBUG_WARNING("Error while writing a partial block.");
+        gotoErr(EFail);
+    }
+    if (pBlockIO->GetMediaSize() != (bytesPerBlock + tailSize)) {
+        DEBUG_WARNING("Wrong file size after writing a partial block.");
+        gotoErr(EFail);
+    }
+
+    g_DebugManager.StartTest("Reading a partial last block");
+    memset(pBuffer->m_pLogicalBuffer, 0, bytesPerBlock);
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_NumValidBytes = 0;
+    pBuffer->m_PosInMedia = bytesPerBlock;
+    pBlockIO->ReadBlockAsync(pBuffer);
+    g_TestCallback->Wait();
+    if ((ENoErr != pBuffer->m_Err)
+        || (pBuffer->m_NumValidBytes != tailSize)) {
+        DEBUG_WARNING("Error while reading a partial block.");
+        gotoErr(EFail);
+    }
+    for (byteNum = 0; byteNum < tailSize; byteNum++) {
+        if ((char) (byteNum + 17) != pBuffer->m_pLogicalBuffer[byteNum]) {
+            DEBUG_WARNING("Data read does not match what was written. byteNum = %d", byteNum);
+            gotoErr(EFail);
+        }
+    }
+
+    g_DebugManager.StartTest("Shrinking to a partial block");
+    err = pBlockIO->Resize(bytesPerBlock + 100);
+    if (err) {
+        DEBUG_WARNING("Cannot shrink a store");
+        gotoErr(err);
+    }
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_NumValidBytes = 0;
+    pBuffer->m_PosInMedia = bytesPerBlock;
+    pBlockIO->ReadBlockAsync(pBuffer);
+    g_TestCallback->Wait();
+    if ((ENoErr != pBuffer->m_Err)
+        || (pBuffer->m_NumValidBytes != 100)) {
+        DEBUG_WARNING("Error while reading a shrunk partial block.");
+        gotoErr(EFail);
+    }
+
+abort:
+    RELEASE_OBJECT(pBuffer);
+    if (NULL != pBlockIO) {
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+    returnErr(err);
+} // TestDirectFileIO.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestFileBlockCache]
+//
+// Two blockIOs on the same file share one block cache. A write through one
+// must be seen by a read through the other.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestFileBlockCache() {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pWriter = NULL;
+    CAsyncBlockIO *pReader = NULL;
+    CIOBuffer *pBuffer = NULL;
+    CIOBuffer *pBlockBuffer = NULL;
+    int32 bytesPerBlock;
+    int32 byteNum;
+    int32 passNum;
+    int64 numHits;
+    int64 numMisses;
+    int64 prevNumHits;
+
+    err = SetFileBlockCacheSize(CACHE_TEST_CACHE_SIZE);
+    if (err) {
+        DEBUG_WARNING("Cannot turn on the file block cache.");
+        gotoErr(err);
+    }
+
+    g_DebugManager.StartTest("Filling a file for the block cache");
+    err = TestOpenBlockIO(
+                     1,
+                     CAsyncBlockIO::CREATE_NEW_STORE
+                        | CAsyncBlockIO::WRITE_ACCESS
+                        | CAsyncBlockIO::READ_ACCESS
+                        | CAsyncBlockIO::USE_SYNCHRONOUS_IO,
+                     0,
+                     false);
+    if (err) {
+        DEBUG_WARNING("Cannot create a store.");
+        gotoErr(err);
+    }
+    pWriter = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    bytesPerBlock = pWriter->GetIOSystem()->GetDefaultBytesPerBlock();
+    pBuffer = pWriter->GetIOSystem()->AllocIOBuffer(
+                                        bytesPerBlock * CACHE_TEST_NUM_BLOCKS,
+                                        true);
+    pBlockBuffer = pWriter->GetIOSystem()->AllocIOBuffer(-1, true);
+    if ((NULL == pBuffer) || (NULL == pBlockBuffer)) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    for (byteNum = 0; byteNum < bytesPerBlock * CACHE_TEST_NUM_BLOCKS; byteNum++) {
+        pBuffer->m_pLogicalBuffer[byteNum] = (char) byteNum;
+    }
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_NumValidBytes = bytesPerBlock * CACHE_TEST_NUM_BLOCKS;
+    pBuffer->m_PosInMedia = 0;
+    pWriter->WriteBlockAsync(pBuffer, 0);
+    g_TestCallback->Wait();
+    if (ENoErr != pBuffer->m_Err) {
+        DEBUG_WARNING("Error while writing a block.");
+        gotoErr(EFail);
+    }
+
+    err = TestOpenBlockIO(
+                     1,
+                     CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::USE_SYNCHRONOUS_IO,
+                     0,
+                     false);
+    if (err) {
+        DEBUG_WARNING("Cannot open a store.");
+        gotoErr(err);
+    }
+    pReader = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    g_DebugManager.StartTest("Reading a block from the block cache");
+    err = TestCachedRead(pReader, pBlockBuffer, 2 * bytesPerBlock, bytesPerBlock, false);
+    if (err) {
+        gotoErr(err);
+    }
+    GetFileBlockCacheStats(&prevNumHits, &numMisses);
+    err = TestCachedRead(pReader, pBlockBuffer, 2 * bytesPerBlock, bytesPerBlock, false);
+    if (err) {
+        gotoErr(err);
+    }
+    GetFileBlockCacheStats(&numHits, &numMisses);
+    if (numHits != (prevNumHits + 1)) {
+        DEBUG_WARNING("A block was not read from the block cache.");
+        gotoErr(EFail);
+    }
+
+    g_DebugManager.StartTest("Invalidating the block cache on a write");
+    memset(pBlockBuffer->m_pLogicalBuffer, CACHE_TEST_CHANGED_BYTE, bytesPerBlock);
+    pBlockBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBlockBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBlockBuffer->m_NumValidBytes = bytesPerBlock;
+    pBlockBuffer->m_PosInMedia = 2 * bytesPerBlock;
+    pWriter->WriteBlockAsync(pBlockBuffer, 0);
+    g_TestCallback->Wait();
+    if (ENoErr != pBlockBuffer->m_Err) {
+        DEBUG_WARNING("Error while writing a block.");
+        gotoErr(EFail);
+    }
+    err = TestCachedRead(pReader, pBlockBuffer, 2 * bytesPerBlock, bytesPerBlock, true);
+    if (err) {
+        gotoErr(err);
+    }
+
+    g_DebugManager.StartTest("Reading more blocks than the block cache holds");
+    for (passNum = 0; passNum < 3; passNum++) {
+        err = TestCachedRead(
+                    pReader,
+                    pBuffer,
+                    0,
+                    bytesPerBlock * CACHE_TEST_NUM_BLOCKS,
+                    true);
         if (err) {
-            DEBUG_WARNING("Error while reading a store.");
+            gotoErr(err);
+        }
+    }
+
+abort:
+    (void) SetFileBlockCacheSize(0);
+    RELEASE_OBJECT(pBuffer);
+    RELEASE_OBJECT(pBlockBuffer);
+    if (NULL != pReader) {
+        pReader->Close();
+        RELEASE_OBJECT(pReader);
+    }
+    if (NULL != pWriter) {
+        pWriter->Close();
+        RELEASE_OBJECT(pWriter);
+    }
+    returnErr(err);
+} // TestFileBlockCache.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestGrowingMemoryStore]
+//
+// Start with an empty memory store and let the writes grow it over
+// several pages. The second pass starts part way into a block, so its
+// reads and writes cross from one page into the next.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestGrowingMemoryStore() {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pBlockIO = NULL;
+
+    g_DebugManager.StartTest("Growing an empty memory store");
+    err = TestOpenBlockIO(
+                     1,
+                     CAsyncBlockIO::CREATE_NEW_STORE
+                        | CAsyncBlockIO::WRITE_ACCESS
+                        | CAsyncBlockIO::READ_ACCESS,
+                     0,
+                     true);
+    if (err) {
+        DEBUG_WARNING("Cannot create a store.");
+        gotoErr(err);
+    }
+    pBlockIO = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    err = TestWriteBlocks(pBlockIO, 0, MEMORY_GROW_TEST_SIZE, 41);
+    if (err) {
+        gotoErr(err);
+    }
+    if (MEMORY_GROW_TEST_SIZE != pBlockIO->GetMediaSize()) {
+        DEBUG_WARNING("Wrong size for a grown memory store.");
+    }
+    err = TestReadBlocks(pBlockIO, 0, MEMORY_GROW_TEST_SIZE, 41);
+    if (err) {
+        gotoErr(err);
+    }
+
+
+    g_DebugManager.StartTest("Reading and writing across memory pages");
+    err = TestWriteBlocks(
+                pBlockIO,
+                MEMORY_GROW_TEST_OFFSET,
+                MEMORY_GROW_TEST_SIZE - MEMORY_GROW_TEST_OFFSET,
+                47);
+    if (err) {
+        gotoErr(err);
+    }
+    err = TestReadBlocks(
+                pBlockIO,
+                MEMORY_GROW_TEST_OFFSET,
+                MEMORY_GROW_TEST_SIZE - MEMORY_GROW_TEST_OFFSET,
+                47);
+    if (err) {
+        gotoErr(err);
+    }
+
+
+    g_DebugManager.StartTest("Shrinking and regrowing a memory store");
+    err = pBlockIO->Resize(MEMORY_GROW_TEST_SHRUNK_SIZE);
+    if (err) {
+        DEBUG_WARNING("Cannot shrink a store");
+        gotoErr(err);
+    }
+    err = TestReadPastEof(pBlockIO, MEMORY_GROW_TEST_SHRUNK_SIZE);
+    if (err) {
+        gotoErr(err);
+    }
+    err = pBlockIO->Resize(MEMORY_GROW_TEST_SIZE);
+    if (err) {
+        DEBUG_WARNING("Cannot grow a store");
+        gotoErr(err);
+    }
+    err = TestWriteBlocks(pBlockIO, 0, MEMORY_GROW_TEST_SIZE, 53);
+    if (err) {
+        gotoErr(err);
+    }
+    err = TestReadBlocks(pBlockIO, 0, MEMORY_GROW_TEST_SIZE, 53);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    if (pBlockIO) {
+        pBlockIO->Close();
+    }
+    RELEASE_OBJECT(pBlockIO);
+    returnErr(err);
+} // TestGrowingMemoryStore.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestIOBufferPool]
+//
+// A released buffer should come back from the next AllocIOBuffer of the
+// same size, with its memory but none of its old state. It comes back on
+// the thread that released it, and idle lists shrink when they go unused.
+/////////////////////////////////////////////////////////////////////////////
+#if LINUX
+static CIOBuffer *g_pPoolTestOtherThreadBuffer = NULL;
+static CRefEvent *g_pPoolTestThreadDone = NULL;
+
+static void
+PoolTestThreadProc(void *arg, CSimpleThread *pThread) {
+    CIOBuffer *pBuffer;
+    UNUSED_PARAM(arg);
+    UNUSED_PARAM(pThread);
+
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    g_pPoolTestOtherThreadBuffer = pBuffer;
+    RELEASE_OBJECT(pBuffer);
+    g_pPoolTestThreadDone->Signal();
+} // PoolTestThreadProc.
+#endif
+
+
+static ErrVal
+TestIOBufferPool() {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    CIOBuffer *pOldBuffer;
+    char *pOldMemory;
+    CIOBuffer *bufferList[BUFFER_POOL_TEST_NUM_BUFFERS];
+    int32 bufferNum;
+    int32 numIdleBuffers;
+
+    g_DebugManager.StartTest("Reusing a buffer with its memory");
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    pOldBuffer = pBuffer;
+    pOldMemory = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer + 10;
+    pBuffer->m_NumValidBytes = 10;
+    pBuffer->m_PosInMedia = 1234;
+    RELEASE_OBJECT(pBuffer);
+
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    if ((pOldBuffer != pBuffer) || (pOldMemory != pBuffer->m_pPhysicalBuffer)) {
+        DEBUG_WARNING("A released buffer was not reused.");
+    }
+    if ((CIOBuffer::ALLOCATED_BUFFER != pBuffer->m_BufferFlags)
+        || (pBuffer->m_pLogicalBuffer != pBuffer->m_pPhysicalBuffer)
+        || (0 != pBuffer->m_NumValidBytes)
+        || (0 != pBuffer->m_PosInMedia)
+        || (g_pMemoryIOSystem->GetDefaultBytesPerBlock() != pBuffer->m_BufferSize)) {
+        DEBUG_WARNING("A reused buffer kept some old state.");
+    }
+    RELEASE_OBJECT(pBuffer);
+
+
+    g_DebugManager.StartTest("Reusing a buffer without its memory");
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(BUFFER_POOL_TEST_ODD_SIZE, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    pOldBuffer = pBuffer;
+    RELEASE_OBJECT(pBuffer);
+
+    // A buffer of an odd size gives up its memory, but the buffer
+    // itself can still be reused.
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, false);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    if (pOldBuffer != pBuffer) {
+        DEBUG_WARNING("A released buffer was not reused.");
+    }
+    if ((0 != pBuffer->m_BufferFlags)
+        || (NULL != pBuffer->m_pPhysicalBuffer)
+        || (0 != pBuffer->m_BufferSize)) {
+        DEBUG_WARNING("A reused buffer kept some old state.");
+    }
+    RELEASE_OBJECT(pBuffer);
+
+
+#if LINUX
+    g_DebugManager.StartTest("Reusing a buffer on the thread that released it");
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    pOldBuffer = pBuffer;
+    RELEASE_OBJECT(pBuffer);
+
+    g_pPoolTestThreadDone = newex CRefEvent;
+    if (NULL == g_pPoolTestThreadDone) {
+        gotoErr(EFail);
+    }
+    err = g_pPoolTestThreadDone->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+    err = CSimpleThread::CreateThread(
+                             "PoolTestThread",
+                             PoolTestThreadProc,
+                             NULL,
+                             NULL);
+    if (err) {
+        gotoErr(err);
+    }
+    g_pPoolTestThreadDone->Wait();
+    RELEASE_OBJECT(g_pPoolTestThreadDone);
+
+    // Our buffer stayed in our magazine, so the other thread could not get it.
+    if (pOldBuffer == g_pPoolTestOtherThreadBuffer) {
+        DEBUG_WARNING("Another thread took a buffer from this thread's magazine.");
+    }
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    if (pOldBuffer != pBuffer) {
+        DEBUG_WARNING("A released buffer was not reused by the same thread.");
+    }
+    RELEASE_OBJECT(pBuffer);
+#endif
+
+
+    g_DebugManager.StartTest("Trimming idle buffers");
+    for (bufferNum = 0; bufferNum < BUFFER_POOL_TEST_NUM_BUFFERS; bufferNum++) {
+        bufferList[bufferNum] = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    }
+    for (bufferNum = 0; bufferNum < BUFFER_POOL_TEST_NUM_BUFFERS; bufferNum++) {
+        RELEASE_OBJECT(bufferList[bufferNum]);
+    }
+
+    // The first trim ends the interval in which the buffers were used.
+    // None are used in the next one, so the second trim drops half of them.
+    g_pMemoryIOSystem->TrimIOBufferPool();
+    numIdleBuffers = g_pMemoryIOSystem->GetNumIdleIOBuffers();
+    g_pMemoryIOSystem->TrimIOBufferPool();
+    if ((numIdleBuffers <= 0)
+        || (g_pMemoryIOSystem->GetNumIdleIOBuffers() > (numIdleBuffers / 2))) {
+        DEBUG_WARNING("Idle buffers were not trimmed.");
+    }
+
+abort:
+#if LINUX
+    RELEASE_OBJECT(g_pPoolTestThreadDone);
+#endif
+    RELEASE_OBJECT(pBuffer);
+    returnErr(err);
+} // TestIOBufferPool.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestBufferSlices]
+//
+// Slices share the memory of their parent and keep it alive after the
+// parent is released.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestBufferSlices() {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    CIOBuffer *pSlice = NULL;
+    CIOBuffer *pSubSlice = NULL;
+    CIOBuffer *pBadSlice = NULL;
+    int32 index;
+
+    g_DebugManager.StartTest("Slices of a buffer");
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    for (index = 0; index < pBuffer->m_BufferSize; index++) {
+        pBuffer->m_pPhysicalBuffer[index] = (char) (index % 97);
+    }
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_NumValidBytes = pBuffer->m_BufferSize;
+
+    pSlice = g_pMemoryIOSystem->AllocBufferSlice(pBuffer, SLICE_TEST_OFFSET, SLICE_TEST_LENGTH);
+    if (NULL == pSlice) {
+        DEBUG_WARNING("Cannot make a slice.");
+        gotoErr(EFail);
+    }
+    pSubSlice = g_pMemoryIOSystem->AllocBufferSlice(pSlice, 1, SLICE_TEST_LENGTH - 2);
+    if (NULL == pSubSlice) {
+        DEBUG_WARNING("Cannot make a slice of a slice.");
+        gotoErr(EFail);
+    }
+    if ((pSlice->m_pLogicalBuffer != (pBuffer->m_pLogicalBuffer + SLICE_TEST_OFFSET))
+        || (SLICE_TEST_LENGTH != pSlice->m_NumValidBytes)
+        || (pBuffer != pSubSlice->m_pSliceParent)
+        || (pSubSlice->m_pLogicalBuffer != (pSlice->m_pLogicalBuffer + 1))) {
+        DEBUG_WARNING("A slice points at the wrong bytes.");
+    }
+    if (pSlice->CheckState() || pSubSlice->CheckState()) {
+        DEBUG_WARNING("A slice is not consistent.");
+    }
+
+    // Only the slices hold the memory now.
+    RELEASE_OBJECT(pBuffer);
+    for (index = 0; index < pSubSlice->m_NumValidBytes; index++) {
+        if (pSubSlice->m_pLogicalBuffer[index] != (char) ((SLICE_TEST_OFFSET + 1 + index) % 97)) {
+            DEBUG_WARNING("A slice lost its bytes.");
+            break;
+        }
+    }
+    RELEASE_OBJECT(pSlice);
+    RELEASE_OBJECT(pSubSlice);
+
+
+    g_DebugManager.StartTest("Slices that are not allowed");
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    pBuffer->m_NumValidBytes = SLICE_TEST_LENGTH;
+    pBadSlice = g_pMemoryIOSystem->AllocBufferSlice(pBuffer, SLICE_TEST_OFFSET, SLICE_TEST_LENGTH);
+    if (NULL != pBadSlice) {
+        DEBUG_WARNING("A slice runs past the valid bytes.");
+    }
+    RELEASE_OBJECT(pBadSlice);
+    RELEASE_OBJECT(pBuffer);
+
+    // Memory that belongs to a caller cannot be kept alive by a slice.
+    pBuffer = g_pMemoryIOSystem->AllocIOBuffer(-1, false);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_BufferSize = SLICE_TEST_LENGTH;
+    pBuffer->m_NumValidBytes = SLICE_TEST_LENGTH;
+    pBadSlice = g_pMemoryIOSystem->AllocBufferSlice(pBuffer, 0, SLICE_TEST_LENGTH);
+    if (NULL != pBadSlice) {
+        DEBUG_WARNING("A slice of memory the buffer does not own.");
+    }
+    RELEASE_OBJECT(pBadSlice);
+
+abort:
+    RELEASE_OBJECT(pSubSlice);
+    RELEASE_OBJECT(pSlice);
+    RELEASE_OBJECT(pBuffer);
+    returnErr(err);
+} // TestBufferSlices.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestFilePreallocation]
+//
+// Append to a file one block at a time. The file should reserve space
+// ahead of the writes, but its length should only count what was written,
+// both while it is open and after it is closed.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestFilePreallocation() {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pBlockIO = NULL;
+    CIOBuffer *pBuffer = NULL;
+    int32 bytesPerBlock;
+    int32 blockNum;
+    int32 byteNum;
+
+    err = SetFilePreallocation(PREALLOCATION_TEST_MIN_CHUNK, PREALLOCATION_TEST_MAX_CHUNK);
+    if (err) {
+        DEBUG_WARNING("Cannot turn on file preallocation.");
+        gotoErr(err);
+    }
+
+    g_DebugManager.StartTest("Appending to a preallocated file");
+    err = TestOpenBlockIO(
+                     1,
+                     CAsyncBlockIO::CREATE_NEW_STORE
+                        | CAsyncBlockIO::WRITE_ACCESS
+                        | CAsyncBlockIO::READ_ACCESS,
+                     0,
+                     false);
+    if (err) {
+        DEBUG_WARNING("Cannot create a store.");
+        gotoErr(err);
+    }
+    pBlockIO = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    bytesPerBlock = pBlockIO->GetIOSystem()->GetDefaultBytesPerBlock();
+    pBuffer = pBlockIO->GetIOSystem()->AllocIOBuffer(-1, true);
+    if (NULL == pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    for (blockNum = 0; blockNum < PREALLOCATION_TEST_NUM_BLOCKS; blockNum++) {
+        for (byteNum = 0; byteNum < bytesPerBlock; byteNum++) {
+            pBuffer->m_pLogicalBuffer[byteNum] = (char) (blockNum + byteNum);
+        }
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pBuffer->m_NumValidBytes = bytesPerBlock;
+        pBuffer->m_PosInMedia = blockNum * bytesPerBlock;
+        pBlockIO->WriteBlockAsync(pBuffer, 0);
+        g_TestCallback->Wait();
+        if (ENoErr != pBuffer->m_Err) {
+            DEBUG_WARNING("Error while writing a block.");
+            gotoErr(EFail);
+        }
+
+        if (pBlockIO->GetMediaSize() != ((blockNum + 1) * bytesPerBlock)) {
+            DEBUG_WARNING("Preallocated space was counted in the file size.");
+            gotoErr(EFail);
+        }
+        if (pBlockIO->GetAllocatedSize() <= pBlockIO->GetMediaSize()) {
+            DEBUG_WARNING("No space was reserved past the end of the file.");
+            gotoErr(EFail);
+        }
+    } // for (blockNum = 0; blockNum < PREALLOCATION_TEST_NUM_BLOCKS; blockNum++)
+
+    g_DebugManager.StartTest("Closing a preallocated file");
+    pBlockIO->Close();
+    RELEASE_OBJECT(pBlockIO);
+
+    err = TestOpenBlockIO(1, CAsyncBlockIO::READ_ACCESS, 0, false);
+    if (err) {
+        DEBUG_WARNING("Cannot open a store.");
+        gotoErr(err);
+    }
+    pBlockIO = g_BlockIOList[0];
+    g_BlockIOList[0] = NULL;
+
+    if ((pBlockIO->GetMediaSize() != (PREALLOCATION_TEST_NUM_BLOCKS * bytesPerBlock))
+        || (pBlockIO->GetAllocatedSize() != pBlockIO->GetMediaSize())) {
+        DEBUG_WARNING("Wrong file size after closing a preallocated file.");
+        gotoErr(EFail);
+    }
+
+    err = TestReadPastEof(pBlockIO, PREALLOCATION_TEST_NUM_BLOCKS * bytesPerBlock);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    (void) SetFilePreallocation(0, PREALLOCATION_TEST_MAX_CHUNK);
+    RELEASE_OBJECT(pBuffer);
+    if (NULL != pBlockIO) {
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+    returnErr(err);
+} // TestFilePreallocation.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestCachedRead]
+//
+// Every byte of the test file is its own position, except that block 2
+// is filled with CACHE_TEST_CHANGED_BYTE once it is changed.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestCachedRead(
+            CAsyncBlockIO *pBlockIO,
+            CIOBuffer *pBuffer,
+            int64 pos,
+            int32 numBytes,
+            bool fBlockTwoChanged) {
+    ErrVal err = ENoErr;
+    int32 bytesPerBlock = pBlockIO->GetIOSystem()->GetDefaultBytesPerBlock();
+    int64 bytePos;
+    char expectedByte;
+    int32 byteNum;
+
+    memset(pBuffer->m_pLogicalBuffer, 0, numBytes);
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_NumValidBytes = 0;
+    pBuffer->m_PosInMedia = pos;
+    pBlockIO->ReadBlockAsync(pBuffer);
+    g_TestCallback->Wait();
+    if ((ENoErr != pBuffer->m_Err)
+        || (pBuffer->m_NumValidBytes < numBytes)) {
+        DEBUG_WARNING("Error while reading through the block cache.");
+        gotoErr(EFail);
+    }
+
+    for (byteNum = 0; byteNum < numBytes; byteNum++) {
+        bytePos = pos + byteNum;
+        expectedByte = (char) bytePos;
+        if ((fBlockTwoChanged)
+            && (bytePos >= 2 * bytesPerBlock)
+            && (bytePos < 3 * bytesPerBlock)) {
+            expectedByte = CACHE_TEST_CHANGED_BYTE;
+        }
+        if (expectedByte != pBuffer->m_pLogicalBuffer[byteNum]) {
+            DEBUG_WARNING("Data read through the block cache is wrong. bytePos = " INT64FMT, bytePos);
+            gotoErr(EFail);
+        }
+    }
+
+abort:
+    returnErr(err);
+} // TestCachedRead.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestNet]
+//
+/////////////////////////////////////////////////////////////////////////////
+static void
+TestNet() {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO * pBlockIO;
+    int32 numBytes;
+    CIOBuffer *pBuffer;
+    CIOSystem *pIOSystem;
+    CParsedUrl *pUrl = NULL;
+    const char *ptr;
+    char buffer[CParsedUrl::MAX_URL_LENGTH];
+
+    g_DebugManager.StartTest("Connect and send HTTP GET");
+
+
+
+    snprintf(
+        buffer,
+        sizeof(buffer),
+        "http://%s:%d",
+        g_TestServerName,
+        g_TestServerPort);
+    RELEASE_OBJECT(pUrl);
+    pUrl = CParsedUrl::AllocateUrl(buffer);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = g_pNetIOSystem->OpenBlockIO(pUrl, CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS, g_TestCallback);
+    if (err) {
+        DEBUG_WARNING("Cannot open a pBlockIO to a host");
+        gotoErr(EFail);
+    }
+
+    err = g_TestCallback->Wait();
+    if (err) {
+        DEBUG_WARNING("Cannot resolve a host");
+        gotoErr(EFail);
+    }
+
+    pBlockIO = g_TestCallback->m_pBlockIO;
+    g_TestCallback->m_pBlockIO = NULL;
+
+
+    pIOSystem = pBlockIO->GetIOSystem();
+    if (!pIOSystem) {
+        DEBUG_WARNING("Cannot get pIOSystem");
+        gotoErr(EFail);
+    }
+    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
+    if (!pBuffer) {
+        DEBUG_WARNING("Cannot allocate an IO block");
+        gotoErr(EFail);
+    }
+
+    // char *ptr = "GET www.google.com/ HTTP/1.0\n\r"
+    ptr = "GET / HTTP/1.1\r\n"
+            "Accept: */*\r\n"
+            "TestHeader: 1\r\n"
+            "Accept-Language: en-us\r\n"
+            //"Accept-Encoding: gzip, deflate\r\n"
+            "User-Agent: dawsonsBrowser\r\n" // Mozilla/4.0 (compatible; MSIE 6.0; Windows NT 5.0; .NET CLR 1.1.4322)\r\n"
+            "Host: www.google.com\r\n"
+            //"Connection: Keep-Alive\r\n"
+            "\r\n";
+
+    numBytes = strlen(ptr);
+    snprintf(g_TestMemoryDevice, TEST_BLOCK_SIZE, ptr);
+
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_Err = ENoErr;
+    pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
+    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
+    pBuffer->m_BufferSize = numBytes;
+    ASSERT(numBytes > 0);
+    pBuffer->m_NumValidBytes = numBytes;
+    ASSERT(pBuffer->m_NumValidBytes >= 0);
+    pBuffer->m_PosInMedia = 0;
+    pBuffer->m_StartWriteOffset= 0;
+
+    pBlockIO->WriteBlockAsync(pBuffer, 0);
+    g_TestCallback->Wait();
+    if ((ENoErr != pBuffer->m_Err)
+        || (pBuffer->m_NumValidBytes != numBytes)) {
+        DEBUG_WARNING("Error while writing a block.");
+        gotoErr(EFail);
+    }
+
+    // Buffers should just arrive.
+    err = g_TestCallback->Wait();
+    if (err) {
+        DEBUG_WARNING("Error while writing a block.");
+        gotoErr(EFail);
+    }
+
+    CIOSystem::ReleaseBlockList(pBuffer);
+
+    pBlockIO->Close();
+
+abort:
+    RELEASE_OBJECT(pBlockIO);
+    RELEASE_OBJECT(pUrl);
+} // TestNet.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is the receiving end of the write chain test. It keeps the accepted
+// blockIO and checks every byte it reads against WRITE_CHAIN_TEST_BYTE.
+/////////////////////////////////////////////////////////////////////////////
+class CWriteChainTestReceiver : public CAsyncBlockIOCallback,
+                                public CRefCountImpl {
+public:
+    CWriteChainTestReceiver();
+    virtual ~CWriteChainTestReceiver();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+    void Wait() { m_pEvent->Wait(); }
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    CAsyncBlockIO       *m_pBlockIO;
+    int32               m_NumBytesReceived;
+    ErrVal              m_Err;
+    bool                m_fFinished;
+
+private:
+    CRefEvent           *m_pEvent;
+}; // CWriteChainTestReceiver
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CWriteChainTestReceiver]
+//
+/////////////////////////////////////////////////////////////////////////////
+CWriteChainTestReceiver::CWriteChainTestReceiver() {
+    m_pBlockIO = NULL;
+    m_NumBytesReceived = 0;
+    m_Err = ENoErr;
+    m_fFinished = false;
+    m_pEvent = NULL;
+} // CWriteChainTestReceiver.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CWriteChainTestReceiver]
+//
+/////////////////////////////////////////////////////////////////////////////
+CWriteChainTestReceiver::~CWriteChainTestReceiver() {
+    RELEASE_OBJECT(m_pBlockIO);
+    RELEASE_OBJECT(m_pEvent);
+} // ~CWriteChainTestReceiver.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CWriteChainTestReceiver::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pEvent = newex CRefEvent;
+    if (NULL == m_pEvent) {
+        gotoErr(EFail);
+    }
+    err = m_pEvent->Initialize();
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOAccept]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CWriteChainTestReceiver::OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) {
+    if ((ENoErr == err) && (NULL == m_pBlockIO)) {
+        m_pBlockIO = pBlockIO;
+        ADDREF_OBJECT(m_pBlockIO);
+    } else if (pBlockIO) {
+        pBlockIO->Close();
+    }
+    m_pEvent->Signal();
+} // OnBlockIOAccept.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+// The blockIO serializes its events, so the checks need no lock.
+/////////////////////////////////////////////////////////////////////////////
+void
+CWriteChainTestReceiver::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    int32 byteNum;
+
+    if ((NULL == pBuffer)
+        || (CIOBuffer::READ != pBuffer->m_BufferOp)
+        || (m_fFinished)) {
+        return;
+    }
+
+    if (pBuffer->m_Err) {
+        m_Err = pBuffer->m_Err;
+    } else if ((m_NumBytesReceived + pBuffer->m_NumValidBytes) > WRITE_CHAIN_TEST_TOTAL_BYTES) {
+        m_Err = EFail;
+    } else {
+        // Partial sends must not drop, repeat or reorder any bytes.
+        for (byteNum = 0; byteNum < pBuffer->m_NumValidBytes; byteNum++) {
+            if (WRITE_CHAIN_TEST_BYTE(m_NumBytesReceived + byteNum)
+                    != pBuffer->m_pLogicalBuffer[byteNum]) {
+                m_Err = EFail;
+                break;
+            }
+        }
+        m_NumBytesReceived += pBuffer->m_NumValidBytes;
+    }
+
+    if ((m_Err) || (WRITE_CHAIN_TEST_TOTAL_BYTES == m_NumBytesReceived)) {
+        m_fFinished = true;
+        m_pEvent->Signal();
+    }
+} // OnBlockIOEvent.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestNetWriteChain]
+//
+// This queues a long chain of writes on a loopback connection before the
+// other end reads anything. The network is restarted with socket buffers
+// much smaller than the chain, so DoPendingWriteChain has to stop and
+// resume in the middle of buffers.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestNetWriteChain() {
+    ErrVal err = ENoErr;
+    CNetIOTestSettings settings;
+    CWriteChainTestReceiver *pReceiver = NULL;
+    CSynCAsyncBlockIOCallback *pCallback = NULL;
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    CAsyncBlockIO *pBlockIO = NULL;
+    CIOBuffer *bufferList[WRITE_CHAIN_TEST_NUM_BUFFERS];
+    static char chainData[WRITE_CHAIN_TEST_TOTAL_BYTES];
+    CParsedUrl *pUrl = NULL;
+    char urlBuffer[CParsedUrl::MAX_URL_LENGTH];
+    uint16 portNum = 0;
+    int32 bufferNum;
+
+    g_DebugManager.StartTest("Partial sends of a write chain");
+
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_NUM_BUFFERS; bufferNum++) {
+        bufferList[bufferNum] = NULL;
+    }
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_TOTAL_BYTES; bufferNum++) {
+        chainData[bufferNum] = WRITE_CHAIN_TEST_BYTE(bufferNum);
+    }
+
+    settings.m_SocketBufferSize = WRITE_CHAIN_TEST_SOCKET_BUFFER_SIZE;
+    err = NetIO_RestartNetIOSystem(&settings);
+    if (err) {
+        DEBUG_WARNING("Cannot restart the network.");
+        gotoErr(err);
+    }
+
+    pReceiver = newex CWriteChainTestReceiver;
+    if (NULL == pReceiver) {
+        gotoErr(EFail);
+    }
+    err = pReceiver->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+    pCallback = newex CSynCAsyncBlockIOCallback;
+    if (NULL == pCallback) {
+        gotoErr(EFail);
+    }
+    err = pCallback->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Both ends are closed at once, so either one may be left in TIME_WAIT.
+    // Let the system pick the port, so the test can run again right away.
+    err = NetIO_OpenServerBlockIO(
+                    0,
+                    true, // fUse127001Address
+                    pReceiver,
+                    &pListenBlockIO);
+    if (!err) {
+        err = NetIO_GetServerPort(pListenBlockIO, &portNum);
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot open a loopback server.");
+        gotoErr(err);
+    }
+
+    snprintf(urlBuffer, sizeof(urlBuffer), "ip://127.0.0.1:%d", portNum);
+    pUrl = CParsedUrl::AllocateUrl(urlBuffer);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
+    if (NULL == pUrl->m_pSockAddr) {
+        gotoErr(EFail);
+    }
+    err = NetIO_LookupHost((char *) "127.0.0.1", portNum, pUrl->m_pSockAddr);
+    if (err) {
+        gotoErr(err);
+    }
+
+    err = g_pNetIOSystem->OpenBlockIO(
+                            pUrl,
+                            CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                            pCallback);
+    if (!err) {
+        err = pCallback->Wait();
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot connect to the loopback server.");
+        gotoErr(err);
+    }
+    pBlockIO = pCallback->m_pBlockIO;
+    pCallback->m_pBlockIO = NULL;
+
+    pReceiver->Wait();
+    if (NULL == pReceiver->m_pBlockIO) {
+        DEBUG_WARNING("The loopback server did not accept the connection.");
+        gotoErr(EFail);
+    }
+
+    // The receiver is not reading yet, so the whole chain is queued
+    // behind a full socket.
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_NUM_BUFFERS; bufferNum++) {
+        bufferList[bufferNum] = pBlockIO->GetIOSystem()->AllocIOBuffer(-1, false);
+        if (NULL == bufferList[bufferNum]) {
+            gotoErr(EFail);
+        }
+
+        bufferList[bufferNum]->m_BufferOp = CIOBuffer::NO_OP;
+        bufferList[bufferNum]->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        bufferList[bufferNum]->m_Err = ENoErr;
+        bufferList[bufferNum]->m_pPhysicalBuffer
+                = &(chainData[bufferNum * WRITE_CHAIN_TEST_BUFFER_SIZE]);
+        bufferList[bufferNum]->m_pLogicalBuffer = bufferList[bufferNum]->m_pPhysicalBuffer;
+        bufferList[bufferNum]->m_BufferSize = WRITE_CHAIN_TEST_BUFFER_SIZE;
+        bufferList[bufferNum]->m_NumValidBytes = WRITE_CHAIN_TEST_BUFFER_SIZE;
+        bufferList[bufferNum]->m_PosInMedia = 0;
+        bufferList[bufferNum]->m_StartWriteOffset = 0;
+
+        pBlockIO->WriteBlockAsync(bufferList[bufferNum], 0);
+    }
+
+    err = NetIO_ReceiveDataFromAcceptedConnection(pReceiver->m_pBlockIO, pReceiver);
+    if (err) {
+        gotoErr(err);
+    }
+
+    pReceiver->Wait();
+    if ((pReceiver->m_Err)
+        || (WRITE_CHAIN_TEST_TOTAL_BYTES != pReceiver->m_NumBytesReceived)) {
+        DEBUG_WARNING("The write chain arrived with the wrong data.");
+        gotoErr(EFail);
+    }
+
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_NUM_BUFFERS; bufferNum++) {
+        (void) pCallback->Wait();
+    }
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_NUM_BUFFERS; bufferNum++) {
+        if ((ENoErr != bufferList[bufferNum]->m_Err)
+            || (WRITE_CHAIN_TEST_BUFFER_SIZE != bufferList[bufferNum]->m_NumValidBytes)) {
+            DEBUG_WARNING("A write in the chain failed.");
             gotoErr(EFail);
         }
     }
 
+abort:
+    for (bufferNum = 0; bufferNum < WRITE_CHAIN_TEST_NUM_BUFFERS; bufferNum++) {
+        if (bufferList[bufferNum]) {
+            CIOSystem::ReleaseBlockList(bufferList[bufferNum]);
+        }
+    }
+    if (pBlockIO) {
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+    if ((pReceiver) && (pReceiver->m_pBlockIO)) {
+        // This breaks the reference cycle between the receiver and the blockIO.
+        pReceiver->m_pBlockIO->ChangeBlockIOCallback(NULL);
+        pReceiver->m_pBlockIO->Close();
+    }
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    RELEASE_OBJECT(pUrl);
+    RELEASE_OBJECT(pCallback);
+    RELEASE_OBJECT(pReceiver);
+
+    // Put back the socket buffers from the config file.
+    if (NetIO_RestartNetIOSystem(NULL)) {
+        DEBUG_WARNING("The write chain test left a network blockIO open.");
+    }
+
+    returnErr(err);
+} // TestNetWriteChain.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is the server end of the loopback tests. It echoes everything it
+// reads on every connection it accepts, and closes a connection when the
+// other end closes it.
+/////////////////////////////////////////////////////////////////////////////
+class CLoopbackTestServer : public CAsyncBlockIOCallback,
+                            public CRefCountImpl {
+public:
+    CLoopbackTestServer();
+    virtual ~CLoopbackTestServer();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+    void Wait() { m_pEvent->Wait(); }
+    void CloseAll();
+    void CloseOnFirstRead(CAsyncBlockIO *pBlockIO);
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    int32               m_NumAccepted;
+    int32               m_NumClosed;
+    ErrVal              m_Err;
+
+private:
+    // Connections are accepted and closed on the reactor threads, and
+    // with several reactors that may be several threads at once.
+    CRefLock            *m_pLock;
+    CRefEvent           *m_pEvent;
+    CAsyncBlockIO       *m_BlockIOList[LOOPBACK_TEST_MAX_CONNECTIONS];
+    CAsyncBlockIO       *m_pCloseOnRead;
+}; // CLoopbackTestServer
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CLoopbackTestServer]
+//
+/////////////////////////////////////////////////////////////////////////////
+CLoopbackTestServer::CLoopbackTestServer() {
+    int32 index;
+
+    m_NumAccepted = 0;
+    m_NumClosed = 0;
+    m_Err = ENoErr;
+    m_pLock = NULL;
+    m_pEvent = NULL;
+    for (index = 0; index < LOOPBACK_TEST_MAX_CONNECTIONS; index++) {
+        m_BlockIOList[index] = NULL;
+    }
+    m_pCloseOnRead = NULL;
+} // CLoopbackTestServer.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CLoopbackTestServer]
+//
+/////////////////////////////////////////////////////////////////////////////
+CLoopbackTestServer::~CLoopbackTestServer() {
+    CloseAll();
+    RELEASE_OBJECT(m_pCloseOnRead);
+    RELEASE_OBJECT(m_pEvent);
+    RELEASE_OBJECT(m_pLock);
+} // ~CLoopbackTestServer.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CLoopbackTestServer::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+    m_pEvent = newex CRefEvent;
+    if (NULL == m_pEvent) {
+        gotoErr(EFail);
+    }
+    err = m_pEvent->Initialize();
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CloseAll]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestServer::CloseAll() {
+    CAsyncBlockIO *pBlockIO;
+    int32 index;
+
+    for (index = 0; index < LOOPBACK_TEST_MAX_CONNECTIONS; index++) {
+        {
+            AutoLock(m_pLock);
+            pBlockIO = m_BlockIOList[index];
+            m_BlockIOList[index] = NULL;
+        }
+        if (pBlockIO) {
+            // This breaks the reference cycle between us and the blockIO.
+            pBlockIO->ChangeBlockIOCallback(NULL);
+            pBlockIO->Close();
+            RELEASE_OBJECT(pBlockIO);
+        }
+    }
+} // CloseAll.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CloseOnFirstRead]
+//
+// The next time the server reads anything, it closes this blockIO instead
+// of echoing. The blockIO that did the read is still locked at that point.
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestServer::CloseOnFirstRead(CAsyncBlockIO *pBlockIO) {
+    AutoLock(m_pLock);
+
+    RELEASE_OBJECT(m_pCloseOnRead);
+    m_pCloseOnRead = pBlockIO;
+    ADDREF_OBJECT(m_pCloseOnRead);
+} // CloseOnFirstRead.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOAccept]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestServer::OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) {
+    bool fKept = false;
+
+    if ((ENoErr == err) && (NULL != pBlockIO)) {
+        AutoLock(m_pLock);
+        if (m_NumAccepted < LOOPBACK_TEST_MAX_CONNECTIONS) {
+            m_BlockIOList[m_NumAccepted] = pBlockIO;
+            ADDREF_OBJECT(pBlockIO);
+            m_NumAccepted += 1;
+            fKept = true;
+        }
+    }
+
+    if (fKept) {
+        err = NetIO_ReceiveDataFromAcceptedConnection(pBlockIO, this);
+    }
+    if ((!fKept) || (err)) {
+        AutoLock(m_pLock);
+        m_Err = EFail;
+    }
+    m_pEvent->Signal();
+} // OnBlockIOAccept.
+
 
 
-    g_DebugManager.StartTest("Closing and re-opening grown pBlockIOs");
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestServer::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    CAsyncBlockIO *pBlockIO = NULL;
+    int32 index;
 
-        (g_BlockIOList[blockIONum])->Close();
-        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+    if ((NULL == pBuffer) || (CIOBuffer::READ != pBuffer->m_BufferOp)) {
+        return;
+    }
+
+    if ((ENoErr == pBuffer->m_Err) && (pBuffer->m_NumValidBytes > 0)) {
+        {
+            AutoLock(m_pLock);
+            pBlockIO = m_pCloseOnRead;
+            m_pCloseOnRead = NULL;
+        }
+        if (pBlockIO) {
+            pBlockIO->Close();
+            RELEASE_OBJECT(pBlockIO);
+            return;
+        }
+
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pBuffer->m_pBlockIO->WriteBlockAsync(pBuffer, 0);
+        return;
     }
 
+    // The other end closed the connection, so close this end too.
+    {
+        AutoLock(m_pLock);
+        for (index = 0; index < LOOPBACK_TEST_MAX_CONNECTIONS; index++) {
+            if (pBuffer->m_pBlockIO == m_BlockIOList[index]) {
+                pBlockIO = m_BlockIOList[index];
+                m_BlockIOList[index] = NULL;
+                m_NumClosed += 1;
+                break;
+            }
+        }
+    }
+    if (pBlockIO) {
+        pBlockIO->ChangeBlockIOCallback(NULL);
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+        m_pEvent->Signal();
+    }
+} // OnBlockIOEvent.
 
 
-    err = TestOpenBlockIO(
-                     numBlockIOs,
-                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
-                     storeSize,
-                     memDevice);
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is the client end of the loopback tests. It checks that every byte
+// it reads is the next one it expects.
+/////////////////////////////////////////////////////////////////////////////
+class CLoopbackTestClient : public CAsyncBlockIOCallback,
+                            public CRefCountImpl {
+public:
+    CLoopbackTestClient();
+    virtual ~CLoopbackTestClient();
+    NEWEX_IMPL()
+
+    ErrVal Initialize(int32 numBytesExpected);
+    ErrVal Connect(uint16 portNum);
+    ErrVal Send(int32 numBytes);
+    void Wait() { m_pEvent->Wait(); }
+    void Close();
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO);
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    CAsyncBlockIO       *m_pBlockIO;
+    int32               m_NumBytesExpected;
+    int32               m_NumBytesSent;
+    int32               m_NumBytesReceived;
+    bool                m_fDisconnected;
+    ErrVal              m_Err;
+
+private:
+    CRefEvent           *m_pEvent;
+    CParsedUrl          *m_pUrl;
+}; // CLoopbackTestClient
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CLoopbackTestClient]
+//
+/////////////////////////////////////////////////////////////////////////////
+CLoopbackTestClient::CLoopbackTestClient() {
+    m_pBlockIO = NULL;
+    m_NumBytesExpected = 0;
+    m_NumBytesSent = 0;
+    m_NumBytesReceived = 0;
+    m_fDisconnected = false;
+    m_Err = ENoErr;
+    m_pEvent = NULL;
+    m_pUrl = NULL;
+} // CLoopbackTestClient.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CLoopbackTestClient]
+//
+/////////////////////////////////////////////////////////////////////////////
+CLoopbackTestClient::~CLoopbackTestClient() {
+    Close();
+    RELEASE_OBJECT(m_pEvent);
+    RELEASE_OBJECT(m_pUrl);
+} // ~CLoopbackTestClient.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CLoopbackTestClient::Initialize(int32 numBytesExpected) {
+    ErrVal err = ENoErr;
+
+    m_NumBytesExpected = numBytesExpected;
+
+    m_pEvent = newex CRefEvent;
+    if (NULL == m_pEvent) {
+        gotoErr(EFail);
+    }
+    err = m_pEvent->Initialize();
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Connect]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CLoopbackTestClient::Connect(uint16 portNum) {
+    ErrVal err = ENoErr;
+    char urlBuffer[CParsedUrl::MAX_URL_LENGTH];
+
+    snprintf(urlBuffer, sizeof(urlBuffer), "ip://127.0.0.1:%d", portNum);
+    m_pUrl = CParsedUrl::AllocateUrl(urlBuffer);
+    if (NULL == m_pUrl) {
+        gotoErr(EFail);
+    }
+    m_pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
+    if (NULL == m_pUrl->m_pSockAddr) {
+        gotoErr(EFail);
+    }
+    err = NetIO_LookupHost((char *) "127.0.0.1", portNum, m_pUrl->m_pSockAddr);
     if (err) {
-       DEBUG_WARNING("Cannot create an store.");
-       gotoErr(err);
+        gotoErr(err);
     }
 
-    // Read the contents.
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, grownStoreSize, 37);
-        if (err)
-            gotoErr(err);
+    err = g_pNetIOSystem->OpenBlockIO(
+                            m_pUrl,
+                            CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS,
+                            this);
+    if (err) {
+        gotoErr(err);
     }
+    Wait();
+    err = m_Err;
+
+abort:
+    returnErr(err);
+} // Connect.
 
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Send]
+//
+// This writes the next numBytes of the test pattern.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CLoopbackTestClient::Send(int32 numBytes) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    int32 byteNum;
 
-    g_DebugManager.StartTest("Shrinking stores");
-    shrunkStoreSize = storeSize - (growAmount >> 1);
+    if (NULL == m_pBlockIO) {
+        gotoErr(EFail);
+    }
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
+    pBuffer = m_pBlockIO->GetIOSystem()->AllocIOBuffer(numBytes, true);
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    for (byteNum = 0; byteNum < numBytes; byteNum++) {
+        pBuffer->m_pLogicalBuffer[byteNum] = LOOPBACK_TEST_BYTE(m_NumBytesSent + byteNum);
+    }
+    m_NumBytesSent += numBytes;
+    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+    pBuffer->m_Err = ENoErr;
+    pBuffer->m_NumValidBytes = numBytes;
+    pBuffer->m_PosInMedia = 0;
+    pBuffer->m_StartWriteOffset = 0;
 
-        err = (g_BlockIOList[blockIONum])->Resize(shrunkStoreSize);
-        if (err) {
-            DEBUG_WARNING("Cannot grow a store");
-            gotoErr(err);
-        }
+    m_pBlockIO->WriteBlockAsync(pBuffer, 0);
+
+abort:
+    if (pBuffer) {
+        CIOSystem::ReleaseBlockList(pBuffer);
     }
+    returnErr(err);
+} // Send.
 
 
-    g_DebugManager.StartTest("Reading and Writing shrunk Stores");
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestWriteBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
-        if (err) {
-            gotoErr(err);
-        }
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Close]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestClient::Close() {
+    CAsyncBlockIO *pBlockIO = m_pBlockIO;
+
+    m_pBlockIO = NULL;
+    if (pBlockIO) {
+        // This breaks the reference cycle between us and the blockIO.
+        pBlockIO->ChangeBlockIOCallback(NULL);
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
     }
+} // Close.
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
-        if (err) {
-            gotoErr(err);
-        }
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOOpen]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestClient::OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) {
+    if ((ENoErr == err) && (NULL != pBlockIO)) {
+        m_pBlockIO = pBlockIO;
+        ADDREF_OBJECT(m_pBlockIO);
+    } else {
+        m_Err = err ? err : EFail;
     }
+    m_pEvent->Signal();
+} // OnBlockIOOpen.
 
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+// This signals once when the last expected byte arrives, or when the
+// connection fails or closes before then.
+/////////////////////////////////////////////////////////////////////////////
+void
+CLoopbackTestClient::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    bool fWasFinished;
+    int32 byteNum;
 
-    g_DebugManager.StartTest("Reading and Writing Past the End Of A store");
+    if ((NULL == pBuffer) || (CIOBuffer::READ != pBuffer->m_BufferOp)) {
+        return;
+    }
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
-        err = TestReadPastEof(g_BlockIOList[blockIONum], shrunkStoreSize);
-        if (err) {
-            DEBUG_WARNING("Error while reading a store.");
-            gotoErr(EFail);
+    fWasFinished = (m_fDisconnected) || (m_Err) || (m_NumBytesReceived == m_NumBytesExpected);
+
+    if (pBuffer->m_Err) {
+        m_fDisconnected = true;
+    } else if ((m_NumBytesReceived + pBuffer->m_NumValidBytes) > m_NumBytesExpected) {
+        m_Err = EFail;
+    } else {
+        for (byteNum = 0; byteNum < pBuffer->m_NumValidBytes; byteNum++) {
+            if (LOOPBACK_TEST_BYTE(m_NumBytesReceived + byteNum)
+                    != pBuffer->m_pLogicalBuffer[byteNum]) {
+                m_Err = EFail;
+                break;
+            }
         }
+        m_NumBytesReceived += pBuffer->m_NumValidBytes;
     }
 
+    if ((!fWasFinished)
+        && ((m_fDisconnected) || (m_Err) || (m_NumBytesReceived == m_NumBytesExpected))) {
+        m_pEvent->Signal();
+    }
+} // OnBlockIOEvent.
 
-    g_DebugManager.StartTest("Closing and re-opening shrunk pBlockIOs");
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
 
-        (g_BlockIOList[blockIONum])->Close();
-        RELEASE_OBJECT(g_BlockIOList[blockIONum]);
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestNetLoopbackEcho]
+//
+// This restarts the network with the given backend, and then connects to
+// a loopback server, sends a few blocks, reads back the echo and closes
+// the connection. The server must see the close.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestNetLoopbackEcho(const char *pTestName, const CNetIOTestSettings *pSettings) {
+    ErrVal err = ENoErr;
+    CLoopbackTestServer *pServer = NULL;
+    CLoopbackTestClient *pClient = NULL;
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    uint16 portNum = 0;
+    int32 sendNum;
+
+    g_DebugManager.StartTest(pTestName);
+
+    err = NetIO_RestartNetIOSystem(pSettings);
+    if (err) {
+        DEBUG_WARNING("Cannot restart the network.");
+        gotoErr(err);
     }
 
+    pServer = newex CLoopbackTestServer;
+    if (NULL == pServer) {
+        gotoErr(EFail);
+    }
+    err = pServer->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+    pClient = newex CLoopbackTestClient;
+    if (NULL == pClient) {
+        gotoErr(EFail);
+    }
+    err = pClient->Initialize(LOOPBACK_TEST_NUM_SENDS * LOOPBACK_TEST_SEND_SIZE);
+    if (err) {
+        gotoErr(err);
+    }
 
-    err = TestOpenBlockIO(
-                     numBlockIOs,
-                     CAsyncBlockIO::WRITE_ACCESS | CAsyncBlockIO::READ_ACCESS,
-                     storeSize,
-                     memDevice);
+    // The server closes its end after the client does, so the port is not
+    // left in TIME_WAIT. Still, let the system pick it, so a test that
+    // fails in the middle does not break the next run.
+    err = NetIO_OpenServerBlockIO(0, true, pServer, &pListenBlockIO);
+    if (!err) {
+        err = NetIO_GetServerPort(pListenBlockIO, &portNum);
+    }
     if (err) {
-       DEBUG_WARNING("Cannot create an store.");
-       gotoErr(err);
+        DEBUG_WARNING("Cannot open a loopback server.");
+        gotoErr(err);
     }
 
+    err = pClient->Connect(portNum);
+    if (err) {
+        DEBUG_WARNING("Cannot connect to the loopback server.");
+        gotoErr(err);
+    }
+    pServer->Wait();
+    if ((pServer->m_Err) || (1 != pServer->m_NumAccepted)) {
+        DEBUG_WARNING("The loopback server did not accept the connection.");
+        gotoErr(EFail);
+    }
 
-    // Read the contents.
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        err = TestReadBlocks(g_BlockIOList[blockIONum], 0, shrunkStoreSize, 37);
+    // Each send is several packets, so the echo arrives in pieces.
+    for (sendNum = 0; sendNum < LOOPBACK_TEST_NUM_SENDS; sendNum++) {
+        err = pClient->Send(LOOPBACK_TEST_SEND_SIZE);
         if (err) {
             gotoErr(err);
         }
     }
+    pClient->Wait();
+    if ((pClient->m_Err)
+        || (pClient->m_fDisconnected)
+        || (pClient->m_NumBytesReceived != pClient->m_NumBytesExpected)) {
+        DEBUG_WARNING("The echo came back with the wrong data.");
+        gotoErr(EFail);
+    }
 
-
-
-    g_DebugManager.StartTest("Closing stores");
-
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        g_DebugManager.ShowProgress();
-
-        if (g_BlockIOList[blockIONum]) {
-            g_BlockIOList[blockIONum]->Close();
-            RELEASE_OBJECT(g_BlockIOList[blockIONum]);
-        }
+    pClient->Close();
+    pServer->Wait();
+    if (1 != pServer->m_NumClosed) {
+        DEBUG_WARNING("The loopback server did not see the connection close.");
+        gotoErr(EFail);
     }
 
 abort:
-    if (err) {
-        ::printf("\n\n\nERROR\n\n\n");
+    if (pClient) {
+        pClient->Close();
     }
-    return;
-} // RunBlockIOTests.
-
+    if (pServer) {
+        pServer->CloseAll();
+    }
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    RELEASE_OBJECT(pClient);
+    RELEASE_OBJECT(pServer);
 
+    returnErr(err);
+} // TestNetLoopbackEcho.
 
 
 
@@ -1797,276 +5313,338 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestOpenBlockIO]
+// [TestNetCrossReactorClose]
 //
+// With two reactors, the listener, the client and the accepted connection
+// are given reactors 0, 1 and 0 in turn. When the server reads from the
+// accepted connection, it closes the client while the accepted connection
+// is still locked. The client belongs to reactor 1, so the close has to
+// wake that reactor, not the one that delivered the read. The server must
+// then see the connection close, and nothing may be left on either reactor.
 /////////////////////////////////////////////////////////////////////////////
 static ErrVal
-TestOpenBlockIO(
-         int32 numBlockIOs,
-         int32 openOptions,
-         int32 storeSize,
-         bool memDevice
-        ) {
+TestNetCrossReactorClose() {
     ErrVal err = ENoErr;
-    int16 blockIONum;
-    CParsedUrl *pUrl = NULL;
-    char buffer[CParsedUrl::MAX_URL_LENGTH];
+    CNetIOTestSettings settings;
+    CLoopbackTestServer *pServer = NULL;
+    CLoopbackTestClient *pClient = NULL;
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    uint16 portNum = 0;
+
+    g_DebugManager.StartTest("Close a connection from another reactor");
+
+    // io_uring completes everything on its own thread, so use the reactors.
+    settings.m_UseIOUring = 0;
+    settings.m_NumReactors = 2;
+    settings.m_NumListenersPerPort = 1;
+    err = NetIO_RestartNetIOSystem(&settings);
+    if (err) {
+        DEBUG_WARNING("Cannot restart the network.");
+        gotoErr(err);
+    }
 
+    pServer = newex CLoopbackTestServer;
+    if (NULL == pServer) {
+        gotoErr(EFail);
+    }
+    err = pServer->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+    pClient = newex CLoopbackTestClient;
+    if (NULL == pClient) {
+        gotoErr(EFail);
+    }
+    err = pClient->Initialize(LOOPBACK_TEST_SEND_SIZE);
+    if (err) {
+        gotoErr(err);
+    }
 
-    for (blockIONum = 0; blockIONum < numBlockIOs; blockIONum++) {
-        RELEASE_OBJECT(pUrl);
-        pUrl = NULL;
-        g_DebugManager.ShowProgress();
+    err = NetIO_OpenServerBlockIO(0, true, pServer, &pListenBlockIO);
+    if (!err) {
+        err = NetIO_GetServerPort(pListenBlockIO, &portNum);
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot open a loopback server.");
+        gotoErr(err);
+    }
 
-        if (memDevice) {
-            pUrl = CParsedUrl::AllocateMemoryUrl(0, storeSize, 0);
-            if (NULL == pUrl) {
-                gotoErr(EFail);
-            }
+    err = pClient->Connect(portNum);
+    if (err) {
+        DEBUG_WARNING("Cannot connect to the loopback server.");
+        gotoErr(err);
+    }
+    pServer->Wait();
+    if ((pServer->m_Err) || (1 != pServer->m_NumAccepted)) {
+        DEBUG_WARNING("The loopback server did not accept the connection.");
+        gotoErr(EFail);
+    }
 
-            err = g_pMemoryIOSystem->OpenBlockIO(pUrl, openOptions, g_TestCallback);
-        } else {
-            snprintf(
-                buffer,
-                sizeof(buffer),
-                "%stestFile%d",
-                g_TestPathPrefix,
-                blockIONum);
-            pUrl = CParsedUrl::AllocateFileUrl(buffer);
-            if (NULL == pUrl) {
-                gotoErr(EFail);
-            }
+    pServer->CloseOnFirstRead(pClient->m_pBlockIO);
+    err = pClient->Send(LOOPBACK_TEST_SEND_SIZE);
+    if (err) {
+        gotoErr(err);
+    }
 
-            err = g_pFileIOSystem->OpenBlockIO(pUrl, openOptions, g_TestCallback);
-        }
-        if (err) {
-            DEBUG_WARNING("Cannot create an store.");
-            gotoErr(err);
-        }
+    pServer->Wait();
+    if (1 != pServer->m_NumClosed) {
+        DEBUG_WARNING("The loopback server did not see the connection close.");
+        gotoErr(EFail);
+    }
 
-        err = g_TestCallback->Wait();
-        if (err) {
-            DEBUG_WARNING("Cannot create an store.");
-            gotoErr(err);
-        }
+abort:
+    if (pClient) {
+        pClient->Close();
+    }
+    if (pServer) {
+        pServer->CloseAll();
+    }
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    RELEASE_OBJECT(pClient);
+    RELEASE_OBJECT(pServer);
+
+    returnErr(err);
+} // TestNetCrossReactorClose.
 
-        g_BlockIOList[blockIONum] = g_TestCallback->m_pBlockIO;
-        g_TestCallback->m_pBlockIO = NULL;
 
-        if (NULL == g_BlockIOList[blockIONum]) {
-            DEBUG_WARNING("Cannot open an store.");
-            gotoErr(err);
-        }
 
-        (g_BlockIOList[blockIONum])->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
-    }
 
-abort:
-    RELEASE_OBJECT(pUrl);
-    returnErr(err);
-} // TestOpenBlockIO
 
 
+/////////////////////////////////////////////////////////////////////////////
+// This is one end of the datagram test. It checks each datagram it reads,
+// in whatever order they arrive, and remembers where they came from.
+/////////////////////////////////////////////////////////////////////////////
+class CDatagramTestEndpoint : public CAsyncBlockIOCallback,
+                              public CRefCountImpl {
+public:
+    CDatagramTestEndpoint();
+    virtual ~CDatagramTestEndpoint();
+    NEWEX_IMPL()
+
+    ErrVal Open(const struct sockaddr_in *pDestAddr);
+    ErrVal Send(int32 numDatagrams);
+    void Wait() { m_pEvent->Wait(); }
+    void Close();
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
 
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
 
+    CAsyncBlockIO       *m_pBlockIO;
+    uint16              m_PortNum;
+    int32               m_NumReceived;
+    struct sockaddr_in  m_Source;
+    ErrVal              m_Err;
+
+private:
+    // Each datagram in a batch completes separately, so several may be
+    // checked at once on different threads.
+    CRefLock            *m_pLock;
+    CRefEvent           *m_pEvent;
+    bool                m_fReceived[DATAGRAM_TEST_NUM_DATAGRAMS];
+}; // CDatagramTestEndpoint
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestWriteBlocks]
+// [CDatagramTestEndpoint]
 //
 /////////////////////////////////////////////////////////////////////////////
-static ErrVal
-TestWriteBlocks(
-         CAsyncBlockIO *pBlockIO,
-         int32 startByte,
-         int32 numBytes,
-         int16 baseVal
-        ) {
-    ErrVal err = ENoErr;
-    int32 byteNum;
-    int32 bytesPerBlock;
-    int32 bytesWritten;
-    int32 bytesToWrite;
-    CIOBuffer *pBuffer = NULL;
-    CIOSystem *pIOSystem = NULL;
+CDatagramTestEndpoint::CDatagramTestEndpoint() {
+    int32 index;
 
-    if (!pBlockIO) {
-        gotoErr(EFail);
+    m_pBlockIO = NULL;
+    m_PortNum = 0;
+    m_NumReceived = 0;
+    memset(&m_Source, 0, sizeof(m_Source));
+    m_Err = ENoErr;
+    m_pLock = NULL;
+    m_pEvent = NULL;
+    for (index = 0; index < DATAGRAM_TEST_NUM_DATAGRAMS; index++) {
+        m_fReceived[index] = false;
     }
+} // CDatagramTestEndpoint.
 
-    pIOSystem = pBlockIO->GetIOSystem();
-    bytesPerBlock = pIOSystem->GetDefaultBytesPerBlock();
-    if (bytesPerBlock <= 0) {
-        DEBUG_WARNING("Invalid bytes per block.");
-        gotoErr(EFail);
-    }
 
-    if (bytesPerBlock >= TEST_BLOCK_SIZE) {
-        DEBUG_WARNING("Block size too big");
-        gotoErr(EFail);
-    }
 
-    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
-    if (!pBuffer) {
-        DEBUG_WARNING("Cannot allocate an IO block");
-        gotoErr(EFail);
-    }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CDatagramTestEndpoint]
+//
+/////////////////////////////////////////////////////////////////////////////
+CDatagramTestEndpoint::~CDatagramTestEndpoint() {
+    Close();
+    RELEASE_OBJECT(m_pEvent);
+    RELEASE_OBJECT(m_pLock);
+} // ~CDatagramTestEndpoint.
 
-    bytesWritten = 0;
-    while (bytesWritten < numBytes) {
-        g_DebugManager.ShowProgress();
 
-        bytesToWrite = bytesPerBlock;
-        if ((bytesWritten + bytesToWrite) > numBytes) {
-            bytesToWrite = numBytes - bytesWritten;
-        }
 
-        // First, initialize the blocks.
-        for (byteNum = 0; byteNum < bytesToWrite; byteNum++) {
-            g_TestMemoryDevice[byteNum] = (char) (byteNum + baseVal);
-        }
 
-        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
-        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
-        pBuffer->m_Err = ENoErr;
-        pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
-        pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
-        pBuffer->m_BufferSize = bytesToWrite;
-        ASSERT(bytesToWrite > 0);
-        pBuffer->m_NumValidBytes = bytesToWrite;
-        ASSERT(pBuffer->m_NumValidBytes >= 0);
-        pBuffer->m_PosInMedia = startByte;
-        pBuffer->m_StartWriteOffset = 0;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Open]
+//
+// This opens a UDP socket on a port the system picks. Everything it sends
+// goes to pDestAddr.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CDatagramTestEndpoint::Open(const struct sockaddr_in *pDestAddr) {
+    ErrVal err = ENoErr;
 
-        pBlockIO->WriteBlockAsync(pBuffer, 0);
-        g_TestCallback->Wait();
-        if ((ENoErr != pBuffer->m_Err)
-            || (pBuffer->m_NumValidBytes != bytesToWrite)) {
-            DEBUG_WARNING("Error while writing a block.");
-            gotoErr(EFail);
-        }
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+    m_pEvent = newex CRefEvent;
+    if (NULL == m_pEvent) {
+        gotoErr(EFail);
+    }
+    err = m_pEvent->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
 
-        startByte += bytesToWrite;
-        bytesWritten += bytesToWrite;
+    err = NetIO_OpenDatagramBlockIO(0, true, pDestAddr, this, &m_pBlockIO);
+    if (err) {
+        gotoErr(err);
     }
+    err = NetIO_GetServerPort(m_pBlockIO, &m_PortNum);
 
 abort:
-    CIOSystem::ReleaseBlockList(pBuffer);
-    returnErr(ENoErr);
-} // TestWriteBlocks.
-
-
+    returnErr(err);
+} // Open.
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestReadBlocks]
+// [Send]
 //
+// The datagrams are written in one write chain, so they go out in batches.
 /////////////////////////////////////////////////////////////////////////////
-static ErrVal
-TestReadBlocks(
-         CAsyncBlockIO *pBlockIO,
-         int32 startByte,
-         int32 numBytes,
-         int16 baseVal
-        ) {
+ErrVal
+CDatagramTestEndpoint::Send(int32 numDatagrams) {
     ErrVal err = ENoErr;
-    int32 byteNum;
-    int32 bytesRead;
-    int32 bytesPerBlock;
-    int32 bytesToRead;
     CIOBuffer *pBuffer = NULL;
-    char c;
-    int16 same;
-    CIOSystem *pIOSystem;
+    int32 datagramNum;
+    int32 size;
+    int32 byteNum;
 
-    if (!pBlockIO) {
+    if (NULL == m_pBlockIO) {
         gotoErr(EFail);
     }
 
-    pIOSystem = pBlockIO->GetIOSystem();
-    bytesPerBlock = pIOSystem->GetDefaultBytesPerBlock();
-    if (bytesPerBlock <= 0) {
-        DEBUG_WARNING("Invalid bytes per block.");
-        gotoErr(EFail);
-    }
+    m_pBlockIO->StartWriteChain();
+    for (datagramNum = 0; datagramNum < numDatagrams; datagramNum++) {
+        size = DATAGRAM_TEST_SIZE(datagramNum);
+        pBuffer = m_pBlockIO->GetIOSystem()->AllocIOBuffer(size, true);
+        if (NULL == pBuffer) {
+            err = EFail;
+            break;
+        }
+        pBuffer->m_pLogicalBuffer[0] = (char) datagramNum;
+        for (byteNum = 1; byteNum < size; byteNum++) {
+            pBuffer->m_pLogicalBuffer[byteNum] = LOOPBACK_TEST_BYTE(datagramNum + byteNum);
+        }
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pBuffer->m_Err = ENoErr;
+        pBuffer->m_NumValidBytes = size;
+        pBuffer->m_PosInMedia = 0;
+        pBuffer->m_StartWriteOffset = 0;
 
-    if (bytesPerBlock >= TEST_BLOCK_SIZE) {
-        DEBUG_WARNING("Block size too big");
-        gotoErr(EFail);
+        m_pBlockIO->WriteBlockAsync(pBuffer, 0);
+        CIOSystem::ReleaseBlockList(pBuffer);
+        pBuffer = NULL;
     }
+    m_pBlockIO->EndWriteChain();
+
+abort:
+    returnErr(err);
+} // Send.
+
+
+
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Close]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CDatagramTestEndpoint::Close() {
+    CAsyncBlockIO *pBlockIO = m_pBlockIO;
 
-    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
-    if (!pBuffer) {
-        DEBUG_WARNING("Cannot allocate an IO block");
-        gotoErr(EFail);
+    m_pBlockIO = NULL;
+    if (pBlockIO) {
+        // This breaks the reference cycle between us and the blockIO.
+        pBlockIO->ChangeBlockIOCallback(NULL);
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
     }
+} // Close.
 
-    bytesRead = 0;
-    while (bytesRead < numBytes) {
-        g_DebugManager.ShowProgress();
 
-        bytesToRead = bytesPerBlock;
-        if ((bytesRead + bytesToRead) > numBytes) {
-            bytesToRead = numBytes - bytesRead;
-        }
 
-        // Zero out the memory.
-        memset(g_TestMemoryDevice, 0, bytesRead);
 
-        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
-        pBuffer->m_Err = ENoErr;
-        pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
-        pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
-        pBuffer->m_BufferSize = bytesToRead;
-        ASSERT(bytesToRead > 0);
-        pBuffer->m_NumValidBytes = bytesToRead;
-        ASSERT(pBuffer->m_NumValidBytes >= 0);
-        pBuffer->m_PosInMedia = startByte;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+// This signals once when every datagram has arrived, or when one is wrong.
+/////////////////////////////////////////////////////////////////////////////
+void
+CDatagramTestEndpoint::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    bool fWasFinished;
+    int32 datagramNum;
+    int32 byteNum;
+    AutoLock(m_pLock);
 
-        pBlockIO->ReadBlockAsync(pBuffer);
+    if ((NULL == pBuffer) || (CIOBuffer::READ != pBuffer->m_BufferOp)) {
+        return;
+    }
 
-        // Be careful; once we grow a file we may get more data than
-        // we originally wrote.
-        g_TestCallback->Wait();
-        if ((ENoErr != pBuffer->m_Err)
-            || (pBuffer->m_NumValidBytes < bytesToRead)) {
-            DEBUG_WARNING("Error while reading a block.");
-            gotoErr(EFail);
-        }
+    fWasFinished = (m_Err) || (DATAGRAM_TEST_NUM_DATAGRAMS == m_NumReceived);
 
-        same = true;
-        for (byteNum = 0; byteNum < bytesToRead; byteNum++) {
-            c = (char) (byteNum + baseVal);
-            if (c != g_TestMemoryDevice[byteNum]) {
-                same = false;
+    datagramNum = -1;
+    if ((ENoErr == pBuffer->m_Err) && (pBuffer->m_NumValidBytes > 0)) {
+        datagramNum = (unsigned char) pBuffer->m_pLogicalBuffer[0];
+    }
+    if ((datagramNum < 0)
+        || (datagramNum >= DATAGRAM_TEST_NUM_DATAGRAMS)
+        || (m_fReceived[datagramNum])
+        || (pBuffer->m_NumValidBytes != DATAGRAM_TEST_SIZE(datagramNum))) {
+        m_Err = EFail;
+    } else {
+        for (byteNum = 1; byteNum < pBuffer->m_NumValidBytes; byteNum++) {
+            if (LOOPBACK_TEST_BYTE(datagramNum + byteNum) != pBuffer->m_pLogicalBuffer[byteNum]) {
+                m_Err = EFail;
                 break;
             }
         }
-
-        if (!same) {
-            DEBUG_WARNING("Data read does not match what was written. byteNum = %d\n",
-                    byteNum);
-            gotoErr(EFail);
-        }
-
-        startByte += bytesToRead;
-        bytesRead += bytesToRead;
+        m_fReceived[datagramNum] = true;
+        m_NumReceived += 1;
+        m_Source = pBuffer->m_udpDatagramSource;
     }
 
-abort:
-    CIOSystem::ReleaseBlockList(pBuffer);
-    returnErr(ENoErr);
-} // TestReadBlocks.
-
-
+    if ((!fWasFinished)
+        && ((m_Err) || (DATAGRAM_TEST_NUM_DATAGRAMS == m_NumReceived))) {
+        m_pEvent->Signal();
+    }
+} // OnBlockIOEvent.
 
 
 
@@ -2075,180 +5653,280 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestReadPastEof]
+// [TestNetDatagramBatch]
 //
+// One UDP socket sends a batch of datagrams to another. A third socket then
+// sends them all back to the address they came from, so both directions
+// are batched and the source address of each read is checked too.
 /////////////////////////////////////////////////////////////////////////////
 static ErrVal
-TestReadPastEof(CAsyncBlockIO *pBlockIO, int32 startByte) {
+TestNetDatagramBatch() {
     ErrVal err = ENoErr;
-    int32 bytesToRead;
-    CIOBuffer *pBuffer = NULL;
-    CIOSystem *pIOSystem;
-    int64 pos;
-
-    if (!pBlockIO) {
-        gotoErr(EFail);
+    CNetIOTestSettings settings;
+    CDatagramTestEndpoint *pSender = NULL;
+    CDatagramTestEndpoint *pReceiver = NULL;
+    CDatagramTestEndpoint *pReplier = NULL;
+    struct sockaddr_in destAddr;
+
+    g_DebugManager.StartTest("Send and receive a batch of datagrams");
+
+    // Datagrams never go through io_uring, so this also checks that they
+    // still work when it is on.
+    settings.m_UseEpoll = 1;
+    settings.m_UseIOUring = 1;
+    err = NetIO_RestartNetIOSystem(&settings);
+    if (err) {
+        DEBUG_WARNING("Cannot restart the network.");
+        gotoErr(err);
     }
 
-    pIOSystem = pBlockIO->GetIOSystem();
-
-    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
-    if (!pBuffer) {
-        DEBUG_WARNING("Cannot allocate an IO block");
+    pSender = newex CDatagramTestEndpoint;
+    pReceiver = newex CDatagramTestEndpoint;
+    pReplier = newex CDatagramTestEndpoint;
+    if ((NULL == pSender) || (NULL == pReceiver) || (NULL == pReplier)) {
         gotoErr(EFail);
     }
 
-    bytesToRead = 10;
-
-    pos = pIOSystem->GetIOStartPosition(startByte)
-                + pIOSystem->GetDefaultBytesPerBlock();
-
-    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
-    pBuffer->m_Err = ENoErr;
-    pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
-    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
-    pBuffer->m_BufferSize = bytesToRead;
-    ASSERT(bytesToRead > 0);
-    pBuffer->m_NumValidBytes = bytesToRead;
-    ASSERT(pBuffer->m_NumValidBytes >= 0);
-    pBuffer->m_PosInMedia = pos;
-
-    pBlockIO->ReadBlockAsync(pBuffer);
-    g_TestCallback->Wait();
-    if (EEOF == pBuffer->m_Err) {
-        err = ENoErr;
-    } else {
-        err = EFail;
+    err = pReceiver->Open(NULL);
+    if (!err) {
+        err = NetIO_LookupHost((char *) "127.0.0.1", pReceiver->m_PortNum, &destAddr);
+    }
+    if (!err) {
+        err = pSender->Open(&destAddr);
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot open a UDP socket.");
+        gotoErr(err);
     }
 
+    err = pSender->Send(DATAGRAM_TEST_NUM_DATAGRAMS);
     if (err) {
-        DEBUG_WARNING("Error while reading a block.");
+        gotoErr(err);
+    }
+    pReceiver->Wait();
+    if ((pReceiver->m_Err)
+        || (DATAGRAM_TEST_NUM_DATAGRAMS != pReceiver->m_NumReceived)) {
+        DEBUG_WARNING("The datagrams arrived with the wrong data.");
+        gotoErr(EFail);
+    }
+    if (ntohs(pReceiver->m_Source.sin_port) != pSender->m_PortNum) {
+        DEBUG_WARNING("A datagram has the wrong source address.");
         gotoErr(EFail);
     }
 
-    if (pBuffer->m_NumValidBytes != 0) {
-        DEBUG_WARNING("Error. No error from reading past eof.");
+    err = pReplier->Open(&(pReceiver->m_Source));
+    if (!err) {
+        err = pReplier->Send(DATAGRAM_TEST_NUM_DATAGRAMS);
+    }
+    if (err) {
+        gotoErr(err);
+    }
+    pSender->Wait();
+    if ((pSender->m_Err)
+        || (DATAGRAM_TEST_NUM_DATAGRAMS != pSender->m_NumReceived)) {
+        DEBUG_WARNING("The datagrams came back with the wrong data.");
         gotoErr(EFail);
     }
 
 abort:
-    RELEASE_OBJECT(pBuffer);
-    returnErr(ENoErr);
-} // TestReadPastEof.
+    if (pSender) {
+        pSender->Close();
+    }
+    if (pReceiver) {
+        pReceiver->Close();
+    }
+    if (pReplier) {
+        pReplier->Close();
+    }
+    RELEASE_OBJECT(pSender);
+    RELEASE_OBJECT(pReceiver);
+    RELEASE_OBJECT(pReplier);
+
+    returnErr(err);
+} // TestNetDatagramBatch.
 
 
 
 
 
 
+#if LINUX
 /////////////////////////////////////////////////////////////////////////////
 //
-// [TestNet]
+// [CountListeningSockets]
 //
+// This counts the TCP sockets that the kernel says are listening on a port.
 /////////////////////////////////////////////////////////////////////////////
-static void
-TestNet() {
-    ErrVal err = ENoErr;
-    CAsyncBlockIO * pBlockIO;
-    int32 numBytes;
-    CIOBuffer *pBuffer;
-    CIOSystem *pIOSystem;
-    CParsedUrl *pUrl = NULL;
-    const char *ptr;
-    char buffer[CParsedUrl::MAX_URL_LENGTH];
+static int32
+CountListeningSockets(uint16 portNum) {
+    FILE *pFile;
+    char line[512];
+    unsigned int localAddr;
+    unsigned int localPort;
+    unsigned int remoteAddr;
+    unsigned int remotePort;
+    unsigned int state;
+    int32 numListeners = 0;
+
+    pFile = fopen("/proc/net/tcp", "r");
+    if (NULL == pFile) {
+        return(-1);
+    }
+    // The first line is a header, which does not parse.
+    while (fgets(line, sizeof(line), pFile)) {
+        if ((5 == sscanf(line, " %*d: %x:%x %x:%x %x",
+                         &localAddr, &localPort, &remoteAddr, &remotePort, &state))
+            && (portNum == localPort)
+            && (0x0A == state)) { // TCP_LISTEN
+            numListeners += 1;
+        }
+    }
+    fclose(pFile);
 
-    g_DebugManager.StartTest("Connect and send HTTP GET");
+    return(numListeners);
+} // CountListeningSockets.
+#endif // LINUX
 
 
 
-    snprintf(
-        buffer,
-        sizeof(buffer),
-        "http://%s:%d",
-        g_TestServerName,
-        g_TestServerPort);
-    RELEASE_OBJECT(pUrl);
-    pUrl = CParsedUrl::AllocateUrl(buffer);
-    if (NULL == pUrl) {
-        gotoErr(EFail);
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestNetReusePortListeners]
+//
+// With two listeners per port, a server port has two SO_REUSEPORT sockets,
+// one on each reactor. Every connection must be accepted and echoed,
+// whichever listener the kernel gives it to, and closing the listener the
+// caller sees must close both.
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+TestNetReusePortListeners() {
+    ErrVal err = ENoErr;
+    CNetIOTestSettings settings;
+    CLoopbackTestServer *pServer = NULL;
+    CLoopbackTestClient *clientList[REUSEPORT_TEST_NUM_CLIENTS];
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    uint16 portNum = 0;
+    int32 clientNum;
+
+    g_DebugManager.StartTest("Accept on several listeners per port");
+
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        clientList[clientNum] = NULL;
     }
 
-    err = g_pNetIOSystem->OpenBlockIO(pUrl, CAsyncBlockIO::READ_ACCESS | CAsyncBlockIO::WRITE_ACCESS, g_TestCallback);
+    settings.m_UseEpoll = 1;
+    settings.m_UseIOUring = 0;
+    settings.m_NumReactors = REUSEPORT_TEST_NUM_LISTENERS;
+    settings.m_NumListenersPerPort = REUSEPORT_TEST_NUM_LISTENERS;
+    err = NetIO_RestartNetIOSystem(&settings);
     if (err) {
-        DEBUG_WARNING("Cannot open a pBlockIO to a host");
-        gotoErr(EFail);
+        DEBUG_WARNING("Cannot restart the network.");
+        gotoErr(err);
     }
 
-    err = g_TestCallback->Wait();
-    if (err) {
-        DEBUG_WARNING("Cannot resolve a host");
+    pServer = newex CLoopbackTestServer;
+    if (NULL == pServer) {
         gotoErr(EFail);
     }
+    err = pServer->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
 
-    pBlockIO = g_TestCallback->m_pBlockIO;
-    g_TestCallback->m_pBlockIO = NULL;
-
+    err = NetIO_OpenServerBlockIO(0, true, pServer, &pListenBlockIO);
+    if (!err) {
+        err = NetIO_GetServerPort(pListenBlockIO, &portNum);
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot open a loopback server.");
+        gotoErr(err);
+    }
+#if LINUX
+    if (REUSEPORT_TEST_NUM_LISTENERS != CountListeningSockets(portNum)) {
+        DEBUG_WARNING("A server port has the wrong number of listeners.");
+    }
+#endif
 
-    pIOSystem = pBlockIO->GetIOSystem();
-    if (!pIOSystem) {
-        DEBUG_WARNING("Cannot get pIOSystem");
-        gotoErr(EFail);
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        clientList[clientNum] = newex CLoopbackTestClient;
+        if (NULL == clientList[clientNum]) {
+            gotoErr(EFail);
+        }
+        err = clientList[clientNum]->Initialize(LOOPBACK_TEST_SEND_SIZE);
+        if (!err) {
+            err = clientList[clientNum]->Connect(portNum);
+        }
+        if (err) {
+            DEBUG_WARNING("Cannot connect to the loopback server.");
+            gotoErr(err);
+        }
     }
-    pBuffer = pIOSystem->AllocIOBuffer(-1, false);
-    if (!pBuffer) {
-        DEBUG_WARNING("Cannot allocate an IO block");
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        pServer->Wait();
+    }
+    if ((pServer->m_Err) || (REUSEPORT_TEST_NUM_CLIENTS != pServer->m_NumAccepted)) {
+        DEBUG_WARNING("The loopback server did not accept every connection.");
         gotoErr(EFail);
     }
 
-    // char *ptr = "GET www.google.com/ HTTP/1.0\n\r"
-    ptr = "GET / HTTP/1.1\r\n"
-            "Accept: */*\r\n"
-            "TestHeader: 1\r\n"
-            "Accept-Language: en-us\r\n"
-            //"Accept-Encoding: gzip, deflate\r\n"
-            "User-Agent: dawsonsBrowser\r\n" // Mozilla/4.0 (compatible; MSIE 6.0; Windows NT 5.0; .NET CLR 1.1.4322)\r\n"
-            "Host: www.google.com\r\n"
-            //"Connection: Keep-Alive\r\n"
-            "\r\n";
-
-    numBytes = strlen(ptr);
-    snprintf(g_TestMemoryDevice, TEST_BLOCK_SIZE, ptr);
-
-    pBuffer->m_BufferOp = CIOBuffer::NO_OP;
-    pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
-    pBuffer->m_Err = ENoErr;
-    pBuffer->m_pPhysicalBuffer = g_TestMemoryDevice;
-    pBuffer->m_pLogicalBuffer = pBuffer->m_pPhysicalBuffer;
-    pBuffer->m_BufferSize = numBytes;
-    ASSERT(numBytes > 0);
-    pBuffer->m_NumValidBytes = numBytes;
-    ASSERT(pBuffer->m_NumValidBytes >= 0);
-    pBuffer->m_PosInMedia = 0;
-    pBuffer->m_StartWriteOffset= 0;
-
-    pBlockIO->WriteBlockAsync(pBuffer, 0);
-    g_TestCallback->Wait();
-    if ((ENoErr != pBuffer->m_Err)
-        || (pBuffer->m_NumValidBytes != numBytes)) {
-        DEBUG_WARNING("Error while writing a block.");
-        gotoErr(EFail);
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        err = clientList[clientNum]->Send(LOOPBACK_TEST_SEND_SIZE);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        clientList[clientNum]->Wait();
+        if ((clientList[clientNum]->m_Err)
+            || (clientList[clientNum]->m_fDisconnected)
+            || (clientList[clientNum]->m_NumBytesReceived
+                    != clientList[clientNum]->m_NumBytesExpected)) {
+            DEBUG_WARNING("The echo came back with the wrong data.");
+            gotoErr(EFail);
+        }
     }
 
-    // Buffers should just arrive.
-    err = g_TestCallback->Wait();
-    if (err) {
-        DEBUG_WARNING("Error while writing a block.");
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        clientList[clientNum]->Close();
+    }
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        pServer->Wait();
+    }
+    if (REUSEPORT_TEST_NUM_CLIENTS != pServer->m_NumClosed) {
+        DEBUG_WARNING("The loopback server did not see every connection close.");
         gotoErr(EFail);
     }
 
-    CIOSystem::ReleaseBlockList(pBuffer);
-
-    pBlockIO->Close();
+    pListenBlockIO->Close();
+    RELEASE_OBJECT(pListenBlockIO);
+    NetIO_WaitForAllBlockIOsToClose();
+#if LINUX
+    if (0 != CountListeningSockets(portNum)) {
+        DEBUG_WARNING("Closing a server did not close all of its listeners.");
+    }
+#endif
 
 abort:
-    RELEASE_OBJECT(pBlockIO);
-    RELEASE_OBJECT(pUrl);
-} // TestNet.
+    for (clientNum = 0; clientNum < REUSEPORT_TEST_NUM_CLIENTS; clientNum++) {
+        if (clientList[clientNum]) {
+            clientList[clientNum]->Close();
+            RELEASE_OBJECT(clientList[clientNum]);
+        }
+    }
+    if (pServer) {
+        pServer->CloseAll();
+    }
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    RELEASE_OBJECT(pServer);
+
+    returnErr(err);
+} // TestNetReusePortListeners.
 
 
 
@@ -29,7 +29,6 @@
 
 #if LINUX
 #include <netinet/in.h>
-#include <aio.h>
 #endif
 
 class CIOBuffer;
@@ -38,6 +37,8 @@ class CIOSystem;
 class CAsyncIOStream;
 class CNetIOSystem;
 class CParsedUrl;
+class CTimer;
+struct CIOBufferMagazine;
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -121,6 +122,8 @@ public:
         OUTPUT_BUFFER       = 0x08,
         DISCARD_WHEN_IDLE   = 0x10,
         UNSAVED_CHANGES     = 0x20,
+        SEND_FROM_FILE      = 0x40,
+        SLICE_OF_BUFFER     = 0x80,
     };
 
     int32                       m_BufferOp;
@@ -161,6 +164,19 @@ public:
     // buffer in one operation.
     int32                       m_StartWriteOffset;
 
+    // A SEND_FROM_FILE buffer has no data of its own. It describes
+    // m_NumValidBytes bytes at m_SendFilePos in another blockIO, and the
+    // device that writes it copies those bytes without reading them into
+    // user memory.
+    CAsyncBlockIO               *m_pSendFileSource;
+    int64                       m_SendFilePos;
+
+    // A SLICE_OF_BUFFER buffer has no memory of its own either. Its
+    // m_pPhysicalBuffer is a range in the memory of m_pSliceParent, and
+    // it holds a reference so that memory stays around as long as the
+    // slice does. Many slices may share one parent.
+    CIOBuffer                   *m_pSliceParent;
+
     struct sockaddr_in          m_udpDatagramSource;
 
 #if WIN32
@@ -169,10 +185,6 @@ public:
     DWORD                       m_dwNumBytesTransferred;
 #endif // WIN32
 
-#if LINUX
-    struct aiocb                m_AIORequest;
-#endif
-
     CIOBuffer();
     ~CIOBuffer();
     NEWEX_IMPL()
@@ -181,7 +193,10 @@ public:
     virtual ErrVal CheckState();
 
     // CRefCountInterface
-    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+    // The last release may hand the buffer back to its IO system to be
+    // reused, rather than deleting it.
+    virtual void AddRefImpl(const char *pFileName, int32 lineNum) { DefaultAddRefImpl(pFileName, lineNum); }
+    virtual void ReleaseImpl(const char *pFileName, int32 lineNum);
 
     // CJob
     virtual void ProcessJob(CSimpleThread *pThreadState);
@@ -204,6 +219,8 @@ public:
         MEMORY_MEDIA                    = 1,
         FILE_MEDIA                      = 2,
         NETWORK_MEDIA                   = 3,
+        // A read-only file that is mapped into memory.
+        MAPPED_FILE_MEDIA               = 4,
 
         // These are the options to open.
         // They are *also* stored as flags in a block IO.
@@ -212,6 +229,19 @@ public:
         RESIZEABLE                      = 0x0004,
         CREATE_NEW_STORE                = 0x0008,
         USE_SYNCHRONOUS_IO              = 0x0010,
+        // Files only. Bypass the OS page cache. Buffers from AllocIOBuffer
+        // and positions from GetIOStartPosition are already aligned for this.
+        USE_DIRECT_IO                   = 0x0020,
+        // Files only. Map a file that is opened without WRITE_ACCESS into
+        // memory, so a stream can read it without copying.
+        USE_MEMORY_MAP                  = 0x0040,
+        // Files only. These tell the OS how the file will be read.
+        SEQUENTIAL_ACCESS               = 0x0080,
+        RANDOM_ACCESS                   = 0x0100,
+        // Files only. A stream Flush does not finish until the data is on
+        // disk. Streams that flush the same file at the same time share one
+        // disk sync.
+        DURABLE_FLUSH                   = 0x0200,
 
         // These are set internally.
         BLOCKIO_IS_OPEN                 = 0x1000,
@@ -233,12 +263,47 @@ public:
     virtual void ReadBlockAsync(CIOBuffer *pBuffer);
     virtual void WriteBlockAsync(CIOBuffer *pBuffer, int32 startOffsetInBuffer);
 
+    // Writes issued between StartWriteChain and EndWriteChain may be held
+    // and then sent together, so a device can send a chain of buffers with
+    // one system call. Each buffer still completes individually.
+    virtual void StartWriteChain();
+    virtual void EndWriteChain();
+
+    // A device that can copy straight from a file descriptor accepts
+    // SEND_FROM_FILE buffers. GetFileDescriptor returns -1 if the media has
+    // no descriptor that another device can read.
+    virtual bool CanSendFromFile() { return(false); }
+    virtual int GetFileDescriptor() { return(-1); }
+
+    // A device that can copy between files inside the kernel copies
+    // numBytes from the source media into this media. It returns the
+    // number of bytes copied, which is 0 if it cannot copy from that
+    // source, so the caller copies the rest through buffers.
+    virtual int64 CopyFromFile(
+                        CAsyncBlockIO *pSrcBlockIO,
+                        int64 srcPos,
+                        int64 destPos,
+                        int64 numBytes);
+
+    // A MAPPED_FILE_MEDIA device returns the whole contents of the media.
+    // This stays valid until the blockIO is closed.
+    virtual char *GetMappedData() { return(NULL); }
+
+    // A device with a block cache returns a slice of the cached block that
+    // holds pos, or NULL if that block is not cached. Many streams may hold
+    // slices of one block, so the caller must never change its bytes.
+    virtual CIOBuffer *GetSharedBlock(int64 pos) { pos = pos; return(NULL); }
+
     // Resize removes from the end. RemoveNBytes removes from the current position.
     virtual ErrVal Resize(int64 newLength) = 0;
     ErrVal RemoveNBytes(int64 numBytes);
 
     // Various accessor functions.
     int64 GetMediaSize() { return(m_MediaSize); }
+
+    // This is the space the media holds, which may be more than
+    // GetMediaSize if a file has space reserved past its end.
+    virtual int64 GetAllocatedSize() { return(m_MediaSize); }
     CIOSystem *GetIOSystem() { return(m_pIOSystem); }
     CRefLock *GetLock();
 
@@ -333,17 +398,125 @@ public:
     virtual int64 GetIOStartPosition(int64 pos) { return(pos); }
     virtual int32 GetBlockBufferAlignment() { return(0); }
 
+    // Asynchronous completions are passed to callbacks on the threads of
+    // this queue. Each blockIO still sees its completions one at a time
+    // and in order.
+    virtual CJobQueue *GetCompletionJobQueue();
+
     CIOBuffer *AllocIOBuffer(int32 bufferSize, bool allocBuffer);
+    CIOBuffer *AllocBufferSlice(CIOBuffer *pParent, int32 offset, int32 numBytes);
+    bool RecycleIOBuffer(CIOBuffer *pBuffer);
+
+    void TrimIOBufferPool();
+    int32 GetNumIdleIOBuffers();
 
 protected:
     friend class CAsyncBlockIO;
+    friend struct CIOBufferMagazine;
+
+    enum {
+        // Idle buffers are sorted by their size in blocks. Buffers larger
+        // than this are always returned to the heap.
+        MAX_POOLED_BUFFER_BLOCKS    = 16,
+
+        // Each thread keeps up to this many idle buffers of each size in
+        // front of the shared lists, and moves half that many at a time
+        // to or from them.
+        BUFFERS_PER_MAGAZINE        = 8,
+        MAGAZINE_TRANSFER_SIZE      = BUFFERS_PER_MAGAZINE / 2,
+    };
+
+    CIOBuffer *GetPooledIOBuffer(int32 sizeClass);
+    bool PutPooledIOBuffer(int32 sizeClass, CIOBuffer *pBuffer);
+    CIOBufferMagazine *GetIOBufferMagazine();
+    void FlushIOBufferMagazine(CIOBufferMagazine *pMagazine);
+    void TrimIdleIOBuffers(bool fForce, CQueueList<CIOBuffer> *pDeadBuffers);
+    void EmptyIOBufferPool();
 
     bool                        m_fInitialized;
     CRefLock                    *m_pLock;
 
     CQueueList<CAsyncBlockIO>   m_ActiveBlockIOs;
+
+    // These are idle buffers. m_IdleBuffers[0] holds buffers with no
+    // memory of their own, and m_IdleBuffers[n] holds buffers of exactly
+    // n default-sized blocks. m_pPoolLock is a leaf lock, so a buffer can
+    // be released while holding any other lock.
+    CRefLock                    *m_pPoolLock;
+    int32                       m_MaxIdleBuffersPerSize;
+    CQueueList<CIOBuffer>       m_IdleBuffers[MAX_POOLED_BUFFER_BLOCKS + 1];
+
+    // This changes each time the pool is emptied, so a thread can tell
+    // that its magazine holds buffers from before then.
+    volatile int32              m_PoolGeneration;
+
+    // Each list is trimmed by half of its low-water mark, which is the
+    // fewest buffers it held since the last trim. Those buffers sat idle
+    // for the whole interval.
+    int32                       m_MinIdleBuffers[MAX_POOLED_BUFFER_BLOCKS + 1];
+    uint64                      m_LastTrimTimeInMs;
 }; // CIOSystem.
 
+
+
+#if LINUX
+struct io_uring_sqe;
+
+/////////////////////////////////////////////////////////////////////////////
+// This is a thin wrapper around one io_uring instance. We talk to the kernel
+// with the raw system calls, so there is no dependency on liburing. Both the
+// network and the file IO systems use it.
+//
+// Any thread may submit. Only one thread reaps completions.
+/////////////////////////////////////////////////////////////////////////////
+class CIOUring {
+public:
+    CIOUring();
+    virtual ~CIOUring();
+    NEWEX_IMPL()
+
+    ErrVal Initialize(uint32 numEntries);
+
+    // SubmitSQE tells the kernel about one request right away. QueueSQE
+    // only puts a request in the ring, so a group of requests can be passed
+    // to the kernel with a single SubmitQueuedSQEs.
+    ErrVal SubmitSQE(const struct io_uring_sqe *pSQE);
+    ErrVal QueueSQE(const struct io_uring_sqe *pSQE);
+    ErrVal SubmitQueuedSQEs();
+
+    ErrVal WaitForCompletions();
+    bool GetNextCompletion(uint64 *pUserData, int32 *pResult);
+
+private:
+    ErrVal QueueSQEInLock(const struct io_uring_sqe *pSQE);
+    ErrVal EnterRing(uint32 numToSubmit);
+
+    int                     m_RingFd;
+    CRefLock                *m_pSubmitLock;
+
+    // These were put in the ring but not yet passed to the kernel.
+    uint32                  m_NumQueuedSQEs;
+
+    void                    *m_pSQRing;
+    size_t                  m_SQRingSize;
+    void                    *m_pCQRing;
+    size_t                  m_CQRingSize;
+    struct io_uring_sqe     *m_pSQEs;
+    size_t                  m_SQEsSize;
+
+    uint32                  *m_pSQHead;
+    uint32                  *m_pSQTail;
+    uint32                  m_SQMask;
+    uint32                  m_SQNumEntries;
+    uint32                  *m_pSQArray;
+
+    uint32                  *m_pCQHead;
+    uint32                  *m_pCQTail;
+    uint32                  m_CQMask;
+    struct io_uring_cqe     *m_pCQEs;
+}; // CIOUring
+#endif // LINUX
+
 extern CIOSystem *g_pMemoryIOSystem;
 extern CIOSystem *g_pFileIOSystem;
 extern CIOSystem *g_pNetIOSystem;
@@ -352,9 +525,93 @@ ErrVal InitializeMemoryBlockIO();
 ErrVal InitializeFileBlockIO();
 ErrVal InitializeNetBlockIO();
 
+// Every file blockIO in the process shares one cache of file blocks.
+// A size of 0 turns the cache off.
+ErrVal SetFileBlockCacheSize(int32 maxNumBlocks);
+void GetFileBlockCacheStats(int64 *pNumHits, int64 *pNumMisses);
+
+// A file that grows reserves space past its end in chunks that double
+// from minChunkBytes up to maxChunkBytes. This applies to files opened
+// afterward. A minChunkBytes of 0 turns this off.
+ErrVal SetFilePreallocation(int32 minChunkBytes, int32 maxChunkBytes);
+
+#if INCLUDE_REGRESSION_TESTS
+// Tests use this to run the same file IO with and without io_uring. It
+// shuts the file system down, and the next file that is opened starts it
+// again with these settings. A setting of -1 is read from the config file,
+// and NULL means all of them are. Every file blockIO must be closed first,
+// or this fails with EFileIsBusy.
+struct CFileIOTestSettings {
+    CFileIOTestSettings() {
+        m_UseIOUring = -1;
+    }
+
+    int32   m_UseIOUring;
+};
+ErrVal RestartFileIOSystem(const CFileIOTestSettings *pSettings);
+#endif
+
 bool NetIO_GetLocalProxySettings(char **ppProxyServerName, int *pProxyPort);
 ErrVal NetIO_LookupHost(char *name, uint16 portNum, struct sockaddr_in *addr);
 void NetIO_WaitForAllBlockIOsToClose(); // This is just for leak checking.
 
+// General purpose timers. The callback runs on a network thread, so it
+// must not block. A cancelled timer may still fire once if it was already
+// expiring when it was cancelled.
+ErrVal NetIO_StartTimer(CTimer *pTimer, int32 delayInMs);
+void NetIO_CancelTimer(CTimer *pTimer);
+
+// TCP servers. The listener's callback gets OnBlockIOAccept for each new
+// connection. An accepted blockIO does not read anything until it is given
+// its own callback with NetIO_ReceiveDataFromAcceptedConnection.
+ErrVal NetIO_OpenServerBlockIO(
+                uint16 portNum,
+                bool fUse127001Address,
+                CAsyncBlockIOCallback *pCallback,
+                CAsyncBlockIO **ppBlockIO);
+ErrVal NetIO_ReceiveDataFromAcceptedConnection(
+                CAsyncBlockIO *pBlockIO,
+                CAsyncBlockIOCallback *pCallback);
+
+// UDP sockets. Each buffer that is read or written is one datagram, and a
+// read buffer's m_udpDatagramSource says where it came from. Every datagram
+// that is written goes to pDestAddr, which is NULL for a socket that only
+// receives. Datagrams arrive as unsolicited reads on the callback.
+ErrVal NetIO_OpenDatagramBlockIO(
+                uint16 portNum,
+                bool fUse127001Address,
+                const struct sockaddr_in *pDestAddr,
+                CAsyncBlockIOCallback *pCallback,
+                CAsyncBlockIO **ppBlockIO);
+
+// This is the port a server or a UDP socket is bound to. Pass port 0 to
+// NetIO_OpenServerBlockIO or NetIO_OpenDatagramBlockIO to let the system
+// pick one.
+ErrVal NetIO_GetServerPort(CAsyncBlockIO *pBlockIO, uint16 *pPortNum);
+
+#if INCLUDE_REGRESSION_TESTS
+// Tests use this to run the same traffic over each network backend. It
+// shuts the network down, and the next blockIO that is opened starts it
+// again with these settings. A setting of -1 is read from the config file,
+// and NULL means all of them are. Every network blockIO must be closed
+// first, or this fails with EFileIsBusy.
+struct CNetIOTestSettings {
+    CNetIOTestSettings() {
+        m_UseEpoll = -1;
+        m_UseIOUring = -1;
+        m_NumReactors = -1;
+        m_NumListenersPerPort = -1;
+        m_SocketBufferSize = -1;
+    }
+
+    int32   m_UseEpoll;
+    int32   m_UseIOUring;
+    int32   m_NumReactors;
+    int32   m_NumListenersPerPort;
+    int32   m_SocketBufferSize;
+};
+ErrVal NetIO_RestartNetIOSystem(const CNetIOTestSettings *pSettings);
+#endif
+
 #endif // _BLOCK_IO_H_
 
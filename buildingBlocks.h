@@ -38,6 +38,7 @@
 #include "fileUtils.h"
 #include "queue.h"
 #include "jobQueue.h"
+#include "timerWheel.h"
 #include "stringParse.h"
 #include "rbTree.h"
 #include "nameTable.h"
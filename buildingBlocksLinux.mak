@@ -46,6 +46,7 @@ SOURCES = buildingBlocksManager.cpp \
    fileUtils.cpp \
    queue.cpp \
    jobQueue.cpp \
+   timerWheel.cpp \
    stringParse.cpp \
    rbTree.cpp \
    nameTable.cpp \
@@ -76,6 +77,7 @@ OBJECTS = \
    $(OUTPUT_DIR)/fileUtils.o \
    $(OUTPUT_DIR)/queue.o \
    $(OUTPUT_DIR)/jobQueue.o \
+   $(OUTPUT_DIR)/timerWheel.o \
    $(OUTPUT_DIR)/stringParse.o \
    $(OUTPUT_DIR)/rbTree.o \
    $(OUTPUT_DIR)/nameTable.o \
@@ -94,6 +96,12 @@ OBJECTS = \
 
 TARGET = $(OUTPUT_DIR)/libbuildingBlocks.a
 
+# The benchmark is a separate program that links with the library.
+# It is only built by "make benchmark".
+BENCHMARK = $(OUTPUT_DIR)/netBenchmark
+BENCHMARK_OBJECTS = $(OUTPUT_DIR)/netBenchmark.o
+BENCHMARK_LIBS = -lpthread -lrt
+
 
 #############################################################################
 # Implicit rules
@@ -112,8 +120,14 @@ all: $(TARGET)
 $(TARGET): $(OBJECTS)
 	$(LINK) $(LFLAGS) $(TARGET) $(OBJECTS)
 
+benchmark: $(BENCHMARK)
+
+$(BENCHMARK): $(BENCHMARK_OBJECTS) $(TARGET)
+	$(CC) -o $(BENCHMARK) $(BENCHMARK_OBJECTS) $(TARGET) $(BENCHMARK_LIBS)
+
 clean:
 	-rm -f $(OBJECTS) $(TARGET)
+	-rm -f $(BENCHMARK_OBJECTS) $(BENCHMARK)
 	-rm -f ~/core
 
 
@@ -131,18 +145,20 @@ $(OUTPUT_DIR)/threads.o: threads.cpp threads.h refCount.h memAlloc.h debugging.h
 $(OUTPUT_DIR)/fileUtils.o: fileUtils.cpp fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
 $(OUTPUT_DIR)/queue.o: queue.cpp queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
 $(OUTPUT_DIR)/jobQueue.o: jobQueue.cpp jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/stringParse.o: stringParse.cpp stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/rbTree.o: rbTree.cpp rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/nameTable.o: nameTable.cpp nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/url.o: url.cpp url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/blockIO.o: blockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/memoryBlockIO.o: memoryBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/fileBlockIO.o: fileBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/netBlockIO.o: netBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/asyncIOStream.o: asyncIOStream.cpp asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/polyHTTPStream.o: polyHTTPStream.cpp polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/polyHTTPStreamBasic.o: polyHTTPStreamBasic.cpp polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/polyXMLDoc.o: polyXMLDoc.cpp polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/polyXMLDocText.o: polyXMLDocText.cpp polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
-$(OUTPUT_DIR)/serializedObject.o: serializedObject.cpp serializedObject.h polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/timerWheel.o: timerWheel.cpp timerWheel.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/stringParse.o: stringParse.cpp stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/rbTree.o: rbTree.cpp rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/nameTable.o: nameTable.cpp nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/url.o: url.cpp url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/blockIO.o: blockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/memoryBlockIO.o: memoryBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/fileBlockIO.o: fileBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/netBlockIO.o: netBlockIO.cpp blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/asyncIOStream.o: asyncIOStream.cpp asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/polyHTTPStream.o: polyHTTPStream.cpp polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/polyHTTPStreamBasic.o: polyHTTPStreamBasic.cpp polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/polyXMLDoc.o: polyXMLDoc.cpp polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/polyXMLDocText.o: polyXMLDocText.cpp polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/serializedObject.o: serializedObject.cpp serializedObject.h polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
+$(OUTPUT_DIR)/netBenchmark.o: netBenchmark.cpp buildingBlocks.h serializedObject.h polyXMLDoc.h polyHTTPStream.h asyncIOStream.h blockIO.h url.h nameTable.h rbTree.h stringParse.h timerWheel.h jobQueue.h queue.h fileUtils.h threads.h refCount.h memAlloc.h debugging.h log.h config.h stringLib.h osIndependantLayer.h
 
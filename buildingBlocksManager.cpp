@@ -72,6 +72,7 @@
 //
 //   stringParse.cpp
 //
+//   timerWheel.cpp
 //   jobQueue.cpp
 //
 //   queue.cpp
@@ -334,6 +335,7 @@ CBuildingBlocks::TestBuildingBlocks() {
     //CSimpleThread::TestThreads();
     //TestQueue();
     //CJobQueue::TestJobQueue();
+    //CTimerWheel::TestTimerWheel();
     //CRBTree::TestTree();
     //CNameTable::TestNameTable();
     //CParsedUrl::TestURL();
@@ -71,6 +71,7 @@ LIB32_OBJS= \
       "$(OUTDIR)\nameTable.obj" \
       "$(OUTDIR)\queue.obj" \
       "$(OUTDIR)\jobQueue.obj" \
+      "$(OUTDIR)\timerWheel.obj" \
       "$(OUTDIR)\fileUtils.obj" \
       "$(OUTDIR)\stringParse.obj" \
       "$(OUTDIR)\url.obj" \
@@ -107,6 +108,7 @@ LIB32_OBJS= \
 "$(OUTDIR)\debugging.obj" : .\*.h
 "$(OUTDIR)\fileBlockIO.obj" : .\*.h
 "$(OUTDIR)\jobQueue.obj" : .\*.h
+"$(OUTDIR)\timerWheel.obj" : .\*.h
 "$(OUTDIR)\threads.obj" : .\*.h
 "$(OUTDIR)\log.obj" : .\*.h
 "$(OUTDIR)\memAlloc.obj" : .\*.h
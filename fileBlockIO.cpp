@@ -30,10 +30,14 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #if LINUX
-#include <aio.h>
-#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#define USE_LINUX_AIO  0
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define USE_IO_URING  1
 #endif // LINUX
 
 #include "osIndependantLayer.h"
@@ -64,17 +68,164 @@ static int32 g_OffsetFromAsyncIOInfoToIOBlock;
 #endif // WIN32
 
 extern int32 g_NumFileCallbacksActive;
+extern CConfigSection *g_pBuildingBlocksConfig;
 
 
-#if USE_LINUX_AIO
-static void LinuxSignalHandler(int sig, siginfo_t *info, void *unused);
-static void LinuxWorkerThreadProc(void *arg, CSimpleThread *threadState);
-static int32 g_OffsetFromAsyncIOInfoToIOBlock;
+#if USE_IO_URING
+static void FileUringThreadProc(void *arg, CSimpleThread *threadState);
+
+// io_uring is off unless the config file asks for it. Without it, Linux
+// files are always opened for synchronous IO.
+static const char g_FileUseIOUringConfigValueName[] = "File Use IO Uring";
 #endif
 
-// SIGRTMIN through SIGRTMAX are signals sent to computer programs for user-defined purposes.
-#define SIG_AIO_IO_COMPLETE (SIGRTMIN)
+// The block cache is off unless the config file gives it a size. It only
+// sees writes made through this process, so turning it on is a promise that
+// no other process changes the files while they are open.
+static const char g_FileBlockCacheBlocksConfigValueName[] = "File Block Cache Blocks";
+
+// A durable flush may wait this long before it syncs the file, so flushes
+// from other streams can share the same sync.
+static const char g_FileGroupCommitWindowConfigValueName[] = "File Group Commit Window Microseconds";
+
+// A file that grows reserves space past its end, so it is extended in a
+// few large pieces instead of one block at a time. This is off unless the
+// config file gives a smallest chunk.
+static const char g_FilePreallocationMinBytesConfigValueName[] = "File Preallocation Min Bytes";
+static const char g_FilePreallocationMaxBytesConfigValueName[] = "File Preallocation Max Bytes";
+
+// File completions normally share the main job queue with every other
+// device. This gives files a job queue of their own with this many threads,
+// so callbacks on different files can run at the same time.
+static const char g_FileCompletionThreadsConfigValueName[] = "File Completion Threads";
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This names one version of a file. Two blockIOs share cached blocks only
+// if they opened the same file when it had the same size and modify time.
+// Writes invalidate blocks by device and inode alone, so they reach every
+// version of the file.
+class CFileIdentity {
+public:
+    uint64      m_Device;
+    uint64      m_Inode;
+    int64       m_ModifyTime;
+    int64       m_FileSize;
+}; // CFileIdentity
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is a process-wide cache of file blocks, shared by every CFileBlockIO.
+// Each cached block is a refcounted CIOBuffer, and is never changed once it
+// is in the cache. Blocks are evicted with the CLOCK algorithm.
+//
+// A stream that cannot change its file, because it was opened without
+// WRITE_ACCESS, links a slice of the cached block into its buffer list, so
+// every such stream on a hot file shares one copy of each block. The slice
+// holds a reference, so an eviction or invalidation never frees a block
+// that a stream still reads. Any other read copies the cached blocks into
+// the reader's own buffer, which saves the read but not the memory. The
+// cache is off by default.
+//
+// The cache lock is below the blockIO lock, and the cache never calls out
+// while it holds the lock.
+class CFileBlockCache {
+public:
+    CFileBlockCache();
+    ~CFileBlockCache();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+    ErrVal SetMaxBlocks(int32 maxNumBlocks);
+    int64 GetGeneration();
+    int32 ReadBlocks(CFileIdentity *pFile, int64 pos, char *pDestPtr, int32 numBytes);
+    CIOBuffer *GetBlock(CFileIdentity *pFile, int64 pos);
+    void AddBlocks(
+                CFileIdentity *pFile,
+                int64 pos,
+                char *pData,
+                int32 numBytes,
+                int64 generation);
+    void Invalidate(CFileIdentity *pFile, int64 startPos, int64 stopPos);
+    void GetStats(int64 *pNumHits, int64 *pNumMisses);
+
+private:
+    class CCacheEntry {
+    public:
+        CFileIdentity   m_File;
+        int64           m_PosInMedia;
+        CIOBuffer       *m_pBuffer;
+        int32           m_NextInBucket;
+        bool            m_fReferenced;
+    }; // CCacheEntry
+
+    int32 GetBucket(CFileIdentity *pFile, int64 pos);
+    int32 FindEntry(CFileIdentity *pFile, int64 pos, bool fMatchVersion);
+    void RemoveEntry(int32 entryNum);
+    int32 GetFreeEntry();
+
+    CRefLock        *m_pLock;
+
+    CCacheEntry     *m_pEntries;
+    int32           m_MaxNumBlocks;
+    int32           m_NumBlocks;
+    int32           m_ClockHand;
+
+    // Free entries are chained through m_NextInBucket.
+    int32           m_FirstFreeEntry;
+
+    // Each bucket is the index of the first entry in a chain, or -1.
+    int32           *m_pBuckets;
+    int32           m_NumBuckets;
+
+    // Every invalidation changes this. A reader that started before the
+    // change may have read old data, so it does not add it to the cache.
+    int64           m_Generation;
+
+    int64           m_NumHits;
+    int64           m_NumMisses;
+}; // CFileBlockCache
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Every DURABLE_FLUSH blockIO on one file shares one of these. Syncing any
+// descriptor of a file writes all of its dirty data, so one sync covers
+// every flush that asked for it before the sync started.
+class CFileSyncGroup : public CRefCountImpl,
+                        public CRefCountInterface {
+public:
+    CFileSyncGroup();
+    virtual ~CFileSyncGroup();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+    ErrVal SyncFile(int fd, int32 windowInMicroSecs);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    // These are protected by the file IO system lock.
+    uint64                      m_Device;
+    uint64                      m_Inode;
+    int32                       m_NumUsers;
+    CQueueHook<CFileSyncGroup>  m_SyncGroupList;
+
+private:
+    CRefLock                    *m_pLock;
+    CRefEvent                   *m_pSyncDone;
 
+    // Each caller takes the next request number. A sync covers every
+    // request that was made before it started.
+    int64                       m_NumRequestedSyncs;
+    int64                       m_NumFinishedSyncs;
+    int64                       m_LastFailedSync;
+    bool                        m_fSyncing;
+    int32                       m_NumWaiters;
+}; // CFileSyncGroup
 
 
 
@@ -89,6 +240,17 @@ public:
     virtual void Close();
     virtual ErrVal Flush();
     virtual ErrVal Resize(int64 newLength);
+    virtual int64 GetAllocatedSize();
+    virtual int GetFileDescriptor();
+    virtual int64 CopyFromFile(
+                        CAsyncBlockIO *pSrcBlockIO,
+                        int64 srcPos,
+                        int64 destPos,
+                        int64 numBytes);
+    virtual char *GetMappedData();
+    virtual CIOBuffer *GetSharedBlock(int64 pos);
+    virtual void StartWriteChain();
+    virtual void EndWriteChain();
 
     // CDebugObject
     virtual ErrVal CheckState();
@@ -106,6 +268,50 @@ protected:
     int           m_AsynchFileFD;
 #endif // WIN32
 
+#if LINUX
+    ErrVal CheckDirectIOBuffer(CIOBuffer *pBuffer);
+    ErrVal WriteDirectIOTail(CIOBuffer *pBuffer);
+    ErrVal MapFile(int32 options);
+    void UnmapFile();
+    bool QueueChainedWrite(CIOBuffer *pBuffer);
+    void WriteChainedBuffers();
+    ErrVal WriteGatheredBuffers(CIOBuffer **pBufferList, int32 numBuffers);
+    void PreallocateSpace(int64 endPos);
+    void TrimPreallocatedSpace();
+
+    // This is the whole file when it is MAPPED_FILE_MEDIA.
+    char          *m_pMappedData;
+
+    // While this is set, requests are not passed to the kernel until
+    // EndWriteChain. Synchronous writes wait in m_PendingWrites, and
+    // io_uring writes wait in the ring.
+    bool          m_fWriteChainOpen;
+    CQueueList<CIOBuffer> m_PendingWrites;
+
+    // m_MediaSize is the logical length of the file. Space past it up to
+    // m_AllocatedSize is reserved but not part of the file.
+    int64         m_AllocatedSize;
+    bool          m_fPreallocate;
+#endif
+
+    void InitBlockCache(int32 options);
+    int32 ReadCachedBlocks(CIOBuffer *pBuffer, int32 numBytes);
+    void InvalidateCachedBlocks(int64 startPos, int64 stopPos);
+
+    // m_FileIdentity is valid if m_fHasFileIdentity is set. Only reads with
+    // m_fUseBlockCache go through the block cache, but every write
+    // invalidates it.
+    CFileIdentity m_FileIdentity;
+    bool          m_fHasFileIdentity;
+    bool          m_fUseBlockCache;
+
+    // This is only used by DURABLE_FLUSH blockIOs.
+    CFileSyncGroup *m_pSyncGroup;
+
+#if USE_IO_URING
+    ErrVal PostUringIO(CIOBuffer *pBuffer, uint8 opCode, int32 numBytes);
+#endif
+
     // This is used only for synchronous IO. It is used for systems that do not
     // support asynch IO, or when we explicitly request synch IO.
     CSimpleFile   m_SynchFile;
@@ -130,36 +336,80 @@ public:
     virtual int32 GetDefaultBytesPerBlock() { return(BYTES_PER_FILE_BLOCK); }
     virtual int64 GetIOStartPosition(int64 pos) {return(pos & (~(BYTES_PER_FILE_BLOCK - 1)));}
     virtual int32 GetBlockBufferAlignment() { return(BYTES_PER_FILE_BLOCK); }
+    virtual CJobQueue *GetCompletionJobQueue();
 
     // CDebugObject
     virtual ErrVal CheckState();
 
-#if USE_LINUX_AIO
-    void WakeWorkerThread(CIOBuffer *pIOBuffer);
-    void RunWorkerThread();
+#if USE_IO_URING
+    void UringThread();
 #endif
 
 private:
     friend class CFileBlockIO;
+    friend class CFileBlockCache;
+    friend ErrVal SetFileBlockCacheSize(int32 maxNumBlocks);
+    friend void GetFileBlockCacheStats(int64 *pNumHits, int64 *pNumMisses);
+    friend ErrVal SetFilePreallocation(int32 minChunkBytes, int32 maxChunkBytes);
+#if INCLUDE_REGRESSION_TESTS
+    friend ErrVal RestartFileIOSystem(const CFileIOTestSettings *pSettings);
+#endif
 
     ErrVal InitFileIOSystem();
+    ErrVal OpenSimpleFile(CSimpleFile *pFile, const char *pPath, int32 *pOptions);
+    ErrVal JoinSyncGroup(CFileBlockIO *pBlockIO);
+    void LeaveSyncGroup(CFileBlockIO *pBlockIO);
+
+    CFileBlockCache m_BlockCache;
+
+    CQueueList<CFileSyncGroup> m_SyncGroups;
+    int32           m_GroupCommitWindowInMicroSecs;
+
+    int32           m_MinPreallocationBytes;
+    int32           m_MaxPreallocationBytes;
+
+    // This is NULL if files use the main job queue.
+    CJobQueue       *m_pCompletionJobQueue;
 
 #if WIN32
     HANDLE          m_hIOCompletionThread;
 #endif
 
-#if USE_LINUX_AIO
+#if USE_IO_URING
+    bool            m_fUseIOUring;
     bool            m_fShutdown;
 
-    CQueueList<CIOBuffer> m_FinishedIOList;
-    CRefEvent       *m_pIOEventSignal;
-    CSimpleThread   *m_pWorkerThread;
+    CIOUring        *m_pIOUring;
+    CSimpleThread   *m_pUringThread;
+    CRefEvent       *m_pUringThreadStopped;
+#endif
+
+#if INCLUDE_REGRESSION_TESTS
+    // These override the config file. See RestartFileIOSystem.
+    CFileIOTestSettings m_TestSettings;
 #endif
 
     enum CFileIOSystemPrivateConstants  {
         BYTES_PER_FILE_BLOCK        = 4096,
         OFFSET_INTO_FILE_BLOCK_MASK = BYTES_PER_FILE_BLOCK - 1,
-        START_BLOCK_MASK            = ~OFFSET_INTO_FILE_BLOCK_MASK
+        START_BLOCK_MASK            = ~OFFSET_INTO_FILE_BLOCK_MASK,
+
+        IO_URING_NUM_ENTRIES        = 1024,
+
+        // This is the most buffers that one pwritev writes.
+        MAX_WRITE_CHAIN_BUFFERS     = 64,
+
+        DEFAULT_MAX_PREALLOCATION_BYTES = 64 * 1024 * 1024,
+
+        // This is the most bytes that one copy_file_range copies.
+        MAX_COPY_FILE_CHUNK         = 0x40000000,
+
+        // A stream covers a mapped file with one CIOBuffer, so the file
+        // must fit in an int32.
+        MAX_MAPPED_FILE_SIZE        = 0x7FFFFFFF,
+
+        // This user data marks the NOP that wakes the uring thread at shutdown.
+        URING_STOP_USER_DATA        = 0
     };
 }; // CFileIOSystem
 
@@ -186,6 +436,141 @@ InitializeFileBlockIO() {
 
 
 
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SetFileBlockCacheSize]
+//
+// This overrides the size from the config file. Blocks that are already
+// open start or stop using the cache immediately.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+SetFileBlockCacheSize(int32 maxNumBlocks) {
+    ErrVal err = ENoErr;
+
+    if ((NULL == g_pFileIOSystemImpl) || (maxNumBlocks < 0)) {
+        gotoErr(EFail);
+    }
+
+    if (!(g_pFileIOSystemImpl->m_fInitialized)) {
+        err = g_pFileIOSystemImpl->InitFileIOSystem();
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    err = g_pFileIOSystemImpl->m_BlockCache.SetMaxBlocks(maxNumBlocks);
+
+abort:
+    returnErr(err);
+} // SetFileBlockCacheSize.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetFileBlockCacheStats]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+GetFileBlockCacheStats(int64 *pNumHits, int64 *pNumMisses) {
+    *pNumHits = 0;
+    *pNumMisses = 0;
+    if (NULL != g_pFileIOSystemImpl) {
+        g_pFileIOSystemImpl->m_BlockCache.GetStats(pNumHits, pNumMisses);
+    }
+} // GetFileBlockCacheStats.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SetFilePreallocation]
+//
+// This overrides the sizes from the config file.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+SetFilePreallocation(int32 minChunkBytes, int32 maxChunkBytes) {
+    ErrVal err = ENoErr;
+
+    if ((NULL == g_pFileIOSystemImpl)
+        || (minChunkBytes < 0)
+        || (maxChunkBytes < minChunkBytes)) {
+        gotoErr(EFail);
+    }
+
+    if (!(g_pFileIOSystemImpl->m_fInitialized)) {
+        err = g_pFileIOSystemImpl->InitFileIOSystem();
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    g_pFileIOSystemImpl->m_MinPreallocationBytes = minChunkBytes;
+    g_pFileIOSystemImpl->m_MaxPreallocationBytes = maxChunkBytes;
+
+abort:
+    returnErr(err);
+} // SetFilePreallocation.
+
+
+
+
+#if INCLUDE_REGRESSION_TESTS
+/////////////////////////////////////////////////////////////////////////////
+//
+// [RestartFileIOSystem]
+//
+// This stops the uring thread and the completion threads, so the next file
+// that is opened starts them again with the new settings. An open file may
+// have IO in flight on them, so this refuses to run while any are open.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+RestartFileIOSystem(const CFileIOTestSettings *pSettings) {
+    ErrVal err = ENoErr;
+
+    if (NULL == g_pFileIOSystemImpl) {
+        gotoErr(EFail);
+    }
+
+    if (g_pFileIOSystemImpl->m_fInitialized) {
+        {
+            AutoLock(g_pFileIOSystemImpl->m_pLock);
+            if (!(g_pFileIOSystemImpl->m_ActiveBlockIOs.IsEmpty())) {
+                DEBUG_LOG("RestartFileIOSystem. %d files are still open",
+                          g_pFileIOSystemImpl->m_ActiveBlockIOs.GetLength());
+                gotoErr(EFileIsBusy);
+            }
+        }
+
+        err = g_pFileIOSystemImpl->Shutdown();
+        if (err) {
+            gotoErr(err);
+        }
+#if USE_IO_URING
+        g_pFileIOSystemImpl->m_pUringThread = NULL;
+#endif
+        g_pFileIOSystemImpl->m_fInitialized = false;
+    }
+
+    if (NULL != pSettings) {
+        g_pFileIOSystemImpl->m_TestSettings = *pSettings;
+    } else {
+        g_pFileIOSystemImpl->m_TestSettings = CFileIOTestSettings();
+    }
+
+abort:
+    returnErr(err);
+} // RestartFileIOSystem.
+#endif // INCLUDE_REGRESSION_TESTS
+
+
+
+
  
 /////////////////////////////////////////////////////////////////////////////
 //
@@ -198,9 +583,18 @@ CFileBlockIO::CFileBlockIO() {
 
 #if WIN32
     m_AsynchFileHandle = INVALID_HANDLE_VALUE;
-#elif USE_LINUX_AIO
+#elif LINUX
     m_AsynchFileFD = -1;
+    m_pMappedData = NULL;
+    m_fWriteChainOpen = false;
+    m_PendingWrites.ResetQueue();
+    m_AllocatedSize = 0;
+    m_fPreallocate = false;
 #endif // WIN32
+
+    m_fHasFileIdentity = false;
+    m_fUseBlockCache = false;
+    m_pSyncGroup = NULL;
 } // CFileBlockIO
 
 
@@ -225,12 +619,24 @@ CFileBlockIO::~CFileBlockIO() {
 
         m_AsynchFileHandle = INVALID_HANDLE_VALUE;
     }
-#elif USE_LINUX_AIO
+#elif LINUX
     if (-1 != m_AsynchFileFD) {
         close(m_AsynchFileFD);
         m_AsynchFileFD = -1;
     }
+    UnmapFile();
+
+    // The code that starts a write chain always ends it, so this only
+    // happens if a client was killed in the middle of a flush.
+    while (!(m_PendingWrites.IsEmpty())) {
+        CIOBuffer *pBuffer = m_PendingWrites.RemoveHead();
+        RELEASE_OBJECT(pBuffer);
+    }
 #endif
+
+    if (NULL != m_pSyncGroup) {
+        g_pFileIOSystemImpl->LeaveSyncGroup(this);
+    }
 } // ~CFileBlockIO.
 
 
@@ -257,7 +663,8 @@ CFileBlockIO::Resize(int64 newLength) {
     DEBUG_LOG("CFileBlockIO::Resize: old size = %d, new size = %d",
                 m_MediaSize, newLength);
 
-    if (newLength < 0) {
+    // A mapped file is read-only.
+    if ((newLength < 0) || (MAPPED_FILE_MEDIA == m_MediaType)) {
         gotoErr(EFail);
     }
 
@@ -292,7 +699,7 @@ CFileBlockIO::Resize(int64 newLength) {
             DEBUG_LOG("CFileBlockIO::Resize. SetEndOfFile failed. GetLastError = %d", dwErr);
             gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
         }
-#elif USE_LINUX_AIO
+#elif LINUX
         if (-1 == m_AsynchFileFD) {
             gotoErr(EFail);
         }
@@ -307,7 +714,12 @@ CFileBlockIO::Resize(int64 newLength) {
 #endif
     } // Asynch IO
 
+    InvalidateCachedBlocks((newLength < m_MediaSize) ? newLength : m_MediaSize, -1);
     m_MediaSize = newLength;
+#if LINUX
+    // Changing the length frees any space that was reserved past the end.
+    m_AllocatedSize = newLength;
+#endif
 
 abort:
     returnErr(err);
@@ -317,6 +729,27 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetAllocatedSize]
+//
+/////////////////////////////////////////////////////////////////////////////
+int64
+CFileBlockIO::GetAllocatedSize() {
+    AutoLock(m_pLock);
+
+#if LINUX
+    if (m_AllocatedSize > m_MediaSize) {
+        return(m_AllocatedSize);
+    }
+#endif
+    return(m_MediaSize);
+} // GetAllocatedSize.
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [Close]
@@ -332,6 +765,10 @@ CFileBlockIO::Close() {
 
     DEBUG_LOG("CFileBlockIO::Close");
 
+#if LINUX
+    TrimPreallocatedSpace();
+#endif
+
     // Close in the base class.
     CAsyncBlockIO::Close();
     m_SynchFile.Close();
@@ -346,12 +783,17 @@ CFileBlockIO::Close() {
         }
         m_AsynchFileHandle = INVALID_HANDLE_VALUE;
     }
-#elif USE_LINUX_AIO
+#elif LINUX
     if (-1 != m_AsynchFileFD) {
         close(m_AsynchFileFD);
         m_AsynchFileFD = -1;
     }
+    UnmapFile();
 #endif
+
+    if (NULL != m_pSyncGroup) {
+        g_pFileIOSystemImpl->LeaveSyncGroup(this);
+    }
 } // Close
 
 
@@ -367,11 +809,31 @@ CFileBlockIO::Close() {
 ErrVal
 CFileBlockIO::Flush() {
     ErrVal err = ENoErr;
-    AutoLock(m_pLock);
+    CFileSyncGroup *pSyncGroup = NULL;
     RunChecks();
 
     DEBUG_LOG("CFileBlockIO::Flush");
 
+    // A durable flush shares its sync with any other flush of the same file.
+    // Do not hold the lock while we wait for the disk.
+    if (m_pLock) {
+        m_pLock->Lock();
+    }
+    pSyncGroup = m_pSyncGroup;
+    ADDREF_OBJECT(pSyncGroup);
+    if (m_pLock) {
+        m_pLock->Unlock();
+    }
+    if (NULL != pSyncGroup) {
+        err = pSyncGroup->SyncFile(
+                            GetFileDescriptor(),
+                            g_pFileIOSystemImpl->m_GroupCommitWindowInMicroSecs);
+        RELEASE_OBJECT(pSyncGroup);
+        returnErr(err);
+    }
+
+    AutoLock(m_pLock);
+
 #if WIN32
     if (INVALID_HANDLE_VALUE == m_AsynchFileHandle) {
         DEBUG_WARNING("File Block IO flushing a NULL handle.");
@@ -380,7 +842,10 @@ CFileBlockIO::Flush() {
     // This seems to confuse synchronous writes in WinNT.
     // fSuccess = FlushFileBuffers(m_AsynchFileHandle);
 abort:
-#elif USE_LINUX_AIO
+#elif LINUX
+    if (m_fSynchronousDevice) {
+        returnErr(ENoErr);
+    }
     if (-1 == m_AsynchFileFD) {
         DEBUG_WARNING("File Block IO flushing a NULL handle.");
         gotoErr(EFail);
@@ -422,7 +887,8 @@ CFileBlockIO::CheckState() {
         gotoErr(EFail);
     }
 
-    if ((FILE_MEDIA != m_MediaType) || (!m_fSeekable)) {
+    if (((FILE_MEDIA != m_MediaType) && (MAPPED_FILE_MEDIA != m_MediaType))
+        || (!m_fSeekable)) {
         gotoErr(EFail);
     }
 
@@ -437,121 +903,244 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [WriteBlockAsyncImpl]
+// [GetFileDescriptor]
 //
-// This method has to be overloaded if a subclass really implements
-// asynchronous I/O
+// This lets a network blockIO send bytes straight from the file.
 /////////////////////////////////////////////////////////////////////////////
-void
-CFileBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
-    ErrVal err = ENoErr;
-    int32 synchBytesWritten = 0;
-#if WIN32
-    BOOL fSuccess = FALSE;
-    LARGE_INTEGER largeInt;
-#endif // WIN32
-    RunChecks();
+int
+CFileBlockIO::GetFileDescriptor() {
+#if LINUX
+    AutoLock(m_pLock);
+
+    if (m_fSynchronousDevice) {
+        return(m_SynchFile.GetFD());
+    }
+    return(m_AsynchFileFD);
+#else
+    return(-1);
+#endif
+} // GetFileDescriptor.
 
 
-    if (NULL == pBuffer) {
-        gotoErr(EFail);
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CopyFromFile]
+//
+// This copies a range of another file into this file with copy_file_range,
+// so the bytes never enter user space. On a filesystem that supports
+// reflinks, the kernel shares the extents instead of copying them.
+//
+// This stops at the first failure and returns the bytes copied so far.
+// Files on different filesystems, or a kernel without copy_file_range,
+// fail on the first call, so the caller copies everything with buffers.
+/////////////////////////////////////////////////////////////////////////////
+int64
+CFileBlockIO::CopyFromFile(
+                    CAsyncBlockIO *pSrcBlockIO,
+                    int64 srcPos,
+                    int64 destPos,
+                    int64 numBytes) {
+#if LINUX
+    int srcFD;
+    int destFD;
+    loff_t srcOffset;
+    loff_t destOffset;
+    ssize_t result;
+    int64 numBytesCopied = 0;
+    int64 chunkSize;
+
+    if ((NULL == pSrcBlockIO)
+        || (srcPos < 0)
+        || (destPos < 0)
+        || (numBytes <= 0)) {
+        return(0);
     }
-    ADDREF_OBJECT(pBuffer);
 
-    DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl.");
+    // Get this before we take our own lock, so we never hold the locks
+    // of two blockIOs at once.
+    srcFD = pSrcBlockIO->GetFileDescriptor();
 
-    //////////////////////////////////////////
-    {
-        AutoLock(m_pLock);
+    AutoLock(m_pLock);
+    RunChecks();
 
-        // If the requested IO is too big, then we either expand the
-        // file or clip the write.
-        if (((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > m_MediaSize)
-            &&  !(m_BlockIOFlags & RESIZEABLE)) {
-            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Failed because buffer exceeds the max length of a fixed-size file.");
-            gotoErr(EFail);
-        } // handling a too-big IO.
+    destFD = GetFileDescriptor();
+    if ((FILE_MEDIA != m_MediaType) || (srcFD < 0) || (destFD < 0)) {
+        return(0);
     }
-    //////////////////////////////////////////
 
-    // Handle the case of a synchronous file specially.
-    if (m_fSynchronousDevice) {
-        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write.");
-        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
-        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. pBuffer->m_NumValidBytes = %d", pBuffer->m_NumValidBytes);
+    // Any writes held for a chain must reach the file before the kernel
+    // copies over them.
+    if (m_fWriteChainOpen) {
+        return(0);
+    }
 
-        err = m_SynchFile.Seek(pBuffer->m_PosInMedia);
-        if (err) {
-            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write seek failed.");
-            gotoErr(err);
+    srcOffset = srcPos;
+    destOffset = destPos;
+    while (numBytesCopied < numBytes) {
+        chunkSize = numBytes - numBytesCopied;
+        if (chunkSize > CFileIOSystem::MAX_COPY_FILE_CHUNK) {
+            chunkSize = CFileIOSystem::MAX_COPY_FILE_CHUNK;
         }
-        err = m_SynchFile.Write(pBuffer->m_pLogicalBuffer, pBuffer->m_NumValidBytes);
-        if (err) {
-            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write failed.");
-            gotoErr(err);
+
+        result = copy_file_range(srcFD, &srcOffset, destFD, &destOffset, (size_t) chunkSize, 0);
+        if ((result < 0) && (EINTR == errno)) {
+            continue;
+        }
+        if (result <= 0) {
+            DEBUG_LOG("CFileBlockIO::CopyFromFile. copy_file_range stopped. result = %d, errno = %d",
+                        (int32) result, errno);
+            break;
         }
-        synchBytesWritten = pBuffer->m_NumValidBytes;
-    } else
-    {
-#if WIN32
-        largeInt.QuadPart = pBuffer->m_PosInMedia;
-        pBuffer->m_NTOverlappedIOInfo.Internal = 0;
-        pBuffer->m_NTOverlappedIOInfo.InternalHigh = 0;
-        pBuffer->m_NTOverlappedIOInfo.Offset = largeInt.LowPart;
-        pBuffer->m_NTOverlappedIOInfo.OffsetHigh = largeInt.HighPart;
-        pBuffer->m_NTOverlappedIOInfo.hEvent = NULL;
 
-        fSuccess = WriteFile(
-                        m_AsynchFileHandle,
-                        pBuffer->m_pLogicalBuffer,
-                        pBuffer->m_NumValidBytes,
-                        &(pBuffer->m_dwNumBytesTransferred),
-                        &(pBuffer->m_NTOverlappedIOInfo));
-        if (!fSuccess) {
-            DWORD dwError = GetLastError();
-            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. WriteFile failed. dwError = %d", dwError);
-            if (ERROR_IO_PENDING == dwError) {
-                // Ignore this; it is not a real error.
-            }
-            else {
-                gotoErr(TranslateWin32ErrorIntoErrVal(dwError, true));
-            }
+        numBytesCopied += result;
+    } // while (numBytesCopied < numBytes)
+
+    if (numBytesCopied > 0) {
+        InvalidateCachedBlocks(destPos, destPos + numBytesCopied);
+        if ((destPos + numBytesCopied) > m_MediaSize) {
+            m_MediaSize = destPos + numBytesCopied;
+        }
+        // The copy may have grown the file past any space we reserved.
+        if (m_AllocatedSize < m_MediaSize) {
+            m_AllocatedSize = m_MediaSize;
         }
-#elif USE_LINUX_AIO
-        memset(&(pBuffer->m_AIORequest), '\0', sizeof(struct aiocb));
-        pBuffer->m_AIORequest.aio_fildes = m_AsynchFileFD;
-        pBuffer->m_AIORequest.aio_buf = pBuffer->m_pLogicalBuffer;
-        pBuffer->m_AIORequest.aio_nbytes = pBuffer->m_NumValidBytes;
-        pBuffer->m_AIORequest.aio_offset = pBuffer->m_PosInMedia;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_signo = SIG_AIO_IO_COMPLETE;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_value.sival_ptr = (void *) &(pBuffer->m_AIORequest);
-        aio_write(&(pBuffer->m_AIORequest));
+    }
+
+    return(numBytesCopied);
+#else
+    UNUSED_PARAM(pSrcBlockIO);
+    UNUSED_PARAM(srcPos);
+    UNUSED_PARAM(destPos);
+    UNUSED_PARAM(numBytes);
+
+    return(0);
 #endif
-    } // Asynch case
+} // CopyFromFile.
 
-    if (m_pLock) {
-        m_pLock->Lock();
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetMappedData]
+//
+/////////////////////////////////////////////////////////////////////////////
+char *
+CFileBlockIO::GetMappedData() {
+#if LINUX
+    AutoLock(m_pLock);
+    return(m_pMappedData);
+#else
+    return(NULL);
+#endif
+} // GetMappedData.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetSharedBlock]
+//
+// This returns a new slice of the cached block that holds pos. The slice
+// keeps the cached block alive after the cache drops it.
+/////////////////////////////////////////////////////////////////////////////
+CIOBuffer *
+CFileBlockIO::GetSharedBlock(int64 pos) {
+    CIOBuffer *pCachedBuffer;
+    CIOBuffer *pSlice = NULL;
+
+    if ((!m_fUseBlockCache) || (pos < 0)) {
+        return(NULL);
     }
 
-    if ((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > m_MediaSize) {
-        m_MediaSize = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
+    pCachedBuffer = g_pFileIOSystemImpl->m_BlockCache.GetBlock(
+                                                    &m_FileIdentity,
+                                                    pos & CFileIOSystem::START_BLOCK_MASK);
+    if (NULL == pCachedBuffer) {
+        return(NULL);
     }
 
-    if (m_pLock) {
-        m_pLock->Unlock();
+    if (pos < (pCachedBuffer->m_PosInMedia + pCachedBuffer->m_NumValidBytes)) {
+        pSlice = g_pFileIOSystemImpl->AllocBufferSlice(
+                                            pCachedBuffer,
+                                            0,
+                                            pCachedBuffer->m_NumValidBytes);
     }
+    RELEASE_OBJECT(pCachedBuffer);
 
-abort:
-    DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl finished.");
+    return(pSlice);
+} // GetSharedBlock.
 
-    // If this was synchronous, then report that we are done.
-    if ((m_fSynchronousDevice) || (err)) {
-        FinishIO(pBuffer, err, synchBytesWritten);
-        RELEASE_OBJECT(pBuffer);
+
+
+
+
+#if LINUX
+/////////////////////////////////////////////////////////////////////////////
+//
+// [MapFile]
+//
+// This is called when the file is opened. If the caller asked for it, it
+// maps a read-only file into memory and makes this MAPPED_FILE_MEDIA.
+// Files that cannot be mapped, like empty files or very large files, are
+// quietly left as normal FILE_MEDIA.
+//
+// It also passes the access hints to the OS, so the OS can read ahead
+// aggressively or not at all.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockIO::MapFile(int32 options) {
+    int fd;
+    int mapAdvice = MADV_NORMAL;
+    int fileAdvice = POSIX_FADV_NORMAL;
+    void *pMapping;
+    AutoLock(m_pLock);
+
+    fd = GetFileDescriptor();
+    if (fd < 0) {
+        returnErr(ENoErr);
+    }
+
+    if (options & CAsyncBlockIO::SEQUENTIAL_ACCESS) {
+        mapAdvice = MADV_SEQUENTIAL;
+        fileAdvice = POSIX_FADV_SEQUENTIAL;
+    } else if (options & CAsyncBlockIO::RANDOM_ACCESS) {
+        mapAdvice = MADV_RANDOM;
+        fileAdvice = POSIX_FADV_RANDOM;
+    }
+
+    if ((options & CAsyncBlockIO::USE_MEMORY_MAP)
+        && !(options & CAsyncBlockIO::WRITE_ACCESS)
+        && !(options & CAsyncBlockIO::CREATE_NEW_STORE)
+        && (m_MediaSize > 0)
+        && (m_MediaSize <= CFileIOSystem::MAX_MAPPED_FILE_SIZE)) {
+        pMapping = mmap(NULL, (size_t) m_MediaSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != pMapping) {
+            if (MADV_NORMAL != mapAdvice) {
+                (void) madvise(pMapping, (size_t) m_MediaSize, mapAdvice);
+            }
+            m_pMappedData = (char *) pMapping;
+            m_MediaType = MAPPED_FILE_MEDIA;
+            returnErr(ENoErr);
+        }
+        DEBUG_LOG("CFileBlockIO::MapFile. mmap failed. errno = %d", errno);
+    }
+
+    if (POSIX_FADV_NORMAL != fileAdvice) {
+        (void) posix_fadvise(fd, 0, 0, fileAdvice);
     }
-} // WriteBlockAsyncImpl.
 
+    returnErr(ENoErr);
+} // MapFile.
 
 
 
@@ -559,120 +1148,1785 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [ReadBlockAsyncImpl]
+// [UnmapFile]
 //
-// This method has to be overloaded if a subclass really implements
-// asynchronous I/O
 /////////////////////////////////////////////////////////////////////////////
 void
-CFileBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
-    ErrVal err = ENoErr;
-    int32 actualIOSize = 0;
-    int32 synchBytesRead = 0;
-#if WIN32
-    BOOL fSuccess = FALSE;
-    LARGE_INTEGER largeInt;
-#endif // WIN32
-    RunChecks();
+CFileBlockIO::UnmapFile() {
+    if (NULL != m_pMappedData) {
+        munmap(m_pMappedData, (size_t) m_MediaSize);
+        m_pMappedData = NULL;
+    }
+} // UnmapFile.
 
-    if (NULL == pBuffer) {
-        return;
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [QueueChainedWrite]
+//
+// This returns true if the write will be done by EndWriteChain. The
+// caller's reference to the buffer is passed to m_PendingWrites.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CFileBlockIO::QueueChainedWrite(CIOBuffer *pBuffer) {
+    AutoLock(m_pLock);
+
+    if ((!m_fSynchronousDevice)
+        || (!m_fWriteChainOpen)
+        || (m_BlockIOFlags & USE_DIRECT_IO)) {
+        return(false);
     }
-    ADDREF_OBJECT(pBuffer);
 
-    DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl()");
+    m_PendingWrites.InsertTail(&(pBuffer->m_BlockIOBufferList));
+    return(true);
+} // QueueChainedWrite.
 
-    { ///////////////////////////////////////////////////
-        AutoLock(m_pLock);
 
-        // If the requested IO is too big, then we clip it.
-        actualIOSize = pBuffer->m_BufferSize;
-        if ((pBuffer->m_PosInMedia + actualIOSize) > m_MediaSize) {
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Clipping IO to file size.");
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. m_MediaSize = " ERRFMT, m_MediaSize);
 
-            actualIOSize = (int32) (m_MediaSize - pBuffer->m_PosInMedia);
-            if (actualIOSize <= 0) {
-                gotoErr(EEOF);
-            }
 
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. actualIOSize = %d", actualIOSize);
-        } // handling a too-big I/O.
-    } ///////////////////////////////////////////////////
 
-    // Handle the case of a synchronous file specially.
-    if (m_fSynchronousDevice) {
-        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Synchronous write.");
-        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
-        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_NumValidBytes = %d", pBuffer->m_NumValidBytes);
 
-        err = m_SynchFile.Seek(pBuffer->m_PosInMedia);
-        if (err) {
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Synchronous seek failed.");
-            gotoErr(err);
-        }
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WriteChainedBuffers]
+//
+// This sorts the writes that were held by a chain, and writes each run of
+// buffers that are next to each other in the file with one pwritev. Every
+// buffer then completes individually.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::WriteChainedBuffers() {
+    ErrVal err = ENoErr;
+    CIOBuffer **pBufferList = NULL;
+    CIOBuffer *pBuffer;
+    CIOBuffer *pPrevBuffer;
+    int32 numBuffers = 0;
+    int32 index;
+    int32 runStart;
+    int32 runLength;
 
-        err = m_SynchFile.Read(
-                            pBuffer->m_pLogicalBuffer,
-                            actualIOSize,
-                            &synchBytesRead);
-        if (err) {
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Read seek failed.");
-            gotoErr(err);
+    if (m_pLock) {
+        m_pLock->Lock();
+    }
+    if (!(m_PendingWrites.IsEmpty())) {
+        pBufferList = (CIOBuffer **) memAlloc(sizeof(CIOBuffer *) * m_PendingWrites.GetLength());
+    }
+    // If we cannot allocate the list, then write the buffers one at a time
+    // in the order they were issued.
+    while ((NULL != pBufferList) && !(m_PendingWrites.IsEmpty())) {
+        pBuffer = m_PendingWrites.RemoveHead();
+
+        // Keep the list sorted by position. A buffer never moves in front
+        // of a buffer that it overlaps, so an overlapping write still
+        // lands after the writes that were issued before it.
+        index = numBuffers;
+        while (index > 0) {
+            pPrevBuffer = pBufferList[index - 1];
+            if ((pPrevBuffer->m_PosInMedia <= pBuffer->m_PosInMedia)
+                || ((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > pPrevBuffer->m_PosInMedia)) {
+                break;
+            }
+            pBufferList[index] = pPrevBuffer;
+            index--;
         }
-    } else
-    {
-#if WIN32
-        largeInt.QuadPart = pBuffer->m_PosInMedia;
-        pBuffer->m_NTOverlappedIOInfo.Internal = 0;
-        pBuffer->m_NTOverlappedIOInfo.InternalHigh = 0;
-        pBuffer->m_NTOverlappedIOInfo.Offset = largeInt.LowPart;
-        pBuffer->m_NTOverlappedIOInfo.OffsetHigh = largeInt.HighPart;
-        pBuffer->m_NTOverlappedIOInfo.hEvent = NULL;
+        pBufferList[index] = pBuffer;
+        numBuffers++;
+    }
+    if (m_pLock) {
+        m_pLock->Unlock();
+    }
 
-        fSuccess = ReadFile(
-                        m_AsynchFileHandle,
-                        pBuffer->m_pLogicalBuffer,
-                        actualIOSize,
-                        &(pBuffer->m_dwNumBytesTransferred),
-                        &(pBuffer->m_NTOverlappedIOInfo));
-        if (!fSuccess) {
-            DWORD dwError = GetLastError();
-            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. ReadFile failed. dwError = %d", dwError);
-            if (ERROR_HANDLE_EOF == dwError) {
-                gotoErr(EEOF);
+    runStart = 0;
+    while (1) {
+        if (NULL == pBufferList) {
+            if (m_pLock) {
+                m_pLock->Lock();
             }
-            else if (ERROR_IO_PENDING == dwError) {
-                // Ignore this; it is not a real error.
+            pBuffer = m_PendingWrites.RemoveHead();
+            if (m_pLock) {
+                m_pLock->Unlock();
             }
-            else {
-                gotoErr(TranslateWin32ErrorIntoErrVal(dwError, true));
+            if (NULL == pBuffer) {
+                break;
             }
+            err = WriteGatheredBuffers(&pBuffer, 1);
+            runLength = 1;
+        } else {
+            if (runStart >= numBuffers) {
+                break;
+            }
+            runLength = 1;
+            while (((runStart + runLength) < numBuffers)
+                    && (runLength < CFileIOSystem::MAX_WRITE_CHAIN_BUFFERS)
+                    && (pBufferList[runStart + runLength]->m_PosInMedia
+                            == (pBufferList[runStart + runLength - 1]->m_PosInMedia
+                                    + pBufferList[runStart + runLength - 1]->m_NumValidBytes))) {
+                runLength++;
+            }
+            err = WriteGatheredBuffers(&(pBufferList[runStart]), runLength);
         }
-#elif USE_LINUX_AIO
-        memset(&(pBuffer->m_AIORequest), '\0', sizeof(struct aiocb));
-        pBuffer->m_AIORequest.aio_fildes = m_AsynchFileFD;
-        pBuffer->m_AIORequest.aio_buf = pBuffer->m_pLogicalBuffer;
-        pBuffer->m_AIORequest.aio_nbytes = pBuffer->m_NumValidBytes;
-        pBuffer->m_AIORequest.aio_offset = pBuffer->m_PosInMedia;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_signo = SIG_AIO_IO_COMPLETE;
-        pBuffer->m_AIORequest.aio_sigevent.sigev_value.sival_ptr = (void *) &(pBuffer->m_AIORequest);
-        aio_read(&(pBuffer->m_AIORequest));
-#endif
-    } // Asynch
+
+        for (index = 0; index < runLength; index++) {
+            if (NULL != pBufferList) {
+                pBuffer = pBufferList[runStart + index];
+            }
+
+            if (!err) {
+                InvalidateCachedBlocks(
+                            pBuffer->m_PosInMedia,
+                            pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes);
+
+                if (m_pLock) {
+                    m_pLock->Lock();
+                }
+                if ((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > m_MediaSize) {
+                    m_MediaSize = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
+                }
+                if (m_pLock) {
+                    m_pLock->Unlock();
+                }
+            }
+
+            FinishIO(pBuffer, err, err ? 0 : pBuffer->m_NumValidBytes);
+            RELEASE_OBJECT(pBuffer);
+        }
+        runStart += runLength;
+    } // while (1)
+
+    memFree(pBufferList);
+} // WriteChainedBuffers.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WriteGatheredBuffers]
+//
+// The buffers must be next to each other in the file.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockIO::WriteGatheredBuffers(CIOBuffer **pBufferList, int32 numBuffers) {
+    ErrVal err = ENoErr;
+    struct iovec ioVecList[CFileIOSystem::MAX_WRITE_CHAIN_BUFFERS];
+    int32 firstIOVec = 0;
+    int64 pos;
+    ssize_t result = 0;
+    int fd;
+    int32 index;
+
+    fd = m_SynchFile.GetFD();
+    if ((fd < 0) || (numBuffers > CFileIOSystem::MAX_WRITE_CHAIN_BUFFERS)) {
+        gotoErr(EFail);
+    }
+
+    for (index = 0; index < numBuffers; index++) {
+        ioVecList[index].iov_base = pBufferList[index]->m_pLogicalBuffer;
+        ioVecList[index].iov_len = pBufferList[index]->m_NumValidBytes;
+    }
+    pos = pBufferList[0]->m_PosInMedia;
+
+    DEBUG_LOG("CFileBlockIO::WriteGatheredBuffers. Write %d buffers at " INT64FMT,
+                numBuffers, pos);
+
+    // The kernel may write only part of the list.
+    while (1) {
+        while ((firstIOVec < numBuffers)
+                && (result >= (ssize_t) (ioVecList[firstIOVec].iov_len))) {
+            result = result - ioVecList[firstIOVec].iov_len;
+            firstIOVec++;
+        }
+        if (firstIOVec >= numBuffers) {
+            break;
+        }
+        ioVecList[firstIOVec].iov_base = ((char *) ioVecList[firstIOVec].iov_base) + result;
+        ioVecList[firstIOVec].iov_len = ioVecList[firstIOVec].iov_len - result;
+
+        result = pwritev(fd, &(ioVecList[firstIOVec]), numBuffers - firstIOVec, pos);
+        if ((result < 0) && (EINTR == errno)) {
+            result = 0;
+            continue;
+        }
+        if (result <= 0) {
+            DEBUG_LOG("CFileBlockIO::WriteGatheredBuffers. pwritev failed. errno = %d", errno);
+            gotoErr(EFail);
+        }
+        pos += result;
+    } // while (1)
 
 abort:
-    DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl finished.");
+    returnErr(err);
+} // WriteGatheredBuffers.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [PreallocateSpace]
+//
+// This is called before a write that may extend the file. If the write
+// reaches the end of the reserved space, then reserve a new chunk as large
+// as the file already is, so a file that grows to N bytes is extended about
+// log(N) times. The reserved space does not change the file length.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::PreallocateSpace(int64 endPos) {
+    int64 allocatedSize;
+    int64 chunkSize;
+    int64 newAllocatedSize;
+    int fd;
+    AutoLock(m_pLock);
+
+    allocatedSize = m_AllocatedSize;
+    if (m_MediaSize > allocatedSize) {
+        allocatedSize = m_MediaSize;
+    }
+    if ((!m_fPreallocate) || (endPos < allocatedSize)) {
+        return;
+    }
+
+    chunkSize = allocatedSize;
+    if (chunkSize < g_pFileIOSystemImpl->m_MinPreallocationBytes) {
+        chunkSize = g_pFileIOSystemImpl->m_MinPreallocationBytes;
+    }
+    if (chunkSize > g_pFileIOSystemImpl->m_MaxPreallocationBytes) {
+        chunkSize = g_pFileIOSystemImpl->m_MaxPreallocationBytes;
+    }
+    newAllocatedSize = (endPos + chunkSize + CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)
+                            & CFileIOSystem::START_BLOCK_MASK;
+
+    fd = m_AsynchFileFD;
+    if (m_fSynchronousDevice) {
+        fd = m_SynchFile.GetFD();
+    }
+    if (-1 == fd) {
+        return;
+    }
+
+    if (fallocate(
+            fd,
+            FALLOC_FL_KEEP_SIZE,
+            allocatedSize,
+            newAllocatedSize - allocatedSize) < 0) {
+        // Some file systems cannot do this, so just let the writes
+        // extend the file.
+        DEBUG_LOG("CFileBlockIO::PreallocateSpace. fallocate failed. errno = %d", errno);
+        m_fPreallocate = false;
+        return;
+    }
+
+    m_AllocatedSize = newAllocatedSize;
+} // PreallocateSpace.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TrimPreallocatedSpace]
+//
+// This frees any reserved space past the end of the file. Setting the
+// length of a file to its own length releases the blocks past the end.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::TrimPreallocatedSpace() {
+    int fd;
+    AutoLock(m_pLock);
+
+    if (m_AllocatedSize <= m_MediaSize) {
+        return;
+    }
+
+    fd = m_AsynchFileFD;
+    if (m_fSynchronousDevice) {
+        fd = m_SynchFile.GetFD();
+    }
+    if ((-1 != fd) && (ftruncate(fd, m_MediaSize) < 0)) {
+        DEBUG_LOG("CFileBlockIO::TrimPreallocatedSpace. ftruncate failed. errno = %d", errno);
+    }
+
+    m_AllocatedSize = m_MediaSize;
+} // TrimPreallocatedSpace.
+#endif // LINUX
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InitBlockCache]
+//
+// This is called when the file is opened, and records which version of
+// which file this is. Mapped files and unbuffered files never read through
+// the block cache, and asynchronous reads do not either.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::InitBlockCache(int32 options) {
+#if LINUX
+    struct stat statInfo;
+    int fd;
+    AutoLock(m_pLock);
+
+    fd = GetFileDescriptor();
+    if ((fd < 0) || (fstat(fd, &statInfo) < 0)) {
+        return;
+    }
+
+    m_FileIdentity.m_Device = (uint64) statInfo.st_dev;
+    m_FileIdentity.m_Inode = (uint64) statInfo.st_ino;
+    m_FileIdentity.m_ModifyTime = ((int64) statInfo.st_mtim.tv_sec * 1000000000)
+                                        + statInfo.st_mtim.tv_nsec;
+    m_FileIdentity.m_FileSize = (int64) statInfo.st_size;
+    m_fHasFileIdentity = true;
+
+    m_fUseBlockCache = (m_fSynchronousDevice)
+                            && !(m_BlockIOFlags & USE_DIRECT_IO)
+                            && (MAPPED_FILE_MEDIA != m_MediaType);
+
+    // Opening a new store may have truncated the file.
+    if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
+        InvalidateCachedBlocks(0, -1);
+    }
+#else
+    options = options;
+#endif
+} // InitBlockCache.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReadCachedBlocks]
+//
+// This copies as many whole blocks as it can from the start of the IO out
+// of the block cache, and returns the number of bytes it copied.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CFileBlockIO::ReadCachedBlocks(CIOBuffer *pBuffer, int32 numBytes) {
+    if ((!m_fUseBlockCache)
+        || (pBuffer->m_PosInMedia & CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)) {
+        return(0);
+    }
+
+    return(g_pFileIOSystemImpl->m_BlockCache.ReadBlocks(
+                                                &m_FileIdentity,
+                                                pBuffer->m_PosInMedia,
+                                                pBuffer->m_pLogicalBuffer,
+                                                numBytes));
+} // ReadCachedBlocks.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InvalidateCachedBlocks]
+//
+// A stopPos of -1 means the end of the file.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::InvalidateCachedBlocks(int64 startPos, int64 stopPos) {
+    if (m_fHasFileIdentity) {
+        g_pFileIOSystemImpl->m_BlockCache.Invalidate(&m_FileIdentity, startPos, stopPos);
+    }
+} // InvalidateCachedBlocks.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [StartWriteChain]
+//
+// With io_uring, the writes in a chain are put in the ring and then passed
+// to the kernel together at EndWriteChain. Synchronous writes are held
+// until EndWriteChain, so buffers that are next to each other in the file
+// are written with one system call.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::StartWriteChain() {
+#if LINUX
+    AutoLock(m_pLock);
+
+    if (!(m_BlockIOFlags & USE_DIRECT_IO)) {
+        m_fWriteChainOpen = true;
+    }
+#endif
+} // StartWriteChain.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [EndWriteChain]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::EndWriteChain() {
+#if LINUX
+    ErrVal err = ENoErr;
+    bool fSubmit = false;
+
+    if (m_pLock) {
+        m_pLock->Lock();
+    }
+    fSubmit = m_fWriteChainOpen;
+    m_fWriteChainOpen = false;
+    if (m_pLock) {
+        m_pLock->Unlock();
+    }
+
+    if (m_fSynchronousDevice) {
+        WriteChainedBuffers();
+    } else if ((fSubmit) && (NULL != g_pFileIOSystemImpl->m_pIOUring)) {
+        err = g_pFileIOSystemImpl->m_pIOUring->SubmitQueuedSQEs();
+        if (err) {
+            DEBUG_LOG("CFileBlockIO::EndWriteChain. SubmitQueuedSQEs failed. err = %d", err);
+        }
+    }
+#endif
+} // EndWriteChain.
+
+
+
+
+
+
+#if LINUX
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckDirectIOBuffer]
+//
+// Unbuffered IO fails unless both the memory and the file position are
+// aligned. Buffers from AllocIOBuffer and positions from GetIOStartPosition
+// always are, so this only catches callers that bring their own memory.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockIO::CheckDirectIOBuffer(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+
+    if ((((uint64) (pBuffer->m_pLogicalBuffer)) & CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)
+        || (pBuffer->m_PosInMedia & CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)) {
+        DEBUG_LOG("CFileBlockIO::CheckDirectIOBuffer. Unaligned buffer. pBuffer->m_PosInMedia = " INT64FMT,
+                  pBuffer->m_PosInMedia);
+        gotoErr(EFail);
+    }
+
+abort:
+    returnErr(err);
+} // CheckDirectIOBuffer.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WriteDirectIOTail]
+//
+// Write a buffer that ends in the middle of a block. Unbuffered IO can only
+// write whole blocks, so pad the buffer with zeros, write the whole block,
+// and then trim the file back to its real length. This is only safe at the
+// end of the file, where the padding does not cover any real data.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockIO::WriteDirectIOTail(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+    int fd;
+    int32 paddedSize;
+    int32 bufferRoom;
+    int64 newLength;
+    ssize_t result;
+    AutoLock(m_pLock);
+
+    fd = m_AsynchFileFD;
+    if (m_fSynchronousDevice) {
+        fd = m_SynchFile.GetFD();
+    }
+    if (-1 == fd) {
+        gotoErr(EFail);
+    }
+
+    newLength = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
+    if (newLength < m_MediaSize) {
+        DEBUG_LOG("CFileBlockIO::WriteDirectIOTail. Cannot write part of a block before the end of the file.");
+        gotoErr(EFail);
+    }
+
+    paddedSize = (pBuffer->m_NumValidBytes + CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)
+                    & CFileIOSystem::START_BLOCK_MASK;
+    bufferRoom = pBuffer->m_BufferSize
+                    - (int32) (pBuffer->m_pLogicalBuffer - pBuffer->m_pPhysicalBuffer);
+    if (paddedSize > bufferRoom) {
+        DEBUG_LOG("CFileBlockIO::WriteDirectIOTail. The buffer cannot hold a whole block.");
+        gotoErr(EFail);
+    }
+    memset(
+        pBuffer->m_pLogicalBuffer + pBuffer->m_NumValidBytes,
+        0,
+        paddedSize - pBuffer->m_NumValidBytes);
+
+    while (1) {
+        result = pwrite(fd, pBuffer->m_pLogicalBuffer, paddedSize, pBuffer->m_PosInMedia);
+        if ((result < 0) && (EINTR == errno)) {
+            continue;
+        }
+        break;
+    }
+    if (result < paddedSize) {
+        DEBUG_LOG("CFileBlockIO::WriteDirectIOTail. pwrite failed. result = %d, errno = %d",
+                  (int32) result, errno);
+        gotoErr(EFail);
+    }
+
+    if (ftruncate(fd, newLength) < 0) {
+        DEBUG_LOG("CFileBlockIO::WriteDirectIOTail. ftruncate failed. errno = %d", errno);
+        gotoErr(EFail);
+    }
+    m_AllocatedSize = newLength;
+
+abort:
+    returnErr(err);
+} // WriteDirectIOTail.
+#endif // LINUX
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WriteBlockAsyncImpl]
+//
+// This method has to be overloaded if a subclass really implements
+// asynchronous I/O
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+    int32 synchBytesWritten = 0;
+    bool fFinishedWrite = false;
+#if WIN32
+    BOOL fSuccess = FALSE;
+    LARGE_INTEGER largeInt;
+#endif // WIN32
+    RunChecks();
+
+
+    if (NULL == pBuffer) {
+        gotoErr(EFail);
+    }
+    ADDREF_OBJECT(pBuffer);
+
+    DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl.");
+
+    //////////////////////////////////////////
+    {
+        AutoLock(m_pLock);
+
+        // If the requested IO is too big, then we either expand the
+        // file or clip the write.
+        if (((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > m_MediaSize)
+            &&  !(m_BlockIOFlags & RESIZEABLE)) {
+            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Failed because buffer exceeds the max length of a fixed-size file.");
+            gotoErr(EFail);
+        } // handling a too-big IO.
+    }
+    //////////////////////////////////////////
+
+#if LINUX
+    if (m_BlockIOFlags & USE_DIRECT_IO) {
+        err = CheckDirectIOBuffer(pBuffer);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    PreallocateSpace(pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes);
+
+    // Unbuffered IO cannot write part of a block, so the last block of
+    // the file is written separately.
+    if ((m_BlockIOFlags & USE_DIRECT_IO)
+        && (pBuffer->m_NumValidBytes & CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)) {
+        err = WriteDirectIOTail(pBuffer);
+        if (err) {
+            gotoErr(err);
+        }
+        synchBytesWritten = pBuffer->m_NumValidBytes;
+        fFinishedWrite = true;
+    } else if (QueueChainedWrite(pBuffer)) {
+        // EndWriteChain finishes the write and releases the buffer.
+        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Hold the write until the chain ends.");
+        gotoErr(ENoErr);
+    } else
+#endif // LINUX
+    // Handle the case of a synchronous file specially.
+    if (m_fSynchronousDevice) {
+        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write.");
+        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
+        DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. pBuffer->m_NumValidBytes = %d", pBuffer->m_NumValidBytes);
+
+        err = m_SynchFile.Seek(pBuffer->m_PosInMedia);
+        if (err) {
+            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write seek failed.");
+            gotoErr(err);
+        }
+        err = m_SynchFile.Write(pBuffer->m_pLogicalBuffer, pBuffer->m_NumValidBytes);
+        if (err) {
+            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. Synchronous write failed.");
+            gotoErr(err);
+        }
+        synchBytesWritten = pBuffer->m_NumValidBytes;
+        fFinishedWrite = true;
+    } else
+    {
+#if WIN32
+        largeInt.QuadPart = pBuffer->m_PosInMedia;
+        pBuffer->m_NTOverlappedIOInfo.Internal = 0;
+        pBuffer->m_NTOverlappedIOInfo.InternalHigh = 0;
+        pBuffer->m_NTOverlappedIOInfo.Offset = largeInt.LowPart;
+        pBuffer->m_NTOverlappedIOInfo.OffsetHigh = largeInt.HighPart;
+        pBuffer->m_NTOverlappedIOInfo.hEvent = NULL;
+
+        fSuccess = WriteFile(
+                        m_AsynchFileHandle,
+                        pBuffer->m_pLogicalBuffer,
+                        pBuffer->m_NumValidBytes,
+                        &(pBuffer->m_dwNumBytesTransferred),
+                        &(pBuffer->m_NTOverlappedIOInfo));
+        if (!fSuccess) {
+            DWORD dwError = GetLastError();
+            DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl. WriteFile failed. dwError = %d", dwError);
+            if (ERROR_IO_PENDING == dwError) {
+                // Ignore this; it is not a real error.
+            }
+            else {
+                gotoErr(TranslateWin32ErrorIntoErrVal(dwError, true));
+            }
+        }
+#elif USE_IO_URING
+        err = PostUringIO(pBuffer, IORING_OP_WRITE, pBuffer->m_NumValidBytes);
+        if (err) {
+            gotoErr(err);
+        }
+#endif
+    } // Asynch case
+
+    // An asynchronous write invalidates the cache when it completes.
+    if (fFinishedWrite) {
+        InvalidateCachedBlocks(
+                    pBuffer->m_PosInMedia,
+                    pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes);
+    }
+
+    if (m_pLock) {
+        m_pLock->Lock();
+    }
+
+    if ((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) > m_MediaSize) {
+        m_MediaSize = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
+    }
+
+    if (m_pLock) {
+        m_pLock->Unlock();
+    }
+
+abort:
+    DEBUG_LOG("CFileBlockIO::WriteBlockAsyncImpl finished.");
+
+    // If this was synchronous, then report that we are done.
+    if ((fFinishedWrite) || (err)) {
+        FinishIO(pBuffer, err, synchBytesWritten);
+        RELEASE_OBJECT(pBuffer);
+    }
+} // WriteBlockAsyncImpl.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReadBlockAsyncImpl]
+//
+// This method has to be overloaded if a subclass really implements
+// asynchronous I/O
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+    int32 actualIOSize = 0;
+    int32 deviceIOSize = 0;
+    int32 synchBytesRead = 0;
+    int32 cachedBytes = 0;
+    int64 cacheGeneration;
+#if WIN32
+    BOOL fSuccess = FALSE;
+    LARGE_INTEGER largeInt;
+#endif // WIN32
+    RunChecks();
+
+    if (NULL == pBuffer) {
+        return;
+    }
+    ADDREF_OBJECT(pBuffer);
+
+    DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl()");
+
+    { ///////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        // If the requested IO is too big, then we clip it.
+        actualIOSize = pBuffer->m_BufferSize;
+        if ((pBuffer->m_PosInMedia + actualIOSize) > m_MediaSize) {
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Clipping IO to file size.");
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. m_MediaSize = " ERRFMT, m_MediaSize);
+
+            actualIOSize = (int32) (m_MediaSize - pBuffer->m_PosInMedia);
+            if (actualIOSize <= 0) {
+                gotoErr(EEOF);
+            }
+
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. actualIOSize = %d", actualIOSize);
+        } // handling a too-big I/O.
+    } ///////////////////////////////////////////////////
+
+    // Unbuffered IO has to read whole blocks, even at the end of the file.
+    // The kernel stops at the end of the file, and we only report the bytes
+    // that were asked for.
+    deviceIOSize = actualIOSize;
+#if LINUX
+    if (m_BlockIOFlags & USE_DIRECT_IO) {
+        err = CheckDirectIOBuffer(pBuffer);
+        if (err) {
+            gotoErr(err);
+        }
+        deviceIOSize = (actualIOSize + CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)
+                            & CFileIOSystem::START_BLOCK_MASK;
+        if (deviceIOSize > (pBuffer->m_BufferSize
+                                - (int32) (pBuffer->m_pLogicalBuffer - pBuffer->m_pPhysicalBuffer))) {
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. The buffer cannot hold a whole block.");
+            gotoErr(EFail);
+        }
+    }
+#endif // LINUX
+
+    // Handle the case of a synchronous file specially.
+    if (m_fSynchronousDevice) {
+        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Synchronous write.");
+        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_PosInMedia = " ERRFMT, pBuffer->m_PosInMedia);
+        DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. pBuffer->m_NumValidBytes = %d", pBuffer->m_NumValidBytes);
+
+        // Only the part of the IO that is not in the block cache is read
+        // from the file.
+        cachedBytes = ReadCachedBlocks(pBuffer, actualIOSize);
+        synchBytesRead = cachedBytes;
+        if (cachedBytes < actualIOSize) {
+            cacheGeneration = g_pFileIOSystemImpl->m_BlockCache.GetGeneration();
+
+            err = m_SynchFile.Seek(pBuffer->m_PosInMedia + cachedBytes);
+            if (err) {
+                DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Synchronous seek failed.");
+                gotoErr(err);
+            }
+
+            err = m_SynchFile.Read(
+                                pBuffer->m_pLogicalBuffer + cachedBytes,
+                                deviceIOSize - cachedBytes,
+                                &synchBytesRead);
+            if (err) {
+                DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. Read seek failed.");
+                gotoErr(err);
+            }
+            synchBytesRead += cachedBytes;
+            if (synchBytesRead > actualIOSize) {
+                synchBytesRead = actualIOSize;
+            }
+
+            if (m_fUseBlockCache) {
+                g_pFileIOSystemImpl->m_BlockCache.AddBlocks(
+                                            &m_FileIdentity,
+                                            pBuffer->m_PosInMedia + cachedBytes,
+                                            pBuffer->m_pLogicalBuffer + cachedBytes,
+                                            synchBytesRead - cachedBytes,
+                                            cacheGeneration);
+            }
+        }
+    } else
+    {
+#if WIN32
+        largeInt.QuadPart = pBuffer->m_PosInMedia;
+        pBuffer->m_NTOverlappedIOInfo.Internal = 0;
+        pBuffer->m_NTOverlappedIOInfo.InternalHigh = 0;
+        pBuffer->m_NTOverlappedIOInfo.Offset = largeInt.LowPart;
+        pBuffer->m_NTOverlappedIOInfo.OffsetHigh = largeInt.HighPart;
+        pBuffer->m_NTOverlappedIOInfo.hEvent = NULL;
+
+        fSuccess = ReadFile(
+                        m_AsynchFileHandle,
+                        pBuffer->m_pLogicalBuffer,
+                        actualIOSize,
+                        &(pBuffer->m_dwNumBytesTransferred),
+                        &(pBuffer->m_NTOverlappedIOInfo));
+        if (!fSuccess) {
+            DWORD dwError = GetLastError();
+            DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl. ReadFile failed. dwError = %d", dwError);
+            if (ERROR_HANDLE_EOF == dwError) {
+                gotoErr(EEOF);
+            }
+            else if (ERROR_IO_PENDING == dwError) {
+                // Ignore this; it is not a real error.
+            }
+            else {
+                gotoErr(TranslateWin32ErrorIntoErrVal(dwError, true));
+            }
+        }
+#elif USE_IO_URING
+        err = PostUringIO(pBuffer, IORING_OP_READ, deviceIOSize);
+        if (err) {
+            gotoErr(err);
+        }
+#endif
+    } // Asynch
+
+abort:
+    DEBUG_LOG("CFileBlockIO::ReadBlockAsyncImpl finished.");
+
+    // If this was synchronous, then report that we are done.
+    if ((m_fSynchronousDevice) || (err)) {
+        FinishIO(pBuffer, err, synchBytesRead);
+        RELEASE_OBJECT(pBuffer);
+    }
+} // ReadBlockAsyncImpl.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CFileIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+CFileIOSystem::CFileIOSystem() {
+    m_SyncGroups.ResetQueue();
+    m_GroupCommitWindowInMicroSecs = 0;
+    m_MinPreallocationBytes = 0;
+    m_MaxPreallocationBytes = DEFAULT_MAX_PREALLOCATION_BYTES;
+    m_pCompletionJobQueue = NULL;
+
+#if WIN32
+    m_hIOCompletionThread = NULL;
+#elif USE_IO_URING
+    m_fUseIOUring = false;
+    m_fShutdown = false;
+    m_pIOUring = NULL;
+    m_pUringThread = NULL;
+    m_pUringThreadStopped = NULL;
+#endif
+} // CFileIOSystem.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InitFileIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::InitFileIOSystem() {
+    ErrVal err = ENoErr;
+    CIOBuffer *tempBuffer = NULL;
+    int32 numCacheBlocks = 0;
+    int32 numCompletionThreads = 0;
+    int32 threadNum;
+
+    err = CIOSystem::InitIOSystem();
+    if (err) {
+        gotoErr(err);
+    }
+
+    tempBuffer = newex CIOBuffer;
+    if (NULL == tempBuffer) {
+        gotoErr(EFail);
+    }
+
+    err = m_BlockCache.Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+    if (NULL != g_pBuildingBlocksConfig) {
+        numCacheBlocks = g_pBuildingBlocksConfig->GetInt(
+                                        g_FileBlockCacheBlocksConfigValueName,
+                                        0);
+    }
+    if (numCacheBlocks > 0) {
+        err = m_BlockCache.SetMaxBlocks(numCacheBlocks);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    m_GroupCommitWindowInMicroSecs = 0;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_GroupCommitWindowInMicroSecs = g_pBuildingBlocksConfig->GetInt(
+                                                g_FileGroupCommitWindowConfigValueName,
+                                                0);
+    }
+
+    m_MinPreallocationBytes = 0;
+    m_MaxPreallocationBytes = DEFAULT_MAX_PREALLOCATION_BYTES;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_MinPreallocationBytes = g_pBuildingBlocksConfig->GetInt(
+                                                g_FilePreallocationMinBytesConfigValueName,
+                                                0);
+        m_MaxPreallocationBytes = g_pBuildingBlocksConfig->GetInt(
+                                                g_FilePreallocationMaxBytesConfigValueName,
+                                                DEFAULT_MAX_PREALLOCATION_BYTES);
+    }
+
+    // Create the completion threads before any IO can complete.
+    if (NULL != g_pBuildingBlocksConfig) {
+        numCompletionThreads = g_pBuildingBlocksConfig->GetInt(
+                                                g_FileCompletionThreadsConfigValueName,
+                                                0);
+    }
+    if (numCompletionThreads > 0) {
+        m_pCompletionJobQueue = newex CJobQueue;
+        if (NULL == m_pCompletionJobQueue) {
+            gotoErr(EFail);
+        }
+        err = m_pCompletionJobQueue->Initialize();
+        if (err) {
+            gotoErr(err);
+        }
+        for (threadNum = 0; threadNum < numCompletionThreads; threadNum++) {
+            err = m_pCompletionJobQueue->AddThread();
+            if (err) {
+                gotoErr(err);
+            }
+        }
+    }
+
+#if WIN32
+    //////////////////////////////////////////////////////////////////////
+    DWORD tid;
+
+    // Compute the offset between a buffer and the Overlapped IO object. We will
+    // pass in OVERLAPPED objects that are actually a field within the CIOBuffer
+    // struct. When Windows calls our callback, it gives us a pointer to the OVERLAPPED.
+    // This offset value will allow us to use that OVERLAPPED pointer to find the
+    // beginning of the CIOBuffer.
+    g_OffsetFromAsyncIOInfoToIOBlock
+        = ((char *) &(tempBuffer->m_NTOverlappedIOInfo)) - ((char *) tempBuffer);
+
+    // Create a new IOCompletion port.
+    g_hIOCompletionPort = CreateIoCompletionPort(
+                                INVALID_HANDLE_VALUE, // file handle to associate with the I/O completion port
+                                NULL, // handle to the I/O completion port
+                                0, // per-file completion key for I/O completion packets
+                                1); // number of threads allowed to  execute concurrently
+    if (NULL == g_hIOCompletionPort) {
+        gotoErr(EFail);
+    }
+
+    // Start up a thread to service the IOCompletion port.
+    m_hIOCompletionThread = CreateThread(
+                                NULL,
+                                0,
+                                Win32FileIOCompletionProc,
+                                (LPVOID) this,
+                                0,
+                                &tid);
+    if (NULL == m_hIOCompletionThread) {
+        gotoErr(EFail);
+    }
+#elif USE_IO_URING
+    //////////////////////////////////////////////////////////////////////
+    // io_uring is optional. If the config file asks for it but the kernel
+    // does not support it, then quietly open every file for synchronous IO.
+    m_fShutdown = false;
+    m_fUseIOUring = false;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_fUseIOUring = g_pBuildingBlocksConfig->GetBool(g_FileUseIOUringConfigValueName, false);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_UseIOUring >= 0) {
+        m_fUseIOUring = (m_TestSettings.m_UseIOUring > 0);
+    }
+#endif
+    if (m_fUseIOUring) {
+        m_pIOUring = newex CIOUring;
+        if (NULL == m_pIOUring) {
+            gotoErr(EFail);
+        }
+        err = m_pIOUring->Initialize(IO_URING_NUM_ENTRIES);
+        if (err) {
+            DEBUG_LOG("CFileIOSystem::InitFileIOSystem. Cannot create an io_uring. err = %d", err);
+            delete m_pIOUring;
+            m_pIOUring = NULL;
+            m_fUseIOUring = false;
+            err = ENoErr;
+        }
+    }
+    if (m_fUseIOUring) {
+        m_pUringThreadStopped = newex CRefEvent;
+        if (NULL == m_pUringThreadStopped) {
+            gotoErr(EFail);
+        }
+        err = m_pUringThreadStopped->Initialize();
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = CSimpleThread::CreateThread(
+                                  "fileIOUring",
+                                  FileUringThreadProc,
+                                  NULL,
+                                  &m_pUringThread);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    DEBUG_LOG("CFileIOSystem::InitFileIOSystem. m_fUseIOUring = %d", m_fUseIOUring);
+#endif
+
+abort:
+    RELEASE_OBJECT(tempBuffer);
+
+    returnErr(err);
+} // InitFileIOSystem.
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Shutdown]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::Shutdown() {
+    ErrVal err = ENoErr;
+
+    // If we never lazily initialized the IO system, then there is nothing
+    // to do.
+    if (!m_fInitialized) {
+        returnErr(ENoErr);
+    }
+
+    RunChecks();
+
+    err = CIOSystem::Shutdown();
+    if (err) {
+        gotoErr(err);
+    }
+
+    (void) m_BlockCache.SetMaxBlocks(0);
+
+#if WIN32
+    if (INVALID_HANDLE_VALUE != g_hIOCompletionPort) {
+        // Tell the worker thread to stop.
+        (void) ::PostQueuedCompletionStatus(
+                        g_hIOCompletionPort, // handle to an I/O completion port
+                        0, // value to return via GetQueuedCompletionStatus' lpNumberOfBytesTranferred
+                        0xFFFFFFFF, // value to return via GetQueuedCompletionStatus' lpCompletionKey
+                        NULL); // value to return via GetQueuedCompletionStatus' lpOverlapped
+
+        if (NULL != m_hIOCompletionThread) {
+            // Wait for the worker thread to stop
+            (void) WaitForSingleObject(m_hIOCompletionThread, INFINITE);
+            (void) CloseHandle(m_hIOCompletionThread);
+        }
+
+        (void) CloseHandle(g_hIOCompletionPort);
+        g_hIOCompletionPort = INVALID_HANDLE_VALUE;
+    }
+#endif // WIN32
+
+#if USE_IO_URING
+    // A NOP with the stop user data tells the uring thread to look
+    // at m_fShutdown.
+    m_fShutdown = true;
+    if ((NULL != m_pIOUring)
+        && (NULL != m_pUringThread)
+        && (NULL != m_pUringThreadStopped)
+        && (m_pUringThread->IsRunning())) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_NOP;
+        sqe.fd = -1;
+        sqe.user_data = URING_STOP_USER_DATA;
+        err = m_pIOUring->SubmitSQE(&sqe);
+        if (!err) {
+            m_pUringThreadStopped->Wait();
+        }
+        err = ENoErr;
+    }
+    RELEASE_OBJECT(m_pUringThreadStopped);
+    if (NULL != m_pIOUring) {
+        delete m_pIOUring;
+        m_pIOUring = NULL;
+    }
+    m_fUseIOUring = false;
+#endif // USE_IO_URING
+
+    // Nothing completes asynchronously once the completion threads above
+    // have stopped, so nothing else will use this queue.
+    if (NULL != m_pCompletionJobQueue) {
+        m_pCompletionJobQueue->Shutdown();
+        delete m_pCompletionJobQueue;
+        m_pCompletionJobQueue = NULL;
+    }
+
+abort:
+    returnErr(err);
+} // Shutdown.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetCompletionJobQueue]
+//
+/////////////////////////////////////////////////////////////////////////////
+CJobQueue *
+CFileIOSystem::GetCompletionJobQueue() {
+    if (NULL != m_pCompletionJobQueue) {
+        return(m_pCompletionJobQueue);
+    }
+    return(CIOSystem::GetCompletionJobQueue());
+} // GetCompletionJobQueue.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenSimpleFile]
+//
+// Some file systems refuse unbuffered IO. In that case, this quietly opens
+// the file through the OS cache and clears USE_DIRECT_IO in the options.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::OpenSimpleFile(CSimpleFile *pFile, const char *pPath, int32 *pOptions) {
+    ErrVal err = ENoErr;
+    int32 fileFlags = 0;
+
+    if (*pOptions & CAsyncBlockIO::USE_DIRECT_IO) {
+        fileFlags |= CSimpleFile::DIRECT_IO;
+    }
+
+    while (1) {
+        if (*pOptions & CAsyncBlockIO::CREATE_NEW_STORE) {
+            err = pFile->OpenOrCreateEmptyFile(pPath, fileFlags);
+        } else {
+            err = pFile->OpenExistingFile(pPath, fileFlags);
+        }
+        if ((err) && (fileFlags & CSimpleFile::DIRECT_IO)) {
+            DEBUG_LOG("CFileIOSystem::OpenSimpleFile. Cannot open %s for direct IO. err = %d", pPath, err);
+            fileFlags &= ~CSimpleFile::DIRECT_IO;
+            *pOptions &= ~CAsyncBlockIO::USE_DIRECT_IO;
+            continue;
+        }
+        break;
+    } // while (1)
+
+    returnErr(err);
+} // OpenSimpleFile.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [JoinSyncGroup]
+//
+// This finds the sync group for the file, or makes a new one. A file
+// without an identity has no group, and its flushes sync it alone.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::JoinSyncGroup(CFileBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    CFileSyncGroup *pSyncGroup = NULL;
+    AutoLock(m_pLock);
+
+    if (!(pBlockIO->m_fHasFileIdentity)) {
+        returnErr(ENoErr);
+    }
+
+    pSyncGroup = m_SyncGroups.GetHead();
+    while (NULL != pSyncGroup) {
+        if ((pBlockIO->m_FileIdentity.m_Device == pSyncGroup->m_Device)
+            && (pBlockIO->m_FileIdentity.m_Inode == pSyncGroup->m_Inode)) {
+            break;
+        }
+        pSyncGroup = pSyncGroup->m_SyncGroupList.GetNextInQueue();
+    }
+
+    // The list holds one reference to each group.
+    if (NULL == pSyncGroup) {
+        pSyncGroup = newex CFileSyncGroup;
+        if (NULL == pSyncGroup) {
+            gotoErr(EFail);
+        }
+        err = pSyncGroup->Initialize();
+        if (err) {
+            RELEASE_OBJECT(pSyncGroup);
+            gotoErr(err);
+        }
+        pSyncGroup->m_Device = pBlockIO->m_FileIdentity.m_Device;
+        pSyncGroup->m_Inode = pBlockIO->m_FileIdentity.m_Inode;
+        m_SyncGroups.InsertTail(&(pSyncGroup->m_SyncGroupList));
+    }
+
+    pSyncGroup->m_NumUsers++;
+    pBlockIO->m_pSyncGroup = pSyncGroup;
+    ADDREF_OBJECT(pSyncGroup);
+
+abort:
+    returnErr(err);
+} // JoinSyncGroup.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [LeaveSyncGroup]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileIOSystem::LeaveSyncGroup(CFileBlockIO *pBlockIO) {
+    CFileSyncGroup *pSyncGroup;
+    AutoLock(m_pLock);
+
+    pSyncGroup = pBlockIO->m_pSyncGroup;
+    pBlockIO->m_pSyncGroup = NULL;
+    if (NULL == pSyncGroup) {
+        return;
+    }
+
+    // Drop the list's reference when the last user leaves, and then the
+    // reference that the blockIO held.
+    pSyncGroup->m_NumUsers--;
+    if (pSyncGroup->m_NumUsers <= 0) {
+        CFileSyncGroup *pListReference = pSyncGroup;
+
+        m_SyncGroups.RemoveFromQueue(&(pSyncGroup->m_SyncGroupList));
+        RELEASE_OBJECT(pListReference);
+    }
+    RELEASE_OBJECT(pSyncGroup);
+} // LeaveSyncGroup.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::OpenBlockIO(
+                    CParsedUrl *pUrl,
+                    int32 options,
+                    CAsyncBlockIOCallback *pCallback) {
+    ErrVal err = ENoErr;
+    CFileBlockIO *pBlockIO = NULL;
+    char cSaveChar = 0;
+    char *pFilePtr = NULL;
+    char *pEndFilePtr = NULL;
+#if WIN32
+    HANDLE fh = INVALID_HANDLE_VALUE;
+    HANDLE hPort = NULL;
+    DWORD dwCreationDisposition;
+    int32 dwOpenOptions = 0;
+    int32 accessRights = 0;
+    int32 shareOptions = 0;
+    LARGE_INTEGER largeInt;
+    bool fileIsOpen = false;
+    BOOL fSuccess = FALSE;
+#endif // WIN32
+    bool fHoldingLock = false;
+    RunChecks();
+
+
+    if ((NULL == pUrl)
+        || (CParsedUrl::URL_SCHEME_FILE != pUrl->m_Scheme)
+        || (NULL == pUrl->m_pPath)
+        || (0 == pUrl->m_PathSize)) {
+        gotoErr(EFail);
+    }
+
+    // Lazily initialize the IO system when we open the first blockIO.
+    if (!m_fInitialized) {
+        err = InitFileIOSystem();
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    if (m_pLock) {
+        m_pLock->Lock();
+        fHoldingLock = true;
+    }
+
+#if LINUX
+    // A mapped file is read straight out of memory, so it never needs
+    // asynchronous or direct IO.
+    if (options & CAsyncBlockIO::USE_MEMORY_MAP) {
+        options |= CAsyncBlockIO::USE_SYNCHRONOUS_IO;
+        options &= ~CAsyncBlockIO::USE_DIRECT_IO;
+    }
+#endif
+
+#if USE_IO_URING
+    if (!m_fUseIOUring) {
+        options |= CAsyncBlockIO::USE_SYNCHRONOUS_IO;
+    }
+#endif
+
+    pBlockIO = newex CFileBlockIO;
+    if (!pBlockIO) {
+        gotoErr(EFail);
+    }
+
+
+    // Handle the case of a synchronous file specially.
+    if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO) {
+        pFilePtr = pUrl->m_pPath;
+        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
+        cSaveChar = *pEndFilePtr;
+        *pEndFilePtr = 0;
+
+        err = OpenSimpleFile(&(pBlockIO->m_SynchFile), pFilePtr, &options);
+        DEBUG_LOG("CFileBlockIO::OpenBlockIO. OpenSimpleFile for synchronous IO. Path = %s, err = %d",
+                    pFilePtr, err);
+        *pEndFilePtr = cSaveChar;
+        if (err) {
+            DEBUG_WARNING("CFileBlockIO::OpenBlockIO error. Path = %s, err = %d", pFilePtr, err);
+            gotoErr(err);
+        }
+
+        err = pBlockIO->m_SynchFile.GetFileLength((uint64 *) &(pBlockIO->m_MediaSize));
+        if (err) {
+            gotoErr(err);
+        }
+    } else { // if (!(options & CAsyncBlockIO::USE_SYNCHRONOUS_IO))
+#if WIN32
+        dwOpenOptions = FILE_FLAG_OVERLAPPED;
+        dwOpenOptions |= FILE_FLAG_WRITE_THROUGH;
+        if (options & CAsyncBlockIO::USE_DIRECT_IO) {
+            dwOpenOptions |= FILE_FLAG_NO_BUFFERING;
+        }
+        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
+            dwCreationDisposition = OPEN_ALWAYS;
+        } else {
+            dwCreationDisposition = OPEN_EXISTING;
+        }
+        if (options & CAsyncBlockIO::READ_ACCESS) {
+            accessRights |= GENERIC_READ;
+        }
+        if (options & CAsyncBlockIO::WRITE_ACCESS) {
+            accessRights |= GENERIC_WRITE;
+        }
+        shareOptions = FILE_SHARE_READ | FILE_SHARE_DELETE;
+
+
+        pFilePtr = pUrl->m_pPath;
+        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
+        cSaveChar = *pEndFilePtr;
+        *pEndFilePtr = 0;
+
+        fh = CreateFileA(
+                    pFilePtr,
+                    accessRights, // access (read-write) mode
+                    shareOptions, // share mode
+                    NULL, // pointer to security attributes
+                    dwCreationDisposition,  // how to create
+                    dwOpenOptions,  // file attributes
+                    NULL);  // handle to file with attributes to copy
+
+        DEBUG_LOG("CFileBlockIO::OpenBlockIO. OpenExistingFile for assynchronous IO. path = %s",
+                    pFilePtr);
+        *pEndFilePtr = cSaveChar;
+
+        if (INVALID_HANDLE_VALUE == fh) {
+            DWORD dwErr = GetLastError();
+            DEBUG_LOG("CFileBlockIO::OpenBlockIO. Open failed. GetLastError = %d",
+                        dwErr);
+            gotoErr(EFileNotFound);
+        }
+        fileIsOpen = true;
+
+        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
+            DWORD dwResult;
+
+            DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file");
+            dwResult = SetFilePointer(
+                            fh, // handle of file
+                            0,  // number of bytes to move file pointer
+                            NULL, // pointer to high-order word of distance
+                            CSimpleFile::SEEK_START);
+            if (0xFFFFFFFF == dwResult) {
+                DWORD dwErr = GetLastError();
+                DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file failed. GetLastError = %d", dwErr);
+                gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
+            }
+
+            fSuccess = SetEndOfFile(fh);
+            if (!fSuccess) {
+                DWORD dwErr = GetLastError();
+                DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file failed (step 2). GetLastError = %d", dwErr);
+                gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
+            }
+        }
+
+        hPort = CreateIoCompletionPort(
+                                fh, // file handle to associate with the I/O completion port
+                                g_hIOCompletionPort, // handle to the I/O completion port
+                                0, // per-file completion key for I/O completion packets
+                                1); // number of threads allowed to execute concurrently
+        if (NULL == hPort) {
+            gotoErr(EFail);
+        }
+        pBlockIO->m_AsynchFileHandle = fh;
+        fh = INVALID_HANDLE_VALUE;
+
+        fSuccess = GetFileSizeEx(pBlockIO->m_AsynchFileHandle, &largeInt);
+        if (!fSuccess) {
+            DWORD dwErr = GetLastError();
+            gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
+        }
+        pBlockIO->m_MediaSize = largeInt.QuadPart;
+#elif USE_IO_URING
+        CSimpleFile file;
+
+        pFilePtr = pUrl->m_pPath;
+        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
+        cSaveChar = *pEndFilePtr;
+        *pEndFilePtr = 0;
+
+        err = OpenSimpleFile(&file, pFilePtr, &options);
+        *pEndFilePtr = cSaveChar;
+        if (err) {
+            gotoErr(err);
+        }
+
+        err = file.GetFileLength((uint64 *) &(pBlockIO->m_MediaSize));
+        if (err) {
+            gotoErr(err);
+        }
+
+        pBlockIO->m_AsynchFileFD = file.GetFD();
+        file.ForgetFD();
+#endif
+    } // if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO)
+
+    // These are part of the base class.
+    pBlockIO->m_pIOSystem = this;
+    pBlockIO->m_MediaType = CAsyncBlockIO::FILE_MEDIA;
+    pBlockIO->m_fSeekable = true;
+
+    pBlockIO->ChangeBlockIOCallback(pCallback);
+    pBlockIO->m_ActiveBlockIOs.ResetQueue();
+
+    pBlockIO->m_BlockIOFlags = CAsyncBlockIO::RESIZEABLE;
+    if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO) {
+        pBlockIO->m_fSynchronousDevice = true;
+    }
+    if (options & CAsyncBlockIO::USE_DIRECT_IO) {
+        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::USE_DIRECT_IO;
+    }
+    // A stream on a file opened without this may share cached blocks.
+    if (options & CAsyncBlockIO::WRITE_ACCESS) {
+        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::WRITE_ACCESS;
+    }
+
+    pBlockIO->m_pUrl = pUrl;
+    ADDREF_OBJECT(pUrl);
+
+    pBlockIO->m_pLock = CRefLock::Alloc();
+    if (NULL == pBlockIO->m_pLock) {
+        gotoErr(EFail);
+    }
+
+#if LINUX
+    err = pBlockIO->MapFile(options);
+    if (err) {
+        gotoErr(err);
+    }
+#endif
+    pBlockIO->InitBlockCache(options);
+
+#if LINUX
+    pBlockIO->m_AllocatedSize = pBlockIO->m_MediaSize;
+    if ((options & CAsyncBlockIO::WRITE_ACCESS)
+        && (m_MinPreallocationBytes > 0)) {
+        pBlockIO->m_fPreallocate = true;
+    }
+#endif
+
+    if (options & CAsyncBlockIO::DURABLE_FLUSH) {
+        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::DURABLE_FLUSH;
+        err = JoinSyncGroup(pBlockIO);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+    // Add this connection to the list of active connections.
+    // This assumes that we are holding the monitor lock.
+    m_ActiveBlockIOs.InsertHead(&(pBlockIO->m_ActiveBlockIOs));
+    ADDREF_OBJECT(pBlockIO);
+
+    pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::BLOCKIO_IS_OPEN;
+
+    // Do not hold the lock when we call the callback. This
+    // can cause a deadlock.
+    if (fHoldingLock) {
+        m_pLock->Unlock();
+        fHoldingLock = false;
+    }
+
+    pCallback->OnBlockIOOpen(ENoErr, pBlockIO);
+
+abort:
+    if (fHoldingLock) {
+        m_pLock->Unlock();
+        fHoldingLock = false;
+    }
+
+    RELEASE_OBJECT(pBlockIO);
+
+#if WIN32
+    if (INVALID_HANDLE_VALUE != fh) {
+        BOOL fSuccess = CloseHandle(fh);
+        if (!fSuccess) {
+            int reason = GetLastError();
+            fSuccess = fSuccess;
+        }
+
+        fh = INVALID_HANDLE_VALUE;
+    }
+#endif // WIN32
+
+    returnErr(err);
+} // OpenBlockIO.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckState]
+//
+// This does not check checksums, because we do not know
+// if the client is currently modifying a buffer (and hence
+// the checksum would be invalid). Checksums must be explicitly
+// called by the client.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileIOSystem::CheckState() {
+    AutoLock(m_pLock);
+    returnErr(ENoErr);
+} // CheckState.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CFileBlockCache]
+//
+/////////////////////////////////////////////////////////////////////////////
+CFileBlockCache::CFileBlockCache() {
+    m_pLock = NULL;
+
+    m_pEntries = NULL;
+    m_MaxNumBlocks = 0;
+    m_NumBlocks = 0;
+    m_ClockHand = 0;
+    m_FirstFreeEntry = -1;
+
+    m_pBuckets = NULL;
+    m_NumBuckets = 0;
+
+    m_Generation = 0;
+
+    m_NumHits = 0;
+    m_NumMisses = 0;
+} // CFileBlockCache.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CFileBlockCache]
+//
+/////////////////////////////////////////////////////////////////////////////
+CFileBlockCache::~CFileBlockCache() {
+    (void) SetMaxBlocks(0);
+    RELEASE_OBJECT(m_pLock);
+} // ~CFileBlockCache.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockCache::Initialize() {
+    if (NULL == m_pLock) {
+        m_pLock = CRefLock::Alloc();
+        if (NULL == m_pLock) {
+            returnErr(EFail);
+        }
+    }
+
+    returnErr(ENoErr);
+} // Initialize.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SetMaxBlocks]
+//
+// This discards everything in the cache. A reader that is copying a block
+// out of the old cache holds a reference to it, so it is not hurt.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockCache::SetMaxBlocks(int32 maxNumBlocks) {
+    ErrVal err = ENoErr;
+    CCacheEntry *pNewEntries = NULL;
+    int32 *pNewBuckets = NULL;
+    int32 numNewBuckets = 0;
+    CCacheEntry *pOldEntries = NULL;
+    int32 *pOldBuckets = NULL;
+    int32 numOldEntries = 0;
+    int32 index;
+
+    if ((NULL == m_pLock) || (maxNumBlocks < 0)) {
+        gotoErr(EFail);
+    }
+
+    if (maxNumBlocks > 0) {
+        // Keep the hash chains short.
+        numNewBuckets = 1;
+        while ((numNewBuckets < maxNumBlocks) && (numNewBuckets < 0x40000000)) {
+            numNewBuckets = numNewBuckets * 2;
+        }
+
+        pNewEntries = (CCacheEntry *) memAlloc(sizeof(CCacheEntry) * maxNumBlocks);
+        pNewBuckets = (int32 *) memAlloc(sizeof(int32) * numNewBuckets);
+        if ((NULL == pNewEntries) || (NULL == pNewBuckets)) {
+            memFree(pNewEntries);
+            memFree(pNewBuckets);
+            gotoErr(EFail);
+        }
+
+        for (index = 0; index < maxNumBlocks; index++) {
+            pNewEntries[index].m_pBuffer = NULL;
+            pNewEntries[index].m_fReferenced = false;
+            pNewEntries[index].m_NextInBucket = index + 1;
+        }
+        pNewEntries[maxNumBlocks - 1].m_NextInBucket = -1;
+
+        for (index = 0; index < numNewBuckets; index++) {
+            pNewBuckets[index] = -1;
+        }
+    } // if (maxNumBlocks > 0)
+
+    //////////////////////////////////////////
+    {
+        AutoLock(m_pLock);
+
+        pOldEntries = m_pEntries;
+        pOldBuckets = m_pBuckets;
+        numOldEntries = m_MaxNumBlocks;
+
+        m_pEntries = pNewEntries;
+        m_MaxNumBlocks = maxNumBlocks;
+        m_NumBlocks = 0;
+        m_ClockHand = 0;
+        m_FirstFreeEntry = (maxNumBlocks > 0) ? 0 : -1;
+        m_pBuckets = pNewBuckets;
+        m_NumBuckets = numNewBuckets;
 
-    // If this was synchronous, then report that we are done.
-    if ((m_fSynchronousDevice) || (err)) {
-        FinishIO(pBuffer, err, synchBytesRead);
-        RELEASE_OBJECT(pBuffer);
+        // Readers that started with the old cache do not add to the new one.
+        m_Generation++;
     }
-} // ReadBlockAsyncImpl.
+    //////////////////////////////////////////
+
+    for (index = 0; index < numOldEntries; index++) {
+        RELEASE_OBJECT(pOldEntries[index].m_pBuffer);
+    }
+    memFree(pOldEntries);
+    memFree(pOldBuckets);
 
+abort:
+    returnErr(err);
+} // SetMaxBlocks.
 
 
 
@@ -680,19 +2934,20 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CFileIOSystem]
+// [GetGeneration]
 //
 /////////////////////////////////////////////////////////////////////////////
-CFileIOSystem::CFileIOSystem() {
-#if WIN32
-    m_hIOCompletionThread = NULL;
-#elif USE_LINUX_AIO
-    m_fShutdown = false;
-    m_pIOEventSignal = NULL;
-    m_pWorkerThread = NULL;
-#endif
-} // CFileIOSystem.
+int64
+CFileBlockCache::GetGeneration() {
+    int64 generation = 0;
+
+    if (NULL != m_pLock) {
+        AutoLock(m_pLock);
+        generation = m_Generation;
+    }
 
+    return(generation);
+} // GetGeneration.
 
 
 
@@ -700,177 +2955,247 @@ CFileIOSystem::CFileIOSystem() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [InitFileIOSystem]
+// [ReadBlocks]
 //
+// This copies blocks that start at pos until it finds one that is not in
+// the cache. It returns the number of bytes it copied. That is always a
+// whole number of blocks, unless it copied all numBytes.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CFileIOSystem::InitFileIOSystem() {
-    ErrVal err = ENoErr;
-    CIOBuffer *tempBuffer = NULL;
+int32
+CFileBlockCache::ReadBlocks(CFileIdentity *pFile, int64 pos, char *pDestPtr, int32 numBytes) {
+    int32 numBytesRead = 0;
+    int32 blockSize;
+    int32 entryNum;
+    CIOBuffer *pBuffer;
 
-    err = CIOSystem::InitIOSystem();
-    if (err) {
-        gotoErr(err);
+    if (NULL == m_pLock) {
+        return(0);
     }
 
-    tempBuffer = newex CIOBuffer;
-    if (NULL == tempBuffer) {
-        gotoErr(EFail);
-    }
+    while (numBytesRead < numBytes) {
+        blockSize = numBytes - numBytesRead;
+        if (blockSize > CFileIOSystem::BYTES_PER_FILE_BLOCK) {
+            blockSize = CFileIOSystem::BYTES_PER_FILE_BLOCK;
+        }
 
+        pBuffer = NULL;
+        m_pLock->Lock();
+        if (m_MaxNumBlocks > 0) {
+            entryNum = FindEntry(pFile, pos + numBytesRead, true);
+            if ((entryNum >= 0)
+                && (m_pEntries[entryNum].m_pBuffer->m_NumValidBytes >= blockSize)) {
+                pBuffer = m_pEntries[entryNum].m_pBuffer;
+                ADDREF_OBJECT(pBuffer);
+                m_pEntries[entryNum].m_fReferenced = true;
+                m_NumHits++;
+            } else {
+                m_NumMisses++;
+            }
+        }
+        m_pLock->Unlock();
 
-#if WIN32
-    //////////////////////////////////////////////////////////////////////
-    DWORD tid;
+        if (NULL == pBuffer) {
+            break;
+        }
 
-    // Compute the offset between a buffer and the Overlapped IO object. We will
-    // pass in OVERLAPPED objects that are actually a field within the CIOBuffer
-    // struct. When Windows calls our callback, it gives us a pointer to the OVERLAPPED.
-    // This offset value will allow us to use that OVERLAPPED pointer to find the
-    // beginning of the CIOBuffer.
-    g_OffsetFromAsyncIOInfoToIOBlock
-        = ((char *) &(tempBuffer->m_NTOverlappedIOInfo)) - ((char *) tempBuffer);
+        memcpy(pDestPtr + numBytesRead, pBuffer->m_pLogicalBuffer, blockSize);
+        RELEASE_OBJECT(pBuffer);
+        numBytesRead += blockSize;
+    } // while (numBytesRead < numBytes)
 
-    // Create a new IOCompletion port.
-    g_hIOCompletionPort = CreateIoCompletionPort(
-                                INVALID_HANDLE_VALUE, // file handle to associate with the I/O completion port
-                                NULL, // handle to the I/O completion port
-                                0, // per-file completion key for I/O completion packets
-                                1); // number of threads allowed to  execute concurrently
-    if (NULL == g_hIOCompletionPort) {
-        gotoErr(EFail);
-    }
+    return(numBytesRead);
+} // ReadBlocks.
 
-    // Start up a thread to service the IOCompletion port.
-    m_hIOCompletionThread = CreateThread(
-                                NULL,
-                                0,
-                                Win32FileIOCompletionProc,
-                                (LPVOID) this,
-                                0,
-                                &tid);
-    if (NULL == m_hIOCompletionThread) {
-        gotoErr(EFail);
-    }
-#elif USE_LINUX_AIO
-    //////////////////////////////////////////////////////////////////////
-    struct sigaction sigActionInfo;
-    int result;
 
-    // Compute the offset between a buffer and the Overlapped IO object.
-    g_OffsetFromAsyncIOInfoToIOBlock
-        = ((char *) &(tempBuffer->m_AIORequest)) - ((char *) tempBuffer);
 
-    m_fShutdown = false;
 
-    m_pIOEventSignal = newex CRefEvent;
-    if (NULL == m_pIOEventSignal) {
-        gotoErr(EFail);
-    }
-    err = m_pIOEventSignal->Initialize();
-    if (err) {
-        gotoErr(err);
-    }
 
-    // Register a function to be called when an IO signal is sent to
-    // this process. That will then signal a thread so we will transfer
-    // control to a know thread, not whatever caught the signal.
-    memset(&sigActionInfo, '\0', sizeof(struct sigaction));
-    sigActionInfo.sa_sigaction = LinuxSignalHandler;
-    sigActionInfo.sa_flags = SA_RESTART | SA_SIGINFO;
-    //sigActionInfo.sa_flags = SA_SIGINFO;
-    sigemptyset(&sigActionInfo.sa_mask);
-    sigaddset(&sigActionInfo.sa_mask, SIG_AIO_IO_COMPLETE);
-    result = sigaction(SIG_AIO_IO_COMPLETE, &sigActionInfo, NULL);
-    if (result <= -1) {
-        gotoErr(EFail);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetBlock]
+//
+// This returns the cached block that starts at pos, with a reference added
+// for the caller, or NULL if that block is not cached.
+/////////////////////////////////////////////////////////////////////////////
+CIOBuffer *
+CFileBlockCache::GetBlock(CFileIdentity *pFile, int64 pos) {
+    CIOBuffer *pBuffer = NULL;
+    int32 entryNum;
+
+    if (NULL == m_pLock) {
+        return(NULL);
     }
 
-    err = CSimpleThread::CreateThread(
-                              "fileIO",
-                              &LinuxWorkerThreadProc,
-                              NULL,
-                              &m_pWorkerThread);
-    if (err) {
-        gotoErr(err);
+    AutoLock(m_pLock);
+
+    if (m_MaxNumBlocks > 0) {
+        entryNum = FindEntry(pFile, pos, true);
+        if (entryNum >= 0) {
+            pBuffer = m_pEntries[entryNum].m_pBuffer;
+            ADDREF_OBJECT(pBuffer);
+            m_pEntries[entryNum].m_fReferenced = true;
+            m_NumHits++;
+        } else {
+            m_NumMisses++;
+        }
     }
-#endif
 
-abort:
-    RELEASE_OBJECT(tempBuffer);
+    return(pBuffer);
+} // GetBlock.
 
-    returnErr(err);
-} // InitFileIOSystem.
 
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [AddBlocks]
+//
+// This is called after data was read from the file. The data is only cached
+// if nothing was invalidated since the caller started the read.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockCache::AddBlocks(
+                    CFileIdentity *pFile,
+                    int64 pos,
+                    char *pData,
+                    int32 numBytes,
+                    int64 generation) {
+    int32 offset = 0;
+    int32 blockSize;
+    int32 entryNum;
+    int32 bucket;
+    bool fEnabled = false;
+    CIOBuffer *pBuffer;
+
+    if ((NULL == m_pLock)
+        || (pos & CFileIOSystem::OFFSET_INTO_FILE_BLOCK_MASK)) {
+        return;
+    }
+
+    m_pLock->Lock();
+    fEnabled = (m_MaxNumBlocks > 0) && (generation == m_Generation);
+    m_pLock->Unlock();
+
+    while ((fEnabled) && (offset < numBytes)) {
+        blockSize = numBytes - offset;
+        if (blockSize > CFileIOSystem::BYTES_PER_FILE_BLOCK) {
+            blockSize = CFileIOSystem::BYTES_PER_FILE_BLOCK;
+        }
+
+        pBuffer = g_pFileIOSystemImpl->AllocIOBuffer(CFileIOSystem::BYTES_PER_FILE_BLOCK, true);
+        if (NULL == pBuffer) {
+            return;
+        }
+        memcpy(pBuffer->m_pLogicalBuffer, pData + offset, blockSize);
+        pBuffer->m_NumValidBytes = blockSize;
+        pBuffer->m_PosInMedia = pos + offset;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+
+        //////////////////////////////////////////
+        {
+            AutoLock(m_pLock);
+
+            fEnabled = (m_MaxNumBlocks > 0) && (generation == m_Generation);
+            if ((fEnabled) && (FindEntry(pFile, pos + offset, true) < 0)) {
+                // New blocks start out unreferenced, so data that is only
+                // read once, like a sequential scan, is evicted first.
+                entryNum = GetFreeEntry();
+                bucket = GetBucket(pFile, pos + offset);
+
+                m_pEntries[entryNum].m_File = *pFile;
+                m_pEntries[entryNum].m_PosInMedia = pos + offset;
+                m_pEntries[entryNum].m_pBuffer = pBuffer;
+                m_pEntries[entryNum].m_fReferenced = false;
+                m_pEntries[entryNum].m_NextInBucket = m_pBuckets[bucket];
+                m_pBuckets[bucket] = entryNum;
+                m_NumBlocks++;
+                pBuffer = NULL;
+            }
+        }
+        //////////////////////////////////////////
+
+        RELEASE_OBJECT(pBuffer);
+        offset += blockSize;
+    } // while ((fEnabled) && (offset < numBytes))
+} // AddBlocks.
+
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [Shutdown]
+// [Invalidate]
 //
+// This discards the blocks of every version of a file between startPos and
+// stopPos. A stopPos of -1 means the end of the file.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CFileIOSystem::Shutdown() {
-    ErrVal err = ENoErr;
+void
+CFileBlockCache::Invalidate(CFileIdentity *pFile, int64 startPos, int64 stopPos) {
+    int64 pos;
+    int32 entryNum;
+    CCacheEntry *pEntry;
 
-    // If we never lazily initialized the IO system, then there is nothing
-    // to do.
-    if (!m_fInitialized) {
-        returnErr(ENoErr);
+    if (NULL == m_pLock) {
+        return;
     }
+    startPos = startPos & CFileIOSystem::START_BLOCK_MASK;
 
-    RunChecks();
+    AutoLock(m_pLock);
 
-    err = CIOSystem::Shutdown();
-    if (err) {
-        gotoErr(err);
+    m_Generation++;
+    if (0 == m_NumBlocks) {
+        return;
     }
 
-#if WIN32
-    if (INVALID_HANDLE_VALUE != g_hIOCompletionPort) {
-        // Tell the worker thread to stop.
-        (void) ::PostQueuedCompletionStatus(
-                        g_hIOCompletionPort, // handle to an I/O completion port
-                        0, // value to return via GetQueuedCompletionStatus' lpNumberOfBytesTranferred
-                        0xFFFFFFFF, // value to return via GetQueuedCompletionStatus' lpCompletionKey
-                        NULL); // value to return via GetQueuedCompletionStatus' lpOverlapped
-
-        if (NULL != m_hIOCompletionThread) {
-            // Wait for the worker thread to stop
-            (void) WaitForSingleObject(m_hIOCompletionThread, INFINITE);
-            (void) CloseHandle(m_hIOCompletionThread);
+    // Look up each block of a small range. Otherwise, it is faster to
+    // look at every block in the cache.
+    if ((stopPos >= 0)
+        && (((stopPos - startPos) / CFileIOSystem::BYTES_PER_FILE_BLOCK) <= m_MaxNumBlocks)) {
+        for (pos = startPos; pos < stopPos; pos += CFileIOSystem::BYTES_PER_FILE_BLOCK) {
+            while (1) {
+                entryNum = FindEntry(pFile, pos, false);
+                if (entryNum < 0) {
+                    break;
+                }
+                RemoveEntry(entryNum);
+            }
+        }
+    } else {
+        for (entryNum = 0; entryNum < m_MaxNumBlocks; entryNum++) {
+            pEntry = &(m_pEntries[entryNum]);
+            if ((NULL != pEntry->m_pBuffer)
+                && (pFile->m_Device == pEntry->m_File.m_Device)
+                && (pFile->m_Inode == pEntry->m_File.m_Inode)
+                && (pEntry->m_PosInMedia >= startPos)
+                && ((stopPos < 0) || (pEntry->m_PosInMedia < stopPos))) {
+                RemoveEntry(entryNum);
+            }
         }
-
-        (void) CloseHandle(g_hIOCompletionPort);
-        g_hIOCompletionPort = INVALID_HANDLE_VALUE;
     }
-#endif // WIN32
+} // Invalidate.
 
-#if USE_LINUX_AIO
-    m_fShutdown = true;
-    if (NULL != m_pWorkerThread) {
-       WakeWorkerThread(NULL);
-       m_pWorkerThread->WaitForThreadToStop();
-
-       delete m_pWorkerThread;
-       m_pWorkerThread = NULL;
-    }
 
-    delete m_pIOEventSignal;
-    m_pIOEventSignal = NULL;
-#endif // USE_LINUX_AIO
 
 
-abort:
-    returnErr(err);
-} // Shutdown.
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetStats]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockCache::GetStats(int64 *pNumHits, int64 *pNumMisses) {
+    *pNumHits = 0;
+    *pNumMisses = 0;
 
+    if (NULL != m_pLock) {
+        AutoLock(m_pLock);
+        *pNumHits = m_NumHits;
+        *pNumMisses = m_NumMisses;
+    }
+} // GetStats.
 
 
 
@@ -878,261 +3203,184 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [OpenBlockIO]
+// [GetBucket]
 //
+// The version of the file is not hashed, so Invalidate can find the blocks
+// of every version.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CFileIOSystem::OpenBlockIO(
-                    CParsedUrl *pUrl,
-                    int32 options,
-                    CAsyncBlockIOCallback *pCallback) {
-    ErrVal err = ENoErr;
-    CFileBlockIO *pBlockIO = NULL;
-    char cSaveChar = 0;
-    char *pFilePtr = NULL;
-    char *pEndFilePtr = NULL;
-#if WIN32
-    HANDLE fh = INVALID_HANDLE_VALUE;
-    HANDLE hPort = NULL;
-    DWORD dwCreationDisposition;
-    int32 dwOpenOptions = 0;
-    int32 accessRights = 0;
-    int32 shareOptions = 0;
-    LARGE_INTEGER largeInt;
-    bool fileIsOpen = false;
-    BOOL fSuccess = FALSE;
-#endif // WIN32
-    bool fHoldingLock = false;
-    RunChecks();
-
-
-    if ((NULL == pUrl)
-        || (CParsedUrl::URL_SCHEME_FILE != pUrl->m_Scheme)
-        || (NULL == pUrl->m_pPath)
-        || (0 == pUrl->m_PathSize)) {
-        gotoErr(EFail);
-    }
+int32
+CFileBlockCache::GetBucket(CFileIdentity *pFile, int64 pos) {
+    uint64 hash;
 
-    // Lazily initialize the IO system when we open the first blockIO.
-    if (!m_fInitialized) {
-        err = InitFileIOSystem();
-        if (err) {
-            gotoErr(err);
-        }
-    }
+    hash = (pFile->m_Device * 31) + pFile->m_Inode;
+    hash = (hash * 31) + (uint64) (pos / CFileIOSystem::BYTES_PER_FILE_BLOCK);
+    hash = hash * (uint64) 0x9E3779B97F4A7C15;
 
-    if (m_pLock) {
-        m_pLock->Lock();
-        fHoldingLock = true;
-    }
+    return((int32) ((hash >> 32) & (uint64) (m_NumBuckets - 1)));
+} // GetBucket.
 
-#if LINUX && !USE_LINUX_AIO
-   options |= CAsyncBlockIO::USE_SYNCHRONOUS_IO;
-#endif
 
-    pBlockIO = newex CFileBlockIO;
-    if (!pBlockIO) {
-        gotoErr(EFail);
-    }
 
 
-    // Handle the case of a synchronous file specially.
-    if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO) {
-        pFilePtr = pUrl->m_pPath;
-        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
-        cSaveChar = *pEndFilePtr;
-        *pEndFilePtr = 0;
 
-        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
-            err = pBlockIO->m_SynchFile.OpenOrCreateEmptyFile(pFilePtr, 0);
-            DEBUG_LOG("CFileBlockIO::OpenBlockIO. OpenOrCreateEmptyFile for synchronous IO. Path = %s, err = %d",
-                        pFilePtr, err);
-        } else {
-            err = pBlockIO->m_SynchFile.OpenExistingFile(pFilePtr, 0);
-            DEBUG_LOG("CFileBlockIO::OpenBlockIO. OpenExistingFile for synchronous IO. Path = %s, err = %d",
-                        pFilePtr, err);
-        }
-        *pEndFilePtr = cSaveChar;
-        if (err) {
-            DEBUG_WARNING("CFileBlockIO::OpenBlockIO error. Path = %s, err = %d", pFilePtr, err);
-            gotoErr(err);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FindEntry]
+//
+// The caller must hold the lock.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CFileBlockCache::FindEntry(CFileIdentity *pFile, int64 pos, bool fMatchVersion) {
+    int32 entryNum;
+    CCacheEntry *pEntry;
+
+    entryNum = m_pBuckets[GetBucket(pFile, pos)];
+    while (entryNum >= 0) {
+        pEntry = &(m_pEntries[entryNum]);
+        if ((pos == pEntry->m_PosInMedia)
+            && (pFile->m_Device == pEntry->m_File.m_Device)
+            && (pFile->m_Inode == pEntry->m_File.m_Inode)
+            && ((!fMatchVersion)
+                || ((pFile->m_ModifyTime == pEntry->m_File.m_ModifyTime)
+                    && (pFile->m_FileSize == pEntry->m_File.m_FileSize)))) {
+            return(entryNum);
         }
+        entryNum = pEntry->m_NextInBucket;
+    }
+
+    return(-1);
+} // FindEntry.
 
-        err = pBlockIO->m_SynchFile.GetFileLength((uint64 *) &(pBlockIO->m_MediaSize));
-        if (err) {
-            gotoErr(err);
-        }
-    } else { // if (!(options & CAsyncBlockIO::USE_SYNCHRONOUS_IO))
-#if WIN32
-        dwOpenOptions = FILE_FLAG_OVERLAPPED;
-        dwOpenOptions |= FILE_FLAG_WRITE_THROUGH;
-        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
-            dwCreationDisposition = OPEN_ALWAYS;
-        } else {
-            dwCreationDisposition = OPEN_EXISTING;
-        }
-        if (options & CAsyncBlockIO::READ_ACCESS) {
-            accessRights |= GENERIC_READ;
-        }
-        if (options & CAsyncBlockIO::WRITE_ACCESS) {
-            accessRights |= GENERIC_WRITE;
-        }
-        shareOptions = FILE_SHARE_READ | FILE_SHARE_DELETE;
 
 
-        pFilePtr = pUrl->m_pPath;
-        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
-        cSaveChar = *pEndFilePtr;
-        *pEndFilePtr = 0;
 
-        fh = CreateFileA(
-                    pFilePtr,
-                    accessRights, // access (read-write) mode
-                    shareOptions, // share mode
-                    NULL, // pointer to security attributes
-                    dwCreationDisposition,  // how to create
-                    dwOpenOptions,  // file attributes
-                    NULL);  // handle to file with attributes to copy
 
-        DEBUG_LOG("CFileBlockIO::OpenBlockIO. OpenExistingFile for assynchronous IO. path = %s",
-                    pFilePtr);
-        *pEndFilePtr = cSaveChar;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [RemoveEntry]
+//
+// The caller must hold the lock. Freeing the block does not call out of
+// the cache, so it is safe to do here.
+/////////////////////////////////////////////////////////////////////////////
+void
+CFileBlockCache::RemoveEntry(int32 entryNum) {
+    CCacheEntry *pEntry = &(m_pEntries[entryNum]);
+    int32 *pPrevLink;
+
+    pPrevLink = &(m_pBuckets[GetBucket(&(pEntry->m_File), pEntry->m_PosInMedia)]);
+    while (*pPrevLink != entryNum) {
+        ASSERT(*pPrevLink >= 0);
+        pPrevLink = &(m_pEntries[*pPrevLink].m_NextInBucket);
+    }
+    *pPrevLink = pEntry->m_NextInBucket;
 
-        if (INVALID_HANDLE_VALUE == fh) {
-            DWORD dwErr = GetLastError();
-            DEBUG_LOG("CFileBlockIO::OpenBlockIO. Open failed. GetLastError = %d",
-                        dwErr);
-            gotoErr(EFileNotFound);
-        }
-        fileIsOpen = true;
+    RELEASE_OBJECT(pEntry->m_pBuffer);
+    pEntry->m_fReferenced = false;
+    pEntry->m_NextInBucket = m_FirstFreeEntry;
+    m_FirstFreeEntry = entryNum;
+    m_NumBlocks--;
+} // RemoveEntry.
 
-        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
-            DWORD dwResult;
 
-            DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file");
-            dwResult = SetFilePointer(
-                            fh, // handle of file
-                            0,  // number of bytes to move file pointer
-                            NULL, // pointer to high-order word of distance
-                            CSimpleFile::SEEK_START);
-            if (0xFFFFFFFF == dwResult) {
-                DWORD dwErr = GetLastError();
-                DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file failed. GetLastError = %d", dwErr);
-                gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
-            }
 
-            fSuccess = SetEndOfFile(fh);
-            if (!fSuccess) {
-                DWORD dwErr = GetLastError();
-                DEBUG_LOG("CFileBlockIO::OpenBlockIO. Truncating file failed (step 2). GetLastError = %d", dwErr);
-                gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
-            }
-        }
 
-        hPort = CreateIoCompletionPort(
-                                fh, // file handle to associate with the I/O completion port
-                                g_hIOCompletionPort, // handle to the I/O completion port
-                                0, // per-file completion key for I/O completion packets
-                                1); // number of threads allowed to execute concurrently
-        if (NULL == hPort) {
-            gotoErr(EFail);
-        }
-        pBlockIO->m_AsynchFileHandle = fh;
-        fh = INVALID_HANDLE_VALUE;
 
-        fSuccess = GetFileSizeEx(pBlockIO->m_AsynchFileHandle, &largeInt);
-        if (!fSuccess) {
-            DWORD dwErr = GetLastError();
-            gotoErr(TranslateWin32ErrorIntoErrVal(dwErr, true));
-        }
-        pBlockIO->m_MediaSize = largeInt.QuadPart;
-#elif USE_LINUX_AIO
-        CSimpleFile file;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetFreeEntry]
+//
+// The caller must hold the lock. If the cache is full, then the clock hand
+// sweeps around the entries. It gives each referenced block a second chance
+// and evicts the first block that was not used since the last sweep.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CFileBlockCache::GetFreeEntry() {
+    int32 entryNum;
 
-        pFilePtr = pUrl->m_pPath;
-        pEndFilePtr = pFilePtr + pUrl->m_PathSize;
-        cSaveChar = *pEndFilePtr;
-        *pEndFilePtr = 0;
+    while (m_FirstFreeEntry < 0) {
+        entryNum = m_ClockHand;
+        m_ClockHand = (m_ClockHand + 1) % m_MaxNumBlocks;
 
-        if (options & CAsyncBlockIO::CREATE_NEW_STORE) {
-            err = file.OpenOrCreateEmptyFile(pFilePtr, 0);
+        if (m_pEntries[entryNum].m_fReferenced) {
+            m_pEntries[entryNum].m_fReferenced = false;
         } else {
-            err = file.OpenExistingFile(pFilePtr, 0);
-        }
-        *pEndFilePtr = cSaveChar;
-        if (err) {
-            gotoErr(err);
+            RemoveEntry(entryNum);
         }
+    }
 
-        err = file.GetFileLength((uint64 *) &(pBlockIO->m_MediaSize));
-        if (err) {
-            gotoErr(err);
-        }
+    entryNum = m_FirstFreeEntry;
+    m_FirstFreeEntry = m_pEntries[entryNum].m_NextInBucket;
+    m_pEntries[entryNum].m_NextInBucket = -1;
 
-        pBlockIO->m_AsynchFileFD = file.GetFD();
-        file.ForgetFD();
-#endif
-    } // if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO)
+    return(entryNum);
+} // GetFreeEntry.
 
-    // These are part of the base class.
-    pBlockIO->m_pIOSystem = this;
-    pBlockIO->m_MediaType = CAsyncBlockIO::FILE_MEDIA;
-    pBlockIO->m_fSeekable = true;
 
-    pBlockIO->ChangeBlockIOCallback(pCallback);
-    pBlockIO->m_ActiveBlockIOs.ResetQueue();
 
-    pBlockIO->m_BlockIOFlags = CAsyncBlockIO::RESIZEABLE;
-    if (options & CAsyncBlockIO::USE_SYNCHRONOUS_IO) {
-        pBlockIO->m_fSynchronousDevice = true;
-    }
 
-    pBlockIO->m_pUrl = pUrl;
-    ADDREF_OBJECT(pUrl);
 
-    pBlockIO->m_pLock = CRefLock::Alloc();
-    if (NULL == pBlockIO->m_pLock) {
-        gotoErr(EFail);
-    }
 
-    // Add this connection to the list of active connections.
-    // This assumes that we are holding the monitor lock.
-    m_ActiveBlockIOs.InsertHead(&(pBlockIO->m_ActiveBlockIOs));
-    ADDREF_OBJECT(pBlockIO);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CFileSyncGroup]
+//
+/////////////////////////////////////////////////////////////////////////////
+CFileSyncGroup::CFileSyncGroup() : m_SyncGroupList(this) {
+    m_Device = 0;
+    m_Inode = 0;
+    m_NumUsers = 0;
 
-    pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::BLOCKIO_IS_OPEN;
+    m_pLock = NULL;
+    m_pSyncDone = NULL;
 
-    // Do not hold the lock when we call the callback. This
-    // can cause a deadlock.
-    if (fHoldingLock) {
-        m_pLock->Unlock();
-        fHoldingLock = false;
-    }
+    m_NumRequestedSyncs = 0;
+    m_NumFinishedSyncs = 0;
+    m_LastFailedSync = 0;
+    m_fSyncing = false;
+    m_NumWaiters = 0;
+} // CFileSyncGroup.
 
-    pCallback->OnBlockIOOpen(ENoErr, pBlockIO);
 
-abort:
-    if (fHoldingLock) {
-        m_pLock->Unlock();
-        fHoldingLock = false;
-    }
 
-    RELEASE_OBJECT(pBlockIO);
 
-#if WIN32
-    if (INVALID_HANDLE_VALUE != fh) {
-        BOOL fSuccess = CloseHandle(fh);
-        if (!fSuccess) {
-            int reason = GetLastError();
-            fSuccess = fSuccess;
-        }
 
-        fh = INVALID_HANDLE_VALUE;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CFileSyncGroup]
+//
+/////////////////////////////////////////////////////////////////////////////
+CFileSyncGroup::~CFileSyncGroup() {
+    RELEASE_OBJECT(m_pSyncDone);
+    RELEASE_OBJECT(m_pLock);
+} // ~CFileSyncGroup.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileSyncGroup::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
     }
-#endif // WIN32
 
+    m_pSyncDone = newex CRefEvent;
+    if (NULL == m_pSyncDone) {
+        gotoErr(EFail);
+    }
+    err = m_pSyncDone->Initialize();
+
+abort:
     returnErr(err);
-} // OpenBlockIO.
+} // Initialize.
 
 
 
@@ -1140,18 +3388,82 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CheckState]
+// [SyncFile]
 //
-// This does not check checksums, because we do not know
-// if the client is currently modifying a buffer (and hence
-// the checksum would be invalid). Checksums must be explicitly
-// called by the client.
+// This returns when everything that was written to the file before the
+// call is on disk. If no sync is running, then the caller becomes the
+// leader. It waits for the window so other callers can join, and then
+// syncs the file for all of them. Callers that arrive while a sync is
+// running wait, and the first of them leads the next sync.
+//
+// A failed sync may have lost data for every caller it covered, so each
+// of them gets the error.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CFileIOSystem::CheckState() {
-    AutoLock(m_pLock);
-    returnErr(ENoErr);
-} // CheckState.
+CFileSyncGroup::SyncFile(int fd, int32 windowInMicroSecs) {
+    ErrVal err = ENoErr;
+    int64 syncNum;
+    int64 lastCoveredSync;
+    int result = 0;
+
+    if ((NULL == m_pLock) || (NULL == m_pSyncDone) || (fd < 0)) {
+        returnErr(EFail);
+    }
+
+    m_pLock->Lock();
+    m_NumRequestedSyncs++;
+    syncNum = m_NumRequestedSyncs;
+
+    while (m_NumFinishedSyncs < syncNum) {
+        if (m_fSyncing) {
+            m_NumWaiters++;
+            m_pLock->Unlock();
+            m_pSyncDone->Wait();
+            m_pLock->Lock();
+            continue;
+        }
+
+        m_fSyncing = true;
+        m_pLock->Unlock();
+
+#if LINUX
+        if (windowInMicroSecs > 0) {
+            usleep(windowInMicroSecs);
+        }
+#endif
+
+        m_pLock->Lock();
+        lastCoveredSync = m_NumRequestedSyncs;
+        m_pLock->Unlock();
+
+#if LINUX
+        result = fdatasync(fd);
+        if (result < 0) {
+            DEBUG_LOG("CFileSyncGroup::SyncFile. fdatasync failed. errno = %d", errno);
+        }
+#endif
+
+        m_pLock->Lock();
+        if (result < 0) {
+            m_LastFailedSync = lastCoveredSync;
+        }
+        m_NumFinishedSyncs = lastCoveredSync;
+        m_fSyncing = false;
+
+        // Wake every waiter. The ones that were not covered go around again.
+        while (m_NumWaiters > 0) {
+            m_pSyncDone->Signal();
+            m_NumWaiters--;
+        }
+    } // while (m_NumFinishedSyncs < syncNum)
+
+    if (syncNum <= m_LastFailedSync) {
+        err = EFail;
+    }
+    m_pLock->Unlock();
+
+    returnErr(err);
+} // SyncFile.
 
 
 
@@ -1239,50 +3551,55 @@ Win32FileIOCompletionProc(LPVOID pvwp) {
 
 
 
-#if USE_LINUX_AIO
-//////////////////////////////////////////////////////////////////////////////
+#if USE_IO_URING
+/////////////////////////////////////////////////////////////////////////////
 //
-// [LinuxSignalHandler]
+// [PostUringIO]
 //
-//////////////////////////////////////////////////////////////////////////////
-static void
-LinuxSignalHandler(int sig, siginfo_t *info, void *unused) {
-    struct aiocb *completedAIO;
-    char *pBasePtr;
-    CIOBuffer *pBuffer;
+// The ring holds the reference that the caller added to the buffer until
+// the uring thread reaps the completion.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CFileBlockIO::PostUringIO(CIOBuffer *pBuffer, uint8 opCode, int32 numBytes) {
+    ErrVal err = ENoErr;
+    CIOUring *pIOUring = g_pFileIOSystemImpl->m_pIOUring;
+    struct io_uring_sqe sqe;
+    bool fQueueOnly;
 
-    sig = sig;
-    unused = unused;
-    if (NULL == info) {
-       return;
-    }
-    completedAIO = (aiocb *) info->si_value.sival_ptr;
-    if (NULL == completedAIO) {
-       return;
+    if ((NULL == pIOUring) || (-1 == m_AsynchFileFD)) {
+        gotoErr(EFail);
     }
 
-    pBasePtr = (char *) completedAIO;
-    pBasePtr = pBasePtr - g_OffsetFromAsyncIOInfoToIOBlock;
-    pBuffer = (CIOBuffer *) pBasePtr;
-
-    g_pFileIOSystemImpl->WakeWorkerThread(pBuffer);
-} // LinuxSignalHandler
-
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opCode;
+    sqe.fd = m_AsynchFileFD;
+    sqe.addr = (uint64) (pBuffer->m_pLogicalBuffer);
+    sqe.len = (uint32) numBytes;
+    sqe.off = (uint64) (pBuffer->m_PosInMedia);
+    sqe.user_data = (uint64) pBuffer;
 
+    if (m_pLock) {
+        m_pLock->Lock();
+    }
+    fQueueOnly = m_fWriteChainOpen;
+    if (m_pLock) {
+        m_pLock->Unlock();
+    }
 
+    if (fQueueOnly) {
+        err = pIOUring->QueueSQE(&sqe);
+    } else {
+        err = pIOUring->SubmitSQE(&sqe);
+    }
+    if (err) {
+        DEBUG_LOG("CFileBlockIO::PostUringIO. Cannot post the request. err = %d", err);
+        gotoErr(err);
+    }
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [LinuxWorkerThreadProc]
-//
-/////////////////////////////////////////////////////////////////////////////
-static void
-LinuxWorkerThreadProc(void *arg, CSimpleThread *threadState) {
-    arg = arg;
-    threadState = threadState;
+abort:
+    returnErr(err);
+} // PostUringIO.
 
-    g_pFileIOSystemImpl->RunWorkerThread();
-} // LinuxWorkerThreadProc
 
 
 
@@ -1290,21 +3607,16 @@ LinuxWorkerThreadProc(void *arg, CSimpleThread *threadState) {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [WakeWorkerThread]
+// [FileUringThreadProc]
 //
 /////////////////////////////////////////////////////////////////////////////
-void
-CFileIOSystem::WakeWorkerThread(CIOBuffer *pBuffer) {
-    AutoLock(m_pLock);
+static void
+FileUringThreadProc(void *arg, CSimpleThread *threadState) {
+    arg = arg;
+    threadState = threadState;
 
-    if (NULL != pBuffer) {
-        m_FinishedIOList.InsertTail(&(pBuffer->m_BlockIOBufferList));
-        ADDREF_OBJECT(pBuffer);
-    }
-    if (NULL != m_pIOEventSignal) {
-        m_pIOEventSignal->Signal();
-    }
-} // WakeWorkerThread
+    g_pFileIOSystemImpl->UringThread();
+} // FileUringThreadProc.
 
 
 
@@ -1313,56 +3625,75 @@ CFileIOSystem::WakeWorkerThread(CIOBuffer *pBuffer) {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [RunWorkerThread]
+// [UringThread]
 //
+// This reaps every completion in the ring each time it wakes up, so a burst
+// of IO costs one system call rather than one per buffer.
 /////////////////////////////////////////////////////////////////////////////
 void
-CFileIOSystem::RunWorkerThread() {
+CFileIOSystem::UringThread() {
     ErrVal err = ENoErr;
+    uint64 userData;
+    int32 result;
+    int32 numBytes;
     CIOBuffer *pBuffer = NULL;
-    bool fShutdown = false;
     CAsyncBlockIO *pBlockIO = NULL;
-    ssize_t numResultBytes = 0;
-
-    while (1) {
-        m_pIOEventSignal->Wait();
-
-        m_pLock->Lock();
-        pBuffer = NULL;
-        fShutdown = m_fShutdown;
-        if (!fShutdown) {
-            pBuffer = m_FinishedIOList.RemoveHead();
-        }
-        m_pLock->Unlock();
+    bool fStop = false;
 
-        if (fShutdown) {
-            break;
-        }
+    while (!fStop) {
+        while (m_pIOUring->GetNextCompletion(&userData, &result)) {
+            if (URING_STOP_USER_DATA == userData) {
+                if (m_fShutdown) {
+                    fStop = true;
+                }
+                continue;
+            }
 
-        if (NULL != pBuffer) {
             g_NumFileCallbacksActive++;
-            err = ENoErr;
-
-             numResultBytes = aio_return(&(pBuffer->m_AIORequest));
-            if (numResultBytes > 0) {
-               err = ENoErr;
-            } else if (0 == numResultBytes) {
-               err = EEOF;
+            pBuffer = (CIOBuffer *) userData;
+
+            numBytes = 0;
+            if (result > 0) {
+                err = ENoErr;
+                numBytes = result;
+            } else if (0 == result) {
+                err = EEOF;
             } else {
-               err = EFail;
+                DEBUG_LOG("CFileIOSystem::UringThread. IO failed. errno = %d", -result);
+                err = EFail;
             }
 
             pBlockIO = pBuffer->m_pBlockIO;
+            if ((NULL != pBlockIO)
+                && (CIOBuffer::WRITE == pBuffer->m_BufferOp)
+                && (numBytes > 0)) {
+                ((CFileBlockIO *) pBlockIO)->InvalidateCachedBlocks(
+                                                pBuffer->m_PosInMedia,
+                                                pBuffer->m_PosInMedia + numBytes);
+            }
             if (NULL != pBlockIO) {
-                pBlockIO->FinishIO(pBuffer, err, numResultBytes);
+                pBlockIO->FinishIO(pBuffer, err, numBytes);
             }
 
             RELEASE_OBJECT(pBuffer);
             g_NumFileCallbacksActive--;
-        } // if (NULL != pBuffer)
-    } // while (1);
-} // RunWorkerThread
+        } // while (m_pIOUring->GetNextCompletion(&userData, &result))
+        if (fStop) {
+            break;
+        }
+
+        err = m_pIOUring->WaitForCompletions();
+        if (err) {
+            DEBUG_LOG("CFileIOSystem::UringThread. WaitForCompletions failed. err = %d", err);
+            OSIndependantLayer::SleepForMilliSecs(100);
+        }
+    } // while (!fStop)
+
+    if (m_pUringThreadStopped) {
+        m_pUringThreadStopped->Signal();
+    }
+} // UringThread.
+#endif // USE_IO_URING
 
-#endif // USE_LINUX_AIO
 
 
@@ -217,7 +217,7 @@ protected:
     bool                    m_fInitialized;
 
     int32                   m_PageSize;
-    uint32                  m_PageAddressMask;
+    uint64                  m_PageAddressMask;
     uint32                  m_PageOffsetMask;
 
     int32                   m_TotalMem;
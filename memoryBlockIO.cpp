@@ -28,6 +28,10 @@
 // writes memory buffers.
 //
 // This always implements IO with synchronous operations.
+//
+// A store that we allocate is a list of fixed-size pages, so it grows by
+// adding pages and never copies the bytes it already holds. A store that
+// the caller passes in is one buffer that cannot grow.
 /////////////////////////////////////////////////////////////////////////////
 
 #include "osIndependantLayer.h"
@@ -48,6 +52,7 @@
 FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
 
 #define MAX_SANE_MEMORY_BLOCK_IO_SIZE   10000000
+#define BYTES_PER_MEMORY_PAGE           (16 * 1024)
 
 /////////////////////////////////////////////////////////////////////////////
 class CMemoryBlockIO : public CAsyncBlockIO {
@@ -70,10 +75,20 @@ protected:
     virtual void ReadBlockAsyncImpl(CIOBuffer *pBuffer);
     virtual void WriteBlockAsyncImpl(CIOBuffer *pBuffer);
 
+    ErrVal SetPhysicalSize(int32 newPhysicalSize);
+    char *GetMediaPtr(int64 pos, int32 *pNumContiguousBytes);
+
     bool    m_fBufferAllocatedFromMemory;
     int32   m_BufferPhysicalSize;
 
+    // This is only used for a store passed in by the caller.
     char    *m_pBuffer;
+
+    // This is only used for a store we allocated. m_BufferPhysicalSize
+    // is always m_NumPages * BYTES_PER_MEMORY_PAGE.
+    char    **m_pPageList;
+    int32   m_NumPages;
+    int32   m_MaxPages;
 }; // CMemoryBlockIO
 
 
@@ -132,6 +147,10 @@ CMemoryBlockIO::CMemoryBlockIO() {
     m_pBuffer = NULL;
     m_BufferPhysicalSize = 0;
     m_fBufferAllocatedFromMemory = false;
+
+    m_pPageList = NULL;
+    m_NumPages = 0;
+    m_MaxPages = 0;
 } // CMemoryBlockIO.
 
 
@@ -146,6 +165,13 @@ CMemoryBlockIO::~CMemoryBlockIO() {
     // Do NOT deallocate the memory buffer. That is done as
     // part of an explicit delete call.
     m_pBuffer = NULL;
+
+    // Close frees the pages, but a blockIO that failed to open was
+    // never closed.
+    if (m_fBufferAllocatedFromMemory) {
+        (void) SetPhysicalSize(0);
+        memFree(m_pPageList);
+    }
 } // ~CMemoryBlockIO.
 
 
@@ -167,30 +193,30 @@ CMemoryBlockIO::Resize(int64 newLength) {
     DEBUG_LOG("CMemoryBlockIO::Resize: new length = %ld, old maxLength = %ld.",
         newLength, m_BufferPhysicalSize);
 
-    if (newLength >= MAX_SANE_MEMORY_BLOCK_IO_SIZE) {
+    if ((newLength < 0) || (newLength >= MAX_SANE_MEMORY_BLOCK_IO_SIZE)) {
         gotoErr(EFail);
     }
 
-    if (newLength <= m_BufferPhysicalSize) {
+    if (!m_fBufferAllocatedFromMemory) {
+        if (newLength > m_BufferPhysicalSize) {
+            gotoErr(EFail);
+        }
         m_MediaSize = newLength;
-        err = ENoErr;
-        gotoErr(err);
+        gotoErr(ENoErr);
     }
 
-    if ((!(m_BlockIOFlags & CAsyncBlockIO::RESIZEABLE))
-        || (!m_fBufferAllocatedFromMemory)) {
+    if ((newLength > m_BufferPhysicalSize)
+        && (!(m_BlockIOFlags & CAsyncBlockIO::RESIZEABLE))) {
         gotoErr(EFail);
     }
 
-    DEBUG_LOG("CMemoryBlockIO::Resize: Allocating new larger buffer.");
-
-    m_pBuffer = (char *) g_MainMem.Realloc(m_pBuffer, (int32) newLength);
-    if (NULL == m_pBuffer) {
-        gotoErr(EFail);
+    // This adds pages to grow, and frees pages past the end to shrink.
+    err = SetPhysicalSize((int32) newLength);
+    if (err) {
+        gotoErr(err);
     }
 
     m_MediaSize = newLength;
-    m_BufferPhysicalSize = (int32) newLength;
 
 abort:
     returnErr(err);
@@ -217,9 +243,10 @@ CMemoryBlockIO::Close() {
 
     CAsyncBlockIO::Close();
 
-    if ((m_pBuffer) && (m_fBufferAllocatedFromMemory)) {
-        g_MainMem.Free(m_pBuffer);
-        m_pBuffer = NULL;
+    if (m_fBufferAllocatedFromMemory) {
+        (void) SetPhysicalSize(0);
+        memFree(m_pPageList);
+        m_MaxPages = 0;
     }
 } // Close.
 
@@ -228,6 +255,86 @@ CMemoryBlockIO::Close() {
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SetPhysicalSize]
+//
+// This adds or frees pages so the store holds newPhysicalSize bytes,
+// rounded up to a whole page. Growing only copies the list of page
+// pointers, which doubles in size when it is full.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CMemoryBlockIO::SetPhysicalSize(int32 newPhysicalSize) {
+    ErrVal err = ENoErr;
+    int32 newNumPages;
+    int32 newMaxPages;
+    char **pNewPageList;
+
+    newNumPages = (newPhysicalSize + BYTES_PER_MEMORY_PAGE - 1) / BYTES_PER_MEMORY_PAGE;
+
+    while (m_NumPages > newNumPages) {
+        m_NumPages = m_NumPages - 1;
+        memFree(m_pPageList[m_NumPages]);
+    }
+
+    if (newNumPages > m_MaxPages) {
+        newMaxPages = m_MaxPages * 2;
+        if (newMaxPages < newNumPages) {
+            newMaxPages = newNumPages;
+        }
+
+        pNewPageList = (char **) g_MainMem.Realloc(m_pPageList, (int32) (newMaxPages * sizeof(char *)));
+        if (NULL == pNewPageList) {
+            gotoErr(EFail);
+        }
+        m_pPageList = pNewPageList;
+        m_MaxPages = newMaxPages;
+    }
+
+    while (m_NumPages < newNumPages) {
+        m_pPageList[m_NumPages] = (char *) memAlloc(BYTES_PER_MEMORY_PAGE);
+        if (NULL == m_pPageList[m_NumPages]) {
+            gotoErr(EFail);
+        }
+        m_NumPages += 1;
+    }
+
+abort:
+    m_BufferPhysicalSize = m_NumPages * BYTES_PER_MEMORY_PAGE;
+    returnErr(err);
+} // SetPhysicalSize.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetMediaPtr]
+//
+// This returns the byte at pos, and the number of bytes after it that are
+// in the same page.
+/////////////////////////////////////////////////////////////////////////////
+char *
+CMemoryBlockIO::GetMediaPtr(int64 pos, int32 *pNumContiguousBytes) {
+    int32 offsetInPage;
+
+    if (!m_fBufferAllocatedFromMemory) {
+        *pNumContiguousBytes = (int32) (m_BufferPhysicalSize - pos);
+        return(m_pBuffer + pos);
+    }
+
+    offsetInPage = (int32) (pos % BYTES_PER_MEMORY_PAGE);
+    *pNumContiguousBytes = BYTES_PER_MEMORY_PAGE - offsetInPage;
+    return(m_pPageList[pos / BYTES_PER_MEMORY_PAGE] + offsetInPage);
+} // GetMediaPtr.
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [WriteBlockAsyncImpl]
@@ -238,13 +345,17 @@ void
 CMemoryBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
     ErrVal err = ENoErr;
     char *destPtr;
+    char *srcPtr;
     int32 newLength;
+    int32 bytesLeft;
+    int32 chunkSize;
+    int64 pos;
     AutoLock(m_pLock);
     RunChecks();
 
     DEBUG_LOG("CMemoryBlockIO::WriteBlockAsyncImpl.");
 
-    if (NULL == m_pBuffer) {
+    if ((NULL == m_pBuffer) && (!m_fBufferAllocatedFromMemory)) {
         return;
     }
 
@@ -258,18 +369,16 @@ CMemoryBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
 
         if ((pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes) <= m_BufferPhysicalSize) {
             m_MediaSize = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
-        } else if (m_BlockIOFlags & RESIZEABLE) {
+        } else if ((m_BlockIOFlags & RESIZEABLE) && (m_fBufferAllocatedFromMemory)) {
             newLength = (int32) (pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes);
             if (newLength >= MAX_SANE_MEMORY_BLOCK_IO_SIZE) {
                 gotoErr(EFail);
             }
 
-            m_pBuffer = (char *) (g_MainMem.Realloc(m_pBuffer, newLength));
-            if (NULL == m_pBuffer) {
-                gotoErr(EFail);
+            err = SetPhysicalSize(newLength);
+            if (err) {
+                gotoErr(err);
             }
-
-            m_BufferPhysicalSize = newLength;
             m_MediaSize = pBuffer->m_PosInMedia + pBuffer->m_NumValidBytes;
         }    // resizing the buffer
         else {
@@ -277,12 +386,21 @@ CMemoryBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
         } // clipping the IO.
     } // handling a too-big IO.
 
-    // Do the actual IO.
-    destPtr = m_pBuffer + pBuffer->m_PosInMedia;
-    memcpy(
-        destPtr,
-        pBuffer->m_pLogicalBuffer,
-        pBuffer->m_NumValidBytes);
+    // Do the actual IO. This may cross from one page into the next.
+    pos = pBuffer->m_PosInMedia;
+    srcPtr = pBuffer->m_pLogicalBuffer;
+    bytesLeft = pBuffer->m_NumValidBytes;
+    while (bytesLeft > 0) {
+        destPtr = GetMediaPtr(pos, &chunkSize);
+        if (chunkSize > bytesLeft) {
+            chunkSize = bytesLeft;
+        }
+        memcpy(destPtr, srcPtr, chunkSize);
+
+        pos += chunkSize;
+        srcPtr += chunkSize;
+        bytesLeft = bytesLeft - chunkSize;
+    }
 
 abort:
     // Mark the block as complete.
@@ -304,13 +422,18 @@ void
 CMemoryBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
     ErrVal err = ENoErr;
     char *srcPtr;
-    int32 actualIOSize;
+    char *destPtr;
+    int32 actualIOSize = 0;
+    int32 bytesLeft;
+    int32 chunkSize;
+    int64 pos;
     AutoLock(m_pLock);
     RunChecks();
 
     DEBUG_LOG("CMemoryBlockIO::ReadBlockAsyncImpl.");
 
-    if ((NULL == m_pBuffer) || (NULL == m_pIOSystem)) {
+    if (((NULL == m_pBuffer) && (!m_fBufferAllocatedFromMemory))
+        || (NULL == m_pIOSystem)) {
         gotoErr(EFail);
     }
 
@@ -336,9 +459,21 @@ CMemoryBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
         gotoErr(EEOF);
     }
 
-    // Do the actual IO.
-    srcPtr = m_pBuffer + pBuffer->m_PosInMedia;
-    memcpy(pBuffer->m_pLogicalBuffer, srcPtr, actualIOSize);
+    // Do the actual IO. This may cross from one page into the next.
+    pos = pBuffer->m_PosInMedia;
+    destPtr = pBuffer->m_pLogicalBuffer;
+    bytesLeft = actualIOSize;
+    while (bytesLeft > 0) {
+        srcPtr = GetMediaPtr(pos, &chunkSize);
+        if (chunkSize > bytesLeft) {
+            chunkSize = bytesLeft;
+        }
+        memcpy(destPtr, srcPtr, chunkSize);
+
+        pos += chunkSize;
+        destPtr += chunkSize;
+        bytesLeft = bytesLeft - chunkSize;
+    }
 
 abort:
     // Mark the block as complete.
@@ -373,7 +508,6 @@ CMemoryBlockIO::CheckState() {
     if ((MEMORY_MEDIA != m_MediaType)
         || (NULL == m_pIOSystem)
         || (!m_fSeekable)
-        || (NULL == m_pBuffer)
         || (m_BufferPhysicalSize < 0)
         || (m_MediaSize > m_BufferPhysicalSize)) {
         gotoErr(EFail);
@@ -383,19 +517,23 @@ CMemoryBlockIO::CheckState() {
     // any lock.
 
     if (m_fBufferAllocatedFromMemory) {
-        int32 realBufSize;
-
-        realBufSize = g_MainMem.GetPtrSize(m_pBuffer);
-        if ((realBufSize < 0)
-            || (realBufSize < m_MediaSize)
-            || (realBufSize != m_BufferPhysicalSize)) {
+        if ((NULL != m_pBuffer)
+            || (m_NumPages < 0)
+            || (m_NumPages > m_MaxPages)
+            || (m_BufferPhysicalSize != (m_NumPages * BYTES_PER_MEMORY_PAGE))) {
             gotoErr(EFail);
         }
 
-        err = g_MainMem.CheckPtr(m_pBuffer);
-        if (err) {
-            gotoErr(err);
+        // Only check the list of pages, not every page, since this runs
+        // on every IO and a big store has many pages.
+        if (m_pPageList) {
+            err = g_MainMem.CheckPtr(m_pPageList);
+            if (err) {
+                gotoErr(err);
+            }
         }
+    } else if (NULL == m_pBuffer) {
+        gotoErr(EFail);
     }
 
 abort:
@@ -470,7 +608,6 @@ CMemoryIOSystem::OpenBlockIO(
                         int32 options,
                         CAsyncBlockIOCallback *pCallback) {
     ErrVal err = ENoErr;
-    char *ptr = NULL;
     CMemoryBlockIO *pBlockIO = NULL;
     char cSaveChar;
     char *pFilePtr;
@@ -521,16 +658,12 @@ CMemoryIOSystem::OpenBlockIO(
     if ((options & CAsyncBlockIO::CREATE_NEW_STORE) || (NULL == pBuffer)) {
         DEBUG_LOG("CMemoryIOSystem::OpenBlockIO: Creating a new store");
 
-        ptr = (char *) memAlloc(bufferLength);
-        if (NULL == ptr) {
-            gotoErr(EFail);
-        }
-
         // These are part of the memory block IO subclass.
-        pBlockIO->m_pBuffer = ptr;
-        pBlockIO->m_BufferPhysicalSize = bufferLength;
         pBlockIO->m_fBufferAllocatedFromMemory = true;
-        ptr = NULL;
+        err = pBlockIO->SetPhysicalSize(bufferLength);
+        if (err) {
+            gotoErr(err);
+        }
     } else
     {
         DEBUG_LOG("CMemoryIOSystem::OpenBlockIO: Opening an existing buffer");
@@ -545,7 +678,11 @@ CMemoryIOSystem::OpenBlockIO(
     pBlockIO->m_fSeekable = true;
     pBlockIO->m_pIOSystem = this;
 
+    // A store we allocate can always add pages.
     pBlockIO->m_BlockIOFlags = 0;
+    if (pBlockIO->m_fBufferAllocatedFromMemory) {
+        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::RESIZEABLE;
+    }
     pBlockIO->m_MediaSize = bufferLength;
     pBlockIO->m_ActiveBlockIOs.ResetQueue();
 
@@ -575,9 +712,6 @@ CMemoryIOSystem::OpenBlockIO(
 abort:
     // The callback owns pBlockIO now.
     RELEASE_OBJECT(pBlockIO);
-    if (ptr) {
-        memFree(ptr);
-    }
 
     returnErr(err);
 } // OpenBlockIO.
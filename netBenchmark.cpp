@@ -0,0 +1,923 @@
+/////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2005-2017 Dawson Dean
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+/////////////////////////////////////////////////////////////////////////////
+//
+// Network Benchmark
+//
+// This is a standalone program, not part of the library. It opens an echo
+// server on 127.0.0.1 with the net blockIO layer, and then drives it with
+// some number of client CAsyncIOStreams. Each client sends a payload, waits
+// for the whole payload to come back, and then immediately sends the next
+// one, so there is always exactly one request outstanding per connection.
+//
+// Every combination of connection count and payload size is run for a fixed
+// time after a short warm-up. Each run prints one line of JSON to stdout
+// with requests/s, payload bytes/s and round-trip latency percentiles in
+// microseconds. Anything else (like log output) goes elsewhere, so the
+// output can be piped straight into a script.
+//
+// A payload bigger than the socket buffers ("Network Socket Buffer Size")
+// cannot be sent without waiting for the peer's ACKs, so that setting
+// decides the latency of the 64KB runs.
+//
+// Usage: netBenchmark [secondsPerRun] [port]
+/////////////////////////////////////////////////////////////////////////////
+
+#include "buildingBlocks.h"
+
+FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
+
+
+static const int32 g_ConnectionCountList[] = { 1, 8, 64 };
+static const int32 g_PayloadSizeList[] = { 64, 1024, 16384, 65536 };
+
+#define NUM_CONNECTION_COUNTS   (int32) (sizeof(g_ConnectionCountList) / sizeof(g_ConnectionCountList[0]))
+#define NUM_PAYLOAD_SIZES       (int32) (sizeof(g_PayloadSizeList) / sizeof(g_PayloadSizeList[0]))
+
+enum NetBenchmarkConstants {
+    DEFAULT_BENCHMARK_PORT      = 9400,
+    DEFAULT_SECONDS_PER_RUN     = 2,
+    MAX_PAYLOAD_SIZE            = 65536,
+    WARMUP_TIME_IN_MS           = 250,
+
+    // After a run, this is how long we wait for the clients to notice
+    // and close their connections.
+    MAX_DRAIN_TIME_IN_MS        = 10000,
+    DRAIN_POLL_TIME_IN_MS       = 10,
+};
+
+// These are shared by all clients in a run. Requests only count while
+// g_fRecording is set, which excludes the warm-up and the drain.
+static volatile bool g_fRecording = false;
+static volatile bool g_fStopClients = false;
+static CRefLock *g_pBenchmarkLock = NULL;
+static int32 g_NumRunningClients = 0;
+
+static char g_Payload[MAX_PAYLOAD_SIZE];
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetTimeInMicroSecs]
+//
+/////////////////////////////////////////////////////////////////////////////
+static uint64
+GetTimeInMicroSecs() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((((uint64) now.tv_sec) * 1000000) + (((uint64) now.tv_nsec) / 1000));
+} // GetTimeInMicroSecs.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This counts latencies in log-linear buckets. Values below LINEAR_LIMIT each
+// have their own bucket, and every power of 2 above that is split into
+// SUB_BUCKETS buckets, so a percentile is accurate to within about 1.5%
+// without keeping every sample.
+/////////////////////////////////////////////////////////////////////////////
+class CLatencyHistogram {
+public:
+    CLatencyHistogram() { Reset(); }
+
+    void Reset();
+    void Record(uint64 value);
+    void Merge(const CLatencyHistogram *pOther);
+    uint64 GetPercentile(double fraction);
+    int64 GetNumSamples() { return(m_NumSamples); }
+
+private:
+    enum {
+        LINEAR_BITS         = 10,
+        LINEAR_LIMIT        = (1 << LINEAR_BITS),
+        SUB_BUCKET_BITS     = 6,
+        SUB_BUCKETS         = (1 << SUB_BUCKET_BITS),
+        MAX_EXPONENT        = 40,
+        NUM_BUCKETS         = LINEAR_LIMIT + ((MAX_EXPONENT - LINEAR_BITS) * SUB_BUCKETS),
+    };
+
+    int64           m_Buckets[NUM_BUCKETS];
+    int64           m_NumSamples;
+}; // CLatencyHistogram
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Reset]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLatencyHistogram::Reset() {
+    memset(m_Buckets, 0, sizeof(m_Buckets));
+    m_NumSamples = 0;
+} // Reset.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Record]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLatencyHistogram::Record(uint64 value) {
+    int32 exponent;
+    int32 bucketNum;
+
+    if (value < LINEAR_LIMIT) {
+        bucketNum = (int32) value;
+    } else {
+        exponent = LINEAR_BITS;
+        while ((exponent < (MAX_EXPONENT - 1)) && ((value >> (exponent + 1)) > 0)) {
+            exponent++;
+        }
+        bucketNum = LINEAR_LIMIT
+                    + ((exponent - LINEAR_BITS) * SUB_BUCKETS)
+                    + (int32) ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    m_Buckets[bucketNum] += 1;
+    m_NumSamples += 1;
+} // Record.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Merge]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CLatencyHistogram::Merge(const CLatencyHistogram *pOther) {
+    int32 bucketNum;
+
+    for (bucketNum = 0; bucketNum < NUM_BUCKETS; bucketNum++) {
+        m_Buckets[bucketNum] += pOther->m_Buckets[bucketNum];
+    }
+    m_NumSamples += pOther->m_NumSamples;
+} // Merge.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetPercentile]
+//
+// This returns the largest value that falls in the bucket that holds the
+// requested sample.
+/////////////////////////////////////////////////////////////////////////////
+uint64
+CLatencyHistogram::GetPercentile(double fraction) {
+    int64 targetSample;
+    int64 numSamplesSeen = 0;
+    int32 bucketNum;
+    int32 exponent;
+    uint64 subBucket;
+
+    if (m_NumSamples <= 0) {
+        return(0);
+    }
+
+    targetSample = (int64) (fraction * (double) m_NumSamples);
+    if (targetSample < 1) {
+        targetSample = 1;
+    }
+    if (targetSample > m_NumSamples) {
+        targetSample = m_NumSamples;
+    }
+
+    for (bucketNum = 0; bucketNum < NUM_BUCKETS; bucketNum++) {
+        numSamplesSeen += m_Buckets[bucketNum];
+        if (numSamplesSeen >= targetSample) {
+            break;
+        }
+    }
+
+    if (bucketNum < LINEAR_LIMIT) {
+        return((uint64) bucketNum);
+    }
+
+    exponent = LINEAR_BITS + ((bucketNum - LINEAR_LIMIT) / SUB_BUCKETS);
+    subBucket = (uint64) ((bucketNum - LINEAR_LIMIT) % SUB_BUCKETS);
+    return(((SUB_BUCKETS + subBucket + 1) << (exponent - SUB_BUCKET_BITS)) - 1);
+} // GetPercentile.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is one accepted connection on the echo server. Every block it reads
+// is written straight back from the same buffer.
+/////////////////////////////////////////////////////////////////////////////
+class CEchoConnection : public CAsyncBlockIOCallback,
+                        public CRefCountImpl {
+public:
+    CEchoConnection();
+    virtual ~CEchoConnection();
+    NEWEX_IMPL()
+
+    ErrVal Start(CAsyncBlockIO *pBlockIO);
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+private:
+    void Close();
+
+    CAsyncBlockIO       *m_pBlockIO;
+}; // CEchoConnection
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CEchoConnection]
+//
+/////////////////////////////////////////////////////////////////////////////
+CEchoConnection::CEchoConnection() {
+    m_pBlockIO = NULL;
+} // CEchoConnection.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CEchoConnection]
+//
+/////////////////////////////////////////////////////////////////////////////
+CEchoConnection::~CEchoConnection() {
+    RELEASE_OBJECT(m_pBlockIO);
+} // ~CEchoConnection.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Start]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CEchoConnection::Start(CAsyncBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+
+    m_pBlockIO = pBlockIO;
+    ADDREF_OBJECT(m_pBlockIO);
+
+    err = NetIO_ReceiveDataFromAcceptedConnection(m_pBlockIO, this);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    returnErr(err);
+} // Start.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+// The blockIO serializes its events, so this is never called on two
+// threads at once for the same connection.
+/////////////////////////////////////////////////////////////////////////////
+void
+CEchoConnection::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    if ((NULL == pBuffer) || (NULL == m_pBlockIO)) {
+        return;
+    }
+
+    if (pBuffer->m_Err) {
+        Close();
+        return;
+    }
+
+    if ((CIOBuffer::READ == pBuffer->m_BufferOp) && (pBuffer->m_NumValidBytes > 0)) {
+        pBuffer->m_BufferOp = CIOBuffer::NO_OP;
+        pBuffer->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        m_pBlockIO->WriteBlockAsync(pBuffer, 0);
+    }
+} // OnBlockIOEvent.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Close]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CEchoConnection::Close() {
+    CAsyncBlockIO *pBlockIO = m_pBlockIO;
+
+    m_pBlockIO = NULL;
+    if (pBlockIO) {
+        // This breaks the reference cycle between us and the blockIO.
+        pBlockIO->ChangeBlockIOCallback(NULL);
+        pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+} // Close.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is the listening socket of the echo server.
+/////////////////////////////////////////////////////////////////////////////
+class CEchoServer : public CAsyncBlockIOCallback,
+                    public CRefCountImpl {
+public:
+    NEWEX_IMPL()
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer) { pBuffer = pBuffer; }
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+}; // CEchoServer
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOAccept]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CEchoServer::OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) {
+    CEchoConnection *pConnection = NULL;
+
+    if ((err) || (NULL == pBlockIO)) {
+        gotoErr(err);
+    }
+
+    pConnection = newex CEchoConnection;
+    if (NULL == pConnection) {
+        gotoErr(EFail);
+    }
+
+    err = pConnection->Start(pBlockIO);
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    if ((err) && (pBlockIO)) {
+        pBlockIO->Close();
+    }
+    RELEASE_OBJECT(pConnection);
+} // OnBlockIOAccept.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is one client connection. It keeps one request in flight until the
+// run is stopped.
+/////////////////////////////////////////////////////////////////////////////
+class CBenchmarkClient : public CAsyncIOEventHandler,
+                         public CRefCountImpl {
+public:
+    CBenchmarkClient();
+    virtual ~CBenchmarkClient();
+    NEWEX_IMPL()
+
+    ErrVal Start(CParsedUrl *pUrl, int32 payloadSize);
+
+    // CAsyncIOEventHandler
+    virtual void OnStreamDisconnect(
+                    ErrVal err,
+                    CAsyncIOStream *pAsyncIOStream,
+                    void *pContext);
+    virtual void OnOpenAsyncIOStream(
+                    ErrVal err,
+                    CAsyncIOStream *pAsyncIOStream,
+                    void *pContext);
+    virtual void OnFlush(
+                    ErrVal err,
+                    CAsyncIOStream *pAsyncIOStream,
+                    void *pContext);
+    virtual void OnReadyToRead(
+                    ErrVal err,
+                    int64 numBytesAvailable,
+                    CAsyncIOStream *pAsyncIOStream,
+                    void *pContext);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    int64               m_NumRequests;
+    int64               m_NumErrors;
+    CLatencyHistogram   m_Latency;
+
+private:
+    void SendRequest();
+    void Finish(ErrVal err);
+
+    CAsyncIOStream      *m_pAsyncIOStream;
+    int32               m_PayloadSize;
+    uint64              m_RequestStartInUs;
+    bool                m_fFinished;
+}; // CBenchmarkClient
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CBenchmarkClient]
+//
+/////////////////////////////////////////////////////////////////////////////
+CBenchmarkClient::CBenchmarkClient() {
+    m_NumRequests = 0;
+    m_NumErrors = 0;
+    m_pAsyncIOStream = NULL;
+    m_PayloadSize = 0;
+    m_RequestStartInUs = 0;
+    m_fFinished = false;
+} // CBenchmarkClient.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CBenchmarkClient]
+//
+/////////////////////////////////////////////////////////////////////////////
+CBenchmarkClient::~CBenchmarkClient() {
+    RELEASE_OBJECT(m_pAsyncIOStream);
+} // ~CBenchmarkClient.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Start]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CBenchmarkClient::Start(CParsedUrl *pUrl, int32 payloadSize) {
+    ErrVal err = ENoErr;
+
+    m_PayloadSize = payloadSize;
+
+    {
+        AutoLock(g_pBenchmarkLock);
+        g_NumRunningClients += 1;
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(pUrl, 0, this, NULL);
+    if (err) {
+        gotoErr(err);
+    }
+    // This is continued in OnOpenAsyncIOStream.
+
+abort:
+    if (err) {
+        Finish(err);
+    }
+    returnErr(err);
+} // Start.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnOpenAsyncIOStream]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::OnOpenAsyncIOStream(
+                        ErrVal err,
+                        CAsyncIOStream *pAsyncIOStream,
+                        void *pContext) {
+    // Unused
+    pContext = pContext;
+
+    if ((err) || (NULL == pAsyncIOStream)) {
+        Finish(err ? err : EFail);
+        return;
+    }
+
+    m_pAsyncIOStream = pAsyncIOStream;
+    ADDREF_OBJECT(m_pAsyncIOStream);
+
+    SendRequest();
+} // OnOpenAsyncIOStream.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [SendRequest]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::SendRequest() {
+    ErrVal err = ENoErr;
+
+    if (g_fStopClients) {
+        Finish(ENoErr);
+        return;
+    }
+
+    m_RequestStartInUs = GetTimeInMicroSecs();
+
+    err = m_pAsyncIOStream->Write(g_Payload, m_PayloadSize);
+    if (err) {
+        Finish(err);
+        return;
+    }
+
+    m_pAsyncIOStream->Flush();
+    // This is continued in OnFlush.
+} // SendRequest.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnFlush]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::OnFlush(
+                        ErrVal err,
+                        CAsyncIOStream *pAsyncIOStream,
+                        void *pContext) {
+    // Unused
+    pAsyncIOStream = pAsyncIOStream;
+    pContext = pContext;
+
+    if (err) {
+        Finish(err);
+        return;
+    }
+
+    m_pAsyncIOStream->ListenForNBytes(0, m_PayloadSize);
+    // This is continued in OnReadyToRead.
+} // OnFlush.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnReadyToRead]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::OnReadyToRead(
+                        ErrVal err,
+                        int64 numBytesAvailable,
+                        CAsyncIOStream *pAsyncIOStream,
+                        void *pContext) {
+    uint64 stopTimeInUs;
+
+    // Unused
+    numBytesAvailable = numBytesAvailable;
+    pAsyncIOStream = pAsyncIOStream;
+    pContext = pContext;
+
+    if (err) {
+        Finish(err);
+        return;
+    }
+
+    // The echo may come back in several pieces.
+    if (m_pAsyncIOStream->GetDataLength() < m_PayloadSize) {
+        m_pAsyncIOStream->ListenForNBytes(0, m_PayloadSize);
+        return;
+    }
+
+    stopTimeInUs = GetTimeInMicroSecs();
+    if (g_fRecording) {
+        m_Latency.Record(stopTimeInUs - m_RequestStartInUs);
+        m_NumRequests += 1;
+    }
+
+    // Discard the response so the next one starts at position 0.
+    err = m_pAsyncIOStream->RemoveNBytes(0, (int32) m_pAsyncIOStream->GetDataLength());
+    if (err) {
+        Finish(err);
+        return;
+    }
+
+    SendRequest();
+} // OnReadyToRead.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnStreamDisconnect]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::OnStreamDisconnect(
+                        ErrVal err,
+                        CAsyncIOStream *pAsyncIOStream,
+                        void *pContext) {
+    // Unused
+    pAsyncIOStream = pAsyncIOStream;
+    pContext = pContext;
+
+    Finish(err ? err : EEOF);
+} // OnStreamDisconnect.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Finish]
+//
+// Stream events are serialized, so only one of them finishes the client.
+/////////////////////////////////////////////////////////////////////////////
+void
+CBenchmarkClient::Finish(ErrVal err) {
+    if (m_fFinished) {
+        return;
+    }
+    m_fFinished = true;
+
+    // Errors after the run is stopped are just the connection going away.
+    if ((err) && !(g_fStopClients)) {
+        m_NumErrors += 1;
+    }
+
+    if (m_pAsyncIOStream) {
+        m_pAsyncIOStream->Close();
+    }
+
+    AutoLock(g_pBenchmarkLock);
+    g_NumRunningClients -= 1;
+} // Finish.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [RunOneBenchmark]
+//
+/////////////////////////////////////////////////////////////////////////////
+static ErrVal
+RunOneBenchmark(
+            CParsedUrl *pUrl,
+            int32 numConnections,
+            int32 payloadSize,
+            int32 secondsPerRun) {
+    ErrVal err = ENoErr;
+    CBenchmarkClient **pClientList = NULL;
+    CLatencyHistogram latency;
+    int32 clientNum;
+    int32 numRunningClients;
+    int32 drainTimeInMs = 0;
+    int64 numRequests = 0;
+    int64 numErrors = 0;
+    uint64 startTimeInUs;
+    uint64 stopTimeInUs;
+    double elapsedSecs;
+
+    pClientList = (CBenchmarkClient **) memCalloc(numConnections * sizeof(CBenchmarkClient *));
+    if (NULL == pClientList) {
+        gotoErr(EFail);
+    }
+
+    g_fRecording = false;
+    g_fStopClients = false;
+
+    for (clientNum = 0; clientNum < numConnections; clientNum++) {
+        pClientList[clientNum] = newex CBenchmarkClient;
+        if (NULL == pClientList[clientNum]) {
+            gotoErr(EFail);
+        }
+        (void) pClientList[clientNum]->Start(pUrl, payloadSize);
+    }
+
+    OSIndependantLayer::SleepForMilliSecs(WARMUP_TIME_IN_MS);
+
+    g_fRecording = true;
+    startTimeInUs = GetTimeInMicroSecs();
+    OSIndependantLayer::SleepForMilliSecs(secondsPerRun * 1000);
+    g_fRecording = false;
+    stopTimeInUs = GetTimeInMicroSecs();
+
+    // Each client stops before it sends its next request.
+    g_fStopClients = true;
+    while (1) {
+        {
+            AutoLock(g_pBenchmarkLock);
+            numRunningClients = g_NumRunningClients;
+        }
+        if ((numRunningClients <= 0) || (drainTimeInMs >= MAX_DRAIN_TIME_IN_MS)) {
+            break;
+        }
+        OSIndependantLayer::SleepForMilliSecs(DRAIN_POLL_TIME_IN_MS);
+        drainTimeInMs += DRAIN_POLL_TIME_IN_MS;
+    }
+
+    for (clientNum = 0; clientNum < numConnections; clientNum++) {
+        numRequests += pClientList[clientNum]->m_NumRequests;
+        numErrors += pClientList[clientNum]->m_NumErrors;
+        latency.Merge(&(pClientList[clientNum]->m_Latency));
+    }
+
+    elapsedSecs = ((double) (stopTimeInUs - startTimeInUs)) / 1000000.0;
+    printf("{\"test\":\"tcp_echo\", \"connections\":%d, \"payload_bytes\":%d, "
+           "\"seconds\":%.3f, \"requests\":" INT64FMT ", \"requests_per_sec\":%.1f, "
+           "\"bytes_per_sec\":%.1f, \"p50_us\":" INT64FMT ", \"p99_us\":" INT64FMT ", "
+           "\"p999_us\":" INT64FMT ", \"errors\":" INT64FMT ", \"stuck_connections\":%d}\n",
+           numConnections,
+           payloadSize,
+           elapsedSecs,
+           numRequests,
+           ((double) numRequests) / elapsedSecs,
+           ((double) numRequests * (double) payloadSize) / elapsedSecs,
+           (int64) latency.GetPercentile(0.50),
+           (int64) latency.GetPercentile(0.99),
+           (int64) latency.GetPercentile(0.999),
+           numErrors,
+           numRunningClients);
+    fflush(stdout);
+
+abort:
+    if (pClientList) {
+        for (clientNum = 0; clientNum < numConnections; clientNum++) {
+            RELEASE_OBJECT(pClientList[clientNum]);
+        }
+        memFree(pClientList);
+    }
+
+    returnErr(err);
+} // RunOneBenchmark.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [main]
+//
+/////////////////////////////////////////////////////////////////////////////
+int
+main(int argc, char *argv[]) {
+    ErrVal err = ENoErr;
+    int32 secondsPerRun = DEFAULT_SECONDS_PER_RUN;
+    int32 portNum = DEFAULT_BENCHMARK_PORT;
+    CEchoServer *pServer = NULL;
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    CParsedUrl *pUrl = NULL;
+    int32 connectionIndex;
+    int32 payloadIndex;
+    char urlBuffer[CParsedUrl::MAX_URL_LENGTH];
+
+    if (argc > 1) {
+        secondsPerRun = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        portNum = atoi(argv[2]);
+    }
+    if ((secondsPerRun <= 0) || (portNum <= 0) || (portNum > 65535)) {
+        fprintf(stderr, "Usage: %s [secondsPerRun] [port]\n", argv[0]);
+        return(1);
+    }
+
+    // A benchmark should never stop in the debugger.
+    g_AllowBreakToDebugger = false;
+
+    err = CBuildingBlocks::Initialize(CBuildingBlocks::FULL_FUNCTIONALITY, NULL);
+    if (err) {
+        gotoErr(err);
+    }
+
+    g_pBenchmarkLock = newex CRefLock;
+    if (NULL == g_pBenchmarkLock) {
+        gotoErr(EFail);
+    }
+    err = g_pBenchmarkLock->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    memset(g_Payload, 'x', sizeof(g_Payload));
+
+    pServer = newex CEchoServer;
+    if (NULL == pServer) {
+        gotoErr(EFail);
+    }
+    err = NetIO_OpenServerBlockIO(
+                    (uint16) portNum,
+                    true, // fUse127001Address
+                    pServer,
+                    &pListenBlockIO);
+    if (err) {
+        fprintf(stderr, "Cannot listen on port %d\n", portNum);
+        gotoErr(err);
+    }
+
+    // Clients connect by address, so they never wait on a name lookup.
+    snprintf(urlBuffer, sizeof(urlBuffer), "ip://127.0.0.1:%d", portNum);
+    pUrl = CParsedUrl::AllocateUrl(urlBuffer);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
+    if (NULL == pUrl->m_pSockAddr) {
+        gotoErr(EFail);
+    }
+    err = NetIO_LookupHost((char *) "127.0.0.1", (uint16) portNum, pUrl->m_pSockAddr);
+    if (err) {
+        gotoErr(err);
+    }
+
+    for (connectionIndex = 0; connectionIndex < NUM_CONNECTION_COUNTS; connectionIndex++) {
+        for (payloadIndex = 0; payloadIndex < NUM_PAYLOAD_SIZES; payloadIndex++) {
+            err = RunOneBenchmark(
+                        pUrl,
+                        g_ConnectionCountList[connectionIndex],
+                        g_PayloadSizeList[payloadIndex],
+                        secondsPerRun);
+            if (err) {
+                gotoErr(err);
+            }
+        }
+    }
+
+abort:
+    RELEASE_OBJECT(pUrl);
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    RELEASE_OBJECT(pServer);
+    RELEASE_OBJECT(g_pBenchmarkLock);
+
+    CBuildingBlocks::Shutdown();
+
+    return(err ? 1 : 0);
+} // main.
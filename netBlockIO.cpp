@@ -35,8 +35,21 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#define USE_EPOLL_REACTOR  1
+#define USE_IO_URING  1
+#define USE_VECTORED_WRITES  1
+#define USE_BATCHED_DATAGRAMS  1
+#define USE_REUSEPORT_LISTENERS  1
 #endif
 
 #if WIN32
@@ -55,6 +68,7 @@
 #include "stringParse.h"
 #include "queue.h"
 #include "jobQueue.h"
+#include "timerWheel.h"
 #include "rbTree.h"
 #include "nameTable.h"
 #include "url.h"
@@ -70,6 +84,9 @@ extern "C" void SOCKSinit(char *s);
 #endif // USE_SOCKS
 
 static void SelectThreadProc(void *arg, CSimpleThread *threadState);
+#if USE_IO_URING
+static void UringThreadProc(void *arg, CSimpleThread *threadState);
+#endif
 
 static char g_LocalServerURL[] = "ip://127.0.0.1";
 static int32 g_LocalServerURLLength = 14;
@@ -77,7 +94,6 @@ static int32 g_LocalServerURLLength = 14;
 static char g_IncomingIPAddressURL[] = "ip://0.0.0.0";
 static int32 g_IncomingIPAddressURLLength = 12;
 
-#define MAX_TIMEOUTS_PER_CHECK          64
 #define MAX_SYSTEM_CALL_INTERRUPTS      5
 
 
@@ -85,6 +101,8 @@ static int32 g_IncomingIPAddressURLLength = 12;
 #define SOCKET_ERROR -1
 #define IO_WOULD_BLOCK(_lastErr) ((EWOULDBLOCK == _lastErr) || (EINPROGRESS == _lastErr))
 #define IO_NOT_CONNECTED_ERROR(_lastErr) ((ENOTCONN == _lastErr))
+#define IO_REFUSED_ERROR(_lastErr) ((ECONNREFUSED == _lastErr) || (ECONNRESET == _lastErr))
+#define IO_UNREACHABLE_ERROR(_lastErr) ((ENETUNREACH == _lastErr) || (EHOSTUNREACH == _lastErr))
 #define IGNORE_SYSTEMCALL_ERROR() 0
 // (EPIPE == GET_LAST_ERROR())
 #endif
@@ -92,6 +110,8 @@ static int32 g_IncomingIPAddressURLLength = 12;
 #if WIN32
 #define IO_WOULD_BLOCK(_lastErr) (WSAEWOULDBLOCK == _lastErr)
 #define IO_NOT_CONNECTED_ERROR(_lastErr) 0
+#define IO_REFUSED_ERROR(_lastErr) ((WSAECONNREFUSED == _lastErr) || (WSAECONNRESET == _lastErr))
+#define IO_UNREACHABLE_ERROR(_lastErr) ((WSAENETUNREACH == _lastErr) || (WSAEHOSTUNREACH == _lastErr))
 typedef int32 socklen_t;
 #define IGNORE_SYSTEMCALL_ERROR() 0
 #define MSG_NOSIGNAL 0
@@ -102,6 +122,12 @@ typedef int32 socklen_t;
 extern CConfigSection *g_pBuildingBlocksConfig;
 static const char g_NetworkProxyHostConfigValueName[] = "Network Proxy";
 static const char g_NetworkProxyPortConfigValueName[] = "Network Proxy Port";
+static const char g_NetworkUseEpollConfigValueName[] = "Network Use Epoll";
+static const char g_NetworkMaxConnectionsConfigValueName[] = "Network Max Connections";
+static const char g_NetworkUseIOUringConfigValueName[] = "Network Use IO Uring";
+static const char g_NetworkNumReactorsConfigValueName[] = "Network Reactor Threads";
+static const char g_NetworkListenersPerPortConfigValueName[] = "Network Listeners Per Port";
+static const char g_NetworkSocketBufferSizeConfigValueName[] = "Network Socket Buffer Size";
 
 
 #if WIN32
@@ -112,11 +138,14 @@ typedef int OSSocket;
 #define NULL_SOCKET  -1
 #endif
 
+class CNetReactor;
+
 
 
 /////////////////////////////////////////////////////////////////////////////
 // This describes one network connection.
 class CNetBlockIO : public CAsyncBlockIO,
+                    public CTimerCallback,
                     public CRBTree::CNode {
 public:
     CNetBlockIO();
@@ -129,6 +158,15 @@ public:
     virtual ErrVal Resize(int64 newLength);
     virtual void CancelTimeout(int32 opType);
     virtual void StartTimeout(int32 opType);
+    virtual void StartWriteChain();
+    virtual void EndWriteChain();
+    virtual bool CanSendFromFile();
+
+    // CTimerCallback
+    virtual void OnTimer(CTimer *pTimer);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
 
     // CDebugObject
     virtual ErrVal CheckState();
@@ -151,15 +189,33 @@ protected:
     virtual ErrVal DoPendingWrite(
                         CIOBuffer *pBuffer,
                         bool *pFinished);
-    bool CheckTimeout(uint64 value, int32 *pTimeoutOp);
+#if USE_VECTORED_WRITES
+    ErrVal DoPendingWriteChain(bool *pFinished, bool *pSentData);
+    void SendWriteChain();
+
+    // TCP writes always go through the write chain. UDP datagrams do
+    // when they can be sent in batches.
+    bool UsesWriteChain() {
+#if USE_BATCHED_DATAGRAMS
+        return(true);
+#else
+        return(!(m_BlockIOFlags & UDP_SOCKET));
+#endif
+    }
+#endif
+#if USE_BATCHED_DATAGRAMS
+    ErrVal DoPendingDatagramReads();
+    ErrVal DoPendingDatagramWrites(bool *pFinished, bool *pSentData);
+#endif
+    bool StopTimeoutTimer();
     ErrVal PrepareToDisconnect();
+#if USE_IO_URING
+    void FinishUringRecv(CIOBuffer *pBuffer, int32 result);
+    void FinishUringSend(CIOBuffer *pBuffer, int32 result);
+#endif
 
 
     enum CNetBlockIOPrivateConstants {
-        // Be REALLY careful. We subtract time from the timeout
-        // every interval, so the first interval may happen immediately
-        // after we start waiting. This means each timeout should be padded
-        // with one interval duration.
         DEFAULT_CONNECT_TIMEOUT_IN_MS   = 150 * 1000,
         DEFAULT_WRITE_TIMEOUT_IN_MS     = 150 * 1000,
         DEFAULT_READ_TIMEOUT_IN_MS      = 200 * 1000,
@@ -173,6 +229,30 @@ protected:
         NEVER_TIMEOUT                   = 0x00400000,
         UDP_SOCKET                      = 0x00800000,
 
+        // These are only used when the socket does its IO through io_uring.
+        URING_SOCKET                    = 0x01000000,
+        URING_RECV_POSTED               = 0x02000000,
+        URING_SEND_POSTED               = 0x04000000,
+
+        // Writes are held until the write chain is ended.
+        WRITE_CHAIN_OPEN                = 0x08000000,
+
+        // This is one of several listeners bound to the same port with
+        // SO_REUSEPORT. Connections it accepts stay on its reactor.
+        REUSEPORT_LISTENER              = 0x10000000,
+
+        // This is the most buffers we send with a single sendmsg.
+        MAX_WRITE_CHAIN_BUFFERS         = 64,
+
+        // This is the most datagrams we receive or send with a single
+        // recvmmsg or sendmmsg.
+        MAX_DATAGRAM_BATCH              = 32,
+
+        // This is the most connections a listener accepts for one readiness
+        // event. The socket is level-triggered, so any more are accepted
+        // on the next pass, after the other sockets on the reactor.
+        MAX_ACCEPTS_PER_EVENT           = 256,
+
         // The type of socket.
         SOCKET_TYPE_TCP                 = 1,
         SOCKET_TYPE_UDP                 = 2,
@@ -187,22 +267,52 @@ protected:
 
     CQueueHook<CNetBlockIO> m_PendingCloseList;
 
+    // This is the reactor thread that watches this socket. It is picked
+    // when the blockIO is allocated and never changes.
+    CNetReactor             *m_pReactor;
+    CQueueHook<CNetBlockIO> m_ReactorBlockIOs;
+
     // This is a list of buffers for pending IO operations.
     CQueueList<CIOBuffer>   m_PendingWrites;
     CQueueList<CIOBuffer>   m_PendingReads;
 
+#if USE_BATCHED_DATAGRAMS
+    // These are buffers that were allocated for a batch of unsolicited
+    // datagrams but were not filled. They are used by the next batch.
+    CQueueList<CIOBuffer>   m_SpareDatagramBuffers;
+#endif
+
     // This is the destination of all UDP datagrams on this blockIO.
     struct sockaddr_in      m_UDPDatagramDest;
 
+#if USE_REUSEPORT_LISTENERS
+    // These are the other listeners on the same port. The first listener
+    // holds a reference to each of them, and closes them when it is closed.
+    CNetBlockIO             *m_pNextListener;
+#endif
+
     // This is the timeout. A blockIO can only wait for
     // one thing at a time, so it can only timeout for 1
-    // thing at a time. m_CurrentTimeoutInMs MUST BE AN INTEGER or else
-    // it becomes huge positive numbers when it goes below 0.
-    int64                   m_CurrentTimeoutRemainingInMs;
+    // thing at a time. The timer is on the timer wheel of
+    // this blockIO's reactor, and it holds a reference to the
+    // blockIO while it is armed.
+    CTimer                  m_TimeoutTimer;
+    bool                    m_fTimeoutHoldsReference;
     int32                   m_CurrentTimeoutOp;
     int8                    m_NumTimeouts;
     int32                   m_ReadTimeout;
     int32                   m_ConnectTimeout;
+
+    // This is the set of events the select thread is listening for on
+    // this socket. It is only changed by WatchSocket and UnwatchSocket.
+    int32                   m_WatchedEvents;
+
+#if USE_IO_URING
+    // The kernel reads or writes this address while a connect or
+    // accept is posted to the ring, so it must live in the blockIO.
+    struct sockaddr_in      m_UringAddr;
+    socklen_t               m_UringAddrLen;
+#endif
 }; // CNetBlockIO
 
 
@@ -232,74 +342,225 @@ public:
                         bool fUse127001Address,
                         CAsyncBlockIOCallback *pCallback,
                         CAsyncBlockIO **ppResultBlockIO);
+    ErrVal OpenDatagramBlockIO(
+                        uint16 portNum,
+                        bool fUse127001Address,
+                        const struct sockaddr_in *pDestAddr,
+                        CAsyncBlockIOCallback *pCallback,
+                        CAsyncBlockIO **ppResultBlockIO);
     ErrVal ReceiveDataFromAcceptedConnection(
                         CNetBlockIO *pBlockIO,
                         CAsyncBlockIOCallback *pCallback);
+    ErrVal GetServerPort(CNetBlockIO *pBlockIO, uint16 *pPortNum);
     void GetLocalAddr(struct sockaddr_in *addr);
     static ErrVal GetLocalHostName(char *host, int32 maxHostLength);
     void WaitForAllBlockIOsToClose();
+#if INCLUDE_REGRESSION_TESTS
+    ErrVal Restart(const CNetIOTestSettings *pSettings);
+#endif
+
+    // General purpose timers. These fire on a reactor thread.
+    ErrVal StartTimer(CTimer *pTimer, int32 delayInMs);
 
     // This is called by the top-level select thread wrapper. It executes all
     // select thread functions, and doesn't return until the select thread exits.
-    void SelectThread();
+    void SelectThread(CNetReactor *pReactor);
+#if USE_IO_URING
+    void UringThread();
+#endif
 
     // CDebugObject
     virtual ErrVal CheckState();
 
 private:
     friend class CNetBlockIO;
+    friend class CNetReactor;
 
     enum CNetIOSystemPrivateConstants
     {
         NETWORK_MTU  = 1400, // 1270, 1452,
 
+        // This is the longest a reactor thread sleeps. It wakes up
+        // sooner if a timer on its timer wheel is about to fire.
         SELECT_TIMEOUT_IN_MS = 5000,
-        SELECT_TIMEOUT_IN_MICROSECS = SELECT_TIMEOUT_IN_MS * 1000,
+        TIMER_TICK_IN_MS    = 10,
+
+        // These are the events we can listen for on a socket.
+        READ_EVENTS         = 0x01,
+        WRITE_EVENTS        = 0x02,
+        EXCEPTION_EVENTS    = 0x04,
+        ALL_SOCKET_EVENTS   = (READ_EVENTS | WRITE_EVENTS | EXCEPTION_EVENTS),
+
+        // epoll is not limited by FD_SETSIZE, so this is just a sanity
+        // limit. The real limit is the process file descriptor limit.
+        DEFAULT_MAX_EPOLL_BLOCKIOS = 65536,
+
+        // This is the send and receive buffer of each TCP socket. A 64KB
+        // write must not have to wait for the peer's ACK halfway through.
+        DEFAULT_SOCKET_BUFFER_BYTES = 256 * 1024,
+
+        // By default, there is one reactor thread per core.
+        MAX_REACTORS            = 64,
+
+        // The operation of an io_uring request is kept in the top byte
+        // of its user data. The rest is a CIOBuffer or CNetBlockIO pointer.
+        IO_URING_NUM_ENTRIES    = 1024,
+        URING_OP_SHIFT          = 56,
+        URING_STOP_OP           = 0,
+        URING_RECV_OP           = 1,
+        URING_SEND_OP           = 2,
+        URING_CONNECT_OP        = 3,
+        URING_ACCEPT_OP         = 4,
+        URING_CANCEL_OP         = 5,
     };
 
     ErrVal InitNetIOSystem();
+    ErrVal InitReactor(CNetReactor *pReactor);
+    ErrVal OpenListenerSocket(
+                    bool fIsUDP,
+                    uint16 portNum,
+                    bool fUse127001Address,
+                    int32 reactorNum,
+                    CAsyncBlockIOCallback *pCallback,
+                    CNetBlockIO **ppResultBlockIO);
+    void ShutdownReactor(CNetReactor *pReactor);
+    CNetReactor *PickReactor();
+    ErrVal AddBlockIOToReactor(CNetBlockIO *pBlockIO);
+
+    // These change which events the select thread listens for on a socket.
+    void WatchSocket(CNetBlockIO *pBlockIO, int32 events);
+    void UnwatchSocket(CNetBlockIO *pBlockIO, int32 events);
+#if USE_EPOLL_REACTOR
+    void EpollThread(CNetReactor *pReactor);
+    ErrVal UpdateEpollRegistration(CNetBlockIO *pBlockIO, int32 newEvents);
+#endif
+
+#if USE_IO_URING
+    // These are the io_uring versions of the select thread functions.
+    // Reads, writes, connects and accepts are posted directly to the ring,
+    // and complete on the uring thread without a readiness notification.
+    void ProcessUringCompletion(uint64 userData, int32 result);
+    ErrVal UringPostRecv(CNetBlockIO *pBlockIO);
+    ErrVal UringPostSend(CNetBlockIO *pBlockIO);
+    ErrVal UringPostConnect(CNetBlockIO *pBlockIO);
+    ErrVal UringPollConnect(CNetBlockIO *pBlockIO);
+    ErrVal UringPostAccept(CNetBlockIO *pBlockIO);
+    void UringCancel(CNetBlockIO *pBlockIO);
+#endif
 
     // Creating and deleting a network blockIO.
     CNetBlockIO *AllocNetBlockIO(
                     CParsedUrl *pUrl,
                     OSSocket socketID,
                     int32 connectionFlags,
-                    CAsyncBlockIOCallback *pCallback);
+                    CAsyncBlockIOCallback *pCallback,
+                    CNetReactor *pReactor);
     ErrVal SetSocketBufSizeImpl(OSSocket sock, bool writeBuf, int numBytes);
     void DisconnectSocket(CNetBlockIO *netIO);
 
     // These are functions performed in the main select thread.
-    ErrVal ProcessActiveSockets();
+    ErrVal ProcessActiveSockets(CNetReactor *pReactor);
     void ProcessReadEvent(CNetBlockIO *connection);
     void ProcessWriteEvent(CNetBlockIO *connection);
     void ProcessExceptionEvent(CNetBlockIO *connection);
-    void AdjustBlockIOs();
+    int32 GetConnectResult(OSSocket sock);
+    ErrVal TranslateConnectError(int32 result);
+    void AdjustBlockIOs(CNetReactor *pReactor);
+    int32 GetReactorWaitTime(CNetReactor *pReactor);
+    void FireTimeout(CNetBlockIO *pBlockIO, int32 timeoutOp);
     void AcceptConnection(
                     CNetBlockIO *serverConnection,
                     OSSocket socketID,
-                    struct sockaddr_in *netAddr);
+                    struct sockaddr_in *netAddr,
+                    bool fIsNonBlocking);
     void ReportSocketIsActive(
                     CNetBlockIO *connection,
                     ErrVal wakeUpErr,
                     int32 op);
-    ErrVal DrainNotificationData(OSSocket sock);
+    ErrVal DrainNotificationData(CNetReactor *pReactor);
     void SafeCloseSocket(OSSocket sock, bool fUDP);
-    ErrVal WakeSelectThread();
+    ErrVal WakeSelectThread(CNetReactor *pReactor);
 
     ErrVal MakeSocketNonBlocking(OSSocket socket);
 
     // This is our network address.
     struct sockaddr_in      m_LocalAddr;
 
-    // The state of the connect thread.
+    // The reactor threads. Each one owns a disjoint set of sockets, and has
+    // its own lock and wakeup socket, so reactors never contend with each
+    // other while they dispatch events.
+    CNetReactor             **m_pReactorList;
+    int32                   m_NumReactors;
+    int32                   m_NextReactor;
+    bool                    m_StopSelectThread;
+
+#if USE_REUSEPORT_LISTENERS
+    // This is how many listening sockets OpenServerBlockIO binds to one
+    // TCP port with SO_REUSEPORT. Each is on a different reactor, and the
+    // kernel spreads incoming connections over them.
+    int32                   m_NumListenersPerPort;
+#endif
+
+    // This is the most network connections. Each reactor allows its share
+    // of them.
+    int32                   m_MaxNumBlockIOs;
+
+    uint32                  m_NumBytesPerSocketBuffer;
+
+#if USE_EPOLL_REACTOR
+    // When this is set, the reactor threads wait with epoll rather than
+    // select. The reactor fd_sets are then unused.
+    bool                    m_fUseEpoll;
+#endif
+
+#if USE_IO_URING
+    // When this is set, TCP sockets do their IO through the ring and
+    // are never added to the select or epoll set.
+    bool                    m_fUseIOUring;
+    CIOUring                *m_pIOUring;
+    CSimpleThread           *m_pUringThread;
+    CRefEvent               *m_pUringThreadStopped;
+#endif
+
+#if INCLUDE_REGRESSION_TESTS
+    // These override the config file. See NetIO_RestartNetIOSystem.
+    CNetIOTestSettings      m_TestSettings;
+#endif
+}; // CNetIOSystem
+
+static CNetIOSystem *g_pNetIOSystemImpl = NULL;
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is the state of one reactor thread. The thread itself is run by
+// CNetIOSystem::SelectThread. m_pLock protects everything here, and it is
+// always taken after any blockIO lock and after the CNetIOSystem lock.
+class CNetReactor {
+public:
+    CNetReactor();
+    virtual ~CNetReactor();
+    NEWEX_IMPL()
+
+private:
+    friend class CNetIOSystem;
+    friend class CNetBlockIO;
+
+    enum CNetReactorPrivateConstants {
+        MAX_EPOLL_EVENTS_PER_WAIT = 256,
+    };
+
+    int32                   m_ReactorNum;
+    CRefLock                *m_pLock;
+
+    // The state of the reactor thread.
     CSimpleThread           *m_pSelectThread;
-    bool                    m_SelectThreadIsRunning;
     OSSocket                m_WakeUpThreadSend;
     OSSocket                m_WakeUpThreadListener;
     OSSocket                m_WakeUpThreadReceive;
     struct sockaddr_in      m_wakeUpConnAddr;
     bool                    m_fPendingWakeupMessage;
-    bool                    m_StopSelectThread;
     CRefEvent               *m_pSelectThreadStopped;
 
     // The socket list used by the select thread.
@@ -312,19 +573,32 @@ private:
     OSSocket                m_FdRange;
     OSSocket                m_ResultFdRange;
 
-    // All active network connections.
-    CNameTable              *m_ActiveSocketTable;
-    int32                   m_MaxNumBlockIOs;
+    // All blockIOs whose sockets this reactor watches. Only the reactor
+    // thread removes items, so it may walk the list while other threads add
+    // to it.
+    CQueueList<CNetBlockIO> m_BlockIOs;
+
+    // All open blockIOs on this reactor, and the table that maps their
+    // sockets to them. Connecting, accepting and closing a socket only
+    // lock the reactor of that socket, never the whole IO system.
+    CQueueList<CAsyncBlockIO> m_ActiveBlockIOs;
+    CNameTable              *m_pSocketTable;
 
     // Async close queue
     CQueueList<CNetBlockIO> m_PendingCloseList;
     CRefEvent               *m_pEmptyPendingCloseBlockIOs;
 
-    uint32                  m_NumBytesPerSocketBuffer;
-    uint64                  m_PrevCheckForTimeoutsTime;
-}; // CNetIOSystem
+    // All timers that fire on this reactor thread, including the
+    // timeouts of its blockIOs. m_WaitDeadline is when the reactor thread
+    // will next wake up on its own. Both are protected by m_pLock.
+    CTimerWheel             m_TimerWheel;
+    uint64                  m_WaitDeadline;
 
-static CNetIOSystem *g_pNetIOSystemImpl = NULL;
+#if USE_EPOLL_REACTOR
+    int                     m_EpollFd;
+    struct epoll_event      m_EpollEvents[MAX_EPOLL_EVENTS_PER_WAIT];
+#endif
+}; // CNetReactor
 
 
 
@@ -356,7 +630,7 @@ InitializeNetBlockIO() {
 // [CNetBlockIO]
 //
 /////////////////////////////////////////////////////////////////////////////
-CNetBlockIO::CNetBlockIO() : m_PendingCloseList(this) {
+CNetBlockIO::CNetBlockIO() : m_PendingCloseList(this), m_ReactorBlockIOs(this) {
     m_MediaType = NETWORK_MEDIA;
     m_fSeekable = false;
 
@@ -364,12 +638,32 @@ CNetBlockIO::CNetBlockIO() : m_PendingCloseList(this) {
 
     m_PendingWrites.ResetQueue();
     m_PendingReads.ResetQueue();
+#if USE_BATCHED_DATAGRAMS
+    m_SpareDatagramBuffers.ResetQueue();
+#endif
+    memset(&m_UDPDatagramDest, 0, sizeof(m_UDPDatagramDest));
 
-    m_CurrentTimeoutRemainingInMs = -1;
+    m_TimeoutTimer.m_pCallback = this;
+    m_TimeoutTimer.m_pContext = this;
+    m_fTimeoutHoldsReference = false;
     m_NumTimeouts = 0;
     m_CurrentTimeoutOp = CIOBuffer::NO_OP;
     m_ReadTimeout = DEFAULT_READ_TIMEOUT_IN_MS;
     m_ConnectTimeout = DEFAULT_CONNECT_TIMEOUT_IN_MS;
+
+    m_WatchedEvents = 0;
+
+    m_pReactor = NULL;
+    m_ReactorBlockIOs.ResetQueue();
+
+#if USE_REUSEPORT_LISTENERS
+    m_pNextListener = NULL;
+#endif
+
+#if USE_IO_URING
+    memset(&m_UringAddr, 0, sizeof(m_UringAddr));
+    m_UringAddrLen = 0;
+#endif
 } // CNetBlockIO.
 
 
@@ -382,9 +676,27 @@ CNetBlockIO::CNetBlockIO() : m_PendingCloseList(this) {
 //
 /////////////////////////////////////////////////////////////////////////////
 CNetBlockIO::~CNetBlockIO() {
+#if USE_BATCHED_DATAGRAMS
+    CIOBuffer *pBuffer;
+#endif
+
     if (NULL_SOCKET != m_Socket) {
         DEBUG_WARNING("net Block IO closing a valid handle.");
     }
+
+#if USE_BATCHED_DATAGRAMS
+    while (1) {
+        pBuffer = m_SpareDatagramBuffers.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+        RELEASE_OBJECT(pBuffer);
+    }
+#endif
+
+#if USE_REUSEPORT_LISTENERS
+    RELEASE_OBJECT(m_pNextListener);
+#endif
 } // ~CNetBlockIO.
 
 
@@ -444,12 +756,22 @@ CNetBlockIO::Flush() {
 /////////////////////////////////////////////////////////////////////////////
 void
 CNetBlockIO::Close() {
-
+#if USE_REUSEPORT_LISTENERS
+    CNetBlockIO *pListener;
+#endif
     AutoLock(m_pLock);
     RunChecksOnce();
 
     DEBUG_LOG("CNetBlockIO::Close: pBlockIOPtr = %p.", this);
 
+    // The list of open blockIOs is protected by the reactor lock, so
+    // remove this before CAsyncBlockIO::Close drops its reference.
+    if (NULL != m_pReactor) {
+        m_pReactor->m_pLock->Lock();
+        m_ActiveBlockIOs.RemoveFromQueue();
+        m_pReactor->m_pLock->Unlock();
+    }
+
     CAsyncBlockIO::Close();
 
     // To avoid a race condition with the select thread,
@@ -458,6 +780,19 @@ CNetBlockIO::Close() {
     if (NULL_SOCKET != m_Socket) {
         (void) PrepareToDisconnect();
     }
+
+#if USE_REUSEPORT_LISTENERS
+    // Close the other listeners on this port. They never lock this
+    // blockIO, so it is safe to hold our lock while we take theirs.
+    while (NULL != m_pNextListener) {
+        pListener = m_pNextListener;
+        m_pNextListener = pListener->m_pNextListener;
+        pListener->m_pNextListener = NULL;
+
+        pListener->Close();
+        RELEASE_OBJECT(pListener);
+    }
+#endif
 } // Close
 
 
@@ -758,201 +1093,348 @@ abort:
 
 
 
+#if USE_VECTORED_WRITES
 /////////////////////////////////////////////////////////////////////////////
 //
-// [ReadBlockAsyncImpl]
+// [DoPendingWriteChain]
 //
-// This is called by the client code to read the socket. We try to read
-// immediately, and if that fails then we queue the buffer up to be read when
-// select fires.
+// This sends the buffers on the pending write list with a single sendmsg.
+// Every buffer that is completely sent is removed from the list and
+// completed. *pFinished is true when the list is empty.
 /////////////////////////////////////////////////////////////////////////////
-void
-CNetBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
+ErrVal
+CNetBlockIO::DoPendingWriteChain(bool *pFinished, bool *pSentData) {
     ErrVal err = ENoErr;
-    ErrVal err2 = ENoErr;
-    bool fFinished = false;
-    bool ReadFullBuffer = false;
+    struct iovec ioVecList[MAX_WRITE_CHAIN_BUFFERS];
+    struct msghdr msgHeader;
+    int32 numIOVecs = 0;
+    int32 bytesWritten;
+    int32 bytesInBuffer;
+    int32 lastErr = 0;
+    int32 numRetries = 0;
+    CIOBuffer *pBuffer;
+    CIOBuffer *pSendFileBuffer = NULL;
+    int fileFD = -1;
+    off_t fileOffset = 0;
+    CQueueList<CIOBuffer> completedBuffers;
     AutoLock(m_pLock);
     RunChecks();
 
-    if (NULL == pBuffer) {
-        return;
+    if ((NULL == pFinished) || (NULL == pSentData)) {
+        gotoErr(EFail);
     }
+    *pFinished = false;
+    *pSentData = false;
 
-    // Check if we can read right away. This is a fast path, and will avoid a lot
-    // of thread jumps.
-    err = DoPendingRead(pBuffer, &ReadFullBuffer, &fFinished);
-    if ((err) && (EEOF != err)) {
-        DEBUG_LOG("ReadBlockAsyncImpl. DoPendingRead returned an error " ERRFMT, err);
-        fFinished = false;
+#if USE_BATCHED_DATAGRAMS
+    // Each UDP buffer is a separate datagram, so they cannot be gathered
+    // into one message. They are sent as a batch of messages instead.
+    if (m_BlockIOFlags & UDP_SOCKET) {
+        err = DoPendingDatagramWrites(pFinished, pSentData);
         gotoErr(err);
     }
+#endif
+
+    // IO does NOT has to be block-aligned for a network device.
+    // A buffer that sends bytes from a file is sent by itself with
+    // sendfile, so the gather list stops at the next one.
+    pBuffer = m_PendingWrites.GetHead();
+    if ((pBuffer) && (pBuffer->m_BufferFlags & CIOBuffer::SEND_FROM_FILE)) {
+        pSendFileBuffer = pBuffer;
+        numIOVecs = 1;
+    }
+    while ((pBuffer)
+            && (NULL == pSendFileBuffer)
+            && !(pBuffer->m_BufferFlags & CIOBuffer::SEND_FROM_FILE)
+            && (numIOVecs < MAX_WRITE_CHAIN_BUFFERS)) {
+        ioVecList[numIOVecs].iov_base = pBuffer->m_pLogicalBuffer + pBuffer->m_StartWriteOffset;
+        ioVecList[numIOVecs].iov_len = pBuffer->m_NumValidBytes - pBuffer->m_StartWriteOffset;
+        numIOVecs++;
+        pBuffer = pBuffer->m_BlockIOBufferList.GetNextInQueue();
+    }
+    if (0 == numIOVecs) {
+        *pFinished = true;
+        gotoErr(ENoErr);
+    }
 
-    // If there is more data to read, then add this socket to the list of
-    // pending reads. We will complete the read when select fires.
-    if (!fFinished) {
-        // There is no race condition with the select thread. If the
-        // socket becomes readable/writeable while we are in the process
-        // of adding it to the select list, then select will simply
-        // immediately return.
+    if (pSendFileBuffer) {
+        fileFD = pSendFileBuffer->m_pSendFileSource->GetFileDescriptor();
+        fileOffset = (off_t) (pSendFileBuffer->m_SendFilePos + pSendFileBuffer->m_StartWriteOffset);
+    }
 
-        // Put this buffer on the queue so the select thread can find
-        // it later when we can resume the IO operation.
-        m_PendingReads.InsertTail(&(pBuffer->m_BlockIOBufferList));
-        ADDREF_OBJECT(pBuffer);
+    DEBUG_LOG("CNetBlockIO::DoPendingWriteChain: pBlockIOPtr = %p, numBuffers = %d.", this, numIOVecs);
 
-        m_BlockIOFlags |= WAITING_TO_READ;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = ioVecList;
+    msgHeader.msg_iovlen = numIOVecs;
 
-        // We do not have to tell select() to listen on this socket,
-        // since it listens for reads on all sockets.
-    } // (!Finished)
+    // We may have to loop several times to ignore system call failures on Linux.
+    while (1) {
+        if (pSendFileBuffer) {
+            // sendfile leaves fileOffset alone when it fails.
+            if (fileFD < 0) {
+                bytesWritten = SOCKET_ERROR;
+                lastErr = EBADF;
+                break;
+            }
+            bytesWritten = sendfile(
+                                m_Socket,
+                                fileFD,
+                                &fileOffset,
+                                pSendFileBuffer->m_NumValidBytes - pSendFileBuffer->m_StartWriteOffset);
+        } else {
+            // MSG_NOSIGNAL means dont send EPIPE on peer reset.
+            bytesWritten = sendmsg(m_Socket, &msgHeader, MSG_NOSIGNAL);
+        }
+        // Get the last error immediately after the system call.
+        // Anything code, even a DEBUG_LOG, may touch a file and
+        // change the last error.
+        lastErr = GET_LAST_ERROR();
 
+        if ((bytesWritten < 0)
+            && (IGNORE_SYSTEMCALL_ERROR())
+            && (numRetries < MAX_SYSTEM_CALL_INTERRUPTS)) {
+            DEBUG_LOG("CNetBlockIO::DoPendingWriteChain: Ignoring EPIPE.");
+            numRetries++;
+            continue;
+        }
 
-    // Close the socket so it is removed from the read select list.
-    // Otherwise, the socket will continually select that it is ready
-    // to read.
-    if (EEOF == err) {
-        DEBUG_LOG("ReadBlockAsyncImpl. Socket closed, calling PrepareToDisconnect");
-        err2 = PrepareToDisconnect();
-        if (err2) {
-            DEBUG_LOG("ReadBlockAsyncImpl. PrepareToDisconnect failed. err2 = %d", err2);
-            //err = err2;
+        break;
+    } // while (1)
+
+    if ((SOCKET_ERROR == bytesWritten) && (IO_WOULD_BLOCK(lastErr))) {
+        bytesWritten = 0;
+    } else if (bytesWritten < 0) {
+        DEBUG_LOG("CNetBlockIO::DoPendingWriteChain: sendmsg failed. errno = %d.",
+                  lastErr);
+
+        // Any error completes every write. This is not a bad error, web
+        // servers may mark the the document by closing the pBlockIO.
+        err = EPeerDisconnected;
+        bytesWritten = 0;
+    } else if ((pSendFileBuffer) && (0 == bytesWritten)) {
+        // The file is shorter than the range we were asked to send.
+        DEBUG_LOG("CNetBlockIO::DoPendingWriteChain: sendfile hit the end of the file.");
+        err = EEOF;
+    } else {
+        DEBUG_LOG("CNetBlockIO::DoPendingWriteChain: sendmsg succeeded. Sent %d bytes",
+                  bytesWritten);
+        if (bytesWritten > 0) {
+            *pSentData = true;
         }
-    } // if (EEOF == err)
+    }
 
-abort:
-    if ((err) && !(fFinished)) {
-        FinishIO(pBuffer, err, 0);
+    // Retire every buffer that was completely sent. Do not change
+    // m_MediaSize for writing to the socket, we only change the mediaSize
+    // when we receive new data from the socket.
+    while (numIOVecs > 0) {
+        pBuffer = m_PendingWrites.GetHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+
+        bytesInBuffer = pBuffer->m_NumValidBytes - pBuffer->m_StartWriteOffset;
+        if ((!err) && (bytesWritten < bytesInBuffer)) {
+            pBuffer->m_StartWriteOffset += bytesWritten;
+            break;
+        }
+
+        if (!err) {
+            bytesWritten = bytesWritten - bytesInBuffer;
+            pBuffer->m_StartWriteOffset = pBuffer->m_NumValidBytes;
+            numIOVecs--;
+        }
+
+        m_PendingWrites.RemoveFromQueue(&(pBuffer->m_BlockIOBufferList));
+        completedBuffers.InsertTail(&(pBuffer->m_BlockIOBufferList));
+    } // while (numIOVecs > 0)
+
+    *pFinished = m_PendingWrites.IsEmpty();
+
+    // Tell the caller that each buffer IO is complete. The buffers were
+    // AddRef'ed when they were put on the pending list.
+    while (true) {
+        pBuffer = completedBuffers.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+
+        pBuffer->m_Err = err;
+        FinishIO(pBuffer, err, pBuffer->m_NumValidBytes);
+        RELEASE_OBJECT(pBuffer);
     }
-} // ReadBlockAsyncImpl.
+
+abort:
+    returnErr(err);
+} // DoPendingWriteChain.
+#endif // USE_VECTORED_WRITES
 
 
 
 
 
 
+#if USE_BATCHED_DATAGRAMS
 /////////////////////////////////////////////////////////////////////////////
 //
-// [WriteBlockAsyncImpl]
+// [DoPendingDatagramReads]
 //
-// This is called by the client code to write the socket. We try to write
-// immediately, and if that fails then we queue the buffer up to be written
-// when select fires.
+// This is called in the select thread when a UDP socket is ready to read.
+// It receives up to MAX_DATAGRAM_BATCH datagrams with a single recvmmsg.
+// Buffers posted by the client are filled first, then spare buffers, and
+// each datagram completes its own buffer.
 /////////////////////////////////////////////////////////////////////////////
-void
-CNetBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
+ErrVal
+CNetBlockIO::DoPendingDatagramReads() {
     ErrVal err = ENoErr;
-    bool fFinished = false;
+    struct mmsghdr msgList[MAX_DATAGRAM_BATCH];
+    struct iovec ioVecList[MAX_DATAGRAM_BATCH];
+    CIOBuffer *bufferList[MAX_DATAGRAM_BATCH];
+    int32 numBuffers = 0;
+    int32 numClientBuffers = 0;
+    int32 numDatagrams = 0;
+    int32 numCompleted;
+    int32 actualIOSize;
+    int32 index;
+    int32 lastErr = 0;
+    int32 numRetries = 0;
+    CIOBuffer *pBuffer;
     AutoLock(m_pLock);
     RunChecks();
 
-    if (NULL == pBuffer) {
-        return;
+    // Datagrams go to the client's buffers first, in the order the
+    // client posted them. Anything else is an unsolicited read.
+    while (numBuffers < MAX_DATAGRAM_BATCH) {
+        pBuffer = m_PendingReads.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+        bufferList[numBuffers] = pBuffer;
+        numBuffers++;
     }
+    numClientBuffers = numBuffers;
 
-    DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl calls DoPendingWrite");
-    err = DoPendingWrite(pBuffer, &fFinished);
-    if (err) {
-        fFinished = true;
+    while (numBuffers < MAX_DATAGRAM_BATCH) {
+        pBuffer = m_SpareDatagramBuffers.RemoveHead();
+        if (NULL == pBuffer) {
+            pBuffer = g_pNetIOSystemImpl->AllocIOBuffer(-1, true);
+            if (NULL == pBuffer) {
+                break;
+            }
+        }
+        bufferList[numBuffers] = pBuffer;
+        numBuffers++;
+    }
+    if (0 == numBuffers) {
+        gotoErr(EFail);
     }
 
-    if (fFinished) {
-        FinishIO(pBuffer, err, pBuffer->m_NumValidBytes);
-    } else { // if (!fFinished)
-        // Unlike read, we have to tell the select thread to wait on this
-        // socket for writing.
-        DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl. Schedule a write for later.");
+    for (index = 0; index < numBuffers; index++) {
+        pBuffer = bufferList[index];
 
-        // There is no race condition with the select thread. If the
-        // socket becomes readable/writeable while we are in the process
-        // of adding it to the select list, then select will simply
-        // immediately return.
-        if (g_pNetIOSystemImpl->m_pLock) {
-            g_pNetIOSystemImpl->m_pLock->Lock();
+        // Don't read more than 1 block per IO on a network.
+        actualIOSize = pBuffer->m_BufferSize;
+        if (actualIOSize > g_pNetIOSystemImpl->GetDefaultBytesPerBlock()) {
+            actualIOSize = g_pNetIOSystemImpl->GetDefaultBytesPerBlock();
         }
 
-#if WIN32
-        if (g_pNetIOSystemImpl->m_WriteSocks.fd_count >= FD_SETSIZE) {
-            DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl. Too many sockets (%d)",
-                      g_pNetIOSystemImpl->m_WriteSocks.fd_count);
-            err = ETooManySockets;
-        } else
-#endif
-        {
-            // Put this buffer on the queue so the select thread can find
-            // it later when we can resume the IO operation.
-            m_PendingWrites.InsertTail(&(pBuffer->m_BlockIOBufferList));
-            ADDREF_OBJECT(pBuffer);
-
-            m_BlockIOFlags |= WAITING_TO_WRITE;
-            StartTimeout(CIOBuffer::WRITE);
-
-            // Tell select() to listen on this socket as well.
-            if (!(FD_ISSET(m_Socket, &(g_pNetIOSystemImpl->m_WriteSocks)))) {
-                FD_SET(m_Socket, &(g_pNetIOSystemImpl->m_WriteSocks));
-#if LINUX
-                if (m_Socket >= g_pNetIOSystemImpl->m_FdRange) {
-                    g_pNetIOSystemImpl->m_FdRange = m_Socket + 1;
-                }
-#endif // LINUX
-            } // if (!(FD_ISSET(m_Socket, &(g_pNetIOSystemImpl->m_WriteSocks))))
-        }
-
-        if (g_pNetIOSystemImpl->m_pLock) {
-            g_pNetIOSystemImpl->m_pLock->Unlock();
-        }
+        ioVecList[index].iov_base = pBuffer->m_pLogicalBuffer;
+        ioVecList[index].iov_len = actualIOSize;
 
-        // Tell the select thread to start listening to this new
-        // socket. We added the socket to the fd set, and
-        // select uses the latest fd set each time it is called.
-        (void) g_pNetIOSystemImpl->WakeSelectThread();
-    } // if (!fFinished)
-
-    if ((err) && (!fFinished)) {
-        FinishIO(pBuffer, err, 0);
+        memset(&(msgList[index]), 0, sizeof(struct mmsghdr));
+        msgList[index].msg_hdr.msg_iov = &(ioVecList[index]);
+        msgList[index].msg_hdr.msg_iovlen = 1;
+        msgList[index].msg_hdr.msg_name = &(pBuffer->m_udpDatagramSource);
+        msgList[index].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
     }
-} // WriteBlockAsyncImpl
 
+    // We may have to loop several times to ignore system call failures on Linux.
+    while (1) {
+        numDatagrams = recvmmsg(m_Socket, msgList, numBuffers, MSG_DONTWAIT, NULL);
+        // Get the last error immediately after the system call.
+        // Anything code, even a DEBUG_LOG, may touch a file and
+        // change the last error.
+        lastErr = GET_LAST_ERROR();
 
+        if ((numDatagrams < 0)
+            && (IGNORE_SYSTEMCALL_ERROR())
+            && (numRetries < MAX_SYSTEM_CALL_INTERRUPTS)) {
+            DEBUG_LOG("CNetBlockIO::DoPendingDatagramReads: Ignoring EPIPE.");
+            numRetries++;
+            continue;
+        }
 
+        break;
+    } // while (1)
 
+    DEBUG_LOG("CNetBlockIO::DoPendingDatagramReads: recvmmsg returned %d, lastErr = %d",
+              numDatagrams, lastErr);
 
+    if (numDatagrams < 0) {
+        if ((IO_WOULD_BLOCK(lastErr)) || (IO_NOT_CONNECTED_ERROR(lastErr))) {
+            numDatagrams = 0;
+        } else {
+            // Like a single recvfrom, an error completes the next read.
+            err = EEOF;
+            numDatagrams = 0;
+        }
+    }
 
+    numCompleted = numDatagrams;
+    if ((err) && (numCompleted < numBuffers)) {
+        numCompleted += 1;
+    }
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [TestBreakingNetworkConnection]
-//
-/////////////////////////////////////////////////////////////////////////////
-void
-CNetBlockIO::TestBreakingNetworkConnection() {
-    AutoLock(m_pLock);
+    for (index = 0; index < numCompleted; index++) {
+        pBuffer = bufferList[index];
 
-    // Avoid closing the same blockIO twice.
-    if (!(m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
-        DEBUG_LOG("CNetBlockIO::TestBreakingNetworkConnection");
+        // A spare buffer becomes an unsolicited read.
+        if (index >= numClientBuffers) {
+            pBuffer->m_BufferOp = CIOBuffer::READ;
+            pBuffer->m_BufferFlags &= ~CIOBuffer::VALID_DATA;
+            pBuffer->m_BufferFlags |= CIOBuffer::INPUT_BUFFER;
+            pBuffer->m_Err = ENoErr;
+            pBuffer->m_NumValidBytes = 0;
+            RELEASE_OBJECT(pBuffer->m_pBlockIO);
+            pBuffer->m_pBlockIO = this;
+            ADDREF_THIS();
 
-        // To avoid a race condition with the select thread,
-        // we don't delete the socket here. Instead, mark the
-        // socket as doomed and let the select thread delete it.
-        if (g_pNetIOSystemImpl->m_pLock) {
-            g_pNetIOSystemImpl->m_pLock->Lock();
+            m_NumActiveReads += 1;
         }
 
-        m_BlockIOFlags |= CNetBlockIO::DISCONNECT_SOCKET;
-        m_BlockIOFlags |= CNetBlockIO::SIMULATE_NETWORK_ERROR;
-
-        g_pNetIOSystemImpl->m_PendingCloseList.InsertTail(&(m_PendingCloseList));
-        ADDREF_THIS();
+        pBuffer->m_PosInMedia = m_MediaSize;
+        if (index < numDatagrams) {
+            m_MediaSize += msgList[index].msg_len;
+            FinishIO(pBuffer, ENoErr, msgList[index].msg_len);
+        } else {
+            DEBUG_LOG("CNetBlockIO::DoPendingDatagramReads: Returning EEOF");
+            FinishIO(pBuffer, EEOF, 0);
+        }
 
-        if (g_pNetIOSystemImpl->m_pLock) {
-            g_pNetIOSystemImpl->m_pLock->Unlock();
+        // The client buffers were AddRef'ed when they were put on the
+        // pending list, and the spare buffers were AddRef'ed when they
+        // were allocated.
+        RELEASE_OBJECT(pBuffer);
+    } // for (index = 0; index < numCompleted; index++)
+
+    // Put back the buffers that were not filled. The client buffers go
+    // back in front of any that did not fit in this batch.
+    for (index = numBuffers - 1; index >= numCompleted; index--) {
+        pBuffer = bufferList[index];
+        if (index < numClientBuffers) {
+            m_PendingReads.InsertHead(&(pBuffer->m_BlockIOBufferList));
+        } else {
+            m_SpareDatagramBuffers.InsertHead(&(pBuffer->m_BlockIOBufferList));
         }
+    }
 
-        // Tell the select thread to delete this socket.
-        (void) g_pNetIOSystemImpl->WakeSelectThread();
+    if (!(m_PendingReads.IsEmpty())) {
+        m_BlockIOFlags |= WAITING_TO_READ;
     }
-} // TestBreakingNetworkConnection.
+
+abort:
+    returnErr(err);
+} // DoPendingDatagramReads.
 
 
 
@@ -961,63 +1443,122 @@ CNetBlockIO::TestBreakingNetworkConnection() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [PrepareToDisconnect]
+// [DoPendingDatagramWrites]
 //
-// This tells the main select thread the close this socket. It will eventually
-// be closed in the select thread.
+// This sends up to MAX_DATAGRAM_BATCH buffers on the pending write list
+// with a single sendmmsg. Each buffer is a whole datagram, so a buffer is
+// either completely sent or left on the list. *pFinished is true when the
+// list is empty.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetBlockIO::PrepareToDisconnect() {
+CNetBlockIO::DoPendingDatagramWrites(bool *pFinished, bool *pSentData) {
     ErrVal err = ENoErr;
-    CIOBuffer *pBuffer = NULL;
+    struct mmsghdr msgList[MAX_DATAGRAM_BATCH];
+    struct iovec ioVecList[MAX_DATAGRAM_BATCH];
+    int32 numBuffers = 0;
+    int32 numSent;
+    int32 lastErr = 0;
+    int32 numRetries = 0;
+    CIOBuffer *pBuffer;
+    CQueueList<CIOBuffer> completedBuffers;
     AutoLock(m_pLock);
     RunChecks();
 
-    DEBUG_LOG("CNetBlockIO::PrepareToDisconnect: pNetBlockIO = %p", this);
+    if ((NULL == pFinished) || (NULL == pSentData)) {
+        gotoErr(EFail);
+    }
+    *pFinished = false;
+    *pSentData = false;
 
-    // Avoid closing the same blockIO twice.
-    if (m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET) {
-        DEBUG_LOG("CNetBlockIO::PrepareToDisconnect. Socket is already disconnected");
+    pBuffer = m_PendingWrites.GetHead();
+    while ((pBuffer) && (numBuffers < MAX_DATAGRAM_BATCH)) {
+        ioVecList[numBuffers].iov_base = pBuffer->m_pLogicalBuffer + pBuffer->m_StartWriteOffset;
+        ioVecList[numBuffers].iov_len = pBuffer->m_NumValidBytes - pBuffer->m_StartWriteOffset;
+
+        memset(&(msgList[numBuffers]), 0, sizeof(struct mmsghdr));
+        msgList[numBuffers].msg_hdr.msg_iov = &(ioVecList[numBuffers]);
+        msgList[numBuffers].msg_hdr.msg_iovlen = 1;
+        msgList[numBuffers].msg_hdr.msg_name = &m_UDPDatagramDest;
+        msgList[numBuffers].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        numBuffers++;
+        pBuffer = pBuffer->m_BlockIOBufferList.GetNextInQueue();
+    }
+    if (0 == numBuffers) {
+        *pFinished = true;
         gotoErr(ENoErr);
     }
 
-    // Discard any buffers that were allocated.
+    DEBUG_LOG("CNetBlockIO::DoPendingDatagramWrites: pBlockIOPtr = %p, numBuffers = %d.", this, numBuffers);
+
+    // We may have to loop several times to ignore system call failures on Linux.
     while (1) {
-        pBuffer = m_PendingReads.RemoveHead();
-        if (NULL == pBuffer) {
-            break;
+        // MSG_NOSIGNAL means dont send EPIPE on peer reset.
+        numSent = sendmmsg(m_Socket, msgList, numBuffers, MSG_NOSIGNAL);
+        // Get the last error immediately after the system call.
+        // Anything code, even a DEBUG_LOG, may touch a file and
+        // change the last error.
+        lastErr = GET_LAST_ERROR();
+
+        if ((numSent < 0)
+            && (IGNORE_SYSTEMCALL_ERROR())
+            && (numRetries < MAX_SYSTEM_CALL_INTERRUPTS)) {
+            DEBUG_LOG("CNetBlockIO::DoPendingDatagramWrites: Ignoring EPIPE.");
+            numRetries++;
+            continue;
         }
-        m_NumActiveReads -= 1;
-        RELEASE_OBJECT(pBuffer);
-    }
 
-    // To avoid a race condition with the select thread,
-    // we don't delete the socket here. Instead, mark the
-    // socket as doomed and let the select thread delete it.
-    if (g_pNetIOSystemImpl->m_pLock) {
-        g_pNetIOSystemImpl->m_pLock->Lock();
+        break;
+    } // while (1)
+
+    if ((SOCKET_ERROR == numSent) && (IO_WOULD_BLOCK(lastErr))) {
+        numSent = 0;
+    } else if (numSent < 0) {
+        DEBUG_LOG("CNetBlockIO::DoPendingDatagramWrites: sendmmsg failed. errno = %d.",
+                  lastErr);
+
+        // Any error completes every datagram in the batch.
+        err = EPeerDisconnected;
+        numSent = numBuffers;
+    } else {
+        DEBUG_LOG("CNetBlockIO::DoPendingDatagramWrites: sendmmsg sent %d datagrams",
+                  numSent);
+        if (numSent > 0) {
+            *pSentData = true;
+        }
     }
 
-    if ((m_NumActiveReads > 0) || (m_NumActiveWrites > 0)) {
-        DEBUG_WARNING("There are active reads or writes.");
+    while (numSent > 0) {
+        pBuffer = m_PendingWrites.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+        if (!err) {
+            pBuffer->m_StartWriteOffset = pBuffer->m_NumValidBytes;
+        }
+        completedBuffers.InsertTail(&(pBuffer->m_BlockIOBufferList));
+        numSent--;
     }
 
-    m_BlockIOFlags |= CNetBlockIO::DISCONNECT_SOCKET;
-    g_pNetIOSystemImpl->m_PendingCloseList.InsertTail(&(m_PendingCloseList));
-    ADDREF_THIS();
+    *pFinished = m_PendingWrites.IsEmpty();
 
-    DEBUG_LOG("CNetBlockIO::PrepareToDisconnect: Put pNetBlockIO %p on PendingCloseList", this);
+    // Tell the caller that each buffer IO is complete. The buffers were
+    // AddRef'ed when they were put on the pending list.
+    while (true) {
+        pBuffer = completedBuffers.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
 
-    if (g_pNetIOSystemImpl->m_pLock) {
-        g_pNetIOSystemImpl->m_pLock->Unlock();
+        pBuffer->m_Err = err;
+        FinishIO(pBuffer, err, pBuffer->m_NumValidBytes);
+        RELEASE_OBJECT(pBuffer);
     }
 
-    // Tell the select thread to delete this socket.
-    (void) g_pNetIOSystemImpl->WakeSelectThread();
-
 abort:
     returnErr(err);
-} // PrepareToDisconnect.
+} // DoPendingDatagramWrites.
+#endif // USE_BATCHED_DATAGRAMS
 
 
 
@@ -1026,60 +1567,85 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CancelTimeout]
+// [ReadBlockAsyncImpl]
 //
+// This is called by the client code to read the socket. We try to read
+// immediately, and if that fails then we queue the buffer up to be read when
+// select fires.
 /////////////////////////////////////////////////////////////////////////////
 void
-CNetBlockIO::CancelTimeout(int32 opType) {
+CNetBlockIO::ReadBlockAsyncImpl(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+    ErrVal err2 = ENoErr;
+    bool fFinished = false;
+    bool ReadFullBuffer = false;
     AutoLock(m_pLock);
+    RunChecks();
 
-    if ((m_NumTimeouts > 0)
-        && (m_CurrentTimeoutOp == opType)) {
-        m_NumTimeouts--;
+    if (NULL == pBuffer) {
+        return;
     }
-} // CancelTimeout
-
-
 
+#if USE_IO_URING
+    // An io_uring socket always has a receive posted to the ring, so there is
+    // nothing to try right now. Queue the buffer and the next receive will
+    // fill it.
+    if (m_BlockIOFlags & URING_SOCKET) {
+        m_PendingReads.InsertTail(&(pBuffer->m_BlockIOBufferList));
+        ADDREF_OBJECT(pBuffer);
+        m_BlockIOFlags |= WAITING_TO_READ;
 
+        (void) g_pNetIOSystemImpl->UringPostRecv(this);
+        return;
+    }
+#endif // USE_IO_URING
 
+    // Check if we can read right away. This is a fast path, and will avoid a lot
+    // of thread jumps.
+    err = DoPendingRead(pBuffer, &ReadFullBuffer, &fFinished);
+    if ((err) && (EEOF != err)) {
+        DEBUG_LOG("ReadBlockAsyncImpl. DoPendingRead returned an error " ERRFMT, err);
+        fFinished = false;
+        gotoErr(err);
+    }
 
+    // If there is more data to read, then add this socket to the list of
+    // pending reads. We will complete the read when select fires.
+    if (!fFinished) {
+        // There is no race condition with the select thread. If the
+        // socket becomes readable/writeable while we are in the process
+        // of adding it to the select list, then select will simply
+        // immediately return.
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [StartTimeout]
-//
-/////////////////////////////////////////////////////////////////////////////
-void
-CNetBlockIO::StartTimeout(int32 opType) {
-    int32 value = 0;
-    AutoLock(m_pLock);
+        // Put this buffer on the queue so the select thread can find
+        // it later when we can resume the IO operation.
+        m_PendingReads.InsertTail(&(pBuffer->m_BlockIOBufferList));
+        ADDREF_OBJECT(pBuffer);
 
-    ASSERT(0 == m_NumTimeouts);
+        m_BlockIOFlags |= WAITING_TO_READ;
 
-    switch (opType) {
-    case CIOBuffer::READ:
-        value = m_ReadTimeout;
-        break;
+        // We do not have to tell select() to listen on this socket,
+        // since it listens for reads on all sockets.
+    } // (!Finished)
 
-    case CIOBuffer::WRITE:
-        value = DEFAULT_WRITE_TIMEOUT_IN_MS;
-        break;
 
-    case CIOBuffer::IO_CONNECT:
-        value = m_ConnectTimeout;
-        break;
+    // Close the socket so it is removed from the read select list.
+    // Otherwise, the socket will continually select that it is ready
+    // to read.
+    if (EEOF == err) {
+        DEBUG_LOG("ReadBlockAsyncImpl. Socket closed, calling PrepareToDisconnect");
+        err2 = PrepareToDisconnect();
+        if (err2) {
+            DEBUG_LOG("ReadBlockAsyncImpl. PrepareToDisconnect failed. err2 = %d", err2);
+            //err = err2;
+        }
+    } // if (EEOF == err)
 
-    default:
-        break;
+abort:
+    if ((err) && !(fFinished)) {
+        FinishIO(pBuffer, err, 0);
     }
-
-    DEBUG_LOG("CNetBlockIO::StartTimeout: opType = %d, time = %d", opType, value);
-
-    m_CurrentTimeoutRemainingInMs = value;
-    m_CurrentTimeoutOp = opType;
-    m_NumTimeouts++;
-} // StartTimeout.
+} // ReadBlockAsyncImpl.
 
 
 
@@ -1088,46 +1654,112 @@ CNetBlockIO::StartTimeout(int32 opType) {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CheckTimeout]
+// [WriteBlockAsyncImpl]
 //
-// This is called by the select thread to decide whether a socket has expired
-// any timeouts.
+// This is called by the client code to write the socket. We try to write
+// immediately, and if that fails then we queue the buffer up to be written
+// when select fires.
 /////////////////////////////////////////////////////////////////////////////
-bool
-CNetBlockIO::CheckTimeout(uint64 elapsedTime, int32 *pTimeoutOp) {
+void
+CNetBlockIO::WriteBlockAsyncImpl(CIOBuffer *pBuffer) {
+    ErrVal err = ENoErr;
+    bool fFinished = false;
     AutoLock(m_pLock);
+    RunChecks();
 
-    if ((m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)
-        || (m_NumTimeouts <= 0)) {
-        return(false);
+    if (NULL == pBuffer) {
+        return;
     }
 
-    if ((m_NumTimeouts > 0)
-        && !(m_BlockIOFlags & NEVER_TIMEOUT)) {
-        // m_CurrentTimeoutRemainingInMs is an uint64, so it CANNOT
-        // become negative.
-        if (elapsedTime >= (uint64) m_CurrentTimeoutRemainingInMs) {
-            DEBUG_LOG("CNetBlockIO::CheckTimeout: Timing out blockIO %p. m_CurrentTimeoutOp = %d",
-                        this, m_CurrentTimeoutOp);
-
-            // Firing a timeout clears all pending activity.
-            // This covers a weird case. There should be only one pending action
-            // at any single time, so we only record one timeout. To be safe,
-            // however, when that timeout fires, it cancels all pending
-            // actions.
-            m_NumTimeouts = 0;
-            if (pTimeoutOp) {
-                *pTimeoutOp = m_CurrentTimeoutOp;
-            }
-
-            return(true);
-        }
+#if USE_IO_URING
+    // Writes to an io_uring socket are posted straight to the ring. Only one
+    // send is posted at a time, so buffers are sent in order.
+    if (m_BlockIOFlags & URING_SOCKET) {
+        m_PendingWrites.InsertTail(&(pBuffer->m_BlockIOBufferList));
+        ADDREF_OBJECT(pBuffer);
+        m_BlockIOFlags |= WAITING_TO_WRITE;
 
-        m_CurrentTimeoutRemainingInMs = m_CurrentTimeoutRemainingInMs - elapsedTime;
+        (void) g_pNetIOSystemImpl->UringPostSend(this);
+        return;
     }
+#endif // USE_IO_URING
 
-    return(false);
-} // CheckTimeout.
+#if USE_VECTORED_WRITES
+    // Writes go through the pending list, so buffers are sent in order.
+    // Without batched datagrams, each UDP buffer is still sent one at a
+    // time below.
+    if (UsesWriteChain()) {
+        m_PendingWrites.InsertTail(&(pBuffer->m_BlockIOBufferList));
+        ADDREF_OBJECT(pBuffer);
+
+        // If we are inside a write chain, or if earlier buffers are
+        // waiting for the socket to drain, then this buffer is sent
+        // along with them later.
+        if ((m_BlockIOFlags & WRITE_CHAIN_OPEN)
+            || (m_BlockIOFlags & WAITING_TO_WRITE)) {
+            return;
+        }
+
+        SendWriteChain();
+        return;
+    }
+#endif // USE_VECTORED_WRITES
+
+    DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl calls DoPendingWrite");
+    err = DoPendingWrite(pBuffer, &fFinished);
+    if (err) {
+        fFinished = true;
+    }
+
+    if (fFinished) {
+        FinishIO(pBuffer, err, pBuffer->m_NumValidBytes);
+    } else { // if (!fFinished)
+        // Unlike read, we have to tell the select thread to wait on this
+        // socket for writing.
+        DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl. Schedule a write for later.");
+
+        // There is no race condition with the select thread. If the
+        // socket becomes readable/writeable while we are in the process
+        // of adding it to the select list, then select will simply
+        // immediately return.
+        if (m_pReactor->m_pLock) {
+            m_pReactor->m_pLock->Lock();
+        }
+
+#if WIN32
+        if (m_pReactor->m_WriteSocks.fd_count >= FD_SETSIZE) {
+            DEBUG_LOG("CNetBlockIO::WriteBlockAsyncImpl. Too many sockets (%d)",
+                      m_pReactor->m_WriteSocks.fd_count);
+            err = ETooManySockets;
+        } else
+#endif
+        {
+            // Put this buffer on the queue so the select thread can find
+            // it later when we can resume the IO operation.
+            m_PendingWrites.InsertTail(&(pBuffer->m_BlockIOBufferList));
+            ADDREF_OBJECT(pBuffer);
+
+            m_BlockIOFlags |= WAITING_TO_WRITE;
+            StartTimeout(CIOBuffer::WRITE);
+
+            // Tell select() to listen on this socket as well.
+            g_pNetIOSystemImpl->WatchSocket(this, CNetIOSystem::WRITE_EVENTS);
+        }
+
+        if (m_pReactor->m_pLock) {
+            m_pReactor->m_pLock->Unlock();
+        }
+
+        // Tell the select thread to start listening to this new
+        // socket. We added the socket to the fd set, and
+        // select uses the latest fd set each time it is called.
+        (void) g_pNetIOSystemImpl->WakeSelectThread(m_pReactor);
+    } // if (!fFinished)
+
+    if ((err) && (!fFinished)) {
+        FinishIO(pBuffer, err, 0);
+    }
+} // WriteBlockAsyncImpl
 
 
 
@@ -1136,42 +1768,51 @@ CNetBlockIO::CheckTimeout(uint64 elapsedTime, int32 *pTimeoutOp) {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CNetIOSystem]
+// [StartWriteChain]
 //
 /////////////////////////////////////////////////////////////////////////////
-CNetIOSystem::CNetIOSystem() {
-    m_pSelectThread = NULL;
-    m_WakeUpThreadSend = NULL_SOCKET;
-    m_WakeUpThreadListener = NULL_SOCKET;
-    m_WakeUpThreadReceive = NULL_SOCKET;
+void
+CNetBlockIO::StartWriteChain() {
+    AutoLock(m_pLock);
 
-    m_ActiveSocketTable = NULL;
+#if USE_VECTORED_WRITES
+    // Only readiness sockets send chains. io_uring sockets post their
+    // own sends.
+    if ((UsesWriteChain())
+        && !(m_BlockIOFlags & URING_SOCKET)) {
+        m_BlockIOFlags |= WRITE_CHAIN_OPEN;
+    }
+#endif
+} // StartWriteChain.
 
-    m_StopSelectThread = false;
-    m_fPendingWakeupMessage = false;
-    m_pSelectThreadStopped = NULL;
 
-    m_LocalAddr.sin_addr.s_addr = INADDR_ANY;
-    m_wakeUpConnAddr.sin_addr.s_addr = INADDR_ANY;
 
-    FD_ZERO(&m_ReadSocks);
-    FD_ZERO(&m_WriteSocks);
-    FD_ZERO(&m_ExceptionSocks);
-    m_FdRange = 0;
 
-    FD_ZERO(&m_ResultReadSocks);
-    FD_ZERO(&m_ResultWriteSocks);
-    FD_ZERO(&m_ResultExceptionSocks);
 
-    m_NumBytesPerSocketBuffer = 16000;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [EndWriteChain]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::EndWriteChain() {
+    AutoLock(m_pLock);
 
-    m_PrevCheckForTimeoutsTime = 0;
+#if USE_VECTORED_WRITES
+    if (!(m_BlockIOFlags & WRITE_CHAIN_OPEN)) {
+        return;
+    }
+    m_BlockIOFlags &= ~WRITE_CHAIN_OPEN;
 
-    m_PendingCloseList.ResetQueue();
-    m_pEmptyPendingCloseBlockIOs = NULL;
+    // If the socket is already full, then the select thread sends the
+    // whole chain when it drains.
+    if (!(m_BlockIOFlags & WAITING_TO_WRITE)
+        && !(m_PendingWrites.IsEmpty())) {
+        SendWriteChain();
+    }
+#endif
+} // EndWriteChain.
 
-    m_MaxNumBlockIOs = FD_SETSIZE - 3;
-} // CNetIOSystem.
 
 
 
@@ -1179,280 +1820,352 @@ CNetIOSystem::CNetIOSystem() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [~CNetIOSystem]
+// [CanSendFromFile]
 //
+// SEND_FROM_FILE buffers are sent by the write chain, so only the
+// sockets that use it can take them.
 /////////////////////////////////////////////////////////////////////////////
-CNetIOSystem::~CNetIOSystem() {
-    m_ActiveSocketTable = NULL;
-    RELEASE_OBJECT(m_pEmptyPendingCloseBlockIOs);
-} // ~CNetIOSystem.
+bool
+CNetBlockIO::CanSendFromFile() {
+#if USE_VECTORED_WRITES
+    AutoLock(m_pLock);
+
+    if (!(m_BlockIOFlags & UDP_SOCKET)
+        && !(m_BlockIOFlags & URING_SOCKET)) {
+        return(true);
+    }
+#endif
+    return(false);
+} // CanSendFromFile.
+
+
 
 
 
+
+#if USE_VECTORED_WRITES
 /////////////////////////////////////////////////////////////////////////////
 //
-// [InitNetIOSystem]
+// [SendWriteChain]
 //
+// This sends as much of the pending write list as the socket will take.
+// If some data is left, then it waits for the socket to be writable.
+// The caller must hold the blockIO lock.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CNetIOSystem::InitNetIOSystem() {
-    ErrVal err = ENoErr;
-    int result;
-    struct hostent *hostInfo = NULL;
-    struct sockaddr_in wakeUpListenAddr;
-    socklen_t addrLen;
-    int32 lastErr = 0;
+void
+CNetBlockIO::SendWriteChain() {
+    bool fFinished = false;
+    bool fSentData = false;
+    bool fWakeSelectThread = false;
+    AutoLock(m_pLock);
 
-#if USE_SOCKS
-    if (!g_InitedFirewall) {
-        SOCKSinit("myProgram");
-        g_InitedFirewall = true;
-    }
-#endif // USE_SOCKS
+    DEBUG_LOG("CNetBlockIO::SendWriteChain calls DoPendingWriteChain");
+    (void) DoPendingWriteChain(&fFinished, &fSentData);
 
-    m_NumBytesPerSocketBuffer = 16000;
+    if (fFinished) {
+        if (m_BlockIOFlags & WAITING_TO_WRITE) {
+            m_pReactor->m_pLock->Lock();
+            g_pNetIOSystemImpl->UnwatchSocket(this, CNetIOSystem::WRITE_EVENTS);
+            m_BlockIOFlags &= ~WAITING_TO_WRITE;
+            m_pReactor->m_pLock->Unlock();
+        }
 
-    // Initialize the base class.
-    err = CIOSystem::InitIOSystem();
-    if (err) {
-        gotoErr(err);
+        CancelTimeout(CIOBuffer::WRITE);
+        return;
     }
 
-    // Locks and events.
-    m_pSelectThreadStopped = newex CRefEvent;
-    if (NULL == m_pSelectThreadStopped) {
-        gotoErr(EFail);
+    // Some data is still waiting, so tell the select thread to resume
+    // the chain when the socket drains.
+    DEBUG_LOG("CNetBlockIO::SendWriteChain. Schedule a write for later.");
+    m_pReactor->m_pLock->Lock();
+    if (!(m_BlockIOFlags & WAITING_TO_WRITE)) {
+        m_BlockIOFlags |= WAITING_TO_WRITE;
+        g_pNetIOSystemImpl->WatchSocket(this, CNetIOSystem::WRITE_EVENTS);
+        fWakeSelectThread = true;
     }
-    err = m_pSelectThreadStopped->Initialize();
-    if (err) {
-        gotoErr(EFail);
+    m_pReactor->m_pLock->Unlock();
+
+    // The write timeout only fires if the peer stops taking data, so
+    // restart it whenever we make progress. There is only one timeout per
+    // blockIO, so don't clobber a read timeout.
+    if (fSentData) {
+        CancelTimeout(CIOBuffer::WRITE);
+    }
+    if (0 == m_NumTimeouts) {
+        StartTimeout(CIOBuffer::WRITE);
     }
 
-    FD_ZERO(&m_ReadSocks);
-    FD_ZERO(&m_WriteSocks);
-    FD_ZERO(&m_ExceptionSocks);
-    m_FdRange = 0;
+    if (fWakeSelectThread) {
+        (void) g_pNetIOSystemImpl->WakeSelectThread(m_pReactor);
+    }
+} // SendWriteChain.
+#endif // USE_VECTORED_WRITES
 
-    // Find out some standard information about this host.
-    // Do this before we initialize the sockets so we can
-    // use the host address for them.
-    memset(&m_LocalAddr, 0, sizeof(struct sockaddr_in));
-    m_LocalAddr.sin_addr.s_addr = INADDR_ANY;
 
 
-    // Get the local IP address.
-    //
-    // If the name parameter is to gethostbyname, then this gets
-    // the result for the local host.
-    // On Windows, it seems that gethostbyname(NULL) works more reliably
-    // than gethostbyname(gethostname()) on Windows.
-#if WIN32
-    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Calling gethostbyname(NULL)");
-    hostInfo = gethostbyname(NULL);
-    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. gethostbyname(NULL) returned");
-#endif
 
-#if LINUX_DYNAMIC_LINK
-    // The Linux version seems to work fine with a dynamically linked libc.
-    // However, it fails with a statically linked glibc. It seems that the
-    // name resolution library runs different code depending on host-specific
-    // preferences, like whether to use DNS or other network infrastructure.
-    // So, rather than writing 1 program that can call out to different local
-    // name resolver services (like, via a local pipe or system call), the
-    // C library is hard-compiled with the diffreent sources. This means that
-    // libc cannot call gethostbyname in a portable way. Instead, you must dynamically
-    // link with the local glibc on each different machine. If you really
-    // need to run the static glibc, then you cannot use this call.
-    {
-        char buffer[512];
-        int nameLength;
 
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Calling gethostname");
-        nameLength = gethostname(buffer, sizeof(buffer));
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. gethostname returned");
-        if (nameLength < 0) {
-            buffer[0] = 0;
-        }
-        hostInfo = gethostbyname(buffer);
-    }
-#endif
-    if (hostInfo) {
-        memcpy(&(m_LocalAddr.sin_addr), hostInfo->h_addr, hostInfo->h_length);
+
+
+#if USE_IO_URING
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FinishUringRecv]
+//
+// This is called in the uring thread when a posted receive completes.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::FinishUringRecv(CIOBuffer *pBuffer, int32 result) {
+    AutoLock(m_pLock);
+
+    m_BlockIOFlags &= ~URING_RECV_POSTED;
+
+    // The socket was closed while the receive was posted. Nobody is
+    // waiting for this buffer anymore.
+    if ((NULL_SOCKET == m_Socket)
+        || (m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+        m_NumActiveReads -= 1;
+        RELEASE_OBJECT(pBuffer);
+        return;
     }
 
-    if (INADDR_ANY == m_LocalAddr.sin_addr.s_addr) {
-#if WIN32
-        m_LocalAddr.sin_addr.S_un.S_un_b.s_b1 = 127;
-        m_LocalAddr.sin_addr.S_un.S_un_b.s_b2 = 0;
-        m_LocalAddr.sin_addr.S_un.S_un_b.s_b3 = 0;
-        m_LocalAddr.sin_addr.S_un.S_un_b.s_b4 = 1;
-#elif LINUX
-        m_LocalAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-#endif
+    // Nothing was read, so keep the buffer for the next receive.
+    if ((-EAGAIN == result) || (-EINTR == result)) {
+        m_PendingReads.InsertHead(&(pBuffer->m_BlockIOBufferList));
+        (void) g_pNetIOSystemImpl->UringPostRecv(this);
+        return;
     }
-    // NOTE: the sin_family value is not set on WinNT, so explicitly
-    // set this to AF_INET
-    m_LocalAddr.sin_family = AF_INET;
-    m_LocalAddr.sin_port = htons(0);
 
+    m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_READ;
+    pBuffer->m_PosInMedia = m_MediaSize;
 
-#if WIN32
-    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Local address = %d.%d.%d.%d",
-                m_LocalAddr.sin_addr.S_un.S_un_b.s_b1,
-                m_LocalAddr.sin_addr.S_un.S_un_b.s_b2,
-                m_LocalAddr.sin_addr.S_un.S_un_b.s_b3,
-                m_LocalAddr.sin_addr.S_un.S_un_b.s_b4);
-#elif LINUX
-    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Local address = 0x%X",
-              m_LocalAddr.sin_addr);
-#endif
+    if (result > 0) {
+        DEBUG_LOG("CNetBlockIO::FinishUringRecv: Read %d bytes", result);
+        m_MediaSize += result;
+        FinishIO(pBuffer, ENoErr, result);
+        RELEASE_OBJECT(pBuffer);
 
+        (void) g_pNetIOSystemImpl->UringPostRecv(this);
+    } else {
+        // A web server may mark the end of a document by closing the socket,
+        // so this is not a bad error.
+        DEBUG_LOG("CNetBlockIO::FinishUringRecv: recv returned %d. Returning EEOF", result);
+        FinishIO(pBuffer, EEOF, 0);
+        RELEASE_OBJECT(pBuffer);
 
-    // Create the sockets that wake up the select thread.
-    m_WakeUpThreadSend = socket(AF_INET, SOCK_STREAM, 0);
-    if (NULL_SOCKET == m_WakeUpThreadSend) {
-        gotoErr(EFail);
-    }
-    m_WakeUpThreadListener = socket(AF_INET, SOCK_STREAM, 0);
-    if (NULL_SOCKET == m_WakeUpThreadListener) {
-        gotoErr(EFail);
+        (void) PrepareToDisconnect();
     }
+} // FinishUringRecv.
 
-    // Make the connect socket asynch before we connect so
-    // the connect will be asynch. Otherwise, we block on ourselves.
-    // Do not make the listener asynch, however, because we
-    // want the accept to be blocking.
-    err = MakeSocketNonBlocking(m_WakeUpThreadSend);
-    if (err) {
-        gotoErr(err);
-    }
 
-    // Bind the socket to a name. This is necessary to connect to the socket.
-    // Really, we just want the system to assign a port to us.
-    // Because we don't rely on any specific port, we won't collide
-    // with another application, or suffer potential DoS attacks.
-    result = bind(
-                m_WakeUpThreadListener,
-                (struct sockaddr *) &m_LocalAddr,
-                sizeof(struct sockaddr_in));
-    // Get the last error immediately after the system call.
-    // Anything code, even a DEBUG_LOG, may touch a file and
-    // change the last error.
-    lastErr = GET_LAST_ERROR();
 
-    if (result < 0) {
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. bind failed. result = %d, lastErr = %d",
-                    result, lastErr);
-        gotoErr(EFail);
-    }
 
-    // Allow up to 5 connections to be waiting for an
-    // accept, which is the most allowed by typical
-    // implementations. We can still have any number of
-    // active connections that have been accepted.
-    result = listen(m_WakeUpThreadListener, 5);
 
-    // Get the port that the wakeup connection socket is
-    // listening to. We don't need the address, we just need
-    // to know what port we were assigned.
-    addrLen = sizeof(struct sockaddr_in);
-    result = getsockname(
-                m_WakeUpThreadListener,
-                (struct sockaddr *) &wakeUpListenAddr,
-                &addrLen);
-    // Get the last error immediately after the system call.
-    // Anything code, even a DEBUG_LOG, may touch a file and
-    // change the last error.
-    lastErr = GET_LAST_ERROR();
 
-    if (result < 0) {
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. getsockname failed. result = %d, last err = %d",
-                    result, lastErr);
-        gotoErr(EFail);
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FinishUringSend]
+//
+// This is called in the uring thread when a posted send completes.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::FinishUringSend(CIOBuffer *pBuffer, int32 result) {
+    AutoLock(m_pLock);
+
+    m_BlockIOFlags &= ~URING_SEND_POSTED;
+
+    if ((-EAGAIN == result) || (-EINTR == result)) {
+        m_PendingWrites.InsertHead(&(pBuffer->m_BlockIOBufferList));
+        pBuffer = NULL;
+    } else if ((result < 0)
+            || (NULL_SOCKET == m_Socket)
+            || (m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+        DEBUG_LOG("CNetBlockIO::FinishUringSend: send failed. result = %d.", result);
+
+        // Any error completes this write and every write queued behind it.
+        while (NULL != pBuffer) {
+            pBuffer->m_Err = EPeerDisconnected;
+            FinishIO(pBuffer, EPeerDisconnected, pBuffer->m_NumValidBytes);
+            RELEASE_OBJECT(pBuffer);
+            pBuffer = m_PendingWrites.RemoveHead();
+        }
+    } else {
+        // Do not change m_MediaSize for writing to the socket, we only change
+        // the mediaSize when we receive new data from the socket.
+        pBuffer->m_Err = ENoErr;
+        pBuffer->m_StartWriteOffset += result;
+        if (pBuffer->m_StartWriteOffset < pBuffer->m_NumValidBytes) {
+            // Send the rest of this buffer before anything queued behind it.
+            m_PendingWrites.InsertHead(&(pBuffer->m_BlockIOBufferList));
+        } else {
+            FinishIO(pBuffer, ENoErr, pBuffer->m_NumValidBytes);
+            RELEASE_OBJECT(pBuffer);
+        }
+        pBuffer = NULL;
     }
 
-    memset(&m_wakeUpConnAddr, 0, sizeof(struct sockaddr_in));
-    m_wakeUpConnAddr = m_LocalAddr;
-    m_wakeUpConnAddr.sin_port = wakeUpListenAddr.sin_port;
+    if (m_PendingWrites.IsEmpty()) {
+        m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_WRITE;
+        CancelTimeout(CIOBuffer::WRITE);
+    } else {
+        (void) g_pNetIOSystemImpl->UringPostSend(this);
+    }
+} // FinishUringSend.
+#endif // USE_IO_URING
 
-    // Asynchronously connect to the listener socket. This will return an
-    // asynch error until we call accept below.
-    result = connect(
-                m_WakeUpThreadSend,
-                (struct sockaddr *) &m_wakeUpConnAddr,
-                sizeof(struct sockaddr_in));
-    // Get the last error immediately after the system call.
-    // Anything code, even a DEBUG_LOG, may touch a file and
-    // change the last error.
-    lastErr = GET_LAST_ERROR();
 
-    if ((result != 0) && !(IO_WOULD_BLOCK(lastErr))) {
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. connect() failed. result = %d, last err = %d",
-                    result, lastErr);
-        gotoErr(EFail);
-    }
 
-    // Accept the connection from ourselves, this will create a new socket
-    // and establishing the connection with ourselves.
-    addrLen = sizeof(struct sockaddr_in);
-    m_WakeUpThreadReceive = accept(
-                                m_WakeUpThreadListener,
-                                (struct sockaddr*) &m_wakeUpConnAddr,
-                                &addrLen);
-    // Get the last error immediately after the system call.
-    // Anything code, even a DEBUG_LOG, may touch a file and
-    // change the last error.
-    lastErr = GET_LAST_ERROR();
 
-    if (NULL_SOCKET == m_WakeUpThreadReceive) {
-        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. accept() failed. last err = %d",
-                    lastErr);
-        gotoErr(EFail);
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestBreakingNetworkConnection]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::TestBreakingNetworkConnection() {
+    AutoLock(m_pLock);
+
+    // Avoid closing the same blockIO twice.
+    if (!(m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+        DEBUG_LOG("CNetBlockIO::TestBreakingNetworkConnection");
+
+        // To avoid a race condition with the select thread,
+        // we don't delete the socket here. Instead, mark the
+        // socket as doomed and let the select thread delete it.
+        if (m_pReactor->m_pLock) {
+            m_pReactor->m_pLock->Lock();
+        }
+
+        m_BlockIOFlags |= CNetBlockIO::DISCONNECT_SOCKET;
+        m_BlockIOFlags |= CNetBlockIO::SIMULATE_NETWORK_ERROR;
+
+        m_pReactor->m_PendingCloseList.InsertTail(&(m_PendingCloseList));
+        ADDREF_THIS();
+
+        if (m_pReactor->m_pLock) {
+            m_pReactor->m_pLock->Unlock();
+        }
+
+        // Tell the select thread to delete this socket.
+        (void) g_pNetIOSystemImpl->WakeSelectThread(m_pReactor);
     }
+} // TestBreakingNetworkConnection.
 
-    // This socket is always in the select list.
-    ASSERT(!(FD_ISSET(m_WakeUpThreadReceive, &m_ReadSocks)));
-    FD_SET(m_WakeUpThreadReceive, &m_ReadSocks);
-#if LINUX
-    if (m_WakeUpThreadReceive >= g_pNetIOSystemImpl->m_FdRange) {
-        g_pNetIOSystemImpl->m_FdRange = m_WakeUpThreadReceive + 1;
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [PrepareToDisconnect]
+//
+// This tells the main select thread the close this socket. It will eventually
+// be closed in the select thread.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetBlockIO::PrepareToDisconnect() {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    int32 numActiveReads;
+    AutoLock(m_pLock);
+    RunChecks();
+
+    DEBUG_LOG("CNetBlockIO::PrepareToDisconnect: pNetBlockIO = %p", this);
+
+    // Avoid closing the same blockIO twice.
+    if (m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET) {
+        DEBUG_LOG("CNetBlockIO::PrepareToDisconnect. Socket is already disconnected");
+        gotoErr(ENoErr);
     }
-#endif // LINUX
 
-    // Make the sockets we use to wake up the select thread non-blocking.
-    err = MakeSocketNonBlocking(m_WakeUpThreadReceive);
-    if (err) {
-        gotoErr(err);
+    // Discard any buffers that were allocated.
+    while (1) {
+        pBuffer = m_PendingReads.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+        m_NumActiveReads -= 1;
+        RELEASE_OBJECT(pBuffer);
     }
-    err = MakeSocketNonBlocking(m_WakeUpThreadListener);
-    if (err) {
-        gotoErr(err);
+#if USE_BATCHED_DATAGRAMS
+    while (1) {
+        pBuffer = m_SpareDatagramBuffers.RemoveHead();
+        if (NULL == pBuffer) {
+            break;
+        }
+        RELEASE_OBJECT(pBuffer);
     }
+#endif
 
-    // Create the table of all active connections. This will map sockets to
-    // the blockIO data structures.
-    m_ActiveSocketTable = newex CNameTable;
-    if (NULL == m_ActiveSocketTable) {
-        gotoErr(EFail);
+    // To avoid a race condition with the select thread,
+    // we don't delete the socket here. Instead, mark the
+    // socket as doomed and let the select thread delete it.
+    if (m_pReactor->m_pLock) {
+        m_pReactor->m_pLock->Lock();
     }
-    err = m_ActiveSocketTable->Initialize(0, 7);
-    if (err) {
-        gotoErr(err);
+
+    numActiveReads = m_NumActiveReads;
+#if USE_IO_URING
+    // An io_uring socket always has one receive posted. That one is
+    // not waiting on anybody, and is released when the ring cancels it.
+    if (m_BlockIOFlags & URING_RECV_POSTED) {
+        numActiveReads -= 1;
+    }
+#endif
+    if ((numActiveReads > 0) || (m_NumActiveWrites > 0)) {
+        DEBUG_WARNING("There are active reads or writes.");
     }
 
-    // Fork the select thread.
-    err = CSimpleThread::CreateThread(
-                              "NetIOSystemSelectThread",
-                              SelectThreadProc,
-                              NULL,
-                              &m_pSelectThread);
-    if (err) {
-        gotoErr(err);
+    m_BlockIOFlags |= CNetBlockIO::DISCONNECT_SOCKET;
+    m_pReactor->m_PendingCloseList.InsertTail(&(m_PendingCloseList));
+    ADDREF_THIS();
+
+    DEBUG_LOG("CNetBlockIO::PrepareToDisconnect: Put pNetBlockIO %p on PendingCloseList", this);
+
+    if (m_pReactor->m_pLock) {
+        m_pReactor->m_pLock->Unlock();
     }
 
+    // Tell the select thread to delete this socket.
+    (void) g_pNetIOSystemImpl->WakeSelectThread(m_pReactor);
+
 abort:
     returnErr(err);
-} // InitNetIOSystem.
+} // PrepareToDisconnect.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CancelTimeout]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::CancelTimeout(int32 opType) {
+    bool fReleaseTimer = false;
+
+    m_pLock->Lock();
+    if ((m_NumTimeouts > 0)
+        && (m_CurrentTimeoutOp == opType)) {
+        m_NumTimeouts--;
+        if (0 == m_NumTimeouts) {
+            fReleaseTimer = StopTimeoutTimer();
+        }
+    }
+    m_pLock->Unlock();
+
+    // Do this outside the lock, since it may be the last reference.
+    if (fReleaseTimer) {
+        RELEASE_THIS();
+    }
+} // CancelTimeout
 
 
 
@@ -1462,64 +2175,51 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [Shutdown]
+// [StartTimeout]
 //
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CNetIOSystem::Shutdown() {
+void
+CNetBlockIO::StartTimeout(int32 opType) {
     ErrVal err = ENoErr;
+    int32 value = 0;
+    AutoLock(m_pLock);
 
-    // If we never lazily initialized the IO system, then there is nothing
-    // to do.
-    if (!m_fInitialized) {
-        returnErr(ENoErr);
-    }
+    ASSERT(0 == m_NumTimeouts);
 
-    DEBUG_LOG("CNetIOSystem::Shutdown()");
+    switch (opType) {
+    case CIOBuffer::READ:
+        value = m_ReadTimeout;
+        break;
 
-    // Run any standard debugger checks.
-    RunChecks();
+    case CIOBuffer::WRITE:
+        value = DEFAULT_WRITE_TIMEOUT_IN_MS;
+        break;
 
-    // Tell the select thread to stop.
-    m_StopSelectThread = true;
-    if ((NULL != m_pSelectThread)
-        && (NULL != m_pSelectThreadStopped)
-        && (m_pSelectThread->IsRunning())) {
-        err = WakeSelectThread();
-        // Wait for the select thread to stop.
-        m_pSelectThreadStopped->Wait();
+    case CIOBuffer::IO_CONNECT:
+        value = m_ConnectTimeout;
+        break;
+
+    default:
+        break;
     }
-    RELEASE_OBJECT(m_pSelectThreadStopped);
 
+    DEBUG_LOG("CNetBlockIO::StartTimeout: opType = %d, time = %d", opType, value);
 
-    if (NULL_SOCKET != m_WakeUpThreadSend) {
-        SafeCloseSocket(m_WakeUpThreadSend, false);
-        m_WakeUpThreadSend = NULL_SOCKET;
-    }
-    if (NULL_SOCKET != m_WakeUpThreadListener) {
-       SafeCloseSocket(m_WakeUpThreadListener, false);
-       m_WakeUpThreadListener = NULL_SOCKET;
-    }
-    if (NULL_SOCKET != m_WakeUpThreadReceive) {
-        SafeCloseSocket(m_WakeUpThreadReceive, false);
-        m_WakeUpThreadReceive = NULL_SOCKET;
-    }
+    m_CurrentTimeoutOp = opType;
+    m_NumTimeouts++;
 
-#if WIN32
-    {
-        BOOL result = WSACleanup();
+    if ((NULL == m_pReactor) || (m_BlockIOFlags & NEVER_TIMEOUT)) {
+        return;
     }
-#endif
 
-    if (m_ActiveSocketTable) {
-        delete m_ActiveSocketTable;
+    // Arming the timer is O(1), and the reactor only looks at this
+    // blockIO again if the timer actually fires.
+    err = m_pReactor->m_TimerWheel.AddTimer(&m_TimeoutTimer, value);
+    if ((!err) && !(m_fTimeoutHoldsReference)) {
+        m_fTimeoutHoldsReference = true;
+        ADDREF_THIS();
     }
-    m_ActiveSocketTable = NULL;
-
-    err = CIOSystem::Shutdown();
-
-    returnErr(err);
-} // Shutdown.
+} // StartTimeout.
 
 
 
@@ -1528,116 +2228,2021 @@ CNetIOSystem::Shutdown() {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [NetIO_LookupHost]
+// [StopTimeoutTimer]
 //
+// The caller must hold the blockIO lock. This returns true if the caller
+// must release the reference that the timer held on this blockIO. The
+// caller should do that after it releases the lock.
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-NetIO_LookupHost(
-                char *pName,
-                uint16 portNum,
-                struct sockaddr_in *pSockAddr) {
-    ErrVal err = ENoErr;
-    int result;
-    uint32 addrVal;
-    char portStr[32];
-    struct addrinfo addressHints;
-    struct addrinfo *addressResultList = NULL;
-    struct addrinfo *currentAddr = NULL;
-
+bool
+CNetBlockIO::StopTimeoutTimer() {
+    CTimerWheel::CancelTimer(&m_TimeoutTimer);
 
-    if ((NULL == pName) || (NULL == pSockAddr)) {
-        gotoErr(EFail);
+    if (m_fTimeoutHoldsReference) {
+        m_fTimeoutHoldsReference = false;
+        return(true);
     }
 
-    DEBUG_LOG("NetIO_LookupHost. pName = %s, portNum = %d",
-                pName, portNum);
+    return(false);
+} // StopTimeoutTimer.
 
-    // First zero out any padding bytes and the sin_zero field.
-    memset(pSockAddr, 0, sizeof(struct sockaddr_in));
 
-    // Winsock does not support passing strings like 127.0.0.1 to
-    // gethostbyname. As a result, we use inet_addr to detect and
-    // translate such a name into an ip address.
-    addrVal = inet_addr(pName);
-    if (INADDR_NONE == addrVal) {
-        if (0 == strcasecmpex(pName, "localhost")) {
-#if WIN32
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnTimer]
+//
+// This is called by the reactor thread when the timeout timer fires.
+// The timer wheel holds a reference on the blockIO during the call.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetBlockIO::OnTimer(CTimer *pTimer) {
+    bool fFireTimeout = false;
+    bool fReleaseTimer = false;
+    int32 timeoutOp = CIOBuffer::NO_OP;
+
+    if (&m_TimeoutTimer != pTimer) {
+        return;
+    }
+
+    m_pLock->Lock();
+
+    // If the timer was re-armed after it was taken off the wheel,
+    // then this is a stale firing, and the new timer owns the reference.
+    if (!(m_TimeoutTimer.IsArmed())) {
+        if (m_fTimeoutHoldsReference) {
+            m_fTimeoutHoldsReference = false;
+            fReleaseTimer = true;
+        }
+
+        if (!(m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)
+            && !(m_BlockIOFlags & NEVER_TIMEOUT)
+            && (m_NumTimeouts > 0)) {
+            DEBUG_LOG("CNetBlockIO::OnTimer: Timing out blockIO %p. m_CurrentTimeoutOp = %d",
+                        this, m_CurrentTimeoutOp);
+
+            // Firing a timeout clears all pending activity.
+            // This covers a weird case. There should be only one pending action
+            // at any single time, so we only record one timeout. To be safe,
+            // however, when that timeout fires, it cancels all pending
+            // actions.
+            m_NumTimeouts = 0;
+            timeoutOp = m_CurrentTimeoutOp;
+            fFireTimeout = true;
+        }
+    } // if (!(m_TimeoutTimer.IsArmed()))
+
+    m_pLock->Unlock();
+
+    if ((fFireTimeout) && (g_pNetIOSystemImpl)) {
+        g_pNetIOSystemImpl->FireTimeout(this, timeoutOp);
+    }
+
+    if (fReleaseTimer) {
+        RELEASE_THIS();
+    }
+} // OnTimer.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CNetIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+CNetIOSystem::CNetIOSystem() {
+    m_pReactorList = NULL;
+    m_NumReactors = 0;
+    m_NextReactor = 0;
+
+    m_StopSelectThread = false;
+
+    m_LocalAddr.sin_addr.s_addr = INADDR_ANY;
+
+    m_NumBytesPerSocketBuffer = DEFAULT_SOCKET_BUFFER_BYTES;
+
+    m_MaxNumBlockIOs = FD_SETSIZE - 3;
+
+#if USE_REUSEPORT_LISTENERS
+    m_NumListenersPerPort = 1;
+#endif
+
+#if USE_EPOLL_REACTOR
+    m_fUseEpoll = false;
+#endif
+
+#if USE_IO_URING
+    m_fUseIOUring = false;
+    m_pIOUring = NULL;
+    m_pUringThread = NULL;
+    m_pUringThreadStopped = NULL;
+#endif
+} // CNetIOSystem.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CNetIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+CNetIOSystem::~CNetIOSystem() {
+} // ~CNetIOSystem.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CNetReactor]
+//
+/////////////////////////////////////////////////////////////////////////////
+CNetReactor::CNetReactor() {
+    m_ReactorNum = 0;
+    m_pLock = NULL;
+
+    m_pSelectThread = NULL;
+    m_WakeUpThreadSend = NULL_SOCKET;
+    m_WakeUpThreadListener = NULL_SOCKET;
+    m_WakeUpThreadReceive = NULL_SOCKET;
+    m_wakeUpConnAddr.sin_addr.s_addr = INADDR_ANY;
+    m_fPendingWakeupMessage = false;
+    m_pSelectThreadStopped = NULL;
+
+    FD_ZERO(&m_ReadSocks);
+    FD_ZERO(&m_WriteSocks);
+    FD_ZERO(&m_ExceptionSocks);
+    m_FdRange = 0;
+
+    FD_ZERO(&m_ResultReadSocks);
+    FD_ZERO(&m_ResultWriteSocks);
+    FD_ZERO(&m_ResultExceptionSocks);
+    m_ResultFdRange = 0;
+
+    m_BlockIOs.ResetQueue();
+    m_ActiveBlockIOs.ResetQueue();
+    m_pSocketTable = NULL;
+    m_PendingCloseList.ResetQueue();
+    m_pEmptyPendingCloseBlockIOs = NULL;
+
+    m_WaitDeadline = 0;
+
+#if USE_EPOLL_REACTOR
+    m_EpollFd = -1;
+#endif
+} // CNetReactor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CNetReactor]
+//
+/////////////////////////////////////////////////////////////////////////////
+CNetReactor::~CNetReactor() {
+    if (NULL != m_pSocketTable) {
+        delete m_pSocketTable;
+        m_pSocketTable = NULL;
+    }
+    RELEASE_OBJECT(m_pEmptyPendingCloseBlockIOs);
+    RELEASE_OBJECT(m_pSelectThreadStopped);
+    RELEASE_OBJECT(m_pLock);
+} // ~CNetReactor.
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InitNetIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::InitNetIOSystem() {
+    ErrVal err = ENoErr;
+    struct hostent *hostInfo = NULL;
+    int32 reactorNum;
+
+#if USE_SOCKS
+    if (!g_InitedFirewall) {
+        SOCKSinit("myProgram");
+        g_InitedFirewall = true;
+    }
+#endif // USE_SOCKS
+
+    // A buffer of 0 leaves the size to the kernel, which grows it as the
+    // connection needs.
+    m_NumBytesPerSocketBuffer = DEFAULT_SOCKET_BUFFER_BYTES;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_NumBytesPerSocketBuffer = g_pBuildingBlocksConfig->GetInt(
+                                            g_NetworkSocketBufferSizeConfigValueName,
+                                            DEFAULT_SOCKET_BUFFER_BYTES);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_SocketBufferSize >= 0) {
+        m_NumBytesPerSocketBuffer = m_TestSettings.m_SocketBufferSize;
+    }
+#endif
+
+    // Initialize the base class.
+    err = CIOSystem::InitIOSystem();
+    if (err) {
+        gotoErr(err);
+    }
+
+#if USE_EPOLL_REACTOR
+    // select() cannot handle a socket whose number is FD_SETSIZE or larger,
+    // and it costs O(N) for every wakeup. epoll has neither problem, so use it
+    // unless the config file says not to.
+    m_fUseEpoll = true;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_fUseEpoll = g_pBuildingBlocksConfig->GetBool(g_NetworkUseEpollConfigValueName, true);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_UseEpoll >= 0) {
+        m_fUseEpoll = (m_TestSettings.m_UseEpoll > 0);
+    }
+#endif
+#endif // USE_EPOLL_REACTOR
+
+    // Find out some standard information about this host.
+    // Do this before we initialize the sockets so we can
+    // use the host address for them.
+    memset(&m_LocalAddr, 0, sizeof(struct sockaddr_in));
+    m_LocalAddr.sin_addr.s_addr = INADDR_ANY;
+
+
+    // Get the local IP address.
+    //
+    // If the name parameter is to gethostbyname, then this gets
+    // the result for the local host.
+    // On Windows, it seems that gethostbyname(NULL) works more reliably
+    // than gethostbyname(gethostname()) on Windows.
+#if WIN32
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Calling gethostbyname(NULL)");
+    hostInfo = gethostbyname(NULL);
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. gethostbyname(NULL) returned");
+#endif
+
+#if LINUX_DYNAMIC_LINK
+    // The Linux version seems to work fine with a dynamically linked libc.
+    // However, it fails with a statically linked glibc. It seems that the
+    // name resolution library runs different code depending on host-specific
+    // preferences, like whether to use DNS or other network infrastructure.
+    // So, rather than writing 1 program that can call out to different local
+    // name resolver services (like, via a local pipe or system call), the
+    // C library is hard-compiled with the diffreent sources. This means that
+    // libc cannot call gethostbyname in a portable way. Instead, you must dynamically
+    // link with the local glibc on each different machine. If you really
+    // need to run the static glibc, then you cannot use this call.
+    {
+        char buffer[512];
+        int nameLength;
+
+        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Calling gethostname");
+        nameLength = gethostname(buffer, sizeof(buffer));
+        DEBUG_LOG("CNetIOSystem::InitNetIOSystem. gethostname returned");
+        if (nameLength < 0) {
+            buffer[0] = 0;
+        }
+        hostInfo = gethostbyname(buffer);
+    }
+#endif
+    if (hostInfo) {
+        memcpy(&(m_LocalAddr.sin_addr), hostInfo->h_addr, hostInfo->h_length);
+    }
+
+    if (INADDR_ANY == m_LocalAddr.sin_addr.s_addr) {
+#if WIN32
+        m_LocalAddr.sin_addr.S_un.S_un_b.s_b1 = 127;
+        m_LocalAddr.sin_addr.S_un.S_un_b.s_b2 = 0;
+        m_LocalAddr.sin_addr.S_un.S_un_b.s_b3 = 0;
+        m_LocalAddr.sin_addr.S_un.S_un_b.s_b4 = 1;
+#elif LINUX
+        m_LocalAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+#endif
+    }
+    // NOTE: the sin_family value is not set on WinNT, so explicitly
+    // set this to AF_INET
+    m_LocalAddr.sin_family = AF_INET;
+    m_LocalAddr.sin_port = htons(0);
+
+
+#if WIN32
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Local address = %d.%d.%d.%d",
+                m_LocalAddr.sin_addr.S_un.S_un_b.s_b1,
+                m_LocalAddr.sin_addr.S_un.S_un_b.s_b2,
+                m_LocalAddr.sin_addr.S_un.S_un_b.s_b3,
+                m_LocalAddr.sin_addr.S_un.S_un_b.s_b4);
+#elif LINUX
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Local address = 0x%X",
+              m_LocalAddr.sin_addr);
+#endif
+
+
+    // Start the reactor threads. Unless the config file says otherwise,
+    // there is one per core, so event dispatch scales with the machine.
+    m_NumReactors = 0;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_NumReactors = g_pBuildingBlocksConfig->GetInt(g_NetworkNumReactorsConfigValueName, 0);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_NumReactors >= 0) {
+        m_NumReactors = m_TestSettings.m_NumReactors;
+    }
+#endif
+#if LINUX
+    if (m_NumReactors <= 0) {
+        m_NumReactors = (int32) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#endif
+    if (m_NumReactors <= 0) {
+        m_NumReactors = 1;
+    }
+    if (m_NumReactors > MAX_REACTORS) {
+        m_NumReactors = MAX_REACTORS;
+    }
+    m_NextReactor = 0;
+
+    m_pReactorList = (CNetReactor **) memAlloc(sizeof(CNetReactor *) * m_NumReactors);
+    if (NULL == m_pReactorList) {
+        gotoErr(EFail);
+    }
+    for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+        m_pReactorList[reactorNum] = NULL;
+    }
+    for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+        m_pReactorList[reactorNum] = newex CNetReactor;
+        if (NULL == m_pReactorList[reactorNum]) {
+            gotoErr(EFail);
+        }
+        m_pReactorList[reactorNum]->m_ReactorNum = reactorNum;
+
+        err = InitReactor(m_pReactorList[reactorNum]);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+
+#if USE_EPOLL_REACTOR
+    if (m_fUseEpoll) {
+        m_MaxNumBlockIOs = DEFAULT_MAX_EPOLL_BLOCKIOS;
+        if (NULL != g_pBuildingBlocksConfig) {
+            m_MaxNumBlockIOs = g_pBuildingBlocksConfig->GetInt(
+                                            g_NetworkMaxConnectionsConfigValueName,
+                                            DEFAULT_MAX_EPOLL_BLOCKIOS);
+        }
+    }
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. m_fUseEpoll = %d, m_MaxNumBlockIOs = %d",
+                m_fUseEpoll, m_MaxNumBlockIOs);
+#endif // USE_EPOLL_REACTOR
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. m_NumReactors = %d", m_NumReactors);
+
+#if USE_REUSEPORT_LISTENERS
+    // By default, a port has a single listener. 0 means one per reactor.
+    m_NumListenersPerPort = 1;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_NumListenersPerPort = g_pBuildingBlocksConfig->GetInt(
+                                            g_NetworkListenersPerPortConfigValueName,
+                                            1);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_NumListenersPerPort >= 0) {
+        m_NumListenersPerPort = m_TestSettings.m_NumListenersPerPort;
+    }
+#endif
+    if ((m_NumListenersPerPort <= 0) || (m_NumListenersPerPort > m_NumReactors)) {
+        m_NumListenersPerPort = m_NumReactors;
+    }
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. m_NumListenersPerPort = %d", m_NumListenersPerPort);
+#endif // USE_REUSEPORT_LISTENERS
+
+#if USE_IO_URING
+    // io_uring is optional. If the config file asks for it but the kernel
+    // does not support it, then quietly use the select thread for everything.
+    m_fUseIOUring = false;
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_fUseIOUring = g_pBuildingBlocksConfig->GetBool(g_NetworkUseIOUringConfigValueName, false);
+    }
+#if INCLUDE_REGRESSION_TESTS
+    if (m_TestSettings.m_UseIOUring >= 0) {
+        m_fUseIOUring = (m_TestSettings.m_UseIOUring > 0);
+    }
+#endif
+    if (m_fUseIOUring) {
+        m_pIOUring = newex CIOUring;
+        if (NULL == m_pIOUring) {
+            gotoErr(EFail);
+        }
+        err = m_pIOUring->Initialize(IO_URING_NUM_ENTRIES);
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::InitNetIOSystem. Cannot create an io_uring. err = %d", err);
+            delete m_pIOUring;
+            m_pIOUring = NULL;
+            m_fUseIOUring = false;
+            err = ENoErr;
+        }
+    }
+    if (m_fUseIOUring) {
+        m_pUringThreadStopped = newex CRefEvent;
+        if (NULL == m_pUringThreadStopped) {
+            gotoErr(EFail);
+        }
+        err = m_pUringThreadStopped->Initialize();
+        if (err) {
+            gotoErr(EFail);
+        }
+
+        err = CSimpleThread::CreateThread(
+                                  "NetIOSystemUringThread",
+                                  UringThreadProc,
+                                  NULL,
+                                  &m_pUringThread);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+    DEBUG_LOG("CNetIOSystem::InitNetIOSystem. m_fUseIOUring = %d", m_fUseIOUring);
+#endif // USE_IO_URING
+
+abort:
+    returnErr(err);
+} // InitNetIOSystem.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InitReactor]
+//
+// This creates the lock, the wakeup sockets and the epoll instance of one
+// reactor, and then forks its thread.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::InitReactor(CNetReactor *pReactor) {
+    ErrVal err = ENoErr;
+    int result;
+    struct sockaddr_in wakeUpListenAddr;
+    socklen_t addrLen;
+    int32 lastErr = 0;
+
+    // Locks and events.
+    pReactor->m_pLock = CRefLock::Alloc();
+    if (NULL == pReactor->m_pLock) {
+        gotoErr(EFail);
+    }
+    pReactor->m_pSelectThreadStopped = newex CRefEvent;
+    if (NULL == pReactor->m_pSelectThreadStopped) {
+        gotoErr(EFail);
+    }
+    err = pReactor->m_pSelectThreadStopped->Initialize();
+    if (err) {
+        gotoErr(EFail);
+    }
+
+    err = pReactor->m_TimerWheel.Initialize(TIMER_TICK_IN_MS);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // This maps the sockets of this reactor to their blockIOs.
+    pReactor->m_pSocketTable = newex CNameTable;
+    if (NULL == pReactor->m_pSocketTable) {
+        gotoErr(EFail);
+    }
+    err = pReactor->m_pSocketTable->Initialize(0, 7);
+    if (err) {
+        gotoErr(err);
+    }
+
+#if USE_EPOLL_REACTOR
+    // If we cannot create the first epoll instance, then quietly fall
+    // back to select for every reactor.
+    if (m_fUseEpoll) {
+        pReactor->m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (pReactor->m_EpollFd < 0) {
+            DEBUG_LOG("CNetIOSystem::InitReactor. epoll_create1 failed. errno = %d",
+                        GET_LAST_ERROR());
+            if (pReactor->m_ReactorNum > 0) {
+                gotoErr(EFail);
+            }
+            m_fUseEpoll = false;
+        }
+    }
+#endif // USE_EPOLL_REACTOR
+
+    // Create the sockets that wake up the select thread.
+    pReactor->m_WakeUpThreadSend = socket(AF_INET, SOCK_STREAM, 0);
+    if (NULL_SOCKET == pReactor->m_WakeUpThreadSend) {
+        gotoErr(EFail);
+    }
+    pReactor->m_WakeUpThreadListener = socket(AF_INET, SOCK_STREAM, 0);
+    if (NULL_SOCKET == pReactor->m_WakeUpThreadListener) {
+        gotoErr(EFail);
+    }
+
+    // Make the connect socket asynch before we connect so
+    // the connect will be asynch. Otherwise, we block on ourselves.
+    // Do not make the listener asynch, however, because we
+    // want the accept to be blocking.
+    err = MakeSocketNonBlocking(pReactor->m_WakeUpThreadSend);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Bind the socket to a name. This is necessary to connect to the socket.
+    // Really, we just want the system to assign a port to us.
+    // Because we don't rely on any specific port, we won't collide
+    // with another application, or suffer potential DoS attacks.
+    result = bind(
+                pReactor->m_WakeUpThreadListener,
+                (struct sockaddr *) &m_LocalAddr,
+                sizeof(struct sockaddr_in));
+    // Get the last error immediately after the system call.
+    // Anything code, even a DEBUG_LOG, may touch a file and
+    // change the last error.
+    lastErr = GET_LAST_ERROR();
+
+    if (result < 0) {
+        DEBUG_LOG("CNetIOSystem::InitReactor. bind failed. result = %d, lastErr = %d",
+                    result, lastErr);
+        gotoErr(EFail);
+    }
+
+    // Allow up to 5 connections to be waiting for an
+    // accept, which is the most allowed by typical
+    // implementations. We can still have any number of
+    // active connections that have been accepted.
+    result = listen(pReactor->m_WakeUpThreadListener, 5);
+
+    // Get the port that the wakeup connection socket is
+    // listening to. We don't need the address, we just need
+    // to know what port we were assigned.
+    addrLen = sizeof(struct sockaddr_in);
+    result = getsockname(
+                pReactor->m_WakeUpThreadListener,
+                (struct sockaddr *) &wakeUpListenAddr,
+                &addrLen);
+    // Get the last error immediately after the system call.
+    // Anything code, even a DEBUG_LOG, may touch a file and
+    // change the last error.
+    lastErr = GET_LAST_ERROR();
+
+    if (result < 0) {
+        DEBUG_LOG("CNetIOSystem::InitReactor. getsockname failed. result = %d, last err = %d",
+                    result, lastErr);
+        gotoErr(EFail);
+    }
+
+    memset(&(pReactor->m_wakeUpConnAddr), 0, sizeof(struct sockaddr_in));
+    pReactor->m_wakeUpConnAddr = m_LocalAddr;
+    pReactor->m_wakeUpConnAddr.sin_port = wakeUpListenAddr.sin_port;
+
+    // Asynchronously connect to the listener socket. This will return an
+    // asynch error until we call accept below.
+    result = connect(
+                pReactor->m_WakeUpThreadSend,
+                (struct sockaddr *) &(pReactor->m_wakeUpConnAddr),
+                sizeof(struct sockaddr_in));
+    // Get the last error immediately after the system call.
+    // Anything code, even a DEBUG_LOG, may touch a file and
+    // change the last error.
+    lastErr = GET_LAST_ERROR();
+
+    if ((result != 0) && !(IO_WOULD_BLOCK(lastErr))) {
+        DEBUG_LOG("CNetIOSystem::InitReactor. connect() failed. result = %d, last err = %d",
+                    result, lastErr);
+        gotoErr(EFail);
+    }
+
+    // Accept the connection from ourselves, this will create a new socket
+    // and establishing the connection with ourselves.
+    addrLen = sizeof(struct sockaddr_in);
+    pReactor->m_WakeUpThreadReceive = accept(
+                                pReactor->m_WakeUpThreadListener,
+                                (struct sockaddr*) &(pReactor->m_wakeUpConnAddr),
+                                &addrLen);
+    // Get the last error immediately after the system call.
+    // Anything code, even a DEBUG_LOG, may touch a file and
+    // change the last error.
+    lastErr = GET_LAST_ERROR();
+
+    if (NULL_SOCKET == pReactor->m_WakeUpThreadReceive) {
+        DEBUG_LOG("CNetIOSystem::InitReactor. accept() failed. last err = %d",
+                    lastErr);
+        gotoErr(EFail);
+    }
+
+    // This socket is always in the select list.
+#if USE_EPOLL_REACTOR
+    if (m_fUseEpoll) {
+        struct epoll_event epollEvent;
+
+        // The wakeup socket is the only one without a blockIO, so a NULL
+        // data pointer identifies it.
+        memset(&epollEvent, 0, sizeof(epollEvent));
+        epollEvent.events = EPOLLIN;
+        epollEvent.data.ptr = NULL;
+        result = epoll_ctl(
+                    pReactor->m_EpollFd,
+                    EPOLL_CTL_ADD,
+                    pReactor->m_WakeUpThreadReceive,
+                    &epollEvent);
+        if (result < 0) {
+            DEBUG_LOG("CNetIOSystem::InitReactor. epoll_ctl failed. errno = %d",
+                        GET_LAST_ERROR());
+            gotoErr(EFail);
+        }
+    } else
+#endif // USE_EPOLL_REACTOR
+    {
+        ASSERT(!(FD_ISSET(pReactor->m_WakeUpThreadReceive, &pReactor->m_ReadSocks)));
+        FD_SET(pReactor->m_WakeUpThreadReceive, &pReactor->m_ReadSocks);
+#if LINUX
+        if (pReactor->m_WakeUpThreadReceive >= pReactor->m_FdRange) {
+            pReactor->m_FdRange = pReactor->m_WakeUpThreadReceive + 1;
+        }
+#endif // LINUX
+    }
+
+    // Make the sockets we use to wake up the select thread non-blocking.
+    err = MakeSocketNonBlocking(pReactor->m_WakeUpThreadReceive);
+    if (err) {
+        gotoErr(err);
+    }
+    err = MakeSocketNonBlocking(pReactor->m_WakeUpThreadListener);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Fork the select thread.
+    err = CSimpleThread::CreateThread(
+                              "NetIOSystemSelectThread",
+                              SelectThreadProc,
+                              pReactor,
+                              &(pReactor->m_pSelectThread));
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    returnErr(err);
+} // InitReactor.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Shutdown]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::Shutdown() {
+    ErrVal err = ENoErr;
+    int32 reactorNum;
+
+    // If we never lazily initialized the IO system, then there is nothing
+    // to do.
+    if (!m_fInitialized) {
+        returnErr(ENoErr);
+    }
+
+    DEBUG_LOG("CNetIOSystem::Shutdown()");
+
+    // Run any standard debugger checks.
+    RunChecks();
+
+    // Tell the reactor threads to stop.
+    m_StopSelectThread = true;
+    if (NULL != m_pReactorList) {
+        for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+            if (NULL != m_pReactorList[reactorNum]) {
+                ShutdownReactor(m_pReactorList[reactorNum]);
+            }
+        }
+    }
+
+#if USE_IO_URING
+    // A NOP with no user data tells the uring thread to look at
+    // m_StopSelectThread.
+    if ((NULL != m_pIOUring)
+        && (NULL != m_pUringThread)
+        && (NULL != m_pUringThreadStopped)
+        && (m_pUringThread->IsRunning())) {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_NOP;
+        sqe.fd = -1;
+        sqe.user_data = URING_STOP_OP;
+        err = m_pIOUring->SubmitSQE(&sqe);
+        if (!err) {
+            m_pUringThreadStopped->Wait();
+        }
+    }
+    RELEASE_OBJECT(m_pUringThreadStopped);
+    if (NULL != m_pIOUring) {
+        delete m_pIOUring;
+        m_pIOUring = NULL;
+    }
+    m_fUseIOUring = false;
+#endif // USE_IO_URING
+
+    // Only delete the reactors once no other thread can wake them up.
+    if (NULL != m_pReactorList) {
+        for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+            if (NULL != m_pReactorList[reactorNum]) {
+                delete m_pReactorList[reactorNum];
+                m_pReactorList[reactorNum] = NULL;
+            }
+        }
+        memFree(m_pReactorList);
+        m_pReactorList = NULL;
+    }
+    m_NumReactors = 0;
+
+#if WIN32
+    {
+        BOOL result = WSACleanup();
+    }
+#endif
+
+    err = CIOSystem::Shutdown();
+
+    returnErr(err);
+} // Shutdown.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ShutdownReactor]
+//
+// This stops one reactor thread and closes its wakeup sockets. The caller
+// has already set m_StopSelectThread.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::ShutdownReactor(CNetReactor *pReactor) {
+    if ((NULL != pReactor->m_pSelectThread)
+        && (NULL != pReactor->m_pSelectThreadStopped)
+        && (pReactor->m_pSelectThread->IsRunning())) {
+        (void) WakeSelectThread(pReactor);
+        // Wait for the select thread to stop.
+        pReactor->m_pSelectThreadStopped->Wait();
+    }
+    RELEASE_OBJECT(pReactor->m_pSelectThreadStopped);
+
+    if (NULL_SOCKET != pReactor->m_WakeUpThreadSend) {
+        SafeCloseSocket(pReactor->m_WakeUpThreadSend, false);
+        pReactor->m_WakeUpThreadSend = NULL_SOCKET;
+    }
+    if (NULL_SOCKET != pReactor->m_WakeUpThreadListener) {
+       SafeCloseSocket(pReactor->m_WakeUpThreadListener, false);
+       pReactor->m_WakeUpThreadListener = NULL_SOCKET;
+    }
+    if (NULL_SOCKET != pReactor->m_WakeUpThreadReceive) {
+        SafeCloseSocket(pReactor->m_WakeUpThreadReceive, false);
+        pReactor->m_WakeUpThreadReceive = NULL_SOCKET;
+    }
+#if USE_EPOLL_REACTOR
+    if (pReactor->m_EpollFd >= 0) {
+        ::close(pReactor->m_EpollFd);
+        pReactor->m_EpollFd = -1;
+    }
+#endif
+} // ShutdownReactor.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_LookupHost]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_LookupHost(
+                char *pName,
+                uint16 portNum,
+                struct sockaddr_in *pSockAddr) {
+    ErrVal err = ENoErr;
+    int result;
+    uint32 addrVal;
+    char portStr[32];
+    struct addrinfo addressHints;
+    struct addrinfo *addressResultList = NULL;
+    struct addrinfo *currentAddr = NULL;
+
+
+    if ((NULL == pName) || (NULL == pSockAddr)) {
+        gotoErr(EFail);
+    }
+
+    DEBUG_LOG("NetIO_LookupHost. pName = %s, portNum = %d",
+                pName, portNum);
+
+    // First zero out any padding bytes and the sin_zero field.
+    memset(pSockAddr, 0, sizeof(struct sockaddr_in));
+
+    // Winsock does not support passing strings like 127.0.0.1 to
+    // gethostbyname. As a result, we use inet_addr to detect and
+    // translate such a name into an ip address.
+    addrVal = inet_addr(pName);
+    if (INADDR_NONE == addrVal) {
+        if (0 == strcasecmpex(pName, "localhost")) {
+#if WIN32
             pSockAddr->sin_addr.S_un.S_un_b.s_b1 = 127;
             pSockAddr->sin_addr.S_un.S_un_b.s_b2 = 0;
             pSockAddr->sin_addr.S_un.S_un_b.s_b3 = 0;
             pSockAddr->sin_addr.S_un.S_un_b.s_b4 = 1;
 #elif LINUX
-            pSockAddr->sin_addr.s_addr = inet_addr("127.0.0.1");
+            pSockAddr->sin_addr.s_addr = inet_addr("127.0.0.1");
+#endif
+        } else {
+            snprintf(portStr, sizeof(portStr), "%d", portNum);
+            memset(&addressHints, 0, sizeof(addressHints));
+            addressHints.ai_family = AF_INET;
+            addressHints.ai_socktype = SOCK_STREAM;
+
+            // getaddrinfo() is both thread-safe and supports IPv6.
+            // Don't use gethostbyname, since it is not thread-safe.
+#if LINUX_DYNAMIC_LINK
+            DEBUG_LOG("NetIO_LookupHost. Calling getaddrinfo");
+            result = getaddrinfo(pName, portStr, &addressHints, &addressResultList);
+            DEBUG_LOG("NetIO_LookupHost. getaddrinfo returned. result = %d", result);
+#else
+	        // The Linux version seems to work fine with a dynamically linked libc.
+	        // However, it fails with a statically linked glibc. It seems that the
+	        // name resolution library runs different code depending on host-specific
+	        // preferences, like whether to use DNS or other network infrastructure.
+	        // So, rather than writing 1 program that can call out to different local
+	        // name resolver services (like, via a local pipe or system call), the
+	        // C library is hard-compiled with the diffreent sources. This means that
+	        // libc cannot call gethostbyname in a portable way. Instead, you must
+	        // dynamically link with the local glibc on each different machine.
+	        // If you really need to run the static glibc, then you cannot use this
+	        // call.
+	        DEBUG_WARNING("Cant resolve network addresses with static linking");
+            result = -1;
+#endif
+
+            if (0 != result) {
+                DEBUG_LOG("NetIO_LookupHost. getaddrinfo failed. result = %d",
+                            result);
+                gotoErr(ENoHostAddress);
+            }
+            currentAddr = addressResultList;
+            while (NULL != currentAddr) {
+                if (AF_INET == currentAddr->ai_family) {
+                    DEBUG_LOG("NetIO_LookupHost. getaddrinfo found a valid address");
+                    // The address is in network byte order.
+                    memcpy(pSockAddr, currentAddr->ai_addr, sizeof(struct sockaddr_in));
+                    break;
+                }
+                currentAddr = currentAddr->ai_next;
+            }
+            if (NULL == currentAddr) {
+                DEBUG_LOG("NetIO_LookupHost. getaddrinfo returned no matching address");
+                gotoErr(ENoHostAddress);
+            }
+        } // calling getaddrinfo.
+    } else
+    {
+        DEBUG_LOG("NetIO_LookupHost. inet_addr succeeded");
+        pSockAddr->sin_addr.s_addr = addrVal;
+    }
+
+    // NOTE: the sin_family value is invalid on NT, so explicitly
+    // set this to AF_INET
+    pSockAddr->sin_family = AF_INET;
+    pSockAddr->sin_port = htons(portNum);
+
+abort:
+    if (NULL != addressResultList) {
+       freeaddrinfo(addressResultList);
+    }
+
+    returnErr(err);
+} // NetIO_LookupHost.
+
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::OpenBlockIO(
+                    CParsedUrl *pUrl,
+                    int32 options,
+                    CAsyncBlockIOCallback *pCallback) {
+    ErrVal err = ENoErr;
+    CNetBlockIO *pBlockIO = NULL;
+    CNetReactor *pReactor = NULL;
+    int result = 0;
+    bool fIsUDP = false;
+    OSSocket newSocketID = NULL_SOCKET;
+    char cSaveChar;
+    char *pName = NULL;
+    char *pEndName = NULL;
+    struct sockaddr_in sockAddr;
+    int32 numRetries = 0;
+    int32 lastErr = 0;
+    int on = 1;
+    RunChecks();
+
+    DEBUG_LOG("CNetIOSystem::OpenBlockIO()");
+
+    options = options;
+    if ((NULL == pUrl)
+        || (NULL == pCallback)) {
+        gotoErr(EFail);
+    }
+
+    DEBUG_LOG("CNetIOSystem::OpenBlockIO. URL scheme = %d", pUrl->m_Scheme);
+
+    if ((CParsedUrl::URL_SCHEME_IP_ADDRESS != pUrl->m_Scheme)
+        && (!(CParsedUrl::NETWORK_NAME & pUrl->m_Flags)
+            || (NULL == pUrl->m_pHostName))) {
+        gotoErr(EFail);
+    }
+    if ((CParsedUrl::URL_SCHEME_IP_ADDRESS == pUrl->m_Scheme)
+        && (NULL == pUrl->m_pSockAddr)) {
+        gotoErr(EFail);
+    }
+
+
+    // Lazily initialize the IO system when we open the first blockIO.
+    if (!m_fInitialized) {
+        err = InitNetIOSystem();
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::OpenBlockIO. InitNetIOSystem failed. err = %d", err);
+            gotoErr(err);
+        }
+    }
+    if (NULL == m_pReactorList) {
+        gotoErr(EFail);
+    }
+
+    // Look for the IP-address in the URL.
+    // If this URL has an IP-address, then just use it.
+    // DNS lookups are incredibly expensive.
+    if (pUrl->m_pSockAddr) {
+        sockAddr = *(pUrl->m_pSockAddr);
+    } else {
+        // Get the name of the host and temporarily turn it into a C-string.
+        pName = pUrl->m_pHostName;
+        pEndName = pUrl->m_pHostName + pUrl->m_HostNameSize;
+        cSaveChar = *pEndName;
+        *pEndName = 0;
+        err = NetIO_LookupHost(pName, pUrl->m_Port, &sockAddr);
+        *pEndName = cSaveChar;
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::OpenBlockIO. NetIO_LookupHost failed. err = %d", err);
+            gotoErr(err);
+        }
+    }
+
+    // Create a new socket.
+    newSocketID = socket(AF_INET, SOCK_STREAM, 0);
+    if (NULL_SOCKET == newSocketID) {
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO. socket() failed");
+        gotoErr(EFail);
+    }
+    DEBUG_LOG("CNetIOSystem::OpenBlockIO: Opened socket %d", newSocketID);
+
+    // Make the socket non-blocking.
+    // If we do this before connect, then the connect is asynchronous.
+    // If we do this after connect, then the connect is synchronous.
+    err = MakeSocketNonBlocking(newSocketID);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Set the read and write buffers.
+    err = SetSocketBufSizeImpl(newSocketID, true, m_NumBytesPerSocketBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+    err = SetSocketBufSizeImpl(newSocketID, false, m_NumBytesPerSocketBuffer);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Turn off Nagle's algorithm. This causes packets to be sent
+    // immediately, rather than being buffered first on the local
+    // host to group them into larger packets. We do the buffering,
+    // so Nagle's algorithm would just get in the way. With it on, the
+    // last partial packet of a write waits for the ACK of the one
+    // before, and the peer may hold that ACK back for 40ms or more.
+    result = setsockopt(
+                  newSocketID,
+                  IPPROTO_TCP,
+                  TCP_NODELAY,
+                  (const char *) &on,
+                  sizeof(on));
+    if (result < 0) {
+       gotoErr(EFail);
+    }
+
+    // Do not bind the socket, this function is for client connections,
+    // not servers.
+
+    // The new connection only ever locks its own reactor, so connects
+    // do not contend with sockets on other reactors.
+    pReactor = PickReactor();
+
+#if WIN32
+    if ((pReactor->m_WriteSocks.fd_count >= FD_SETSIZE)
+        || (pReactor->m_ExceptionSocks.fd_count >= FD_SETSIZE)
+        || (pReactor->m_ReadSocks.fd_count >= FD_SETSIZE)) {
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO. Failing because too many sockets (%d, %d, %d)",
+                    pReactor->m_WriteSocks.fd_count,
+                    pReactor->m_ReadSocks.fd_count,
+                    pReactor->m_ExceptionSocks.fd_count);
+        gotoErr(ETooManySockets);
+    }
+#endif
+
+    pBlockIO = AllocNetBlockIO(pUrl, newSocketID, 0, pCallback, pReactor);
+    if (NULL == pBlockIO) {
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO. AllocNetBlockIO failed.");
+        gotoErr(ETooManySockets);
+    }
+    // At this point, the connection is in the select thread list,
+    // so the select thread is responsible for finally deleting it.
+
+    pBlockIO->m_BlockIOFlags |= CNetBlockIO::WAITING_TO_CONNECT;
+    pBlockIO->StartTimeout(CIOBuffer::IO_CONNECT);
+
+    // Tell select() to report when this socket is connected.
+    // Do this before we try to connect to avoid a race
+    // condition of the result coming in between the time
+    // we try to connect and the time we tell the select
+    // thread to notify us.
+    //
+    // We always wait for reads on any socket.
+#if USE_IO_URING
+    if (m_fUseIOUring) {
+        pBlockIO->m_BlockIOFlags |= CNetBlockIO::URING_SOCKET;
+    } else
+#endif
+    {
+        WatchSocket(pBlockIO, READ_EVENTS | WRITE_EVENTS | EXCEPTION_EVENTS);
+    }
+
+    err = AddBlockIOToReactor(pBlockIO);
+    if (err) {
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO. AddBlockIOToReactor failed.");
+        gotoErr(err);
+    }
+
+    // Tell the select thread to start listening to this
+    // new socket. We added the socket to the fd set, and
+    // select uses the latest fd set each time it is called.
+    (void) WakeSelectThread(pBlockIO->m_pReactor);
+
+    // TCP ONLY.
+    // Connect to the server. This only works if the server
+    // process is alive and ready to talk.
+#if DD_DEBUG
+    {
+        char *pStaticBuffer = inet_ntoa(sockAddr.sin_addr);
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO connect to: %s", pStaticBuffer);
+    }
+#endif // DD_DEBUG
+
+#if USE_IO_URING
+    // The ring does the whole connect, and tells us when it is done.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SOCKET) {
+        pBlockIO->m_UringAddr = sockAddr;
+        err = UringPostConnect(pBlockIO);
+        result = 0;
+        if (err) {
+            result = -1;
+        }
+    } else
+#endif // USE_IO_URING
+    {
+        // We may have to loop several times to ignore system call failures on Linux.
+        while (1) {
+            result = connect(
+                        newSocketID,
+                        (struct sockaddr *) &sockAddr,
+                        sizeof(struct sockaddr_in));
+            // Get the last error immediately after the system call.
+            // Anything code, even a DEBUG_LOG, may touch a file and
+            // change the last error.
+            lastErr = GET_LAST_ERROR();
+
+#if LINUX
+            if ((result < 0)
+                && (IGNORE_SYSTEMCALL_ERROR())
+                && (numRetries < MAX_SYSTEM_CALL_INTERRUPTS)) {
+                DEBUG_LOG("CNetBlockIO::OpenBlockIO: Ignoring EPIPE.");
+                numRetries++;
+                continue;
+            }
+#endif
+            break;
+        } // while (1)
+    }
+
+    DEBUG_LOG("CNetIOSystem::OpenBlockIO connect returned result=%d, errno=%d",
+                result, lastErr);
+
+    if ((result != 0) && !(IO_WOULD_BLOCK(lastErr))) {
+        DEBUG_LOG("CNetIOSystem::OpenBlockIO connect() failed, giving up");
+        pBlockIO->Close();
+        // A connect the ring could not post has no errno.
+        err = ENoResponse;
+        if (lastErr) {
+            err = TranslateConnectError(-lastErr);
+        }
+        gotoErr(err);
+    }
+
+    if ((pBlockIO)
+        && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::BLOCKIO_IS_OPEN;
+    }
+
+    RELEASE_OBJECT(pBlockIO);
+    returnErr(ENoErr);
+
+abort:
+    if (pBlockIO) {
+        (void) pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    } else { // if (!pBlockIO)
+        if (NULL_SOCKET != newSocketID) {
+            DEBUG_LOG("CNetIOSystem::OpenBlockIO. Call SafeCloseSocket on socket %d", 
+                      newSocketID);
+            SafeCloseSocket(newSocketID, fIsUDP);
+        }
+    }
+
+    returnErr(err);
+} // OpenBlockIO.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenServerBlockIO]
+//
+// On Linux, a TCP port may have several listening sockets, all bound with
+// SO_REUSEPORT. The kernel spreads incoming connections over them, and each
+// one is accepted on its own reactor thread, so accepting is not limited to
+// a single thread. The caller only sees the first listener. Closing it closes
+// the rest.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::OpenServerBlockIO(
+                    bool fIsUDP,
+                    uint16 portNum,
+                    bool fUse127001Address,
+                    CAsyncBlockIOCallback *pCallback,
+                    CAsyncBlockIO **ppResultBlockIO) {
+    ErrVal err = ENoErr;
+    CNetBlockIO *pBlockIO = NULL;
+    int32 firstReactorNum = -1;
+#if USE_REUSEPORT_LISTENERS
+    CNetBlockIO *pListener = NULL;
+    int32 listenerNum;
+    struct sockaddr_in boundAddr;
+    socklen_t addrLength;
+#endif
+    RunChecks();
+
+    if (NULL == ppResultBlockIO) {
+        gotoErr(EFail);
+    }
+    *ppResultBlockIO = NULL;
+
+
+    // Lazily initialize the IO system when we open the first blockIO.
+    if (!m_fInitialized) {
+        err = InitNetIOSystem();
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. InitNetIOSystem failed. err = %d", err);
+            gotoErr(err);
+        }
+    }
+    if (NULL == m_pReactorList) {
+        DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. NULL == m_pReactorList");
+        gotoErr(EFail);
+    }
+
+#if USE_REUSEPORT_LISTENERS
+    // Only TCP listeners are replicated. They use consecutive reactors,
+    // starting with the next one in the round-robin.
+    if ((!fIsUDP) && (m_NumListenersPerPort > 1)) {
+        firstReactorNum = PickReactor()->m_ReactorNum;
+    }
+#endif
+
+    err = OpenListenerSocket(
+                    fIsUDP,
+                    portNum,
+                    fUse127001Address,
+                    firstReactorNum,
+                    pCallback,
+                    &pBlockIO);
+    if (err) {
+        gotoErr(err);
+    }
+
+#if USE_REUSEPORT_LISTENERS
+    if (firstReactorNum >= 0) {
+        // If the system picked the port, then the other listeners
+        // have to bind to the same one.
+        addrLength = sizeof(boundAddr);
+        if (getsockname(pBlockIO->m_Socket, (struct sockaddr *) &boundAddr, &addrLength) < 0) {
+            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. getsockname() failed, errno = %d",
+                        GET_LAST_ERROR());
+            gotoErr(EFail);
+        }
+        portNum = ntohs(boundAddr.sin_port);
+
+        for (listenerNum = 1; listenerNum < m_NumListenersPerPort; listenerNum++) {
+            err = OpenListenerSocket(
+                            false,
+                            portNum,
+                            fUse127001Address,
+                            (firstReactorNum + listenerNum) % m_NumReactors,
+                            pCallback,
+                            &pListener);
+            if (err) {
+                gotoErr(err);
+            }
+
+            // The first listener keeps the reference.
+            AutoLock(pBlockIO->m_pLock);
+            pListener->m_pNextListener = pBlockIO->m_pNextListener;
+            pBlockIO->m_pNextListener = pListener;
+            pListener = NULL;
+        }
+    } // if (firstReactorNum >= 0)
+#endif // USE_REUSEPORT_LISTENERS
+
+    *ppResultBlockIO = pBlockIO;
+    pBlockIO = NULL;
+
+abort:
+    if (pBlockIO) {
+        (void) pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+
+    returnErr(err);
+} // OpenServerBlockIO.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenListenerSocket]
+//
+// This opens one server socket. If reactorNum is not negative, then the
+// socket is one of several listeners on a TCP port. It is bound with
+// SO_REUSEPORT, and it and all the connections it accepts use that reactor.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::OpenListenerSocket(
+                    bool fIsUDP,
+                    uint16 portNum,
+                    bool fUse127001Address,
+                    int32 reactorNum,
+                    CAsyncBlockIOCallback *pCallback,
+                    CNetBlockIO **ppResultBlockIO) {
+    ErrVal err = ENoErr;
+    int result = 0;
+    OSSocket newSocketID = NULL_SOCKET;
+    int on = 1;
+    CParsedUrl *pUrl = NULL;
+    CNetBlockIO *pBlockIO = NULL;
+    int32 lastErr = 0;
+
+    *ppResultBlockIO = NULL;
+
+
+    // Create a URL that has the name we will be listening on.
+    pUrl = CParsedUrl::AllocateUrl(g_LocalServerURL, g_LocalServerURLLength, NULL);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+    pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
+    if (NULL == pUrl->m_pSockAddr) {
+        gotoErr(EFail);
+    }
+    *(pUrl->m_pSockAddr) = m_LocalAddr;
+
+
+    // Create a new socket.
+    if (fIsUDP) {
+        newSocketID = socket(AF_INET, SOCK_DGRAM, 0);
+    } else {
+        newSocketID = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (NULL_SOCKET == newSocketID) {
+        gotoErr(EFail);
+    }
+    DEBUG_LOG("CNetIOSystem::OpenListenerSocket. Opened socket %d", newSocketID);
+
+
+    err = MakeSocketNonBlocking(newSocketID);
+    if (err) {
+        DEBUG_LOG("CNetIOSystem::OpenListenerSocket. MakeSocketNonBlocking failed, err = %d", err);
+        gotoErr(err);
+    }
+
+    // Prevent a hacker application from also binding to our port.
+#if 0
+    on = TRUE;
+    result = setsockopt(
+                newSocketID,
+                SOL_SOCKET,
+                SO_EXCLUSIVEADDRUSE,
+                (const char *) &on,
+                sizeof(on));
+    // Ignore any error.
+    result = 0;
+#endif
+
+    on = 0;
+    result = setsockopt(
+                newSocketID,
+                SOL_SOCKET,
+                SO_REUSEADDR,
+                (const char *) &on,
+                sizeof(on));
+    // Ignore any error.
+    result = 0;
+
+#if USE_REUSEPORT_LISTENERS
+    // Every listener on the port must set this before it binds.
+    if (reactorNum >= 0) {
+        on = 1;
+        result = setsockopt(
+                    newSocketID,
+                    SOL_SOCKET,
+                    SO_REUSEPORT,
+                    (const char *) &on,
+                    sizeof(on));
+        if (result < 0) {
+            DEBUG_LOG("CNetIOSystem::OpenListenerSocket. SO_REUSEPORT failed, errno = %d",
+                        GET_LAST_ERROR());
+            gotoErr(EFail);
+        }
+    }
+#endif
+
+
+    // Some applications will try to connect to 127.0.0.1. In those
+    // cases, we must bind to that address, not the real address of
+    // the machine.
+    if (fUse127001Address) {
+#if WIN32
+        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b1 = 127;
+        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b2 = 0;
+        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b3 = 0;
+        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b4 = 1;
+#elif LINUX
+        pUrl->m_pSockAddr->sin_addr.s_addr = inet_addr("127.0.0.1");
+#endif
+    }
+    if (portNum > 0) {
+        pUrl->m_pSockAddr->sin_port = htons(portNum);
+    } else
+    {
+        pUrl->m_pSockAddr->sin_port = htons(0);
+    }
+
+#if WIN32
+    // On Windows, this will cause us to bind to all NIC's.
+    pUrl->m_pSockAddr->sin_addr.s_addr = INADDR_ANY;
 #endif
+
+    // Bind the socket to a name. This may be very time consuming, so
+    // do it outside the lock.
+    result = bind(
+                newSocketID,
+                (struct sockaddr *) pUrl->m_pSockAddr,
+                sizeof(struct sockaddr_in));
+    // Get the last error immediately after the system call.
+    // Anything code, even a DEBUG_LOG, may touch a file and
+    // change the last error.
+    lastErr = GET_LAST_ERROR();
+
+    if (result < 0) {
+        DEBUG_LOG("CNetIOSystem::OpenListenerSocket. bind() failed, lastErr = %d",
+                    lastErr);
+        gotoErr(EFail);
+    }
+
+    // Allocate the BlockIO.
+    { /////////////////////////////////////////////////
+        pBlockIO = AllocNetBlockIO(
+                        pUrl,
+                        newSocketID,
+                        0,
+                        pCallback,
+                        (reactorNum >= 0) ? m_pReactorList[reactorNum] : NULL);
+        if (!pBlockIO) {
+            DEBUG_LOG("CNetIOSystem::OpenListenerSocket. AllocNetBlockIO failed");
+            gotoErr(ETooManySockets);
+        }
+
+        if (fIsUDP) {
+            pBlockIO->m_BlockIOFlags |= CNetBlockIO::UDP_SOCKET;
         } else {
-            snprintf(portStr, sizeof(portStr), "%d", portNum);
-            memset(&addressHints, 0, sizeof(addressHints));
-            addressHints.ai_family = AF_INET;
-            addressHints.ai_socktype = SOCK_STREAM;
+            pBlockIO->m_BlockIOFlags |= CNetBlockIO::ACCEPT_INCOMING_CONNECTIONS;
+        }
+        if (reactorNum >= 0) {
+            pBlockIO->m_BlockIOFlags |= CNetBlockIO::REUSEPORT_LISTENER;
+        }
+
+#if WIN32
+        if (pBlockIO->m_pReactor->m_ReadSocks.fd_count >= FD_SETSIZE) {
+            DEBUG_LOG("CNetIOSystem::OpenListenerSocket. Too many sockets (%d)",
+                        pBlockIO->m_pReactor->m_ReadSocks.fd_count);
+            gotoErr(ETooManySockets);
+        }
+#endif // WIN32
+
+        // Tell select() to listen on this socket for new connections.
+#if USE_IO_URING
+        if ((m_fUseIOUring) && (!fIsUDP)) {
+            pBlockIO->m_BlockIOFlags |= CNetBlockIO::URING_SOCKET;
+        } else
+#endif
+        {
+            WatchSocket(pBlockIO, READ_EVENTS | EXCEPTION_EVENTS);
+        }
+
+        err = AddBlockIOToReactor(pBlockIO);
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::OpenListenerSocket. AddBlockIOToReactor failed (%d)", err);
+            gotoErr(err);
+        }
+    } /////////////////////////////////////////////////
+
+    if (!fIsUDP) {
+        // Let the kernel queue as many connections as it allows. A short
+        // backlog overflows, and drops connections, under a burst of
+        // connects. We can still have any number of active connections
+        // that have been accepted.
+        result = listen(newSocketID, SOMAXCONN);
+        if (result) {
+            DEBUG_LOG("CNetIOSystem::OpenListenerSocket. listen() failed, lastErr = %d",
+                    lastErr);
+            gotoErr(EFail);
+        }
+    }
+
+#if USE_IO_URING
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SOCKET) {
+        err = UringPostAccept(pBlockIO);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+#endif // USE_IO_URING
+
+    // Tell the select thread to start listening to this new
+    // socket. We added the socket to the fd set, and
+    // select uses the latest fd set each time it is called.
+    (void) WakeSelectThread(pBlockIO->m_pReactor);
+
+    *ppResultBlockIO = pBlockIO;
+    pBlockIO = NULL;
+    newSocketID = NULL_SOCKET;
+
+abort:
+    if (pBlockIO) {
+        (void) pBlockIO->Close();
+        RELEASE_OBJECT(pBlockIO);
+    }
+    if (NULL_SOCKET != newSocketID) {
+        DEBUG_LOG("CNetIOSystem::OpenListenerSocket. Call SafeCloseSocket on socket %d", newSocketID);
+        SafeCloseSocket(newSocketID, fIsUDP);
+        newSocketID = NULL_SOCKET;
+    }
+
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // OpenListenerSocket.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OpenDatagramBlockIO]
+//
+// This opens a UDP socket. Every datagram written on it goes to pDestAddr.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::OpenDatagramBlockIO(
+                    uint16 portNum,
+                    bool fUse127001Address,
+                    const struct sockaddr_in *pDestAddr,
+                    CAsyncBlockIOCallback *pCallback,
+                    CAsyncBlockIO **ppResultBlockIO) {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pBlockIO = NULL;
+
+    if (NULL == ppResultBlockIO) {
+        gotoErr(EFail);
+    }
+    *ppResultBlockIO = NULL;
+
+    err = OpenServerBlockIO(
+                    true, // fUDP
+                    portNum,
+                    fUse127001Address,
+                    pCallback,
+                    &pBlockIO);
+    if (err) {
+        gotoErr(err);
+    }
+
+    // Nothing can be written until the caller has the blockIO, so this
+    // does not race with a send.
+    if (pDestAddr) {
+        ((CNetBlockIO *) pBlockIO)->m_UDPDatagramDest = *pDestAddr;
+    }
+
+    *ppResultBlockIO = pBlockIO;
+
+abort:
+    returnErr(err);
+} // OpenDatagramBlockIO.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReceiveDataFromAcceptedConnection]
+//
+// This is called when a server wants to start receiving data from a blockIO
+// that it accepted.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::ReceiveDataFromAcceptedConnection(
+                        CNetBlockIO *pBlockIO,
+                        CAsyncBlockIOCallback *pCallback) {
+    ErrVal err = ENoErr;
+    bool locked = false;
+    RunChecks();
+
+    if (NULL == m_pReactorList) {
+        gotoErr(EFail);
+    }
 
-            // getaddrinfo() is both thread-safe and supports IPv6.
-            // Don't use gethostbyname, since it is not thread-safe.
-#if LINUX_DYNAMIC_LINK
-            DEBUG_LOG("NetIO_LookupHost. Calling getaddrinfo");
-            result = getaddrinfo(pName, portStr, &addressHints, &addressResultList);
-            DEBUG_LOG("NetIO_LookupHost. getaddrinfo returned. result = %d", result);
-#else
-	        // The Linux version seems to work fine with a dynamically linked libc.
-	        // However, it fails with a statically linked glibc. It seems that the
-	        // name resolution library runs different code depending on host-specific
-	        // preferences, like whether to use DNS or other network infrastructure.
-	        // So, rather than writing 1 program that can call out to different local
-	        // name resolver services (like, via a local pipe or system call), the
-	        // C library is hard-compiled with the diffreent sources. This means that
-	        // libc cannot call gethostbyname in a portable way. Instead, you must
-	        // dynamically link with the local glibc on each different machine.
-	        // If you really need to run the static glibc, then you cannot use this
-	        // call.
-	        DEBUG_WARNING("Cant resolve network addresses with static linking");
-            result = -1;
+    if ((NULL == pBlockIO) || (NULL == pBlockIO->m_pLock) || (NULL == pCallback)) {
+        gotoErr(EFail);
+    }
+
+    // Only this blockIO and its reactor are locked, so accepting
+    // connections on one reactor does not stall the others.
+    pBlockIO->m_pLock->Lock();
+    locked = true;
+
+    pBlockIO->ChangeBlockIOCallback(pCallback);
+
+#if WIN32
+    // Start waiting for a read.
+    if ((pBlockIO->m_pReactor->m_ExceptionSocks.fd_count >= FD_SETSIZE)
+        || (pBlockIO->m_pReactor->m_ReadSocks.fd_count >= FD_SETSIZE)) {
+       DEBUG_LOG("CNetIOSystem::ReceiveDataFromAcceptedConnection. Too many sockets (%d, %d)",
+                  pBlockIO->m_pReactor->m_ExceptionSocks.fd_count,
+                  pBlockIO->m_pReactor->m_ReadSocks.fd_count);
+        gotoErr(ETooManySockets);
+    }
+#endif // WIN32
+
+#if USE_IO_URING
+    if ((m_fUseIOUring) && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::UDP_SOCKET)) {
+        pBlockIO->m_BlockIOFlags |= CNetBlockIO::URING_SOCKET;
+    } else
 #endif
+    {
+        WatchSocket(pBlockIO, READ_EVENTS | EXCEPTION_EVENTS);
+    }
 
-            if (0 != result) {
-                DEBUG_LOG("NetIO_LookupHost. getaddrinfo failed. result = %d",
-                            result);
-                gotoErr(ENoHostAddress);
+    err = AddBlockIOToReactor(pBlockIO);
+    if (err) {
+        DEBUG_LOG("CNetIOSystem::ReceiveDataFromAcceptedConnection. AddBlockIOToReactor failed (%d)", err);
+        gotoErr(err);
+    }
+
+    pBlockIO->m_pLock->Unlock();
+    locked = false;
+
+#if USE_IO_URING
+    // Post the first receive. From now on, there is always one posted.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SOCKET) {
+        err = UringPostRecv(pBlockIO);
+        if (err) {
+            gotoErr(err);
+        }
+    }
+#endif // USE_IO_URING
+
+    // Tell the select thread to start listening to this
+    // new socket. We added the socket to the fd set, and
+    // select uses the latest fd set each time it is called.
+    (void) WakeSelectThread(pBlockIO->m_pReactor);
+
+abort:
+    if (locked) {
+        pBlockIO->m_pLock->Unlock();
+    }
+
+    returnErr(err);
+} // ReceiveDataFromAcceptedConnection.
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetServerPort]
+//
+// This is the port the system picked when a server or a datagram socket
+// was opened on port 0.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::GetServerPort(CNetBlockIO *pBlockIO, uint16 *pPortNum) {
+    ErrVal err = ENoErr;
+    struct sockaddr_in boundAddr;
+    socklen_t addrLength = sizeof(boundAddr);
+
+    if ((NULL == pBlockIO)
+        || (NULL == pPortNum)
+        || !(pBlockIO->m_BlockIOFlags
+                & (CNetBlockIO::ACCEPT_INCOMING_CONNECTIONS | CNetBlockIO::UDP_SOCKET))) {
+        gotoErr(EFail);
+    }
+
+    if (getsockname(pBlockIO->m_Socket, (struct sockaddr *) &boundAddr, &addrLength) < 0) {
+        DEBUG_LOG("CNetIOSystem::GetServerPort. getsockname() failed, errno = %d",
+                    GET_LAST_ERROR());
+        gotoErr(EFail);
+    }
+    *pPortNum = ntohs(boundAddr.sin_port);
+
+abort:
+    returnErr(err);
+} // GetServerPort.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_WaitForAllBlockIOsToClose]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+NetIO_WaitForAllBlockIOsToClose() {
+    g_pNetIOSystemImpl->WaitForAllBlockIOsToClose();
+}
+
+
+
+
+#if INCLUDE_REGRESSION_TESTS
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_RestartNetIOSystem]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_RestartNetIOSystem(const CNetIOTestSettings *pSettings) {
+    if (NULL == g_pNetIOSystemImpl) {
+        returnErr(EFail);
+    }
+
+    return(g_pNetIOSystemImpl->Restart(pSettings));
+}
+#endif // INCLUDE_REGRESSION_TESTS
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_StartTimer]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_StartTimer(CTimer *pTimer, int32 delayInMs) {
+    if (NULL == g_pNetIOSystemImpl) {
+        returnErr(EFail);
+    }
+
+    return(g_pNetIOSystemImpl->StartTimer(pTimer, delayInMs));
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_CancelTimer]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+NetIO_CancelTimer(CTimer *pTimer) {
+    CTimerWheel::CancelTimer(pTimer);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_OpenServerBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_OpenServerBlockIO(
+                uint16 portNum,
+                bool fUse127001Address,
+                CAsyncBlockIOCallback *pCallback,
+                CAsyncBlockIO **ppBlockIO) {
+    ErrVal err = ENoErr;
+    CAsyncBlockIO *pBlockIO = NULL;
+
+    if ((NULL == g_pNetIOSystemImpl) || (NULL == pCallback) || (NULL == ppBlockIO)) {
+        gotoErr(EFail);
+    }
+    *ppBlockIO = NULL;
+
+    err = g_pNetIOSystemImpl->OpenServerBlockIO(
+                                    false, // fUDP
+                                    portNum,
+                                    fUse127001Address,
+                                    pCallback,
+                                    &pBlockIO);
+    if (err) {
+        gotoErr(err);
+    }
+
+    *ppBlockIO = pBlockIO;
+
+abort:
+    returnErr(err);
+} // NetIO_OpenServerBlockIO.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_OpenDatagramBlockIO]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_OpenDatagramBlockIO(
+                uint16 portNum,
+                bool fUse127001Address,
+                const struct sockaddr_in *pDestAddr,
+                CAsyncBlockIOCallback *pCallback,
+                CAsyncBlockIO **ppBlockIO) {
+    if ((NULL == g_pNetIOSystemImpl) || (NULL == pCallback) || (NULL == ppBlockIO)) {
+        returnErr(EFail);
+    }
+
+    return(g_pNetIOSystemImpl->OpenDatagramBlockIO(
+                                    portNum,
+                                    fUse127001Address,
+                                    pDestAddr,
+                                    pCallback,
+                                    ppBlockIO));
+} // NetIO_OpenDatagramBlockIO.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_ReceiveDataFromAcceptedConnection]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_ReceiveDataFromAcceptedConnection(
+                CAsyncBlockIO *pBlockIO,
+                CAsyncBlockIOCallback *pCallback) {
+    if ((NULL == g_pNetIOSystemImpl)
+        || (NULL == pBlockIO)
+        || (g_pNetIOSystemImpl != pBlockIO->GetIOSystem())) {
+        returnErr(EFail);
+    }
+
+    return(g_pNetIOSystemImpl->ReceiveDataFromAcceptedConnection(
+                                        (CNetBlockIO *) pBlockIO,
+                                        pCallback));
+} // NetIO_ReceiveDataFromAcceptedConnection.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_GetServerPort]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+NetIO_GetServerPort(CAsyncBlockIO *pBlockIO, uint16 *pPortNum) {
+    if ((NULL == g_pNetIOSystemImpl)
+        || (NULL == pBlockIO)
+        || (g_pNetIOSystemImpl != pBlockIO->GetIOSystem())) {
+        returnErr(EFail);
+    }
+
+    return(g_pNetIOSystemImpl->GetServerPort((CNetBlockIO *) pBlockIO, pPortNum));
+} // NetIO_GetServerPort.
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WaitForAllBlockIOsToClose]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::WaitForAllBlockIOsToClose() {
+    ErrVal err = ENoErr;
+    CRefEvent *pSemaphore = NULL;
+    CNetReactor *pReactor;
+    int32 reactorNum;
+
+    DEBUG_LOG("CNetIOSystem::WaitForAllBlockIOsToClose");
+
+    // Each reactor closes its own sockets, so wait for each one in turn.
+    for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+        pReactor = m_pReactorList[reactorNum];
+
+        //////////////////////////////////////////////////////
+        {
+            AutoLock(pReactor->m_pLock);
+
+            // Discard any semaphore left over from a previous operation.
+            RELEASE_OBJECT(pReactor->m_pEmptyPendingCloseBlockIOs);
+
+            pReactor->m_pEmptyPendingCloseBlockIOs = newex CRefEvent;
+            if (NULL == pReactor->m_pEmptyPendingCloseBlockIOs) {
+                return;
             }
-            currentAddr = addressResultList;
-            while (NULL != currentAddr) {
-                if (AF_INET == currentAddr->ai_family) {
-                    DEBUG_LOG("NetIO_LookupHost. getaddrinfo found a valid address");
-                    // The address is in network byte order.
-                    memcpy(pSockAddr, currentAddr->ai_addr, sizeof(struct sockaddr_in));
-                    break;
-                }
-                currentAddr = currentAddr->ai_next;
+
+            err = pReactor->m_pEmptyPendingCloseBlockIOs->Initialize();
+            if (err) {
+                RELEASE_OBJECT(pReactor->m_pEmptyPendingCloseBlockIOs);
+                return;
             }
-            if (NULL == currentAddr) {
-                DEBUG_LOG("NetIO_LookupHost. getaddrinfo returned no matching address");
-                gotoErr(ENoHostAddress);
+
+            pSemaphore = pReactor->m_pEmptyPendingCloseBlockIOs;
+            ADDREF_OBJECT(pSemaphore);
+        }
+        //////////////////////////////////////////////////////
+
+        err = WakeSelectThread(pReactor);
+        if (err) {
+            RELEASE_OBJECT(pSemaphore);
+            return;
+        }
+        pSemaphore->Wait();
+        RELEASE_OBJECT(pSemaphore);
+
+        //////////////////////////////////////////////////////
+        {
+            AutoLock(pReactor->m_pLock);
+            RELEASE_OBJECT(pReactor->m_pEmptyPendingCloseBlockIOs);
+        }
+        //////////////////////////////////////////////////////
+    } // for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++)
+} // WaitForAllBlockIOsToClose.
+
+
+
+
+#if INCLUDE_REGRESSION_TESTS
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Restart]
+//
+// This stops the reactors and the uring thread, so the next blockIO that is
+// opened starts them again with the new settings. A blockIO points at its
+// reactor, so this refuses to run while any of them are still alive.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::Restart(const CNetIOTestSettings *pSettings) {
+    ErrVal err = ENoErr;
+    int32 reactorNum;
+
+    if (m_fInitialized) {
+        WaitForAllBlockIOsToClose();
+
+        for (reactorNum = 0; reactorNum < m_NumReactors; reactorNum++) {
+            AutoLock(m_pReactorList[reactorNum]->m_pLock);
+            if (!(m_pReactorList[reactorNum]->m_ActiveBlockIOs.IsEmpty())) {
+                DEBUG_LOG("CNetIOSystem::Restart. Reactor %d still has %d blockIOs",
+                          reactorNum,
+                          m_pReactorList[reactorNum]->m_ActiveBlockIOs.GetLength());
+                gotoErr(EFileIsBusy);
             }
-        } // calling getaddrinfo.
-    } else
-    {
-        DEBUG_LOG("NetIO_LookupHost. inet_addr succeeded");
-        pSockAddr->sin_addr.s_addr = addrVal;
+        }
+
+        err = Shutdown();
+        if (err) {
+            gotoErr(err);
+        }
+#if USE_IO_URING
+        m_pUringThread = NULL;
+#endif
+        m_StopSelectThread = false;
+        m_fInitialized = false;
     }
 
-    // NOTE: the sin_family value is invalid on NT, so explicitly
-    // set this to AF_INET
-    pSockAddr->sin_family = AF_INET;
-    pSockAddr->sin_port = htons(portNum);
-
-abort:
-    if (NULL != addressResultList) {
-       freeaddrinfo(addressResultList);
+    if (NULL != pSettings) {
+        m_TestSettings = *pSettings;
+    } else {
+        m_TestSettings = CNetIOTestSettings();
     }
 
+abort:
     returnErr(err);
-} // NetIO_LookupHost.
+} // Restart.
+#endif // INCLUDE_REGRESSION_TESTS
+
+
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetLocalAddr]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::GetLocalAddr(struct sockaddr_in *pAddrResult) {
+    if (NULL != pAddrResult) {
+        memcpy(pAddrResult, &m_LocalAddr, sizeof(struct sockaddr_in));
+    }
+} // GetLocalAddr.
+
+
 
 
 
@@ -1645,275 +4250,342 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [OpenBlockIO]
+// [GetLocalHostName]
 //
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::OpenBlockIO(
-                    CParsedUrl *pUrl,
-                    int32 options,
-                    CAsyncBlockIOCallback *pCallback) {
-    ErrVal err = ENoErr;
-    CNetBlockIO *pBlockIO = NULL;
-    int result = 0;
-    bool locked = false;
-    bool fIsUDP = false;
-    OSSocket newSocketID = NULL_SOCKET;
-    char cSaveChar;
-    char *pName = NULL;
-    char *pEndName = NULL;
-    struct sockaddr_in sockAddr;
-    int32 numRetries = 0;
-    int32 lastErr = 0;
-#if WIN32
-    int on = -1;
-#endif
-    RunChecks();
+CNetIOSystem::GetLocalHostName(char *host, int32 maxHostLength) {
+    int32 result;
 
-    DEBUG_LOG("CNetIOSystem::OpenBlockIO()");
+    if (NULL == host) {
+        returnErr(EFail);
+    }
 
-    options = options;
-    if ((NULL == pUrl)
-        || (NULL == pCallback)) {
-        gotoErr(EFail);
+    DEBUG_LOG("CNetIOSystem::GetLocalHostName. Calling gethostname");
+    result = gethostname(host, maxHostLength - 1);
+    DEBUG_LOG("CNetIOSystem::GetLocalHostName. gethostname returned. result = %d",
+                result);
+
+    if (result) {
+        returnErr(EFail);
     }
 
-    DEBUG_LOG("CNetIOSystem::OpenBlockIO. URL scheme = %d", pUrl->m_Scheme);
+    returnErr(ENoErr);
+} // GetLocalHostName.
 
-    if ((CParsedUrl::URL_SCHEME_IP_ADDRESS != pUrl->m_Scheme)
-        && (!(CParsedUrl::NETWORK_NAME & pUrl->m_Flags)
-            || (NULL == pUrl->m_pHostName))) {
-        gotoErr(EFail);
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [NetIO_GetLocalProxySettings]
+//
+/////////////////////////////////////////////////////////////////////////////
+bool
+NetIO_GetLocalProxySettings(
+                        char **ppProxyServerName,
+                        int *pProxyPort) {
+    bool fFoundIt = false;
+    char *pConfigStr = NULL;
+#if WIN32
+    HKEY hKey = NULL;
+#endif
+
+
+    if (NULL != ppProxyServerName) {
+        *ppProxyServerName = NULL;
     }
-    if ((CParsedUrl::URL_SCHEME_IP_ADDRESS == pUrl->m_Scheme)
-        && (NULL == pUrl->m_pSockAddr)) {
-        gotoErr(EFail);
+    if (NULL != pProxyPort) {
+        *pProxyPort = -1;
     }
 
 
-    // Lazily initialize the IO system when we open the first blockIO.
-    if (!m_fInitialized) {
-        err = InitNetIOSystem();
-        if (err) {
-            DEBUG_LOG("CNetIOSystem::OpenBlockIO. InitNetIOSystem failed. err = %d", err);
-            gotoErr(err);
+    // First, look if there is a gateway in the config file.
+    pConfigStr = g_pBuildingBlocksConfig->GetString(
+                                             g_NetworkProxyHostConfigValueName,
+                                             NULL);
+    if (NULL != pConfigStr) {
+        fFoundIt = true;
+
+        DEBUG_LOG("NetIO_GetLocalProxySettings. Found a proxy (%s)", pConfigStr);
+
+        if (NULL != ppProxyServerName) {
+            *ppProxyServerName = strdupex(pConfigStr);
+            if (NULL == *ppProxyServerName) {
+                goto abort;
+            }
+        }
+        if (NULL != pProxyPort) {
+            *pProxyPort = g_pBuildingBlocksConfig->GetInt(g_NetworkProxyPortConfigValueName, 80);
         }
+
+        goto abort;
+    } // if (NULL != pConfigStr)
+    else
+    {
+        DEBUG_LOG("NetIO_GetLocalProxySettings. No proxy");
     }
-    if (NULL == m_ActiveSocketTable) {
-        gotoErr(EFail);
+
+#if WIN32
+    LONG lResult;
+    DWORD valueType;
+    static const char g_SettingsRegistryKey[] = "Software\\Microsoft\\Windows\\CurrentVersion\\Internet Settings";
+    DWORD dwIntValue;
+    char *pPortStr;
+    DWORD length;
+    char buffer[1024];
+
+    lResult = RegCreateKeyExA(
+                    HKEY_CURRENT_USER,
+                    g_SettingsRegistryKey,
+                    0, // reserved
+                    NULL, // class
+                    REG_OPTION_NON_VOLATILE,
+                    KEY_READ | KEY_QUERY_VALUE,
+                    NULL, // security attributes
+                    &hKey,
+                    NULL);
+    if (ERROR_SUCCESS != lResult) {
+        DEBUG_LOG("NetIO_GetLocalProxySettings. RegCreateKeyExA failed");
+        goto abort;
     }
 
-    // Look for the IP-address in the URL.
-    // If this URL has an IP-address, then just use it.
-    // DNS lookups are incredibly expensive.
-    if (pUrl->m_pSockAddr) {
-        sockAddr = *(pUrl->m_pSockAddr);
-    } else {
-        // Get the name of the host and temporarily turn it into a C-string.
-        pName = pUrl->m_pHostName;
-        pEndName = pUrl->m_pHostName + pUrl->m_HostNameSize;
-        cSaveChar = *pEndName;
-        *pEndName = 0;
-        err = NetIO_LookupHost(pName, pUrl->m_Port, &sockAddr);
-        *pEndName = cSaveChar;
-        if (err) {
-            DEBUG_LOG("CNetIOSystem::OpenBlockIO. NetIO_LookupHost failed. err = %d", err);
-            gotoErr(err);
-        }
+    length = sizeof(dwIntValue);
+    lResult = RegQueryValueExA(
+                  hKey,
+                  "ProxyEnable",
+                  NULL,
+                  &valueType,
+                  (uchar *) &dwIntValue,
+                  &length);
+    if ((ERROR_SUCCESS == lResult) && (!dwIntValue)) {
+        DEBUG_LOG("NetIO_GetLocalProxySettings. RegQueryValueEx failed");
+        goto abort;
     }
 
-    // Create a new socket.
-    newSocketID = socket(AF_INET, SOCK_STREAM, 0);
-    if (NULL_SOCKET == newSocketID) {
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO. socket() failed");
-        gotoErr(EFail);
+    length = sizeof(buffer);
+    lResult = RegQueryValueExA(
+                  hKey,
+                  "ProxyServer",
+                  NULL,
+                  &valueType,
+                  (uchar *) buffer,
+                  &length);
+    if ((ERROR_SUCCESS == lResult) && (REG_SZ == valueType)) {
+        fFoundIt = true;
+
+        DEBUG_LOG("NetIO_GetLocalProxySettings. Found a proxy (%s)", buffer);
+
+        if (NULL != ppProxyServerName) {
+            *ppProxyServerName = strdupex(buffer);
+            if (NULL == *ppProxyServerName) {
+                goto abort;
+            }
+
+            pPortStr = *ppProxyServerName;
+            while ((*pPortStr) && (':' != *pPortStr)) {
+                pPortStr++;
+            }
+            if (':' == *pPortStr) {
+                *pPortStr = 0;
+                pPortStr++;
+                if (NULL != pProxyPort) {
+                    CStringLib::StringToNumber(pPortStr, strlen(pPortStr), pProxyPort);
+                }
+            }
+        }
+    } // if ((ERROR_SUCCESS == lResult) && (REG_SZ == valueType))
+    else
+    {
+        DEBUG_LOG("NetIO_GetLocalProxySettings. No proxy");
     }
-    DEBUG_LOG("CNetIOSystem::OpenBlockIO: Opened socket %d", newSocketID);
 
-    // Make the socket non-blocking.
-    // If we do this before connect, then the connect is asynchronous.
-    // If we do this after connect, then the connect is synchronous.
-    err = MakeSocketNonBlocking(newSocketID);
-    if (err) {
-        gotoErr(err);
+    //HKEY_CURRENT_USER\Software\Microsoft\Windows\CurrentVersion\Internet Settings\ProxyHttp1.1
+    //HKEY_CURRENT_USER\Software\Microsoft\Windows\CurrentVersion\Internet Settings\ProxyOverride
+#endif
+
+
+abort:
+#if WIN32
+    if (NULL != hKey) {
+        RegCloseKey(hKey);
+        hKey = NULL;
     }
+#endif
+
+    return(fFoundIt);
+} // GetLocalProxySettings
+
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckState]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::CheckState() {
+    ErrVal err = ENoErr;
+    AutoLock(m_pLock);
 
-    // Set the read and write buffers.
-    err = SetSocketBufSizeImpl(newSocketID, true, m_NumBytesPerSocketBuffer);
-    if (err) {
-        gotoErr(err);
+    if ((!m_fInitialized) || (m_StopSelectThread)) {
+        returnErr(ENoErr);
     }
-    err = SetSocketBufSizeImpl(newSocketID, false, m_NumBytesPerSocketBuffer);
-    if (err) {
-        gotoErr(err);
+
+    if (NULL == m_pReactorList) {
+        returnErr(EFail);
     }
 
-    // Turn off Nagle's algorithm. This causes packets to be sent
-    // immediately, rather than being buffered first on the local
-    // host to group them into larger packets. We do the buffering,
-    // so Nagle's algorithm would just get in the way. Normally,
-    // this defaults to off, but the winsock 1.1 and 2.0 specs let
-    // each winsock implementation decide what to default it to.
-    //
-    // It seems that NODELAY is only in Linux versions Linux 2.5.71
-    // and later, so it is not portable.
-#if WIN32
-        result = setsockopt(
-                      newSocketID,
-                      IPPROTO_TCP,
-                      TCP_NODELAY,
-                      (const char *) &on,
-                      sizeof(on));
-        if (result < 0) {
-           gotoErr(EFail);
-        }
-#endif // WIN32
+    returnErr(err);
+} // CheckState.
 
-    // Do not bind the socket, this function is for client connections,
-    // not servers.
 
-    // We only hold the lock while we add the connection to
-    // the global list.
-    if (m_pLock) {
-        m_pLock->Lock();
-        locked = true;
-    }
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [PickReactor]
+//
+// Sockets and timers are spread over the reactors round-robin. This does not
+// take any lock, so two callers may occasionally get the same reactor.
+/////////////////////////////////////////////////////////////////////////////
+CNetReactor *
+CNetIOSystem::PickReactor() {
+    uint32 ticket;
 
 #if WIN32
-    if ((m_WriteSocks.fd_count >= FD_SETSIZE)
-        || (m_ExceptionSocks.fd_count >= FD_SETSIZE)
-        || (m_ReadSocks.fd_count >= FD_SETSIZE)) {
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO. Failing because too many sockets (%d, %d, %d)",
-                    m_WriteSocks.fd_count,
-                    m_ReadSocks.fd_count,
-                    m_ExceptionSocks.fd_count);
-        gotoErr(ETooManySockets);
-    }
+    ticket = (uint32) InterlockedIncrement((LONG *) &m_NextReactor);
+#elif LINUX
+    ticket = (uint32) __sync_fetch_and_add(&m_NextReactor, 1);
 #endif
 
-    pBlockIO = AllocNetBlockIO(pUrl, newSocketID, 0, pCallback);
-    if (NULL == pBlockIO) {
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO. AllocNetBlockIO failed.");
-        gotoErr(ETooManySockets);
-    }
-    // At this point, the connection is in the select thread list,
-    // so the select thread is responsible for finally deleting it.
+    return(m_pReactorList[ticket % m_NumReactors]);
+} // PickReactor.
 
-    pBlockIO->m_BlockIOFlags |= CNetBlockIO::WAITING_TO_CONNECT;
-    pBlockIO->StartTimeout(CIOBuffer::IO_CONNECT);
 
-    // Tell select() to report when this socket is connected.
-    // Do this before we try to connect to avoid a race
-    // condition of the result coming in between the time
-    // we try to connect and the time we tell the select
-    // thread to notify us.
-    ASSERT(!(FD_ISSET(newSocketID, &m_WriteSocks)));
-    ASSERT(!(FD_ISSET(newSocketID, &m_ExceptionSocks)));
-    ASSERT(!(FD_ISSET(newSocketID, &m_ReadSocks)));
 
-    FD_SET(newSocketID, &m_WriteSocks);
-    FD_SET(newSocketID, &m_ExceptionSocks);
 
-    // We always wait for reads on any socket.
-    FD_SET(newSocketID, &m_ReadSocks);
-#if LINUX
-    if (newSocketID >= g_pNetIOSystemImpl->m_FdRange) {
-        g_pNetIOSystemImpl->m_FdRange = newSocketID + 1;
-    }
-#endif // LINUX
 
-    // Add this blockIO to the table that maps sockets to blockIO pointers.
-    err = m_ActiveSocketTable->SetValueEx(
-                                    (const char *) &(pBlockIO->m_Socket), // pKey
-                                    sizeof(OSSocket),
-                                    (const char *) pBlockIO, // userData
-                                    pBlockIO); // table entry
-    if (err) {
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO. SetValueEx failed.");
-        gotoErr(err);
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [AllocNetBlockIO]
+//
+// If pReactor is NULL, then this picks the next reactor. A blockIO stays
+// with one reactor for its whole life, so its events are always dispatched
+// by the same thread.
+/////////////////////////////////////////////////////////////////////////////
+CNetBlockIO *
+CNetIOSystem::AllocNetBlockIO(
+                    CParsedUrl *pUrl,
+                    OSSocket newSocketID,
+                    int32 connectionFlags,
+                    CAsyncBlockIOCallback *pCallback,
+                    CNetReactor *pReactor) {
+    ErrVal err = ENoErr;
+    CNetBlockIO *pBlockIO = NULL;
+    int32 maxBlockIOsPerReactor;
+
+    if (NULL == pReactor) {
+        pReactor = PickReactor();
     }
-    ADDREF_OBJECT(pBlockIO);
 
-    if (m_pLock) {
-        m_pLock->Unlock();
+    pBlockIO = newex CNetBlockIO;
+    if (!pBlockIO) {
+        gotoErr(EFail);
     }
-    locked = false;
 
-    // Tell the select thread to start listening to this
-    // new socket. We added the socket to the fd set, and
-    // select uses the latest fd set each time it is called.
-    (void) WakeSelectThread();
+    // These are part of the base class.
+    pBlockIO->m_MediaType = CAsyncBlockIO::NETWORK_MEDIA;
+    pBlockIO->m_fSeekable = false;
+    pBlockIO->m_pUrl = pUrl;
+    ADDREF_OBJECT(pUrl);
 
-    // TCP ONLY.
-    // Connect to the server. This only works if the server
-    // process is alive and ready to talk.
-#if DD_DEBUG
-    {
-        char *pStaticBuffer = inet_ntoa(sockAddr.sin_addr);
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO connect to: %s", pStaticBuffer);
+    pBlockIO->m_MediaSize = 0;
+
+    pBlockIO->m_pLock = CRefLock::Alloc();
+    if (NULL == pBlockIO->m_pLock) {
+        gotoErr(EFail);
     }
-#endif // DD_DEBUG
 
-    // We may have to loop several times to ignore system call failures on Linux.
-    while (1) {
-        result = connect(
-                    newSocketID,
-                    (struct sockaddr *) &sockAddr,
-                    sizeof(struct sockaddr_in));
-        // Get the last error immediately after the system call.
-        // Anything code, even a DEBUG_LOG, may touch a file and
-        // change the last error.
-        lastErr = GET_LAST_ERROR();
+    // These are part of the net Block IO subclass.
+    pBlockIO->m_Socket = newSocketID;
+    pBlockIO->m_BlockIOFlags = connectionFlags;
+    pBlockIO->m_BlockIOFlags &= ~CAsyncBlockIO::RESIZEABLE;
+    pBlockIO->m_pReactor = pReactor;
 
-#if LINUX
-        if ((result < 0)
-            && (IGNORE_SYSTEMCALL_ERROR())
-            && (numRetries < MAX_SYSTEM_CALL_INTERRUPTS)) {
-            DEBUG_LOG("CNetBlockIO::OpenBlockIO: Ignoring EPIPE.");
-            numRetries++;
-            continue;
+    pBlockIO->m_ActiveBlockIOs.ResetQueue();
+
+    // Add this connection to the list of active connections on its
+    // reactor. Each reactor allows its share of the total.
+    { /////////////////////////////////////////////////
+        AutoLock(pReactor->m_pLock);
+
+        maxBlockIOsPerReactor = (m_MaxNumBlockIOs + m_NumReactors - 1) / m_NumReactors;
+        if (pReactor->m_ActiveBlockIOs.GetLength() >= maxBlockIOsPerReactor) {
+            DEBUG_LOG("CNetIOSystem::AllocNetBlockIO. Too many sockets (%d) on reactor %d",
+                      pReactor->m_ActiveBlockIOs.GetLength(),
+                      pReactor->m_ReactorNum);
+            gotoErr(ETooManySockets);
         }
-#endif
-        break;
-    } // while (1)
 
-    DEBUG_LOG("CNetIOSystem::OpenBlockIO connect returned result=%d, errno=%d",
-                result, lastErr);
+        pReactor->m_ActiveBlockIOs.InsertHead(&(pBlockIO->m_ActiveBlockIOs));
+        ADDREF_OBJECT(pBlockIO);
+        pBlockIO->m_pIOSystem = this;
+    } /////////////////////////////////////////////////
 
-    if ((result != 0) && !(IO_WOULD_BLOCK(lastErr))) {
-        DEBUG_LOG("CNetIOSystem::OpenBlockIO connect() failed, giving up");
-        pBlockIO->Close();
-        err = ENoResponse;
-        gotoErr(err);
-    }
+    pBlockIO->ChangeBlockIOCallback(pCallback);
 
-    if ((pBlockIO)
-        && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
-        pBlockIO->m_BlockIOFlags |= CAsyncBlockIO::BLOCKIO_IS_OPEN;
-    }
+    return(pBlockIO);
 
+abort:
     RELEASE_OBJECT(pBlockIO);
-    returnErr(ENoErr);
 
-abort:
-    if ((locked) && (m_pLock)) {
-        m_pLock->Unlock();
+    return(NULL);
+} // AllocNetBlockIO.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [AddBlockIOToReactor]
+//
+// This adds a socket to the table of its reactor, so the reactor can find
+// the blockIO, and to the list of blockIOs the reactor watches. The table
+// holds a reference, which the list shares, and DisconnectSocket removes
+// the blockIO from both.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::AddBlockIOToReactor(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    CNetReactor *pReactor = pBlockIO->m_pReactor;
+    AutoLock(pReactor->m_pLock);
+
+    err = pReactor->m_pSocketTable->SetValueEx(
+                                    (const char *) &(pBlockIO->m_Socket), // pKey
+                                    sizeof(OSSocket),
+                                    (const char *) pBlockIO, // userData
+                                    pBlockIO); // table entry
+    if (err) {
+        returnErr(err);
     }
+    ADDREF_OBJECT(pBlockIO);
 
-    if (pBlockIO) {
-        (void) pBlockIO->Close();
-        RELEASE_OBJECT(pBlockIO);
-    } else { // if (!pBlockIO)
-        if (NULL_SOCKET != newSocketID) {
-            DEBUG_LOG("CNetIOSystem::OpenBlockIO. Call SafeCloseSocket on socket %d", 
-                      newSocketID);
-            SafeCloseSocket(newSocketID, fIsUDP);
-        }
+    if (!(pBlockIO->m_ReactorBlockIOs.OnAnyQueue())) {
+        pReactor->m_BlockIOs.InsertTail(&(pBlockIO->m_ReactorBlockIOs));
     }
 
     returnErr(err);
-} // OpenBlockIO.
-
+} // AddBlockIOToReactor.
 
 
 
@@ -1922,567 +4594,591 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [OpenServerBlockIO]
+// [DisconnectSocket]
+//
+// This routine is only called by the select thread, so connections are not
+// deleted by other threads while select has a pointer to them.
+//
+// To close a connection, the client sets the delete flag and wakes up the
+// select thread. The select thread sees this flag and calls this routine.
 //
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CNetIOSystem::OpenServerBlockIO(
-                    bool fIsUDP,
-                    uint16 portNum,
-                    bool fUse127001Address,
-                    CAsyncBlockIOCallback *pCallback,
-                    CAsyncBlockIO **ppResultBlockIO) {
-    ErrVal err = ENoErr;
-    int result = 0;
-    OSSocket newSocketID = NULL_SOCKET;
-    int on = 1;
-    CParsedUrl *pUrl = NULL;
-    CNetBlockIO *pBlockIO = NULL;
-    int32 lastErr = 0;
-    RunChecks();
+void
+CNetIOSystem::DisconnectSocket(CNetBlockIO *pBlockIO) {
+    bool fRemovedItem = false;
+    bool fIsUdp = false;
+    bool fReleaseTimer = false;
+    CNetBlockIO *pTimerBlockIO = pBlockIO;
+    CNetReactor *pReactor;
 
-    if (NULL == ppResultBlockIO) {
-        gotoErr(EFail);
+    DEBUG_LOG("CNetIOSystem::DisconnectSocket. pBlockIO = %p", pBlockIO);
+    if ((!pBlockIO)
+        || (!pBlockIO->m_pReactor)
+        || (NULL_SOCKET == pBlockIO->m_Socket)) {
+        return;
     }
-    *ppResultBlockIO = NULL;
+    pReactor = pBlockIO->m_pReactor;
 
+    // Hold the lock while we remove the connection from
+    // the global list of active connections.
+    if (pBlockIO->m_pLock) {
+        pBlockIO->m_pLock->Lock();
+    }
 
-    // Lazily initialize the IO system when we open the first blockIO.
-    if (!m_fInitialized) {
-        err = InitNetIOSystem();
-        if (err) {
-            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. InitNetIOSystem failed. err = %d", err);
-            gotoErr(err);
-        }
+    /////////////////////////////////////////
+    // Get the reactor lock. This runs on the reactor thread, which is the
+    // only thread that walks the reactor list without holding this lock.
+    pReactor->m_pLock->Lock();
+
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::UDP_SOCKET) {
+       fIsUdp = true;
     }
-    if (NULL == m_ActiveSocketTable) {
-        DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. NULL == m_ActiveSocketTable");
-        gotoErr(EFail);
+
+    fRemovedItem = pReactor->m_pSocketTable->RemoveValue(
+                                            (const char *) &(pBlockIO->m_Socket),
+                                            sizeof(OSSocket));
+
+    UnwatchSocket(pBlockIO, ALL_SOCKET_EVENTS);
+#if USE_IO_URING
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SOCKET) {
+        UringCancel(pBlockIO);
+    }
+#endif
+
+    if (pBlockIO->m_ReactorBlockIOs.OnAnyQueue()) {
+        pReactor->m_BlockIOs.RemoveFromQueue(&(pBlockIO->m_ReactorBlockIOs));
     }
 
+    pReactor->m_pLock->Unlock();
+    /////////////////////////////////////////
+
+
+    // Handle this specially if we are simulating a network error.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::SIMULATE_NETWORK_ERROR) {
+        DEBUG_LOG("CNetIOSystem::DisconnectSocket. Call SafeCloseSocket on socket %d",
+                  pBlockIO->m_Socket);
+
+        SafeCloseSocket(pBlockIO->m_Socket, fIsUdp);
+        pBlockIO->m_Socket = NULL_SOCKET;
+
+        pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::DISCONNECT_SOCKET;
+
+        // Force the error to be reported immediately.
+        if (CNetBlockIO::WAITING_TO_WRITE & pBlockIO->m_BlockIOFlags) {
+            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::WRITE);
+        } else if (CNetBlockIO::WAITING_TO_READ & pBlockIO->m_BlockIOFlags) {
+            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::READ);
+        } else { // if (CNetBlockIO::WAITING_TO_CONNECT & pBlockIO->m_BlockIOFlags)
+            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::IO_CONNECT);
+        }
+    } else { // simulating a network error.
+        DEBUG_LOG("CNetIOSystem::DisconnectSocket. Call SafeCloseSocket on socket %d",
+                  pBlockIO->m_Socket);
 
-    // Create a URL that has the name we will be listening on.
-    pUrl = CParsedUrl::AllocateUrl(g_LocalServerURL, g_LocalServerURLLength, NULL);
-    if (NULL == pUrl) {
-        gotoErr(EFail);
-    }
-    pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
-    if (NULL == pUrl->m_pSockAddr) {
-        gotoErr(EFail);
-    }
-    *(pUrl->m_pSockAddr) = m_LocalAddr;
+        // Otherwise, this is just normally closing the socket.
+        SafeCloseSocket(pBlockIO->m_Socket, fIsUdp);
+        pBlockIO->m_Socket = NULL_SOCKET;
+    } // normal close.
 
+    // A closed socket cannot time out, so take it off the timer wheel.
+    pBlockIO->m_NumTimeouts = 0;
+    fReleaseTimer = pBlockIO->StopTimeoutTimer();
 
-    // Create a new socket.
-    if (fIsUDP) {
-        newSocketID = socket(AF_INET, SOCK_DGRAM, 0);
-    } else {
-        newSocketID = socket(AF_INET, SOCK_STREAM, 0);
-    }
-    if (NULL_SOCKET == newSocketID) {
-        gotoErr(EFail);
+    if (pBlockIO->m_pLock) {
+        pBlockIO->m_pLock->Unlock();
     }
-    DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. Opened socket %d", newSocketID);
 
+    if (fReleaseTimer) {
+        RELEASE_OBJECT(pTimerBlockIO);
+    }
 
-    err = MakeSocketNonBlocking(newSocketID);
-    if (err) {
-        DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. MakeSocketNonBlocking failed, err = %d", err);
-        gotoErr(err);
+    // The blockIO was AddRefed when it was put in the socket table.
+    if (fRemovedItem) {
+        RELEASE_OBJECT(pBlockIO);
     }
+} // DisconnectSocket.
 
-    // Prevent a hacker application from also binding to our port.
-#if 0
-    on = TRUE;
-    result = setsockopt(
-                newSocketID,
-                SOL_SOCKET,
-                SO_EXCLUSIVEADDRUSE,
-                (const char *) &on,
-                sizeof(on));
-    // Ignore any error.
-    result = 0;
-#endif
 
-    on = 0;
-    result = setsockopt(
-                newSocketID,
-                SOL_SOCKET,
-                SO_REUSEADDR,
-                (const char *) &on,
-                sizeof(on));
-    // Ignore any error.
-    result = 0;
 
 
-    // Some applications will try to connect to 127.0.0.1. In those
-    // cases, we must bind to that address, not the real address of
-    // the machine.
-    if (fUse127001Address) {
-#if WIN32
-        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b1 = 127;
-        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b2 = 0;
-        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b3 = 0;
-        pUrl->m_pSockAddr->sin_addr.S_un.S_un_b.s_b4 = 1;
-#elif LINUX
-        pUrl->m_pSockAddr->sin_addr.s_addr = inet_addr("127.0.0.1");
-#endif
-    }
-    if (portNum > 0) {
-        pUrl->m_pSockAddr->sin_port = htons(portNum);
-    } else
-    {
-        pUrl->m_pSockAddr->sin_port = htons(0);
-    }
 
-#if WIN32
-    // On Windows, this will cause us to bind to all NIC's.
-    pUrl->m_pSockAddr->sin_addr.s_addr = INADDR_ANY;
-#endif
 
-    // Bind the socket to a name. This may be very time consuming, so
-    // do it outside the lock.
-    result = bind(
-                newSocketID,
-                (struct sockaddr *) pUrl->m_pSockAddr,
-                sizeof(struct sockaddr_in));
-    // Get the last error immediately after the system call.
-    // Anything code, even a DEBUG_LOG, may touch a file and
-    // change the last error.
-    lastErr = GET_LAST_ERROR();
+/////////////////////////////////////////////////////////////////////////////
+//
+// [WatchSocket]
+//
+// This tells the select thread to start listening for some events on a
+// socket. The select thread uses the new set the next time it waits, so
+// the caller should wake it up.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::WatchSocket(CNetBlockIO *pBlockIO, int32 events) {
+    int32 newEvents;
+    CNetReactor *pReactor;
 
-    if (result < 0) {
-        DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. bind() failed, lastErr = %d",
-                    lastErr);
-        gotoErr(EFail);
+    if ((NULL == pBlockIO) || (NULL == pBlockIO->m_pReactor)) {
+        return;
     }
+    pReactor = pBlockIO->m_pReactor;
+    AutoLock(pReactor->m_pLock);
 
-    // Allocate the BlockIO.
-    { /////////////////////////////////////////////////
-        AutoLock(m_pLock);
-
-        pBlockIO = AllocNetBlockIO(pUrl, newSocketID, 0, pCallback);
-        if (!pBlockIO) {
-            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. AllocNetBlockIO failed");
-            gotoErr(ETooManySockets);
-        }
-
-        if (fIsUDP) {
-            pBlockIO->m_BlockIOFlags |= CNetBlockIO::UDP_SOCKET;
-        } else {
-            pBlockIO->m_BlockIOFlags |= CNetBlockIO::ACCEPT_INCOMING_CONNECTIONS;
-        }
+    if (NULL_SOCKET == pBlockIO->m_Socket) {
+        return;
+    }
+    newEvents = pBlockIO->m_WatchedEvents | events;
 
-#if WIN32
-        if (m_ReadSocks.fd_count >= FD_SETSIZE) {
-            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. Too many sockets (%d)",
-                        m_ReadSocks.fd_count);
-            gotoErr(ETooManySockets);
+#if USE_EPOLL_REACTOR
+    if (m_fUseEpoll) {
+        if (newEvents != pBlockIO->m_WatchedEvents) {
+            (void) UpdateEpollRegistration(pBlockIO, newEvents);
         }
-#endif // WIN32
-
-        // Tell select() to listen on this socket for new connections.
-        ASSERT(!(FD_ISSET(newSocketID, &m_ReadSocks)));
-        FD_SET(newSocketID, &m_ReadSocks);
+        return;
+    }
+#endif // USE_EPOLL_REACTOR
 
-        ASSERT(!(FD_ISSET(newSocketID, &m_ExceptionSocks)));
-        FD_SET(newSocketID, &m_ExceptionSocks);
+    if (events & READ_EVENTS) {
+        FD_SET(pBlockIO->m_Socket, &pReactor->m_ReadSocks);
+    }
+    if (events & WRITE_EVENTS) {
+        FD_SET(pBlockIO->m_Socket, &pReactor->m_WriteSocks);
+    }
+    if (events & EXCEPTION_EVENTS) {
+        FD_SET(pBlockIO->m_Socket, &pReactor->m_ExceptionSocks);
+    }
 #if LINUX
-        if (newSocketID >= g_pNetIOSystemImpl->m_FdRange) {
-            g_pNetIOSystemImpl->m_FdRange = newSocketID + 1;
-        }
+    if (pBlockIO->m_Socket >= pReactor->m_FdRange) {
+        pReactor->m_FdRange = pBlockIO->m_Socket + 1;
+    }
 #endif // LINUX
 
-        // Add this blockIO to the table that maps sockets to blockIO pointers.
-        err = m_ActiveSocketTable->SetValueEx(
-                                        (const char *) &(pBlockIO->m_Socket), // pKey
-                                        sizeof(OSSocket),
-                                        (const char *) pBlockIO, // userData
-                                        pBlockIO); // table entry
-        if (err) {
-            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. SetValueEx failed (%d)", err);
-            gotoErr(err);
-        }
+    pBlockIO->m_WatchedEvents = newEvents;
+} // WatchSocket.
 
-        ADDREF_OBJECT(pBlockIO);
-    } /////////////////////////////////////////////////
 
-    if (!fIsUDP) {
-        // Allow up to 5 connections to be waiting for an accept, which is
-        // the most allowed by typical implementations. We can still have
-        // any number of active connections that have been accepted.
-        result = listen(newSocketID, 5);
-        if (result) {
-            DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. listen() failed, lastErr = %d",
-                    lastErr);
-            gotoErr(EFail);
-        }
-    }
 
-    // Tell the select thread to start listening to this new
-    // socket. We added the socket to the fd set, and
-    // select uses the latest fd set each time it is called.
-    (void) WakeSelectThread();
 
-    *ppResultBlockIO = pBlockIO;
-    pBlockIO = NULL;
-    newSocketID = NULL_SOCKET;
 
-abort:
-    if (pBlockIO) {
-        (void) pBlockIO->Close();
-        RELEASE_OBJECT(pBlockIO);
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UnwatchSocket]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::UnwatchSocket(CNetBlockIO *pBlockIO, int32 events) {
+    int32 newEvents;
+    CNetReactor *pReactor;
+
+    if ((NULL == pBlockIO) || (NULL == pBlockIO->m_pReactor)) {
+        return;
     }
-    if (NULL_SOCKET != newSocketID) {
-        DEBUG_LOG("CNetIOSystem::OpenServerBlockIO. Call SafeCloseSocket on socket %d", newSocketID);
-        SafeCloseSocket(newSocketID, fIsUDP);
-        newSocketID = NULL_SOCKET;
+    pReactor = pBlockIO->m_pReactor;
+    AutoLock(pReactor->m_pLock);
+
+    if (NULL_SOCKET == pBlockIO->m_Socket) {
+        return;
     }
+    newEvents = pBlockIO->m_WatchedEvents & ~events;
 
-    RELEASE_OBJECT(pUrl);
+#if USE_EPOLL_REACTOR
+    if (m_fUseEpoll) {
+        if (newEvents != pBlockIO->m_WatchedEvents) {
+            (void) UpdateEpollRegistration(pBlockIO, newEvents);
+        }
+        return;
+    }
+#endif // USE_EPOLL_REACTOR
 
-    returnErr(err);
-} // OpenServerBlockIO.
+    if (events & READ_EVENTS) {
+        FD_CLR(pBlockIO->m_Socket, &pReactor->m_ReadSocks);
+    }
+    if (events & WRITE_EVENTS) {
+        FD_CLR(pBlockIO->m_Socket, &pReactor->m_WriteSocks);
+    }
+    if (events & EXCEPTION_EVENTS) {
+        FD_CLR(pBlockIO->m_Socket, &pReactor->m_ExceptionSocks);
+    }
 
+    pBlockIO->m_WatchedEvents = newEvents;
+} // UnwatchSocket.
 
 
 
 
 
+#if USE_EPOLL_REACTOR
 /////////////////////////////////////////////////////////////////////////////
 //
-// [ReceiveDataFromAcceptedConnection]
+// [UpdateEpollRegistration]
 //
-// This is called when a server wants to start receiving data from a blockIO
-// that it accepted.
+// The caller holds the reactor lock. The epoll entry points directly at
+// the blockIO, so the select thread never has to look up the socket. This
+// is safe because the socket table holds a reference to the blockIO
+// until DisconnectSocket, and DisconnectSocket removes the epoll entry
+// before it releases that reference.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::ReceiveDataFromAcceptedConnection(
-                        CNetBlockIO *pBlockIO,
-                        CAsyncBlockIOCallback *pCallback) {
+CNetIOSystem::UpdateEpollRegistration(CNetBlockIO *pBlockIO, int32 newEvents) {
     ErrVal err = ENoErr;
-    bool locked = false;
-    RunChecks();
+    CNetReactor *pReactor = pBlockIO->m_pReactor;
+    struct epoll_event epollEvent;
+    int op;
+    int result;
 
-    if ((NULL == m_ActiveSocketTable) || (NULL == m_pLock)) {
-        gotoErr(EFail);
+    if (0 == pBlockIO->m_WatchedEvents) {
+        op = EPOLL_CTL_ADD;
+    } else if (0 == newEvents) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
     }
 
-    if ((NULL == pBlockIO) || (NULL == pCallback)) {
-        gotoErr(EFail);
+    // This is level-triggered, just like select, so a socket that still
+    // has unread data keeps firing until it is drained.
+    memset(&epollEvent, 0, sizeof(epollEvent));
+    if (newEvents & READ_EVENTS) {
+        epollEvent.events |= EPOLLIN | EPOLLRDHUP;
     }
-
-    // We only hold the lock while we add the connection to
-    // the global list.
-    m_pLock->Lock();
-    locked = true;
-
-    pBlockIO->ChangeBlockIOCallback(pCallback);
-
-#if WIN32
-    // Start waiting for a read.
-    if ((m_ExceptionSocks.fd_count >= FD_SETSIZE)
-        || (m_ReadSocks.fd_count >= FD_SETSIZE)) {
-       DEBUG_LOG("CNetIOSystem::ReceiveDataFromAcceptedConnection. Too many sockets (%d, %d)",
-                  m_ExceptionSocks.fd_count,
-                  m_ReadSocks.fd_count);
-        gotoErr(ETooManySockets);
+    if (newEvents & WRITE_EVENTS) {
+        epollEvent.events |= EPOLLOUT;
     }
-#endif // WIN32
-
-    ASSERT(!(FD_ISSET(pBlockIO->m_Socket, &m_ExceptionSocks)));
-    ASSERT(!(FD_ISSET(pBlockIO->m_Socket, &m_ReadSocks)));
-    FD_SET(pBlockIO->m_Socket, &m_ExceptionSocks);
-    FD_SET(pBlockIO->m_Socket, &m_ReadSocks);
-#if LINUX
-    if (pBlockIO->m_Socket >= g_pNetIOSystemImpl->m_FdRange) {
-        g_pNetIOSystemImpl->m_FdRange = pBlockIO->m_Socket + 1;
+    if (newEvents & EXCEPTION_EVENTS) {
+        epollEvent.events |= EPOLLPRI;
     }
-#endif // LINUX
+    epollEvent.data.ptr = pBlockIO;
 
-    err = m_ActiveSocketTable->SetValueEx(
-                                    (const char *) &(pBlockIO->m_Socket), // pKey
-                                    sizeof(OSSocket),
-                                    (const char *) pBlockIO, // userData
-                                    pBlockIO); // table entry
-    if (err) {
-        DEBUG_LOG("CNetIOSystem::ReceiveDataFromAcceptedConnection. SetValueEx failed (%d)", err);
-        gotoErr(err);
+    result = epoll_ctl(pReactor->m_EpollFd, op, pBlockIO->m_Socket, &epollEvent);
+    if (result < 0) {
+        DEBUG_LOG("CNetIOSystem::UpdateEpollRegistration. epoll_ctl(%d) failed on socket %d. errno = %d",
+                    op, pBlockIO->m_Socket, GET_LAST_ERROR());
+        gotoErr(EFail);
     }
-    ADDREF_OBJECT(pBlockIO);
-
-    m_pLock->Unlock();
-    locked = false;
 
-    // Tell the select thread to start listening to this
-    // new socket. We added the socket to the fd set, and
-    // select uses the latest fd set each time it is called.
-    (void) WakeSelectThread();
+    pBlockIO->m_WatchedEvents = newEvents;
 
 abort:
-    if ((m_pLock) && (locked)) {
-        m_pLock->Unlock();
-    }
-
     returnErr(err);
-} // ReceiveDataFromAcceptedConnection.
+} // UpdateEpollRegistration.
+#endif // USE_EPOLL_REACTOR
+
+
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [NetIO_WaitForAllBlockIOsToClose]
+// [SelectThreadProc]
 //
+// This is the main select thread procedure.
 /////////////////////////////////////////////////////////////////////////////
-void
-NetIO_WaitForAllBlockIOsToClose() {
-    g_pNetIOSystemImpl->WaitForAllBlockIOsToClose();
-}
+static void
+SelectThreadProc(void *arg, CSimpleThread *threadState) {
+    threadState = threadState;
+    g_pNetIOSystemImpl->SelectThread((CNetReactor *) arg);
+} // SelectThreadProc.
+
+
+
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [WaitForAllBlockIOsToClose]
+// [SelectThread]
 //
+// This is the main select thread.
 /////////////////////////////////////////////////////////////////////////////
 void
-CNetIOSystem::WaitForAllBlockIOsToClose() {
-    ErrVal err = ENoErr;
-    CRefEvent *pSemaphore = NULL;
+CNetIOSystem::SelectThread(CNetReactor *pReactor) {
+    int numActiveSockets;
+    struct timeval timeoutInterval;
+    int32 waitTimeInMs;
+    uint32 msSleepingForSelectError;
+    bool fExitLoop = false;
+    int32 numBytes;
+    int32 lastErr = 0;
 
-    DEBUG_LOG("CNetIOSystem::WaitForAllBlockIOsToClose");
 
-    //////////////////////////////////////////////////////
-    {
-        AutoLock(m_pLock);
+#if USE_EPOLL_REACTOR
+    if (m_fUseEpoll) {
+        EpollThread(pReactor);
+        return;
+    }
+#endif // USE_EPOLL_REACTOR
+
+    msSleepingForSelectError = 100;
+
+    numActiveSockets = 0;
 
-        // Discard any semaphore left over from a previous operation.
-        RELEASE_OBJECT(m_pEmptyPendingCloseBlockIOs);
+    // This is the select thread loop.
+    while (1) {
+        // Copy the fd-sets into temporary variables. These will be modified
+        // by other methods while we wait on select
+        //
+        // Ugh, this is expensive. There must be a cheaper system call than
+        // select. Can I switch to poll? Does that work on windows?
+        // I'd rather not have the windows and linux implemntations differ too much,
+        // which is why I'm not using IOCompletion ports on windows. Maybe I will have
+        // to if this becomes a bottleneck.
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Lock();
+        }
 
-        m_pEmptyPendingCloseBlockIOs = newex CRefEvent;
-        if (NULL == m_pEmptyPendingCloseBlockIOs) {
-            return;
+#if WIN32
+        pReactor->m_ResultReadSocks.fd_count = pReactor->m_ReadSocks.fd_count;
+        if (pReactor->m_ResultReadSocks.fd_count > 0) {
+            numBytes = sizeof(int32) * pReactor->m_ReadSocks.fd_count;
+            memcpy(pReactor->m_ResultReadSocks.fd_array, pReactor->m_ReadSocks.fd_array, numBytes);
+        }
+        pReactor->m_ResultWriteSocks.fd_count = pReactor->m_WriteSocks.fd_count;
+        if (pReactor->m_ResultWriteSocks.fd_count > 0) {
+            numBytes = sizeof(int32) * pReactor->m_WriteSocks.fd_count;
+            memcpy(pReactor->m_ResultWriteSocks.fd_array, pReactor->m_WriteSocks.fd_array, numBytes);
+        }
+        pReactor->m_ResultExceptionSocks.fd_count = pReactor->m_ExceptionSocks.fd_count;
+        if (pReactor->m_ResultExceptionSocks.fd_count > 0) {
+            numBytes = sizeof(int32) * pReactor->m_ExceptionSocks.fd_count;
+            memcpy(pReactor->m_ResultExceptionSocks.fd_array, pReactor->m_ExceptionSocks.fd_array, numBytes);
+        }
+        // This param is ignored on windows
+        pReactor->m_ResultFdRange = 0;
+#elif LINUX
+        // Only copies the part of the bit vector that I actually use.
+        // numBytes = sizeof(pReactor->m_ReadSocks);
+        numBytes = (pReactor->m_FdRange / 8);
+        if ((numBytes * 8) < pReactor->m_FdRange) {
+           numBytes += 1;
         }
+        ASSERT(numBytes <= (int32) sizeof(pReactor->m_ReadSocks));
 
-        err = m_pEmptyPendingCloseBlockIOs->Initialize();
-        if (err) {
-            RELEASE_OBJECT(m_pEmptyPendingCloseBlockIOs);
-            return;
+        memcpy(&pReactor->m_ResultReadSocks, &pReactor->m_ReadSocks, numBytes);
+        memcpy(&pReactor->m_ResultWriteSocks, &pReactor->m_WriteSocks, numBytes);
+        memcpy(&pReactor->m_ResultExceptionSocks, &pReactor->m_ExceptionSocks, numBytes);
+        pReactor->m_ResultFdRange = pReactor->m_FdRange;
+#endif
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Unlock();
         }
 
-        pSemaphore = m_pEmptyPendingCloseBlockIOs;
-        ADDREF_OBJECT(pSemaphore);
-    }
-    //////////////////////////////////////////////////////
+        ASSERT_WIN32(pReactor->m_ReadSocks.fd_count > 0);
+        ASSERT_WIN32(pReactor->m_ResultReadSocks.fd_count > 0);
 
-    err = WakeSelectThread();
-    if (err) {
-        return;
-    }
-    pSemaphore->Wait();
-    RELEASE_OBJECT(pSemaphore);
+        // Sleep until the next timer fires, or around 5 seconds.
+        // Reset the timeout interval before every select. Select on
+        // Linux seems to reset this, so we need to refresh the value.
+        waitTimeInMs = GetReactorWaitTime(pReactor);
+        timeoutInterval.tv_sec = waitTimeInMs / 1000; // seconds
+        timeoutInterval.tv_usec = (waitTimeInMs % 1000) * 1000; // microseconds
 
-    //////////////////////////////////////////////////////
-    {
-        AutoLock(m_pLock);
-        RELEASE_OBJECT(m_pEmptyPendingCloseBlockIOs);
-    }
-    //////////////////////////////////////////////////////
-} // WaitForAllBlockIOsToClose.
+        // Block until there is something to do.
+        numActiveSockets = select(
+                                pReactor->m_ResultFdRange,
+                                &pReactor->m_ResultReadSocks,
+                                &pReactor->m_ResultWriteSocks,
+                                &pReactor->m_ResultExceptionSocks,
+                                &timeoutInterval);
+        // Get the last error immediately after the system call.
+        // Anything code, even a DEBUG_LOG, may touch a file and
+        // change the last error.
+        lastErr = GET_LAST_ERROR();
+
+        // DEBUG_LOG("Return from select. pReactor->m_ResultFdRange = %d, numActiveSockets = %d",  pReactor->m_ResultFdRange, numActiveSockets);
 
+#if LINUX
+      // This happens when a process signal interrupts the system call.
+    	if (numActiveSockets == -1 && errno == EINTR) {
+            continue;
+    	}
+#endif
 
+        // The pending wake-up flag is cleared when the wake-up socket
+        // is drained, not here. See DrainNotificationData.
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Lock();
+        }
 
+        // If we are quitting the entire network server, then exit
+        // the main loop of the select thread as soon as we leave the lock.
+        if (m_StopSelectThread) {
+            fExitLoop = true;
+        }
 
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Unlock();
+        }
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [GetLocalAddr]
-//
-/////////////////////////////////////////////////////////////////////////////
-void
-CNetIOSystem::GetLocalAddr(struct sockaddr_in *pAddrResult) {
-    if (NULL != pAddrResult) {
-        memcpy(pAddrResult, &m_LocalAddr, sizeof(struct sockaddr_in));
-    }
-} // GetLocalAddr.
+        if (fExitLoop) {
+            break;
+        }
+
+        // If there was an exception, then select failed. Often this
+        // means that an invalid socket is in the fd sets. This can
+        // happen if a socket is closed but not FD_CLR'ed. All we can
+        // do is raise a warning and adjust the connections in the hope
+        // that the offending connection has been cleared.
+        //
+        // This shouldn't happen and it usually means there is a bug.
+        if (numActiveSockets < 0) {
+            DEBUG_WARNING("Select returned an error. err = %d", lastErr);
 
+            // Sleep for a while to let other threads run long enough
+            // to close their sockets. Otherwise, this select becomes a
+            // busy loop.
+            OSIndependantLayer::SleepForMilliSecs(msSleepingForSelectError);
 
+            // Adjust the connections, hopefully this will fix the problem.
+            AdjustBlockIOs(pReactor);
 
+            continue;
+        } // handling a select error event.
 
+        // In Win32, if numActiveSockets is 0, then the FD_SET's may be invalid.
+        // In particular, the exception sockets is what we passed in, not what really
+        // has an exception.
+        if (0 == numActiveSockets) {
+            ASSERT_WIN32(0 == pReactor->m_ResultReadSocks.fd_count);
+            ASSERT_WIN32(0 == pReactor->m_ResultWriteSocks.fd_count);
+            ASSERT_WIN32(0 == pReactor->m_ResultExceptionSocks.fd_count);
 
+            // Check for timeouts and try again.
+            AdjustBlockIOs(pReactor);
+#if WIN32
+            continue;
+#endif
+        }
 
+        // As a special case, check if this is one of the sockets
+        // that is just designed to wake up the select thread.
+        if (FD_ISSET(pReactor->m_WakeUpThreadReceive, &pReactor->m_ResultReadSocks)) {
+            FD_CLR(pReactor->m_WakeUpThreadReceive, &pReactor->m_ResultReadSocks);
+            (void) DrainNotificationData(pReactor);
+            numActiveSockets = numActiveSockets - 1;
+        }
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [GetLocalHostName]
-//
-/////////////////////////////////////////////////////////////////////////////
-ErrVal
-CNetIOSystem::GetLocalHostName(char *host, int32 maxHostLength) {
-    int32 result;
+        if (numActiveSockets > 0) {
+            (void) ProcessActiveSockets(pReactor);
+        } else {
+            ASSERT_WIN32(0 == pReactor->m_ResultReadSocks.fd_count);
+            ASSERT_WIN32(0 == pReactor->m_ResultWriteSocks.fd_count);
+            ASSERT_WIN32(0 == pReactor->m_ResultExceptionSocks.fd_count);
+        }
 
-    if (NULL == host) {
-        returnErr(EFail);
-    }
+        ASSERT_WIN32(pReactor->m_ReadSocks.fd_count > 0);
 
-    DEBUG_LOG("CNetIOSystem::GetLocalHostName. Calling gethostname");
-    result = gethostname(host, maxHostLength - 1);
-    DEBUG_LOG("CNetIOSystem::GetLocalHostName. gethostname returned. result = %d",
-                result);
+        // Always call this, even when there are no active sockets,
+        // since it implements timeouts.
+        AdjustBlockIOs(pReactor);
+        ASSERT_WIN32(pReactor->m_ReadSocks.fd_count > 0);
+    } // the main server loop.
 
-    if (result) {
-        returnErr(EFail);
+    if (NULL != pReactor->m_pSelectThreadStopped) {
+        pReactor->m_pSelectThreadStopped->Signal();
     }
-
-    returnErr(ENoErr);
-} // GetLocalHostName.
+} // SelectThread.
 
 
 
 
 
 
+#if USE_EPOLL_REACTOR
 /////////////////////////////////////////////////////////////////////////////
 //
-// [NetIO_GetLocalProxySettings]
+// [EpollThread]
 //
+// This is the main select thread when we use epoll. It does the same work as
+// the select loop, but the kernel only hands us the sockets that are ready,
+// so the work per wakeup is proportional to the number of active sockets,
+// not the number of open sockets.
 /////////////////////////////////////////////////////////////////////////////
-bool
-NetIO_GetLocalProxySettings(
-                        char **ppProxyServerName,
-                        int *pProxyPort) {
-    bool fFoundIt = false;
-    char *pConfigStr = NULL;
-#if WIN32
-    HKEY hKey = NULL;
-#endif
-
-
-    if (NULL != ppProxyServerName) {
-        *ppProxyServerName = NULL;
-    }
-    if (NULL != pProxyPort) {
-        *pProxyPort = -1;
-    }
-
-
-    // First, look if there is a gateway in the config file.
-    pConfigStr = g_pBuildingBlocksConfig->GetString(
-                                             g_NetworkProxyHostConfigValueName,
-                                             NULL);
-    if (NULL != pConfigStr) {
-        fFoundIt = true;
+void
+CNetIOSystem::EpollThread(CNetReactor *pReactor) {
+    int numEvents;
+    int eventNum;
+    uint32 eventFlags;
+    CNetBlockIO *pBlockIO;
+    bool fExitLoop = false;
+    int32 lastErr = 0;
 
-        DEBUG_LOG("NetIO_GetLocalProxySettings. Found a proxy (%s)", pConfigStr);
+    while (1) {
+        // Block until there is something to do, or until the next
+        // timer on this reactor fires.
+        numEvents = epoll_wait(
+                        pReactor->m_EpollFd,
+                        pReactor->m_EpollEvents,
+                        CNetReactor::MAX_EPOLL_EVENTS_PER_WAIT,
+                        GetReactorWaitTime(pReactor));
+        // Get the last error immediately after the system call.
+        // Anything code, even a DEBUG_LOG, may touch a file and
+        // change the last error.
+        lastErr = GET_LAST_ERROR();
 
-        if (NULL != ppProxyServerName) {
-            *ppProxyServerName = strdupex(pConfigStr);
-            if (NULL == *ppProxyServerName) {
-                goto abort;
-            }
+        // This happens when a process signal interrupts the system call.
+        if ((numEvents < 0) && (EINTR == lastErr)) {
+            continue;
         }
-        if (NULL != pProxyPort) {
-            *pProxyPort = g_pBuildingBlocksConfig->GetInt(g_NetworkProxyPortConfigValueName, 80);
+
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Lock();
         }
 
-        goto abort;
-    } // if (NULL != pConfigStr)
-    else
-    {
-        DEBUG_LOG("NetIO_GetLocalProxySettings. No proxy");
-    }
+        if (m_StopSelectThread) {
+            fExitLoop = true;
+        }
 
-#if WIN32
-    LONG lResult;
-    DWORD valueType;
-    static const char g_SettingsRegistryKey[] = "Software\\Microsoft\\Windows\\CurrentVersion\\Internet Settings";
-    DWORD dwIntValue;
-    char *pPortStr;
-    DWORD length;
-    char buffer[1024];
+        if (pReactor->m_pLock) {
+            pReactor->m_pLock->Unlock();
+        }
 
-    lResult = RegCreateKeyExA(
-                    HKEY_CURRENT_USER,
-                    g_SettingsRegistryKey,
-                    0, // reserved
-                    NULL, // class
-                    REG_OPTION_NON_VOLATILE,
-                    KEY_READ | KEY_QUERY_VALUE,
-                    NULL, // security attributes
-                    &hKey,
-                    NULL);
-    if (ERROR_SUCCESS != lResult) {
-        DEBUG_LOG("NetIO_GetLocalProxySettings. RegCreateKeyExA failed");
-        goto abort;
-    }
+        if (fExitLoop) {
+            break;
+        }
 
-    length = sizeof(dwIntValue);
-    lResult = RegQueryValueExA(
-                  hKey,
-                  "ProxyEnable",
-                  NULL,
-                  &valueType,
-                  (uchar *) &dwIntValue,
-                  &length);
-    if ((ERROR_SUCCESS == lResult) && (!dwIntValue)) {
-        DEBUG_LOG("NetIO_GetLocalProxySettings. RegQueryValueEx failed");
-        goto abort;
-    }
+        if (numEvents < 0) {
+            DEBUG_WARNING("epoll_wait returned an error. err = %d", lastErr);
 
-    length = sizeof(buffer);
-    lResult = RegQueryValueExA(
-                  hKey,
-                  "ProxyServer",
-                  NULL,
-                  &valueType,
-                  (uchar *) buffer,
-                  &length);
-    if ((ERROR_SUCCESS == lResult) && (REG_SZ == valueType)) {
-        fFoundIt = true;
+            // Don't let this become a busy loop.
+            OSIndependantLayer::SleepForMilliSecs(100);
+            AdjustBlockIOs(pReactor);
+            continue;
+        }
 
-        DEBUG_LOG("NetIO_GetLocalProxySettings. Found a proxy (%s)", buffer);
+        // Nothing in this loop can release the last reference to a blockIO.
+        // Only AdjustBlockIOs disconnects sockets, and that runs after we
+        // have finished with this batch of events.
+        for (eventNum = 0; eventNum < numEvents; eventNum++) {
+            pBlockIO = (CNetBlockIO *) (pReactor->m_EpollEvents[eventNum].data.ptr);
+            eventFlags = pReactor->m_EpollEvents[eventNum].events;
 
-        if (NULL != ppProxyServerName) {
-            *ppProxyServerName = strdupex(buffer);
-            if (NULL == *ppProxyServerName) {
-                goto abort;
+            if (NULL == pBlockIO) {
+                (void) DrainNotificationData(pReactor);
+                continue;
             }
 
-            pPortStr = *ppProxyServerName;
-            while ((*pPortStr) && (':' != *pPortStr)) {
-                pPortStr++;
+            // Linux select reports an error or a hangup as both readable
+            // and writable, so do the same here. The read or write will
+            // then discover the actual error.
+            if (eventFlags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                ProcessReadEvent(pBlockIO);
             }
-            if (':' == *pPortStr) {
-                *pPortStr = 0;
-                pPortStr++;
-                if (NULL != pProxyPort) {
-                    CStringLib::StringToNumber(pPortStr, strlen(pPortStr), pProxyPort);
-                }
+            if (eventFlags & (EPOLLOUT | EPOLLERR)) {
+                ProcessWriteEvent(pBlockIO);
             }
-        }
-    } // if ((ERROR_SUCCESS == lResult) && (REG_SZ == valueType))
-    else
-    {
-        DEBUG_LOG("NetIO_GetLocalProxySettings. No proxy");
-    }
-
-    //HKEY_CURRENT_USER\Software\Microsoft\Windows\CurrentVersion\Internet Settings\ProxyHttp1.1
-    //HKEY_CURRENT_USER\Software\Microsoft\Windows\CurrentVersion\Internet Settings\ProxyOverride
-#endif
-
+            if (eventFlags & EPOLLPRI) {
+                ProcessExceptionEvent(pBlockIO);
+            }
+        } // for (eventNum = 0; eventNum < numEvents; eventNum++)
 
-abort:
-#if WIN32
-    if (NULL != hKey) {
-        RegCloseKey(hKey);
-        hKey = NULL;
-    }
-#endif
+        // Always call this, even when there are no active sockets,
+        // since it implements timeouts.
+        AdjustBlockIOs(pReactor);
+    } // the main server loop.
 
-    return(fFoundIt);
-} // GetLocalProxySettings
+    if (NULL != pReactor->m_pSelectThreadStopped) {
+        pReactor->m_pSelectThreadStopped->Signal();
+    }
+} // EpollThread.
 
 
 
@@ -2490,93 +5186,186 @@ abort:
 
 
 
+#if USE_IO_URING
 /////////////////////////////////////////////////////////////////////////////
 //
-// [CheckState]
+// [UringThreadProc]
 //
 /////////////////////////////////////////////////////////////////////////////
-ErrVal
-CNetIOSystem::CheckState() {
-    ErrVal err = ENoErr;
-    AutoLock(m_pLock);
-
-    if ((!m_fInitialized) || (m_StopSelectThread)) {
-        returnErr(ENoErr);
-    }
+static void
+UringThreadProc(void *arg, CSimpleThread *threadState) {
+    arg = arg;
+    threadState = threadState;
+    g_pNetIOSystemImpl->UringThread();
+} // UringThreadProc.
 
-    if (NULL == m_ActiveSocketTable) {
-        returnErr(EFail);
-    }
 
-    returnErr(err);
-} // CheckState.
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [AllocNetBlockIO]
+// [UringThread]
 //
+// This reaps completions from the io_uring. The select thread still owns
+// timeouts and closing sockets, this thread only finishes IO.
 /////////////////////////////////////////////////////////////////////////////
-CNetBlockIO *
-CNetIOSystem::AllocNetBlockIO(
-                    CParsedUrl *pUrl,
-                    OSSocket newSocketID,
-                    int32 connectionFlags,
-                    CAsyncBlockIOCallback *pCallback) {
+void
+CNetIOSystem::UringThread() {
     ErrVal err = ENoErr;
-    CNetBlockIO *pBlockIO = NULL;
-    AutoLock(m_pLock);
+    uint64 userData;
+    int32 result;
+    bool fStop = false;
 
+    while (!fStop) {
+        while (m_pIOUring->GetNextCompletion(&userData, &result)) {
+            if (URING_STOP_OP == userData) {
+                if (m_StopSelectThread) {
+                    fStop = true;
+                }
+                continue;
+            }
 
-    if (m_ActiveBlockIOs.GetLength() >= m_MaxNumBlockIOs) {
-       DEBUG_LOG("CNetIOSystem::AllocNetBlockIO. Too many sockets (%d)",
-                  m_ActiveBlockIOs.GetLength());
-        gotoErr(ETooManySockets);
-    }
+            ProcessUringCompletion(userData, result);
+        }
+        if (fStop) {
+            break;
+        }
 
-    pBlockIO = newex CNetBlockIO;
-    if (!pBlockIO) {
-        gotoErr(EFail);
+        err = m_pIOUring->WaitForCompletions();
+        if (err) {
+            DEBUG_LOG("CNetIOSystem::UringThread. WaitForCompletions failed. err = %d", err);
+            OSIndependantLayer::SleepForMilliSecs(100);
+        }
+    } // while (!fStop)
+
+    if (m_pUringThreadStopped) {
+        m_pUringThreadStopped->Signal();
     }
+} // UringThread.
 
-    // These are part of the base class.
-    pBlockIO->m_MediaType = CAsyncBlockIO::NETWORK_MEDIA;
-    pBlockIO->m_fSeekable = false;
-    pBlockIO->m_pUrl = pUrl;
-    ADDREF_OBJECT(pUrl);
 
-    pBlockIO->m_MediaSize = 0;
 
-    pBlockIO->m_pLock = CRefLock::Alloc();
-    if (NULL == pBlockIO->m_pLock) {
-        gotoErr(EFail);
-    }
 
-    // These are part of the net Block IO subclass.
-    pBlockIO->m_Socket = newSocketID;
-    pBlockIO->m_BlockIOFlags = connectionFlags;
-    pBlockIO->m_BlockIOFlags &= ~CAsyncBlockIO::RESIZEABLE;
 
-    pBlockIO->m_ActiveBlockIOs.ResetQueue();
 
-    // Add this connection to the list of active connections.
-    // This procedure assumes that the caller has already
-    // acquired the lock.
-    m_ActiveBlockIOs.InsertHead(&(pBlockIO->m_ActiveBlockIOs));
-    ADDREF_OBJECT(pBlockIO);
-    pBlockIO->m_pIOSystem = this;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ProcessUringCompletion]
+//
+// The top byte of the user data says which operation completed. The rest is
+// a pointer to the buffer or blockIO the ring was holding a reference to.
+// User-space pointers fit in the low 56 bits, so the top byte is free.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::ProcessUringCompletion(uint64 userData, int32 result) {
+    int32 op = (int32) (userData >> URING_OP_SHIFT);
+    void *ptr = (void *) (userData & ((((uint64) 1) << URING_OP_SHIFT) - 1));
+    CIOBuffer *pBuffer = NULL;
+    CNetBlockIO *pBlockIO = NULL;
+    bool fRepost = false;
 
-    pBlockIO->ChangeBlockIOCallback(pCallback);
+    DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. op = %d, result = %d", op, result);
 
-    return(pBlockIO);
+    switch (op) {
+    case URING_RECV_OP:
+    case URING_SEND_OP:
+        pBuffer = (CIOBuffer *) ptr;
+        pBlockIO = (CNetBlockIO *) (pBuffer->m_pBlockIO);
+        ADDREF_OBJECT(pBlockIO);
+        if (URING_RECV_OP == op) {
+            pBlockIO->FinishUringRecv(pBuffer, result);
+        } else {
+            pBlockIO->FinishUringSend(pBuffer, result);
+        }
+        RELEASE_OBJECT(pBlockIO);
+        break;
 
-abort:
-    RELEASE_OBJECT(pBlockIO);
+    case URING_CONNECT_OP:
+        pBlockIO = (CNetBlockIO *) ptr;
+        if (pBlockIO->m_pLock) {
+            pBlockIO->m_pLock->Lock();
+        }
+        // A positive result is from the poll below. The socket is writable,
+        // so the connect is done, and SO_ERROR says whether it worked.
+        if (result > 0) {
+            result = GetConnectResult(pBlockIO->m_Socket);
+        }
+        if (-EISCONN == result) {
+            result = 0;
+        }
 
-    return(NULL);
-} // AllocNetBlockIO.
+        // Like connect() on the readiness path, a non-blocking socket may
+        // say the connect is still in progress. Then wait for the socket to
+        // become writable. The ring keeps its reference to the blockIO.
+        if ((result < 0)
+            && ((IO_WOULD_BLOCK(-result)) || (-EALREADY == result) || (-EINTR == result))
+            && (NULL_SOCKET != pBlockIO->m_Socket)
+            && (pBlockIO->m_BlockIOFlags & CNetBlockIO::WAITING_TO_CONNECT)
+            && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+            DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. connect in progress. result = %d", result);
+            if (ENoErr == UringPollConnect(pBlockIO)) {
+                if (pBlockIO->m_pLock) {
+                    pBlockIO->m_pLock->Unlock();
+                }
+                break;
+            }
+        }
+
+        if ((0 == result)
+            && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+            DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. Finished connecting (%d)",
+                        pBlockIO->m_Socket);
+            pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_CONNECT;
+            ReportSocketIsActive(pBlockIO, ENoErr, CIOBuffer::IO_CONNECT);
+            (void) UringPostRecv(pBlockIO);
+        } else if (pBlockIO->m_BlockIOFlags & CNetBlockIO::WAITING_TO_CONNECT) {
+            DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. connect failed. result = %d", result);
+            pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_CONNECT;
+            ReportSocketIsActive(pBlockIO, TranslateConnectError(result), CIOBuffer::IO_CONNECT);
+        }
+        if (pBlockIO->m_pLock) {
+            pBlockIO->m_pLock->Unlock();
+        }
+        RELEASE_OBJECT(pBlockIO);
+        break;
+
+    case URING_ACCEPT_OP:
+        pBlockIO = (CNetBlockIO *) ptr;
+        if (pBlockIO->m_pLock) {
+            pBlockIO->m_pLock->Lock();
+        }
+        if ((NULL_SOCKET != pBlockIO->m_Socket)
+            && !(pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+            if (result >= 0) {
+                DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. accepted a socket %d", result);
+                AcceptConnection(pBlockIO, result, &(pBlockIO->m_UringAddr), true);
+                fRepost = true;
+            } else if ((-EINTR == result)
+                    || (-EAGAIN == result)
+                    || (-ECONNABORTED == result)) {
+                fRepost = true;
+            } else {
+                DEBUG_LOG("CNetIOSystem::ProcessUringCompletion. accept failed. result = %d", result);
+            }
+        } else if (result >= 0) {
+            SafeCloseSocket(result, false);
+        }
+        if (fRepost) {
+            (void) UringPostAccept(pBlockIO);
+        }
+        if (pBlockIO->m_pLock) {
+            pBlockIO->m_pLock->Unlock();
+        }
+        RELEASE_OBJECT(pBlockIO);
+        break;
+
+    case URING_CANCEL_OP:
+    default:
+        break;
+    } // switch (op)
+} // ProcessUringCompletion.
 
 
 
@@ -2585,93 +5374,141 @@ abort:
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [DisconnectSocket]
-//
-// This routine is only called by the select thread, so connections are not
-// deleted by other threads while select has a pointer to them.
-//
-// To close a connection, the client sets the delete flag and wakes up the
-// select thread. The select thread sees this flag and calls this routine.
+// [UringPostRecv]
 //
+// Post a receive for the socket, unless one is already posted. This uses
+// the next buffer the client gave us, or else an unsolicited buffer, just
+// like ProcessReadEvent.
 /////////////////////////////////////////////////////////////////////////////
-void
-CNetIOSystem::DisconnectSocket(CNetBlockIO *pBlockIO) {
-    bool fRemovedItem = false;
-    bool fIsUdp = false;
+ErrVal
+CNetIOSystem::UringPostRecv(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    int32 actualIOSize;
+    struct io_uring_sqe sqe;
+    AutoLock(pBlockIO->m_pLock);
 
-    DEBUG_LOG("CNetIOSystem::DisconnectSocket. pBlockIO = %p", pBlockIO);
-    if ((!pBlockIO)
-        || (!m_ActiveSocketTable)
-        || (NULL_SOCKET == pBlockIO->m_Socket)) {
-        return;
+    if ((NULL == m_pIOUring)
+        || (NULL_SOCKET == pBlockIO->m_Socket)
+        || (pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)
+        || (pBlockIO->m_BlockIOFlags & CNetBlockIO::WAITING_TO_CONNECT)
+        || (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_RECV_POSTED)) {
+        returnErr(ENoErr);
     }
 
-    // Hold the lock while we remove the connection from
-    // the global list of active connections.
-    if (pBlockIO->m_pLock) {
-        pBlockIO->m_pLock->Lock();
+    pBuffer = pBlockIO->m_PendingReads.RemoveHead();
+    if (NULL == pBuffer) {
+        pBuffer = AllocIOBuffer(-1, true);
+        if (!pBuffer) {
+            gotoErr(EFail);
+        }
+
+        pBuffer->m_BufferOp = CIOBuffer::READ;
+        pBuffer->m_BufferFlags &= ~CIOBuffer::VALID_DATA;
+        pBuffer->m_BufferFlags |= CIOBuffer::INPUT_BUFFER;
+        pBuffer->m_Err = ENoErr;
+        // buffer and bufferSize are initialized by AllocIOBuffer.
+        pBuffer->m_NumValidBytes = 0;
+        pBuffer->m_pBlockIO = pBlockIO;
+        ADDREF_OBJECT(pBlockIO);
+
+        pBlockIO->m_NumActiveReads += 1;
     }
 
-    /////////////////////////////////////////
-    // Get the global IOSystem lock.
-    if (m_pLock) {
-        m_pLock->Lock();
+    // Don't read more than 1 block per IO on a network.
+    actualIOSize = pBuffer->m_BufferSize;
+    if (actualIOSize > GetDefaultBytesPerBlock()) {
+        actualIOSize = GetDefaultBytesPerBlock();
     }
 
-    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::UDP_SOCKET) {
-       fIsUdp = true;
+    // The ring holds the reference we got from either the pending
+    // list or AllocIOBuffer until the receive completes.
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = pBlockIO->m_Socket;
+    sqe.addr = (uint64) (pBuffer->m_pLogicalBuffer);
+    sqe.len = actualIOSize;
+    sqe.user_data = ((uint64) pBuffer) | (((uint64) URING_RECV_OP) << URING_OP_SHIFT);
+
+    pBlockIO->m_BlockIOFlags |= CNetBlockIO::URING_RECV_POSTED;
+    err = m_pIOUring->SubmitSQE(&sqe);
+    if (err) {
+        pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::URING_RECV_POSTED;
+        pBlockIO->FinishIO(pBuffer, err, 0);
+        gotoErr(err);
     }
+    pBuffer = NULL;
 
-    fRemovedItem = m_ActiveSocketTable->RemoveValue(
-                                            (const char *) &(pBlockIO->m_Socket),
-                                            sizeof(OSSocket));
+abort:
+    RELEASE_OBJECT(pBuffer);
+    returnErr(err);
+} // UringPostRecv.
 
-    FD_CLR(pBlockIO->m_Socket, &m_ReadSocks);
-    FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-    FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
 
-    if (m_pLock) {
-        m_pLock->Unlock();
-    }
-    /////////////////////////////////////////
 
 
-    // Handle this specially if we are simulating a network error.
-    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::SIMULATE_NETWORK_ERROR) {
-        DEBUG_LOG("CNetIOSystem::DisconnectSocket. Call SafeCloseSocket on socket %d",
-                  pBlockIO->m_Socket);
 
-        SafeCloseSocket(pBlockIO->m_Socket, fIsUdp);
-        pBlockIO->m_Socket = NULL_SOCKET;
 
-        pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::DISCONNECT_SOCKET;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UringPostSend]
+//
+// Post a send for the first queued write, unless one is already posted.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::UringPostSend(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    CIOBuffer *pBuffer = NULL;
+    struct io_uring_sqe sqe;
+    AutoLock(pBlockIO->m_pLock);
 
-        // Force the error to be reported immediately.
-        if (CNetBlockIO::WAITING_TO_WRITE & pBlockIO->m_BlockIOFlags) {
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::WRITE);
-        } else if (CNetBlockIO::WAITING_TO_READ & pBlockIO->m_BlockIOFlags) {
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::READ);
-        } else { // if (CNetBlockIO::WAITING_TO_CONNECT & pBlockIO->m_BlockIOFlags)
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::IO_CONNECT);
-        }
-    } else { // simulating a network error.
-        DEBUG_LOG("CNetIOSystem::DisconnectSocket. Call SafeCloseSocket on socket %d",
-                  pBlockIO->m_Socket);
+    if ((NULL == m_pIOUring)
+        || (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SEND_POSTED)) {
+        returnErr(ENoErr);
+    }
 
-        // Otherwise, this is just normally closing the socket.
-        SafeCloseSocket(pBlockIO->m_Socket, fIsUdp);
-        pBlockIO->m_Socket = NULL_SOCKET;
-    } // normal close.
+    pBuffer = pBlockIO->m_PendingWrites.RemoveHead();
+    if (NULL == pBuffer) {
+        returnErr(ENoErr);
+    }
 
-    if (pBlockIO->m_pLock) {
-        pBlockIO->m_pLock->Unlock();
+    if ((NULL_SOCKET == pBlockIO->m_Socket)
+        || (pBlockIO->m_BlockIOFlags & CNetBlockIO::DISCONNECT_SOCKET)) {
+        gotoErr(EPeerDisconnected);
     }
 
-    // The blockIO was AddRefed when it was put in m_ActiveSocketTable.
-    if (fRemovedItem) {
-        RELEASE_OBJECT(pBlockIO);
+    // There is only one timeout per blockIO. Don't clobber a read timeout
+    // the stream is already waiting on.
+    if (0 == pBlockIO->m_NumTimeouts) {
+        pBlockIO->StartTimeout(CIOBuffer::WRITE);
     }
-} // DisconnectSocket.
+
+    // IO does NOT has to be block-aligned for a network device.
+    // MSG_NOSIGNAL means dont send EPIPE on peer reset.
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_SEND;
+    sqe.fd = pBlockIO->m_Socket;
+    sqe.addr = (uint64) (pBuffer->m_pLogicalBuffer + pBuffer->m_StartWriteOffset);
+    sqe.len = pBuffer->m_NumValidBytes - pBuffer->m_StartWriteOffset;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = ((uint64) pBuffer) | (((uint64) URING_SEND_OP) << URING_OP_SHIFT);
+
+    pBlockIO->m_BlockIOFlags |= CNetBlockIO::URING_SEND_POSTED;
+    err = m_pIOUring->SubmitSQE(&sqe);
+    if (err) {
+        pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::URING_SEND_POSTED;
+        gotoErr(err);
+    }
+    pBuffer = NULL;
+
+abort:
+    if (pBuffer) {
+        pBuffer->m_Err = EPeerDisconnected;
+        pBlockIO->FinishIO(pBuffer, EPeerDisconnected, pBuffer->m_NumValidBytes);
+        RELEASE_OBJECT(pBuffer);
+    }
+    returnErr(err);
+} // UringPostSend.
 
 
 
@@ -2680,212 +5517,162 @@ CNetIOSystem::DisconnectSocket(CNetBlockIO *pBlockIO) {
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// [SelectThreadProc]
+// [UringPostConnect]
 //
-// This is the main select thread procedure.
 /////////////////////////////////////////////////////////////////////////////
-static void
-SelectThreadProc(void *arg, CSimpleThread *threadState) {
-    arg = arg;
-    threadState = threadState;
-    g_pNetIOSystemImpl->SelectThread();
-} // SelectThreadProc.
+ErrVal
+CNetIOSystem::UringPostConnect(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    struct io_uring_sqe sqe;
+    AutoLock(pBlockIO->m_pLock);
 
+    if (NULL == m_pIOUring) {
+        gotoErr(EFail);
+    }
 
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_CONNECT;
+    sqe.fd = pBlockIO->m_Socket;
+    sqe.addr = (uint64) &(pBlockIO->m_UringAddr);
+    sqe.off = sizeof(struct sockaddr_in);
+    sqe.user_data = ((uint64) pBlockIO) | (((uint64) URING_CONNECT_OP) << URING_OP_SHIFT);
 
+    // The ring holds a reference until the connect completes.
+    ADDREF_OBJECT(pBlockIO);
+    err = m_pIOUring->SubmitSQE(&sqe);
+    if (err) {
+        RELEASE_OBJECT(pBlockIO);
+        gotoErr(err);
+    }
 
+abort:
+    returnErr(err);
+} // UringPostConnect.
 
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// [SelectThread]
-//
-// This is the main select thread.
-/////////////////////////////////////////////////////////////////////////////
-void
-CNetIOSystem::SelectThread() {
-    int numActiveSockets;
-    struct timeval timeoutInterval;
-    uint32 msSleepingForSelectError;
-    bool fExitLoop = false;
-    int32 numBytes;
-    int32 lastErr = 0;
 
 
-    msSleepingForSelectError = 100;
 
-    m_PrevCheckForTimeoutsTime = GetTimeSinceBootInMs();
-    numActiveSockets = 0;
 
-    // This is the select thread loop.
-    while (1) {
-        // Copy the fd-sets into temporary variables. These will be modified
-        // by other methods while we wait on select
-        //
-        // Ugh, this is expensive. There must be a cheaper system call than
-        // select. Can I switch to poll? Does that work on windows?
-        // I'd rather not have the windows and linux implemntations differ too much,
-        // which is why I'm not using IOCompletion ports on windows. Maybe I will have
-        // to if this becomes a bottleneck.
-        if (m_pLock) {
-            m_pLock->Lock();
-        }
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UringPollConnect]
+//
+// This waits for a connect that is still in progress. It completes as a
+// URING_CONNECT_OP with the poll mask as its result, and the ring keeps the
+// reference that the connect was holding.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::UringPollConnect(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    struct io_uring_sqe sqe;
 
-#if WIN32
-        m_ResultReadSocks.fd_count = m_ReadSocks.fd_count;
-        if (m_ResultReadSocks.fd_count > 0) {
-            numBytes = sizeof(int32) * m_ReadSocks.fd_count;
-            memcpy(m_ResultReadSocks.fd_array, m_ReadSocks.fd_array, numBytes);
-        }
-        m_ResultWriteSocks.fd_count = m_WriteSocks.fd_count;
-        if (m_ResultWriteSocks.fd_count > 0) {
-            numBytes = sizeof(int32) * m_WriteSocks.fd_count;
-            memcpy(m_ResultWriteSocks.fd_array, m_WriteSocks.fd_array, numBytes);
-        }
-        m_ResultExceptionSocks.fd_count = m_ExceptionSocks.fd_count;
-        if (m_ResultExceptionSocks.fd_count > 0) {
-            numBytes = sizeof(int32) * m_ExceptionSocks.fd_count;
-            memcpy(m_ResultExceptionSocks.fd_array, m_ExceptionSocks.fd_array, numBytes);
-        }
-        // This param is ignored on windows
-        m_ResultFdRange = 0;
-#elif LINUX
-        // Only copies the part of the bit vector that I actually use.
-        // numBytes = sizeof(m_ReadSocks);
-        numBytes = (m_FdRange / 8);
-        if ((numBytes * 8) < m_FdRange) {
-           numBytes += 1;
-        }
-        ASSERT(numBytes <= (int32) sizeof(m_ReadSocks));
+    if (NULL == m_pIOUring) {
+        gotoErr(EFail);
+    }
 
-        memcpy(&m_ResultReadSocks, &m_ReadSocks, numBytes);
-        memcpy(&m_ResultWriteSocks, &m_WriteSocks, numBytes);
-        memcpy(&m_ResultExceptionSocks, &m_ExceptionSocks, numBytes);
-        m_ResultFdRange = m_FdRange;
-#endif
-        if (m_pLock) {
-            m_pLock->Unlock();
-        }
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = pBlockIO->m_Socket;
+    sqe.poll32_events = POLLOUT;
+    sqe.user_data = ((uint64) pBlockIO) | (((uint64) URING_CONNECT_OP) << URING_OP_SHIFT);
+    err = m_pIOUring->SubmitSQE(&sqe);
 
-        ASSERT_WIN32(m_ReadSocks.fd_count > 0);
-        ASSERT_WIN32(m_ResultReadSocks.fd_count > 0);
+abort:
+    returnErr(err);
+} // UringPollConnect.
 
-        // This is how often we check for timeouts. This is around 5 seconds.
-        // Reset the timeout interval before every select. Select on
-        // Linux seems to reset this, so we need to refresh the value.
-        timeoutInterval.tv_sec = 0; // seconds
-        timeoutInterval.tv_usec = SELECT_TIMEOUT_IN_MICROSECS; // microseconds
 
-        // Block until there is something to do.
-        numActiveSockets = select(
-                                m_ResultFdRange,
-                                &m_ResultReadSocks,
-                                &m_ResultWriteSocks,
-                                &m_ResultExceptionSocks,
-                                &timeoutInterval);
-        // Get the last error immediately after the system call.
-        // Anything code, even a DEBUG_LOG, may touch a file and
-        // change the last error.
-        lastErr = GET_LAST_ERROR();
 
-        // DEBUG_LOG("Return from select. m_ResultFdRange = %d, numActiveSockets = %d",  m_ResultFdRange, numActiveSockets);
 
-#if LINUX
-      // This happens when a process signal interrupts the system call.
-    	if (numActiveSockets == -1 && errno == EINTR) {
-            continue;
-    	}
-#endif
 
-        // After this point, if any other thread wants to change the
-        // global state, then they must send a new wake-up message.
-        // If a thread saw this was set between the time select() returned
-        // and we clear it, this is NOT a race condition. We clear it before
-        // we process any pending changes to the global state.
-        if (m_pLock) {
-            m_pLock->Lock();
-        }
 
-        m_fPendingWakeupMessage = false;
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UringPostAccept]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::UringPostAccept(CNetBlockIO *pBlockIO) {
+    ErrVal err = ENoErr;
+    struct io_uring_sqe sqe;
+    AutoLock(pBlockIO->m_pLock);
 
-        // If we are quitting the entire network server, then exit
-        // the main loop of the select thread as soon as we leave the lock.
-        if (m_StopSelectThread) {
-            fExitLoop = true;
-        }
+    if (NULL == m_pIOUring) {
+        gotoErr(EFail);
+    }
 
-        if (m_pLock) {
-            m_pLock->Unlock();
-        }
+    // Only one accept is posted at a time, so it is safe to keep the
+    // peer address in the listening blockIO.
+    pBlockIO->m_UringAddrLen = sizeof(struct sockaddr_in);
 
-        if (fExitLoop) {
-            break;
-        }
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = pBlockIO->m_Socket;
+    sqe.addr = (uint64) &(pBlockIO->m_UringAddr);
+    sqe.addr2 = (uint64) &(pBlockIO->m_UringAddrLen);
+    sqe.accept_flags = SOCK_NONBLOCK;
+    sqe.user_data = ((uint64) pBlockIO) | (((uint64) URING_ACCEPT_OP) << URING_OP_SHIFT);
 
-        // If there was an exception, then select failed. Often this
-        // means that an invalid socket is in the fd sets. This can
-        // happen if a socket is closed but not FD_CLR'ed. All we can
-        // do is raise a warning and adjust the connections in the hope
-        // that the offending connection has been cleared.
-        //
-        // This shouldn't happen and it usually means there is a bug.
-        if (numActiveSockets < 0) {
-            DEBUG_WARNING("Select returned an error. err = %d", lastErr);
+    // The ring holds a reference until the accept completes.
+    ADDREF_OBJECT(pBlockIO);
+    err = m_pIOUring->SubmitSQE(&sqe);
+    if (err) {
+        RELEASE_OBJECT(pBlockIO);
+        gotoErr(err);
+    }
 
-            // Sleep for a while to let other threads run long enough
-            // to close their sockets. Otherwise, this select becomes a
-            // busy loop.
-            OSIndependantLayer::SleepForMilliSecs(msSleepingForSelectError);
+abort:
+    returnErr(err);
+} // UringPostAccept.
 
-            // Adjust the connections, hopefully this will fix the problem.
-            AdjustBlockIOs();
 
-            continue;
-        } // handling a select error event.
 
-        // In Win32, if numActiveSockets is 0, then the FD_SET's may be invalid.
-        // In particular, the exception sockets is what we passed in, not what really
-        // has an exception.
-        if (0 == numActiveSockets) {
-            ASSERT_WIN32(0 == m_ResultReadSocks.fd_count);
-            ASSERT_WIN32(0 == m_ResultWriteSocks.fd_count);
-            ASSERT_WIN32(0 == m_ResultExceptionSocks.fd_count);
 
-            // Check for timeouts and try again.
-            AdjustBlockIOs();
-#if WIN32
-            continue;
-#endif
-        }
 
-        // As a special case, check if this is one of the sockets
-        // that is just designed to wake up the select thread.
-        if (FD_ISSET(m_WakeUpThreadReceive, &m_ResultReadSocks)) {
-            FD_CLR(m_WakeUpThreadReceive, &m_ResultReadSocks);
-            (void) DrainNotificationData(m_WakeUpThreadReceive);
-            numActiveSockets = numActiveSockets - 1;
-        }
 
-        if (numActiveSockets > 0) {
-            (void) ProcessActiveSockets();
-        } else {
-            ASSERT_WIN32(0 == m_ResultReadSocks.fd_count);
-            ASSERT_WIN32(0 == m_ResultWriteSocks.fd_count);
-            ASSERT_WIN32(0 == m_ResultExceptionSocks.fd_count);
-        }
+/////////////////////////////////////////////////////////////////////////////
+//
+// [UringCancel]
+//
+// This is called by DisconnectSocket just before it closes the socket. Any
+// operations still posted to the ring complete with an error and drop their
+// references.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::UringCancel(CNetBlockIO *pBlockIO) {
+    if ((NULL == m_pIOUring)
+        || (NULL_SOCKET == pBlockIO->m_Socket)) {
+        return;
+    }
 
-        ASSERT_WIN32(m_ReadSocks.fd_count > 0);
+    // Shutdown wakes up a posted recv or accept even on kernels that
+    // cannot cancel by file descriptor. A posted send waits until the peer
+    // reads, so also shut down the write side. The send then fails with
+    // EPIPE instead of keeping the blockIO alive. A posted connect is only
+    // cancelled by the ring, so on older kernels it holds its reference
+    // until the connect succeeds or the kernel gives up.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::URING_SEND_POSTED) {
+        (void) shutdown(pBlockIO->m_Socket, SHUT_RDWR);
+    } else {
+        (void) shutdown(pBlockIO->m_Socket, SHUT_RD);
+    }
 
-        // Always call this, even when there are no active sockets,
-        // since it implements timeouts.
-        AdjustBlockIOs();
-        ASSERT_WIN32(m_ReadSocks.fd_count > 0);
-    } // the main server loop.
+#if defined(IORING_ASYNC_CANCEL_FD) && defined(IORING_ASYNC_CANCEL_ALL)
+    {
+        struct io_uring_sqe sqe;
 
-    if (NULL != m_pSelectThreadStopped) {
-        m_pSelectThreadStopped->Signal();
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = pBlockIO->m_Socket;
+        sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe.user_data = ((uint64) URING_CANCEL_OP) << URING_OP_SHIFT;
+        (void) m_pIOUring->SubmitSQE(&sqe);
     }
-} // SelectThread.
+#endif
+} // UringCancel.
+#endif // USE_IO_URING
+#endif // USE_EPOLL_REACTOR
 
 
 
@@ -2901,13 +5688,13 @@ CNetIOSystem::SelectThread() {
 // This is called in the select thread when we detect activity on a socket.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::ProcessActiveSockets() {
+CNetIOSystem::ProcessActiveSockets(CNetReactor *pReactor) {
     ErrVal err = ENoErr;
     OSSocket currentSocket;
     CNetBlockIO *pBlockIO;
     int32 socketNum;
 
-    if (NULL == m_ActiveSocketTable) {
+    if (NULL == pReactor->m_pSocketTable) {
         gotoErr(EFail);
     }
 
@@ -2919,19 +5706,15 @@ CNetIOSystem::ProcessActiveSockets() {
     // all connections and determine if they are active (which
     // costs N*S).
     //////////////////////////////////////////////
-    for (socketNum = 0; (uint32) socketNum < m_ResultReadSocks.fd_count; socketNum++) {
-        currentSocket = (m_ResultReadSocks.fd_array)[ socketNum ];
+    for (socketNum = 0; (uint32) socketNum < pReactor->m_ResultReadSocks.fd_count; socketNum++) {
+        currentSocket = (pReactor->m_ResultReadSocks.fd_array)[ socketNum ];
 
         ////////////////////////////
-        if (m_pLock) {
-            m_pLock->Lock();
-        }
-        pBlockIO = (CNetBlockIO *) (m_ActiveSocketTable->GetValue(
+        pReactor->m_pLock->Lock();
+        pBlockIO = (CNetBlockIO *) (pReactor->m_pSocketTable->GetValue(
                                             (const char *) &currentSocket,
                                             sizeof(OSSocket)));
-        if (m_pLock) {
-            m_pLock->Unlock();
-        }
+        pReactor->m_pLock->Unlock();
         ////////////////////////////
 
         if (pBlockIO) {
@@ -2942,20 +5725,16 @@ CNetIOSystem::ProcessActiveSockets() {
 
 
     //////////////////////////////////////////////
-    for (socketNum = 0; (uint32) socketNum < m_ResultWriteSocks.fd_count; socketNum++) {
-        currentSocket = (m_ResultWriteSocks.fd_array)[ socketNum ];
+    for (socketNum = 0; (uint32) socketNum < pReactor->m_ResultWriteSocks.fd_count; socketNum++) {
+        currentSocket = (pReactor->m_ResultWriteSocks.fd_array)[ socketNum ];
 
         ////////////////////////////
-        if (m_pLock) {
-            m_pLock->Lock();
-        }
+        pReactor->m_pLock->Lock();
 
-        pBlockIO = (CNetBlockIO *) (m_ActiveSocketTable->GetValue(
+        pBlockIO = (CNetBlockIO *) (pReactor->m_pSocketTable->GetValue(
                                             (const char *) &currentSocket,
                                             sizeof(OSSocket)));
-        if (m_pLock) {
-            m_pLock->Unlock();
-        }
+        pReactor->m_pLock->Unlock();
         ////////////////////////////
 
         if (pBlockIO) {
@@ -2966,19 +5745,15 @@ CNetIOSystem::ProcessActiveSockets() {
 
 
     //////////////////////////////////////////////
-    for (socketNum = 0; (uint32) socketNum < m_ResultExceptionSocks.fd_count; socketNum++) {
-        currentSocket = (m_ResultExceptionSocks.fd_array)[ socketNum ];
+    for (socketNum = 0; (uint32) socketNum < pReactor->m_ResultExceptionSocks.fd_count; socketNum++) {
+        currentSocket = (pReactor->m_ResultExceptionSocks.fd_array)[ socketNum ];
 
         ////////////////////////////
-        if (m_pLock) {
-            m_pLock->Lock();
-        }
-        pBlockIO = (CNetBlockIO *) (m_ActiveSocketTable->GetValue(
+        pReactor->m_pLock->Lock();
+        pBlockIO = (CNetBlockIO *) (pReactor->m_pSocketTable->GetValue(
                                             (const char *) &currentSocket,
                                             sizeof(OSSocket)));
-        if (m_pLock) {
-            m_pLock->Unlock();
-        }
+        pReactor->m_pLock->Unlock();
         ////////////////////////////
 
         if (pBlockIO) {
@@ -3000,24 +5775,31 @@ abort:
 // This is called in the select thread when we detect activity on a socket.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::ProcessActiveSockets() {
+CNetIOSystem::ProcessActiveSockets(CNetReactor *pReactor) {
     ErrVal err = ENoErr;
     OSSocket currentSocket;
     CNetBlockIO *pBlockIO;
     CNetBlockIO *pNextBlockIO;
 
-    pBlockIO = (CNetBlockIO *) m_ActiveBlockIOs.GetHead();
+    // Only this thread removes blockIOs from the reactor list, so we only
+    // need the lock to follow the links, not while we process a socket.
+    // Otherwise, we would take a blockIO lock while holding the reactor lock.
+    pReactor->m_pLock->Lock();
+    pBlockIO = pReactor->m_BlockIOs.GetHead();
+    pReactor->m_pLock->Unlock();
     while (NULL != pBlockIO) {
-        pNextBlockIO = (CNetBlockIO *) (pBlockIO->m_ActiveBlockIOs.GetNextInQueue());
+        pReactor->m_pLock->Lock();
+        pNextBlockIO = pBlockIO->m_ReactorBlockIOs.GetNextInQueue();
+        pReactor->m_pLock->Unlock();
         currentSocket = pBlockIO->m_Socket;
 
-        if (FD_ISSET(currentSocket, &m_ResultReadSocks)) {
+        if (FD_ISSET(currentSocket, &pReactor->m_ResultReadSocks)) {
             ProcessReadEvent(pBlockIO);
         }
-        if (FD_ISSET(currentSocket, &m_ResultWriteSocks)) {
+        if (FD_ISSET(currentSocket, &pReactor->m_ResultWriteSocks)) {
             ProcessWriteEvent(pBlockIO);
         }
-        if (FD_ISSET(currentSocket, &m_ResultExceptionSocks)) {
+        if (FD_ISSET(currentSocket, &pReactor->m_ResultExceptionSocks)) {
            ProcessExceptionEvent(pBlockIO);
         }
 
@@ -3039,27 +5821,20 @@ CNetIOSystem::ProcessActiveSockets() {
 //
 // This does several things:
 //
-//   1. Check for timeouts
-//   2. Deletes doomed connections
+//   1. Deletes doomed connections
+//   2. Fires timers, including blockIO timeouts
 /////////////////////////////////////////////////////////////////////////////
 void
-CNetIOSystem::AdjustBlockIOs() {
-    uint64 now = 0;
+CNetIOSystem::AdjustBlockIOs(CNetReactor *pReactor) {
     CNetBlockIO *pBlockIO;
-    int socketNum;
-    uint64 timeSinceLastCheck;
-    CAsyncBlockIO * connectionList[MAX_TIMEOUTS_PER_CHECK];
-    int32 timeOutList[MAX_TIMEOUTS_PER_CHECK];
-    int numTimeouts = 0;
-    int32 timeoutOp;
 
     // We always do this. This only checks the queue of pending-close
     // sockets, not all sockets, so it is not expensive.
-    if (m_pLock) {
+    if (pReactor->m_pLock) {
         while (true) {
-            m_pLock->Lock();
-            pBlockIO = m_PendingCloseList.RemoveHead();
-            m_pLock->Unlock();
+            pReactor->m_pLock->Lock();
+            pBlockIO = pReactor->m_PendingCloseList.RemoveHead();
+            pReactor->m_pLock->Unlock();
 
             if (NULL == pBlockIO) {
                 break;
@@ -3072,88 +5847,133 @@ CNetIOSystem::AdjustBlockIOs() {
             RELEASE_OBJECT(pBlockIO);
         }
 
-        m_pLock->Lock();
-        if (m_pEmptyPendingCloseBlockIOs) {
-            m_pEmptyPendingCloseBlockIOs->Signal();
+        pReactor->m_pLock->Lock();
+        if (pReactor->m_pEmptyPendingCloseBlockIOs) {
+            pReactor->m_pEmptyPendingCloseBlockIOs->Signal();
         }
-        m_pLock->Unlock();
-    } // if (m_pLock)
+        pReactor->m_pLock->Unlock();
+    } // if (pReactor->m_pLock)
+
+
+    // Fire any timers that have expired. This only looks at timers that
+    // are actually due, not all sockets, so it is not expensive either.
+    (void) pReactor->m_TimerWheel.FireExpiredTimers(GetTimeSinceBootInMs());
+} // AdjustBlockIOs.
+
+
+
+
 
 
-    // Select may be going off a lot when there is a lot of network activity.
-    // Don't check for timeouts too often. It's not a cheap operation, and
-    // it doesn't have to be done that frequently.
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetReactorWaitTime]
+//
+// This decides how long a reactor thread may sleep. It also records when
+// the reactor will wake up, so StartTimer knows whether it has to wake the
+// reactor for a new timer.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CNetIOSystem::GetReactorWaitTime(CNetReactor *pReactor) {
+    int32 waitTimeInMs = SELECT_TIMEOUT_IN_MS;
+    int32 msUntilNextTimer;
+    uint64 now;
+    AutoLock(pReactor->m_pLock);
+
     now = GetTimeSinceBootInMs();
-    timeSinceLastCheck = now - m_PrevCheckForTimeoutsTime;
+    msUntilNextTimer = pReactor->m_TimerWheel.GetMsUntilNextTimer(now);
+    if ((msUntilNextTimer >= 0) && (msUntilNextTimer < waitTimeInMs)) {
+        waitTimeInMs = msUntilNextTimer;
+    }
 
-    if (timeSinceLastCheck < SELECT_TIMEOUT_IN_MS) {
-        return;
+    pReactor->m_WaitDeadline = now + waitTimeInMs;
+    return(waitTimeInMs);
+} // GetReactorWaitTime.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FireTimeout]
+//
+// This runs on the reactor thread when the timeout timer of a blockIO fires.
+/////////////////////////////////////////////////////////////////////////////
+void
+CNetIOSystem::FireTimeout(CNetBlockIO *pBlockIO, int32 timeoutOp) {
+    if (CIOBuffer::WRITE == timeoutOp) {
+        // Remove the socket. Once we timeout, we cannot report
+        // any additional activity.
+        UnwatchSocket(pBlockIO, WRITE_EVENTS | EXCEPTION_EVENTS);
+
+        DEBUG_LOG("CNetIOSystem::FireTimeout. ENoResponse for a write on pBlockIO %p", pBlockIO);
+        ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::WRITE);
     }
-    m_PrevCheckForTimeoutsTime = now;
+    if (CIOBuffer::READ == timeoutOp) {
+        // Remove the socket. Once we timeout, we cannot report
+        // any additional activity.
+        UnwatchSocket(pBlockIO, ALL_SOCKET_EVENTS);
 
-    /////////////////////////////////////////////////
-    // Make a private list of all blockIOs that should timeout.
-    {
-        AutoLock(m_pLock);
-
-        pBlockIO = (CNetBlockIO *) m_ActiveBlockIOs.GetHead();
-        numTimeouts = 0;
-        while ((numTimeouts < MAX_TIMEOUTS_PER_CHECK) && (pBlockIO)) {
-            if (pBlockIO->CheckTimeout(timeSinceLastCheck, &timeoutOp)) {
-                ADDREF_OBJECT(pBlockIO);
-                connectionList[numTimeouts] = pBlockIO;
-                timeOutList[numTimeouts] = timeoutOp;
-                numTimeouts += 1;
-            }
+        DEBUG_LOG("CNetIOSystem::FireTimeout. ENoResponse for a read on pBlockIO %p", pBlockIO);
+        ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::READ);
+    }
+    if (CIOBuffer::IO_CONNECT == timeoutOp) {
+        // Remove the socket. Once we timeout, we cannot report
+        // any additional activity.
+        UnwatchSocket(pBlockIO, ALL_SOCKET_EVENTS);
 
-            pBlockIO = (CNetBlockIO *) (pBlockIO->m_ActiveBlockIOs.GetNextInQueue());
-        }
+        DEBUG_LOG("CNetIOSystem::FireTimeout. ENoResponse for a connect on pBlockIO %p", pBlockIO);
+        ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::IO_CONNECT);
     }
-    /////////////////////////////////////////////////
+} // FireTimeout.
 
 
-    for (socketNum = 0; socketNum < numTimeouts; socketNum++) {
-        pBlockIO = (CNetBlockIO *) (connectionList[socketNum]);
-        timeoutOp = timeOutList[socketNum];
-        if (!pBlockIO) {
-            continue;
-        }
 
-        // Fire a timeout.
-        if (CIOBuffer::WRITE == timeoutOp) {
-            // Remove the socket. Once we timeout, we cannot report
-            // any additional activity.
-            FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-            FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
 
-            DEBUG_LOG("CNetIOSystem::AdjustBlockIOs. ENoResponse for a write on pBlockIO %p", pBlockIO);
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::WRITE);
-        }
-        if (CIOBuffer::READ == timeoutOp) {
-            // Remove the socket. Once we timeout, we cannot report
-            // any additional activity.
-            FD_CLR(pBlockIO->m_Socket, &m_ReadSocks);
-            FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-            FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
 
-            DEBUG_LOG("CNetIOSystem::AdjustBlockIOs. ENoResponse for a read on pBlockIO %p", pBlockIO);
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::READ);
-        }
-        if (CIOBuffer::IO_CONNECT == timeoutOp) {
-            // Remove the socket. Once we timeout, we cannot report
-            // any additional activity.
-            FD_CLR(pBlockIO->m_Socket, &m_ReadSocks);
-            FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-            FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
 
-            DEBUG_LOG("CNetIOSystem::AdjustBlockIOs. ENoResponse for a connect on pBlockIO %p", pBlockIO);
-            ReportSocketIsActive(pBlockIO, ENoResponse, CIOBuffer::IO_CONNECT);
-        }
+/////////////////////////////////////////////////////////////////////////////
+//
+// [StartTimer]
+//
+// This arms a general purpose timer. Timers are spread across the reactor
+// threads, and the callback runs on that reactor thread, so it must not
+// block.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::StartTimer(CTimer *pTimer, int32 delayInMs) {
+    ErrVal err = ENoErr;
+    CNetReactor *pReactor = NULL;
+    bool fWakeReactor = false;
 
-        // BlockIO's were AddRef'ed by GetActiveBlockIOs.
-        RELEASE_OBJECT(pBlockIO);
-    } // finding sockets with activity.
-} // AdjustBlockIOs.
+    if ((NULL == pTimer) || (delayInMs < 0)) {
+        gotoErr(EInvalidArg);
+    }
+    if ((NULL == m_pReactorList) || (m_NumReactors <= 0)) {
+        gotoErr(EFail);
+    }
+
+    pReactor = PickReactor();
+
+    // Hold the reactor lock so we either arm the timer before the
+    // reactor decides how long to sleep, or else see its new deadline.
+    pReactor->m_pLock->Lock();
+    err = pReactor->m_TimerWheel.AddTimer(pTimer, delayInMs);
+    if ((!err)
+        && ((GetTimeSinceBootInMs() + delayInMs) < pReactor->m_WaitDeadline)) {
+        fWakeReactor = true;
+    }
+    pReactor->m_pLock->Unlock();
+
+    if (fWakeReactor) {
+        (void) WakeSelectThread(pReactor);
+    }
+
+abort:
+    returnErr(err);
+} // StartTimer.
 
 
 
@@ -3169,15 +5989,19 @@ void
 CNetIOSystem::AcceptConnection(
                     CNetBlockIO *serverConnection,
                     OSSocket socketID,
-                    struct sockaddr_in *netAddr) {
+                    struct sockaddr_in *netAddr,
+                    bool fIsNonBlocking) {
     ErrVal err = ENoErr;
     CParsedUrl *pUrl = NULL;
     CNetBlockIO *pBlockIO = NULL;
+    CNetReactor *pReactor = NULL;
     CAsyncBlockIOCallback *pCallback = NULL;
 #if WIN32
     BOOL result = 0;
-    int off = 0;
+#else
+    int result = 0;
 #endif // WIN32
+    int on = 1;
     RunChecks();
 
     DEBUG_LOG("CNetIOSystem::AcceptConnection()");
@@ -3201,9 +6025,11 @@ CNetIOSystem::AcceptConnection(
     *(pUrl->m_pSockAddr) = *netAddr;
 
 
-    err = MakeSocketNonBlocking(socketID);
-    if (err) {
-        gotoErr(err);
+    if (!fIsNonBlocking) {
+        err = MakeSocketNonBlocking(socketID);
+        if (err) {
+            gotoErr(err);
+        }
     }
 
     // Set the read and write buffers.
@@ -3217,32 +6043,30 @@ CNetIOSystem::AcceptConnection(
     }
 
 
-    // Turn off Nagle's algorithm. This causes packets to be sent
-    // immediately, rather than being buffered first on the local
-    // host to group them into larger packets. We do the buffering,
-    // so Nagle's algorithm would just get in the way. Normally,
-    // this defaults to off, but the winsock 1.1 and 2.0 specs let
-    // each winsock implementation decide what to default it to.
-    // It seems that NODELAY is only in Linux versions Linux 2.5.71
-    // and later, so it is not portable.
-#if WIN32
+    // Turn off Nagle's algorithm, as OpenBlockIO does for the other end.
     result = setsockopt(
                   socketID,
                   IPPROTO_TCP,
                   TCP_NODELAY,
-                  (const char *) &off,
-                  sizeof(off));
+                  (const char *) &on,
+                  sizeof(on));
     if (result < 0) {
         gotoErr(EFail);
     }
-#endif
 
     // Use the connection BlockIO callback to report the
     // new connection. This will probably be changed so each
     // blockIO has its own callback.
     pCallback = serverConnection->GetBlockIOCallback();
 
-    pBlockIO = AllocNetBlockIO(pUrl, socketID, 0, pCallback);
+    // A connection accepted by one of several listeners on a port stays on
+    // that listener's reactor. The kernel already spread the connections
+    // over the listeners.
+    if (serverConnection->m_BlockIOFlags & CNetBlockIO::REUSEPORT_LISTENER) {
+        pReactor = serverConnection->m_pReactor;
+    }
+
+    pBlockIO = AllocNetBlockIO(pUrl, socketID, 0, pCallback, pReactor);
     if (!pBlockIO) {
         DEBUG_LOG("CNetIOSystem::AcceptConnection. AllocNetBlockIO() failed");
         gotoErr(ETooManySockets);
@@ -3297,6 +6121,7 @@ CNetIOSystem::ProcessReadEvent(CNetBlockIO *pBlockIO) {
     socklen_t fAddrLength;
     struct sockaddr_in newClientAddress;
     OSSocket newSocket;
+    int32 numAccepted;
     AutoLock(pBlockIO->m_pLock);
 
 
@@ -3308,24 +6133,50 @@ CNetIOSystem::ProcessReadEvent(CNetBlockIO *pBlockIO) {
     }
 
     if (pBlockIO->m_BlockIOFlags & CNetBlockIO::ACCEPT_INCOMING_CONNECTIONS) {
-        // Accept the message, creating a new socket and establishing
-        // the pBlockIO with the remote client.
-        fAddrLength = sizeof(struct sockaddr_in);
-        newSocket = accept(
-                       pBlockIO->m_Socket,
-                       (struct sockaddr*) &newClientAddress,
-                       &fAddrLength);
-
-        DEBUG_LOG("CNetIOSystem::ProcessReadEvent. accepted a socket %d",
-                    newSocket);
-
-        // Once we have a new pBlockIO, initialize it.
-        if (newSocket > 0) {
-           AcceptConnection(pBlockIO, newSocket, &newClientAddress);
+        // Accept every connection that is waiting, creating a new socket
+        // and establishing a pBlockIO with each remote client. One
+        // readiness event may stand for a whole burst of connections.
+        for (numAccepted = 0; numAccepted < CNetBlockIO::MAX_ACCEPTS_PER_EVENT; numAccepted++) {
+            fAddrLength = sizeof(struct sockaddr_in);
+#if LINUX
+            newSocket = accept4(
+                           pBlockIO->m_Socket,
+                           (struct sockaddr*) &newClientAddress,
+                           &fAddrLength,
+                           SOCK_NONBLOCK);
+#else
+            newSocket = accept(
+                           pBlockIO->m_Socket,
+                           (struct sockaddr*) &newClientAddress,
+                           &fAddrLength);
+#endif
+            if ((NULL_SOCKET == newSocket) || (newSocket <= 0)) {
+                break;
+            }
+
+            DEBUG_LOG("CNetIOSystem::ProcessReadEvent. accepted a socket %d",
+                        newSocket);
+
+            // Once we have a new pBlockIO, initialize it.
+#if LINUX
+            AcceptConnection(pBlockIO, newSocket, &newClientAddress, true);
+#else
+            AcceptConnection(pBlockIO, newSocket, &newClientAddress, false);
+#endif
+        } // for (numAccepted = 0; ...)
+
+        if (numAccepted > 0) {
            return;
         }
      } // processing a pBlockIO on a listener socket.
 
+    // A failed connect is readable as well as writable. Leave it to
+    // ProcessWriteEvent, which runs next, because a read here would
+    // consume the socket error that says why the connect failed.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::WAITING_TO_CONNECT) {
+        return;
+    }
+
     // If we just reported valid activity, then don't timeout.
     // IMPORTANT. Do this before we wake up the thread. Otherwise,
     // in a race codnition, we could clobber the state of the
@@ -3338,6 +6189,20 @@ CNetIOSystem::ProcessReadEvent(CNetBlockIO *pBlockIO) {
         goto abort;
     }
 
+#if USE_BATCHED_DATAGRAMS
+    // Drain a whole batch of datagrams with one system call.
+    if (pBlockIO->m_BlockIOFlags & CNetBlockIO::UDP_SOCKET) {
+        err = pBlockIO->DoPendingDatagramReads();
+        if (EEOF == err) {
+            DEBUG_LOG("CNetIOSystem::ProcessReadEvent. Hit EOF. PrepareToDisconnect(%d)",
+                        pBlockIO->m_Socket);
+            (void) pBlockIO->PrepareToDisconnect();
+            err = ENoErr;
+        }
+        gotoErr(err);
+    }
+#endif // USE_BATCHED_DATAGRAMS
+
     // This loop iterates as long as we are reading full buffers of data.
     while (1) {
         RELEASE_OBJECT(pBuffer);
@@ -3416,6 +6281,69 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetConnectResult]
+//
+// This returns 0 if a connect worked, or else the negative errno.
+// That is also how the ring reports a connect. A connect that has not
+// finished yet returns -ENOTCONN.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CNetIOSystem::GetConnectResult(OSSocket sock) {
+    int socketErr = 0;
+    socklen_t errLength = sizeof(socketErr);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *) &socketErr, &errLength) < 0) {
+        return(-GET_LAST_ERROR());
+    }
+#if LINUX
+    // No error may also mean the connect has not finished.
+    if (0 == socketErr) {
+        struct sockaddr_in peerAddr;
+        socklen_t peerAddrLength = sizeof(peerAddr);
+
+        if (getpeername(sock, (struct sockaddr *) &peerAddr, &peerAddrLength) < 0) {
+            return(-GET_LAST_ERROR());
+        }
+    }
+#endif
+    return(-socketErr);
+} // GetConnectResult.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TranslateConnectError]
+//
+// This turns the negative errno of a failed connect into the error we
+// report to the callback.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CNetIOSystem::TranslateConnectError(int32 result) {
+    int32 lastErr = -result;
+
+    if (0 == result) {
+        return(ENoErr);
+    }
+    if (IO_REFUSED_ERROR(lastErr)) {
+        return(EPeerDisconnected);
+    }
+    if (IO_UNREACHABLE_ERROR(lastErr)) {
+        return(ENoHostAddress);
+    }
+    return(ENoResponse);
+} // TranslateConnectError.
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [ProcessWriteEvent]
@@ -3426,6 +6354,7 @@ CNetIOSystem::ProcessWriteEvent(CNetBlockIO *pBlockIO) {
     ErrVal err = ENoErr;
     CIOBuffer *pBuffer = NULL;
     bool fFinished = false;
+    int32 connectResult;
     AutoLock(pBlockIO->m_pLock);
 
     if ((NULL == pBlockIO)
@@ -3444,25 +6373,41 @@ CNetIOSystem::ProcessWriteEvent(CNetBlockIO *pBlockIO) {
     // on a read after blocking on a connect and do a second FD_SET
     // before we finish doing the first FD_CLR. Then, the first FD_CLR
     // clobbers the second FD_SET.
-    if (m_pLock) {
-        m_pLock->Lock();
-    }
-    FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-    FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
-
-    if (m_pLock) {
-        m_pLock->Unlock();
-    }
+    UnwatchSocket(pBlockIO, WRITE_EVENTS | EXCEPTION_EVENTS);
 
 
     if (pBlockIO->m_BlockIOFlags & CNetBlockIO::WAITING_TO_CONNECT) {
-        DEBUG_LOG("CNetIOSystem::ProcessWriteEvent. Finished connecting (%d)",
-                    pBlockIO->m_Socket);
+        // A refused connect is also writable, so check how it ended.
+        // We watch the socket before we call connect(), and Linux says
+        // a socket that is not yet connecting is writable too. Then just
+        // keep waiting.
+        connectResult = GetConnectResult(pBlockIO->m_Socket);
+        if ((connectResult < 0) && (IO_NOT_CONNECTED_ERROR(-connectResult))) {
+            WatchSocket(pBlockIO, WRITE_EVENTS | EXCEPTION_EVENTS);
+            return;
+        }
+
+        DEBUG_LOG("CNetIOSystem::ProcessWriteEvent. Finished connecting (%d), result = %d",
+                    pBlockIO->m_Socket, connectResult);
 
         pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_CONNECT;
-        ReportSocketIsActive(pBlockIO, ENoErr, CIOBuffer::IO_CONNECT);
+        ReportSocketIsActive(
+                pBlockIO,
+                TranslateConnectError(connectResult),
+                CIOBuffer::IO_CONNECT);
+        return;
+    }
+
+#if USE_VECTORED_WRITES
+    // Resume the whole chain of pending writes. We just stopped
+    // listening for writes, so SendWriteChain starts again if the socket
+    // fills up before the chain is sent.
+    if (pBlockIO->UsesWriteChain()) {
+        pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_WRITE;
+        pBlockIO->SendWriteChain();
         return;
     }
+#endif // USE_VECTORED_WRITES
 
     // If the block IO is synchronously waiting for this event,
     // then signal it.
@@ -3486,8 +6431,8 @@ CNetIOSystem::ProcessWriteEvent(CNetBlockIO *pBlockIO) {
     }
 
     if (fFinished) {
-        if (m_pLock) {
-            m_pLock->Lock();
+        if (pBlockIO->m_pReactor) {
+            pBlockIO->m_pReactor->m_pLock->Lock();
         }
 
         // Don't select on this again until the pBlockIO is waiting for another
@@ -3499,12 +6444,12 @@ CNetIOSystem::ProcessWriteEvent(CNetBlockIO *pBlockIO) {
         // on a read after blocking on a connect and do a second FD_SET
         // before we finish doing the first FD_CLR. Then, the first FD_CLR
         // clobbers the second FD_SET.
-        FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
+        UnwatchSocket(pBlockIO, WRITE_EVENTS);
 
         pBlockIO->m_BlockIOFlags &= ~CNetBlockIO::WAITING_TO_WRITE;
 
-        if (m_pLock) {
-            m_pLock->Unlock();
+        if (pBlockIO->m_pReactor) {
+            pBlockIO->m_pReactor->m_pLock->Unlock();
         }
 
         // Tell the caller that the buffer I/O is complete.
@@ -3559,15 +6504,7 @@ CNetIOSystem::ProcessExceptionEvent(CNetBlockIO *pBlockIO) {
     // on a read after blocking on a connect and do a second FD_SET
     // before we finish doing the first FD_CLR. Then, the first FD_CLR
     // clobbers the second FD_SET.
-    if (m_pLock) {
-        m_pLock->Lock();
-    }
-    FD_CLR(pBlockIO->m_Socket, &m_WriteSocks);
-    FD_CLR(pBlockIO->m_Socket, &m_ExceptionSocks);
-
-    if (m_pLock) {
-        m_pLock->Unlock();
-    }
+    UnwatchSocket(pBlockIO, WRITE_EVENTS | EXCEPTION_EVENTS);
 
 
     oldFlags = pBlockIO->m_BlockIOFlags;
@@ -3644,10 +6581,17 @@ abort:
 //
 // [DrainNotificationData]
 //
+// This reads all wake-up messages, and then clears the pending wake-up flag.
+// After this point, if any other thread wants to change the state of the
+// reactor, then they must send a new wake-up message. The flag must not be
+// cleared before the socket is drained. Otherwise, a message sent in between
+// would be read along with the old one, the flag would stay set with nothing
+// on the socket, and every later wake-up would be skipped.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::DrainNotificationData(OSSocket sock) {
+CNetIOSystem::DrainNotificationData(CNetReactor *pReactor) {
     ErrVal err = ENoErr;
+    OSSocket sock = pReactor->m_WakeUpThreadReceive;
     int32 bytesRead;
     char temp[256];
     int32 maxBytesToRead = sizeof(temp);
@@ -3707,6 +6651,14 @@ CNetIOSystem::DrainNotificationData(OSSocket sock) {
     } // trying to read data.
 
 abort:
+    if (pReactor->m_pLock) {
+        pReactor->m_pLock->Lock();
+    }
+    pReactor->m_fPendingWakeupMessage = false;
+    if (pReactor->m_pLock) {
+        pReactor->m_pLock->Unlock();
+    }
+
     returnErr(err);
 } // DrainNotificationData.
 
@@ -3720,7 +6672,7 @@ abort:
 //
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CNetIOSystem::WakeSelectThread() {
+CNetIOSystem::WakeSelectThread(CNetReactor *pReactor) {
     ErrVal err = ENoErr;
     int32 numBytesSent;
     char *dataPtr;
@@ -3734,15 +6686,15 @@ CNetIOSystem::WakeSelectThread() {
     // do it again. The select thread hasn't done any work yet, and
     // many wake-ups will only create unnecessary reads and writes
     // on the wake-up socket.
-    if (m_pLock) {
-        m_pLock->Lock();
+    if (pReactor->m_pLock) {
+        pReactor->m_pLock->Lock();
     }
 
-    fPendingWakeupMessage = m_fPendingWakeupMessage;
-    m_fPendingWakeupMessage = true;
+    fPendingWakeupMessage = pReactor->m_fPendingWakeupMessage;
+    pReactor->m_fPendingWakeupMessage = true;
 
-    if (m_pLock) {
-        m_pLock->Unlock();
+    if (pReactor->m_pLock) {
+        pReactor->m_pLock->Unlock();
     }
 
     if (fPendingWakeupMessage) {
@@ -3750,7 +6702,7 @@ CNetIOSystem::WakeSelectThread() {
     }
 
 
-    if (NULL_SOCKET == m_WakeUpThreadSend) {
+    if (NULL_SOCKET == pReactor->m_WakeUpThreadSend) {
         returnErr(EFail);
     }
 
@@ -3763,7 +6715,7 @@ CNetIOSystem::WakeSelectThread() {
 
     while (bufferSize > 0) {
         // Write all of the bytes that are currently in the buffer.
-        numBytesSent = send(m_WakeUpThreadSend, dataPtr, (int) bufferSize, 0);
+        numBytesSent = send(pReactor->m_WakeUpThreadSend, dataPtr, (int) bufferSize, 0);
         // Get the last error immediately after the system call.
         // Anything code, even a DEBUG_LOG, may touch a file and
         // change the last error.
@@ -55,6 +55,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
@@ -1476,6 +1477,9 @@ CSimpleFile::OpenExistingFile(
         shareOptions = 0;
     }
     dwOpenOptions = 0; // FILE_FLAG_RANDOM_ACCESS;
+    if (flags & DIRECT_IO) {
+        dwOpenOptions |= FILE_FLAG_NO_BUFFERING;
+    }
 
     // Convert from UTF-8 to UTF16 here.
     err = unicodeStr.ConvertUTF8String(pFileName, -1);
@@ -1521,6 +1525,9 @@ CSimpleFile::OpenExistingFile(
     } else {
         openFlags |= O_RDWR;
     } 
+    if (flags & DIRECT_IO) {
+        openFlags |= O_DIRECT;
+    }
 
     m_FileHandle = open(pFileName, openFlags, 00700);
     if (m_FileHandle < 0) {
@@ -1578,6 +1585,9 @@ CSimpleFile::OpenOrCreateFile(const char *pFileName, int32 flags) {
         shareOptions = 0;
     }
     dwOpenOptions = 0;
+    if (flags & DIRECT_IO) {
+        dwOpenOptions |= FILE_FLAG_NO_BUFFERING;
+    }
 
     // Convert from UTF-8 to UTF16 here.
     err = unicodeStr.ConvertUTF8String(pFileName, -1);
@@ -1621,6 +1631,9 @@ CSimpleFile::OpenOrCreateFile(const char *pFileName, int32 flags) {
     } else {
         openFlags |= O_RDWR;
     } 
+    if (flags & DIRECT_IO) {
+        openFlags |= O_DIRECT;
+    }
 
     m_FileHandle = open(pFileName, openFlags, 00700);
     if (m_FileHandle < 0) {
@@ -2843,15 +2856,36 @@ CDirFileList::GetNextFile(char *pFileName, int32 maxPath) {
 //
 // [GetCurrentThreadId]
 //
+// On Linux, getpid() is the same for every thread in the process, so this
+// returns the kernel thread id instead. Each thread caches its id. A child
+// process after fork() has a new id, so the fork handler clears the cache
+// of the one thread that is copied into the child.
 /////////////////////////////////////////////////////////////////////////////
+#if LINUX
+static __thread int32 g_CurrentThreadId = 0;
+static pthread_once_t g_ThreadIdForkHandlerOnce = PTHREAD_ONCE_INIT;
+
+static void
+ClearThreadIdInForkedChild() {
+    g_CurrentThreadId = 0;
+}
+
+static void
+InstallThreadIdForkHandler() {
+    (void) pthread_atfork(NULL, NULL, ClearThreadIdInForkedChild);
+}
+#endif
+
 int32
 OSIndependantLayer::GetCurrentThreadId() {
 #if WIN32
     return(::GetCurrentThreadId());
 #elif LINUX
-    //pthread_t self;
-    //self = pthread_self();
-    return(getpid());
+    if (0 == g_CurrentThreadId) {
+        (void) pthread_once(&g_ThreadIdForkHandlerOnce, InstallThreadIdForkHandler);
+        g_CurrentThreadId = (int32) syscall(SYS_gettid);
+    }
+    return(g_CurrentThreadId);
 #endif
 } // GetCurrentThreadId
 
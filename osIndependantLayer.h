@@ -473,6 +473,9 @@ public:
         SHARE_WRITE         = 0x0002,
         EXCLUSIVE_ACCESS    = 0x0004,
         EXPECT_TO_FIND_FILE = 0x0008,
+        // Bypass the OS cache. Every IO must then use aligned buffers,
+        // file positions and lengths.
+        DIRECT_IO           = 0x0010,
 
         // Common Options
         RECURSIVE           = 0x0100,
@@ -178,6 +178,60 @@ static char g_DumpFileName[1024];
 static CAsyncIOEventHandlerSynch *g_pTestCallback = NULL;
 
 static void TestOneURL(const char *urlStr, int32 *pResultSize);
+static ErrVal TestConnectionPool();
+static ErrVal RunPoolTestRequest(CParsedUrl *pUrl);
+
+#define POOL_TEST_MAX_CONNECTIONS       8
+#define POOL_TEST_BODY                  "hello"
+
+static const char g_PoolTestResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 5\r\n"
+    "\r\n"
+    POOL_TEST_BODY;
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is a tiny loopback HTTP server for the connection pool test. It
+// answers every request with g_PoolTestResponse and keeps each connection
+// open, so it counts how many connections the client really made.
+/////////////////////////////////////////////////////////////////////////////
+class CPoolTestServer : public CAsyncBlockIOCallback,
+                        public CRefCountImpl {
+public:
+    CPoolTestServer();
+    virtual ~CPoolTestServer();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+    void CloseConnections();
+
+    // CAsyncBlockIOCallback
+    virtual void OnBlockIOEvent(CIOBuffer *pBuffer);
+    virtual void OnBlockIOOpen(ErrVal err, CAsyncBlockIO *pBlockIO) { err = err; pBlockIO = pBlockIO; }
+    virtual void OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    int32               m_NumAccepts;
+    int32               m_NumRequests;
+
+    // This closes the connection that carries the next request instead
+    // of answering it, like a server that times out an idle connection
+    // just as the client reuses it.
+    bool                m_fDropNextRequest;
+
+private:
+    CRefLock            *m_pLock;
+    CAsyncBlockIO       *m_BlockIOList[POOL_TEST_MAX_CONNECTIONS];
+
+    // This is how much of the blank line at the end of a request header
+    // each connection has seen.
+    int32               m_NumEndBytesSeen[POOL_TEST_MAX_CONNECTIONS];
+}; // CPoolTestServer
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -210,6 +264,9 @@ CPolyHttpStream::TestHTTPStream() {
     g_pNetIOSystem->SetDebugFlags(CDebugObject::CHECK_STATE_ON_EVERY_OP);
     DontCountAllCurrentAllocations();
 
+    g_DebugManager.StartTest("Reuse idle connections");
+    (void) TestConnectionPool();
+
     ////////////////////////////////////////
     for (index = 0; ; index++) {
         test = g_TestURLList[index];
@@ -378,5 +435,387 @@ abort:
 } // TestOneURL.
 
 
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestConnectionPool]
+//
+// Requests from different streams to the same host should share one
+// connection through the idle pool. If the server closes a pooled
+// connection just as it is reused, the request is sent again on a new one.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+TestConnectionPool() {
+    ErrVal err = ENoErr;
+    CPoolTestServer *pServer = NULL;
+    CAsyncBlockIO *pListenBlockIO = NULL;
+    CParsedUrl *pUrl = NULL;
+    char urlBuffer[CParsedUrl::MAX_URL_LENGTH];
+    uint16 portNum = 0;
+
+    // A proxy would carry these requests instead of the loopback server.
+    if (NetIO_GetLocalProxySettings(NULL, NULL)) {
+        return(ENoErr);
+    }
+
+    pServer = newex CPoolTestServer;
+    if (NULL == pServer) {
+        gotoErr(EFail);
+    }
+    err = pServer->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    // The server closes connections first, which leaves their port in
+    // TIME_WAIT, so let the system pick a new port each time.
+    err = NetIO_OpenServerBlockIO(
+                    0, // portNum
+                    true, // fUse127001Address
+                    pServer,
+                    &pListenBlockIO);
+    if (!err) {
+        err = NetIO_GetServerPort(pListenBlockIO, &portNum);
+    }
+    if (err) {
+        DEBUG_WARNING("Cannot open a loopback server.");
+        gotoErr(err);
+    }
+
+    snprintf(urlBuffer, sizeof(urlBuffer), "http://127.0.0.1:%d/pool", portNum);
+    pUrl = CParsedUrl::AllocateUrl(urlBuffer);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    // The second request comes from a new stream, so it can only
+    // avoid a new connection by taking the first one from the pool.
+    err = RunPoolTestRequest(pUrl);
+    if (err) {
+        gotoErr(err);
+    }
+    err = RunPoolTestRequest(pUrl);
+    if (err) {
+        gotoErr(err);
+    }
+    if ((1 != pServer->m_NumAccepts) || (2 != pServer->m_NumRequests)) {
+        DEBUG_WARNING("The second request did not reuse the pooled connection.");
+        gotoErr(EFail);
+    }
+
+    // The server closes the pooled connection when it gets the request,
+    // so the client has to retry on a new connection.
+    pServer->m_fDropNextRequest = true;
+    err = RunPoolTestRequest(pUrl);
+    if (err) {
+        DEBUG_WARNING("A request on a closed pooled connection was not retried.");
+        gotoErr(err);
+    }
+    if ((pServer->m_fDropNextRequest)
+        || (2 != pServer->m_NumAccepts)
+        || (3 != pServer->m_NumRequests)) {
+        DEBUG_WARNING("The retry did not use a new connection.");
+        gotoErr(EFail);
+    }
+
+abort:
+    if (pListenBlockIO) {
+        pListenBlockIO->Close();
+        RELEASE_OBJECT(pListenBlockIO);
+    }
+    if (pServer) {
+        pServer->CloseConnections();
+    }
+    RELEASE_OBJECT(pServer);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // TestConnectionPool.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [RunPoolTestRequest]
+//
+// This reads one document with a new stream, checks it, and then lets
+// the stream go with CloseStreamToURL, which puts the connection back
+// into the pool.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+RunPoolTestRequest(CParsedUrl *pUrl) {
+    ErrVal err = ENoErr;
+    CPolyHttpStream *pHTTPStream = NULL;
+    CSynchPolyHttpCallback *pCallback = NULL;
+    CAsyncIOStream *pBodyStream = NULL;
+    int64 startBodyPosition;
+    char bodyStr[sizeof(POOL_TEST_BODY)];
+
+    pHTTPStream = CPolyHttpStream::AllocateSimpleStream();
+    if (NULL == pHTTPStream) {
+        gotoErr(EFail);
+    }
+    pCallback = newex CSynchPolyHttpCallback;
+    if (NULL == pCallback) {
+        gotoErr(EFail);
+    }
+    err = pCallback->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    pHTTPStream->ReadHTTPDocument(pUrl, pCallback, NULL);
+    err = pCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    if (200 != pHTTPStream->GetStatusCode()) {
+        DEBUG_WARNING("The loopback server returned the wrong status.");
+        gotoErr(EFail);
+    }
+
+    err = pHTTPStream->GetIOStream(&pBodyStream, &startBodyPosition, NULL);
+    if ((err) || (NULL == pBodyStream)) {
+        gotoErr(EFail);
+    }
+    err = pBodyStream->SetPosition(startBodyPosition);
+    if (err) {
+        gotoErr(err);
+    }
+    err = pBodyStream->Read(bodyStr, sizeof(POOL_TEST_BODY) - 1);
+    if (err) {
+        gotoErr(err);
+    }
+    bodyStr[sizeof(POOL_TEST_BODY) - 1] = 0;
+    if (strcmp(bodyStr, POOL_TEST_BODY)) {
+        DEBUG_WARNING("The loopback server returned the wrong body.");
+        gotoErr(EFail);
+    }
+
+abort:
+    RELEASE_OBJECT(pBodyStream);
+    if (pHTTPStream) {
+        pHTTPStream->CloseStreamToURL();
+    }
+    RELEASE_OBJECT(pHTTPStream);
+    RELEASE_OBJECT(pCallback);
+
+    returnErr(err);
+} // RunPoolTestRequest.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CPoolTestServer]
+//
+/////////////////////////////////////////////////////////////////////////////
+CPoolTestServer::CPoolTestServer() {
+    int32 connectionNum;
+
+    m_NumAccepts = 0;
+    m_NumRequests = 0;
+    m_fDropNextRequest = false;
+    m_pLock = NULL;
+    for (connectionNum = 0; connectionNum < POOL_TEST_MAX_CONNECTIONS; connectionNum++) {
+        m_BlockIOList[connectionNum] = NULL;
+        m_NumEndBytesSeen[connectionNum] = 0;
+    }
+} // CPoolTestServer.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CPoolTestServer]
+//
+/////////////////////////////////////////////////////////////////////////////
+CPoolTestServer::~CPoolTestServer() {
+    RELEASE_OBJECT(m_pLock);
+} // ~CPoolTestServer.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CPoolTestServer::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CloseConnections]
+//
+// The connections are closed outside the server lock, because a blockIO
+// calls OnBlockIOEvent with its own lock held.
+/////////////////////////////////////////////////////////////////////////////
+void
+CPoolTestServer::CloseConnections() {
+    CAsyncBlockIO *blockIOList[POOL_TEST_MAX_CONNECTIONS];
+    int32 connectionNum;
+
+    m_pLock->Lock();
+    for (connectionNum = 0; connectionNum < POOL_TEST_MAX_CONNECTIONS; connectionNum++) {
+        blockIOList[connectionNum] = m_BlockIOList[connectionNum];
+        m_BlockIOList[connectionNum] = NULL;
+    }
+    m_pLock->Unlock();
+
+    for (connectionNum = 0; connectionNum < POOL_TEST_MAX_CONNECTIONS; connectionNum++) {
+        if (blockIOList[connectionNum]) {
+            // This breaks the reference cycle between us and the blockIO.
+            blockIOList[connectionNum]->ChangeBlockIOCallback(NULL);
+            blockIOList[connectionNum]->Close();
+            RELEASE_OBJECT(blockIOList[connectionNum]);
+        }
+    }
+} // CloseConnections.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOAccept]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CPoolTestServer::OnBlockIOAccept(ErrVal err, CAsyncBlockIO *pBlockIO) {
+    bool fKeepConnection = false;
+
+    if ((err) || (NULL == pBlockIO)) {
+        return;
+    }
+
+    m_pLock->Lock();
+    if (m_NumAccepts < POOL_TEST_MAX_CONNECTIONS) {
+        m_BlockIOList[m_NumAccepts] = pBlockIO;
+        ADDREF_OBJECT(pBlockIO);
+        m_NumAccepts += 1;
+        fKeepConnection = true;
+    }
+    m_pLock->Unlock();
+
+    if ((!fKeepConnection)
+        || (NetIO_ReceiveDataFromAcceptedConnection(pBlockIO, this))) {
+        pBlockIO->Close();
+    }
+} // OnBlockIOAccept.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnBlockIOEvent]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CPoolTestServer::OnBlockIOEvent(CIOBuffer *pBuffer) {
+    CAsyncBlockIO *pBlockIO;
+    CAsyncBlockIO *pDroppedBlockIO = NULL;
+    CIOBuffer *pResponse;
+    int32 connectionNum;
+    int32 byteNum;
+    int32 numRequests = 0;
+
+    if ((NULL == pBuffer)
+        || (CIOBuffer::READ != pBuffer->m_BufferOp)
+        || (pBuffer->m_Err)) {
+        return;
+    }
+    pBlockIO = pBuffer->m_pBlockIO;
+
+    { /////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        for (connectionNum = 0; connectionNum < POOL_TEST_MAX_CONNECTIONS; connectionNum++) {
+            if (pBlockIO == m_BlockIOList[connectionNum]) {
+                break;
+            }
+        }
+        if (connectionNum >= POOL_TEST_MAX_CONNECTIONS) {
+            return;
+        }
+
+        // The requests have no body, so each one ends with a blank line.
+        for (byteNum = 0; byteNum < pBuffer->m_NumValidBytes; byteNum++) {
+            if ("\r\n\r\n"[m_NumEndBytesSeen[connectionNum]] == pBuffer->m_pLogicalBuffer[byteNum]) {
+                m_NumEndBytesSeen[connectionNum] += 1;
+            } else if ('\r' == pBuffer->m_pLogicalBuffer[byteNum]) {
+                m_NumEndBytesSeen[connectionNum] = 1;
+            } else {
+                m_NumEndBytesSeen[connectionNum] = 0;
+            }
+            if (4 == m_NumEndBytesSeen[connectionNum]) {
+                m_NumEndBytesSeen[connectionNum] = 0;
+                numRequests += 1;
+            }
+        }
+
+        if ((numRequests > 0) && (m_fDropNextRequest)) {
+            m_fDropNextRequest = false;
+            pDroppedBlockIO = m_BlockIOList[connectionNum];
+            m_BlockIOList[connectionNum] = NULL;
+            numRequests = 0;
+        }
+        m_NumRequests += numRequests;
+    } /////////////////////////////////////////////////
+
+    if (pDroppedBlockIO) {
+        pDroppedBlockIO->ChangeBlockIOCallback(NULL);
+        pDroppedBlockIO->Close();
+        RELEASE_OBJECT(pDroppedBlockIO);
+    }
+
+    while (numRequests > 0) {
+        numRequests--;
+
+        pResponse = pBlockIO->GetIOSystem()->AllocIOBuffer(-1, false);
+        if (NULL == pResponse) {
+            return;
+        }
+        pResponse->m_BufferOp = CIOBuffer::NO_OP;
+        pResponse->m_BufferFlags |= CIOBuffer::VALID_DATA;
+        pResponse->m_Err = ENoErr;
+        pResponse->m_pPhysicalBuffer = (char *) g_PoolTestResponse;
+        pResponse->m_pLogicalBuffer = pResponse->m_pPhysicalBuffer;
+        pResponse->m_BufferSize = sizeof(g_PoolTestResponse) - 1;
+        pResponse->m_NumValidBytes = sizeof(g_PoolTestResponse) - 1;
+        pResponse->m_PosInMedia = 0;
+        pResponse->m_StartWriteOffset = 0;
+
+        pBlockIO->WriteBlockAsync(pResponse, 0);
+        CIOSystem::ReleaseBlockList(pResponse);
+    }
+} // OnBlockIOEvent.
+
+
 #endif // INCLUDE_REGRESSION_TESTS
 
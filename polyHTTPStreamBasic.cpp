@@ -37,6 +37,7 @@
 #include "stringParse.h"
 #include "queue.h"
 #include "jobQueue.h"
+#include "timerWheel.h"
 #include "rbTree.h"
 #include "nameTable.h"
 #include "url.h"
@@ -47,6 +48,8 @@
 
 FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
 
+extern CConfigSection *g_pBuildingBlocksConfig;
+
 
 /////////////////////////////////////////////
 enum ReadAction {
@@ -116,6 +119,13 @@ enum {
     SENT_RESPONSE_HEADER        = 0x0008,
     READING_RESPONSE            = 0x0010,
     CONNECTED_TO_PEER           = 0x0020,
+    REUSABLE_CONNECTION         = 0x0040,
+    REUSED_CONNECTION           = 0x0080,
+
+    /////////////////////////////////////////////
+    // Defaults for the idle connection pool.
+    DEFAULT_MAX_IDLE_CONNECTIONS_PER_HOST   = 4,
+    DEFAULT_IDLE_CONNECTION_TIMEOUT_IN_MS   = 30000,
 };
 
 
@@ -170,6 +180,9 @@ static const char *g_ShortMonthNames[] = { "Jan", "Feb", "Mar", "Apr", "May", "J
 // lookup a name in any header. As a small side-benefit, it also saves
 // us the time of "discovering" these standard names with each new header.
 static CNameTable *m_pGlobalNameList = NULL;
+
+static const char g_HTTPMaxIdleConnectionsConfigValueName[] = "HTTP Max Idle Connections Per Host";
+static const char g_HTTPIdleConnectionTimeoutConfigValueName[] = "HTTP Idle Connection Timeout";
 static const char *g_BuiltInNames[] = {
     "Date",
     "Content-Length",
@@ -465,6 +478,80 @@ public:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+// This is one open HTTP 1.1 connection that is waiting to be reused.
+class CIdleHttpConnection {
+public:
+    CIdleHttpConnection();
+    NEWEX_IMPL()
+
+    CAsyncIOStream                      *m_pAsyncIOStream;
+
+    // This is the host and port the connection was opened to.
+    CParsedUrl                          *m_pUrl;
+
+    uint64                              m_IdleSinceInMs;
+    bool                                m_fDisconnected;
+
+    CQueueHook<CIdleHttpConnection>     m_PoolList;
+}; // CIdleHttpConnection
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This keeps idle keep-alive connections, so a later request to the
+// same host and port can skip the TCP connect. All HTTP streams share
+// a single pool.
+//
+// While a connection is idle, the pool is its event handler, so it
+// hears when the server closes it. Connections are closed by the sweep
+// timer, never while some stream's lock may be held.
+class CHttpConnectionPool : public CAsyncIOEventHandler,
+                            public CTimerCallback,
+                            public CRefCountImpl {
+public:
+    CHttpConnectionPool();
+    virtual ~CHttpConnectionPool();
+    NEWEX_IMPL()
+
+    ErrVal Initialize();
+
+    CAsyncIOStream *TakeConnection(CParsedUrl *pUrl);
+    bool ReturnConnection(CAsyncIOStream *pAsyncIOStream, CParsedUrl *pUrl);
+
+    // CAsyncIOEventHandler
+    virtual void OnStreamDisconnect(
+                    ErrVal err,
+                    CAsyncIOStream *pAsyncIOStream,
+                    void *pContext);
+
+    // CTimerCallback
+    virtual void OnTimer(CTimer *pTimer);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+private:
+    bool IsUsable(CIdleHttpConnection *pConnection, uint64 now);
+
+    CRefLock                            *m_pLock;
+
+    // This is in LRU order. The most recently returned connection is
+    // at the head, so the oldest one is at the tail.
+    CQueueList<CIdleHttpConnection>     m_IdleList;
+
+    int32                               m_MaxIdleConnectionsPerHost;
+    int32                               m_IdleTimeoutInMs;
+
+    CTimer                              m_SweepTimer;
+}; // CHttpConnectionPool
+
+static CHttpConnectionPool *g_pIdleConnectionPool = NULL;
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 // All asynch events are translated into calls on this object.
 class CPolyHttpStreamBasic : public CPolyHttpStream,
@@ -555,7 +642,7 @@ public:
     ErrVal ReadBodyData(ErrVal resultErr, ReadAction *pAction);
     ErrVal ReadChunks(ErrVal resultErr, ReadAction *pAction);
 
-    ErrVal OpenStreamToURL(CParsedUrl *url);
+    ErrVal OpenStreamToURL(CParsedUrl *url, bool fReuseConnection);
     void SendRequestAfterConnecting();
     ErrVal FollowRedirection();
 
@@ -660,6 +747,8 @@ public:
     CParsedUrl          *m_pUrl;
 
     CAsyncIOStream      *m_pAsyncIOStream;
+    // This is the host and port that m_pAsyncIOStream is connected to.
+    CParsedUrl          *m_pConnectedUrl;
     // This is a stream we send as the body of a POST.
     CAsyncIOStream      *m_pSendAsyncIOStream;
 
@@ -768,6 +857,17 @@ InitializeBasicHTTPStreamGlobalState(CProductInfo *pVersion) {
 
     m_pGlobalNameList->AddDictionaryEntryList(g_BuiltInNames);
 
+    // Create the pool of idle keep-alive connections.
+    g_pIdleConnectionPool = newex CHttpConnectionPool;
+    if (NULL == g_pIdleConnectionPool) {
+        gotoErr(EFail);
+    }
+
+    err = g_pIdleConnectionPool->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
 
 abort:
     returnErr(err);
@@ -800,6 +900,371 @@ CPolyHttpStream::AllocateSimpleStream() {
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CIdleHttpConnection]
+//
+/////////////////////////////////////////////////////////////////////////////
+CIdleHttpConnection::CIdleHttpConnection() : m_PoolList(this) {
+    m_pAsyncIOStream = NULL;
+    m_pUrl = NULL;
+    m_IdleSinceInMs = 0;
+    m_fDisconnected = false;
+} // CIdleHttpConnection
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CHttpConnectionPool]
+//
+/////////////////////////////////////////////////////////////////////////////
+CHttpConnectionPool::CHttpConnectionPool() {
+    m_pLock = NULL;
+    m_MaxIdleConnectionsPerHost = DEFAULT_MAX_IDLE_CONNECTIONS_PER_HOST;
+    m_IdleTimeoutInMs = DEFAULT_IDLE_CONNECTION_TIMEOUT_IN_MS;
+
+    m_SweepTimer.m_pCallback = this;
+    m_SweepTimer.m_pContext = NULL;
+} // CHttpConnectionPool
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CHttpConnectionPool]
+//
+/////////////////////////////////////////////////////////////////////////////
+CHttpConnectionPool::~CHttpConnectionPool() {
+    CIdleHttpConnection *pConnection;
+
+    NetIO_CancelTimer(&m_SweepTimer);
+
+    while (1) {
+        pConnection = m_IdleList.RemoveHead();
+        if (NULL == pConnection) {
+            break;
+        }
+
+        pConnection->m_pAsyncIOStream->Close();
+        RELEASE_OBJECT(pConnection->m_pAsyncIOStream);
+        RELEASE_OBJECT(pConnection->m_pUrl);
+        delete pConnection;
+    }
+
+    RELEASE_OBJECT(m_pLock);
+} // ~CHttpConnectionPool
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CHttpConnectionPool::Initialize() {
+    ErrVal err = ENoErr;
+
+    m_pLock = newex CRefLock;
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+    err = m_pLock->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    if (NULL != g_pBuildingBlocksConfig) {
+        m_MaxIdleConnectionsPerHost = g_pBuildingBlocksConfig->GetInt(
+                                            g_HTTPMaxIdleConnectionsConfigValueName,
+                                            DEFAULT_MAX_IDLE_CONNECTIONS_PER_HOST);
+        m_IdleTimeoutInMs = g_pBuildingBlocksConfig->GetInt(
+                                            g_HTTPIdleConnectionTimeoutConfigValueName,
+                                            DEFAULT_IDLE_CONNECTION_TIMEOUT_IN_MS);
+    }
+    if (m_IdleTimeoutInMs <= 0) {
+        m_MaxIdleConnectionsPerHost = 0;
+    }
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [IsUsable]
+//
+// The caller must hold the pool lock.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CHttpConnectionPool::IsUsable(CIdleHttpConnection *pConnection, uint64 now) {
+    if ((pConnection->m_fDisconnected)
+        || !(pConnection->m_pAsyncIOStream->IsOpen())
+        || ((now - pConnection->m_IdleSinceInMs) >= (uint64) m_IdleTimeoutInMs)) {
+        return(false);
+    }
+
+    return(true);
+} // IsUsable.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TakeConnection]
+//
+// This returns an AddRef'ed idle connection to the host and port of pUrl,
+// or NULL if there is none. The caller must install its own event handler.
+//
+// This does not close stale connections it passes over, because the
+// caller may hold the lock of another stream. The sweep timer closes them.
+/////////////////////////////////////////////////////////////////////////////
+CAsyncIOStream *
+CHttpConnectionPool::TakeConnection(CParsedUrl *pUrl) {
+    CIdleHttpConnection *pConnection = NULL;
+    CAsyncIOStream *pAsyncIOStream = NULL;
+    uint64 now;
+
+    if (NULL == pUrl) {
+        return(NULL);
+    }
+
+    { /////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        now = GetTimeSinceBootInMs();
+
+        // Start at the head, so we reuse the most recently used connection.
+        // It is the least likely to have been closed by the server.
+        pConnection = m_IdleList.GetHead();
+        while (NULL != pConnection) {
+            if ((IsUsable(pConnection, now))
+                && (pUrl->Equal(CParsedUrl::URL_HOST, pConnection->m_pUrl))) {
+                pConnection->m_PoolList.RemoveFromQueue();
+                break;
+            }
+            pConnection = pConnection->m_PoolList.GetNextInQueue();
+        }
+    } /////////////////////////////////////////////////
+
+    if (NULL != pConnection) {
+        DEBUG_LOG("CHttpConnectionPool::TakeConnection. Reuse stream %p", pConnection->m_pAsyncIOStream);
+
+        // Pass the stream's reference to the caller.
+        pAsyncIOStream = pConnection->m_pAsyncIOStream;
+        RELEASE_OBJECT(pConnection->m_pUrl);
+        delete pConnection;
+    }
+
+    return(pAsyncIOStream);
+} // TakeConnection.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReturnConnection]
+//
+// This returns true if the pool kept the connection. Otherwise, the
+// caller still owns it and should close it.
+/////////////////////////////////////////////////////////////////////////////
+bool
+CHttpConnectionPool::ReturnConnection(CAsyncIOStream *pAsyncIOStream, CParsedUrl *pUrl) {
+    ErrVal err = ENoErr;
+    CIdleHttpConnection *pConnection = NULL;
+    CIdleHttpConnection *pOtherConnection;
+    int32 numConnectionsToHost = 0;
+    bool fStartTimer = false;
+    uint64 now;
+
+    if ((NULL == pAsyncIOStream)
+        || (NULL == pUrl)
+        || (m_MaxIdleConnectionsPerHost <= 0)
+        || !(pAsyncIOStream->IsOpen())) {
+        return(false);
+    }
+
+    pConnection = newex CIdleHttpConnection;
+    if (NULL == pConnection) {
+        return(false);
+    }
+
+    // Listen for the server closing the connection while it is idle,
+    // and release the buffers from the last response.
+    pAsyncIOStream->SetEventHandler(this, NULL);
+    err = pAsyncIOStream->RemoveNBytes(0, (int32) (pAsyncIOStream->GetDataLength()));
+    if (err) {
+        delete pConnection;
+        return(false);
+    }
+
+    pConnection->m_pAsyncIOStream = pAsyncIOStream;
+    ADDREF_OBJECT(pConnection->m_pAsyncIOStream);
+    pConnection->m_pUrl = pUrl;
+    ADDREF_OBJECT(pConnection->m_pUrl);
+
+    { /////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        now = GetTimeSinceBootInMs();
+        pConnection->m_IdleSinceInMs = now;
+
+        pOtherConnection = m_IdleList.GetHead();
+        while (NULL != pOtherConnection) {
+            if ((IsUsable(pOtherConnection, now))
+                && (pUrl->Equal(CParsedUrl::URL_HOST, pOtherConnection->m_pUrl))) {
+                numConnectionsToHost += 1;
+            }
+            pOtherConnection = pOtherConnection->m_PoolList.GetNextInQueue();
+        }
+
+        if (numConnectionsToHost < m_MaxIdleConnectionsPerHost) {
+            // If the pool was empty, then the sweep timer is not running.
+            fStartTimer = m_IdleList.IsEmpty();
+            m_IdleList.InsertHead(&(pConnection->m_PoolList));
+            if (fStartTimer) {
+                (void) NetIO_StartTimer(&m_SweepTimer, m_IdleTimeoutInMs);
+            }
+            pConnection = NULL;
+        }
+    } /////////////////////////////////////////////////
+
+    // If there are already enough idle connections to this host, then
+    // give this one back to the caller.
+    if (NULL != pConnection) {
+        RELEASE_OBJECT(pConnection->m_pAsyncIOStream);
+        RELEASE_OBJECT(pConnection->m_pUrl);
+        delete pConnection;
+        return(false);
+    }
+
+    return(true);
+} // ReturnConnection.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnStreamDisconnect]
+//
+// CAsyncIOEventHandler
+//
+// This is called with the stream's lock held, so it just marks the
+// connection and lets the sweep timer close it right away.
+/////////////////////////////////////////////////////////////////////////////
+void
+CHttpConnectionPool::OnStreamDisconnect(
+                            ErrVal err,
+                            CAsyncIOStream *pAsyncIOStream,
+                            void *pContext) {
+    CIdleHttpConnection *pConnection;
+
+    // Unused
+    err = err;
+    pContext = pContext;
+
+    AutoLock(m_pLock);
+
+    pConnection = m_IdleList.GetHead();
+    while (NULL != pConnection) {
+        if (pAsyncIOStream == pConnection->m_pAsyncIOStream) {
+            DEBUG_LOG("CHttpConnectionPool::OnStreamDisconnect. Idle stream %p closed by the peer", pAsyncIOStream);
+            pConnection->m_fDisconnected = true;
+            (void) NetIO_StartTimer(&m_SweepTimer, 0);
+            break;
+        }
+        pConnection = pConnection->m_PoolList.GetNextInQueue();
+    }
+} // OnStreamDisconnect.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnTimer]
+//
+// CTimerCallback
+//
+// This closes every connection that has been idle too long or that
+// the server has closed.
+/////////////////////////////////////////////////////////////////////////////
+void
+CHttpConnectionPool::OnTimer(CTimer *pTimer) {
+    CQueueList<CIdleHttpConnection> closeList;
+    CIdleHttpConnection *pConnection;
+    CIdleHttpConnection *pNextConnection;
+    uint64 now;
+    int32 delayInMs;
+
+    // Unused
+    pTimer = pTimer;
+
+    { /////////////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        now = GetTimeSinceBootInMs();
+
+        pConnection = m_IdleList.GetHead();
+        while (NULL != pConnection) {
+            pNextConnection = pConnection->m_PoolList.GetNextInQueue();
+            if (!(IsUsable(pConnection, now))) {
+                pConnection->m_PoolList.RemoveFromQueue();
+                closeList.InsertTail(&(pConnection->m_PoolList));
+            }
+            pConnection = pNextConnection;
+        }
+
+        // The oldest connection is at the tail, so it expires first.
+        pConnection = m_IdleList.GetTail();
+        if (NULL != pConnection) {
+            delayInMs = (int32) ((pConnection->m_IdleSinceInMs + m_IdleTimeoutInMs) - now);
+            if (delayInMs < 0) {
+                delayInMs = 0;
+            }
+            (void) NetIO_StartTimer(&m_SweepTimer, delayInMs);
+        }
+    } /////////////////////////////////////////////////
+
+    // Close the streams outside the pool lock, since each close
+    // takes the stream's own lock.
+    while (1) {
+        pConnection = closeList.RemoveHead();
+        if (NULL == pConnection) {
+            break;
+        }
+
+        DEBUG_LOG("CHttpConnectionPool::OnTimer. Close idle stream %p", pConnection->m_pAsyncIOStream);
+        pConnection->m_pAsyncIOStream->Close();
+        RELEASE_OBJECT(pConnection->m_pAsyncIOStream);
+        RELEASE_OBJECT(pConnection->m_pUrl);
+        delete pConnection;
+    }
+} // OnTimer.
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [CPolyHttpStreamBasic]
@@ -812,6 +1277,7 @@ CPolyHttpStreamBasic::CPolyHttpStreamBasic() {
     m_fKeepAlive = false;
 
     m_pAsyncIOStream = NULL;
+    m_pConnectedUrl = NULL;
     m_pUrl = NULL;
 
     m_pCallback = NULL;
@@ -887,7 +1353,7 @@ CPolyHttpStreamBasic::ReadHTTPDocument(
         gotoErr(err);
     }
 
-    err = OpenStreamToURL(pUrl);
+    err = OpenStreamToURL(pUrl, true);
     if (err) {
         gotoErr(err);
     }
@@ -954,20 +1420,14 @@ CPolyHttpStreamBasic::SendHTTPPost(
         }
     }
 
-    // If we are already connected, then we are using a previously
-    // established connection with the Keep-alive. In that case,
-    // just send the new message. Otherwise, we first have to connect
-    // to the server.
-    if (m_HttpStreamFlags & CONNECTED_TO_PEER) {
-        SendRequestAfterConnecting();
-    } else
-    {
-        err = OpenStreamToURL(pUrl);
-        if (err) {
-            gotoErr(err);
-        }
-        // This resumes in OnOpenAsyncIOStream.
+    // If we are already connected with a Keep-alive connection, then
+    // OpenStreamToURL just sends the new message on it. Otherwise, we
+    // first have to connect to the server.
+    err = OpenStreamToURL(pUrl, true);
+    if (err) {
+        gotoErr(err);
     }
+    // This resumes in OnOpenAsyncIOStream.
 
 abort:
     if (err) {
@@ -1085,62 +1545,108 @@ abort:
 //
 // [OpenStreamToURL]
 //
+// If fReuseConnection is true, then this may send the request on a
+// Keep-alive connection to the same host, either the one we already
+// hold or an idle one from the pool, instead of opening a new one.
 /////////////////////////////////////////////////////////////////////////////
 ErrVal
-CPolyHttpStreamBasic::OpenStreamToURL(CParsedUrl *pUrl) {
+CPolyHttpStreamBasic::OpenStreamToURL(CParsedUrl *pUrl, bool fReuseConnection) {
     ErrVal err = ENoErr;
-    AutoLock(m_pLock);
+    CAsyncIOStream *pIdleStream = NULL;
     SignObject("CPolyHttpStreamBasic::OpenStreamToURL");
 
-    // Check the arguments.
-    if (NULL == pUrl) {
-        gotoErr(EFail);
-    }
+    { ///////////////////////////////////////////
+        AutoLock(m_pLock);
 
-    // This happens when we try to open an HTTPS or similar
-    // scheme.
-    if (CParsedUrl::URL_SCHEME_HTTPS == pUrl->m_Scheme) {
-        gotoErr(EHTTPSRequired);
-    }
-    if ((CParsedUrl::URL_SCHEME_HTTP != pUrl->m_Scheme)
-         && (CParsedUrl::URL_SCHEME_URN != m_pUrl->m_Scheme)) {
-        char debugBuffer[1024];
-        char *pDestPtr;
-        pUrl->PrintToString(
-                CParsedUrl::ENTIRE_URL,
-                debugBuffer,
-                sizeof(debugBuffer),
-                &pDestPtr);
-        DEBUG_LOG("Malformed URL. scheme = %d, string = %s", pUrl->m_Scheme, debugBuffer);
-        gotoErr(ENoResponse);
-    }
+        // Check the arguments.
+        if (NULL == pUrl) {
+            gotoErr(EFail);
+        }
 
-    if ((NULL == pUrl->m_pHostName)
-        || (pUrl->m_HostNameSize <= 0)) {
-        gotoErr(EFail);
-    }
+        // This happens when we try to open an HTTPS or similar
+        // scheme.
+        if (CParsedUrl::URL_SCHEME_HTTPS == pUrl->m_Scheme) {
+            gotoErr(EHTTPSRequired);
+        }
+        if ((CParsedUrl::URL_SCHEME_HTTP != pUrl->m_Scheme)
+             && (CParsedUrl::URL_SCHEME_URN != m_pUrl->m_Scheme)) {
+            char debugBuffer[1024];
+            char *pDestPtr;
+            pUrl->PrintToString(
+                    CParsedUrl::ENTIRE_URL,
+                    debugBuffer,
+                    sizeof(debugBuffer),
+                    &pDestPtr);
+            DEBUG_LOG("Malformed URL. scheme = %d, string = %s", pUrl->m_Scheme, debugBuffer);
+            gotoErr(ENoResponse);
+        }
 
-    // If we are going through a proxy, then find the
-    // address of the end server.
-    if (g_fUseHTTPProxy) {
-        memFree(pUrl->m_pSockAddr);
-        pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
-        if (NULL == pUrl->m_pSockAddr) {
+        if ((NULL == pUrl->m_pHostName)
+            || (pUrl->m_HostNameSize <= 0)) {
             gotoErr(EFail);
         }
 
-        *(pUrl->m_pSockAddr) = g_HTTPProxyAddress;
-    }
+        // If we are going through a proxy, then find the
+        // address of the end server.
+        if (g_fUseHTTPProxy) {
+            memFree(pUrl->m_pSockAddr);
+            pUrl->m_pSockAddr = (struct sockaddr_in *) memAlloc(sizeof(struct sockaddr_in));
+            if (NULL == pUrl->m_pSockAddr) {
+                gotoErr(EFail);
+            }
+
+            *(pUrl->m_pSockAddr) = g_HTTPProxyAddress;
+        }
+
+        // Keep the connection from the previous request if it can carry
+        // this one. Otherwise, let it go (it may go back into the pool)
+        // and look for an idle connection to the new host.
+        if ((fReuseConnection)
+            && (m_HttpStreamFlags & CONNECTED_TO_PEER)
+            && (m_HttpStreamFlags & REUSABLE_CONNECTION)
+            && (NULL != m_pAsyncIOStream)
+            && (m_pAsyncIOStream->IsOpen())
+            && (pUrl->Equal(CParsedUrl::URL_HOST, m_pConnectedUrl))) {
+            pIdleStream = m_pAsyncIOStream;
+            ADDREF_OBJECT(pIdleStream);
+        } else {
+            CloseStreamToURL();
 
-    m_HttpState = CONNECTING_TO_SERVER;
+            if ((fReuseConnection) && (NULL != g_pIdleConnectionPool)) {
+                pIdleStream = g_pIdleConnectionPool->TakeConnection(pUrl);
+            }
+        }
+
+        m_HttpStreamFlags &= ~(REUSABLE_CONNECTION | REUSED_CONNECTION);
+        m_HttpState = CONNECTING_TO_SERVER;
+
+        RELEASE_OBJECT(m_pConnectedUrl);
+        m_pConnectedUrl = pUrl;
+        ADDREF_OBJECT(m_pConnectedUrl);
+
+        if (NULL == pIdleStream) {
+            err = CAsyncIOStream::OpenAsyncIOStream(pUrl, 0, this, NULL);
+            // This continues in OnOpenAsyncIOStream.
+            gotoErr(err);
+        }
+
+        m_HttpStreamFlags |= REUSED_CONNECTION;
+    } ///////////////////////////////////////////
 
-    err = CAsyncIOStream::OpenAsyncIOStream(pUrl, 0, this, NULL);
+    // The header parser expects each response to start at position 0,
+    // so discard anything left from the previous response.
+    pIdleStream->SetEventHandler(this, NULL);
+    err = pIdleStream->RemoveNBytes(0, (int32) (pIdleStream->GetDataLength()));
     if (err) {
         gotoErr(err);
     }
-    // This continues in OnOpenAsyncIOStream.
+
+    // The connection is already open, so send the request now.
+    // Call this outside the lock, since it may call the callback.
+    OnOpenAsyncIOStream(ENoErr, pIdleStream, NULL);
 
 abort:
+    RELEASE_OBJECT(pIdleStream);
     returnErr(err);
 } // OpenStreamToURL.
 
@@ -1152,17 +1658,43 @@ abort:
 //
 // [CloseStreamToURL]
 //
+// A connection that can carry another request goes back into the pool
+// instead of being closed.
 /////////////////////////////////////////////////////////////////////////////
 void
 CPolyHttpStreamBasic::CloseStreamToURL() {
-    AutoLock(m_pLock);
+    CAsyncIOStream *pAsyncIOStream = NULL;
+    CParsedUrl *pConnectedUrl = NULL;
+    bool fReuseConnection = false;
     SignObject("CPolyHttpStreamBasic::CloseStreamToURL");
 
-    if (m_pAsyncIOStream) {
-        m_pAsyncIOStream->Close();
-        m_HttpStreamFlags &= ~CONNECTED_TO_PEER;
-        RELEASE_OBJECT(m_pAsyncIOStream);
+    { ///////////////////////////////////////////
+        AutoLock(m_pLock);
+
+        pAsyncIOStream = m_pAsyncIOStream;
+        m_pAsyncIOStream = NULL;
+        pConnectedUrl = m_pConnectedUrl;
+        m_pConnectedUrl = NULL;
+
+        if ((m_HttpStreamFlags & CONNECTED_TO_PEER)
+            && (m_HttpStreamFlags & REUSABLE_CONNECTION)) {
+            fReuseConnection = true;
+        }
+        if (NULL != pAsyncIOStream) {
+            m_HttpStreamFlags &= ~(CONNECTED_TO_PEER | REUSABLE_CONNECTION | REUSED_CONNECTION);
+        }
+    } ///////////////////////////////////////////
+
+    if (NULL != pAsyncIOStream) {
+        if ((!fReuseConnection)
+            || (NULL == g_pIdleConnectionPool)
+            || (!(g_pIdleConnectionPool->ReturnConnection(pAsyncIOStream, pConnectedUrl)))) {
+            pAsyncIOStream->Close();
+        }
     }
+
+    RELEASE_OBJECT(pAsyncIOStream);
+    RELEASE_OBJECT(pConnectedUrl);
 } // CloseStreamToURL.
 
 
@@ -1415,6 +1947,7 @@ CPolyHttpStreamBasic::OnReadyToRead(
     ErrVal err = ENoErr;
     CRefLock *pHeldLock = NULL;
     ReadAction action = PARSE_BUFFER;
+    bool fRetryOnNewConnection = false;
     SignObject("CPolyHttpStreamBasic::OnReadyToRead");
 
     // Unused
@@ -1500,12 +2033,36 @@ abort:
        }
     }
 
+    // A peer that has closed its side cannot carry another request.
+    if (EEOF == resultErr) {
+        m_HttpStreamFlags |= DISCONNECT_ON_CLOSE;
+    }
+
+    // The server may have closed an idle connection just as we reused it.
+    // If it failed before we saw any of the response, then send the request
+    // again on a new connection. Only do this for requests that are safe
+    // to repeat.
+    if ((err)
+        && (m_HttpStreamFlags & REUSED_CONNECTION)
+        && (READING_HEADER == m_HttpState)
+        && (NULL != m_pAsyncIOStream)
+        && (0 == m_numBytesProcessed)
+        && (HTTP_POST_MSG != m_HttpOpInSendRequest)) {
+        DEBUG_LOG("CPolyHttpStreamBasic::OnReadyToRead. Reused connection failed, err = %d", err);
+        fRetryOnNewConnection = true;
+    }
+
     // To avoid deadlock, we may need to release the lock before calling a callback.
     if (pHeldLock) {
         pHeldLock->Unlock();
         pHeldLock = NULL;
     }
 
+    if (fRetryOnNewConnection) {
+        CloseStreamToURL();
+        err = OpenStreamToURL(m_pUrl, false);
+    }
+
     if ((err) || (FINISHED_DOCUMENT == action)) {
         FinishAsynchOp(err, false);
     }
@@ -1557,8 +2114,13 @@ CPolyHttpStreamBasic::ReadHeader(ReadAction *pAction, CRefLock **ppHeldLock) {
     // Process any connection directives. These tell us what to
     // do with the connection when we are done. Do this now,
     // before we potentially discard the header.
-    // By default, we try to leave the connection open.
+    // By default, we try to leave an HTTP 1.1 connection open. Older
+    // peers close it unless they explicitly say Keep-Alive.
     m_HttpStreamFlags &= ~DISCONNECT_ON_CLOSE;
+    if ((m_HttpMajorVersion < 1)
+        || ((1 == m_HttpMajorVersion) && (m_HttpMinorVersion < 1))) {
+        m_HttpStreamFlags |= DISCONNECT_ON_CLOSE;
+    }
     err = GetStringHeader(
                     "Connection",
                     TempBuffer,
@@ -1826,7 +2388,7 @@ CPolyHttpStreamBasic::FollowRedirection() {
     }
     CloseStreamToURL();
 
-    err = OpenStreamToURL(m_pUrl);
+    err = OpenStreamToURL(m_pUrl, true);
     if (err) {
         gotoErr(err);
     }
@@ -1885,6 +2447,17 @@ CPolyHttpStreamBasic::FinishAsynchOp(ErrVal resultErr, bool fWriteOp) {
             m_HttpStreamFlags &= ~CONNECTED_TO_PEER;
         }
 
+        // If the header told us where the response ends, and the peer
+        // did not ask to close, then the connection can carry another
+        // request. CloseStreamToURL puts it back into the pool.
+        if ((!resultErr)
+            && (!fWriteOp)
+            && (m_fReadingResponse)
+            && (m_HttpStreamFlags & CONNECTED_TO_PEER)
+            && !(m_HttpStreamFlags & DISCONNECT_ON_CLOSE)) {
+            m_HttpStreamFlags |= REUSABLE_CONNECTION;
+        }
+
         // Save the callback. The callback may start a new asynch op before returning.
         pCallback = m_pCallback;
         ADDREF_OBJECT(pCallback);
@@ -2199,16 +2772,19 @@ CPolyHttpStreamBasic::OnStreamDisconnect(ErrVal err, CAsyncIOStream *pAsyncIOStr
     void *pEventCallbackContext = NULL;
     SignObject("CPolyHttpStreamBasic::OpenStreamToURL");
 
-    pAsyncIOStream = pAsyncIOStream;
     pContext = pContext;
 
     ///////////////////////////////////////////////////////
     {
         AutoLock(m_pLock);
 
-        pEventCallback = m_pCallback;
-        pEventCallbackContext = m_pCallbackContext;
-        ADDREF_OBJECT(pEventCallback);
+        // Ignore a connection we already let go of, like a stale
+        // Keep-alive connection that we replaced with a new one.
+        if (pAsyncIOStream == m_pAsyncIOStream) {
+            pEventCallback = m_pCallback;
+            pEventCallbackContext = m_pCallbackContext;
+            ADDREF_OBJECT(pEventCallback);
+        }
     }
     ///////////////////////////////////////////////////////
 
@@ -3199,6 +3775,7 @@ CPolyHttpStreamBasic::ParseHeader() {
     char nameBuffer[300];
     char *pDestPtr;
     char *pEndDestPtr;
+    CAsyncIOStream *pCursorStream = NULL;
 
 
     if (NULL == m_pAsyncIOStream) {
@@ -3206,6 +3783,15 @@ CPolyHttpStreamBasic::ParseHeader() {
     }
     pPrevHeaderLine = NULL;
 
+    // The header is parsed one byte at a time, so read it through a cursor
+    // rather than locking the stream for every byte.
+    pCursorStream = m_pAsyncIOStream;
+    ADDREF_OBJECT(pCursorStream);
+    err = pCursorStream->CheckOutCursor();
+    if (err) {
+        gotoErr(err);
+    }
+
     // This loop reads all of the headers. Headers may appear
     // in any order, and there may be any number of headers.
     // One header may appear several times if its body is a
@@ -3302,6 +3888,10 @@ CPolyHttpStreamBasic::ParseHeader() {
     } // reading all of the headers.
 
 abort:
+    if (NULL != pCursorStream) {
+        pCursorStream->CheckInCursor();
+        RELEASE_OBJECT(pCursorStream);
+    }
     returnErr(err);
 } // ParseHeader.
 
@@ -3672,15 +4262,43 @@ CPolyHttpStreamBasic::GotoEndOfHTTPLine() {
     ErrVal err = ENoErr;
     char c1;
     char c2;
+    CIOStreamSpanIterator spans;
+    const char *pSpan;
+    const char *pChar;
+    const char *pEndSpan;
+    int32 spanLength;
+    int64 newlinePosition = -1;
 
     if (NULL == m_pAsyncIOStream) {
         gotoErr(EFail);
     }
 
-    // Read the first CR or LF. Be careful, we may not be at the
+    // Find the first CR or LF. Be careful, we may not be at the
     // the line, so we may have to skip over some whitespace
-    // or other text.
-    err = m_pAsyncIOStream->SkipUntilCharType(CStringLib::NEWLINE_CHAR);
+    // or other text. Search a whole buffer at a time, rather than
+    // reading one character at a time, and look at each byte once.
+    err = spans.Start(m_pAsyncIOStream, m_pAsyncIOStream->GetPosition(), -1);
+    if (err) {
+        gotoErr(err);
+    }
+    while ((newlinePosition < 0) && (spans.GetNextSpan(&pSpan, &spanLength))) {
+        pEndSpan = pSpan + spanLength;
+        for (pChar = pSpan; pChar < pEndSpan; pChar++) {
+            if (('\r' == *pChar) || ('\n' == *pChar)) {
+                newlinePosition = spans.GetSpanPosition() + (pChar - pSpan);
+                break;
+            }
+        }
+    }
+    spans.Stop();
+
+    // If there is no newline, then this stops at the end of the stream
+    // just as it always has.
+    if (newlinePosition >= 0) {
+        err = m_pAsyncIOStream->SetPosition(newlinePosition);
+    } else {
+        err = m_pAsyncIOStream->SkipUntilCharType(CStringLib::NEWLINE_CHAR);
+    }
     if (err) {
         gotoErr(err);
     }
@@ -371,6 +371,7 @@ public:
                         char *pTextBuffer,
                         int64 startOffset,
                         int32 contentLength);
+    ErrVal ReadXMLFile(const char *pFileName);
     ErrVal ReadStreamImpl(
                         CAsyncIOStream *pAsyncIOStream,
                         int64 startPos,
@@ -417,7 +418,9 @@ private:
     bool                    m_fEnforceStrictXML;
 
     // This is used when we read from a stream, like an HTTP stream.
+    // It is only closed here if this document opened it.
     CAsyncIOStream          *m_pAsyncIOStream;
+    bool                    m_fCloseAsyncIOStream;
     int64                   m_StartDocPosition;
     int32                   m_ContentLength;
 
@@ -467,8 +470,6 @@ ErrVal
 OpenSimpleXMLFile(const char *pFileName, CPolyXMLDoc **ppResult) {
     ErrVal err = ENoErr;
     CSimpleXMLDoc *pDoc = NULL;
-    char *pTextBuffer = NULL;
-    int32 contentLength;
 
     if (NULL == ppResult) {
         gotoErr(EFail);
@@ -488,24 +489,16 @@ OpenSimpleXMLFile(const char *pFileName, CPolyXMLDoc **ppResult) {
         gotoErr(err);
     }
 
-
-    err = CFileUtils::ReadFileToBuffer(pFileName, &pTextBuffer, &contentLength);
-    if (err) {
-        gotoErr(err);
-    }
-
-    err = pDoc->ReadXMLBuffer(pTextBuffer, 0, contentLength);
+    err = pDoc->ReadXMLFile(pFileName);
     if (err) {
         gotoErr(err);
     }
 
     *ppResult = pDoc;
     pDoc = NULL;
-    pTextBuffer = NULL;
 
 abort:
     RELEASE_OBJECT(pDoc);
-    memFree(pTextBuffer);
 
     returnErr(err);
 } // OpenSimpleXMLFile
@@ -642,6 +635,7 @@ CSimpleXMLDoc::CSimpleXMLDoc() {
     m_fEnforceStrictXML = false;
 
     m_pAsyncIOStream = NULL;
+    m_fCloseAsyncIOStream = false;
 
     m_pRootNode = NULL;
 
@@ -680,6 +674,9 @@ CSimpleXMLDoc::~CSimpleXMLDoc() {
         delete m_pNameList;
     }
 
+    if ((m_fCloseAsyncIOStream) && (NULL != m_pAsyncIOStream)) {
+        m_pAsyncIOStream->Close();
+    }
     RELEASE_OBJECT(m_pAsyncIOStream);
 
     // Free all the nodes. This does a simple
@@ -839,6 +836,80 @@ abort:
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// [ReadXMLFile]
+//
+// The file is mapped into memory, so the document parses it in place
+// without first copying it into a buffer.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CSimpleXMLDoc::ReadXMLFile(const char *pFileName) {
+    ErrVal err = ENoErr;
+    CAsyncIOEventHandlerSynch *pSyncAsyncIOStreamCallback = NULL;
+    CParsedUrl *pUrl = NULL;
+    CAsyncIOStream *pAsyncIOStream = NULL;
+    RunChecks();
+
+    pSyncAsyncIOStreamCallback = newex CAsyncIOEventHandlerSynch;
+    if (NULL == pSyncAsyncIOStreamCallback) {
+        gotoErr(EFail);
+    }
+
+    err = pSyncAsyncIOStreamCallback->Initialize();
+    if (err) {
+        gotoErr(err);
+    }
+
+    pUrl = CParsedUrl::AllocateFileUrl(pFileName);
+    if (NULL == pUrl) {
+        gotoErr(EFail);
+    }
+
+    err = CAsyncIOStream::OpenAsyncIOStream(
+                              pUrl,
+                              CAsyncBlockIO::READ_ACCESS
+                                  | CAsyncBlockIO::USE_MEMORY_MAP
+                                  | CAsyncBlockIO::SEQUENTIAL_ACCESS,
+                              pSyncAsyncIOStreamCallback,
+                              NULL); // pCallbackContext
+    if (err) {
+        gotoErr(err);
+    }
+    err = pSyncAsyncIOStreamCallback->Wait();
+    if (err) {
+        gotoErr(err);
+    }
+    pAsyncIOStream = pSyncAsyncIOStreamCallback->m_pAsyncIOStream;
+    pSyncAsyncIOStreamCallback->m_pAsyncIOStream = NULL;
+    if (NULL == pAsyncIOStream) {
+        gotoErr(EFail);
+    }
+
+    // We opened this stream, so we close it when the document goes away.
+    m_fCloseAsyncIOStream = true;
+    err = ReadStreamImpl(
+                pAsyncIOStream,
+                0,
+                (int32) (pAsyncIOStream->GetDataLength()));
+    if (err) {
+        gotoErr(err);
+    }
+
+abort:
+    RELEASE_OBJECT(pAsyncIOStream);
+    RELEASE_OBJECT(pSyncAsyncIOStreamCallback);
+    RELEASE_OBJECT(pUrl);
+
+    returnErr(err);
+} // ReadXMLFile
+
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [ReadStreamImpl]
@@ -911,6 +982,11 @@ CSimpleXMLDoc::FirstLexicalScan() {
     bool fInsideTextNode = false;
     CSimpleXMLNode *pNode = NULL;
     CParseState tempParseState;
+    CIOStreamSpanIterator spans;
+    const char *pSpan;
+    const char *pOpenElement;
+    int32 spanLength;
+    int64 textStopPosition;
     RunChecks();
 
 
@@ -989,6 +1065,29 @@ CSimpleXMLDoc::FirstLexicalScan() {
                     gotoErr(err);
                 }
             }
+
+            // Nothing but a '<' ends the text, so skip to the next one a
+            // whole buffer at a time rather than one character at a time.
+            // In UTF-8, the byte '<' is never part of a longer character.
+            textStopPosition = m_pAsyncIOStream->GetPosition();
+            err = spans.Start(m_pAsyncIOStream, textStopPosition, -1);
+            if (err) {
+                gotoErr(err);
+            }
+            while (spans.GetNextSpan(&pSpan, &spanLength)) {
+                pOpenElement = (const char *) memchr(pSpan, '<', spanLength);
+                if (NULL != pOpenElement) {
+                    textStopPosition = spans.GetSpanPosition() + (pOpenElement - pSpan);
+                    break;
+                }
+                textStopPosition = spans.GetSpanPosition() + spanLength;
+            }
+            spans.Stop();
+
+            err = m_pAsyncIOStream->SetPosition(textStopPosition);
+            if (err) {
+                gotoErr(err);
+            }
         } // Read a text character
     } // while (1)
 
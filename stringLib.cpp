@@ -37,6 +37,13 @@
 #include <mbstring.h>
 #endif
 
+// Pattern searches filter candidate positions 16 or 32 bytes at a time
+// when the processor supports it. This is decided when the program runs.
+#if LINUX && (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_PATTERN_SEARCH 1
+#include <immintrin.h>
+#endif
+
 
 /////////////////////////////////////////////////////////////////////////////
 //
@@ -667,6 +674,145 @@ finishedEntireString:
 
 
 
+#if VECTOR_PATTERN_SEARCH
+typedef const char *(*VectorFindPatternProc)(
+                        const char *pBuffer,
+                        int32 bufferLength,
+                        const char *pPattern,
+                        int32 patternLength,
+                        const char **ppStopPos);
+
+static VectorFindPatternProc g_pVectorFindPattern = NULL;
+static bool g_CheckedVectorFindPattern = false;
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [VectorFindPatternSSE2]
+//
+// Each iteration compares the first and last byte of the pattern against
+// 16 possible match positions at once, and only does a full compare at the
+// positions where both bytes match. A byte that is not ASCII is always a
+// candidate, since it may still match after conversion to Unicode.
+//
+// This stops at the first position that does not leave a whole block, and
+// the caller searches the rest one byte at a time.
+/////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static const char *
+VectorFindPatternSSE2(
+                const char *pBuffer,
+                int32 bufferLength,
+                const char *pPattern,
+                int32 patternLength,
+                const char **ppStopPos) {
+    const char *pLastMatch = pBuffer + bufferLength - patternLength;
+    CByteInfo *pFirstInfo = &(g_ByteInfoList[((uchar) pPattern[0])]);
+    CByteInfo *pLastInfo = &(g_ByteInfoList[((uchar) pPattern[patternLength - 1])]);
+    __m128i firstLowerCase = _mm_set1_epi8((char) pFirstInfo->m_LowerCaseASCIICharVal);
+    __m128i firstUpperCase = _mm_set1_epi8((char) pFirstInfo->m_UpperCaseASCIICharVal);
+    __m128i lastLowerCase = _mm_set1_epi8((char) pLastInfo->m_LowerCaseASCIICharVal);
+    __m128i lastUpperCase = _mm_set1_epi8((char) pLastInfo->m_UpperCaseASCIICharVal);
+    __m128i firstBytes;
+    __m128i lastBytes;
+    uint32 candidates;
+    int32 offset;
+
+    while ((pLastMatch - pBuffer) >= 15) {
+        firstBytes = _mm_loadu_si128((const __m128i *) pBuffer);
+        lastBytes = _mm_loadu_si128((const __m128i *) (pBuffer + patternLength - 1));
+
+        candidates = (uint32) (_mm_movemask_epi8(_mm_or_si128(
+                                            _mm_cmpeq_epi8(firstBytes, firstLowerCase),
+                                            _mm_cmpeq_epi8(firstBytes, firstUpperCase)))
+                                | _mm_movemask_epi8(firstBytes));
+        candidates &= (uint32) (_mm_movemask_epi8(_mm_or_si128(
+                                            _mm_cmpeq_epi8(lastBytes, lastLowerCase),
+                                            _mm_cmpeq_epi8(lastBytes, lastUpperCase)))
+                                | _mm_movemask_epi8(lastBytes));
+
+        while (candidates) {
+            offset = __builtin_ctz(candidates);
+            if (0 == strncasecmpex(pPattern, pBuffer + offset, patternLength)) {
+                return(pBuffer + offset);
+            }
+            candidates &= (candidates - 1);
+        }
+
+        pBuffer += 16;
+    } // while ((pLastMatch - pBuffer) >= 15)
+
+    *ppStopPos = pBuffer;
+    return(NULL);
+} // VectorFindPatternSSE2
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [VectorFindPatternAVX2]
+//
+// This is the same as VectorFindPatternSSE2, but checks 32 positions at once.
+/////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static const char *
+VectorFindPatternAVX2(
+                const char *pBuffer,
+                int32 bufferLength,
+                const char *pPattern,
+                int32 patternLength,
+                const char **ppStopPos) {
+    const char *pLastMatch = pBuffer + bufferLength - patternLength;
+    CByteInfo *pFirstInfo = &(g_ByteInfoList[((uchar) pPattern[0])]);
+    CByteInfo *pLastInfo = &(g_ByteInfoList[((uchar) pPattern[patternLength - 1])]);
+    __m256i firstLowerCase = _mm256_set1_epi8((char) pFirstInfo->m_LowerCaseASCIICharVal);
+    __m256i firstUpperCase = _mm256_set1_epi8((char) pFirstInfo->m_UpperCaseASCIICharVal);
+    __m256i lastLowerCase = _mm256_set1_epi8((char) pLastInfo->m_LowerCaseASCIICharVal);
+    __m256i lastUpperCase = _mm256_set1_epi8((char) pLastInfo->m_UpperCaseASCIICharVal);
+    __m256i firstBytes;
+    __m256i lastBytes;
+    uint32 candidates;
+    int32 offset;
+
+    while ((pLastMatch - pBuffer) >= 31) {
+        firstBytes = _mm256_loadu_si256((const __m256i *) pBuffer);
+        lastBytes = _mm256_loadu_si256((const __m256i *) (pBuffer + patternLength - 1));
+
+        candidates = (uint32) (_mm256_movemask_epi8(_mm256_or_si256(
+                                            _mm256_cmpeq_epi8(firstBytes, firstLowerCase),
+                                            _mm256_cmpeq_epi8(firstBytes, firstUpperCase)))
+                                | _mm256_movemask_epi8(firstBytes));
+        candidates &= (uint32) (_mm256_movemask_epi8(_mm256_or_si256(
+                                            _mm256_cmpeq_epi8(lastBytes, lastLowerCase),
+                                            _mm256_cmpeq_epi8(lastBytes, lastUpperCase)))
+                                | _mm256_movemask_epi8(lastBytes));
+
+        while (candidates) {
+            offset = __builtin_ctz(candidates);
+            if (0 == strncasecmpex(pPattern, pBuffer + offset, patternLength)) {
+                return(pBuffer + offset);
+            }
+            candidates &= (candidates - 1);
+        }
+
+        pBuffer += 32;
+    } // while ((pLastMatch - pBuffer) >= 31)
+
+    *ppStopPos = pBuffer;
+    return(NULL);
+} // VectorFindPatternAVX2
+
+#endif // VECTOR_PATTERN_SEARCH
+
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // [FindPatternInBuffer]
@@ -680,6 +826,9 @@ CStringLib::FindPatternInBuffer(
                         int32 patternLength) {
     const char *pLastMatch;
     int32 result;
+#if VECTOR_PATTERN_SEARCH
+    const char *pMatch;
+#endif
 
     if ((NULL == pPattern)
          || (NULL == pBuffer)
@@ -696,6 +845,40 @@ CStringLib::FindPatternInBuffer(
 
     pLastMatch = pBuffer + bufferLength;
     pLastMatch = pLastMatch - patternLength;
+
+#if VECTOR_PATTERN_SEARCH
+    // Pick the widest search this processor supports. Two threads may
+    // both do this the first time, but they will pick the same thing.
+    if (!g_CheckedVectorFindPattern) {
+        if (__builtin_cpu_supports("avx2")) {
+            g_pVectorFindPattern = VectorFindPatternAVX2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            g_pVectorFindPattern = VectorFindPatternSSE2;
+        }
+        g_CheckedVectorFindPattern = true;
+    }
+
+    // The vector search only looks for ASCII first and last bytes.
+    // A pattern that starts or ends with a Unicode character may match
+    // different bytes, so it is checked at every position.
+    if ((NULL != g_pVectorFindPattern)
+        && (bufferLength >= patternLength)
+        && (CStringLib::ASCII_CHAR & g_ByteInfoList[((uchar) pPattern[0])].m_Flags)
+        && (CStringLib::ASCII_CHAR & g_ByteInfoList[((uchar) pPattern[patternLength - 1])].m_Flags)) {
+        pMatch = (*g_pVectorFindPattern)(
+                                pBuffer,
+                                bufferLength,
+                                pPattern,
+                                patternLength,
+                                &pBuffer);
+        if (NULL != pMatch) {
+            return(pMatch);
+        }
+        // Otherwise, pBuffer is where the vector search stopped, and the
+        // loop below checks the few remaining positions.
+    }
+#endif // VECTOR_PATTERN_SEARCH
+
     while (pBuffer <= pLastMatch) {
         result = strncasecmpex(pPattern, pBuffer, patternLength);
         if (0 == result) {
@@ -1718,6 +1901,13 @@ MapIntegerToString(CStringToIntegerMap *pMap, int32 value) {
 
 #define NUM_VALUES      200
 
+// The decoy has the same first and last bytes as the pattern, so only
+// a full compare can reject it.
+#define PATTERN_TEST_BUFFER_SIZE    200
+#define PATTERN_TEST_PATTERN        "--BoundaryX"
+#define PATTERN_TEST_MATCH          "--bOUNDARYx"
+#define PATTERN_TEST_DECOY          "--BoundaryZX"
+
 
 /////////////////////////////////////////////////////////////////////////////
 //
@@ -1733,6 +1923,11 @@ CStringLib::TestStringLib() {
     char *finalSrc;
     char correctStr[32];
     int32 returnedNum;
+    char searchBuffer[PATTERN_TEST_BUFFER_SIZE];
+    const char *pMatch;
+    int32 bufferLength;
+    int32 matchOffset;
+    int32 index;
 
     OSIndependantLayer::PrintToConsole("Test Module: String Utilities");
 
@@ -1748,6 +1943,44 @@ CStringLib::TestStringLib() {
     }
 
 
+    ////////////////////////////////////////////////
+    OSIndependantLayer::PrintToConsole("  Test: Pattern Search");
+
+    // Put the pattern at every offset of buffers of many lengths, so
+    // matches are found in every lane of a block and in the bytes after
+    // the last whole block.
+    for (bufferLength = strlen(PATTERN_TEST_MATCH); bufferLength <= PATTERN_TEST_BUFFER_SIZE; bufferLength++) {
+        for (matchOffset = 0; (matchOffset + (int32) strlen(PATTERN_TEST_MATCH)) <= bufferLength; matchOffset++) {
+            for (index = 0; index < bufferLength; index++) {
+                searchBuffer[index] = 'a' + (index % 7);
+            }
+            if (matchOffset >= (int32) strlen(PATTERN_TEST_DECOY)) {
+                memcpy(searchBuffer, PATTERN_TEST_DECOY, strlen(PATTERN_TEST_DECOY));
+            }
+            memcpy(searchBuffer + matchOffset, PATTERN_TEST_MATCH, strlen(PATTERN_TEST_MATCH));
+
+            pMatch = CStringLib::FindPatternInBuffer(
+                                    searchBuffer,
+                                    bufferLength,
+                                    PATTERN_TEST_PATTERN,
+                                    -1);
+            if (pMatch != (searchBuffer + matchOffset)) {
+                REPORT_LOW_LEVEL_BUG();
+            }
+
+            // The pattern is not there when the buffer stops one byte short.
+            pMatch = CStringLib::FindPatternInBuffer(
+                                    searchBuffer,
+                                    matchOffset + strlen(PATTERN_TEST_MATCH) - 1,
+                                    PATTERN_TEST_PATTERN,
+                                    -1);
+            if (NULL != pMatch) {
+                REPORT_LOW_LEVEL_BUG();
+            }
+        }
+    }
+
+
     ////////////////////////////////////////////////
     OSIndependantLayer::PrintToConsole("  Test: String To Number Conversion");
 
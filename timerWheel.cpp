@@ -0,0 +1,726 @@
+/////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2005-2017 Dawson Dean
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+/////////////////////////////////////////////////////////////////////////////
+//
+// Timer Wheel Module
+//
+// This implements a hierarchical timer wheel. Arming and cancelling a timer
+// are O(1), and the cost of advancing the wheel is proportional to the
+// number of timers that actually fire, not the number of timers that are
+// armed. This matters for things like network timeouts, where there may be
+// thousands of armed timers and almost none of them ever fire.
+//
+// Time is divided into ticks of a fixed number of milliseconds. The first
+// level of the wheel has one slot for each of the next 256 ticks. Each
+// higher level has 64 slots, and each of those slots covers one complete
+// rotation of the level below it. Timers that are far in the future are
+// kept in a coarse slot of a higher level, and are moved ("cascaded") down
+// to a finer level when the lower level wraps around. A timer is cascaded
+// at most once per level, so the amortized cost is still O(1).
+//
+// The wheel does not have its own thread. The owner periodically calls
+// FireExpiredTimers, and may use GetMsUntilNextTimer to decide how long to
+// sleep between calls. A timer fires at most one tick after its deadline,
+// and never before it.
+//
+// A wheel has its own lock, so timers may be armed and cancelled from any
+// thread. This lock is never held while calling a callback, so it is
+// always the innermost lock.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#include "osIndependantLayer.h"
+#include "log.h"
+#include "config.h"
+#include "debugging.h"
+#include "refCount.h"
+#include "memAlloc.h"
+#include "threads.h"
+#include "queue.h"
+#include "timerWheel.h"
+
+FILE_DEBUGGING_GLOBALS(LOG_LEVEL_DEFAULT, 0);
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CTimer]
+//
+/////////////////////////////////////////////////////////////////////////////
+CTimer::CTimer() : m_WheelSlot(this) {
+    m_pCallback = NULL;
+    m_pContext = NULL;
+    m_ExpireTick = 0;
+    m_pWheel = NULL;
+} // CTimer.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CTimerWheel]
+//
+/////////////////////////////////////////////////////////////////////////////
+CTimerWheel::CTimerWheel() {
+    int32 level;
+    int32 slot;
+
+    m_pLock = NULL;
+    m_MsPerTick = 1;
+    m_StartTime = 0;
+    m_NextTick = 0;
+    m_NumTimers = 0;
+
+    for (slot = 0; slot < LEVEL0_SLOTS; slot++) {
+        m_Level0[slot].ResetQueue();
+    }
+    for (level = 0; level < NUM_UPPER_LEVELS; level++) {
+        for (slot = 0; slot < LEVELN_SLOTS; slot++) {
+            m_UpperLevels[level][slot].ResetQueue();
+        }
+    }
+} // CTimerWheel.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [~CTimerWheel]
+//
+// The owner must cancel all timers before deleting the wheel.
+/////////////////////////////////////////////////////////////////////////////
+CTimerWheel::~CTimerWheel() {
+    if (m_NumTimers > 0) {
+        DEBUG_WARNING("Deleting a timer wheel with %d armed timers.", m_NumTimers);
+    }
+
+    RELEASE_OBJECT(m_pLock);
+} // ~CTimerWheel.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Initialize]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CTimerWheel::Initialize(int32 msPerTick) {
+    ErrVal err = ENoErr;
+
+    if (msPerTick <= 0) {
+        gotoErr(EInvalidArg);
+    }
+
+    m_pLock = CRefLock::Alloc();
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+
+    m_MsPerTick = msPerTick;
+    m_StartTime = GetTimeSinceBootInMs();
+    m_NextTick = 0;
+    m_NumTimers = 0;
+
+abort:
+    returnErr(err);
+} // Initialize.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [AddTimer]
+//
+// This arms a timer. If the timer is already armed, then it is re-armed
+// with the new delay.
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CTimerWheel::AddTimer(CTimer *pTimer, int32 delayInMs) {
+    ErrVal err = ENoErr;
+    uint64 numTicks = 0;
+
+    if ((NULL == pTimer) || (delayInMs < 0)) {
+        gotoErr(EInvalidArg);
+    }
+    if (NULL == m_pLock) {
+        gotoErr(EFail);
+    }
+
+    // A timer can only be on one wheel at a time.
+    if ((NULL != pTimer->m_pWheel) && (this != pTimer->m_pWheel)) {
+        CancelTimer(pTimer);
+    }
+
+    // Round up, and then add one more tick because we are already
+    // partway through the current tick. This means a timer never
+    // fires early.
+    if (delayInMs > 0) {
+        numTicks = ((delayInMs + m_MsPerTick - 1) / m_MsPerTick) + 1;
+    }
+
+    {
+        AutoLock(m_pLock);
+
+        if (this == pTimer->m_pWheel) {
+            pTimer->m_WheelSlot.RemoveFromQueue();
+            m_NumTimers--;
+        }
+
+        pTimer->m_ExpireTick = GetTickForTime(GetTimeSinceBootInMs()) + numTicks;
+        pTimer->m_pWheel = this;
+        InsertTimer(pTimer);
+        m_NumTimers++;
+    }
+
+abort:
+    returnErr(err);
+} // AddTimer.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CancelTimer]
+//
+// This is static so the caller does not need to know which wheel the timer
+// is on. A timer that has already been removed from its wheel to fire may
+// still fire once after this returns, so callbacks should check their own
+// state.
+/////////////////////////////////////////////////////////////////////////////
+void
+CTimerWheel::CancelTimer(CTimer *pTimer) {
+    CTimerWheel *pWheel;
+
+    if (NULL == pTimer) {
+        return;
+    }
+
+    // The only other thread that may change m_pWheel is a thread that
+    // is firing this timer, and that only sets it to NULL. So, it is
+    // safe to read it without a lock and then check it again.
+    pWheel = pTimer->m_pWheel;
+    if (NULL == pWheel) {
+        return;
+    }
+
+    AutoLock(pWheel->m_pLock);
+    if (pWheel == pTimer->m_pWheel) {
+        pTimer->m_WheelSlot.RemoveFromQueue();
+        pTimer->m_pWheel = NULL;
+        pWheel->m_NumTimers--;
+    }
+} // CancelTimer.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [FireExpiredTimers]
+//
+/////////////////////////////////////////////////////////////////////////////
+int32
+CTimerWheel::FireExpiredTimers(uint64 now) {
+    CTimer *timerList[MAX_TIMERS_PER_BATCH];
+    CTimerCallback *callbackList[MAX_TIMERS_PER_BATCH];
+    int32 numInBatch;
+    int32 totalFired = 0;
+    int32 index;
+    uint64 targetTick;
+    CTimer *pTimer;
+
+    if (NULL == m_pLock) {
+        return(0);
+    }
+
+    while (true) {
+        numInBatch = 0;
+
+        /////////////////////////////////////////////////
+        m_pLock->Lock();
+        targetTick = GetTickForTime(now);
+
+        // If nothing is armed, then there is nothing to cascade, so
+        // skip all the idle ticks at once.
+        if ((0 == m_NumTimers) && (m_NextTick <= targetTick)) {
+            m_NextTick = targetTick + 1;
+        }
+
+        while ((numInBatch < MAX_TIMERS_PER_BATCH) && (m_NextTick <= targetTick)) {
+            index = (int32) (m_NextTick & LEVEL0_MASK);
+            pTimer = m_Level0[index].RemoveHead();
+            if (NULL == pTimer) {
+                // This tick is done. If the first level just wrapped
+                // around, then refill it from the higher levels.
+                m_NextTick++;
+                if (0 == (m_NextTick & LEVEL0_MASK)) {
+                    if (0 == Cascade(0, (int32) ((m_NextTick >> LEVEL0_BITS) & LEVELN_MASK))) {
+                        if (0 == Cascade(1, (int32) ((m_NextTick >> (LEVEL0_BITS + LEVELN_BITS)) & LEVELN_MASK))) {
+                            (void) Cascade(2, (int32) ((m_NextTick >> (LEVEL0_BITS + (2 * LEVELN_BITS))) & LEVELN_MASK));
+                        }
+                    }
+                }
+                continue;
+            }
+
+            pTimer->m_pWheel = NULL;
+            m_NumTimers--;
+
+            // Hold a reference on the callback so the client may
+            // cancel the timer and release the callback while it fires.
+            timerList[numInBatch] = pTimer;
+            callbackList[numInBatch] = pTimer->m_pCallback;
+            ADDREF_OBJECT(callbackList[numInBatch]);
+            numInBatch++;
+        } // while ((numInBatch < MAX_TIMERS_PER_BATCH) && (m_NextTick <= targetTick))
+        m_pLock->Unlock();
+        /////////////////////////////////////////////////
+
+        for (index = 0; index < numInBatch; index++) {
+            if (callbackList[index]) {
+                callbackList[index]->OnTimer(timerList[index]);
+            }
+            RELEASE_OBJECT(callbackList[index]);
+        }
+        totalFired += numInBatch;
+
+        if (numInBatch < MAX_TIMERS_PER_BATCH) {
+            break;
+        }
+    } // while (true)
+
+    return(totalFired);
+} // FireExpiredTimers.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetMsUntilNextTimer]
+//
+// This only looks at the first level of the wheel. If the next timer is
+// in a higher level, then this returns the time until the first level
+// wraps around, since the owner must call FireExpiredTimers then to
+// cascade the timers down.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CTimerWheel::GetMsUntilNextTimer(uint64 now) {
+    uint64 tick;
+    uint64 deadline;
+    AutoLock(m_pLock);
+
+    if (m_NumTimers <= 0) {
+        return(-1);
+    }
+
+    tick = m_NextTick;
+    while (true) {
+        if (!(m_Level0[tick & LEVEL0_MASK].IsEmpty())) {
+            break;
+        }
+        tick++;
+        if (0 == (tick & LEVEL0_MASK)) {
+            break;
+        }
+    }
+
+    deadline = m_StartTime + (tick * m_MsPerTick);
+    if (deadline <= now) {
+        return(0);
+    }
+    if ((deadline - now) > 0x7FFFFFFF) {
+        return(0x7FFFFFFF);
+    }
+
+    return((int32) (deadline - now));
+} // GetMsUntilNextTimer.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [InsertTimer]
+//
+// The caller must hold the lock.
+/////////////////////////////////////////////////////////////////////////////
+void
+CTimerWheel::InsertTimer(CTimer *pTimer) {
+    uint64 delta;
+    int32 slot;
+
+    // A timer that is already due goes in the next slot to be processed.
+    if (pTimer->m_ExpireTick < m_NextTick) {
+        pTimer->m_ExpireTick = m_NextTick;
+    }
+
+    delta = pTimer->m_ExpireTick - m_NextTick;
+    if (delta > MAX_DELAY_IN_TICKS) {
+        pTimer->m_ExpireTick = m_NextTick + MAX_DELAY_IN_TICKS;
+        delta = MAX_DELAY_IN_TICKS;
+    }
+
+    if (delta < LEVEL0_SLOTS) {
+        slot = (int32) (pTimer->m_ExpireTick & LEVEL0_MASK);
+        m_Level0[slot].InsertTail(&(pTimer->m_WheelSlot));
+    } else if (delta < (1 << (LEVEL0_BITS + LEVELN_BITS))) {
+        slot = (int32) ((pTimer->m_ExpireTick >> LEVEL0_BITS) & LEVELN_MASK);
+        m_UpperLevels[0][slot].InsertTail(&(pTimer->m_WheelSlot));
+    } else if (delta < (1 << (LEVEL0_BITS + (2 * LEVELN_BITS)))) {
+        slot = (int32) ((pTimer->m_ExpireTick >> (LEVEL0_BITS + LEVELN_BITS)) & LEVELN_MASK);
+        m_UpperLevels[1][slot].InsertTail(&(pTimer->m_WheelSlot));
+    } else {
+        slot = (int32) ((pTimer->m_ExpireTick >> (LEVEL0_BITS + (2 * LEVELN_BITS))) & LEVELN_MASK);
+        m_UpperLevels[2][slot].InsertTail(&(pTimer->m_WheelSlot));
+    }
+} // InsertTimer.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [Cascade]
+//
+// This moves every timer in one slot of a higher level down to a lower
+// level. It returns the slot, so the caller knows whether the next level
+// up also wrapped around. The caller must hold the lock.
+/////////////////////////////////////////////////////////////////////////////
+int32
+CTimerWheel::Cascade(int32 level, int32 slot) {
+    CQueueList<CTimer> timerList;
+    CTimer *pTimer;
+
+    // Move the timers to a private list first, since InsertTimer
+    // may put some of them back in the same slot.
+    while (true) {
+        pTimer = m_UpperLevels[level][slot].RemoveHead();
+        if (NULL == pTimer) {
+            break;
+        }
+        timerList.InsertTail(&(pTimer->m_WheelSlot));
+    }
+
+    while (true) {
+        pTimer = timerList.RemoveHead();
+        if (NULL == pTimer) {
+            break;
+        }
+        InsertTimer(pTimer);
+    }
+
+    return(slot);
+} // Cascade.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [GetTickForTime]
+//
+/////////////////////////////////////////////////////////////////////////////
+uint64
+CTimerWheel::GetTickForTime(uint64 now) {
+    if (now <= m_StartTime) {
+        return(0);
+    }
+
+    return((now - m_StartTime) / m_MsPerTick);
+} // GetTickForTime.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [CheckState]
+//
+/////////////////////////////////////////////////////////////////////////////
+ErrVal
+CTimerWheel::CheckState() {
+    ErrVal err = ENoErr;
+    int32 level;
+    int32 slot;
+    int32 numTimers = 0;
+    CTimer *pTimer;
+    AutoLock(m_pLock);
+
+    for (slot = 0; slot < LEVEL0_SLOTS; slot++) {
+        pTimer = m_Level0[slot].GetHead();
+        while (pTimer) {
+            if ((this != pTimer->m_pWheel)
+                || ((int32) (pTimer->m_ExpireTick & LEVEL0_MASK) != slot)) {
+                gotoErr(EFail);
+            }
+            numTimers++;
+            pTimer = pTimer->m_WheelSlot.GetNextInQueue();
+        }
+    }
+
+    for (level = 0; level < NUM_UPPER_LEVELS; level++) {
+        for (slot = 0; slot < LEVELN_SLOTS; slot++) {
+            pTimer = m_UpperLevels[level][slot].GetHead();
+            while (pTimer) {
+                if ((this != pTimer->m_pWheel)
+                    || (pTimer->m_ExpireTick < m_NextTick)) {
+                    gotoErr(EFail);
+                }
+                numTimers++;
+                pTimer = pTimer->m_WheelSlot.GetNextInQueue();
+            }
+        }
+    }
+
+    if (numTimers != m_NumTimers) {
+        gotoErr(EFail);
+    }
+
+abort:
+    returnErr(err);
+} // CheckState.
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//                       TESTING PROCEDURES
+//
+/////////////////////////////////////////////////////////////////////////////
+#if INCLUDE_REGRESSION_TESTS
+
+#define NUM_TEST_TIMERS         2000
+#define TEST_MS_PER_TICK        10
+#define TEST_STEP_IN_MS         25
+#define TEST_MAX_DELAY_IN_MS    (3 * 60 * 60 * 1000)
+
+class CTestTimerCallback : public CTimerCallback,
+                           public CRefCountImpl {
+public:
+    CTestTimerCallback() { m_Now = 0; }
+    NEWEX_IMPL()
+
+    // CTimerCallback
+    virtual void OnTimer(CTimer *pTimer);
+
+    // CRefCountInterface
+    PASS_REFCOUNT_TO_REFCOUNTIMPL()
+
+    uint64  m_Now;
+}; // CTestTimerCallback
+
+class CTestTimer {
+public:
+    NEWEX_IMPL()
+
+    CTimer      m_Timer;
+    uint64      m_Deadline;
+    bool        m_fCancelled;
+    int32       m_NumFires;
+    uint64      m_FireTime;
+}; // CTestTimer
+
+static CTestTimer g_TestTimers[NUM_TEST_TIMERS];
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [OnTimer]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CTestTimerCallback::OnTimer(CTimer *pTimer) {
+    CTestTimer *pTestTimer = (CTestTimer *) (pTimer->m_pContext);
+
+    pTestTimer->m_NumFires += 1;
+    pTestTimer->m_FireTime = m_Now;
+} // OnTimer.
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// [TestTimerWheel]
+//
+/////////////////////////////////////////////////////////////////////////////
+void
+CTimerWheel::TestTimerWheel() {
+    ErrVal err = ENoErr;
+    CTimerWheel *pWheel = NULL;
+    CTestTimerCallback *pCallback = NULL;
+    CTestTimer *pTestTimer;
+    int32 timerNum;
+    int32 delayInMs;
+    uint64 startTime;
+    uint64 now;
+
+    g_DebugManager.StartModuleTest("Timer Wheel");
+
+    // Make the tests repeatable.
+    OSIndependantLayer::SetRandSeed(256);
+
+    pWheel = newex CTimerWheel;
+    pCallback = newex CTestTimerCallback;
+    if ((NULL == pWheel) || (NULL == pCallback)) {
+        DEBUG_WARNING("Cannot allocate a test timer wheel.");
+        gotoErr(EFail);
+    }
+
+    err = pWheel->Initialize(TEST_MS_PER_TICK);
+    if (err) {
+        DEBUG_WARNING("Cannot initialize a test timer wheel.");
+        gotoErr(err);
+    }
+
+
+    g_DebugManager.StartTest("Arm timers");
+    // Spread the delays over every level of the wheel.
+    startTime = GetTimeSinceBootInMs();
+    for (timerNum = 0; timerNum < NUM_TEST_TIMERS; timerNum++) {
+        pTestTimer = &(g_TestTimers[timerNum]);
+        switch (timerNum % 4) {
+        case 0:
+            delayInMs = OSIndependantLayer::GetRandomNum() % 2000;
+            break;
+        case 1:
+            delayInMs = OSIndependantLayer::GetRandomNum() % (3 * 60 * 1000);
+            break;
+        case 2:
+            delayInMs = OSIndependantLayer::GetRandomNum() % (60 * 60 * 1000);
+            break;
+        default:
+            delayInMs = OSIndependantLayer::GetRandomNum() % TEST_MAX_DELAY_IN_MS;
+            break;
+        }
+
+        pTestTimer->m_Timer.m_pCallback = pCallback;
+        pTestTimer->m_Timer.m_pContext = pTestTimer;
+        pTestTimer->m_fCancelled = false;
+        pTestTimer->m_NumFires = 0;
+        pTestTimer->m_FireTime = 0;
+        pTestTimer->m_Deadline = GetTimeSinceBootInMs() + delayInMs;
+
+        err = pWheel->AddTimer(&(pTestTimer->m_Timer), delayInMs);
+        if (err) {
+            DEBUG_WARNING("AddTimer failed.");
+        }
+    }
+    if (NUM_TEST_TIMERS != pWheel->GetNumTimers()) {
+        DEBUG_WARNING("Wrong number of armed timers.");
+    }
+    err = pWheel->CheckState();
+    if (err) {
+        DEBUG_WARNING("Timer wheel is inconsistent after arming timers.");
+    }
+
+
+    g_DebugManager.StartTest("Cancel timers");
+    for (timerNum = 0; timerNum < NUM_TEST_TIMERS; timerNum += 3) {
+        pTestTimer = &(g_TestTimers[timerNum]);
+        CTimerWheel::CancelTimer(&(pTestTimer->m_Timer));
+        pTestTimer->m_fCancelled = true;
+        if (pTestTimer->m_Timer.IsArmed()) {
+            DEBUG_WARNING("A cancelled timer is still armed.");
+        }
+    }
+    err = pWheel->CheckState();
+    if (err) {
+        DEBUG_WARNING("Timer wheel is inconsistent after cancelling timers.");
+    }
+
+
+    g_DebugManager.StartTest("Fire timers");
+    // The wheel does not care whether time is real, so just pretend
+    // time is passing.
+    for (now = startTime; now <= startTime + TEST_MAX_DELAY_IN_MS + 1000; now += TEST_STEP_IN_MS) {
+        pCallback->m_Now = now;
+        (void) pWheel->FireExpiredTimers(now);
+        if (pWheel->GetMsUntilNextTimer(now) > ((LEVEL0_SLOTS + 1) * TEST_MS_PER_TICK)) {
+            DEBUG_WARNING("GetMsUntilNextTimer is too far in the future.");
+        }
+    }
+    if (0 != pWheel->GetNumTimers()) {
+        DEBUG_WARNING("Some timers never fired.");
+    }
+    err = pWheel->CheckState();
+    if (err) {
+        DEBUG_WARNING("Timer wheel is inconsistent after firing timers.");
+    }
+
+    for (timerNum = 0; timerNum < NUM_TEST_TIMERS; timerNum++) {
+        pTestTimer = &(g_TestTimers[timerNum]);
+        if (pTestTimer->m_fCancelled) {
+            if (0 != pTestTimer->m_NumFires) {
+                DEBUG_WARNING("A cancelled timer fired.");
+            }
+            continue;
+        }
+
+        if (1 != pTestTimer->m_NumFires) {
+            DEBUG_WARNING("Timer %d fired %d times.", timerNum, pTestTimer->m_NumFires);
+        } else if (pTestTimer->m_FireTime < pTestTimer->m_Deadline) {
+            DEBUG_WARNING("Timer %d fired early.", timerNum);
+        } else if (pTestTimer->m_FireTime
+                    > (pTestTimer->m_Deadline + (2 * TEST_MS_PER_TICK) + TEST_STEP_IN_MS)) {
+            DEBUG_WARNING("Timer %d fired late.", timerNum);
+        }
+    }
+
+abort:
+    delete pWheel;
+    RELEASE_OBJECT(pCallback);
+} // TestTimerWheel.
+
+
+#endif // INCLUDE_REGRESSION_TESTS
+
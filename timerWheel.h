@@ -0,0 +1,153 @@
+/////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2005-2017 Dawson Dean
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+/////////////////////////////////////////////////////////////////////////////
+// See the corresponding .cpp file for a description of this module.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+class CTimer;
+class CTimerWheel;
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Clients of a timer wheel implement this callback interface.
+//
+// The callback is AddRef'ed while a timer is firing, so the client may
+// cancel the timer and release its last reference at any time. OnTimer
+// is called with no locks held, and it may re-arm the same timer.
+/////////////////////////////////////////////////////////////////////////////
+class CTimerCallback : public CRefCountInterface {
+public:
+    virtual void OnTimer(CTimer *pTimer) = 0;
+}; // CTimerCallback
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is a single timer. Clients usually embed one in a larger object,
+// so arming and cancelling a timer never allocates memory.
+/////////////////////////////////////////////////////////////////////////////
+class CTimer {
+public:
+    CTimer();
+    NEWEX_IMPL()
+
+    bool IsArmed() { return(NULL != m_pWheel); }
+
+    CTimerCallback          *m_pCallback;
+    void                    *m_pContext;
+
+private:
+    friend class CTimerWheel;
+
+    // This is the wheel tick when the timer fires. It is only
+    // valid while the timer is on a wheel.
+    uint64                  m_ExpireTick;
+
+    CTimerWheel             *m_pWheel;
+    CQueueHook<CTimer>      m_WheelSlot;
+}; // CTimer
+
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This is a hierarchical timer wheel.
+/////////////////////////////////////////////////////////////////////////////
+class CTimerWheel : public CDebugObject {
+public:
+#if INCLUDE_REGRESSION_TESTS
+    static void TestTimerWheel();
+#endif
+
+    CTimerWheel();
+    virtual ~CTimerWheel();
+    NEWEX_IMPL()
+
+    ErrVal Initialize(int32 msPerTick);
+
+    ErrVal AddTimer(CTimer *pTimer, int32 delayInMs);
+    static void CancelTimer(CTimer *pTimer);
+
+    // This fires every timer that has expired by the time "now".
+    // It returns the number of timers that fired.
+    int32 FireExpiredTimers(uint64 now);
+
+    // This returns how long the owner may sleep before it must call
+    // FireExpiredTimers again, or -1 if no timers are armed.
+    int32 GetMsUntilNextTimer(uint64 now);
+
+    int32 GetNumTimers() { return(m_NumTimers); }
+
+    // CDebugObject
+    virtual ErrVal CheckState();
+
+private:
+    enum CTimerWheelConstants {
+        // The first level has one slot per tick. Each higher level
+        // has one slot per complete rotation of the level below it.
+        LEVEL0_BITS                 = 8,
+        LEVEL0_SLOTS                = (1 << LEVEL0_BITS),
+        LEVEL0_MASK                 = (LEVEL0_SLOTS - 1),
+
+        LEVELN_BITS                 = 6,
+        LEVELN_SLOTS                = (1 << LEVELN_BITS),
+        LEVELN_MASK                 = (LEVELN_SLOTS - 1),
+
+        NUM_UPPER_LEVELS            = 3,
+        MAX_DELAY_IN_TICKS          = (1 << (LEVEL0_BITS + (NUM_UPPER_LEVELS * LEVELN_BITS))) - 1,
+
+        // Callbacks are called outside the lock, so expired timers
+        // are collected in batches of this size.
+        MAX_TIMERS_PER_BATCH        = 64,
+    };
+
+    void InsertTimer(CTimer *pTimer);
+    int32 Cascade(int32 level, int32 slot);
+    uint64 GetTickForTime(uint64 now);
+
+    CRefLock                *m_pLock;
+
+    int32                   m_MsPerTick;
+    uint64                  m_StartTime;
+
+    // This is the next tick that has not been processed yet.
+    uint64                  m_NextTick;
+
+    int32                   m_NumTimers;
+
+    CQueueList<CTimer>      m_Level0[LEVEL0_SLOTS];
+    CQueueList<CTimer>      m_UpperLevels[NUM_UPPER_LEVELS][LEVELN_SLOTS];
+}; // CTimerWheel
+
+
+#endif // _TIMER_WHEEL_H_
+